@@ -371,7 +371,7 @@ static void StartShapeAndRoi(  // we have the facerect, now get the rest
     const Image&   img,        // in:  the image (grayscale)
     const vec_Mod& mods,       // in:  a vector of models, one for each yaw range
                                //       (use only estart, and meanshape)
-    StasmCascadeClassifier cascade)
+    StasmCascadeClassifier& cascade)
 {
     PossiblySetRotToZero(detpar.rot);         // treat small rots as zero rots
 
@@ -450,7 +450,7 @@ bool NextStartShapeAndRoi(     // use face detector results to estimate start sh
     const vec_Mod& mods,       // in:  a vector of models, one for each yaw range
                                //       (use only estart, and meanshape)
     FaceDet&       facedet,    // io:  the face detector (internal face index bumped)
-    StasmCascadeClassifier cascade)
+    StasmCascadeClassifier& cascade)
 {
     detpar = facedet.NextFace_();  // get next face's detpar from the face det
 
@@ -460,4 +460,19 @@ bool NextStartShapeAndRoi(     // use face detector results to estimate start sh
     return Valid(detpar.x);
 }
 
+// Like NextStartShapeAndRoi, but for a face rectangle the caller already
+// detected, so the face detector isn't run a second time.
+
+void RectStartShapeAndRoi(     // use a face rect found by the caller to estimate start shape
+    Shape&         startshape, // out: the start shape
+    Image&         face_roi,   // out: ROI around face, possibly rotated upright
+    DetPar&        detpar_roi, // out: detpar wrt to face_roi
+    DetPar&        detpar,     // io:  detpar wrt to img (has face rect on entry)
+    const Image&   img,        // in:  the image (grayscale)
+    const vec_Mod& mods,       // in:  a vector of models, one for each yaw range
+    StasmCascadeClassifier& cascade)
+{
+    StartShapeAndRoi(startshape, face_roi, detpar_roi, detpar, img, mods, cascade);
+}
+
 } // namespace stasm
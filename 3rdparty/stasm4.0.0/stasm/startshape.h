@@ -19,7 +19,16 @@ bool NextStartShapeAndRoi(     // use face detector results to estimate start sh
     const Image&   img,        // in: the image (grayscale)
     const vec_Mod& mods,       // in: a vector of models, one for each yaw range
     FaceDet&       facedet,   // io:  the face detector (internal face index bumped)
-    StasmCascadeClassifier cascade);
+    StasmCascadeClassifier& cascade);
+
+void RectStartShapeAndRoi(     // use a face rect found by the caller to estimate start shape
+    Shape&         startshape, // out: the start shape we are looking for
+    Image&         face_roi,   // out: ROI around face, possibly rotated upright
+    DetPar&        detpar_roi, // out: detpar wrt to face_roi
+    DetPar&        detpar,     // io:  detpar wrt to img (has face rect on entry)
+    const Image&   img,        // in: the image (grayscale)
+    const vec_Mod& mods,       // in: a vector of models, one for each yaw range
+    StasmCascadeClassifier& cascade);
 
 void PinnedStartShapeAndRoi(   // use the pinned landmarks to init the start shape
     Shape&         startshape, // out: the start shape (in ROI frame)
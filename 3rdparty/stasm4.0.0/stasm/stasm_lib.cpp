@@ -161,7 +161,7 @@ int stasm_search_auto_ext( // extended version of stasm_search_auto
     const char* data,
     const int width,
     const int height,
-    StasmCascadeClassifier cascade)
+    StasmCascadeClassifier& cascade)
 {
     int returnval = 1;     // assume success
     *foundface = 0;        // but assume no face found
@@ -220,7 +220,7 @@ int stasm_search_auto(// call repeatedly to find all faces
     const char *data,
     const int width,
     const int height,
-    StasmCascadeClassifier cascade)
+    StasmCascadeClassifier& cascade)
 {
     return stasm_search_auto_ext(foundface, landmarks, NULL, data, width, height, cascade);
 }
@@ -231,7 +231,7 @@ int stasm_search_single(   // wrapper for stasm_search_auto and friends
     const char* img,       // in: gray image data, top left corner at 0,0
     int         width,     // in: image width
     int         height,    // in: image height
-    StasmCascadeClassifier cascade,
+    StasmCascadeClassifier& cascade,
     const char* imgpath,   // in: image path, used only for err msgs and debug
     const char* datadir)   // in: directory of face detector files
 {
@@ -241,6 +241,70 @@ int stasm_search_single(   // wrapper for stasm_search_auto and friends
     return stasm_search_auto(foundface, landmarks, img, width, height, cascade);
 }
 
+int stasm_search_rects(      // find landmarks in faces detected by the caller
+    int          nfaces,     // in: number of face rects
+    const int*   rects,      // in: x, y, width, height of each face rect
+    int*         foundfaces, // out: for each face, 0=search failed, 1=found landmarks
+    float*       landmarks,  // out: stasm_NLANDMARKS x, y pairs per face, caller must allocate
+    const char*  data,       // in: gray image data, top left corner at 0,0
+    int          width,      // in: image width
+    int          height,     // in: image height
+    StasmCascadeClassifier& cascade)
+{
+    int returnval = 1;     // assume success
+    try
+    {
+        CheckStasmInit();
+
+        Image img = Image(height, width,(unsigned char*)data);
+
+        for (int iface = 0; iface < nfaces; iface++)
+        {
+            foundfaces[iface] = 0;
+            float* facelandmarks = landmarks + iface * 2 * stasm_NLANDMARKS;
+            try
+            {
+                // same detpar as DetectFaces would have made from this rect
+                const int* rect = rects + iface * 4;
+                DetPar detpar;
+                detpar.x = rect[0] + rect[2] / 2.;
+                detpar.y = rect[1] + rect[3] / 2.;
+                detpar.width  = double(rect[2]);
+                detpar.height = double(rect[3]);
+                detpar.yaw = 0;
+                detpar.eyaw = EYAW00;
+
+                Shape shape;       // the shape with landmarks
+                Image face_roi;    // cropped to area around startshape and possibly rotated
+                DetPar detpar_roi; // detpar translated to ROI frame
+
+                RectStartShapeAndRoi(shape, face_roi, detpar_roi, detpar,
+                                     img, mods_g, cascade);
+
+                const int imod = ABS(EyawAsModIndex(detpar.eyaw, mods_g));
+
+                shape = mods_g[imod]->ModSearch_(shape, face_roi);
+
+                shape = RoiShapeToImgFrame(shape, face_roi, detpar_roi, detpar);
+                RoundMat(shape);
+                ShapeToLandmarks(facelandmarks, shape);
+                foundfaces[iface] = 1;
+            }
+            catch(...)
+            {
+                // a failed face doesn't stop the search of the others
+                for (int i = 0; i < 2 * stasm_NLANDMARKS; i++)
+                    facelandmarks[i] = 0;
+            }
+        }
+    }
+    catch(...)
+    {
+        returnval = 0; // a call was made to Err or a CV_Assert failed
+    }
+    return returnval;
+}
+
 int stasm_search_pinned(    // call after the user has pinned some points
     float*       landmarks, // out: x0, y0, x1, y1, ..., caller must allocate
     const float* pinned,    // in: pinned landmarks (0,0 points not pinned)
@@ -89,7 +89,7 @@ int stasm_search_auto(       // call repeatedly to find all faces
     const char*  data,
     const int    width,
     const int    height,
-    StasmCascadeClassifier cascade);
+    StasmCascadeClassifier& cascade);
 
 extern "C"
 int stasm_search_single(     // wrapper for stasm_search_auto and friends
@@ -98,10 +98,21 @@ int stasm_search_single(     // wrapper for stasm_search_auto and friends
     const char*  img,        // in: gray image data, top left corner at 0,0
     int          width,      // in: image width
     int          height,     // in: image height
-    StasmCascadeClassifier cascade,
+    StasmCascadeClassifier& cascade,
     const char*  imgpath,    // in: image path, used only for err msgs and debug
     const char*  datadir);   // in: directory of face detector files
 
+extern "C"                   // find landmarks in faces detected by the caller
+int stasm_search_rects(      // all faces of one image in one call
+    int          nfaces,     // in: number of face rects
+    const int*   rects,      // in: x, y, width, height of each face rect
+    int*         foundfaces, // out: for each face, 0=search failed, 1=found landmarks
+    float*       landmarks,  // out: stasm_NLANDMARKS x, y pairs per face, caller must allocate
+    const char*  img,        // in: gray image data, top left corner at 0,0
+    int          width,      // in: image width
+    int          height,     // in: image height
+    StasmCascadeClassifier& cascade); // in: eye and mouth detectors, face detector unused
+
 extern "C"                   // find landmarks, no OpenCV face detect
 int stasm_search_pinned(     // call after the user has pinned some points
     float*       landmarks,  // out: x0, y0, x1, y1, ..., caller must allocate
@@ -0,0 +1,282 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*!
+ * \ingroup cli
+ * \page cli_benchmark Distance Benchmark
+ * \brief Microbenchmarks of the distance kernels and output sinks.
+ *
+ * Every kernel compares a gallery of synthetic templates against a set of queries through
+ * br::Distance::compare() into a br::MatrixOutput, for each dimensionality and gallery size.
+ * Then synthetic score matrices of each gallery size are written through the \c Matrix, \c rank, \c topk and \c null outputs,
+ * and a synthetic self-similarity matrix of \c -evalTemplates templates is evaluated by br_eval().
+ * The data is drawn from a fixed seed, and the best of \c -repeat runs is reported after one warmup run,
+ * so results are comparable across builds and machines.
+ * \code
+ * $ br_bench -dimensions 128,256,512 -galleries 1000,10000,100000 -queries 16 -repeat 5
+ * $ br_bench -kernels ByteL1,Hamming -galleries 100000
+ * $ br_bench -benchmarks eval -evalTemplates 5000
+ * \endcode
+ * Templates feeding more than \c -memory megabytes are skipped.
+ */
+
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QTemporaryDir>
+#include <opencv2/core/core.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openbr/openbr.h>
+#include <openbr/openbr_plugin.h>
+
+using namespace br;
+using namespace cv;
+
+struct Options
+{
+    QList<int> dimensions, galleries;
+    QStringList benchmarks, kernels, outputs;
+    int queries, repeat, memory, evalTemplates;
+    quint64 seed;
+
+    Options()
+        : queries(16), repeat(5), memory(1024), evalTemplates(2000), seed(0)
+    {
+        benchmarks << "kernel" << "output" << "eval";
+        dimensions << 128 << 256 << 512;
+        galleries << 1000 << 10000 << 100000;
+        kernels << "L1" << "L2" << "ByteL1" << "HalfByteL1" << "Hamming" << "ProductQuantization";
+        outputs << "Matrix" << "rank" << "topk" << "null";
+    }
+};
+
+static QList<int> toInts(const QString &string)
+{
+    QList<int> ints;
+    foreach (const QString &word, string.split(',', QString::SkipEmptyParts))
+        ints.append(word.toInt());
+    return ints;
+}
+
+// The gallery's feature vectors for one kernel, as the distance expects them
+static Mat features(const QString &kernel, int rows, int dimensions, RNG &rng)
+{
+    Mat m;
+    if ((kernel == "L1") || (kernel == "L2") || (kernel == "ProductQuantization")) {
+        m = Mat(rows, dimensions, CV_32FC1);
+        rng.fill(m, RNG::NORMAL, 0, 1);
+    } else {
+        // ByteL1 stores one dimension per byte, HalfByteL1 two and Hamming eight
+        const int bytes = (kernel == "ByteL1") ? dimensions : (kernel == "HalfByteL1") ? dimensions/2 : dimensions/8;
+        m = Mat(rows, bytes, CV_8UC1);
+        rng.fill(m, RNG::UNIFORM, 0, 256);
+    }
+    return m;
+}
+
+static TemplateList templates(const Mat &m, const QString &prefix)
+{
+    TemplateList templateList;
+    templateList.reserve(m.rows);
+    for (int i=0; i<m.rows; i++) {
+        Template t(File(prefix + QString::number(i)), m.row(i).clone());
+        t.file.set("Label", i % 64);
+        templateList.append(t);
+    }
+    return templateList;
+}
+
+// Best wall time in seconds of repeat runs after one warmup run
+static double timeCompare(const Distance &distance, const TemplateList &targets, const TemplateList &queries, int repeat)
+{
+    double best = -1;
+    for (int i=0; i<=repeat; i++) {
+        QScopedPointer<MatrixOutput> output(MatrixOutput::make(targets.files(), queries.files()));
+        QElapsedTimer timer; timer.start();
+        distance.compare(targets, queries, output.data());
+        const double seconds = timer.nsecsElapsed() / 1e9;
+        if ((i > 0) && ((best < 0) || (seconds < best))) best = seconds;
+    }
+    return best;
+}
+
+static void report(const QString &benchmark, const QString &name, int dimensions, int gallery, int queries, qint64 bytes, double seconds)
+{
+    const double comparisons = double(gallery) * queries;
+    printf("%-8s %-20s %10d %10d %8d %12.4f %16.0f %10.2f\n", qPrintable(benchmark), qPrintable(name), dimensions, gallery, queries,
+           seconds * 1e3, comparisons / seconds, bytes / seconds / 1e9);
+    fflush(stdout);
+}
+
+static void benchmarkKernel(const Options &options, const QString &kernel, int dimensions)
+{
+    RNG rng(options.seed);
+    QSharedPointer<Transform> transform;
+    if (kernel == "ProductQuantization") {
+        // Train the subspace codebooks once per dimensionality on data separate from the galleries
+        transform = QSharedPointer<Transform>(Transform::make("ProductQuantization(2)", NULL));
+        transform->train(templates(features(kernel, 4096, dimensions, rng), "train"));
+    }
+
+    QSharedPointer<Distance> distance(Distance::make(kernel, NULL));
+    TemplateList queries = templates(features(kernel, options.queries, dimensions, rng), "query");
+    if (transform) queries >> *transform;
+
+    foreach (int gallery, options.galleries) {
+        const Mat data = features(kernel, gallery, dimensions, rng);
+        if (qint64(data.total() * data.elemSize()) > qint64(options.memory) * 1024 * 1024) {
+            printf("# Skipping %s with %d dimensions and %d templates, exceeds -memory %d.\n", qPrintable(kernel), dimensions, gallery, options.memory);
+            continue;
+        }
+
+        TemplateList targets = templates(data, "target");
+        if (transform) targets >> *transform;
+
+        // Each comparison streams one target template
+        const qint64 bytes = qint64(targets.first().m().total() * targets.first().m().elemSize()) * gallery * options.queries;
+        report("kernel", kernel, dimensions, gallery, options.queries, bytes, timeCompare(*distance, targets, queries, options.repeat));
+    }
+}
+
+static void benchmarkOutput(const Options &options, const QString &output, const QTemporaryDir &directory)
+{
+    RNG rng(options.seed);
+    FileList queryFiles;
+    for (int i=0; i<options.queries; i++)
+        queryFiles.append(File("query" + QString::number(i)));
+
+    foreach (int gallery, options.galleries) {
+        FileList targetFiles;
+        for (int i=0; i<gallery; i++)
+            targetFiles.append(File("target" + QString::number(i)));
+        Mat scores(options.queries, gallery, CV_32FC1);
+        rng.fill(scores, RNG::UNIFORM, 0, 1);
+
+        // Includes serialization by the output's destructor, which is part of the cost of a sink
+        double best = -1;
+        for (int r=0; r<=options.repeat; r++) {
+            const File file(directory.path() + "/bench." + output);
+            QElapsedTimer timer; timer.start();
+            {
+                QScopedPointer<Output> o(output == "Matrix" ? MatrixOutput::make(targetFiles, queryFiles) : Output::make(file, targetFiles, queryFiles));
+                for (int i=0; i<options.queries; i+=o->blockSize)
+                    for (int j=0; j<gallery; j+=o->blockSize) {
+                        o->setBlock(i/o->blockSize, j/o->blockSize);
+                        o->setRelativeTile(scores(Range(i, std::min(i+o->blockSize, options.queries)),
+                                                  Range(j, std::min(j+o->blockSize, gallery))), 0, 0);
+                    }
+            }
+            const double seconds = timer.nsecsElapsed() / 1e9;
+            if ((r > 0) && ((best < 0) || (seconds < best))) best = seconds;
+        }
+        report("output", output, 1, gallery, options.queries, qint64(sizeof(float)) * gallery * options.queries, best);
+    }
+}
+
+static void benchmarkEval(const Options &options, const QTemporaryDir &directory)
+{
+    // Four templates per subject so every row has genuine and impostor scores
+    const int n = options.evalTemplates;
+    const QString gallery = directory.path() + "/eval.gal", simmat = directory.path() + "/eval.mtx", mask = directory.path() + "/eval.mask";
+    TemplateList templates;
+    for (int i=0; i<n; i++) {
+        Template t(File("template" + QString::number(i)));
+        t.file.set("Label", i / 4);
+        templates.append(t);
+    }
+    {
+        QScopedPointer<Gallery> g(Gallery::make(gallery));
+        g->writeBlock(templates);
+    }
+    br_make_mask(qPrintable(gallery), qPrintable(gallery), qPrintable(mask));
+
+    // Genuine scores are drawn from a shifted distribution so the evaluation has a realistic curve
+    RNG rng(options.seed);
+    Mat scores(n, n, CV_32FC1);
+    rng.fill(scores, RNG::NORMAL, 0, 1);
+    for (int i=0; i<n; i++)
+        for (int j=(i/4)*4; j<std::min(n, (i/4)*4+4); j++)
+            scores.at<float>(i, j) += 2;
+    {
+        QScopedPointer<Output> o(Output::make(simmat, templates.files(), templates.files()));
+        for (int i=0; i<n; i+=o->blockSize)
+            for (int j=0; j<n; j+=o->blockSize) {
+                o->setBlock(i/o->blockSize, j/o->blockSize);
+                o->setRelativeTile(scores(Range(i, std::min(i+o->blockSize, n)), Range(j, std::min(j+o->blockSize, n))), 0, 0);
+            }
+    }
+
+    double best = -1;
+    for (int r=0; r<=options.repeat; r++) {
+        QElapsedTimer timer; timer.start();
+        br_eval(qPrintable(simmat), qPrintable(mask));
+        const double seconds = timer.nsecsElapsed() / 1e9;
+        if ((r > 0) && ((best < 0) || (seconds < best))) best = seconds;
+    }
+    // Each comparison reads a score and a mask value
+    report("eval", "br_eval", 1, n, n, qint64(n) * n * (sizeof(float) + sizeof(uchar)), best);
+}
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    for (int i=1; i<argc; i++) {
+        const bool hasValue = (i+1 < argc);
+        if      (!strcmp(argv[i], "-benchmarks") && hasValue) options.benchmarks = QString(argv[++i]).split(',', QString::SkipEmptyParts);
+        else if (!strcmp(argv[i], "-dimensions") && hasValue) options.dimensions = toInts(argv[++i]);
+        else if (!strcmp(argv[i], "-galleries") && hasValue)  options.galleries = toInts(argv[++i]);
+        else if (!strcmp(argv[i], "-kernels") && hasValue)    options.kernels = QString(argv[++i]).split(',', QString::SkipEmptyParts);
+        else if (!strcmp(argv[i], "-outputs") && hasValue)    options.outputs = QString(argv[++i]).split(',', QString::SkipEmptyParts);
+        else if (!strcmp(argv[i], "-queries") && hasValue)    options.queries = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-repeat") && hasValue)     options.repeat = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-memory") && hasValue)     options.memory = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-seed") && hasValue)       options.seed = QString(argv[++i]).toULongLong();
+        else if (!strcmp(argv[i], "-evalTemplates") && hasValue) options.evalTemplates = atoi(argv[++i]);
+        else {
+            printf("Usage: br_bench [-benchmarks (kernel|output|eval),...] [-dimensions <int,...>] [-galleries <int,...>] [-queries <int>]\n"
+                   "                [-repeat <int>] [-kernels <distance,...>] [-outputs <output,...>] [-evalTemplates <int>] [-memory <MB>] [-seed <int>]\n");
+            return strcmp(argv[i], "-help") ? EXIT_FAILURE : EXIT_SUCCESS;
+        }
+    }
+    if ((options.queries < 1) || (options.repeat < 1))
+        qFatal("Expected at least one query and one repeat.");
+
+    int contextArgc = 1;
+    Context::initialize(contextArgc, argv, "", false);
+
+    printf("%-8s %-20s %10s %10s %8s %12s %16s %10s\n", "#", "name", "dimensions", "gallery", "queries", "ms", "comparisons/s", "GB/s");
+    if (options.benchmarks.contains("kernel"))
+        foreach (const QString &kernel, options.kernels)
+            foreach (int dimensions, options.dimensions)
+                benchmarkKernel(options, kernel, dimensions);
+
+    QTemporaryDir directory;
+    if (options.benchmarks.contains("output"))
+        foreach (const QString &output, options.outputs)
+            benchmarkOutput(options, output, directory);
+
+    if (options.benchmarks.contains("eval") && (options.evalTemplates >= 8)) {
+        // Evaluation prints its own summary, which would interleave with the table
+        const bool quiet = Globals->quiet;
+        Globals->quiet = true;
+        benchmarkEval(options, directory);
+        Globals->quiet = quiet;
+    }
+
+    Context::finalize();
+    return EXIT_SUCCESS;
+}
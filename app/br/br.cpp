@@ -107,6 +107,9 @@ public:
                 } else {
                     br_eval(parv[0], parv[1], parv[2]);
                 }
+            } else if (!strcmp(fun, "benchmark")) {
+                check((parc >= 1) && (parc <= 2), "Incorrect parameter count for 'benchmark'.");
+                br_benchmark(parv[0], parc == 2 ? parv[1] : "");
             } else if (!strcmp(fun, "plot")) {
                 check(parc >= 2, "Incorrect parameter count for 'plot'.");
                 br_plot(parc-1, parv, parv[parc-1], true);
@@ -119,6 +122,9 @@ public:
             } else if (!strcmp(fun, "cluster")) {
                 check(parc >= 3, "Insufficient parameter count for 'cluster'.");
                 br_cluster(parc-2, parv, atof(parv[parc-2]), parv[parc-1]);
+            } else if (!strcmp(fun, "deduplicate")) {
+                check(parc == 3, "Incorrect parameter count for 'deduplicate'.");
+                br_deduplicate(parv[0], atof(parv[1]), parv[2]);
             } else if (!strcmp(fun, "makeMask")) {
                 check(parc == 3, "Incorrect parameter count for 'makeMask'.");
                 br_make_mask(parv[0], parv[1], parv[2]);
@@ -223,10 +229,12 @@ private:
                "-compare <target_gallery> <query_gallery> [{output}]\n"
                "-eval <simmat> [<mask>] [{csv}]\n"
                "-plot <file> ... <file> {destination}\n"
+               "-benchmark <input_gallery> [{json}]\n"
                "\n"
                "==== Other Commands ====\n"
                "-fuse <simmat> ... <simmat> (None|MinMax|ZScore|WScore) (Min|Max|Sum[W1:W2:...:Wn]|Replace|Difference|None) {simmat}\n"
                "-cluster <simmat> ... <simmat> <aggressiveness> {csv}\n"
+               "-deduplicate <gallery> <threshold> {csv}\n"
                "-makeMask <target_gallery> <query_gallery> {mask}\n"
                "-combineMasks <mask> ... <mask> {mask} (And|Or)\n"
                "-cat <gallery> ... <gallery> {gallery}\n"
@@ -0,0 +1,68 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Checks that score normalizing distances leave the -FLT_MAX of empty and excluded pairs as it is
+#include <limits>
+#include <openbr/openbr_plugin.h>
+
+static int failures = 0;
+
+static void check(const char *comparison, float score, float expected)
+{
+    if ((score == expected) || (fabs(score - expected) <= 1e-5f * fabs(expected))) return;
+    printf("%s scored %g, expected %g\n", comparison, score, expected);
+    failures++;
+}
+
+static br::Template makeTemplate(const QString &name, const QString &subject, bool empty)
+{
+    br::Template t(name);
+    t.file.set("Subject", subject);
+    if (!empty) t.append(cv::Mat(1, 3, CV_32FC1, cv::Scalar(name == "query" ? 1 : 2)));
+    return t;
+}
+
+int main(int argc, char *argv[])
+{
+    br::Context::initialize(argc, argv);
+
+    // Unit's a*(score-b) is finite for every input, so only a pass through keeps the missing scores missing
+    QSharedPointer<br::Distance> distance(br::Distance::make("Unit(distance=Pipe(distances=[Metadata(filters=[Subject]),Dist(metric=L2,negLogPlusOne=false)]),a=2,b=1)", NULL));
+
+    br::TemplateList targets;
+    targets.append(makeTemplate("match", "A", false));
+    targets.append(makeTemplate("excluded", "B", false));
+    targets.append(makeTemplate("empty", "A", true));
+    br::TemplateList queries;
+    queries.append(makeTemplate("query", "A", false));
+
+    const float missing = -std::numeric_limits<float>::max();
+    const float match = 2 * (sqrt(3.f) - 1);
+
+    QScopedPointer<br::MatrixOutput> output(br::MatrixOutput::make(targets.files(), queries.files()));
+    distance->compare(targets, queries, output.data());
+    check("Block match", output->data.at<float>(0, 0), match);
+    check("Block excluded pair", output->data.at<float>(0, 1), missing);
+    check("Block empty template", output->data.at<float>(0, 2), missing);
+
+    const QList<float> scores = distance->compare(targets, queries.first());
+    check("1:N match", scores[0], match);
+    check("1:N excluded pair", scores[1], missing);
+    check("1:N empty template", scores[2], missing);
+
+    br::Context::finalize();
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,64 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Checks that a pipe built by br::Transform::make fuses its untrainable stages and projects as the stages do one at a time
+#include <openbr/openbr_plugin.h>
+
+int main(int argc, char *argv[])
+{
+    br::Context::initialize(argc, argv);
+    int failures = 0;
+
+    const QStringList stages = QStringList() << "Cvt(Gray)" << "Blur(2)" << "Resize(16,16)";
+    QScopedPointer<br::Transform> pipe(br::Transform::make(stages.join("+"), NULL));
+
+    // Each stage is wrapped in Independent, which must not keep them apart
+    int length = 0;
+    if (!QMetaObject::invokeMethod(pipe.data(), "fusedLength", Qt::DirectConnection, Q_RETURN_ARG(int, length), Q_ARG(int, 0))) {
+        printf("%s is not a pipe\n", qPrintable(stages.join("+")));
+        failures++;
+    } else if (length != stages.size()) {
+        printf("Fused %d of %d stages\n", length, stages.size());
+        failures++;
+    }
+
+    br::TemplateList fused;
+    for (int i=0; i<4; i++) {
+        cv::Mat image(32, 32, CV_8UC3);
+        cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(255));
+        fused.append(br::Template(QString("image%1").arg(i), image));
+    }
+    br::TemplateList expected = fused;
+    fused >> *pipe;
+    foreach (const QString &stage, stages) {
+        QScopedPointer<br::Transform> transform(br::Transform::make(stage, NULL));
+        expected >> *transform;
+    }
+
+    if (fused.size() != expected.size()) {
+        printf("Fused projection made %d templates, expected %d\n", fused.size(), expected.size());
+        failures++;
+    } else {
+        for (int i=0; i<fused.size(); i++)
+            if ((fused[i].m().size() != expected[i].m().size()) || (cv::norm(fused[i].m(), expected[i].m(), cv::NORM_INF) != 0)) {
+                printf("Fused projection of %s differs\n", qPrintable(fused[i].file.name));
+                failures++;
+            }
+    }
+
+    br::Context::finalize();
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
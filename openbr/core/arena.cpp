@@ -0,0 +1,94 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QHash>
+#include <QList>
+#include <QThreadStorage>
+
+#include "arena.h"
+
+using namespace cv;
+
+namespace
+{
+
+// Bounds what a thread keeps idle
+const int MaxBuffers = 64;
+const qint64 MaxBytes = qint64(64) * 1024 * 1024;
+
+struct Pool
+{
+    QHash<quint64, QList<Mat> > buffers;
+    int count;
+    qint64 bytes;
+
+    Pool() : count(0), bytes(0) {}
+
+    static quint64 key(int rows, int cols, int type)
+    {
+        return (quint64(rows) << 40) | (quint64(cols) << 16) | quint64(type);
+    }
+};
+
+QThreadStorage<Pool*> pools;
+
+Pool &pool()
+{
+    if (!pools.hasLocalData())
+        pools.setLocalData(new Pool());
+    return *pools.localData();
+}
+
+} // namespace
+
+Mat MatArena::get(int rows, int cols, int type)
+{
+    Pool &p = pool();
+    QHash<quint64, QList<Mat> >::iterator it = p.buffers.find(Pool::key(rows, cols, type));
+    if ((it == p.buffers.end()) || it->isEmpty())
+        return Mat(rows, cols, type);
+
+    Mat m = it->takeLast();
+    p.count--;
+    p.bytes -= m.total() * m.elemSize();
+    return m;
+}
+
+void MatArena::put(Mat &m)
+{
+    // Only whole buffers held by m alone can be handed out again
+    const bool recyclable = m.data && (m.dims == 2) && !m.isSubmatrix() && m.refcount && (*m.refcount == 1);
+    if (recyclable) {
+        Pool &p = pool();
+        const qint64 size = m.total() * m.elemSize();
+        if ((p.count < MaxBuffers) && (p.bytes + size <= MaxBytes)) {
+            p.buffers[Pool::key(m.rows, m.cols, m.type())].append(m);
+            p.count++;
+            p.bytes += size;
+        }
+    }
+    m.release();
+}
+
+void MatArena::put(br::TemplateList &templates)
+{
+    for (int i=0; i<templates.size(); i++) {
+        br::Template &t = templates[i];
+        for (int j=0; j<t.size(); j++)
+            put(t[j]);
+    }
+    templates.clear();
+}
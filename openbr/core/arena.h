@@ -0,0 +1,37 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef ARENA_ARENA_H
+#define ARENA_ARENA_H
+
+#include <opencv2/core/core.hpp>
+#include <openbr/openbr_plugin.h>
+
+/*!
+ * \brief Per-thread pool of matrix buffers keyed by size and type.
+ *
+ * Transforms whose output shape is known up front request it with get() instead of allocating,
+ * and stream frames give their matrices back with put() once the last stage is done with them,
+ * so repeated frame shapes stop reallocating.
+ */
+namespace MatArena
+{
+    cv::Mat get(int rows, int cols, int type); /*!< \brief A \em rows x \em cols matrix of \em type, recycled when possible. */
+    void put(cv::Mat &m); /*!< \brief Releases \em m, keeping its buffer if nothing else references it. */
+    void put(br::TemplateList &templates); /*!< \brief Releases every matrix in \em templates. */
+}
+
+#endif // ARENA_ARENA_H
@@ -19,9 +19,8 @@
 #include <QHash>
 #include <QMap>
 #include <QRegExp>
-#ifndef BR_EMBEDDED
-#include <QtXml>
-#endif // BR_EMBEDDED
+#include <QFutureSynchronizer>
+#include <QtConcurrentRun>
 #include <algorithm>
 #include <limits>
 #include <openbr/openbr_plugin.h>
@@ -34,74 +33,80 @@ using namespace cv;
 using namespace br;
 
 /**** BEE ****/
-FileList BEE::readSigset(const File &sigset, bool ignoreMetadata)
+BEE::SigsetReader::SigsetReader(const File &sigset, bool ignoreMetadata)
+    : file(sigset.resolved()), ignoreMetadata(ignoreMetadata), started(false), inSignature(false), finished(false)
 {
-    FileList fileList;
-
-#ifndef BR_EMBEDDED
-    QDomDocument doc(sigset.fileName());
-    QFile file(sigset.resolved());
-    bool success;
-    success = file.open(QIODevice::ReadOnly); if (!success) qFatal("Unable to open %s for reading.", qPrintable(sigset));
-    success = doc.setContent(&file);
+    bool success = file.open(QIODevice::ReadOnly); if (!success) qFatal("Unable to open %s for reading.", qPrintable(sigset));
+    xml.setDevice(&file);
+}
 
-    file.close();
+FileList BEE::SigsetReader::read(int n, bool *done)
+{
+    FileList fileList;
 
-    if (!success) {
-        qWarning("Unable to parse %s.", qPrintable(sigset));
-        return fileList;
+    if (!started) {
+        started = true;
+        if (!xml.readNextStartElement() || (xml.name() != "biometric-signature-set"))
+            finished = true;
     }
 
-    QDomElement docElem = doc.documentElement();
-    if (docElem.nodeName() != "biometric-signature-set")
-        return fileList;
-
-    QDomNode subject = docElem.firstChild();
-    while (!subject.isNull()) {
-        // Looping through subjects
-        QDomNode fileNode = subject.firstChild();
-        QDomElement d = subject.toElement();
-        QString name = d.attribute("name");
-        while (!fileNode.isNull()) {
-            // Looping through files
-            File file("", name);
-
-            QDomElement e = fileNode.toElement();
-            QDomNamedNodeMap attributes = e.attributes();
-            for (int i=0; i<attributes.length(); i++) {
-                const QString key = attributes.item(i).nodeName();
-                const QString value = attributes.item(i).nodeValue();
-                if      (key == "file-name") file.name = value;
-                else if (!ignoreMetadata)    file.set(key, value);
+    while (!finished && (fileList.size() < n)) {
+        if (!inSignature) {
+            // Looping through subjects
+            if (!xml.readNextStartElement()) {
+                finished = true;
+                break;
             }
+            name = xml.attributes().value("name").toString();
+            inSignature = true;
+        }
 
-            // add bounding boxes, if they exist (will be child elements of <presentation>)
-            if (fileNode.hasChildNodes()) {
-                QList<QRectF> rects;
-                QDomNodeList bboxes = fileNode.childNodes();
-                for (int i=0; i<bboxes.length(); i++) {
-                    QDomElement bbox = bboxes.at(i).toElement();
-                    qreal x = bbox.attribute("x").toDouble();
-                    qreal y = bbox.attribute("y").toDouble();
-                    qreal width = bbox.attribute("width").toDouble();
-                    qreal height = bbox.attribute("height").toDouble();
-                    rects += QRectF(x, y, width, height);
-                }
-                file.setRects(rects);
-            }
+        // Looping through files
+        if (!xml.readNextStartElement()) {
+            inSignature = false;
+            continue;
+        }
 
-            if (file.name.isEmpty()) qFatal("Missing file-name in %s.", qPrintable(sigset));
-            fileList.append(file);
+        File file("", name);
+        foreach (const QXmlStreamAttribute &attribute, xml.attributes()) {
+            const QString key = attribute.name().toString();
+            const QString value = attribute.value().toString();
+            if      (key == "file-name") file.name = value;
+            else if (!ignoreMetadata)    file.set(key, value);
+        }
 
-            fileNode = fileNode.nextSibling();
+        // add bounding boxes, if they exist (will be child elements of <presentation>)
+        QList<QRectF> rects;
+        while (xml.readNextStartElement()) {
+            const QXmlStreamAttributes bbox = xml.attributes();
+            qreal x = bbox.value("x").toString().toDouble();
+            qreal y = bbox.value("y").toString().toDouble();
+            qreal width = bbox.value("width").toString().toDouble();
+            qreal height = bbox.value("height").toString().toDouble();
+            rects += QRectF(x, y, width, height);
+            xml.skipCurrentElement();
         }
-        subject = subject.nextSibling();
+        if (!rects.isEmpty()) file.setRects(rects);
+
+        if (file.name.isEmpty()) qFatal("Missing file-name in %s.", qPrintable(this->file.fileName()));
+        fileList.append(file);
+    }
+
+    if (xml.hasError()) {
+        qWarning("Unable to parse %s: %s", qPrintable(this->file.fileName()), qPrintable(xml.errorString()));
+        finished = true;
     }
-#else // BR_EMBEDDED
-    (void) sigset;
-    (void) ignoreMetadata;
-#endif // BR_EMBEDDED
 
+    *done = finished;
+    return fileList;
+}
+
+FileList BEE::readSigset(const File &sigset, bool ignoreMetadata)
+{
+    FileList fileList;
+    SigsetReader reader(sigset, ignoreMetadata);
+    bool done = false;
+    while (!done) fileList.append(reader.read(std::numeric_limits<int>::max(), &done));
     return fileList;
 }
 
@@ -135,9 +140,40 @@ void BEE::writeSigset(const QString &sigset, const br::FileList &files, bool ign
     QtUtils::writeFile(sigset, lines);
 }
 
-Mat BEE::readMat(const br::File &matrix, QString *targetSigset, QString *querySigset)
+// Packed masks store 2 bits per cell, four cells per byte with the first in the low bits and rows padded to whole bytes
+static int packedStep(int cols)
+{
+    return (cols + 3) / 4;
+}
+
+static QByteArray packMask(const Mat &m)
+{
+    QByteArray packed((qint64)m.rows*packedStep(m.cols), 0);
+    for (int i=0; i<m.rows; i++) {
+        const BEE::Mask_t *row = m.ptr<BEE::Mask_t>(i);
+        uchar *dst = (uchar*)packed.data() + (qint64)i*packedStep(m.cols);
+        for (int j=0; j<m.cols; j++) {
+            const uchar code = (row[j] == BEE::Match) ? 2 : ((row[j] == BEE::NonMatch) ? 1 : 0);
+            dst[j/4] |= code << (2*(j%4));
+        }
+    }
+    return packed;
+}
+
+static void unpackMask(const uchar *packed, Mat &m)
+{
+    static const BEE::Mask_t values[4] = { BEE::DontCare, BEE::NonMatch, BEE::Match, BEE::DontCare };
+    for (int i=0; i<m.rows; i++) {
+        BEE::Mask_t *row = m.ptr<BEE::Mask_t>(i);
+        const uchar *src = packed + (qint64)i*packedStep(m.cols);
+        for (int j=0; j<m.cols; j++)
+            row[j] = values[(src[j/4] >> (2*(j%4))) & 3];
+    }
+}
+
+BEE::MappedMatrix::MappedMatrix(const br::File &matrix)
+    : file(matrix.name)
 {
-    QFile file(matrix);
     bool success = file.open(QFile::ReadOnly);
     if (!success) qFatal("Unable to open %s for reading.", qPrintable(matrix.name));
 
@@ -145,57 +181,58 @@ Mat BEE::readMat(const br::File &matrix, QString *targetSigset, QString *querySi
     QByteArray format = file.readLine();
     bool isDistance = (format[0] == 'D');
     if (format[1] != '2') qFatal("Invalid matrix header.");
-
+    negate = isDistance ^ matrix.get<bool>("negate", false);
 
     // Read sigsets
-    if (targetSigset != NULL) *targetSigset = file.readLine().simplified();
-    else                      file.readLine();
-    if (querySigset != NULL) *querySigset = file.readLine().simplified();
-    else                     file.readLine();
+    targetSigset = file.readLine().simplified();
+    querySigset = file.readLine().simplified();
 
     // Get matrix size
     QStringList words = QString(file.readLine()).split(" ");
     int rows = words[1].toInt();
     int cols = words[2].toInt();
 
-    bool isMask = words[0][1] == 'B';
-    int typeSize = isMask ? sizeof(BEE::Mask_t) : sizeof(BEE::Simmat_t);
-
-    // Get matrix data
-    qint64 bytesExpected = (qint64)rows*(qint64)cols*(qint64)typeSize;
-    Mat m;
-    if (isMask)
-        m.create(rows, cols, OpenCVType<BEE::Mask_t,1>::make());
-    else
-        m.create(rows, cols, OpenCVType<BEE::Simmat_t,1>::make());
+    bool isPacked = words[0][1] == 'P';
+    bool isMask = (words[0][1] == 'B') || isPacked;
+    int type = isMask ? OpenCVType<BEE::Mask_t,1>::make() : OpenCVType<BEE::Simmat_t,1>::make();
 
-    qint64 read = file.read((char*)m.data, bytesExpected);
-    if (read != bytesExpected)
+    // Map matrix data
+    qint64 bytesExpected = (qint64)rows * (isPacked ? packedStep(cols) : (qint64)cols*CV_ELEM_SIZE(type));
+    if (file.size() - file.pos() < bytesExpected)
         qFatal("Invalid matrix size.");
-    file.close();
+    if (bytesExpected == 0) {
+        m.create(rows, cols, type);
+        return;
+    }
 
-    Mat result;
-    if (isDistance ^ matrix.get<bool>("negate", false)) m.convertTo(result, -1, -1);
-    else                                                result = m.clone();
-    return result;
+    uchar *data = file.map(file.pos(), bytesExpected);
+    if (data == NULL) qFatal("Unable to map %s.", qPrintable(matrix.name));
+    if (isPacked) {
+        m.create(rows, cols, type);
+        unpackMask(data, m);
+        file.unmap(data);
+    } else {
+        m = Mat(rows, cols, type, data);
+    }
 }
 
-void BEE::writeMat(const Mat &m, const QString &matrix, const QString &targetSigset, const QString &querySigset)
+BEE::MatrixWriter::MatrixWriter(const br::File &matrix, int rows, int cols, int type, const QString &targetSigset, const QString &querySigset)
+    : file(matrix.name), rows(rows), cols(cols), type(type)
 {
     bool isMask = false;
-    if (m.type() == OpenCVType<BEE::Mask_t,1>::make())
+    if (type == OpenCVType<BEE::Mask_t,1>::make())
         isMask = true;
-    else if (m.type() != OpenCVType<BEE::Simmat_t,1>::make())
+    else if (type != OpenCVType<BEE::Simmat_t,1>::make())
         qFatal("Invalid matrix type, .mtx files can only contain single channel float or uchar matrices.");
 
-    int elemSize = isMask ? sizeof(BEE::Mask_t) : sizeof(BEE::Simmat_t);
+    isPacked = isMask && matrix.get<bool>("packed", false);
+    rowSize = isPacked ? packedStep(cols) : (qint64)cols*CV_ELEM_SIZE(type);
 
-    QString matrixType = isMask ? "B" : "F";
+    QString matrixType = isPacked ? "P" : (isMask ? "B" : "F");
 
     char buff[4];
-    QFile file(matrix);
     QtUtils::touchDir(file);
-    bool success = file.open(QFile::WriteOnly); if (!success) qFatal("Unable to open %s for writing.", qPrintable(matrix));
+    bool success = file.open(QFile::WriteOnly); if (!success) qFatal("Unable to open %s for writing.", qPrintable(matrix.name));
     file.write("S2\n");
     file.write(qPrintable(targetSigset));
     file.write("\n");
@@ -204,22 +241,75 @@ void BEE::writeMat(const Mat &m, const QString &matrix, const QString &targetSig
     file.write("M");
     file.write(qPrintable(matrixType));
     file.write(" ");
-    file.write(qPrintable(QString::number(m.rows)));
+    file.write(qPrintable(QString::number(rows)));
     file.write(" ");
-    file.write(qPrintable(QString::number(m.cols)));
+    file.write(qPrintable(QString::number(cols)));
     file.write(" ");
     int endian = 0x12345678;
     memcpy(&buff, &endian, 4);
     file.write(buff, 4);
     file.write("\n");
-    file.write((const char*)m.data, m.rows*m.cols*elemSize);
-    file.close();
+    headerSize = file.pos();
+
+    // Blocks may arrive in any order
+    file.resize(headerSize + rows*rowSize);
+}
+
+void BEE::MatrixWriter::write(const Mat &block, int row)
+{
+    if ((block.type() != type) || (block.cols != cols) || (row < 0) || (row + block.rows > rows))
+        qFatal("Block (%ix%i at row %i) does not fit matrix (%ix%i).", block.rows, block.cols, row, rows, cols);
+
+    if (!isPacked && !block.isContinuous()) {
+        write(block.clone(), row);
+        return;
+    }
+
+    // Written in bounded chunks of rows, QByteArray sizes are ints and a block may exceed 2 GiB
+    const qint64 chunkBytes = qint64(64) * 1024 * 1024;
+    const int chunkRows = (int) std::max(qint64(1), chunkBytes / std::max(qint64(1), rowSize));
+    QMutexLocker locker(&lock);
+    for (int i=0; i<block.rows; i+=chunkRows) {
+        const Mat chunk = block.rowRange(i, std::min(i+chunkRows, block.rows));
+        file.seek(headerSize + qint64(row+i)*rowSize);
+        qint64 written;
+        if (isPacked) {
+            const QByteArray data = packMask(chunk);
+            written = (file.write(data) == data.size()) ? chunk.rows*rowSize : -1;
+        } else {
+            written = file.write((const char*)chunk.data, chunk.rows*rowSize);
+        }
+        if (written != chunk.rows*rowSize)
+            qFatal("Failed to write %s.", qPrintable(file.fileName()));
+    }
+}
+
+Mat BEE::readMat(const br::File &matrix, QString *targetSigset, QString *querySigset)
+{
+    MappedMatrix mapped(matrix);
+    if (targetSigset != NULL) *targetSigset = mapped.targetSigset;
+    if (querySigset != NULL) *querySigset = mapped.querySigset;
+
+    // Copy out of the mapping once, negating along the way if needed
+    Mat result;
+    if      (mapped.negate)     mapped.m.convertTo(result, -1, -1);
+    else if (mapped.m.refcount) result = mapped.m; // Unpacked into memory already
+    else                        result = mapped.m.clone();
+    return result;
+}
+
+void BEE::writeMat(const Mat &m, const br::File &matrix, const QString &targetSigset, const QString &querySigset)
+{
+    MatrixWriter writer(matrix, m.rows, m.cols, m.type(), targetSigset, querySigset);
+    writer.write(m, 0);
 }
 
 void BEE::readMatrixHeader(const QString &matrix, QString *targetSigset, QString *querySigset)
 {
     qDebug("Reading %s header.", qPrintable(matrix));
-    readMat(matrix, targetSigset, querySigset);
+    MappedMatrix mapped(matrix);
+    if (targetSigset != NULL) *targetSigset = mapped.targetSigset;
+    if (querySigset != NULL) *querySigset = mapped.querySigset;
 }
 
 void BEE::writeMatrixHeader(const QString &matrix, const QString &targetSigset, const QString &querySigset)
@@ -258,74 +348,89 @@ void BEE::makePairwiseMask(const QString &targetInput, const QString &queryInput
     }
 }
 
-cv::Mat BEE::makePairwiseMask(const br::FileList &targets, const br::FileList &queries, int partition)
+static QVector<int> indexValues(const QStringList &values, QHash<QString,int> &ids, bool unlabeled)
+{
+    QVector<int> indices(values.size());
+    for (int i=0; i<values.size(); i++) {
+        if (unlabeled && (values[i] == "-1")) indices[i] = -1;
+        else if (ids.contains(values[i]))     indices[i] = ids[values[i]];
+        else                                  indices[i] = ids.insert(values[i], ids.size()).value();
+    }
+    return indices;
+}
+
+void BEE::indexMask(const br::FileList &targets, const br::FileList &queries, MaskIndex *targetIndex, MaskIndex *queryIndex)
+{
+    // Direct use of "Label" isn't general, but labels and file names are compared as integers from here on
+    QHash<QString,int> labels, names;
+    targetIndex->labels = indexValues(File::get<QString>(targets, "Label", "-1"), labels, true);
+    queryIndex->labels = indexValues(File::get<QString>(queries, "Label", "-1"), labels, true);
+    targetIndex->names = indexValues(targets.names(), names, false);
+    queryIndex->names = indexValues(queries.names(), names, false);
+    targetIndex->partitions = targets.crossValidationPartitions();
+    queryIndex->partitions = queries.crossValidationPartitions();
+}
+
+void BEE::fillMask(const MaskIndex &targets, const MaskIndex &queries, int partition, Mat &mask, int row, int col)
 {
-    // Direct use of "Label" isn't general, also would prefer to use indexProperty, rather than
-    // doing string comparisons (but that isn't implemented yet for FileList) -cao
-    QList<QString> targetLabels = File::get<QString>(targets, "Label", "-1");
-    QList<QString> queryLabels = File::get<QString>(queries, "Label", "-1");
+    for (int i=0; i<mask.rows; i++) {
+        const int nameA = queries.names[row+i];
+        const int labelA = queries.labels[row+i];
+        const int partitionA = queries.partitions[row+i];
+        Mask_t *maskRow = mask.ptr<Mask_t>(i);
+
+        if ((labelA == -1) || (partitionA != partition)) {
+            memset(maskRow, DontCare, mask.cols*sizeof(Mask_t));
+            continue;
+        }
 
-    QList<int> targetPartitions = targets.crossValidationPartitions();
-    QList<int> queryPartitions = queries.crossValidationPartitions();
+        for (int j=0; j<mask.cols; j++) {
+            const int labelB = targets.labels[col+j];
+            const int partitionB = targets.partitions[col+j];
+
+            Mask_t val;
+            if      (nameA == targets.names[col+j]) val = DontCare;
+            else if (labelB == -1)                   val = DontCare;
+            else if (partitionB == -1)               val = NonMatch;
+            else if (partitionB != partition)        val = DontCare;
+            else if (labelA == labelB)               val = Match;
+            else                                     val = NonMatch;
+            maskRow[j] = val;
+        }
+    }
+}
+
+cv::Mat BEE::makePairwiseMask(const br::FileList &targets, const br::FileList &queries, int partition)
+{
+    MaskIndex targetIndex, queryIndex;
+    indexMask(targets, queries, &targetIndex, &queryIndex);
 
     Mat mask(queries.size(), 1, CV_8UC1);
     for (int i=0; i<queries.size(); i++) {
-        const QString &fileA = queries[i];
-        const QString labelA = queryLabels[i];
-        const int partitionA = queryPartitions[i];
-
-        const QString &fileB = targets[i];
-        const QString labelB = targetLabels[i];
-        const int partitionB = targetPartitions[i];
-
-        Mask_t val;
-        if      (fileA == fileB)           val = DontCare;
-        else if (labelA == "-1")           val = DontCare;
-        else if (labelB == "-1")           val = DontCare;
-        else if (partitionA != partition)  val = DontCare;
-        else if (partitionB == -1)         val = NonMatch;
-        else if (partitionB != partition)  val = DontCare;
-        else if (labelA == labelB)         val = Match;
-        else                               val = NonMatch;
-        mask.at<Mask_t>(i,0) = val;
+        Mat cell = mask.row(i);
+        fillMask(targetIndex, queryIndex, partition, cell, i, i);
     }
 
     return mask;
 }
 
-cv::Mat BEE::makeMask(const br::FileList &targets, const br::FileList &queries, int partition)
+static void fillRows(const BEE::MaskIndex *targets, const BEE::MaskIndex *queries, int partition, Mat mask, int row)
 {
-    // Direct use of "Label" isn't general, also would prefer to use indexProperty, rather than
-    // doing string comparisons (but that isn't implemented yet for FileList) -cao
-    QList<QString> targetLabels = File::get<QString>(targets, "Label", "-1");
-    QList<QString> queryLabels = File::get<QString>(queries, "Label", "-1");
+    BEE::fillMask(*targets, *queries, partition, mask, row);
+}
 
-    QList<int> targetPartitions = targets.crossValidationPartitions();
-    QList<int> queryPartitions = queries.crossValidationPartitions();
+cv::Mat BEE::makeMask(const br::FileList &targets, const br::FileList &queries, int partition)
+{
+    MaskIndex targetIndex, queryIndex;
+    indexMask(targets, queries, &targetIndex, &queryIndex);
 
+    // Rows are filled in parallel blocks of about 4M cells
     Mat mask(queries.size(), targets.size(), CV_8UC1);
-    for (int i=0; i<queries.size(); i++) {
-        const QString &fileA = queries[i];
-        const QString labelA = queryLabels[i];
-        const int partitionA = queryPartitions[i];
-
-        for (int j=0; j<targets.size(); j++) {
-            const QString &fileB = targets[j];
-            const QString labelB = targetLabels[j];
-            const int partitionB = targetPartitions[j];
-
-            Mask_t val;
-            if      (fileA == fileB)           val = DontCare;
-            else if (labelA == "-1")           val = DontCare;
-            else if (labelB == "-1")           val = DontCare;
-            else if (partitionA != partition)  val = DontCare;
-            else if (partitionB == -1)         val = NonMatch;
-            else if (partitionB != partition)  val = DontCare;
-            else if (labelA == labelB)         val = Match;
-            else                               val = NonMatch;
-            mask.at<Mask_t>(i,j) = val;
-        }
-    }
+    const int step = std::max(1, (1 << 22) / std::max(1, targets.size()));
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<queries.size(); i+=step)
+        futures.addFuture(QtConcurrent::run(fillRows, &targetIndex, &queryIndex, partition, mask.rowRange(i, std::min(i+step, queries.size())), i));
+    futures.waitForFinished();
 
     return mask;
 }
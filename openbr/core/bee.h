@@ -17,11 +17,15 @@
 #ifndef BEE_BEE_H
 #define BEE_BEE_H
 
+#include <QFile>
 #include <QList>
+#include <QMutex>
 #include <QPair>
 #include <QHash>
 #include <QString>
 #include <QStringList>
+#include <QVector>
+#include <QXmlStreamReader>
 #include <opencv2/core/core.hpp>
 #include <openbr/openbr_plugin.h>
 
@@ -35,16 +39,74 @@ namespace BEE
     typedef uchar Mask_t;
 
     // Sigset
+    /*!
+     * \brief Parses a sigset incrementally, holding only the current element instead of the whole document.
+     */
+    class SigsetReader
+    {
+    public:
+        explicit SigsetReader(const br::File &sigset, bool ignoreMetadata = false);
+        br::FileList read(int n, bool *done); // Returns the next n files at most, setting done after the last one
+
+    private:
+        QFile file;
+        QXmlStreamReader xml;
+        bool ignoreMetadata, started, inSignature, finished;
+        QString name; // Of the current biometric-signature
+    };
+
     br::FileList readSigset(const br::File &sigset, bool ignoreMetadata = false);
     void writeSigset(const QString &sigset, const br::FileList &files, bool ignoreMetadata = false);
 
     // Matrix
+    /*!
+     * \brief A similarity matrix or mask whose payload is memory mapped rather than read.
+     *
+     * Unlike readMat() the scores are not negated when the file holds distances, consumers apply #negate themselves.
+     * Packed masks are unpacked into memory.
+     */
+    class MappedMatrix
+    {
+    public:
+        explicit MappedMatrix(const br::File &matrix);
+        cv::Mat m; // Read only view of the payload, valid for the lifetime of this object
+        bool negate; // True if m must be negated to obtain similarity scores
+        QString targetSigset, querySigset;
+
+    private:
+        QFile file;
+    };
+
+    /*!
+     * \brief Writes a similarity matrix or mask a block of rows at a time.
+     */
+    class MatrixWriter
+    {
+    public:
+        MatrixWriter(const br::File &matrix, int rows, int cols, int type, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query");
+        void write(const cv::Mat &block, int row); // Writes the rows of block starting at row, safe to call concurrently
+
+    private:
+        QFile file;
+        QMutex lock;
+        int rows, cols, type;
+        bool isPacked;
+        qint64 headerSize, rowSize;
+    };
+
     cv::Mat readMat(const br::File & mat, QString * targetSigset = NULL, QString * querySigset = NULL);
-    void writeMat(const cv::Mat &m, const QString &simmat, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query");
+    void writeMat(const cv::Mat &m, const br::File &simmat, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query"); // Masks are packed 2 bits per cell with the "packed" property
     void readMatrixHeader(const QString &matrix, QString *targetSigset, QString *querySigset);
     void writeMatrixHeader(const QString &matrix, const QString &targetSigset, const QString &querySigset);
 
     // Mask
+    struct MaskIndex
+    {
+        QVector<int> labels, names; // Dense ids shared by the targets and queries, label "-1" is -1
+        QList<int> partitions;
+    };
+    void indexMask(const br::FileList &targets, const br::FileList &queries, MaskIndex *targetIndex, MaskIndex *queryIndex);
+    void fillMask(const MaskIndex &targets, const MaskIndex &queries, int partition, cv::Mat &mask, int row = 0, int col = 0); // Fills mask for the queries starting at row and targets starting at col
     void makeMask(const QString &targetInput, const QString &queryInput, const QString &mask);
     cv::Mat makeMask(const br::FileList &targets, const br::FileList &queries, int partition = 0);
     void makePairwiseMask(const QString &targetInput, const QString &queryInput, const QString &mask);
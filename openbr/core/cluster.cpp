@@ -16,10 +16,13 @@
 
 #include <QDebug>
 #include <QFile>
+#include <QFutureSynchronizer>
 #include <QHash>
 #include <QPair>
-#include <QSet>
+#include <QtConcurrentRun>
+#include <algorithm>
 #include <limits>
+#include <vector>
 #include <openbr/openbr_plugin.h>
 
 #include "openbr/core/bee.h"
@@ -37,29 +40,47 @@ static bool compareNeighbors(const Neighbor &a, const Neighbor &b)
     return a.second > b.second;
 }
 
+// Neighbor ids of each template paired with their index in its neighbor list, sorted by id for logarithmic lookup
+typedef QPair<int,int> NeighborPosition; // QPair<id,index>
+typedef QVector< QVector<NeighborPosition> > NeighborPositions;
+
+static NeighborPositions getPositions(const Neighborhood &neighborhood)
+{
+    NeighborPositions positions(neighborhood.size());
+    for (int i=0; i<neighborhood.size(); i++) {
+        QVector<NeighborPosition> &position = positions[i];
+        position.reserve(neighborhood[i].size());
+        for (int j=0; j<neighborhood[i].size(); j++)
+            position.append(NeighborPosition(neighborhood[i][j].first, j));
+        std::sort(position.begin(), position.end());
+    }
+    return positions;
+}
+
 // Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
 // Ob(x) in eq. 1, modified to consider 0/1 as ground truth imposter/genuine.
-static int indexOf(const Neighbors &neighbors, int i)
+static int indexOf(const Neighborhood &neighborhood, const NeighborPositions &positions, int a, int i)
 {
-    for (int j=0; j<neighbors.size(); j++) {
-        const Neighbor &neighbor = neighbors[j];
-        if (neighbor.first == i) {
-            if      (neighbor.second == 0) return neighbors.size()-1;
-            else if (neighbor.second == 1) return 0;
-            else                           return j;
-        }
-    }
-    return -1;
+    const QVector<NeighborPosition> &position = positions[a];
+    QVector<NeighborPosition>::const_iterator it = std::lower_bound(position.begin(), position.end(), NeighborPosition(i, -1));
+    if ((it == position.end()) || (it->first != i))
+        return -1;
+
+    const Neighbors &neighbors = neighborhood[a];
+    const Neighbor &neighbor = neighbors[it->second];
+    if      (neighbor.second == 0) return neighbors.size()-1;
+    else if (neighbor.second == 1) return 0;
+    else                           return it->second;
 }
 
 // Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
 // Corresponds to eq. 1, or D(a,b)
-static int asymmetricalROD(const Neighborhood &neighborhood, int a, int b)
+static int asymmetricalROD(const Neighborhood &neighborhood, const NeighborPositions &positions, int a, int b)
 {
     int distance = 0;
     foreach (const Neighbor &neighbor, neighborhood[a]) {
         if (neighbor.first == b) break;
-        int index = indexOf(neighborhood[b], neighbor.first);
+        int index = indexOf(neighborhood, positions, b, neighbor.first);
         distance += (index == -1) ? neighborhood[b].size() : index;
     }
     return distance;
@@ -67,21 +88,94 @@ static int asymmetricalROD(const Neighborhood &neighborhood, int a, int b)
 
 // Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
 // Corresponds to eq. 2/4, or D-R(a,b)
-float normalizedROD(const Neighborhood &neighborhood, int a, int b)
+float normalizedROD(const Neighborhood &neighborhood, const NeighborPositions &positions, int a, int b)
 {
-    int indexA = indexOf(neighborhood[b], a);
-    int indexB = indexOf(neighborhood[a], b);
+    int indexA = indexOf(neighborhood, positions, b, a);
+    int indexB = indexOf(neighborhood, positions, a, b);
 
     // Default behaviors
     if ((indexA == -1) || (indexB == -1)) return std::numeric_limits<float>::max();
     if ((neighborhood[b][indexA].second == 1) || (neighborhood[a][indexB].second == 1)) return 0;
     if ((neighborhood[b][indexA].second == 0) || (neighborhood[a][indexB].second == 0)) return std::numeric_limits<float>::max();
 
-    int distanceA = asymmetricalROD(neighborhood, a, b);
-    int distanceB = asymmetricalROD(neighborhood, b, a);
+    int distanceA = asymmetricalROD(neighborhood, positions, a, b);
+    int distanceB = asymmetricalROD(neighborhood, positions, b, a);
     return 1.f * (distanceA + distanceB) / std::min(indexA+1, indexB+1);
 }
 
+// Templates whose rank-order distance to a neighbor is below the threshold
+struct MergeBlock
+{
+    const Neighborhood *neighborhood;
+    const NeighborPositions *positions;
+    float threshold;
+    int begin, end;
+    QList< QPair<int,int> > merges;
+};
+
+static void findMerges(MergeBlock *block)
+{
+    for (int a=block->begin; a<block->end; a++)
+        foreach (const Neighbor &neighbor, (*block->neighborhood)[a])
+            // The distance is symmetric and infinite unless both templates list each other, so each pair is evaluated once
+            if ((neighbor.first > a) &&
+                (normalizedROD(*block->neighborhood, *block->positions, a, neighbor.first) < block->threshold))
+                block->merges.append(QPair<int,int>(a, neighbor.first));
+}
+
+// Union-find root with path halving
+static int findRoot(QVector<int> &parents, int i)
+{
+    while (parents[i] != i) {
+        parents[i] = parents[parents[i]];
+        i = parents[i];
+    }
+    return i;
+}
+
+// Rows of one similarity matrix whose best neighbors are merged into the bounded heaps of their templates
+struct NeighborBlock
+{
+    const BEE::MappedMatrix *matrix;
+    bool diagonal; // Skip self-similarity scores
+    int columnOffset, begin, end, cutoff;
+    QVector< std::vector<Neighbor> > *heaps; // Indexed by row, the worst kept neighbor is at the front
+    float min, max; // Of the finite scores seen
+};
+
+static void collectNeighbors(NeighborBlock *block)
+{
+    block->max = -std::numeric_limits<float>::max();
+    block->min = std::numeric_limits<float>::max();
+    const cv::Mat &m = block->matrix->m;
+    const float sign = block->matrix->negate ? -1 : 1;
+
+    for (int k=block->begin; k<block->end; k++) {
+        std::vector<Neighbor> &heap = (*block->heaps)[k];
+        const float *row = m.ptr<float>(k);
+        for (int l=0; l<m.cols; l++) {
+            if (block->diagonal && (k==l)) continue; // Skips self-similarity scores
+            const float val = sign*row[l];
+
+            if ((val != -std::numeric_limits<float>::infinity()) &&
+                (val != std::numeric_limits<float>::infinity())) {
+                block->max = std::max(block->max, val);
+                block->min = std::min(block->min, val);
+            }
+
+            const Neighbor neighbor(l+block->columnOffset, val);
+            if ((int)heap.size() < block->cutoff) {
+                heap.push_back(neighbor);
+                std::push_heap(heap.begin(), heap.end(), compareNeighbors);
+            } else if (compareNeighbors(neighbor, heap.front())) {
+                std::pop_heap(heap.begin(), heap.end(), compareNeighbors);
+                heap.back() = neighbor;
+                std::push_heap(heap.begin(), heap.end(), compareNeighbors);
+            }
+        }
+    }
+}
+
 Neighborhood getNeighborhood(const QStringList &simmats)
 {
     Neighborhood neighborhood;
@@ -91,48 +185,61 @@ Neighborhood getNeighborhood(const QStringList &simmats)
     int numGalleries = (int)sqrt((float)simmats.size());
     if (numGalleries*numGalleries != simmats.size())
         qFatal("Incorrect number of similarity matrices.");
+    const int cutoff = std::max(1, br::Globals->clusterNeighbors);
 
     // Process each simmat
     for (int i=0; i<numGalleries; i++) {
-        QVector<Neighbors> allNeighbors;
+        // Bounded heaps of the top matches of each row, so only cutoff neighbors per template are ever held
+        QVector< std::vector<Neighbor> > heaps;
 
         int currentRows = -1;
         int columnOffset = 0;
         for (int j=0; j<numGalleries; j++) {
-            cv::Mat m = BEE::readMat(simmats[i*numGalleries+j]);
+            const BEE::MappedMatrix matrix(simmats[i*numGalleries+j]);
+            const cv::Mat &m = matrix.m;
             if (j==0) {
                 currentRows = m.rows;
-                allNeighbors.resize(currentRows);
+                heaps.resize(currentRows);
             }
             if (currentRows != m.rows) qFatal("Row count mismatch.");
 
-            // Get data row by row
-            for (int k=0; k<m.rows; k++) {
-                Neighbors &neighbors = allNeighbors[k];
-                neighbors.reserve(neighbors.size() + m.cols);
-                for (int l=0; l<m.cols; l++) {
-                    float val = m.at<float>(k,l);
-                    if ((i==j) && (k==l)) continue; // Skips self-similarity scores
-
-                    if ((val != -std::numeric_limits<float>::infinity()) &&
-                        (val != std::numeric_limits<float>::infinity())) {
-                        globalMax = std::max(globalMax, val);
-                        globalMin = std::min(globalMin, val);
-                    }
-                    neighbors.append(Neighbor(l+columnOffset, val));
-                }
+            // Rows in parallel blocks of about 4M scores
+            const int step = std::max(1, (1 << 22) / std::max(1, m.cols));
+            QList<NeighborBlock> blocks;
+            for (int k=0; k<m.rows; k+=step) {
+                NeighborBlock block;
+                block.matrix = &matrix;
+                block.diagonal = (i==j);
+                block.columnOffset = columnOffset;
+                block.begin = k;
+                block.end = std::min(k+step, m.rows);
+                block.cutoff = cutoff;
+                block.heaps = &heaps;
+                blocks.append(block);
+            }
+
+            QFutureSynchronizer<void> futures;
+            for (int k=0; k<blocks.size(); k++)
+                futures.addFuture(QtConcurrent::run(collectNeighbors, &blocks[k]));
+            futures.waitForFinished();
+
+            foreach (const NeighborBlock &block, blocks) {
+                globalMax = std::max(globalMax, block.max);
+                globalMin = std::min(globalMin, block.min);
             }
 
             columnOffset += m.cols;
         }
 
         // Keep the top matches
-        for (int j=0; j<allNeighbors.size(); j++) {
-            Neighbors &val = allNeighbors[j];
-            const int cutoff = 20; // Somewhat arbitrary number of neighbors to keep
-            int keep = std::min(cutoff, val.size());
-            std::partial_sort(val.begin(), val.begin()+keep, val.end(), compareNeighbors);
-            neighborhood.append((Neighbors)val.mid(0, keep));
+        for (int j=0; j<heaps.size(); j++) {
+            std::vector<Neighbor> &heap = heaps[j];
+            std::sort_heap(heap.begin(), heap.end(), compareNeighbors);
+            Neighbors neighbors; neighbors.reserve(heap.size());
+            for (size_t k=0; k<heap.size(); k++)
+                neighbors.append(heap[k]);
+            neighborhood.append(neighbors);
+            std::vector<Neighbor>().swap(heap);
         }
     }
 
@@ -154,6 +261,33 @@ Neighborhood getNeighborhood(const QStringList &simmats)
 }
 
 // Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
+br::Clusters br::MergeClusters(int size, const QList< QPair<int,int> > &merges)
+{
+    // Merge transitively, each cluster is labeled by its lowest template id
+    QVector<int> parents(size);
+    for (int i=0; i<size; i++) parents[i] = i;
+    typedef QPair<int,int> Merge;
+    foreach (const Merge &merge, merges) {
+        const int rootA = findRoot(parents, merge.first);
+        const int rootB = findRoot(parents, merge.second);
+        if      (rootA < rootB) parents[rootB] = rootA;
+        else if (rootB < rootA) parents[rootA] = rootB;
+    }
+
+    // Construct clusters in order of their lowest template id
+    Clusters clusters;
+    QVector<int> clusterIDs(size, -1);
+    for (int i=0; i<size; i++) {
+        const int root = findRoot(parents, i);
+        if (clusterIDs[root] == -1) {
+            clusterIDs[root] = clusters.size();
+            clusters.append(Cluster());
+        }
+        clusters[clusterIDs[root]].append(i);
+    }
+    return clusters;
+}
+
 br::Clusters br::ClusterGallery(const QStringList &simmats, float aggressiveness, const QString &csv)
 {
     qDebug("Clustering %d simmat(s)", simmats.size());
@@ -163,78 +297,29 @@ br::Clusters br::ClusterGallery(const QStringList &simmats, float aggressiveness
     const int cutoff = neighborhood.first().size();
     const float threshold = 3*cutoff/4 * aggressiveness/5;
 
-    // Initialize clusters
-    Clusters clusters(neighborhood.size());
-    for (int i=0; i<neighborhood.size(); i++)
-        clusters[i].append(i);
-
-    bool done = false;
-    while (!done) {
-        // nextClusterIds[i] = j means that cluster i is set to merge into cluster j
-        QVector<int> nextClusterIDs(neighborhood.size());
-        for (int i=0; i<neighborhood.size(); i++) nextClusterIDs[i] = i;
-
-        // For each cluster
-        for (int clusterID=0; clusterID<neighborhood.size(); clusterID++) {
-            const Neighbors &neighbors = neighborhood[clusterID];
-            int nextClusterID = nextClusterIDs[clusterID];
-
-            // Check its neighbors
-            foreach (const Neighbor &neighbor, neighbors) {
-                int neighborID = neighbor.first;
-                int nextNeighborID = nextClusterIDs[neighborID];
-
-                // Don't bother if they have already merged
-                if (nextNeighborID == nextClusterID) continue;
-
-                // Flag for merge if similar enough
-                if (normalizedROD(neighborhood, clusterID, neighborID) < threshold) {
-                    if (nextClusterID < nextNeighborID) nextClusterIDs[neighborID] = nextClusterID;
-                    else                                nextClusterIDs[clusterID] = nextNeighborID;
-                }
-            }
-        }
-
-        // Transitive merge
-        for (int i=0; i<neighborhood.size(); i++) {
-            int nextClusterID = i;
-            while (nextClusterID != nextClusterIDs[nextClusterID]) {
-                assert(nextClusterIDs[nextClusterID] < nextClusterID);
-                nextClusterID = nextClusterIDs[nextClusterID];
-            }
-            nextClusterIDs[i] = nextClusterID;
-        }
-
-        // Construct new clusters
-        QHash<int, int> clusterIDLUT;
-        QList<int> allClusterIDs = QSet<int>::fromList(nextClusterIDs.toList()).values();
-        for (int i=0; i<neighborhood.size(); i++)
-            clusterIDLUT[i] = allClusterIDs.indexOf(nextClusterIDs[i]);
-
-        Clusters newClusters(allClusterIDs.size());
-        Neighborhood newNeighborhood(allClusterIDs.size());
+    // Evaluate the rank-order distances to every template's neighbors in parallel
+    const NeighborPositions positions = getPositions(neighborhood);
+    const int step = 4096;
+    QList<MergeBlock> blocks;
+    for (int i=0; i<neighborhood.size(); i+=step) {
+        MergeBlock block;
+        block.neighborhood = &neighborhood;
+        block.positions = &positions;
+        block.threshold = threshold;
+        block.begin = i;
+        block.end = std::min(i+step, neighborhood.size());
+        blocks.append(block);
+    }
 
-        for (int i=0; i<neighborhood.size(); i++) {
-            int newID = clusterIDLUT[i];
-            newClusters[newID].append(clusters[i]);
-            newNeighborhood[newID].append(neighborhood[i]);
-        }
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<blocks.size(); i++)
+        futures.addFuture(QtConcurrent::run(findMerges, &blocks[i]));
+    futures.waitForFinished();
 
-        // Update indices and trim
-        for (int i=0; i<newNeighborhood.size(); i++) {
-            Neighbors &neighbors = newNeighborhood[i];
-            int size = qMin(neighbors.size(),cutoff);
-            std::partial_sort(neighbors.begin(), neighbors.begin()+size, neighbors.end(), compareNeighbors);
-            for (int j=0; j<size; j++)
-                neighbors[j].first = clusterIDLUT[j];
-            neighbors = neighbors.mid(0, cutoff);
-        }
-
-        // Update results
-        done = true; //(newClusters.size() >= clusters.size());
-        clusters = newClusters;
-        neighborhood = newNeighborhood;
-    }
+    QList< QPair<int,int> > merges;
+    foreach (const MergeBlock &block, blocks)
+        merges.append(block.merges);
+    Clusters clusters = MergeClusters(neighborhood.size(), merges);
 
     // Save clusters
     if (!csv.isEmpty())
@@ -319,6 +404,162 @@ void br::EvalClustering(const QString &csv, const QString &input)
     qDebug("Recall: %f  Precision: %f  F-score: %f  Jaccard index: %f", wI, wII, sqrt(wI*wII), jaccard);
 }
 
+struct NearestCenters
+{
+    cv::Mat data, centers;
+    cv::Mat centerNorms; // 1 x k squared norms of the centers
+    int *labels;
+    float *distances; // Squared distances
+};
+
+// Nearest center of every row through one matrix product, d(x,c) = |x|^2 - 2x.c + |c|^2
+static void nearestCenters(NearestCenters *job)
+{
+    cv::Mat products;
+    cv::gemm(job->data, job->centers, -2, cv::Mat(), 0, products, cv::GEMM_2_T);
+    for (int i=0; i<job->data.rows; i++) {
+        const float *row = products.ptr<float>(i);
+        const float *norms = job->centerNorms.ptr<float>();
+        int best = 0;
+        float bestDistance = std::numeric_limits<float>::max();
+        for (int j=0; j<products.cols; j++) {
+            const float distance = row[j] + norms[j];
+            if (distance < bestDistance) {
+                bestDistance = distance;
+                best = j;
+            }
+        }
+        job->labels[i] = best;
+        job->distances[i] = std::max(0.f, bestDistance + (float)job->data.row(i).dot(job->data.row(i)));
+    }
+}
+
+static void assignCenters(const cv::Mat &data, const cv::Mat &centers, int *labels, float *distances)
+{
+    cv::Mat centerNorms(1, centers.rows, CV_32FC1);
+    for (int j=0; j<centers.rows; j++)
+        centerNorms.at<float>(0, j) = centers.row(j).dot(centers.row(j));
+
+    const int chunks = std::max(1, std::min(br::Globals->parallelism, data.rows / 256));
+    QVector<NearestCenters> jobs(chunks);
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<chunks; i++) {
+        const int begin = qint64(data.rows) * i / chunks;
+        const int end = qint64(data.rows) * (i+1) / chunks;
+        NearestCenters &job = jobs[i];
+        job.data = data.rowRange(begin, end);
+        job.centers = centers;
+        job.centerNorms = centerNorms;
+        job.labels = labels + begin;
+        job.distances = distances + begin;
+        if (chunks > 1) futures.addFuture(QtConcurrent::run(nearestCenters, &job));
+        else            nearestCenters(&job);
+    }
+    futures.waitForFinished();
+}
+
+// k-means|| oversampling followed by weighted k-means++ over the candidates
+static cv::Mat seedCenters(const cv::Mat &data, int k)
+{
+    const int rounds = 5;
+    const double oversampling = 2.0 * k;
+
+    QList<int> candidates;
+    candidates.append(rand() % data.rows);
+    QVector<int> labels(data.rows);
+    QVector<float> distances(data.rows);
+    for (int round=0; round<rounds; round++) {
+        cv::Mat centers(candidates.size(), data.cols, CV_32FC1);
+        for (int i=0; i<candidates.size(); i++)
+            data.row(candidates[i]).copyTo(centers.row(i));
+        assignCenters(data, centers, labels.data(), distances.data());
+
+        double cost = 0;
+        for (int i=0; i<data.rows; i++)
+            cost += distances[i];
+        if (cost == 0) break;
+        for (int i=0; i<data.rows; i++)
+            if (double(rand()) / RAND_MAX < oversampling * distances[i] / cost)
+                candidates.append(i);
+    }
+
+    // Weight each candidate by the rows nearest to it
+    cv::Mat candidateCenters(candidates.size(), data.cols, CV_32FC1);
+    for (int i=0; i<candidates.size(); i++)
+        data.row(candidates[i]).copyTo(candidateCenters.row(i));
+    assignCenters(data, candidateCenters, labels.data(), distances.data());
+    QVector<double> weights(candidates.size(), 0);
+    for (int i=0; i<data.rows; i++)
+        weights[labels[i]]++;
+
+    // Weighted k-means++ on the candidates
+    cv::Mat centers(k, data.cols, CV_32FC1);
+    QVector<double> nearest(candidates.size(), std::numeric_limits<double>::max());
+    int chosen = rand() % candidates.size();
+    for (int c=0; c<k; c++) {
+        if (c >= candidates.size()) {
+            // Fewer candidates than centers, fall back to random rows
+            data.row(rand() % data.rows).copyTo(centers.row(c));
+            continue;
+        }
+        candidateCenters.row(chosen).copyTo(centers.row(c));
+
+        double total = 0;
+        for (int i=0; i<candidates.size(); i++) {
+            nearest[i] = std::min(nearest[i], cv::norm(candidateCenters.row(i), centers.row(c), cv::NORM_L2SQR));
+            total += weights[i] * nearest[i];
+        }
+        double target = total * rand() / RAND_MAX;
+        chosen = 0;
+        for (int i=0; i<candidates.size(); i++) {
+            target -= weights[i] * nearest[i];
+            if (target <= 0) {
+                chosen = i;
+                break;
+            }
+        }
+    }
+    return centers;
+}
+
+double br::MiniBatchKMeans(const cv::Mat &data, int k, cv::Mat &labels, cv::Mat &centers, int batchSize, int iterations)
+{
+    if ((data.type() != CV_32FC1) || (data.rows < k))
+        qFatal("MiniBatchKMeans expects at least k CV_32FC1 rows.");
+
+    centers = seedCenters(data, k);
+    batchSize = std::min(batchSize, data.rows);
+
+    QVector<int> counts(k, 0);
+    QVector<int> batchLabels(batchSize);
+    QVector<float> batchDistances(batchSize);
+    cv::Mat batch(batchSize, data.cols, CV_32FC1);
+    for (int iteration=0; iteration<iterations; iteration++) {
+        QVector<int> rows(batchSize);
+        for (int i=0; i<batchSize; i++) {
+            rows[i] = rand() % data.rows;
+            data.row(rows[i]).copyTo(batch.row(i));
+        }
+        assignCenters(batch, centers, batchLabels.data(), batchDistances.data());
+
+        // Per-center learning rate of one over the number of rows it has absorbed
+        for (int i=0; i<batchSize; i++) {
+            const int c = batchLabels[i];
+            const float eta = 1.f / ++counts[c];
+            cv::Mat center = centers.row(c);
+            cv::addWeighted(center, 1 - eta, batch.row(i), eta, 0, center);
+        }
+    }
+
+    labels.create(data.rows, 1, CV_32SC1);
+    QVector<float> distances(data.rows);
+    assignCenters(data, centers, labels.ptr<int>(), distances.data());
+    double compactness = 0;
+    for (int i=0; i<data.rows; i++)
+        compactness += distances[i];
+    return compactness;
+}
+
 br::Clusters br::ReadClusters(const QString &csv)
 {
     Clusters clusters;
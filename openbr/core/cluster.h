@@ -18,9 +18,11 @@
 #define BR_CLUSTER_H
 
 #include <QList>
+#include <QPair>
 #include <QString>
 #include <QStringList>
 #include <QVector>
+#include <opencv2/core/core.hpp>
 
 namespace br
 {
@@ -28,8 +30,22 @@ namespace br
     typedef QVector<Cluster> Clusters;
 
     Clusters ClusterGallery(const QStringList &simmats, float aggressiveness, const QString &csv);
+
+    /*!
+     * \brief Merges the \em size templates joined by \em merges transitively with union-find, each cluster in order of its lowest template id.
+     */
+    Clusters MergeClusters(int size, const QList< QPair<int,int> > &merges);
     void EvalClustering(const QString &csv, const QString &input);
 
+    /*!
+     * \brief Mini-batch k-means (Sculley 2010) seeded with k-means|| (Bahmani et al. 2012).
+     *
+     * Clusters the CV_32FC1 rows of \em data into \em k \em centers updated from \em iterations random batches of \em batchSize rows,
+     * sets \em labels to each row's nearest center and returns the compactness.
+     * Distance computations are spread over br::Context::parallelism threads.
+     */
+    double MiniBatchKMeans(const cv::Mat &data, int k, cv::Mat &labels, cv::Mat &centers, int batchSize = 1024, int iterations = 100);
+
     Clusters ReadClusters(const QString &csv);
     void WriteClusters(const Clusters &clusters, const QString &csv);
 }
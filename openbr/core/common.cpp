@@ -16,6 +16,7 @@
 
 #include "common.h"
 #include <QMutex>
+#include <QThreadStorage>
 
 using namespace std;
 
@@ -63,3 +64,15 @@ QList<int> Common::RandSample(int n, const QSet<int> &values, bool unique)
     }
     return samples;
 }
+
+static QThreadStorage<bool> inParallelFor;
+
+bool Common::InParallelFor()
+{
+    return inParallelFor.hasLocalData() && inParallelFor.localData();
+}
+
+void Common::SetInParallelFor(bool inside)
+{
+    inParallelFor.setLocalData(inside);
+}
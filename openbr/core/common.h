@@ -18,11 +18,16 @@
 #define COMMON_COMMON_H
 
 #include <QDebug>
+#include <QElapsedTimer>
+#include <QFutureSynchronizer>
 #include <QList>
 #include <QMap>
 #include <QPair>
 #include <QSet>
+#include <QThread>
+#include <QVector>
 #include <QtAlgorithms>
+#include <QtConcurrentRun>
 #include <algorithm>
 #include <functional>
 #include <iostream>
@@ -51,24 +56,96 @@ int round(T r)
  *        pair.second = original index
  */
 template <typename T>
-QList< QPair<T,int> > Sort(const QList<T> &vals, bool decending = false, int n = std::numeric_limits<int>::max())
+QList< QPair<T,int> > Sort(const QList<T> &vals, bool decending = false, int n = std::numeric_limits<int>::max());
+
+/*!
+ * \brief Selects the \em n pairs of vals[begin, end) that sort first, in no particular order.
+ */
+template <typename T>
+std::vector< QPair<T,int> > Select(const QList<T> *vals, int begin, int end, int n, bool decending)
+{
+    std::vector< QPair<T,int> > pairs; pairs.reserve(end-begin);
+    for (int i=begin; i<end; i++) pairs.push_back(QPair<T,int>((*vals)[i], i));
+
+    if (n < int(pairs.size())) {
+        if (decending) std::nth_element(pairs.begin(), pairs.begin()+n, pairs.end(), std::greater< QPair<T,int> >());
+        else           std::nth_element(pairs.begin(), pairs.begin()+n, pairs.end(), std::less< QPair<T,int> >());
+        pairs.resize(n);
+    }
+    return pairs;
+}
+
+/*!
+ * \brief Returns the \em n pairs that Sort() would return first, in the same order, in linear time plus O(n log n).
+ *
+ * Lists of at least a million values are split across threads and the per-thread selections merged.
+ */
+template <typename T>
+QList< QPair<T,int> > TopK(const QList<T> &vals, int n, bool decending = false)
 {
     const int size = vals.size();
-    QList< QPair<T,int> > pairs; pairs.reserve(size);
-    for (int i=0; i<size; i++) pairs.append(QPair<T,int>(vals[i], i));
+    if (n <= 0) return QList< QPair<T,int> >();
+
+    std::vector< QPair<T,int> > pairs;
+    const int chunks = std::min(QThread::idealThreadCount(), size / (1 << 20));
+    if ((chunks > 1) && (n < size / chunks)) {
+        QList< QFuture< std::vector< QPair<T,int> > > > futures;
+        for (int i=0; i<chunks; i++)
+            futures.append(QtConcurrent::run(&Select<T>, &vals, int(qint64(size)*i/chunks), int(qint64(size)*(i+1)/chunks), n, decending));
+        pairs.reserve(chunks*n);
+        for (int i=0; i<chunks; i++) {
+            const std::vector< QPair<T,int> > selected = futures[i].result();
+            pairs.insert(pairs.end(), selected.begin(), selected.end());
+        }
 
-    if (n >= pairs.size()) {
-        if (decending) std::sort(pairs.begin(), pairs.end(), std::greater< QPair<T,int> >());
-        else           std::sort(pairs.begin(), pairs.end(), std::less< QPair<T,int> >());
+        if (n < int(pairs.size())) {
+            if (decending) std::nth_element(pairs.begin(), pairs.begin()+n, pairs.end(), std::greater< QPair<T,int> >());
+            else           std::nth_element(pairs.begin(), pairs.begin()+n, pairs.end(), std::less< QPair<T,int> >());
+            pairs.resize(n);
+        }
     } else {
-        if (decending) std::partial_sort(pairs.begin(), pairs.begin()+n, pairs.end(), std::greater< QPair<T,int> >());
-        else           std::partial_sort(pairs.begin(), pairs.begin()+n, pairs.end(), std::less< QPair<T,int> >());
-        pairs = pairs.mid(0, n);
+        pairs = Select(&vals, 0, size, n, decending);
     }
 
+    if (decending) std::sort(pairs.begin(), pairs.end(), std::greater< QPair<T,int> >());
+    else           std::sort(pairs.begin(), pairs.end(), std::less< QPair<T,int> >());
+
+    QList< QPair<T,int> > result; result.reserve(int(pairs.size()));
+    for (size_t i=0; i<pairs.size(); i++) result.append(pairs[i]);
+    return result;
+}
+
+template <typename T>
+QList< QPair<T,int> > Sort(const QList<T> &vals, bool decending, int n)
+{
+    const int size = vals.size();
+    if (n < size) return TopK(vals, n, decending);
+
+    QList< QPair<T,int> > pairs; pairs.reserve(size);
+    for (int i=0; i<size; i++) pairs.append(QPair<T,int>(vals[i], i));
+    if (decending) std::sort(pairs.begin(), pairs.end(), std::greater< QPair<T,int> >());
+    else           std::sort(pairs.begin(), pairs.end(), std::less< QPair<T,int> >());
     return pairs;
 }
 
+/*!
+ * \brief Adds \em candidate to \em heap, a min-heap of the \em k largest pairs seen so far.
+ *
+ * std::sort_heap with std::greater leaves the heap in decreasing order.
+ */
+template <typename T>
+inline void PushTopK(QVector< QPair<T,int> > &heap, const QPair<T,int> &candidate, int k)
+{
+    if (heap.size() < k) {
+        heap.append(candidate);
+        std::push_heap(heap.begin(), heap.end(), std::greater< QPair<T,int> >());
+    } else if (heap.first() < candidate) {
+        std::pop_heap(heap.begin(), heap.end(), std::greater< QPair<T,int> >());
+        heap.last() = candidate;
+        std::push_heap(heap.begin(), heap.end(), std::greater< QPair<T,int> >());
+    }
+}
+
 /*!
  * \brief Returns the minimum, maximum, minimum index, and maximum index of a vector of values.
  */
@@ -315,6 +392,59 @@ QList<T> RemoveOutliers(QList<T> vals)
     return newVals;
 }
 
+/*!
+ * \brief Returns \c true if the calling thread is running a ParallelFor() chunk.
+ */
+bool InParallelFor();
+void SetInParallelFor(bool inside);
+
+template <typename Function>
+struct ParallelForChunk
+{
+    static void run(const Function *function, int begin, int end)
+    {
+        const bool outer = InParallelFor();
+        SetInParallelFor(true);
+        for (int i=begin; i<end; i++)
+            (*function)(i);
+        SetInParallelFor(outer);
+    }
+};
+
+/*!
+ * \brief Calls <tt>function(i)</tt> for every \em i in [\em begin, \em end) across the global thread pool.
+ *
+ * The first item is timed on the calling thread and the rest are handed out in chunks of roughly a millisecond of work,
+ * but at least four chunks per thread, so cheap items share a task.
+ * Calls nested inside a chunk run serially rather than oversubscribing the pool.
+ */
+template <typename Function>
+void ParallelFor(int begin, int end, const Function &function, int threads)
+{
+    if (begin >= end) return;
+    if ((threads <= 1) || (end-begin == 1) || InParallelFor()) {
+        for (int i=begin; i<end; i++)
+            function(i);
+        return;
+    }
+
+    QElapsedTimer timer; timer.start();
+    ParallelForChunk<Function>::run(&function, begin, begin+1);
+    const qint64 itemNanoseconds = std::max(qint64(1), qint64(timer.nsecsElapsed()));
+    begin++;
+
+    const qint64 chunkNanoseconds = 1000000;
+    const int remaining = end - begin;
+    const int grain = int(std::max(qint64(1), std::min(qint64(remaining / (4*threads)), chunkNanoseconds / itemNanoseconds)));
+
+    QFutureSynchronizer<void> futures;
+    for (int i=begin; i+grain<end; i+=grain)
+        futures.addFuture(QtConcurrent::run(&ParallelForChunk<Function>::run, &function, i, i+grain));
+    // The calling thread takes the last chunk
+    ParallelForChunk<Function>::run(&function, end - ((remaining-1) % grain + 1), end);
+    futures.waitForFinished();
+}
+
 /*!
  * \brief Sorts and evenly downsamples a vector to size k.
  */
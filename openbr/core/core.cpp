@@ -14,27 +14,327 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QAtomicPointer>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFuture>
+#include <QMutex>
+#include <QThreadPool>
+#include <QThreadStorage>
+#include <QtConcurrentRun>
+#include <limits>
 #include <openbr/openbr_plugin.h>
 
 #include "bee.h"
+#include "cluster.h"
 #include "common.h"
+#include "distributed.h"
+#include "memory.h"
+#include "metrics.h"
+#include "profiler.h"
+#include "progress.h"
 #include "qtutils.h"
 #include "../plugins/openbr_internal.h"
 
 using namespace br;
 
 /**** ALGORITHM_CORE ****/
+static const char MappedModelMagic[8] = { 'B', 'R', 'M', 'O', 'D', 'E', 'L', '1' };
+static const int MappedModelHeaderSize = 4096; // Keeps the serialized model page aligned
+
+// Sectioned models hold each pipeline stage in an aligned byte range of its own, listed in a table after the magic
+static const char SectionedModelMagic[8] = { 'B', 'R', 'M', 'O', 'D', 'E', 'L', '2' };
+static const int ModelSectionAlignment = 64;
+static const qint32 ModelSectionVersion = 1;
+
+struct ModelSection
+{
+    QString type; // Class name of the object serialized in the section
+    qint32 version;
+    qint64 offset, size;
+
+    ModelSection() : version(ModelSectionVersion), offset(0), size(0) {}
+};
+
+static QDataStream &operator<<(QDataStream &stream, const ModelSection &section)
+{
+    return stream << section.type << section.version << section.offset << section.size;
+}
+
+static QDataStream &operator>>(QDataStream &stream, ModelSection &section)
+{
+    return stream >> section.type >> section.version >> section.offset >> section.size;
+}
+
+static qint64 alignSection(qint64 offset)
+{
+    return (offset + ModelSectionAlignment - 1) / ModelSectionAlignment * ModelSectionAlignment;
+}
+
+static void loadSection(Object *object, const char *data, qint64 size)
+{
+    QByteArray section = QByteArray::fromRawData(data, int(size));
+    QDataStream in(&section, QFile::ReadOnly);
+    object->load(in);
+}
+
+/*!
+ * \brief Reads blocks [begin, end) of a gallery in order, one pass at a time.
+ *
+ * Random access galleries read only the requested blocks and load the next one in the background.
+ * A resident stream keeps the blocks of its first pass and serves later passes from memory.
+ */
+class BlockStream
+{
+    Gallery *gallery;
+    int begin, end;
+    bool randomAccess, resident, cached;
+    QList<TemplateList> blocks;
+    QList<int> ids;
+
+    // State of the current pass
+    int index, position, peekedId;
+    bool done, peeked;
+    TemplateList peekedBlock;
+    QFuture<TemplateList> next;
+    qint64 residentBytes; // Held by the kept blocks, when tracking memory
+
+    static TemplateList readBlockAt(Gallery *gallery, int block)
+    {
+        return gallery->readBlockAt(block);
+    }
+
+    bool readNext(TemplateList &templates, int *block)
+    {
+        if (peeked) {
+            peeked = false;
+            templates = peekedBlock;
+            peekedBlock.clear();
+            *block = peekedId;
+            return true;
+        }
+
+        if (randomAccess) {
+            if (index >= end) return false;
+            templates = next.result();
+            if (index+1 < end) next = QtConcurrent::run(readBlockAt, gallery, index+1);
+            *block = index++;
+            return true;
+        }
+
+        // Sequential galleries are read to the end so the next pass starts from the beginning
+        while (!done) {
+            templates = gallery->readBlock(&done);
+            const int i = index++;
+            if ((i >= begin) && (i < end)) {
+                *block = i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    BlockStream(Gallery *gallery, int begin, int end)
+        : gallery(gallery), begin(begin), end(end), resident(false), cached(false), peeked(false), residentBytes(0)
+    {
+        randomAccess = gallery->blockCount() >= 0;
+        if (randomAccess) this->end = qMin(end, gallery->blockCount());
+        rewind();
+    }
+
+    void setResident(bool resident)
+    {
+        this->resident = resident;
+    }
+
+    // Approximate size of a complete pass, from its first block which is kept for the pass
+    qint64 estimateBytes(int templates)
+    {
+        TemplateList first;
+        int block;
+        if (!readNext(first, &block) || first.isEmpty()) return 0;
+        peekedBlock = first;
+        peekedId = block;
+        peeked = true;
+
+        qint64 bytes = 0;
+        foreach (const Template &t, first)
+            foreach (const cv::Mat &m, t)
+                bytes += m.total() * m.elemSize();
+        return bytes * templates / first.size();
+    }
+
+    void rewind()
+    {
+        if (peeked) return; // The pass begun by estimateBytes() hasn't been read yet
+        position = 0;
+        index = randomAccess ? begin : 0;
+        done = false;
+        if (randomAccess && !cached && (begin < end)) next = QtConcurrent::run(readBlockAt, gallery, begin);
+    }
+
+    // Returns false at the end of the pass
+    bool read(TemplateList &templates, int *block)
+    {
+        if (cached) {
+            if (position >= blocks.size()) return false;
+            templates = blocks[position];
+            *block = ids[position];
+            position++;
+            return true;
+        }
+
+        if (!readNext(templates, block)) {
+            cached = resident;
+            return false;
+        }
+
+        if (resident) {
+            blocks.append(templates);
+            ids.append(*block);
+            if (Memory::enabled()) {
+                residentBytes += Profiler::bytes(templates);
+                Memory::hold("gallery " + gallery->file.name, residentBytes);
+            }
+        }
+        return true;
+    }
+};
+
+// Regroups or splits the gallery blocks of a BlockStream into blocks of size templates, numbered from zero.
+// Blocks of br::Context::blockSize pass through with their gallery block numbers.
+class BlockRegrouper
+{
+    BlockStream *stream;
+    const bool passThrough;
+    const int size;
+    TemplateList pending;
+    int index;
+    bool exhausted;
+
+public:
+    BlockRegrouper(BlockStream *stream, int size)
+        : stream(stream), passThrough(size == Globals->blockSize), size(size), index(0), exhausted(false) {}
+
+    void rewind()
+    {
+        stream->rewind();
+        pending.clear();
+        index = 0;
+        exhausted = false;
+    }
+
+    // Returns false at the end of the pass
+    bool read(TemplateList &templates, int *block)
+    {
+        if (passThrough) return stream->read(templates, block);
+
+        while (!exhausted && (pending.size() < size)) {
+            TemplateList next;
+            int ignored;
+            if (stream->read(next, &ignored)) pending.append(next);
+            else exhausted = true;
+        }
+        if (pending.isEmpty()) return false;
+
+        if (pending.size() <= size) {
+            templates = pending;
+            pending.clear();
+        } else {
+            templates = pending.mid(0, size);
+            pending = pending.mid(size);
+        }
+        *block = index++;
+        return true;
+    }
+};
+
+// Templates per compared block for templates of the given size, so that the blocks compared and read ahead on
+// both sides stay within a small share of br::Context::compareMemory, in whole tiles of br::Distance::compare().
+static int adaptiveBlockSize(qint64 bytesPerTemplate)
+{
+    if (!Globals->adaptiveBlockSize || (bytesPerTemplate <= 0)) return Globals->blockSize;
+    const qint64 bytes = qint64(Globals->compareMemory) * 1024 * 1024 / 16;
+    const int tile = 128;
+    qint64 size = std::min(qint64(4) * Globals->blockSize, bytes / bytesPerTemplate);
+    if (size >= tile) size -= size % tile;
+    return int(std::max(qint64(std::max(1, Globals->parallelism)), size));
+}
+
+// Keeps the pairs above the diagonal of a self-similarity matrix scoring at least threshold instead of the matrix
+class DuplicateOutput : public Output
+{
+    const float threshold;
+    QMutex mergesLock;
+
+public:
+    QList< QPair<int,int> > merges;
+
+    DuplicateOutput(float threshold)
+        : threshold(threshold) {}
+
+private:
+    void set(float value, int i, int j)
+    {
+        if ((j <= i) || (value < threshold)) return;
+        QMutexLocker locker(&mergesLock);
+        merges.append(qMakePair(i, j));
+    }
+
+    void setTile(const cv::Mat &scores, int i, int j)
+    {
+        QList< QPair<int,int> > found;
+        for (int k=0; k<scores.rows; k++) {
+            const float *row = scores.ptr<float>(k);
+            for (int l=std::max(0, i+k+1-j); l<scores.cols; l++)
+                if (row[l] >= threshold)
+                    found.append(qMakePair(i+k, j+l));
+        }
+        if (found.isEmpty()) return;
+        QMutexLocker locker(&mergesLock);
+        merges.append(found);
+    }
+};
+
 struct AlgorithmCore
 {
     QSharedPointer<Transform> transform;
     QSharedPointer<Distance> distance;
 
     AlgorithmCore(const QString &name)
+        : enrollingShard(false)
     {
         this->name = name;
         init(name);
     }
 
+    ~AlgorithmCore()
+    {
+        qDeleteAll(idleStreams);
+    }
+
+    // Returns a Stream wrapper around the algorithm's transform, reusing one returned by an earlier caller
+    Transform *takeStream()
+    {
+        {
+            QMutexLocker locker(&streamsLock);
+            if (!idleStreams.isEmpty()) return idleStreams.takeLast();
+        }
+
+        Transform *stream = Transform::make("Stream(Identity)", NULL);
+        WrapperTransform *wrapper = dynamic_cast<WrapperTransform *>(stream);
+        wrapper->transform = transform.data();
+        wrapper->init();
+        return stream;
+    }
+
+    void returnStream(Transform *stream)
+    {
+        QMutexLocker locker(&streamsLock);
+        idleStreams.append(stream);
+    }
+
     bool isClassifier() const
     {
         return distance.isNull();
@@ -42,6 +342,14 @@ struct AlgorithmCore
 
     void train(const File &input, const QString &model)
     {
+        // Across ranks a stored model is trained once, by rank 0, and loaded by the others
+        const bool distributed = (Distributed::size() > 1) && !model.isEmpty();
+        if (distributed && (Distributed::rank() != 0)) {
+            Distributed::barrier();
+            load(model);
+            return;
+        }
+
         qDebug("Training on %s%s", qPrintable(input.flat()),
                model.isEmpty() ? "" : qPrintable(" to " + model));
 
@@ -55,11 +363,12 @@ struct AlgorithmCore
         downcast->init();
 
         TemplateList data(TemplateList::fromGallery(input));
+        Memory::hold("gallery " + input.name, Profiler::bytes(data));
 
         if (transform.isNull()) qFatal("Null transform.");
         qDebug("%d Training Files", data.size());
 
-        Globals->startTime.start();
+        Progress progress("Training");
 
         qDebug("Training Enrollment");
         downcast->train(data);
@@ -77,11 +386,19 @@ struct AlgorithmCore
             store(model);
         }
 
-        qDebug("Training Time: %s", qPrintable(QtUtils::toTime(Globals->startTime.elapsed()/1000.0f)));
+        qDebug("Training Time: %s", qPrintable(QtUtils::toTime(progress.elapsed()/1000.0f)));
+        Memory::report("Training");
+        if (distributed) Distributed::barrier();
     }
 
     void store(const QString &model) const
     {
+        // Uncompressed models are sectioned so they can be memory-mapped and their stages loaded in parallel
+        if (QFileInfo(model).suffix() == "mapped") {
+            storeSections(model);
+            return;
+        }
+
         // Create stream
         QByteArray data;
         QDataStream out(&data, QFile::WriteOnly);
@@ -99,9 +416,22 @@ struct AlgorithmCore
 
     void load(const QString &model)
     {
-        // Load from file and decompress
+        QFile file(model);
         QByteArray data;
-        QtUtils::readFile(model, data, true);
+        bool sectioned = false;
+        const uchar *mapping = mapModel(file, &sectioned);
+        if (sectioned) {
+            loadSections(reinterpret_cast<const char*>(mapping), file.size());
+            return;
+        } else if (mapping) {
+            // Deserialize directly from the shared read-only mapping
+            qint64 size;
+            memcpy(&size, mapping + sizeof(MappedModelMagic), sizeof(size));
+            data = QByteArray::fromRawData(reinterpret_cast<const char*>(mapping) + MappedModelHeaderSize, int(size));
+        } else {
+            // Load from file and decompress
+            QtUtils::readFile(model, data, true);
+        }
 
         // Create stream
         QDataStream in(&data, QFile::ReadOnly);
@@ -113,6 +443,139 @@ struct AlgorithmCore
         if (hasDistance) distance->load(in);
     }
 
+    // The stages stored in sections of their own, which are the stages of a top-level pipeline
+    // that serializes nothing but its stages, otherwise the whole transform
+    QList<Transform*> sectionStages(bool *pipeline) const
+    {
+        *pipeline = false;
+        CompositeTransform *pipe = transform->inherits("br::PipeTransform") ? dynamic_cast<CompositeTransform*>(transform.data()) : NULL;
+        if (pipe == NULL) return QList<Transform*>() << transform.data();
+
+        int stored = 0;
+        for (int i=1; i<pipe->metaObject()->propertyCount(); i++)
+            if (pipe->metaObject()->property(i).isStored(pipe))
+                stored++;
+        if (stored != 1) return QList<Transform*>() << transform.data();
+
+        *pipeline = true;
+        return pipe->transforms;
+    }
+
+    // Magic, table size and table of sections, followed by the sections each aligned to ModelSectionAlignment.
+    // The first section names the algorithm, then come the stages and the distance.
+    void storeSections(const QString &model) const
+    {
+        QByteArray algorithm;
+        {
+            QDataStream out(&algorithm, QFile::WriteOnly);
+            out << name << !distance.isNull();
+        }
+
+        bool pipeline;
+        QList<const Object*> objects;
+        foreach (const Transform *stage, sectionStages(&pipeline))
+            objects.append(stage);
+        if (!distance.isNull()) objects.append(distance.data());
+
+        QList<QByteArray> payloads;
+        payloads.append(algorithm);
+        QList<ModelSection> sections;
+        sections.append(ModelSection());
+        sections.first().type = "br::Algorithm";
+        foreach (const Object *object, objects) {
+            QByteArray payload;
+            QDataStream out(&payload, QFile::WriteOnly);
+            object->store(out);
+            payloads.append(payload);
+            ModelSection section;
+            section.type = object->metaObject()->className();
+            sections.append(section);
+        }
+
+        // The table is written twice, first to learn its size and then with the final offsets
+        QByteArray table;
+        for (int pass=0; pass<2; pass++) {
+            qint64 offset = alignSection(sizeof(SectionedModelMagic) + sizeof(qint64) + table.size());
+            for (int i=0; i<sections.size(); i++) {
+                sections[i].offset = offset;
+                sections[i].size = payloads[i].size();
+                offset = alignSection(offset + sections[i].size);
+            }
+            table.clear();
+            QDataStream out(&table, QFile::WriteOnly);
+            out << sections;
+        }
+
+        QByteArray data(int(sections.last().offset + sections.last().size), 0);
+        const qint64 tableSize = table.size();
+        memcpy(data.data(), SectionedModelMagic, sizeof(SectionedModelMagic));
+        memcpy(data.data() + sizeof(SectionedModelMagic), &tableSize, sizeof(tableSize));
+        memcpy(data.data() + sizeof(SectionedModelMagic) + sizeof(tableSize), table.constData(), table.size());
+        for (int i=0; i<sections.size(); i++)
+            memcpy(data.data() + sections[i].offset, payloads[i].constData(), payloads[i].size());
+        QtUtils::writeFile(model, data, 0);
+    }
+
+    // Sections are deserialized straight from the mapping, sections of stages that store nothing are skipped.
+    // They are loaded one at a time since plugins like ProductQuantization register what they load in global tables.
+    void loadSections(const char *mapping, qint64 size)
+    {
+        qint64 tableSize;
+        memcpy(&tableSize, mapping + sizeof(SectionedModelMagic), sizeof(tableSize));
+        QByteArray table = QByteArray::fromRawData(mapping + sizeof(SectionedModelMagic) + sizeof(tableSize), int(tableSize));
+        QDataStream tableIn(&table, QFile::ReadOnly);
+        QList<ModelSection> sections;
+        tableIn >> sections;
+        if (sections.isEmpty()) qFatal("Empty model table.");
+        foreach (const ModelSection &section, sections)
+            if ((section.version > ModelSectionVersion) || (section.offset < 0) || (section.offset + section.size > size))
+                qFatal("Unsupported or truncated model section %s.", qPrintable(section.type));
+
+        QByteArray algorithm = QByteArray::fromRawData(mapping + sections.first().offset, int(sections.first().size));
+        QDataStream in(&algorithm, QFile::ReadOnly);
+        bool hasDistance;
+        in >> name >> hasDistance;
+        init(Globals->abbreviations.contains(name) ? Globals->abbreviations[name] : name);
+
+        bool pipeline;
+        QList<Object*> objects;
+        foreach (Transform *stage, sectionStages(&pipeline))
+            objects.append(stage);
+        if (hasDistance) objects.append(distance.data());
+        if (objects.size() != sections.size()-1)
+            qFatal("Model has %d sections but %s has %d stages.", sections.size()-1, qPrintable(name), objects.size());
+
+        for (int i=0; i<objects.size(); i++) {
+            const ModelSection &section = sections[i+1];
+            if (section.type != objects[i]->metaObject()->className())
+                qFatal("Model section %s does not match stage %s.", qPrintable(section.type), objects[i]->metaObject()->className());
+            if (section.size == 0) continue;
+            loadSection(objects[i], mapping + section.offset, section.size);
+        }
+
+        // As Object::load() would after loading the stages
+        if (pipeline) transform->init();
+    }
+
+    // Returns the memory-mapped contents of a model saved in an uncompressed format, or NULL
+    static const uchar *mapModel(QFile &file, bool *sectioned)
+    {
+        *sectioned = false;
+        if (!file.open(QFile::ReadOnly) || (file.size() < qint64(sizeof(SectionedModelMagic) + sizeof(qint64))))
+            return NULL;
+
+        char magic[sizeof(MappedModelMagic)];
+        if (file.read(magic, sizeof(magic)) != sizeof(magic))
+            return NULL;
+        *sectioned = !memcmp(magic, SectionedModelMagic, sizeof(magic));
+        if (!*sectioned && ((file.size() < MappedModelHeaderSize) || memcmp(magic, MappedModelMagic, sizeof(magic))))
+            return NULL;
+
+        const uchar *mapping = file.map(0, file.size());
+        if (mapping == NULL) qFatal("Unable to memory-map %s.", qPrintable(file.fileName()));
+        return mapping;
+    }
+
     File getMemoryGallery(const File &file) const
     {
         return name + file.baseName() + file.hash() + ".mem";
@@ -120,6 +583,9 @@ struct AlgorithmCore
 
     FileList enroll(File input, File gallery = File())
     {
+        if ((Distributed::size() > 1) && !enrollingShard && isIncremental(input) && !gallery.contains("append"))
+            return enrollDistributed(input, gallery);
+
         FileList files;
 
         qDebug("Enrolling %s%s", qPrintable(input.flat()),
@@ -129,73 +595,230 @@ struct AlgorithmCore
             if (input.name.isEmpty()) return FileList();
             else                      gallery = getMemoryGallery(input);
         }
-        TemplateList data(TemplateList::fromGallery(input));
-
+        QSet<QString> nameSet;
         if (gallery.contains("append"))
         {
             // Remove any templates which are already in the gallery
             QScopedPointer<Gallery> g(Gallery::make(gallery));
             files = g->files();
-            QSet<QString> nameSet = QSet<QString>::fromList(files.names());
+            nameSet = QSet<QString>::fromList(files.names());
+        }
+
+        // Stepped by the ProgressCounter in the enrollment pipe
+        Progress progress("Enrolling " + input.flat());
+
+        // Without options that need the whole list, the stream reads the gallery block by block as it enrolls,
+        // so enrollment starts with the first block and the stream runs once for the whole gallery
+        const bool incremental = isIncremental(input) && nameSet.isEmpty();
+        TemplateList data;
+        if (incremental) {
+            Template source(input);
+            source.file.set("ProgressScope", progress.id());
+            data.append(source);
+        } else {
+            data = TemplateList::fromGallery(input);
             for (int i = data.size() - 1; i>=0; i--) {
                 if (nameSet.contains(data[i].file.name))
                 {
                     data.removeAt(i);
                 }
             }
+            progress.addTotal(data.length());
         }
 
-        if (data.empty())
-            return files;
+        if (!data.empty()) {
+            // Trust me, this makes complete sense.
+            // We're just going to make a pipe with a placeholder first transform
+            QString pipeDesc = "Identity+GalleryOutput("+gallery.flat()+")+ProgressCounter("+QString::number(data.length())+","+QString::number(progress.id())+")+Discard";
+            QScopedPointer<Transform> basePipe(Transform::make(pipeDesc,NULL));
 
-        // Store steps for ProgressCounter
-        Globals->currentStep = 0;
-        Globals->totalSteps = data.length();
+            CompositeTransform * downcast = dynamic_cast<CompositeTransform *>(basePipe.data());
+            if (downcast == NULL)
+                qFatal("downcast failed?");
 
-        // Trust me, this makes complete sense.
-        // We're just going to make a pipe with a placeholder first transform
-        QString pipeDesc = "Identity+GalleryOutput("+gallery.flat()+")+ProgressCounter("+QString::number(data.length())+")+Discard";
-        QScopedPointer<Transform> basePipe(Transform::make(pipeDesc,NULL));
+            // replace that placeholder with the current algorithm
+            downcast->transforms[0] = this->transform.data();
 
-        CompositeTransform * downcast = dynamic_cast<CompositeTransform *>(basePipe.data());
-        if (downcast == NULL)
-            qFatal("downcast failed?");
+            // call init on the pipe to collapse the algorithm (if its top level is a pipe)
+            downcast->init();
 
-        // replace that placeholder with the current algorithm
-        downcast->transforms[0] = this->transform.data();
+            // Next, we make a Stream (with placeholder transform)
+            QString streamDesc = QString("Stream(Identity, readMode=%1)").arg(incremental ? "StreamGallery" : "DistributeFrames");
+            QScopedPointer<Transform> baseStream(Transform::make(streamDesc, NULL));
+            WrapperTransform *wrapper = dynamic_cast<WrapperTransform *> (baseStream.data());
 
-        // call init on the pipe to collapse the algorithm (if its top level is a pipe)
-        downcast->init();
+            // replace that placeholder with the pipe we built
+            wrapper->transform = downcast;
 
-        // Next, we make a Stream (with placeholder transform)
-        QString streamDesc = "Stream(Identity, readMode=DistributeFrames)";
-        QScopedPointer<Transform> baseStream(Transform::make(streamDesc, NULL));
-        WrapperTransform * wrapper = dynamic_cast<WrapperTransform *> (baseStream.data());
+            // and get the final stream's stages by reinterpreting the pipe. Perfectly straightforward.
+            wrapper->init();
 
-        // replace that placeholder with the pipe we built
-        wrapper->transform = downcast;
+            wrapper->projectUpdate(data,data);
+            Metrics::increment("br_templates_enrolled_total", data.size());
+            files.append(data.files());
+        }
 
-        // and get the final stream's stages by reinterpreting the pipe. Perfectly straightforward.
-        wrapper->init();
+        Memory::report("Enrollment");
+        return files;
+    }
+
+    // Each rank enrolls a contiguous share of the input, the shares are gathered in order into the gallery
+    FileList enrollDistributed(const File &input, File gallery)
+    {
+        if (gallery.name.isEmpty()) {
+            if (input.name.isEmpty()) return FileList();
+            else                      gallery = getMemoryGallery(input);
+        }
 
-        Globals->startTime.start();
+        const int count = TemplateList::fromGallery(input).size();
+        const int rank = Distributed::rank(), ranks = Distributed::size();
+        File shardInput = input;
+        shardInput.set("pos", int(qint64(count) * rank / ranks));
+        shardInput.set("length", int(qint64(count) * (rank+1) / ranks) - int(qint64(count) * rank / ranks));
+        const File shardGallery(getMemoryGallery(input).name + ".rank" + QString::number(rank) + ".mem");
 
-        wrapper->projectUpdate(data,data);
+        enrollingShard = true;
+        enroll(shardInput, shardGallery);
+        enrollingShard = false;
 
-        files.append(data.files());
+        QByteArray data;
+        {
+            QDataStream stream(&data, QFile::WriteOnly);
+            stream << static_cast< const QList<Template>& >(TemplateList::fromGallery(shardGallery));
+        }
+
+        // Memory galleries are needed by every rank, others are written once by rank 0
+        const bool all = (gallery.suffix() == "mem");
+        const QList<QByteArray> shards = Distributed::gather(data, all);
+        FileList files;
+        if (all || (rank == 0)) {
+            TemplateList templates;
+            foreach (const QByteArray &shard, shards) {
+                QList<Template> shardTemplates;
+                QDataStream stream(shard);
+                stream >> shardTemplates;
+                templates.append(shardTemplates);
+            }
+            for (int i=0; i<templates.size(); i++) {
+                templates[i].file.set("Index", i);
+                templates[i].file.set("Gallery", input.name);
+            }
 
+            QScopedPointer<Gallery> g(Gallery::make(gallery));
+            g->writeBlock(templates);
+            files = templates.files();
+        }
+
+        if (!all) {
+            Distributed::barrier();
+            if (rank != 0) {
+                QScopedPointer<Gallery> g(Gallery::make(gallery));
+                files = g->files();
+            }
+        }
         return files;
     }
 
+    // True if TemplateList::fromGallery(input) would return the blocks of a single gallery unchanged
+    static bool isIncremental(const File &input)
+    {
+        return (input.split().size() == 1) &&
+               (input.get<int>("pos", 0) == 0) &&
+               (input.get<int>("length", -1) == -1) &&
+               (input.get<int>("step", 1) <= 1) &&
+               !input.getBool("reduce") &&
+               (input.get<int>("crossValidate", 0) <= 0) &&
+               !input.getBool("leaveOneImageOut");
+    }
+
     void enroll(TemplateList &data)
     {
         if (transform.isNull()) qFatal("Null transform.");
         data >> *transform;
     }
 
+    void benchmark(const File &input, const QString &output)
+    {
+        if (transform.isNull()) qFatal("Null transform.");
+
+        // The sample is replicated to the requested size so small inputs like a single image still load the pipeline
+        const TemplateList sample = TemplateList::fromGallery(input);
+        if (sample.isEmpty()) qFatal("Empty benchmark input %s.", qPrintable(input.flat()));
+        const int count = input.get<int>("count", 64);
+        const int warmup = input.get<int>("warmup", 8);
+        TemplateList templates;
+        for (int i=0; i<count; i++)
+            templates.append(sample[i % sample.size()]);
+
+        QList<int> levels = input.getList<int>("parallelism", QList<int>());
+        if (levels.isEmpty()) levels.append(input.get<int>("parallelism", Globals->parallelism));
+        QStringList readModes = input.getList<QString>("readMode", QList<QString>());
+        if (readModes.isEmpty()) readModes.append(input.get<QString>("readMode", "Auto"));
+
+        const int parallelism = Globals->parallelism;
+        Profiler::setForced(true);
+        QStringList runs;
+        foreach (int level, levels) {
+            Globals->setProperty("parallelism", QString::number(level));
+            foreach (const QString &readMode, readModes) {
+                QScopedPointer<Transform> stream(Transform::make("Stream(Identity, readMode=" + readMode + ")", NULL));
+                WrapperTransform *wrapper = dynamic_cast<WrapperTransform *>(stream.data());
+                wrapper->transform = transform.data();
+                wrapper->init();
+
+                // Warm caches, lazily loaded SDKs and thread pools, then discard their timings
+                TemplateList warm = templates.mid(0, warmup);
+                if (!warm.isEmpty()) stream->projectUpdate(warm, warm);
+                Profiler::takeSummary();
+
+                TemplateList data = templates;
+                QElapsedTimer timer; timer.start();
+                stream->projectUpdate(data, data);
+                const double seconds = timer.nsecsElapsed() / 1e9;
+                const QString stages = Profiler::takeSummary();
+
+                // Latency of one template at a time through the algorithm, as a service request would see it
+                QList<double> latencies;
+                foreach (const Template &t, templates) {
+                    Template dst;
+                    timer.restart();
+                    transform->project(t, dst);
+                    latencies.append(timer.nsecsElapsed() / 1e6);
+                }
+                Profiler::takeSummary();
+                std::sort(latencies.begin(), latencies.end());
+
+                QStringList percentiles;
+                foreach (int p, QList<int>() << 50 << 90 << 99)
+                    percentiles.append(QString("\"p%1\":%2").arg(QString::number(p), QString::number(latencies[std::min(latencies.size()-1, p*latencies.size()/100)])));
+                percentiles.append("\"max\":" + QString::number(latencies.last()));
+
+                runs.append(QString("{\"parallelism\":%1,\"readMode\":%2,\"templates\":%3,\"seconds\":%4,\"templatesPerSecond\":%5,\"latencyMs\":{%6},\"stages\":%7}")
+                            .arg(QString::number(level), QtUtils::toJsonString(readMode), QString::number(count), QString::number(seconds),
+                                 QString::number(count / seconds), percentiles.join(","), stages));
+                qDebug("Benchmarked parallelism %d with readMode %s at %g templates/s", level, qPrintable(readMode), count / seconds);
+            }
+        }
+        Profiler::setForced(false);
+        Globals->setProperty("parallelism", QString::number(parallelism));
+
+        const QString json = QString("{\"algorithm\":%1,\"input\":%2,\"version\":%3,\"warmup\":%4,\"runs\":[\n%5\n]}\n")
+                             .arg(QtUtils::toJsonString(name), QtUtils::toJsonString(input.flat()), QtUtils::toJsonString(Context::version()), QString::number(warmup), runs.join(",\n"));
+        if (output.isEmpty()) {
+            printf("%s", qPrintable(json));
+        } else {
+            QFile file(output);
+            QtUtils::touchDir(file);
+            if (!file.open(QFile::WriteOnly))
+                qFatal("Unable to open %s for writing.", qPrintable(output));
+            file.write(qPrintable(json));
+            file.close();
+        }
+    }
+
     void retrieveOrEnroll(const File &file, QScopedPointer<Gallery> &gallery, FileList &galleryFiles)
     {
-        if (!file.getBool("enroll") && (QStringList() << "gal" << "mem" << "template").contains(file.suffix())) {
+        if (!file.getBool("enroll") && (QStringList() << "gal" << "cgal" << "zgal" << "mem" << "mmg" << "template").contains(file.suffix())) {
             // Retrieve it
             gallery.reset(Gallery::make(file));
             galleryFiles = gallery->files();
@@ -236,19 +859,15 @@ struct AlgorithmCore
         // Use a single file for one of the dimensions so that the output makes the right size file
         FileList dummyTarget;
         dummyTarget.append(targets[0]);
-        QScopedPointer<Output> realOutput(Output::make(output, dummyTarget, queryFiles));
-
-        // Some outputs assume Globals->blockSize is a real thing, of course we have no interest in it.
-        int old_block_size = Globals->blockSize;
-        Globals->blockSize = INT_MAX;
+        // Some outputs assume blocks are a real thing, of course we have no interest in them.
+        // The output gets a single block of its own instead of changing Globals->blockSize under concurrent requests.
+        QScopedPointer<Output> realOutput(Output::make(output, dummyTarget, queryFiles, INT_MAX));
         realOutput->setBlock(0,0);
         for (int i=0; i < queries.length(); i++)
         {
             float res = distance->compare(queries[i], targets[i]);
             realOutput->setRelative(res, 0,i);
         }
-
-        Globals->blockSize = old_block_size;
     }
 
     void compare(File targetGallery, File queryGallery, File output)
@@ -277,55 +896,285 @@ struct AlgorithmCore
         }
         else outputFiles.append(output);
 
+        // Target galleries can be sharded across nodes by contiguous ranges of target blocks,
+        // each node compares its shard and a final run merges the shard matrices into the output.
+        // Under MPI each rank compares one shard and rank 0 merges them as they are gathered.
+        const bool distributed = (Distributed::size() > 1) && !output.contains("shard") && !output.contains("merge") && partitionSizes.empty();
+        const int shards = distributed ? Distributed::size() : output.get<int>("shards", 1);
+        const int targetBlocks = (targetFiles.size() + Globals->blockSize - 1) / Globals->blockSize;
+        const FileList allTargetFiles = targetFiles;
+        int firstTargetBlock = 0, endTargetBlock = std::numeric_limits<int>::max();
+        if (output.contains("shard") || output.contains("merge")) {
+            if (!partitionSizes.empty()) qFatal("Sharded comparison does not support split outputs.");
+            if (shards < 1) qFatal("Invalid shard count %d.", shards);
+        }
+        if (output.contains("merge")) {
+            QScopedPointer<Output> merged(Output::make(output, targetFiles, queryFiles));
+            mergeShards(output.get<QString>("merge"), shards, targetBlocks, queryFiles.size(), targetFiles.size(), merged.data());
+            return;
+        }
+        if (output.contains("shard") || distributed) {
+            const int shard = distributed ? Distributed::rank() : output.get<int>("shard");
+            if ((shard < 0) || (shard >= shards)) qFatal("Shard %d out of range [0, %d).", shard, shards);
+            firstTargetBlock = shardBegin(shard, shards, targetBlocks);
+            endTargetBlock = shardBegin(shard+1, shards, targetBlocks);
+            targetFiles = targetFiles.mid(firstTargetBlock*Globals->blockSize, (endTargetBlock-firstTargetBlock)*Globals->blockSize);
+        }
+
+        if (distance.isNull()) qFatal("Null distance.");
+        BlockStream targetStream(t.data(), firstTargetBlock, endTargetBlock), queryStream(q.data(), 0, std::numeric_limits<int>::max());
+        const qint64 targetBytes = targetStream.estimateBytes(targetFiles.size()), queryBytes = queryStream.estimateBytes(queryFiles.size());
+
+        // Blocks are sized from the template footprint, except shards which are laid out in gallery blocks
+        const int blockSize = (distributed || output.contains("shard")) ? Globals->blockSize
+                              : adaptiveBlockSize(std::max(targetBytes / std::max(1, targetFiles.size()), queryBytes / std::max(1, queryFiles.size())));
+        if (blockSize != Globals->blockSize) qDebug("Comparing in blocks of %d templates", blockSize);
+
         QList<Output*> outputs;
-        foreach (const File &outputFile, outputFiles) outputs.append(Output::make(outputFile, targetFiles, queryFiles));
+        if (distributed) outputs.append(MatrixOutput::make(targetFiles, queryFiles));
+        else foreach (const File &outputFile, outputFiles) outputs.append(Output::make(outputFile, targetFiles, queryFiles, blockSize));
+        foreach (Output *o, outputs)
+            if (MatrixOutput *matrix = dynamic_cast<MatrixOutput*>(o))
+                Memory::hold("output " + o->file.name, qint64(matrix->data.total() * matrix->data.elemSize()));
+
+        Progress progress("Comparing", double(targetFiles.size()) * double(queryFiles.size()));
+
+        // Keep whichever side fits in memory resident so the other side is only read once
+        const qint64 budget = qint64(Globals->compareMemory) * 1024 * 1024;
+        bool targetsOuter = false;
+        if ((targetGallery.suffix() == "mmg") || (targetBytes <= budget)) {
+            targetStream.setResident(true);
+        } else if ((queryFiles.size() < targetFiles.size()) && ((queryGallery.suffix() == "mmg") || (queryBytes <= budget))) {
+            queryStream.setResident(true);
+            targetsOuter = true;
+        }
+        BlockRegrouper targets(&targetStream, blockSize), queries(&queryStream, blockSize);
+
+        // A symmetric self-comparison only compares the blocks on and above the diagonal and mirrors the rest
+        const bool symmetric = (queryGallery == targetGallery) && distance->symmetric() && !distributed &&
+                               !output.contains("shard") && partitionSizes.empty();
+
+        TemplateList targetBlock, queryBlock;
+        int targetIndex, queryIndex;
+        if (targetsOuter) {
+            while (targets.read(targetBlock, &targetIndex)) {
+                queries.rewind();
+                while (queries.read(queryBlock, &queryIndex))
+                    if (!symmetric || (targetIndex >= queryIndex))
+                        compareBlocks(targetBlock, queryBlock, partitionSizes, outputs, queryIndex, targetIndex - firstTargetBlock, &progress, symmetric && (targetIndex > queryIndex));
+            }
+        } else {
+            while (queries.read(queryBlock, &queryIndex)) {
+                targets.rewind();
+                while (targets.read(targetBlock, &targetIndex))
+                    if (!symmetric || (targetIndex >= queryIndex))
+                        compareBlocks(targetBlock, queryBlock, partitionSizes, outputs, queryIndex, targetIndex - firstTargetBlock, &progress, symmetric && (targetIndex > queryIndex));
+            }
+        }
 
+        if (distributed) {
+            // Rank 0 gathers one block of scores at a time from the rank that owns it and writes it into the output,
+            // so it never holds the whole matrix, every gather stays below MPI's int sized counts
+            // and each block is set exactly once, in the same order as an undistributed comparison
+            const cv::Mat &scores = static_cast<MatrixOutput*>(outputs.first())->data;
+            const int shard = Distributed::rank();
+            QScopedPointer<Output> merged(shard == 0 ? Output::make(output, allTargetFiles, queryFiles) : NULL);
+            for (int queryBlock=0; queryBlock*Globals->blockSize < queryFiles.size(); queryBlock++) {
+                const cv::Range rows(queryBlock*Globals->blockSize, qMin((queryBlock+1)*Globals->blockSize, queryFiles.size()));
+                for (int targetBlock=0; targetBlock<targetBlocks; targetBlock++) {
+                    cv::Mat tile;
+                    if ((targetBlock >= firstTargetBlock) && (targetBlock < endTargetBlock)) {
+                        const int column = (targetBlock - firstTargetBlock)*Globals->blockSize;
+                        tile = scores(rows, cv::Range(column, qMin(column+Globals->blockSize, scores.cols))).clone();
+                    }
+                    const QList<QByteArray> tiles = Distributed::gather(QByteArray::fromRawData((const char*)tile.data, int(tile.total() * tile.elemSize())));
+                    if (merged.isNull()) continue;
+                    const int owner = ownerShard(targetBlock, shards, targetBlocks);
+                    const int columns = qMin((targetBlock+1)*Globals->blockSize, allTargetFiles.size()) - targetBlock*Globals->blockSize;
+                    merged->setBlock(queryBlock, targetBlock);
+                    merged->setRelativeTile(cv::Mat(rows.size(), columns, CV_32FC1, const_cast<char*>(tiles[owner].constData())), 0, 0);
+                }
+            }
+        }
+
+        qDeleteAll(outputs);
+
+        // Comparisons per second of wall time, and per thread of the pool that ran them
+        const double speed = progress.rate();
+        if (!Globals->quiet && (progress.total() > 1)) fprintf(stderr, "\rSPEED=%.1e  PER_THREAD=%.1e  \n", speed, speed / std::max(1, QThreadPool::globalInstance()->maxThreadCount()));
+        Memory::report("Comparison");
+    }
+
+    Clusters deduplicate(const File &input, float threshold, const QString &csv)
+    {
+        qDebug("Deduplicating %s", qPrintable(input.flat()));
+
+        QScopedPointer<Gallery> t, q;
+        FileList files;
+        retrieveOrEnroll(input, t, files);
+        retrieveOrEnroll(input, q, files);
         if (distance.isNull()) qFatal("Null distance.");
-        Globals->currentStep = 0;
-        Globals->totalSteps = double(targetFiles.size()) * double(queryFiles.size());
-        Globals->startTime.start();
 
-        int queryBlock = -1;
-        bool queryDone = false;
-        while (!queryDone) {
-            queryBlock++;
-            TemplateList queries = q->readBlock(&queryDone);
+        DuplicateOutput output(threshold);
+        output.initialize(files, files);
+        QList<Output*> outputs;
+        outputs.append(&output);
+
+        // Only the blocks on and above the diagonal are compared
+        BlockStream targetStream(t.data(), 0, std::numeric_limits<int>::max()), queryStream(q.data(), 0, std::numeric_limits<int>::max());
+        const qint64 bytes = targetStream.estimateBytes(files.size());
+        const qint64 budget = qint64(Globals->compareMemory) * 1024 * 1024;
+        if ((input.suffix() == "mmg") || (bytes <= budget))
+            targetStream.setResident(true);
+        const int blockSize = adaptiveBlockSize(bytes / std::max(1, files.size()));
+        output.blockSize = blockSize;
+        BlockRegrouper targets(&targetStream, blockSize), queries(&queryStream, blockSize);
+
+        double comparisons = 0;
+        for (int begin=0; begin<files.size(); begin+=blockSize)
+            comparisons += double(std::min(blockSize, files.size()-begin)) * double(files.size()-begin);
+        Progress progress("Deduplicating", comparisons);
+
+        TemplateList targetBlock, queryBlock;
+        int targetIndex, queryIndex;
+        while (queries.read(queryBlock, &queryIndex)) {
+            targets.rewind();
+            while (targets.read(targetBlock, &targetIndex))
+                if (targetIndex >= queryIndex)
+                    compareBlocks(targetBlock, queryBlock, QList<int>(), outputs, queryIndex, targetIndex, &progress);
+        }
+
+        const Clusters clusters = MergeClusters(files.size(), output.merges);
+        if (!Globals->quiet) fprintf(stderr, "\r%d duplicate pairs merge %d templates into %d clusters\n", output.merges.size(), files.size(), clusters.size());
+        if (!csv.isEmpty()) WriteClusters(clusters, csv);
+        return clusters;
+    }
 
-            QList<TemplateList> queryPartitions;
-            if (!partitionSizes.empty()) queryPartitions = queries.partition(partitionSizes);
-            else queryPartitions.append(queries);
+private:
+    QString name;
+    QMutex streamsLock;
+    QList<Transform*> idleStreams;
+    bool enrollingShard;
 
+    // Mirrored blocks are also written transposed as block (targetBlock, queryBlock)
+    void compareBlocks(const TemplateList &targets, const TemplateList &queries, const QList<int> &partitionSizes,
+                       const QList<Output*> &outputs, int queryBlock, int targetBlock, Progress *progress, bool mirror = false)
+    {
+        if (mirror) {
+            QScopedPointer<MatrixOutput> scores(MatrixOutput::make(targets.files(), queries.files()));
+            {
+                Metrics::Timer metric("br_compare_block_seconds");
+                distance->compare(targets, queries, scores.data());
+            }
+            const cv::Mat transposed = scores->data.t();
+            foreach (Output *output, outputs) {
+                output->setBlock(queryBlock, targetBlock);
+                output->setRelativeTile(scores->data, 0, 0);
+                output->setBlock(targetBlock, queryBlock);
+                output->setRelativeTile(transposed, 0, 0);
+            }
+            Metrics::increment("br_comparisons_total", double(targets.size()) * double(queries.size()));
+
+            progress->step(2 * double(targets.size()) * double(queries.size()));
+            Globals->printStatus();
+            return;
+        }
+
+        QList<TemplateList> queryPartitions, targetPartitions;
+        if (!partitionSizes.empty()) {
+            queryPartitions = queries.partition(partitionSizes);
+            targetPartitions = targets.partition(partitionSizes);
+        } else {
+            queryPartitions.append(queries);
+            targetPartitions.append(targets);
+        }
+
+        {
+            Metrics::Timer metric("br_compare_block_seconds");
             for (int i=0; i<queryPartitions.size(); i++) {
-                int targetBlock = -1;
-                bool targetDone = false;
-                while (!targetDone) {
-                    targetBlock++;
+                outputs[i]->setBlock(queryBlock, targetBlock);
+                distance->compare(targetPartitions[i], queryPartitions[i], outputs[i]);
+            }
+        }
+        Metrics::increment("br_comparisons_total", double(targets.size()) * double(queries.size()));
 
-                    TemplateList targets = t->readBlock(&targetDone);
+        progress->step(double(targets.size()) * double(queries.size()));
+        Globals->printStatus();
+    }
 
-                    QList<TemplateList> targetPartitions;
-                    if (!partitionSizes.empty()) targetPartitions = targets.partition(partitionSizes);
-                    else targetPartitions.append(targets);
+    static int shardBegin(int shard, int shards, int targetBlocks)
+    {
+        return int(qint64(shard) * targetBlocks / shards);
+    }
 
-                    outputs[i]->setBlock(queryBlock, targetBlock);
+    // The shard whose range of target blocks contains targetBlock
+    static int ownerShard(int targetBlock, int shards, int targetBlocks)
+    {
+        int shard = 0;
+        while (shardBegin(shard+1, shards, targetBlocks) <= targetBlock)
+            shard++;
+        return shard;
+    }
 
-                    distance->compare(targetPartitions[i], queryPartitions[i], outputs[i]);
+    static int shardColumns(int shard, int shards, int targetBlocks, int targets)
+    {
+        return qMin(shardBegin(shard+1, shards, targetBlocks)*Globals->blockSize, targets) - shardBegin(shard, shards, targetBlocks)*Globals->blockSize;
+    }
 
-                    Globals->currentStep += double(targets.size()) * double(queries.size());
-                    Globals->printStatus();
-                }
-            }
+    // Replays the shard similarity matrices block by block into output, in the same order as compare()
+    static void mergeShards(const QString &shardName, int shards, int targetBlocks, int queries, int targets, Output *output)
+    {
+        if (!shardName.contains("%1")) qFatal("Shard file name missing shard number place marker (%%1)");
+
+        QList< QSharedPointer<QFile> > files;
+        QList<cv::Mat> matrices;
+        for (int shard=0; shard<shards; shard++) {
+            const int columns = shardColumns(shard, shards, targetBlocks, targets);
+            QSharedPointer<QFile> file(new QFile(shardName.arg(shard)));
+            if (!file->open(QFile::ReadOnly)) qFatal("Unable to open %s for reading.", qPrintable(file->fileName()));
+            if (!file->readLine().startsWith("S2")) qFatal("Shard %s is not a similarity matrix.", qPrintable(file->fileName()));
+            file->readLine();
+            file->readLine();
+            const QStringList words = QString(file->readLine()).split(" ");
+            if ((words.size() < 3) || (words[0] != "MF") || (words[1].toInt() != queries) || (words[2].toInt() != columns))
+                qFatal("Shard %s should be a %dx%d MF matrix.", qPrintable(file->fileName()), queries, columns);
+
+            // Mapped rather than read so only one block row of each shard is resident at a time
+            const qint64 bytes = qint64(queries) * columns * sizeof(float);
+            uchar *data = bytes > 0 ? file->map(file->pos(), bytes) : NULL;
+            if ((bytes > 0) && (data == NULL)) qFatal("Unable to map %s.", qPrintable(file->fileName()));
+            matrices.append(cv::Mat(queries, columns, CV_32FC1, data));
+            files.append(file);
         }
 
-        qDeleteAll(outputs);
+        replayShards(matrices, shards, targetBlocks, queries, output);
+    }
 
-        const float speed = 1000 * Globals->totalSteps / Globals->startTime.elapsed() / std::max(1, abs(Globals->parallelism));
-        if (!Globals->quiet && (Globals->totalSteps > 1)) fprintf(stderr, "\rSPEED=%.1e  \n", speed);
-        Globals->totalSteps = 0;
+    // Writes the shard similarity matrices block by block into output
+    static void replayShards(const QList<cv::Mat> &matrices, int shards, int targetBlocks, int queries, Output *output)
+    {
+        for (int queryBlock=0; queryBlock*Globals->blockSize < queries; queryBlock++) {
+            const cv::Range rows(queryBlock*Globals->blockSize, qMin((queryBlock+1)*Globals->blockSize, queries));
+            QList<cv::Mat> band;
+            foreach (const cv::Mat &matrix, matrices)
+                band.append(matrix.rowRange(rows));
+            replayRows(band, shards, targetBlocks, queryBlock, output);
+        }
     }
 
-private:
-    QString name;
+    // Replays query block queryBlock from each shard's matrix of its rows
+    static void replayRows(const QList<cv::Mat> &matrices, int shards, int targetBlocks, int queryBlock, Output *output)
+    {
+        for (int shard=0; shard<shards; shard++) {
+            const int firstTargetBlock = shardBegin(shard, shards, targetBlocks);
+            for (int targetBlock=firstTargetBlock; targetBlock<shardBegin(shard+1, shards, targetBlocks); targetBlock++) {
+                const int column = (targetBlock - firstTargetBlock)*Globals->blockSize;
+                const cv::Range columns(column, qMin(column+Globals->blockSize, matrices[shard].cols));
+                output->setBlock(queryBlock, targetBlock);
+                output->setRelativeTile(matrices[shard].colRange(columns), 0, 0);
+            }
+        }
+    }
 
     QString getFileName(const QString &description) const
     {
@@ -367,37 +1216,89 @@ class AlgorithmManager : public Initializer
 {
     Q_OBJECT
 
+    typedef QHash<QString, QSharedPointer<AlgorithmCore> > Registry;
+
+    // Each thread's most recent lookup, checked before the registry.
+    // Weak so a thread that looked an algorithm up doesn't keep its core, or the SDK contexts it holds, alive past finalize.
+    struct LastLookup
+    {
+        QString algorithm;
+        QWeakPointer<AlgorithmCore> algorithmCore;
+        int generation;
+        LastLookup() : generation(-1) {}
+    };
+
 public:
-    static QHash<QString, QSharedPointer<AlgorithmCore> > algorithms;
+    // Readers load the published registry without locking, it is never modified once published.
+    // Writers copy it, insert, and publish the copy under algorithmsLock.
+    static QAtomicPointer<const Registry> registry;
+    static QList<const Registry*> snapshots; // Every published registry, freed by finalize
     static QMutex algorithmsLock;
+    static QAtomicInt generation; // Invalidates LastLookups when algorithms are finalized
+    static QThreadStorage<LastLookup*> lastLookups;
 
     void initialize() const {}
 
     void finalize() const
     {
-        algorithms.clear();
+        QMutexLocker locker(&algorithmsLock);
+        registry.storeRelease(NULL);
+        qDeleteAll(snapshots);
+        snapshots.clear();
+        generation.ref();
+        if (lastLookups.hasLocalData())
+            lastLookups.localData()->algorithmCore.clear();
     }
 
     static QSharedPointer<AlgorithmCore> getAlgorithm(const QString &algorithm)
     {
         if (algorithm.isEmpty()) qFatal("No default algorithm set.");
 
-        if (!algorithms.contains(algorithm)) {
+        if (!lastLookups.hasLocalData())
+            lastLookups.setLocalData(new LastLookup());
+        LastLookup *lastLookup = lastLookups.localData();
+        if ((lastLookup->generation == generation.load()) && (lastLookup->algorithm == algorithm)) {
+            const QSharedPointer<AlgorithmCore> algorithmCore = lastLookup->algorithmCore.toStrongRef();
+            if (!algorithmCore.isNull()) return algorithmCore;
+        }
+
+        const int currentGeneration = generation.load();
+        QSharedPointer<AlgorithmCore> result = lookup(algorithm);
+        if (result.isNull()) {
             // Some algorithms are recursive, so we need to construct them outside the lock.
             QSharedPointer<AlgorithmCore> algorithmCore(new AlgorithmCore(algorithm));
 
-            algorithmsLock.lock();
-            if (!algorithms.contains(algorithm))
-                algorithms.insert(algorithm, algorithmCore);
-            algorithmsLock.unlock();
+            QMutexLocker locker(&algorithmsLock);
+            result = lookup(algorithm);
+            if (result.isNull()) {
+                const Registry *current = registry.loadAcquire();
+                Registry *next = (current == NULL) ? new Registry() : new Registry(*current);
+                next->insert(algorithm, algorithmCore);
+                snapshots.append(next);
+                registry.storeRelease(next);
+                result = algorithmCore;
+            }
         }
 
-        return algorithms[algorithm];
+        lastLookup->algorithm = algorithm;
+        lastLookup->algorithmCore = result;
+        lastLookup->generation = currentGeneration;
+        return result;
+    }
+
+private:
+    static QSharedPointer<AlgorithmCore> lookup(const QString &algorithm)
+    {
+        const Registry *current = registry.loadAcquire();
+        return (current == NULL) ? QSharedPointer<AlgorithmCore>() : current->value(algorithm);
     }
 };
 
-QHash<QString, QSharedPointer<AlgorithmCore> > AlgorithmManager::algorithms;
+QAtomicPointer<const AlgorithmManager::Registry> AlgorithmManager::registry;
+QList<const AlgorithmManager::Registry*> AlgorithmManager::snapshots;
 QMutex AlgorithmManager::algorithmsLock;
+QAtomicInt AlgorithmManager::generation;
+QThreadStorage<AlgorithmManager::LastLookup*> AlgorithmManager::lastLookups;
 
 BR_REGISTER(Initializer, AlgorithmManager)
 
@@ -435,11 +1336,49 @@ void br::CompareTemplateLists(const TemplateList &target, const TemplateList &qu
     dist->compare(target, query, output);
 }
 
+Clusters br::Deduplicate(const File &gallery, float threshold, const QString &csv)
+{
+    return AlgorithmManager::getAlgorithm(gallery.get<QString>("algorithm"))->deduplicate(gallery, threshold, csv);
+}
+
 void br::PairwiseCompare(const File &targetGallery, const File &queryGallery, const File &output)
 {
     AlgorithmManager::getAlgorithm(output.get<QString>("algorithm"))->pairwiseCompare(targetGallery, queryGallery, output);
 }
 
+void br::Benchmark(const File &input, const File &output)
+{
+    AlgorithmManager::getAlgorithm(output.get<QString>("algorithm"))->benchmark(input, output.name);
+}
+
+struct GalleryBlock
+{
+    TemplateList templates;
+    bool done;
+};
+
+static GalleryBlock readGalleryBlock(Gallery *gallery)
+{
+    GalleryBlock block;
+    block.templates = gallery->readBlock(&block.done);
+    return block;
+}
+
+// Copies the blocks of source to destination in order, reading the next block on the thread pool while the calling thread writes one,
+// so destinations that are not thread-safe are only ever written from the thread that made them.
+// Every block read is written, even an empty last one, so an empty source still creates the destination.
+static void copyBlocks(Gallery *source, Gallery *destination)
+{
+    QFuture<GalleryBlock> reading = QtConcurrent::run(readGalleryBlock, source);
+    bool done = false;
+    while (!done) {
+        const GalleryBlock block = reading.result();
+        done = block.done;
+        if (!done) reading = QtConcurrent::run(readGalleryBlock, source);
+        destination->writeBlock(block.templates);
+    }
+}
+
 void br::Convert(const File &fileType, const File &inputFile, const File &outputFile)
 {
     qDebug("Converting %s %s to %s", qPrintable(fileType.flat()), qPrintable(inputFile.flat()), qPrintable(outputFile.flat()));
@@ -451,13 +1390,13 @@ void br::Convert(const File &fileType, const File &inputFile, const File &output
     } else if (fileType == "Gallery") {
         QScopedPointer<Gallery> before(Gallery::make(inputFile));
         QScopedPointer<Gallery> after(Gallery::make(outputFile));
-        bool done = false;
-        while (!done) after->writeBlock(before->readBlock(&done));
+        copyBlocks(before.data(), after.data());
     } else if (fileType == "Output") {
-        QString target, query;
-        cv::Mat m = BEE::readMat(inputFile, &target, &query);
-        const FileList targetFiles = TemplateList::fromGallery(target).files();
-        const FileList queryFiles = TemplateList::fromGallery(query).files();
+        const BEE::MappedMatrix mapped(inputFile);
+        const cv::Mat &m = mapped.m;
+        const float sign = mapped.negate ? -1 : 1;
+        const FileList targetFiles = TemplateList::fromGallery(mapped.targetSigset).files();
+        const FileList queryFiles = TemplateList::fromGallery(mapped.querySigset).files();
 
         if ((targetFiles.size() != m.cols || queryFiles.size() != m.rows)
             && (m.cols != 1 || targetFiles.size() != m.rows || queryFiles.size() != m.rows))
@@ -471,12 +1410,27 @@ void br::Convert(const File &fileType, const File &inputFile, const File &output
             MatrixOutput   * mOut = dynamic_cast<MatrixOutput *>(o.data());
             if (mOut)
                 mOut->data.create(queryFiles.size(), 1, CV_32FC1);
+
+            o->setBlock(0,0);
+            for (int i=0; i < m.rows; i++)
+                for (int j=0; j < m.cols; j++)
+                    o->setRelative(sign*m.at<float>(i,j), i, j);
+            return;
         }
 
-        o->setBlock(0,0);
-        for (int i=0; i < m.rows; i++)
-            for (int j=0; j < m.cols; j++)
-                o->setRelative(m.at<float>(i,j), i, j);
+        // Block by block in the order compare() uses, so outputs that stream blocks hold one at a time,
+        // each copied as a tile rather than score by score
+        const int blockSize = o->blockSize;
+        cv::Mat tile;
+        for (int rowBlock=0; qint64(rowBlock)*blockSize < m.rows; rowBlock++) {
+            const cv::Range rows(rowBlock*blockSize, int(qMin(qint64(rowBlock+1)*blockSize, qint64(m.rows))));
+            for (int columnBlock=0; qint64(columnBlock)*blockSize < m.cols; columnBlock++) {
+                const cv::Range columns(columnBlock*blockSize, int(qMin(qint64(columnBlock+1)*blockSize, qint64(m.cols))));
+                m(rows, columns).convertTo(tile, CV_32F, sign);
+                o->setBlock(rowBlock, columnBlock);
+                o->setRelativeTile(tile, 0, 0);
+            }
+        }
     } else {
         qFatal("Unrecognized file type %s.", qPrintable(fileType.flat()));
     }
@@ -491,23 +1445,27 @@ void br::Cat(const QStringList &inputGalleries, const QString &outputGallery)
     QScopedPointer<Gallery> og(Gallery::make(outputGallery));
     foreach (const QString &inputGallery, inputGalleries) {
         QScopedPointer<Gallery> ig(Gallery::make(inputGallery));
-        bool done = false;
-        while (!done) og->writeBlock(ig->readBlock(&done));
+        copyBlocks(ig.data(), og.data());
     }
 }
 
+// Returns a stream wrapper to its algorithm when the last reference to it is released.
+// Holding the algorithm also keeps the wrapped transform alive while the stream is in use.
+struct StreamRecycler
+{
+    QSharedPointer<AlgorithmCore> algorithmCore;
+    StreamRecycler(const QSharedPointer<AlgorithmCore> &algorithmCore_) : algorithmCore(algorithmCore_) {}
+    void operator()(Transform *stream) const { algorithmCore->returnStream(stream); }
+};
+
 QSharedPointer<br::Transform> br::Transform::fromAlgorithm(const QString &algorithm, bool preprocess)
 {
     if (!preprocess)
         return AlgorithmManager::getAlgorithm(algorithm)->transform;
-    else {
-        QSharedPointer<Transform> orig_tform = AlgorithmManager::getAlgorithm(algorithm)->transform;
-        QSharedPointer<Transform> newRoot = QSharedPointer<Transform>(Transform::make("Stream(Identity)", NULL));
-        WrapperTransform * downcast = dynamic_cast<WrapperTransform *> (newRoot.data());
-        downcast->transform = orig_tform.data();
-        downcast->init();
-        return newRoot;
-    }
+
+    // Stream wrappers are built once per concurrent user and recycled, instead of per call
+    const QSharedPointer<AlgorithmCore> algorithmCore = AlgorithmManager::getAlgorithm(algorithm);
+    return QSharedPointer<Transform>(algorithmCore->takeStream(), StreamRecycler(algorithmCore));
 }
 
 QSharedPointer<br::Distance> br::Distance::fromAlgorithm(const QString &algorithm)
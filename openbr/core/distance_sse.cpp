@@ -0,0 +1,741 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <stdlib.h>
+#include <string.h>
+#include "distance_sse.h"
+#include "simd.h"
+
+// Kernels for wider instruction sets are compiled individually with BR_TARGET and selected at runtime
+
+typedef float (*L1Function)(const uchar *a, const uchar *b, int size);
+
+static inline int l1Scalar(const uchar *a, const uchar *b, int size)
+{
+    int distance = 0;
+    for (int i=0; i<size; i++)
+        distance += abs(a[i]-b[i]);
+    return distance;
+}
+
+static inline int packedL1Scalar(const uchar *a, const uchar *b, int size)
+{
+    int distance = 0;
+    for (int i=0; i<size; i++)
+        distance += abs((a[i] & 0x0F) - (b[i] & 0x0F)) +
+                    abs((a[i] >> 4)   - (b[i] >> 4));
+    return distance;
+}
+
+static inline int popcount64(quint64 x)
+{
+    x = x - ((x >> 1) & Q_UINT64_C(0x5555555555555555));
+    x = (x & Q_UINT64_C(0x3333333333333333)) + ((x >> 2) & Q_UINT64_C(0x3333333333333333));
+    x = (x + (x >> 4)) & Q_UINT64_C(0x0F0F0F0F0F0F0F0F);
+    return (x * Q_UINT64_C(0x0101010101010101)) >> 56;
+}
+
+static inline int hammingScalar(const uchar *a, const uchar *b, int size)
+{
+    int distance = 0;
+    int i = 0;
+    for (; i+8<=size; i+=8) {
+        quint64 A, B;
+        memcpy(&A, a+i, 8);
+        memcpy(&B, b+i, 8);
+        distance += popcount64(A ^ B);
+    }
+    for (; i<size; i++)
+        distance += popcount64(a[i] ^ b[i]);
+    return distance;
+}
+
+#ifndef BR_NEON
+
+static float hammingGeneric(const uchar *a, const uchar *b, int size)
+{
+    return hammingScalar(a, b, size);
+}
+
+static float l1Generic(const uchar *a, const uchar *b, int size)
+{
+    return l1Scalar(a, b, size);
+}
+
+static float packedL1Generic(const uchar *a, const uchar *b, int size)
+{
+    return packedL1Scalar(a, b, size);
+}
+
+#endif // BR_NEON
+
+#ifdef BR_X86
+
+BR_TARGET("sse2")
+static float l1SSE2(const uchar *a, const uchar *b, int size)
+{
+    __m128i accumulate = _mm_setzero_si128();
+    int i = 0;
+    for (; i+16<=size; i+=16) {
+        const __m128i A = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i));
+        const __m128i B = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b+i));
+        accumulate = _mm_add_epi64(accumulate, _mm_sad_epu8(A, B));
+    }
+
+    qint64 buff[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(buff), accumulate);
+    return buff[0] + buff[1] + l1Scalar(a+i, b+i, size-i);
+}
+
+BR_TARGET("sse2")
+static float packedL1SSE2(const uchar *a, const uchar *b, int size)
+{
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    __m128i accumulate = _mm_setzero_si128();
+    int i = 0;
+    for (; i+16<=size; i+=16) {
+        const __m128i A = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i));
+        const __m128i B = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b+i));
+        const __m128i low = _mm_sad_epu8(_mm_and_si128(A, mask), _mm_and_si128(B, mask));
+        const __m128i high = _mm_sad_epu8(_mm_and_si128(_mm_srli_epi16(A, 4), mask), _mm_and_si128(_mm_srli_epi16(B, 4), mask));
+        accumulate = _mm_add_epi64(accumulate, _mm_add_epi64(low, high));
+    }
+
+    qint64 buff[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(buff), accumulate);
+    return buff[0] + buff[1] + packedL1Scalar(a+i, b+i, size-i);
+}
+
+BR_TARGET("avx2")
+static float l1AVX2(const uchar *a, const uchar *b, int size)
+{
+    __m256i accumulate = _mm256_setzero_si256();
+    int i = 0;
+    for (; i+32<=size; i+=32) {
+        const __m256i A = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a+i));
+        const __m256i B = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b+i));
+        accumulate = _mm256_add_epi64(accumulate, _mm256_sad_epu8(A, B));
+    }
+
+    qint64 buff[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(buff), accumulate);
+    return buff[0] + buff[1] + buff[2] + buff[3] + l1Scalar(a+i, b+i, size-i);
+}
+
+BR_TARGET("avx2")
+static float packedL1AVX2(const uchar *a, const uchar *b, int size)
+{
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    __m256i accumulate = _mm256_setzero_si256();
+    int i = 0;
+    for (; i+32<=size; i+=32) {
+        const __m256i A = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a+i));
+        const __m256i B = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b+i));
+        const __m256i low = _mm256_sad_epu8(_mm256_and_si256(A, mask), _mm256_and_si256(B, mask));
+        const __m256i high = _mm256_sad_epu8(_mm256_and_si256(_mm256_srli_epi16(A, 4), mask), _mm256_and_si256(_mm256_srli_epi16(B, 4), mask));
+        accumulate = _mm256_add_epi64(accumulate, _mm256_add_epi64(low, high));
+    }
+
+    qint64 buff[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(buff), accumulate);
+    return buff[0] + buff[1] + buff[2] + buff[3] + packedL1Scalar(a+i, b+i, size-i);
+}
+
+BR_TARGET("avx512f,avx512bw")
+static float l1AVX512(const uchar *a, const uchar *b, int size)
+{
+    __m512i accumulate = _mm512_setzero_si512();
+    int i = 0;
+    for (; i+64<=size; i+=64) {
+        const __m512i A = _mm512_loadu_si512(a+i);
+        const __m512i B = _mm512_loadu_si512(b+i);
+        accumulate = _mm512_add_epi64(accumulate, _mm512_sad_epu8(A, B));
+    }
+
+    qint64 buff[8];
+    _mm512_storeu_si512(buff, accumulate);
+    return buff[0] + buff[1] + buff[2] + buff[3] + buff[4] + buff[5] + buff[6] + buff[7] + l1Scalar(a+i, b+i, size-i);
+}
+
+BR_TARGET("avx512f,avx512bw")
+static float packedL1AVX512(const uchar *a, const uchar *b, int size)
+{
+    const __m512i mask = _mm512_set1_epi8(0x0F);
+    __m512i accumulate = _mm512_setzero_si512();
+    int i = 0;
+    for (; i+64<=size; i+=64) {
+        const __m512i A = _mm512_loadu_si512(a+i);
+        const __m512i B = _mm512_loadu_si512(b+i);
+        const __m512i low = _mm512_sad_epu8(_mm512_and_si512(A, mask), _mm512_and_si512(B, mask));
+        const __m512i high = _mm512_sad_epu8(_mm512_and_si512(_mm512_srli_epi16(A, 4), mask), _mm512_and_si512(_mm512_srli_epi16(B, 4), mask));
+        accumulate = _mm512_add_epi64(accumulate, _mm512_add_epi64(low, high));
+    }
+
+    qint64 buff[8];
+    _mm512_storeu_si512(buff, accumulate);
+    return buff[0] + buff[1] + buff[2] + buff[3] + buff[4] + buff[5] + buff[6] + buff[7] + packedL1Scalar(a+i, b+i, size-i);
+}
+
+// Aligned variants require 64-byte aligned inputs whose size is a multiple of 64 bytes, so they need no unaligned loads or scalar tail
+
+BR_TARGET("sse2")
+static float l1AlignedSSE2(const uchar *a, const uchar *b, int size)
+{
+    __m128i accumulate = _mm_setzero_si128();
+    for (int i=0; i<size; i+=16)
+        accumulate = _mm_add_epi64(accumulate, _mm_sad_epu8(_mm_load_si128(reinterpret_cast<const __m128i*>(a+i)),
+                                                            _mm_load_si128(reinterpret_cast<const __m128i*>(b+i))));
+
+    qint64 buff[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(buff), accumulate);
+    return buff[0] + buff[1];
+}
+
+BR_TARGET("sse2")
+static float packedL1AlignedSSE2(const uchar *a, const uchar *b, int size)
+{
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    __m128i accumulate = _mm_setzero_si128();
+    for (int i=0; i<size; i+=16) {
+        const __m128i A = _mm_load_si128(reinterpret_cast<const __m128i*>(a+i));
+        const __m128i B = _mm_load_si128(reinterpret_cast<const __m128i*>(b+i));
+        const __m128i low = _mm_sad_epu8(_mm_and_si128(A, mask), _mm_and_si128(B, mask));
+        const __m128i high = _mm_sad_epu8(_mm_and_si128(_mm_srli_epi16(A, 4), mask), _mm_and_si128(_mm_srli_epi16(B, 4), mask));
+        accumulate = _mm_add_epi64(accumulate, _mm_add_epi64(low, high));
+    }
+
+    qint64 buff[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(buff), accumulate);
+    return buff[0] + buff[1];
+}
+
+BR_TARGET("avx2")
+static float l1AlignedAVX2(const uchar *a, const uchar *b, int size)
+{
+    __m256i accumulate = _mm256_setzero_si256();
+    for (int i=0; i<size; i+=32)
+        accumulate = _mm256_add_epi64(accumulate, _mm256_sad_epu8(_mm256_load_si256(reinterpret_cast<const __m256i*>(a+i)),
+                                                                  _mm256_load_si256(reinterpret_cast<const __m256i*>(b+i))));
+
+    qint64 buff[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(buff), accumulate);
+    return buff[0] + buff[1] + buff[2] + buff[3];
+}
+
+BR_TARGET("avx2")
+static float packedL1AlignedAVX2(const uchar *a, const uchar *b, int size)
+{
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    __m256i accumulate = _mm256_setzero_si256();
+    for (int i=0; i<size; i+=32) {
+        const __m256i A = _mm256_load_si256(reinterpret_cast<const __m256i*>(a+i));
+        const __m256i B = _mm256_load_si256(reinterpret_cast<const __m256i*>(b+i));
+        const __m256i low = _mm256_sad_epu8(_mm256_and_si256(A, mask), _mm256_and_si256(B, mask));
+        const __m256i high = _mm256_sad_epu8(_mm256_and_si256(_mm256_srli_epi16(A, 4), mask), _mm256_and_si256(_mm256_srli_epi16(B, 4), mask));
+        accumulate = _mm256_add_epi64(accumulate, _mm256_add_epi64(low, high));
+    }
+
+    qint64 buff[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(buff), accumulate);
+    return buff[0] + buff[1] + buff[2] + buff[3];
+}
+
+BR_TARGET("avx512f,avx512bw")
+static float l1AlignedAVX512(const uchar *a, const uchar *b, int size)
+{
+    __m512i accumulate = _mm512_setzero_si512();
+    for (int i=0; i<size; i+=64)
+        accumulate = _mm512_add_epi64(accumulate, _mm512_sad_epu8(_mm512_load_si512(a+i), _mm512_load_si512(b+i)));
+    return _mm512_reduce_add_epi64(accumulate);
+}
+
+BR_TARGET("avx512f,avx512bw")
+static float packedL1AlignedAVX512(const uchar *a, const uchar *b, int size)
+{
+    const __m512i mask = _mm512_set1_epi8(0x0F);
+    __m512i accumulate = _mm512_setzero_si512();
+    for (int i=0; i<size; i+=64) {
+        const __m512i A = _mm512_load_si512(a+i);
+        const __m512i B = _mm512_load_si512(b+i);
+        const __m512i low = _mm512_sad_epu8(_mm512_and_si512(A, mask), _mm512_and_si512(B, mask));
+        const __m512i high = _mm512_sad_epu8(_mm512_and_si512(_mm512_srli_epi16(A, 4), mask), _mm512_and_si512(_mm512_srli_epi16(B, 4), mask));
+        accumulate = _mm512_add_epi64(accumulate, _mm512_add_epi64(low, high));
+    }
+    return _mm512_reduce_add_epi64(accumulate);
+}
+
+BR_TARGET("popcnt")
+static float hammingPOPCNT(const uchar *a, const uchar *b, int size)
+{
+    qint64 distance = 0;
+    int i = 0;
+#if defined(__x86_64__) || defined(_M_X64)
+    for (; i+8<=size; i+=8) {
+        quint64 A, B;
+        memcpy(&A, a+i, 8);
+        memcpy(&B, b+i, 8);
+        distance += _mm_popcnt_u64(A ^ B);
+    }
+#else
+    for (; i+4<=size; i+=4) {
+        quint32 A, B;
+        memcpy(&A, a+i, 4);
+        memcpy(&B, b+i, 4);
+        distance += _mm_popcnt_u32(A ^ B);
+    }
+#endif
+    return distance + hammingScalar(a+i, b+i, size-i);
+}
+
+BR_TARGET("avx512f,avx512vpopcntdq")
+static float hammingAVX512(const uchar *a, const uchar *b, int size)
+{
+    __m512i accumulate = _mm512_setzero_si512();
+    int i = 0;
+    for (; i+64<=size; i+=64)
+        accumulate = _mm512_add_epi64(accumulate, _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_loadu_si512(a+i), _mm512_loadu_si512(b+i))));
+    return _mm512_reduce_add_epi64(accumulate) + hammingScalar(a+i, b+i, size-i);
+}
+
+BR_TARGET("avx512f,avx512vpopcntdq")
+static float hammingAlignedAVX512(const uchar *a, const uchar *b, int size)
+{
+    __m512i accumulate = _mm512_setzero_si512();
+    for (int i=0; i<size; i+=64)
+        accumulate = _mm512_add_epi64(accumulate, _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_load_si512(a+i), _mm512_load_si512(b+i))));
+    return _mm512_reduce_add_epi64(accumulate);
+}
+
+// Fixed size variants of the aligned kernels for the registered sizes of deployed templates, see fixed_l1()
+#if defined(__clang__)
+#  define BR_UNROLL _Pragma("unroll")
+#elif defined(__GNUC__)
+#  define BR_UNROLL _Pragma("GCC unroll 64")
+#else
+#  define BR_UNROLL
+#endif
+
+template <int Size>
+BR_TARGET("sse2")
+static float l1FixedSSE2(const uchar *a, const uchar *b)
+{
+    __m128i accumulate = _mm_setzero_si128();
+    BR_UNROLL
+    for (int i=0; i<Size; i+=16)
+        accumulate = _mm_add_epi64(accumulate, _mm_sad_epu8(_mm_load_si128(reinterpret_cast<const __m128i*>(a+i)),
+                                                            _mm_load_si128(reinterpret_cast<const __m128i*>(b+i))));
+
+    qint64 buff[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(buff), accumulate);
+    return buff[0] + buff[1];
+}
+
+template <int Size>
+BR_TARGET("sse2")
+static float packedL1FixedSSE2(const uchar *a, const uchar *b)
+{
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    __m128i accumulate = _mm_setzero_si128();
+    BR_UNROLL
+    for (int i=0; i<Size; i+=16) {
+        const __m128i A = _mm_load_si128(reinterpret_cast<const __m128i*>(a+i));
+        const __m128i B = _mm_load_si128(reinterpret_cast<const __m128i*>(b+i));
+        const __m128i low = _mm_sad_epu8(_mm_and_si128(A, mask), _mm_and_si128(B, mask));
+        const __m128i high = _mm_sad_epu8(_mm_and_si128(_mm_srli_epi16(A, 4), mask), _mm_and_si128(_mm_srli_epi16(B, 4), mask));
+        accumulate = _mm_add_epi64(accumulate, _mm_add_epi64(low, high));
+    }
+
+    qint64 buff[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(buff), accumulate);
+    return buff[0] + buff[1];
+}
+
+template <int Size>
+BR_TARGET("avx2")
+static float l1FixedAVX2(const uchar *a, const uchar *b)
+{
+    __m256i accumulate = _mm256_setzero_si256();
+    BR_UNROLL
+    for (int i=0; i<Size; i+=32)
+        accumulate = _mm256_add_epi64(accumulate, _mm256_sad_epu8(_mm256_load_si256(reinterpret_cast<const __m256i*>(a+i)),
+                                                                  _mm256_load_si256(reinterpret_cast<const __m256i*>(b+i))));
+
+    qint64 buff[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(buff), accumulate);
+    return buff[0] + buff[1] + buff[2] + buff[3];
+}
+
+template <int Size>
+BR_TARGET("avx2")
+static float packedL1FixedAVX2(const uchar *a, const uchar *b)
+{
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    __m256i accumulate = _mm256_setzero_si256();
+    BR_UNROLL
+    for (int i=0; i<Size; i+=32) {
+        const __m256i A = _mm256_load_si256(reinterpret_cast<const __m256i*>(a+i));
+        const __m256i B = _mm256_load_si256(reinterpret_cast<const __m256i*>(b+i));
+        const __m256i low = _mm256_sad_epu8(_mm256_and_si256(A, mask), _mm256_and_si256(B, mask));
+        const __m256i high = _mm256_sad_epu8(_mm256_and_si256(_mm256_srli_epi16(A, 4), mask), _mm256_and_si256(_mm256_srli_epi16(B, 4), mask));
+        accumulate = _mm256_add_epi64(accumulate, _mm256_add_epi64(low, high));
+    }
+
+    qint64 buff[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(buff), accumulate);
+    return buff[0] + buff[1] + buff[2] + buff[3];
+}
+
+template <int Size>
+BR_TARGET("avx512f,avx512bw")
+static float l1FixedAVX512(const uchar *a, const uchar *b)
+{
+    __m512i accumulate = _mm512_setzero_si512();
+    BR_UNROLL
+    for (int i=0; i<Size; i+=64)
+        accumulate = _mm512_add_epi64(accumulate, _mm512_sad_epu8(_mm512_load_si512(a+i), _mm512_load_si512(b+i)));
+    return _mm512_reduce_add_epi64(accumulate);
+}
+
+template <int Size>
+BR_TARGET("avx512f,avx512bw")
+static float packedL1FixedAVX512(const uchar *a, const uchar *b)
+{
+    const __m512i mask = _mm512_set1_epi8(0x0F);
+    __m512i accumulate = _mm512_setzero_si512();
+    BR_UNROLL
+    for (int i=0; i<Size; i+=64) {
+        const __m512i A = _mm512_load_si512(a+i);
+        const __m512i B = _mm512_load_si512(b+i);
+        const __m512i low = _mm512_sad_epu8(_mm512_and_si512(A, mask), _mm512_and_si512(B, mask));
+        const __m512i high = _mm512_sad_epu8(_mm512_and_si512(_mm512_srli_epi16(A, 4), mask), _mm512_and_si512(_mm512_srli_epi16(B, 4), mask));
+        accumulate = _mm512_add_epi64(accumulate, _mm512_add_epi64(low, high));
+    }
+    return _mm512_reduce_add_epi64(accumulate);
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+template <int Size>
+BR_TARGET("popcnt")
+static float hammingFixedPOPCNT(const uchar *a, const uchar *b)
+{
+    qint64 distance = 0;
+    BR_UNROLL
+    for (int i=0; i<Size; i+=8)
+        distance += _mm_popcnt_u64(*reinterpret_cast<const quint64*>(a+i) ^ *reinterpret_cast<const quint64*>(b+i));
+    return distance;
+}
+#endif
+
+template <int Size>
+BR_TARGET("avx512f,avx512vpopcntdq")
+static float hammingFixedAVX512(const uchar *a, const uchar *b)
+{
+    __m512i accumulate = _mm512_setzero_si512();
+    BR_UNROLL
+    for (int i=0; i<Size; i+=64)
+        accumulate = _mm512_add_epi64(accumulate, _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_load_si512(a+i), _mm512_load_si512(b+i))));
+    return _mm512_reduce_add_epi64(accumulate);
+}
+
+// The registered sizes, in bytes of 64-byte aligned rows: 256-bit and 512-bit codes, and 128 to 1024-byte feature vectors
+#define BR_FIXED_SIZES(KERNEL)          \
+    switch (size) {                     \
+      case 64:   return KERNEL<64>;     \
+      case 128:  return KERNEL<128>;    \
+      case 256:  return KERNEL<256>;    \
+      case 512:  return KERNEL<512>;    \
+      case 768:  return KERNEL<768>;    \
+      case 1024: return KERNEL<1024>;   \
+      default:   return NULL;           \
+    }
+
+enum InstructionSet { Generic, SSE2, AVX2, AVX512 };
+
+static InstructionSet detectInstructionSet()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    const bool sse2 = (info[3] & (1 << 26)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!osxsave || (maxLeaf < 7)) return sse2 ? SSE2 : Generic;
+
+    const unsigned long long xcr0 = _xgetbv(0);
+    __cpuidex(info, 7, 0);
+    const bool avx2 = ((info[1] & (1 << 5)) != 0) && ((xcr0 & 0x06) == 0x06);
+    const bool avx512 = ((info[1] & (1 << 16)) != 0) && ((info[1] & (1 << 30)) != 0) && ((xcr0 & 0xE6) == 0xE6);
+    return avx512 ? AVX512 : (avx2 ? AVX2 : (sse2 ? SSE2 : Generic));
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) return AVX512;
+    if (__builtin_cpu_supports("avx2"))     return AVX2;
+    if (__builtin_cpu_supports("sse2"))     return SSE2;
+    return Generic;
+#endif
+}
+
+static const InstructionSet instructionSet = detectInstructionSet();
+
+// Population count instructions are detected separately, VPOPCNTDQ is not implied by AVX-512BW
+enum PopcountSet { GenericPopcount, POPCNT, VPOPCNTDQ };
+
+static PopcountSet detectPopcountSet()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    const bool popcnt = (info[2] & (1 << 23)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!osxsave || (maxLeaf < 7)) return popcnt ? POPCNT : GenericPopcount;
+
+    const unsigned long long xcr0 = _xgetbv(0);
+    __cpuidex(info, 7, 0);
+    const bool vpopcntdq = ((info[1] & (1 << 16)) != 0) && ((info[2] & (1 << 14)) != 0) && ((xcr0 & 0xE6) == 0xE6);
+    return vpopcntdq ? VPOPCNTDQ : (popcnt ? POPCNT : GenericPopcount);
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vpopcntdq")) return VPOPCNTDQ;
+    if (__builtin_cpu_supports("popcnt"))          return POPCNT;
+    return GenericPopcount;
+#endif
+}
+
+static const PopcountSet popcountSet = detectPopcountSet();
+
+static L1Function selectHamming()
+{
+    switch (popcountSet) {
+      case VPOPCNTDQ: return hammingAVX512;
+      case POPCNT:    return hammingPOPCNT;
+      default:        return hammingGeneric;
+    }
+}
+
+static L1Function selectAlignedHamming()
+{
+    switch (popcountSet) {
+      case VPOPCNTDQ: return hammingAlignedAVX512;
+      case POPCNT:    return hammingPOPCNT;
+      default:        return hammingGeneric;
+    }
+}
+
+static L1Function selectL1()
+{
+    switch (instructionSet) {
+      case AVX512: return l1AVX512;
+      case AVX2:   return l1AVX2;
+      case SSE2:   return l1SSE2;
+      default:     return l1Generic;
+    }
+}
+
+static L1Function selectPackedL1()
+{
+    switch (instructionSet) {
+      case AVX512: return packedL1AVX512;
+      case AVX2:   return packedL1AVX2;
+      case SSE2:   return packedL1SSE2;
+      default:     return packedL1Generic;
+    }
+}
+
+static L1Function selectAlignedL1()
+{
+    switch (instructionSet) {
+      case AVX512: return l1AlignedAVX512;
+      case AVX2:   return l1AlignedAVX2;
+      case SSE2:   return l1AlignedSSE2;
+      default:     return l1Generic;
+    }
+}
+
+static L1Function selectAlignedPackedL1()
+{
+    switch (instructionSet) {
+      case AVX512: return packedL1AlignedAVX512;
+      case AVX2:   return packedL1AlignedAVX2;
+      case SSE2:   return packedL1AlignedSSE2;
+      default:     return packedL1Generic;
+    }
+}
+
+static FixedL1Function selectFixedL1(int size)
+{
+    switch (instructionSet) {
+      case AVX512: BR_FIXED_SIZES(l1FixedAVX512)
+      case AVX2:   BR_FIXED_SIZES(l1FixedAVX2)
+      case SSE2:   BR_FIXED_SIZES(l1FixedSSE2)
+      default:     return NULL;
+    }
+}
+
+static FixedL1Function selectFixedPackedL1(int size)
+{
+    switch (instructionSet) {
+      case AVX512: BR_FIXED_SIZES(packedL1FixedAVX512)
+      case AVX2:   BR_FIXED_SIZES(packedL1FixedAVX2)
+      case SSE2:   BR_FIXED_SIZES(packedL1FixedSSE2)
+      default:     return NULL;
+    }
+}
+
+static FixedL1Function selectFixedHamming(int size)
+{
+    switch (popcountSet) {
+      case VPOPCNTDQ: BR_FIXED_SIZES(hammingFixedAVX512)
+#if defined(__x86_64__) || defined(_M_X64)
+      case POPCNT:    BR_FIXED_SIZES(hammingFixedPOPCNT)
+#endif
+      default:        return NULL;
+    }
+}
+
+const char *l1InstructionSet()
+{
+    switch (instructionSet) {
+      case AVX512: return "AVX-512BW";
+      case AVX2:   return "AVX2";
+      case SSE2:   return "SSE2";
+      default:     return "Generic";
+    }
+}
+
+#elif defined(BR_NEON)
+
+static float l1NEON(const uchar *a, const uchar *b, int size)
+{
+    uint32x4_t accumulate = vdupq_n_u32(0);
+    int i = 0;
+    for (; i+16<=size; i+=16)
+        accumulate = vpadalq_u16(accumulate, vpaddlq_u8(vabdq_u8(vld1q_u8(a+i), vld1q_u8(b+i))));
+
+    const uint64x2_t sum = vpaddlq_u32(accumulate);
+    return vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1) + l1Scalar(a+i, b+i, size-i);
+}
+
+static float packedL1NEON(const uchar *a, const uchar *b, int size)
+{
+    const uint8x16_t mask = vdupq_n_u8(0x0F);
+    uint32x4_t accumulate = vdupq_n_u32(0);
+    int i = 0;
+    for (; i+16<=size; i+=16) {
+        const uint8x16_t A = vld1q_u8(a+i);
+        const uint8x16_t B = vld1q_u8(b+i);
+        // Each nibble difference is at most 15, so their sum fits in a byte
+        const uint8x16_t difference = vaddq_u8(vabdq_u8(vandq_u8(A, mask), vandq_u8(B, mask)),
+                                               vabdq_u8(vshrq_n_u8(A, 4), vshrq_n_u8(B, 4)));
+        accumulate = vpadalq_u16(accumulate, vpaddlq_u8(difference));
+    }
+
+    const uint64x2_t sum = vpaddlq_u32(accumulate);
+    return vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1) + packedL1Scalar(a+i, b+i, size-i);
+}
+
+static float hammingNEON(const uchar *a, const uchar *b, int size)
+{
+    uint32x4_t accumulate = vdupq_n_u32(0);
+    int i = 0;
+    for (; i+16<=size; i+=16)
+        accumulate = vpadalq_u16(accumulate, vpaddlq_u8(vcntq_u8(veorq_u8(vld1q_u8(a+i), vld1q_u8(b+i)))));
+
+    const uint64x2_t sum = vpaddlq_u32(accumulate);
+    return vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1) + hammingScalar(a+i, b+i, size-i);
+}
+
+static L1Function selectL1()       { return l1NEON; }
+static L1Function selectPackedL1() { return packedL1NEON; }
+static L1Function selectAlignedL1()       { return l1NEON; }
+static L1Function selectAlignedPackedL1() { return packedL1NEON; }
+const char *l1InstructionSet()     { return "NEON"; }
+static L1Function selectHamming()        { return hammingNEON; }
+static L1Function selectAlignedHamming() { return hammingNEON; }
+static FixedL1Function selectFixedL1(int)       { return NULL; }
+static FixedL1Function selectFixedPackedL1(int) { return NULL; }
+static FixedL1Function selectFixedHamming(int)  { return NULL; }
+
+#else
+
+static L1Function selectL1()       { return l1Generic; }
+static L1Function selectPackedL1() { return packedL1Generic; }
+static L1Function selectAlignedL1()       { return l1Generic; }
+static L1Function selectAlignedPackedL1() { return packedL1Generic; }
+const char *l1InstructionSet()     { return "Generic"; }
+static L1Function selectHamming()        { return hammingGeneric; }
+static L1Function selectAlignedHamming() { return hammingGeneric; }
+static FixedL1Function selectFixedL1(int)       { return NULL; }
+static FixedL1Function selectFixedPackedL1(int) { return NULL; }
+static FixedL1Function selectFixedHamming(int)  { return NULL; }
+
+#endif
+
+static const L1Function l1Kernel = selectL1();
+static const L1Function packedL1Kernel = selectPackedL1();
+static const L1Function alignedL1Kernel = selectAlignedL1();
+static const L1Function alignedPackedL1Kernel = selectAlignedPackedL1();
+static const L1Function hammingKernel = selectHamming();
+static const L1Function alignedHammingKernel = selectAlignedHamming();
+
+float l1(const uchar *a, const uchar *b, int size)
+{
+    return l1Kernel(a, b, size);
+}
+
+float packed_l1(const uchar *a, const uchar *b, int size)
+{
+    return packedL1Kernel(a, b, size);
+}
+
+float aligned_l1(const uchar *a, const uchar *b, int size)
+{
+    return alignedL1Kernel(a, b, size);
+}
+
+float aligned_packed_l1(const uchar *a, const uchar *b, int size)
+{
+    return alignedPackedL1Kernel(a, b, size);
+}
+
+float hamming(const uchar *a, const uchar *b, int size)
+{
+    return hammingKernel(a, b, size);
+}
+
+float aligned_hamming(const uchar *a, const uchar *b, int size)
+{
+    return alignedHammingKernel(a, b, size);
+}
+
+FixedL1Function fixed_l1(int size)
+{
+    return selectFixedL1(size);
+}
+
+FixedL1Function fixed_packed_l1(int size)
+{
+    return selectFixedPackedL1(size);
+}
+
+FixedL1Function fixed_hamming(int size)
+{
+    return selectFixedHamming(size);
+}
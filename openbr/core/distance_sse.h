@@ -19,9 +19,9 @@
 
 #include <QDebug>
 
-#ifdef __SSE__
+#ifdef __SSE2__
 
-#include <xmmintrin.h>
+#include <emmintrin.h>
 
 inline QDebug operator<<(QDebug dbg, const __m128i &p)
 {
@@ -31,45 +31,69 @@ inline QDebug operator<<(QDebug dbg, const __m128i &p)
     return dbg.space();
 }
 
-inline float l1(const uchar *a, const uchar *b, int size)
-{
-    size = size / sizeof(__m128i);
-    __m128i accumulate = _mm_setzero_si128();
-
-    for (int i=0; i<size; i++) {
-        __m128i A = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a)+i);
-        __m128i B = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b)+i);
-        __m128i sad = _mm_sad_epu8(A, B);
-        accumulate = _mm_add_epi64(sad, accumulate);
-    }
-
-    int64_t buff[2];
-    _mm_storeu_si128(reinterpret_cast<__m128i*>(&buff), accumulate);
-    return buff[0] + buff[1];
-}
+#endif // __SSE2__
 
-#else
+/*!
+ * \brief L1 distance between two byte vectors of length \em size.
+ *
+ * Dispatches at runtime to the widest of AVX-512BW, AVX2, SSE2 or NEON supported by the processor.
+ */
+float l1(const uchar *a, const uchar *b, int size);
 
-inline float l1(const uchar *a, const uchar *b, int size)
-{
-    int distance = 0;
-    for (int i=0; i<size; i++)
-        distance += abs(a[i]-b[i]);
-    return distance;
-}
+/*!
+ * \brief L1 distance between two vectors of \em size bytes, each byte holding two 4-bit values.
+ *
+ * Dispatches at runtime like l1().
+ */
+float packed_l1(const uchar *a, const uchar *b, int size);
 
-#endif
+/*!
+ * \brief l1() for 64-byte aligned vectors whose \em size is a multiple of 64 bytes.
+ */
+float aligned_l1(const uchar *a, const uchar *b, int size);
 
-inline float packed_l1(const uchar *a, const uchar *b, int size)
-{
-    static const uchar low_mask = 0x0F;
-    static const uchar hi_mask = 0xF0;
-
-    int distance = 0;
-    for (int i=0; i<size; i++)
-        distance += (abs((a[i] & low_mask) - (b[i] & low_mask)) >> 0) +
-                    (abs((a[i] & hi_mask)  - (b[i] & hi_mask))  >> 4);
-    return distance;
-}
+/*!
+ * \brief packed_l1() for 64-byte aligned vectors whose \em size is a multiple of 64 bytes.
+ */
+float aligned_packed_l1(const uchar *a, const uchar *b, int size);
+
+/*!
+ * \brief Name of the instruction set selected by l1() and packed_l1().
+ */
+const char *l1InstructionSet();
+
+/*!
+ * \brief Hamming distance between two bit vectors of \em size bytes.
+ *
+ * Dispatches at runtime to AVX-512 VPOPCNTDQ, POPCNT or NEON when supported by the processor.
+ */
+float hamming(const uchar *a, const uchar *b, int size);
+
+/*!
+ * \brief hamming() for 64-byte aligned vectors whose \em size is a multiple of 64 bytes.
+ */
+float aligned_hamming(const uchar *a, const uchar *b, int size);
+
+/*!
+ * \brief Distance between two 64-byte aligned vectors of a size fixed when the kernel was compiled.
+ */
+typedef float (*FixedL1Function)(const uchar *a, const uchar *b);
+
+/*!
+ * \brief aligned_l1() specialized for vectors of \em size bytes, or \c NULL if that size has no fully unrolled kernel.
+ *
+ * Kernels are compiled for 64, 128, 256, 512, 768 and 1024 bytes, the padded sizes of common binary codes and feature vectors.
+ */
+FixedL1Function fixed_l1(int size);
+
+/*!
+ * \brief aligned_packed_l1() specialized like fixed_l1().
+ */
+FixedL1Function fixed_packed_l1(int size);
+
+/*!
+ * \brief aligned_hamming() specialized like fixed_l1().
+ */
+FixedL1Function fixed_hamming(int size);
 
 #endif // DISTANCE_SSE_H
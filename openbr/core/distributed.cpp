@@ -0,0 +1,121 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QString>
+#include <QVector>
+#include <limits>
+#ifdef BR_DISTRIBUTED
+#include <mpi.h>
+#endif
+
+#include "distributed.h"
+
+#ifdef BR_DISTRIBUTED
+
+static bool Initialized = false;
+
+void Distributed::initialize(int &argc, char *argv[])
+{
+    int initialized;
+    MPI_Initialized(&initialized);
+    if (!initialized) {
+        MPI_Init(&argc, &argv);
+        Initialized = true;
+    }
+}
+
+void Distributed::finalize()
+{
+    if (!Initialized) return;
+    MPI_Finalize();
+    Initialized = false;
+}
+
+int Distributed::rank()
+{
+    if (!Initialized) return 0;
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    return rank;
+}
+
+int Distributed::size()
+{
+    if (!Initialized) return 1;
+    int size;
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    return size;
+}
+
+void Distributed::barrier()
+{
+    if (Initialized) MPI_Barrier(MPI_COMM_WORLD);
+}
+
+void Distributed::abort()
+{
+    if (Initialized) MPI_Abort(MPI_COMM_WORLD, 1);
+}
+
+QList<QByteArray> Distributed::gather(const QByteArray &data, bool all)
+{
+    if (size() == 1) return QList<QByteArray>() << data;
+
+    int bytes = data.size();
+    QVector<int> sizes(size()), offsets(size());
+    if (all) MPI_Allgather(&bytes, 1, MPI_INT, sizes.data(), 1, MPI_INT, MPI_COMM_WORLD);
+    else     MPI_Gather(&bytes, 1, MPI_INT, sizes.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    // MPI counts and QByteArray sizes are ints
+    qint64 total = 0;
+    for (int i=0; i<sizes.size(); i++) {
+        offsets[i] = int(total);
+        total += sizes[i];
+    }
+    if ((all || (rank() == 0)) && (total > std::numeric_limits<int>::max()))
+        qFatal("Gathering %s bytes exceeds the 2 GiB limit.", qPrintable(QString::number(total)));
+
+    QByteArray buffer((all || (rank() == 0)) ? int(total) : 0, 0);
+    if (all) MPI_Allgatherv(const_cast<char*>(data.constData()), bytes, MPI_BYTE, buffer.data(), sizes.data(), offsets.data(), MPI_BYTE, MPI_COMM_WORLD);
+    else     MPI_Gatherv(const_cast<char*>(data.constData()), bytes, MPI_BYTE, buffer.data(), sizes.data(), offsets.data(), MPI_BYTE, 0, MPI_COMM_WORLD);
+
+    QList<QByteArray> gathered;
+    if (all || (rank() == 0))
+        for (int i=0; i<sizes.size(); i++)
+            gathered.append(buffer.mid(offsets[i], sizes[i]));
+    return gathered;
+}
+
+#else // BR_DISTRIBUTED
+
+void Distributed::initialize(int &argc, char *argv[])
+{
+    (void) argc; (void) argv;
+}
+
+void Distributed::finalize() {}
+int Distributed::rank() { return 0; }
+int Distributed::size() { return 1; }
+void Distributed::barrier() {}
+void Distributed::abort() {}
+
+QList<QByteArray> Distributed::gather(const QByteArray &data, bool all)
+{
+    (void) all;
+    return QList<QByteArray>() << data;
+}
+
+#endif // BR_DISTRIBUTED
@@ -0,0 +1,40 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_DISTRIBUTED_H
+#define BR_DISTRIBUTED_H
+
+#include <QByteArray>
+#include <QList>
+
+/*!
+ * \brief MPI execution across ranks, enabled by building with \c BR_DISTRIBUTED and launching \c br with \c mpirun.
+ *
+ * Every rank runs the same command line.
+ * Without \c BR_DISTRIBUTED, or when launched without \c mpirun, there is a single rank and every call is trivial.
+ */
+namespace Distributed
+{
+    void initialize(int &argc, char *argv[]); /*!< \brief Calls \c MPI_Init, from br::Context::initialize. */
+    void finalize(); /*!< \brief Calls \c MPI_Finalize, from br::Context::finalize. */
+    int rank(); /*!< \brief Index of this process, \c 0 without MPI. */
+    int size(); /*!< \brief Number of processes, \c 1 without MPI. */
+    void barrier(); /*!< \brief Waits until every rank reaches the barrier. */
+    void abort(); /*!< \brief Terminates every rank, called on \c qFatal so the other ranks don't wait forever on this one. */
+    QList<QByteArray> gather(const QByteArray &data, bool all = false); /*!< \brief Every rank's \em data in rank order on rank \c 0, or on every rank if \em all, empty elsewhere. Together they must stay below 2 GiB. */
+}
+
+#endif // BR_DISTRIBUTED_H
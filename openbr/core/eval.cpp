@@ -14,6 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
+#include <QtConcurrentMap>
+#include <QtConcurrentRun>
 #include "bee.h"
 #include "eval.h"
 #include "openbr/core/common.h"
@@ -97,8 +100,14 @@ float Evaluate(const QString &simmat, const QString &mask, const QString &csv)
     // Read similarity matrix
     QString target, query;
     Mat scores;
+    QScopedPointer<BEE::MappedMatrix> mapped;
     if (simmat.endsWith(".mtx")) {
-        scores = BEE::readMat(simmat, &target, &query);
+        // Similarity scores are evaluated straight from the mapping
+        mapped.reset(new BEE::MappedMatrix(simmat));
+        target = mapped->targetSigset;
+        query = mapped->querySigset;
+        if (mapped->negate) scores = -mapped->m;
+        else                scores = mapped->m;
     } else {
         QScopedPointer<Format> format(Factory<Format>::make(simmat));
         scores = format->read();
@@ -124,13 +133,136 @@ float Evaluate(const QString &simmat, const QString &mask, const QString &csv)
     return Evaluate(scores, truth, csv);
 }
 
+static const int Max_Retrieval = 200; // Length of the CMC curve
+static const int Report_Retrieval = 5;
+
+// Everything written by Evaluate(), filled in from sorted comparisons or from a ScoreHistogram
+struct Evaluation
+{
+    int rows, cols;
+    qint64 genuineCount, impostorCount;
+    QList<OperatingPoint> operatingPoints; // In order of increasing FAR
+    QList<float> genuines, impostors; // Evenly spaced samples in order of decreasing score
+    QVector<int> firstGenuineReturns; // Rank of each query's first genuine match, or <= 0 if it has none
+};
+
+// Number of evenly spaced score samples to plot
+static int scorePoints(qint64 genuineCount, qint64 impostorCount)
+{
+    return (int) qMin(qMin(qint64(Max_Points), genuineCount), impostorCount);
+}
+
+// Index of sample i of points in a list of size
+static qint64 sampleIndex(int i, int points, qint64 size)
+{
+    return qint64(double(i) / double(points-1) * double(size-1));
+}
+
+// Tracks thresholds at which both the true and false positive counts increase
+struct OperatingPoints
+{
+    QList<OperatingPoint> points;
+    qint64 genuineCount, impostorCount;
+    qint64 falsePositives, previousFalsePositives;
+    qint64 truePositives, previousTruePositives;
+
+    OperatingPoints(qint64 genuineCount, qint64 impostorCount)
+        : genuineCount(genuineCount), impostorCount(impostorCount),
+          falsePositives(0), previousFalsePositives(0), truePositives(0), previousTruePositives(0) {}
+
+    void update(float thresh)
+    {
+        if ((falsePositives > previousFalsePositives) &&
+             (truePositives > previousTruePositives)) {
+            points.append(OperatingPoint(thresh, float(falsePositives)/impostorCount, float(truePositives)/genuineCount));
+            previousFalsePositives = falsePositives;
+            previousTruePositives = truePositives;
+        }
+    }
+};
+
+static float writeEvaluation(Evaluation &evaluation, const QString &csv)
+{
+    float result = -1;
+    QList<OperatingPoint> &operatingPoints = evaluation.operatingPoints;
+    if (operatingPoints.size() == 0) operatingPoints.append(OperatingPoint(1, 1, 1));
+    if (operatingPoints.size() == 1) operatingPoints.prepend(OperatingPoint(0, 0, 0));
+    if (operatingPoints.size() > 2)  operatingPoints.takeLast(); // Remove point (1,1)
+
+    // Write Metadata table
+    QStringList lines;
+    lines.append("Plot,X,Y");
+    lines.append("Metadata,"+QString::number(evaluation.cols)+",Gallery");
+    lines.append("Metadata,"+QString::number(evaluation.rows)+",Probe");
+    lines.append("Metadata,"+QString::number(evaluation.genuineCount)+",Genuine");
+    lines.append("Metadata,"+QString::number(evaluation.impostorCount)+",Impostor");
+    lines.append("Metadata,"+QString::number(qint64(evaluation.cols)*evaluation.rows-(evaluation.genuineCount+evaluation.impostorCount))+",Ignored");
+
+    // Write Detection Error Tradeoff (DET), PRE, REC
+    int points = qMin(operatingPoints.size(), Max_Points);
+    for (int i=0; i<points; i++) {
+        const OperatingPoint &operatingPoint = operatingPoints[double(i) / double(points-1) * double(operatingPoints.size()-1)];
+        lines.append(QString("DET,%1,%2").arg(QString::number(operatingPoint.FAR),
+                                              QString::number(1-operatingPoint.TAR)));
+        lines.append(QString("FAR,%1,%2").arg(QString::number(operatingPoint.score),
+                                              QString::number(operatingPoint.FAR)));
+        lines.append(QString("FRR,%1,%2").arg(QString::number(operatingPoint.score),
+                                              QString::number(1-operatingPoint.TAR)));
+    }
+
+    // Write FAR/TAR Bar Chart (BC)
+    lines.append(qPrintable(QString("BC,0.001,%1").arg(QString::number(getTAR(operatingPoints, 0.001), 'f', 3))));
+    lines.append(qPrintable(QString("BC,0.01,%1").arg(QString::number(result = getTAR(operatingPoints, 0.01), 'f', 3))));
+
+    // Write SD & KDE
+    for (int i=0; i<evaluation.genuines.size(); i++) {
+        lines.append(QString("SD,%1,Genuine").arg(QString::number(evaluation.genuines[i])));
+        lines.append(QString("SD,%1,Impostor").arg(QString::number(evaluation.impostors[i])));
+    }
+
+    // Write Cumulative Match Characteristic (CMC) curve
+    float reportRetrievalRate = -1;
+    for (int i=1; i<=Max_Retrieval; i++) {
+        int realizedReturns = 0, possibleReturns = 0;
+        foreach (int firstGenuineReturn, evaluation.firstGenuineReturns) {
+            if (firstGenuineReturn > 0) {
+                possibleReturns++;
+                if (firstGenuineReturn <= i) realizedReturns++;
+            }
+        }
+        const float retrievalRate = float(realizedReturns)/possibleReturns;
+        lines.append(qPrintable(QString("CMC,%1,%2").arg(QString::number(i), QString::number(retrievalRate))));
+        if (i == Report_Retrieval) reportRetrievalRate = retrievalRate;
+    }
+
+    QtUtils::writeFile(csv, lines);
+    qDebug("TAR @ FAR = 0.01: %.3f\nRetrieval Rate @ Rank = %d: %.3f", result, Report_Retrieval, reportRetrievalRate);
+    return result;
+}
+
+// Similarity matrices with more comparisons than this are evaluated from histograms
+static const qint64 Max_Sorted_Comparisons = qint64(1) << 26;
+
+static void addRows(ScoreHistogram *histogram, const Mat *simmat, const Mat *mask, int begin, int end)
+{
+    histogram->add(simmat->rowRange(begin, end), mask->rowRange(begin, end), begin);
+}
+
 float Evaluate(const Mat &simmat, const Mat &mask, const QString &csv)
 {
     if (simmat.size() != mask.size())
         qFatal("Similarity matrix (%ix%i) differs in size from mask matrix (%ix%i).",
                simmat.rows, simmat.cols, mask.rows, mask.cols);
 
-    float result = -1;
+    if (qint64(simmat.rows)*simmat.cols > Max_Sorted_Comparisons) {
+        ScoreHistogram histogram(simmat.rows);
+        const int step = std::max(1, int(Max_Sorted_Comparisons / 64 / std::max(1, simmat.cols)));
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<simmat.rows; i+=step)
+            futures.addFuture(QtConcurrent::run(addRows, &histogram, &simmat, &mask, i, std::min(i+step, simmat.rows)));
+        futures.waitForFinished();
+        return histogram.evaluate(simmat.cols, csv);
+    }
 
     // Make comparisons
     QList<Comparison> comparisons; comparisons.reserve(simmat.rows*simmat.cols);
@@ -154,13 +286,11 @@ float Evaluate(const Mat &simmat, const Mat &mask, const QString &csv)
     // Sort comparisons by simmat_val (score)
     std::sort(comparisons.begin(), comparisons.end());
 
-    QList<OperatingPoint> operatingPoints;
+    OperatingPoints operatingPoints(genuineCount, impostorCount);
     QList<float> genuines; genuines.reserve(sqrt((float)comparisons.size()));
     QList<float> impostors; impostors.reserve(comparisons.size());
     QVector<int> firstGenuineReturns(simmat.rows, 0);
 
-    int falsePositives = 0, previousFalsePositives = 0;
-    int truePositives = 0, previousTruePositives = 0;
     int index = 0;
     float minGenuineScore = std::numeric_limits<float>::max();
     float minImpostorScore = std::numeric_limits<float>::max();
@@ -172,7 +302,7 @@ float Evaluate(const Mat &simmat, const Mat &mask, const QString &csv)
                (comparisons[index].score == thresh)) {
             const Comparison &comparison = comparisons[index];
             if (comparison.genuine) {
-                truePositives++;
+                operatingPoints.truePositives++;
                 genuines.append(comparison.score);
                 if (firstGenuineReturns[comparison.query] < 1)
                     firstGenuineReturns[comparison.query] = abs(firstGenuineReturns[comparison.query]) + 1;
@@ -180,7 +310,7 @@ float Evaluate(const Mat &simmat, const Mat &mask, const QString &csv)
                     (comparison.score < minGenuineScore))
                     minGenuineScore = comparison.score;
             } else {
-                falsePositives++;
+                operatingPoints.falsePositives++;
                 impostors.append(comparison.score);
                 if (firstGenuineReturns[comparison.query] < 1)
                     firstGenuineReturns[comparison.query]--;
@@ -191,82 +321,225 @@ float Evaluate(const Mat &simmat, const Mat &mask, const QString &csv)
             index++;
         }
 
-        if ((falsePositives > previousFalsePositives) &&
-             (truePositives > previousTruePositives)) {
-            operatingPoints.append(OperatingPoint(thresh, float(falsePositives)/impostorCount, float(truePositives)/genuineCount));
-            previousFalsePositives = falsePositives;
-            previousTruePositives = truePositives;
+        operatingPoints.update(thresh);
+    }
+
+    Evaluation evaluation;
+    evaluation.rows = simmat.rows;
+    evaluation.cols = simmat.cols;
+    evaluation.genuineCount = genuineCount;
+    evaluation.impostorCount = impostorCount;
+    evaluation.operatingPoints = operatingPoints.points;
+    evaluation.firstGenuineReturns = firstGenuineReturns;
+
+    const int points = scorePoints(genuines.size(), impostors.size());
+    if (points > 1) {
+        for (int i=0; i<points; i++) {
+            float genuineScore = genuines[sampleIndex(i, points, genuines.size())];
+            float impostorScore = impostors[sampleIndex(i, points, impostors.size())];
+            if (genuineScore == -std::numeric_limits<float>::max()) genuineScore = minGenuineScore;
+            if (impostorScore == -std::numeric_limits<float>::max()) impostorScore = minImpostorScore;
+            evaluation.genuines.append(genuineScore);
+            evaluation.impostors.append(impostorScore);
         }
     }
 
-    if (operatingPoints.size() == 0) operatingPoints.append(OperatingPoint(1, 1, 1));
-    if (operatingPoints.size() == 1) operatingPoints.prepend(OperatingPoint(0, 0, 0));
-    if (operatingPoints.size() > 2)  operatingPoints.takeLast(); // Remove point (1,1)
+    return writeEvaluation(evaluation, csv);
+}
 
-    // Write Metadata table
-    QStringList lines;
-    lines.append("Plot,X,Y");
-    lines.append("Metadata,"+QString::number(simmat.cols)+",Gallery");
-    lines.append("Metadata,"+QString::number(simmat.rows)+",Probe");
-    lines.append("Metadata,"+QString::number(genuineCount)+",Genuine");
-    lines.append("Metadata,"+QString::number(impostorCount)+",Impostor");
-    lines.append("Metadata,"+QString::number(simmat.cols*simmat.rows-(genuineCount+impostorCount))+",Ignored");
+/* ScoreHistogram */
+static const int ScoreBinShift = 12; // Keeps the leading 20 bits
+static const int Max_Tail_Impostors = 1 << 20;
 
-    // Write Detection Error Tradeoff (DET), PRE, REC
-    int points = qMin(operatingPoints.size(), Max_Points);
-    for (int i=0; i<points; i++) {
-        const OperatingPoint &operatingPoint = operatingPoints[double(i) / double(points-1) * double(operatingPoints.size()-1)];
-        lines.append(QString("DET,%1,%2").arg(QString::number(operatingPoint.FAR),
-                                              QString::number(1-operatingPoint.TAR)));
-        lines.append(QString("FAR,%1,%2").arg(QString::number(operatingPoint.score),
-                                              QString::number(operatingPoint.FAR)));
-        lines.append(QString("FRR,%1,%2").arg(QString::number(operatingPoint.score),
-                                              QString::number(1-operatingPoint.TAR)));
+// Maps floats to unsigned integers of the same order
+static inline quint32 orderedBits(float value)
+{
+    union { float f; quint32 u; } bits;
+    bits.f = value;
+    return (bits.u & 0x80000000u) ? ~bits.u : (bits.u | 0x80000000u);
+}
+
+static inline float orderedFloat(quint32 value)
+{
+    union { float f; quint32 u; } bits;
+    bits.u = (value & 0x80000000u) ? (value & 0x7FFFFFFFu) : ~value;
+    return bits.f;
+}
+
+// Lowest score counted by a bin, the bin holding negative infinity otherwise starts with NaN bit patterns
+static inline float binScore(int bin)
+{
+    const float score = orderedFloat(quint32(bin) << ScoreBinShift);
+    return (score == score) ? score : -std::numeric_limits<float>::infinity();
+}
+
+// Keeps the n highest values
+static void keepHighest(std::vector<float> &values, size_t n)
+{
+    if (values.size() <= n) return;
+    std::nth_element(values.begin(), values.begin()+n, values.end(), std::greater<float>());
+    values.resize(n);
+}
+
+ScoreHistogram::ScoreHistogram(int queries)
+    : impostorBins(1 << (32 - ScoreBinShift), 0), genuineCount(0), impostorCount(0), numNaNs(0),
+      minGenuineScore(std::numeric_limits<float>::max()), minImpostorScore(std::numeric_limits<float>::max()),
+      bestGenuines(queries, -std::numeric_limits<float>::infinity()), topImpostors(queries) {}
+
+void ScoreHistogram::add(const Mat &scores, const Mat &mask, int row)
+{
+    if (scores.size() != mask.size())
+        qFatal("Similarity matrix (%ix%i) differs in size from mask matrix (%ix%i).",
+               scores.rows, scores.cols, mask.rows, mask.cols);
+
+    std::vector<float> localGenuines, localImpostors, rowImpostors;
+    std::vector<quint32> bins;
+    qint64 localNaNs = 0;
+    float localMinGenuine = std::numeric_limits<float>::max();
+    float localMinImpostor = std::numeric_limits<float>::max();
+
+    for (int i=0; i<scores.rows; i++) {
+        const BEE::Simmat_t *score = scores.ptr<BEE::Simmat_t>(i);
+        const BEE::Mask_t *truth = mask.ptr<BEE::Mask_t>(i);
+        float bestGenuine = -std::numeric_limits<float>::infinity();
+        rowImpostors.clear();
+        for (int j=0; j<scores.cols; j++) {
+            if (truth[j] == BEE::DontCare) continue;
+            const float value = score[j];
+            if (value != value) { localNaNs++; continue; }
+            const bool minimum = value == -std::numeric_limits<float>::max();
+            if (truth[j] == BEE::Match) {
+                localGenuines.push_back(value);
+                bestGenuine = std::max(bestGenuine, value);
+                if (!minimum) localMinGenuine = std::min(localMinGenuine, value);
+            } else {
+                rowImpostors.push_back(value);
+                bins.push_back(orderedBits(value) >> ScoreBinShift);
+                if (!minimum) localMinImpostor = std::min(localMinImpostor, value);
+            }
+        }
+        localImpostors.insert(localImpostors.end(), rowImpostors.begin(), rowImpostors.end());
+
+        // Only the impostors above a query's best genuine match affect its rank
+        keepHighest(rowImpostors, Max_Retrieval);
+        QMutexLocker locker(&queryLocks[(row+i) % NumQueryLocks]);
+        bestGenuines[row+i] = std::max(bestGenuines[row+i], bestGenuine);
+        std::vector<float> &top = topImpostors[row+i];
+        top.insert(top.end(), rowImpostors.begin(), rowImpostors.end());
+        keepHighest(top, Max_Retrieval);
     }
 
-    // Write FAR/TAR Bar Chart (BC)
-    lines.append(qPrintable(QString("BC,0.001,%1").arg(QString::number(getTAR(operatingPoints, 0.001), 'f', 3))));
-    lines.append(qPrintable(QString("BC,0.01,%1").arg(QString::number(result = getTAR(operatingPoints, 0.01), 'f', 3))));
+    keepHighest(localImpostors, Max_Tail_Impostors);
+    std::sort(bins.begin(), bins.end());
 
-    // Write SD & KDE
-    points = qMin(qMin(Max_Points, genuines.size()), impostors.size());
-    QList<double> sampledGenuineScores; sampledGenuineScores.reserve(points);
-    QList<double> sampledImpostorScores; sampledImpostorScores.reserve(points);
+    QMutexLocker locker(&lock);
+    for (size_t i=0; i<bins.size(); ) {
+        size_t j = i+1;
+        while ((j < bins.size()) && (bins[j] == bins[i])) j++;
+        impostorBins[bins[i]] += j - i;
+        i = j;
+    }
+    impostorCount += bins.size();
+    genuineCount += localGenuines.size();
+    numNaNs += localNaNs;
+    minGenuineScore = std::min(minGenuineScore, localMinGenuine);
+    minImpostorScore = std::min(minImpostorScore, localMinImpostor);
+    genuines.insert(genuines.end(), localGenuines.begin(), localGenuines.end());
+    tail.insert(tail.end(), localImpostors.begin(), localImpostors.end());
+    if (tail.size() > 2*size_t(Max_Tail_Impostors))
+        keepHighest(tail, Max_Tail_Impostors);
+}
 
-    if (points > 1) {
-        for (int i=0; i<points; i++) {
-            float genuineScore = genuines[double(i) / double(points-1) * double(genuines.size()-1)];
-            float impostorScore = impostors[double(i) / double(points-1) * double(impostors.size()-1)];
-            if (genuineScore == -std::numeric_limits<float>::max()) genuineScore = minGenuineScore;
-            if (impostorScore == -std::numeric_limits<float>::max()) impostorScore = minImpostorScore;
-            lines.append(QString("SD,%1,Genuine").arg(QString::number(genuineScore)));
-            lines.append(QString("SD,%1,Impostor").arg(QString::number(impostorScore)));
-            sampledGenuineScores.append(genuineScore);
-            sampledImpostorScores.append(impostorScore);
+float ScoreHistogram::evaluate(int targets, const QString &csv) const
+{
+    if (numNaNs > 0) qWarning("Encountered %lld NaN scores!", numNaNs);
+    if (genuineCount == 0) qFatal("No genuine scores!");
+    if (impostorCount == 0) qFatal("No impostor scores!");
+
+    std::vector<float> sortedGenuines(genuines), sortedTail(tail);
+    std::sort(sortedGenuines.begin(), sortedGenuines.end(), std::greater<float>());
+    keepHighest(sortedTail, Max_Tail_Impostors);
+    std::sort(sortedTail.begin(), sortedTail.end(), std::greater<float>());
+
+    // The exact tail is removed from the bins
+    QVector<qint64> bins(impostorBins);
+    for (size_t i=0; i<sortedTail.size(); i++)
+        bins[orderedBits(sortedTail[i]) >> ScoreBinShift]--;
+
+    // Sweep thresholds in decreasing order, taking the exact tail before the remaining bins
+    OperatingPoints operatingPoints(genuineCount, impostorCount);
+    size_t genuine = 0, tailIndex = 0;
+    int bin = bins.size() - 1;
+    while (true) {
+        while ((bin >= 0) && (bins[bin] == 0)) bin--;
+        const bool impostorsLeft = (tailIndex < sortedTail.size()) || (bin >= 0);
+        if (!impostorsLeft && (genuine == sortedGenuines.size())) break;
+
+        const float impostor = tailIndex < sortedTail.size() ? sortedTail[tailIndex] : (bin >= 0 ? binScore(bin) : -std::numeric_limits<float>::infinity());
+        const float thresh = (genuine < sortedGenuines.size()) ? std::max(impostor, sortedGenuines[genuine]) : impostor;
+
+        while ((genuine < sortedGenuines.size()) && (sortedGenuines[genuine] == thresh)) {
+            operatingPoints.truePositives++;
+            genuine++;
+        }
+        if (tailIndex < sortedTail.size()) {
+            while ((tailIndex < sortedTail.size()) && (sortedTail[tailIndex] == thresh)) {
+                operatingPoints.falsePositives++;
+                tailIndex++;
+            }
+        } else if ((bin >= 0) && (binScore(bin) == thresh)) {
+            operatingPoints.falsePositives += bins[bin];
+            bin--;
         }
+
+        operatingPoints.update(thresh);
     }
 
-    // Write Cumulative Match Characteristic (CMC) curve
-    const int Max_Retrieval = 200;
-    const int Report_Retrieval = 5;
+    Evaluation evaluation;
+    evaluation.rows = bestGenuines.size();
+    evaluation.cols = targets;
+    evaluation.genuineCount = genuineCount;
+    evaluation.impostorCount = impostorCount;
+    evaluation.operatingPoints = operatingPoints.points;
+
+    // A rank beyond the kept impostors is past the end of the CMC curve
+    evaluation.firstGenuineReturns.resize(bestGenuines.size());
+    for (int i=0; i<bestGenuines.size(); i++) {
+        if (bestGenuines[i] == -std::numeric_limits<float>::infinity()) {
+            evaluation.firstGenuineReturns[i] = 0;
+            continue;
+        }
+        int rank = 1;
+        foreach (float impostor, topImpostors[i])
+            if (impostor > bestGenuines[i])
+                rank++;
+        evaluation.firstGenuineReturns[i] = (rank > int(topImpostors[i].size()) && (int(topImpostors[i].size()) == Max_Retrieval)) ? Max_Retrieval+1 : rank;
+    }
 
-    float reportRetrievalRate = -1;
-    for (int i=1; i<=Max_Retrieval; i++) {
-        int realizedReturns = 0, possibleReturns = 0;
-        foreach (int firstGenuineReturn, firstGenuineReturns) {
-            if (firstGenuineReturn > 0) {
-                possibleReturns++;
-                if (firstGenuineReturn <= i) realizedReturns++;
+    // Impostor samples come from the tail and then from the lower edges of the bins
+    const int points = scorePoints(genuineCount, impostorCount);
+    if (points > 1) {
+        qint64 counted = sortedTail.size();
+        int sampleBin = bins.size() - 1;
+        for (int i=0; i<points; i++) {
+            float genuineScore = sortedGenuines[sampleIndex(i, points, sortedGenuines.size())];
+            const qint64 index = sampleIndex(i, points, impostorCount);
+            float impostorScore;
+            if (index < qint64(sortedTail.size())) {
+                impostorScore = sortedTail[index];
+            } else {
+                while ((sampleBin > 0) && (counted + bins[sampleBin] <= index))
+                    counted += bins[sampleBin--];
+                impostorScore = binScore(sampleBin);
             }
+            if (genuineScore == -std::numeric_limits<float>::max()) genuineScore = minGenuineScore;
+            if (impostorScore == -std::numeric_limits<float>::max()) impostorScore = minImpostorScore;
+            evaluation.genuines.append(genuineScore);
+            evaluation.impostors.append(impostorScore);
         }
-        const float retrievalRate = float(realizedReturns)/possibleReturns;
-        lines.append(qPrintable(QString("CMC,%1,%2").arg(QString::number(i), QString::number(retrievalRate))));
-        if (i == Report_Retrieval) reportRetrievalRate = retrievalRate;
     }
 
-    QtUtils::writeFile(csv, lines);
-    qDebug("TAR @ FAR = 0.01: %.3f\nRetrieval Rate @ Rank = %d: %.3f", result, Report_Retrieval, reportRetrievalRate);
-    return result;
+    return writeEvaluation(evaluation, csv);
 }
 
 // Helper struct for statistics accumulation
@@ -387,10 +660,12 @@ struct DetectionOperatingPoint
         : Recall(TP/totalPositives), FalsePositives(FP), Precision(TP/(TP+FP)) {}
 };
 
-static QStringList computeDetectionResults(const QList<ResolvedDetection> &detections, int totalTrueDetections, bool discrete)
+// Sweeps the detections in order of decreasing confidence, appending to points the operating points numbered in keep (ascending).
+// Returns the total number of operating points, so the ones to keep are chosen without holding every point.
+static int sweepDetections(const QList<ResolvedDetection> &detections, int totalTrueDetections, bool discrete, const QVector<int> &keep, QList<DetectionOperatingPoint> &points)
 {
-    QList<DetectionOperatingPoint> points;
     float TP = 0, FP = 0, prevFP = -1;
+    int count = 0, next = 0;
     for (int i=0; i<detections.size(); i++) {
         const ResolvedDetection &detection = detections[i];
         if (discrete) {
@@ -403,26 +678,35 @@ static QStringList computeDetectionResults(const QList<ResolvedDetection> &detec
         }
         if ((i == detections.size()-1) || (detection.confidence > detections[i+1].confidence)) {
             if (FP > prevFP || (i == detections.size()-1)) {
-                points.append(DetectionOperatingPoint(TP, FP, totalTrueDetections));
+                while ((next < keep.size()) && (keep[next] == count)) {
+                    points.append(DetectionOperatingPoint(TP, FP, totalTrueDetections));
+                    next++;
+                }
+                count++;
                 prevFP = FP;
             }
         }
     }
+    return count;
+}
+
+static QStringList computeDetectionResults(const QList<ResolvedDetection> &detections, int totalTrueDetections, bool discrete)
+{
+    QList<DetectionOperatingPoint> points;
+    const int numPoints = sweepDetections(detections, totalTrueDetections, discrete, QVector<int>(), points);
 
-    const int keep = qMin(points.size(), Max_Points);
+    const int keep = qMin(numPoints, Max_Points);
     if (keep < 1) qFatal("Insufficient points.");
 
+    QVector<int> indices(keep, 0);
+    for (int i=1; i<keep; i++)
+        indices[i] = double(i) / double(keep-1) * double(numPoints-1);
+    sweepDetections(detections, totalTrueDetections, discrete, indices, points);
+
     QStringList lines; lines.reserve(keep);
-    if (keep == 1) {
-        const DetectionOperatingPoint &point = points[0];
+    foreach (const DetectionOperatingPoint &point, points) {
         lines.append(QString("%1ROC, %2, %3").arg(discrete ? "Discrete" : "Continuous", QString::number(point.FalsePositives), QString::number(point.Recall)));
         lines.append(QString("%1PR, %2, %3").arg(discrete ? "Discrete" : "Continuous", QString::number(point.Recall), QString::number(point.Precision)));
-    } else {
-        for (int i=0; i<keep; i++) {
-            const DetectionOperatingPoint &point = points[double(i) / double(keep-1) * double(points.size()-1)];
-            lines.append(QString("%1ROC, %2, %3").arg(discrete ? "Discrete" : "Continuous", QString::number(point.FalsePositives), QString::number(point.Recall)));
-            lines.append(QString("%1PR, %2, %3").arg(discrete ? "Discrete" : "Continuous", QString::number(point.Recall), QString::number(point.Precision)));
-        }
     }
     return lines;
 }
@@ -497,6 +781,142 @@ QMap<QString, Detections> getDetections(const TemplateList &predicted, const Tem
     return allDetections;
 }
 
+// Images with at least this many predicted detections are matched through a DetectionGrid
+static const int Min_Grid_Detections = 64;
+
+// Uniform grid over the predicted detections of one image, so each ground truth detection
+// is only compared against the predictions that can overlap it
+class DetectionGrid
+{
+    static const int Max_Cells = 16; // Detections spanning more cells are always candidates
+
+    qreal cellSize;
+    int size;
+    QHash<QPair<int,int>, QVector<int> > cells;
+    QVector<int> large;
+    mutable QVector<int> stamps;
+    mutable int stamp;
+
+    void range(const QRectF &rect, int *x0, int *y0, int *x1, int *y1) const
+    {
+        *x0 = floor(rect.left() / cellSize);
+        *y0 = floor(rect.top() / cellSize);
+        *x1 = floor(rect.right() / cellSize);
+        *y1 = floor(rect.bottom() / cellSize);
+    }
+
+public:
+    DetectionGrid(const QList<Detection> &detections)
+        : size(detections.size()), stamps(detections.size(), 0), stamp(0)
+    {
+        // Cells about the size of a typical detection
+        qreal total = 0;
+        foreach (const Detection &detection, detections)
+            total += std::max(detection.boundingBox.width(), detection.boundingBox.height());
+        cellSize = std::max(total / std::max(size, 1), qreal(1));
+
+        for (int i=0; i<detections.size(); i++) {
+            int x0, y0, x1, y1;
+            range(detections[i].boundingBox.normalized(), &x0, &y0, &x1, &y1);
+            if (qint64(x1-x0+1)*(y1-y0+1) > Max_Cells) {
+                large.append(i);
+                continue;
+            }
+            for (int x=x0; x<=x1; x++)
+                for (int y=y0; y<=y1; y++)
+                    cells[QPair<int,int>(x, y)].append(i);
+        }
+    }
+
+    // Indices of the detections sharing a cell with rect
+    void candidates(const QRectF &rect, QVector<int> &indices) const
+    {
+        int x0, y0, x1, y1;
+        range(rect.normalized(), &x0, &y0, &x1, &y1);
+        if (qint64(x1-x0+1)*(y1-y0+1) > qint64(cells.size())) {
+            indices.resize(size);
+            for (int i=0; i<size; i++) indices[i] = i;
+            return;
+        }
+
+        indices = large;
+        stamp++;
+        for (int x=x0; x<=x1; x++)
+            for (int y=y0; y<=y1; y++)
+                foreach (int i, cells.value(QPair<int,int>(x, y)))
+                    if (stamps[i] != stamp) {
+                        stamps[i] = stamp;
+                        indices.append(i);
+                    }
+    }
+};
+
+struct ResolvedImage
+{
+    QList<ResolvedDetection> resolved;
+    int truthDetections, falseNegatives;
+};
+
+static ResolvedImage resolveDetections(const Detections &detections)
+{
+    const QList<Detection> &truth = detections.truth;
+    const QList<Detection> &predicted = detections.predicted;
+    QScopedPointer<DetectionGrid> grid(predicted.size() >= Min_Grid_Detections ? new DetectionGrid(predicted) : NULL);
+    QVector<bool> taken(predicted.size(), false);
+    QVector<int> candidates;
+
+    ResolvedImage image;
+    image.truthDetections = truth.size();
+    const int matches = std::min(truth.size(), predicted.size());
+    int first = 0; // Lowest prediction not yet taken
+
+    // Try to associate ground truth detections with predicted detections
+    for (int t=0; t<matches; t++) {
+        while (taken[first]) first++;
+        int bestIndex = -1;
+        float bestOverlap = -std::numeric_limits<float>::max();
+
+        // Find the nearest predicted detection to this ground truth detection, lowest index first on ties
+        if (grid) {
+            grid->candidates(truth[t].boundingBox, candidates);
+            foreach (int i, candidates) {
+                if (taken[i]) continue;
+                const float overlap = truth[t].overlap(predicted[i]);
+                if ((overlap > bestOverlap) || ((overlap == bestOverlap) && (i < bestIndex))) {
+                    bestOverlap = overlap;
+                    bestIndex = i;
+                }
+            }
+            // Without any overlap the first remaining prediction is taken, as in the exhaustive search
+            if ((bestIndex == -1) || (bestOverlap <= 0)) {
+                bestIndex = first;
+                bestOverlap = truth[t].overlap(predicted[first]);
+            }
+        } else {
+            for (int i=first; i<predicted.size(); i++) {
+                if (taken[i]) continue;
+                const float overlap = truth[t].overlap(predicted[i]);
+                if (overlap > bestOverlap) {
+                    bestOverlap = overlap;
+                    bestIndex = i;
+                }
+            }
+        }
+
+        // Taking the detection prevents us from considering it twice.
+        // We don't want to associate two ground truth detections with the
+        // same prediction, over vice versa.
+        taken[bestIndex] = true;
+        image.resolved.append(ResolvedDetection(predicted[bestIndex].confidence, bestOverlap));
+    }
+
+    for (int i=0; i<predicted.size(); i++)
+        if (!taken[i])
+            image.resolved.append(ResolvedDetection(predicted[i].confidence, 0));
+    image.falseNegatives = truth.size() - matches;
+    return image;
+}
+
 float EvalDetection(const QString &predictedGallery, const QString &truthGallery, const QString &csv)
 {
     qDebug("Evaluating detection of %s against %s", qPrintable(predictedGallery), qPrintable(truthGallery));
@@ -506,34 +926,15 @@ float EvalDetection(const QString &predictedGallery, const QString &truthGallery
     // Organized by file, QMap used to preserve order
     QMap<QString, Detections> allDetections = getDetections(predicted, truth);
 
+    // Files are matched in parallel, results are gathered in file order
+    const QList<ResolvedImage> images = QtConcurrent::blockingMapped< QList<ResolvedImage> >(allDetections.values(), resolveDetections);
+
     QList<ResolvedDetection> resolvedDetections, falseNegativeDetections;
     int totalTrueDetections = 0;
-    foreach (Detections detections, allDetections.values()) { // For every file
-        totalTrueDetections += detections.truth.size();
-
-        // Try to associate ground truth detections with predicted detections
-        while (!detections.truth.isEmpty() && !detections.predicted.isEmpty()) {
-            const Detection truth = detections.truth.takeFirst(); // Take removes the detection
-            int bestIndex = -1;
-            float bestOverlap = -std::numeric_limits<float>::max();
-            // Find the nearest predicted detection to this ground truth detection
-            for (int i=0; i<detections.predicted.size(); i++) {
-                const float overlap = truth.overlap(detections.predicted[i]);
-                if (overlap > bestOverlap) {
-                    bestOverlap = overlap;
-                    bestIndex = i;
-                }
-            }
-            // Removing the detection prevents us from considering it twice.
-            // We don't want to associate two ground truth detections with the
-            // same prediction, over vice versa.
-            const Detection predicted = detections.predicted.takeAt(bestIndex);
-            resolvedDetections.append(ResolvedDetection(predicted.confidence, bestOverlap));
-        }
-
-        foreach (const Detection &detection, detections.predicted)
-            resolvedDetections.append(ResolvedDetection(detection.confidence, 0));
-        for (int i=0; i<detections.truth.size(); i++)
+    foreach (const ResolvedImage &image, images) {
+        resolvedDetections.append(image.resolved);
+        totalTrueDetections += image.truthDetections;
+        for (int i=0; i<image.falseNegatives; i++)
             falseNegativeDetections.append(ResolvedDetection(-std::numeric_limits<float>::max(), 0));
     }
 
@@ -564,29 +965,64 @@ float EvalDetection(const QString &predictedGallery, const QString &truthGallery
     return averageOverlap;
 }
 
+// Normalized error of each point of a predicted template against its ground truth
+struct LandmarkErrors
+{
+    const TemplateList *predicted, *truth;
+    const QVector<int> *truthIndices;
+    int normalizationIndexA, normalizationIndexB;
+    QVector< QVector<float> > *errors;
+
+    void operator()(int i) const
+    {
+        const QList<QPointF> predictedPoints = (*predicted)[i].file.points();
+        const QList<QPointF> truthPoints = (*truth)[(*truthIndices)[i]].file.points();
+        if (predictedPoints.size() != truthPoints.size()) qFatal("Points size mismatch for file: %s", qPrintable((*predicted)[i].file.name));
+        if (normalizationIndexA >= truthPoints.size()) qFatal("Normalization index A is out of range.");
+        if (normalizationIndexB >= truthPoints.size()) qFatal("Normalization index B is out of range.");
+        const float normalizedLength = QtUtils::euclideanLength(truthPoints[normalizationIndexB] - truthPoints[normalizationIndexA]);
+        QVector<float> &error = (*errors)[i];
+        error.resize(predictedPoints.size());
+        for (int j=0; j<predictedPoints.size(); j++)
+            error[j] = QtUtils::euclideanLength(predictedPoints[j] - truthPoints[j])/normalizedLength;
+    }
+};
+
 float EvalLandmarking(const QString &predictedGallery, const QString &truthGallery, const QString &csv, int normalizationIndexA, int normalizationIndexB)
 {
     qDebug("Evaluating landmarking of %s against %s", qPrintable(predictedGallery), qPrintable(truthGallery));
     const TemplateList predicted(TemplateList::fromGallery(predictedGallery));
     const TemplateList truth(TemplateList::fromGallery(truthGallery));
-    const QStringList predictedNames = File::get<QString>(predicted, "name");
-    const QStringList truthNames = File::get<QString>(truth, "name");
 
-    QList< QList<float> > pointErrors;
+    // Index the ground truth by name once, the first template of a name is its truth
+    QHash<QString, int> truthIndex;
+    for (int i=0; i<truth.size(); i++)
+        if (!truthIndex.contains(truth[i].file.name))
+            truthIndex.insert(truth[i].file.name, i);
+
+    QVector<int> truthIndices(predicted.size());
     for (int i=0; i<predicted.size(); i++) {
-        const QString &predictedName = predictedNames[i];
-        const int truthIndex = truthNames.indexOf(predictedName);
-        if (truthIndex == -1) qFatal("Could not identify ground truth for file: %s", qPrintable(predictedName));
-        const QList<QPointF> predictedPoints = predicted[i].file.points();
-        const QList<QPointF> truthPoints = truth[truthIndex].file.points();
-        if (predictedPoints.size() != truthPoints.size()) qFatal("Points size mismatch for file: %s", qPrintable(predictedName));
-        while (pointErrors.size() < predictedPoints.size())
+        const QHash<QString, int>::const_iterator it = truthIndex.constFind(predicted[i].file.name);
+        if (it == truthIndex.constEnd()) qFatal("Could not identify ground truth for file: %s", qPrintable(predicted[i].file.name));
+        truthIndices[i] = it.value();
+    }
+
+    QVector< QVector<float> > errors(predicted.size());
+    LandmarkErrors landmarkErrors;
+    landmarkErrors.predicted = &predicted;
+    landmarkErrors.truth = &truth;
+    landmarkErrors.truthIndices = &truthIndices;
+    landmarkErrors.normalizationIndexA = normalizationIndexA;
+    landmarkErrors.normalizationIndexB = normalizationIndexB;
+    landmarkErrors.errors = &errors;
+    Common::ParallelFor(0, predicted.size(), landmarkErrors, Globals->parallelism);
+
+    QList< QList<float> > pointErrors;
+    foreach (const QVector<float> &error, errors) {
+        while (pointErrors.size() < error.size())
             pointErrors.append(QList<float>());
-        if (normalizationIndexA >= truthPoints.size()) qFatal("Normalization index A is out of range.");
-        if (normalizationIndexB >= truthPoints.size()) qFatal("Normalization index B is out of range.");
-        const float normalizedLength = QtUtils::euclideanLength(truthPoints[normalizationIndexB] - truthPoints[normalizationIndexA]);
-        for (int j=0; j<predictedPoints.size(); j++)
-            pointErrors[j].append(QtUtils::euclideanLength(predictedPoints[j] - truthPoints[j])/normalizedLength);
+        for (int j=0; j<error.size(); j++)
+            pointErrors[j].append(error[j]);
     }
 
     QList<float> averagePointErrors; averagePointErrors.reserve(pointErrors.size());
@@ -18,7 +18,10 @@
 #define BR_EVAL_H
 
 #include <QList>
+#include <QMutex>
 #include <QString>
+#include <QVector>
+#include <vector>
 #include "openbr/openbr_plugin.h"
 
 namespace br
@@ -26,6 +29,33 @@ namespace br
     float Evaluate(const QString &simmat, const QString &mask = "", const QString &csv = ""); // Returns TAR @ FAR = 0.001
     float Evaluate(const cv::Mat &scores, const FileList &target, const FileList &query, const QString &csv = "", int parition = 0);
     float Evaluate(const cv::Mat &scores, const cv::Mat &masks, const QString &csv = "");
+
+    /*!
+     * \brief Accumulates blocks of a similarity matrix for evaluation without storing every comparison.
+     *
+     * Impostor scores are counted in bins of the leading 20 bits of their order preserving integer representation,
+     * except for the highest million which are kept exactly so low false accept rates are not quantized.
+     * Genuine scores grow only with the number of matches and are kept exactly,
+     * as are the best genuine and highest impostor scores of each query needed for the CMC curve.
+     */
+    class ScoreHistogram
+    {
+    public:
+        explicit ScoreHistogram(int queries);
+        void add(const cv::Mat &scores, const cv::Mat &mask, int row); // Scores and mask of any targets for queries starting at row, safe to call concurrently
+        float evaluate(int targets, const QString &csv = "") const; // Returns TAR @ FAR = 0.01
+
+    private:
+        static const int NumQueryLocks = 64;
+        QMutex lock, queryLocks[NumQueryLocks];
+        QVector<qint64> impostorBins;
+        std::vector<float> genuines, tail; // tail holds the highest impostor scores
+        qint64 genuineCount, impostorCount, numNaNs;
+        float minGenuineScore, minImpostorScore;
+        QVector<float> bestGenuines; // Per query
+        QVector< std::vector<float> > topImpostors;
+    };
+
     void EvalClassification(const QString &predictedGallery, const QString &truthGallery, QString predictedProperty = "", QString truthProperty = "");
     float EvalDetection(const QString &predictedGallery, const QString &truthGallery, const QString &csv = ""); // Return average overlap
     float EvalLandmarking(const QString &predictedGallery, const QString &truthGallery, const QString &csv = "", int normalizationIndexA = 0, int normalizationIndexB = 1); // Return average error
@@ -14,9 +14,15 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
 #include <QList>
+#include <QMutex>
+#include <QSharedPointer>
 #include <QStringList>
+#include <QVector>
+#include <QtConcurrentRun>
 #include "openbr/core/opencvutils.h"
+#include <algorithm>
 #include <limits>
 #include <vector>
 #include <opencv2/core/core.hpp>
@@ -28,140 +34,252 @@
 
 using namespace cv;
 
-static void normalizeMatrix(Mat &matrix, const Mat &mask, const QString &method)
+enum Normalization { NoNormalization, MinMaxNormalization, ZScoreNormalization };
+enum Fusion { NoFusion, MaxFusion, MinFusion, SumFusion, ReplaceFusion, DifferenceFusion };
+
+// Running statistics of the finite scores of one matrix in one partition, merged across row blocks
+struct ScoreStatistics
 {
-    if (matrix.rows != mask.rows && matrix.cols != mask.cols)
-        qFatal("Similarity matrix (%d, %d) and mask (%d, %d) size mismatch.", matrix.rows, matrix.cols, mask.rows, mask.cols);
-
-    if (method == "None") return;
-
-    QList<float> vals; vals.reserve(matrix.rows*matrix.cols);
-    for (int i=0; i<matrix.rows; i++) {
-        for (int j=0; j<matrix.cols; j++) {
-            float val = matrix.at<float>(i,j);
-            if ((mask.at<BEE::Mask_t>(i,j) == BEE::DontCare) ||
-                (val == -std::numeric_limits<float>::max()) ||
-                (val ==  std::numeric_limits<float>::max()))
-                continue;
-            vals.append(val);
+    qint64 count;
+    double mean, m2;
+    float min, max;
+
+    ScoreStatistics() : count(0), mean(0), m2(0), min(std::numeric_limits<float>::max()), max(-std::numeric_limits<float>::max()) {}
+
+    void add(float val)
+    {
+        count++;
+        const double delta = val - mean;
+        mean += delta / count;
+        m2 += delta * (val - mean);
+        if (val < min) min = val;
+        if (val > max) max = val;
+    }
+
+    void merge(const ScoreStatistics &other)
+    {
+        if (other.count == 0) return;
+        const qint64 total = count + other.count;
+        const double delta = other.mean - mean;
+        m2 += other.m2 + delta * delta * count * other.count / total;
+        mean += delta * other.count / total;
+        count = total;
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+    }
+
+    double stddev() const
+    {
+        return count == 0 ? 0 : sqrt(m2 / count);
+    }
+};
+
+// Everything the row block kernels share
+struct FuseContext
+{
+    QList< QSharedPointer<BEE::MappedMatrix> > matrices;
+    BEE::MaskIndex targets, queries;
+    int partitions;
+    Normalization normalization;
+    Fusion fusion;
+    QList<float> weights;
+    QVector<ScoreStatistics> statistics; // Indexed by partition*matrices.size() + matrix
+    QMutex lock;
+    QScopedPointer<BEE::MatrixWriter> writer;
+
+    // Each query belongs to one partition, so its row is masked for that partition only
+    void mask(Mat &mask, int begin) const
+    {
+        for (int i=0; i<mask.rows; i++) {
+            Mat row = mask.row(i);
+            const int partition = queries.partitions[begin+i];
+            if ((partition >= 0) && (partition < partitions)) BEE::fillMask(targets, queries, partition, row, begin+i);
+            else                                              row.setTo(BEE::DontCare);
         }
     }
 
-    float min, max;
-    double mean, stddev;
-    Common::MinMax(vals, &min, &max);
-    Common::MeanStdDev(vals, &mean, &stddev);
-
-    if (method == "MinMax") {
-        for (int i=0; i<matrix.rows; i++) {
-            for (int j=0; j<matrix.cols; j++) {
-                if (mask.at<BEE::Mask_t>(i,j) == BEE::DontCare) continue;
-                float &val = matrix.at<float>(i,j);
-                if      (val == -std::numeric_limits<float>::max()) val = 0;
-                else if (val ==  std::numeric_limits<float>::max()) val = 1;
-                else                                                     val = (val - min) / (max - min);
+    float score(int matrix, int i, int j) const
+    {
+        const float val = matrices[matrix]->m.at<float>(i,j);
+        return matrices[matrix]->negate ? -val : val;
+    }
+
+    float normalize(float val, const ScoreStatistics &s) const
+    {
+        if (normalization == MinMaxNormalization) {
+            if      (val == -std::numeric_limits<float>::max()) return 0;
+            else if (val ==  std::numeric_limits<float>::max()) return 1;
+            else                                               return (val - s.min) / (s.max - s.min);
+        } else if (normalization == ZScoreNormalization) {
+            if      (val == -std::numeric_limits<float>::max()) return (s.min - s.mean) / s.stddev();
+            else if (val ==  std::numeric_limits<float>::max()) return (s.max - s.mean) / s.stddev();
+            else                                               return (val - s.mean) / s.stddev();
+        }
+        return val;
+    }
+};
+
+// First pass, normalization statistics over the cells the mask doesn't ignore
+static void accumulateRows(FuseContext *context, int begin, int end)
+{
+    const int cols = context->matrices.first()->m.cols;
+    QVector<ScoreStatistics> statistics(context->statistics.size());
+    Mat mask(end-begin, cols, CV_8UC1);
+    context->mask(mask, begin);
+
+    for (int i=begin; i<end; i++) {
+        const BEE::Mask_t *maskRow = mask.ptr<BEE::Mask_t>(i-begin);
+        const int offset = context->queries.partitions[i]*context->matrices.size();
+        for (int j=0; j<cols; j++) {
+            if (maskRow[j] == BEE::DontCare) continue;
+            for (int k=0; k<context->matrices.size(); k++) {
+                const float val = context->score(k, i, j);
+                if ((val == -std::numeric_limits<float>::max()) ||
+                    (val ==  std::numeric_limits<float>::max()))
+                    continue;
+                statistics[offset+k].add(val);
             }
         }
-    } else if (method == "ZScore") {
-        if (stddev == 0) qFatal("Stddev is 0.");
-        for (int i=0; i<matrix.rows; i++) {
-            for (int j=0; j<matrix.cols; j++) {
-                if (mask.at<BEE::Mask_t>(i,j) == BEE::DontCare) continue;
-                float &val = matrix.at<float>(i,j);
-                if      (val == -std::numeric_limits<float>::max()) val = (min - mean) / stddev;
-                else if (val ==  std::numeric_limits<float>::max()) val = (max - mean) / stddev;
-                else                                                val = (val - mean) / stddev;
+    }
+
+    QMutexLocker locker(&context->lock);
+    for (int i=0; i<statistics.size(); i++)
+        context->statistics[i].merge(statistics[i]);
+}
+
+// Second pass, normalize and fuse a block of rows and write it out
+static void fuseRows(FuseContext *context, int begin, int end)
+{
+    const int cols = context->matrices.first()->m.cols;
+    const int numMatrices = context->matrices.size();
+    Mat fused(end-begin, cols, CV_32FC1);
+    Mat mask(end-begin, cols, CV_8UC1);
+    context->mask(mask, begin);
+
+    QVector<float> vals(numMatrices);
+    for (int i=begin; i<end; i++) {
+        const BEE::Mask_t *maskRow = mask.ptr<BEE::Mask_t>(i-begin);
+        float *fusedRow = fused.ptr<float>(i-begin);
+        const int offset = context->queries.partitions[i]*numMatrices;
+        for (int j=0; j<cols; j++) {
+            // We don't want to add scores where the mask says we shouldn't care
+            if (maskRow[j] == BEE::DontCare) {
+                fusedRow[j] = 0;
+                continue;
+            }
+
+            for (int k=0; k<numMatrices; k++)
+                vals[k] = context->normalize(context->score(k, i, j), context->statistics[offset+k]);
+
+            float val = vals[0];
+            switch (context->fusion) {
+              case MaxFusion:
+                for (int k=1; k<numMatrices; k++) val = std::max(val, vals[k]);
+                break;
+              case MinFusion:
+                for (int k=1; k<numMatrices; k++) val = std::min(val, vals[k]);
+                break;
+              case SumFusion:
+                val = 0;
+                for (int k=0; k<numMatrices; k++) val += context->weights[k] * vals[k];
+                break;
+              case ReplaceFusion:
+                val = vals[1];
+                break;
+              case DifferenceFusion:
+                val = vals[0] - vals[1];
+                break;
+              case NoFusion:
+                break;
             }
+            fusedRow[j] = val;
         }
-    } else {
-        qFatal("Invalid normalization method %s.", qPrintable(method));
     }
+
+    context->writer->write(fused, begin);
 }
 
 void br::Fuse(const QStringList &inputSimmats, const QString &normalization, const QString &fusion, const QString &outputSimmat)
 {
     qDebug("Fusing %d to %s", inputSimmats.size(), qPrintable(outputSimmat));
 
-    QString target, query, previousTarget, previousQuery;
-    QList<Mat> originalMatrices;
+    FuseContext context;
+    QString target, query;
     foreach (const QString &simmat, inputSimmats) {
-        originalMatrices.append(BEE::readMat(simmat,&target,&query));
+        context.matrices.append(QSharedPointer<BEE::MappedMatrix>(new BEE::MappedMatrix(simmat)));
+        const BEE::MappedMatrix &matrix = *context.matrices.last();
         // Make we're fusing score matrices for the same set of targets and querys
-        if (!previousTarget.isEmpty() && !previousQuery.isEmpty() && (previousTarget != target || previousQuery != query))
+        if (!target.isEmpty() && !query.isEmpty() && (matrix.targetSigset != target || matrix.querySigset != query))
             qFatal("Target or query files are not the same across fused matrices.");
-        previousTarget = target; previousQuery = query;
+        if (matrix.m.size() != context.matrices.first()->m.size())
+            qFatal("Fused matrices differ in size.");
+        target = matrix.targetSigset; query = matrix.querySigset;
     }
 
-    if ((originalMatrices.size() < 2) && (fusion != "None")) qFatal("Expected at least two similarity matrices.");
-    if ((originalMatrices.size() > 1) && (fusion == "None")) qFatal("Expected exactly one similarity matrix.");
+    if ((context.matrices.size() < 2) && (fusion != "None")) qFatal("Expected at least two similarity matrices.");
+    if ((context.matrices.size() > 1) && (fusion == "None")) qFatal("Expected exactly one similarity matrix.");
 
-    const FileList targetFiles = TemplateList::fromGallery(target).files();
-    const FileList queryFiles = TemplateList::fromGallery(query).files();
+    if      (normalization == "None")   context.normalization = NoNormalization;
+    else if (normalization == "MinMax") context.normalization = MinMaxNormalization;
+    else if (normalization == "ZScore") context.normalization = ZScoreNormalization;
+    else                                qFatal("Invalid normalization method %s.", qPrintable(normalization));
 
-    int partition = 0;
-    int crossValidate = Globals->crossValidate;
-    Mat buffer = Mat::zeros(originalMatrices.last().size(),originalMatrices.last().type());
-
-    do {
-        QList<Mat> matrices;
-        foreach (const Mat& matrix, originalMatrices)
-            matrices.append(matrix.clone());
-
-        Mat matrix_mask = BEE::makeMask(targetFiles,queryFiles,partition);
-        for (int i=0; i<matrices.size(); i++)
-            normalizeMatrix(matrices[i], matrix_mask, normalization);
-
-        Mat fused;
-        if (fusion == "Max") {
-            max(matrices[0], matrices[1], fused);
-            for (int i=2; i<matrices.size(); i++)
-                max(fused, matrices[i], fused);
-        } else if (fusion == "Min") {
-            min(matrices[0], matrices[1], fused);
-            for (int i=2; i<matrices.size(); i++)
-                min(fused, matrices[i], fused);
-        } else if (fusion.startsWith("Sum")) {
-            QList<float> weights;
-            QStringList words = fusion.right(fusion.size()-3).split(":", QString::SkipEmptyParts);
-            if (words.size() == 0) {
-                for (int k=0; k<matrices.size(); k++)
-                    weights.append(1);
-            } else if (words.size() == matrices.size()) {
-                bool ok;
-                for (int k=0; k<matrices.size(); k++) {
-                    float weight = words[k].toFloat(&ok);
-                    if (!ok) qFatal("Non-numerical weight %s.", qPrintable(words[k]));
-                    weights.append(weight);
-                }
-            } else {
-                qFatal("Number of weights does not match number of similarity matrices.");
-            }
+    if      (fusion == "Max")          context.fusion = MaxFusion;
+    else if (fusion == "Min")          context.fusion = MinFusion;
+    else if (fusion.startsWith("Sum")) context.fusion = SumFusion;
+    else if (fusion == "Replace")      context.fusion = ReplaceFusion;
+    else if (fusion == "Difference")   context.fusion = DifferenceFusion;
+    else if (fusion == "None")         context.fusion = NoFusion;
+    else                               qFatal("Invalid fusion method %s.", qPrintable(fusion));
 
-            addWeighted(matrices[0], weights[0], matrices[1], weights[1], 0, fused);
-            for (int i=2; i<matrices.size(); i++)
-                addWeighted(fused, 1, matrices[i], weights[i], 0, fused);
-        } else if (fusion == "Replace") {
-            if (matrices.size() != 2) qFatal("Replace fusion requires exactly two matrices.");
-            fused = matrices.first().clone();
-            matrices.last().copyTo(fused, matrix_mask != BEE::DontCare);
-        } else if (fusion == "Difference") {
-            if (matrices.size() != 2) qFatal("Difference fusion requires exactly two matrices.");
-            subtract(matrices[0], matrices[1], fused);
-        } else if (fusion == "None") {
-            fused = matrices[0];
+    if (context.fusion == SumFusion) {
+        QStringList words = fusion.right(fusion.size()-3).split(":", QString::SkipEmptyParts);
+        if (words.size() == 0) {
+            for (int k=0; k<context.matrices.size(); k++)
+                context.weights.append(1);
+        } else if (words.size() == context.matrices.size()) {
+            bool ok;
+            for (int k=0; k<context.matrices.size(); k++) {
+                float weight = words[k].toFloat(&ok);
+                if (!ok) qFatal("Non-numerical weight %s.", qPrintable(words[k]));
+                context.weights.append(weight);
+            }
         } else {
-            qFatal("Invalid fusion method %s.", qPrintable(fusion));
+            qFatal("Number of weights does not match number of similarity matrices.");
         }
+    } else if (((context.fusion == ReplaceFusion) || (context.fusion == DifferenceFusion)) && (context.matrices.size() != 2)) {
+        qFatal("%s fusion requires exactly two matrices.", qPrintable(fusion));
+    }
 
-        // We don't want to add scores where the mask says we shouldn't care
-        Mat buffer_mask = Mat::ones(matrix_mask.size(),CV_8UC1);
-        buffer_mask.setTo(0,matrix_mask==BEE::DontCare);
+    const FileList targetFiles = TemplateList::fromGallery(target).files();
+    const FileList queryFiles = TemplateList::fromGallery(query).files();
+    const int rows = context.matrices.first()->m.rows;
+    const int cols = context.matrices.first()->m.cols;
+    if ((rows != queryFiles.size()) || (cols != targetFiles.size()))
+        qFatal("Similarity matrix (%d, %d) and mask (%d, %d) size mismatch.", rows, cols, queryFiles.size(), targetFiles.size());
 
-        add(buffer,fused,buffer,buffer_mask);
+    BEE::indexMask(targetFiles, queryFiles, &context.targets, &context.queries);
+    context.partitions = std::max(1, Globals->crossValidate);
+    context.statistics.resize(context.partitions*context.matrices.size());
 
-        partition++;
+    // Rows are streamed from the mapped matrices in blocks of about 4M cells
+    const int step = std::max(1, (1 << 22) / std::max(1, cols));
 
-    } while (partition < crossValidate);
+    if (context.normalization != NoNormalization) {
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<rows; i+=step)
+            futures.addFuture(QtConcurrent::run(accumulateRows, &context, i, std::min(i+step, rows)));
+        futures.waitForFinished();
+
+        if (context.normalization == ZScoreNormalization)
+            foreach (const ScoreStatistics &statistics, context.statistics)
+                if ((statistics.count > 0) && (statistics.stddev() == 0))
+                    qFatal("Stddev is 0.");
+    }
 
-    BEE::writeMat(buffer, outputSimmat);
+    context.writer.reset(new BEE::MatrixWriter(outputSimmat, rows, cols, CV_32FC1));
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<rows; i+=step)
+        futures.addFuture(QtConcurrent::run(fuseRows, &context, i, std::min(i+step, rows)));
+    futures.waitForFinished();
 }
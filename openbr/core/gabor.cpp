@@ -0,0 +1,67 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <vector>
+
+#include "gabor.h"
+
+using namespace cv;
+
+void Gabor::wavelet(float lambda, float theta, float psi, float sigma, float gamma, Mat &kReal, Mat &kImaginary)
+{
+    float sigma_x = sigma;
+    float sigma_y = sigma/gamma;
+
+    // Bounding box
+    const double nstds = 3;
+    int xmax = std::ceil(std::max(1.0, std::max(std::abs(nstds*sigma_x*cos(theta)),
+                                                std::abs(nstds*sigma_y*sin(theta)))));
+    int ymax = std::ceil(std::max(1.0, std::max(std::abs(nstds*sigma_x*sin(theta)),
+                                                std::abs(nstds*sigma_y*cos(theta)))));
+
+    // Compute kernels
+    kReal.create(2*ymax+1, 2*xmax+1, CV_32FC1);
+    kImaginary.create(2*ymax+1, 2*xmax+1, CV_32FC1);
+    for (int y = -ymax; y <= ymax; y++) {
+        int row = y + ymax;
+        for (int x = -xmax; x <= xmax; x++) {
+            int col = x + xmax;
+            float x_prime = x*cos(theta) + y*sin(theta);
+            float y_prime = -x*sin(theta) + y*cos(theta);
+            float a = exp(-0.5 * (x_prime*x_prime + gamma*gamma*y_prime*y_prime)/(sigma*sigma));
+            float b = 2*CV_PI*x_prime/lambda+psi;
+            kReal.at<float>(row, col) = a*cos(b);
+            kImaginary.at<float>(row, col) = a*sin(b);
+        }
+    }
+
+    // Remove DC component, should only effect real kernel
+    subtract(kReal, mean(kReal), kReal);
+    subtract(kImaginary, mean(kImaginary), kImaginary);
+}
+
+Mat Gabor::spectrum(const Mat &kReal, const Mat &kImaginary, const Size &size)
+{
+    std::vector<Mat> mv;
+    mv.push_back(Mat::zeros(size, CV_32FC1));
+    mv.push_back(Mat::zeros(size, CV_32FC1));
+    kReal.copyTo(mv[0](Rect(0, 0, kReal.cols, kReal.rows)));
+    kImaginary.copyTo(mv[1](Rect(0, 0, kImaginary.cols, kImaginary.rows)));
+    Mat kernel, spectrum;
+    merge(mv, kernel);
+    dft(kernel, spectrum, DFT_COMPLEX_OUTPUT);
+    return spectrum;
+}
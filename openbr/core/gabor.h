@@ -0,0 +1,31 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef GABOR_GABOR_H
+#define GABOR_GABOR_H
+
+#include <opencv2/core/core.hpp>
+
+/*!
+ * \brief Gabor wavelet construction shared by the spatial and frequency domain filter banks.
+ */
+namespace Gabor
+{
+    void wavelet(float lambda, float theta, float psi, float sigma, float gamma, cv::Mat &kReal, cv::Mat &kImaginary); /*!< \brief Zero mean real and imaginary kernels spanning three standard deviations. */
+    cv::Mat spectrum(const cv::Mat &kReal, const cv::Mat &kImaginary, const cv::Size &size); /*!< \brief DFT of the complex wavelet zero padded to \em size, correlate with mulSpectrums(..., true). */
+}
+
+#endif // GABOR_GABOR_H
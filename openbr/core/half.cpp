@@ -0,0 +1,160 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <string.h>
+#include "half.h"
+#include "simd.h"
+
+static inline quint16 encodeScalar(float value)
+{
+    quint32 f;
+    memcpy(&f, &value, 4);
+    const quint32 sign = (f >> 16) & 0x8000;
+    const quint32 exponent = (f >> 23) & 0xFF;
+    quint32 mantissa = f & 0x7FFFFF;
+
+    if (exponent == 0xFF) // Infinity or NaN
+        return sign | 0x7C00 | (mantissa ? 0x200 | (mantissa >> 13) : 0);
+
+    const int e = int(exponent) - 127 + 15;
+    if (e >= 31) return sign | 0x7C00; // Overflow to infinity
+    if (e <= 0) { // Subnormal or zero
+        if (e < -10) return sign;
+        mantissa |= 0x800000;
+        const int shift = 14 - e;
+        const quint32 half = mantissa >> shift;
+        const quint32 remainder = mantissa & ((1u << shift) - 1);
+        const quint32 halfway = 1u << (shift - 1);
+        return sign | (half + ((remainder > halfway) || ((remainder == halfway) && (half & 1))));
+    }
+
+    const quint32 half = (quint32(e) << 10) | (mantissa >> 13);
+    const quint32 remainder = mantissa & 0x1FFF;
+    // A carry out of the mantissa correctly increments the exponent, up to infinity
+    return sign | (half + ((remainder > 0x1000) || ((remainder == 0x1000) && (half & 1))));
+}
+
+static inline float decodeScalar(quint16 value)
+{
+    const quint32 sign = quint32(value & 0x8000) << 16;
+    const quint32 exponent = (value >> 10) & 0x1F;
+    quint32 mantissa = value & 0x3FF;
+
+    quint32 f;
+    if (exponent == 0x1F) {
+        f = sign | 0x7F800000 | (mantissa ? 0x400000 | (mantissa << 13) : 0); // NaNs are quieted like F16C does
+    } else if (exponent != 0) {
+        f = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        f = sign;
+    } else { // Subnormal, normalize it
+        int e = 127 - 15 + 1;
+        while (!(mantissa & 0x400)) {
+            mantissa <<= 1;
+            e--;
+        }
+        f = sign | (quint32(e) << 23) | ((mantissa & 0x3FF) << 13);
+    }
+
+    float result;
+    memcpy(&result, &f, 4);
+    return result;
+}
+
+#ifdef BR_X86
+
+BR_TARGET("avx,f16c")
+static void encodeF16C(const float *src, quint16 *dst, int size)
+{
+    int i = 0;
+    for (; i+8<=size; i+=8)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst+i), _mm256_cvtps_ph(_mm256_loadu_ps(src+i), 0 /* Round to nearest even */));
+    for (; i<size; i++)
+        dst[i] = encodeScalar(src[i]);
+}
+
+BR_TARGET("avx,f16c")
+static void decodeF16C(const quint16 *src, float *dst, int size)
+{
+    int i = 0;
+    for (; i+8<=size; i+=8)
+        _mm256_storeu_ps(dst+i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i))));
+    for (; i<size; i++)
+        dst[i] = decodeScalar(src[i]);
+}
+
+static bool detectF16C()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    const bool f16c = (info[2] & (1 << 29)) != 0;
+    return osxsave && avx && f16c && ((_xgetbv(0) & 0x06) == 0x06);
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+#endif
+}
+
+static const bool f16c = detectF16C();
+
+#endif // BR_X86
+
+void Half::encode(const float *src, quint16 *dst, int size)
+{
+#ifdef BR_X86
+    if (f16c) {
+        encodeF16C(src, dst, size);
+        return;
+    }
+#endif
+    for (int i=0; i<size; i++)
+        dst[i] = encodeScalar(src[i]);
+}
+
+void Half::decode(const quint16 *src, float *dst, int size)
+{
+#ifdef BR_X86
+    if (f16c) {
+        decodeF16C(src, dst, size);
+        return;
+    }
+#endif
+    for (int i=0; i<size; i++)
+        dst[i] = decodeScalar(src[i]);
+}
+
+cv::Mat Half::encode(const cv::Mat &src)
+{
+    if (src.depth() != CV_32F) qFatal("Half::encode expects floating point matrices.");
+    cv::Mat dst(src.rows, src.cols, CV_MAKETYPE(Depth, src.channels()));
+    const int size = src.cols * src.channels();
+    for (int i=0; i<src.rows; i++)
+        encode(src.ptr<float>(i), dst.ptr<quint16>(i), size);
+    return dst;
+}
+
+cv::Mat Half::decode(const cv::Mat &src)
+{
+    if (src.depth() != Depth) qFatal("Half::decode expects half precision matrices.");
+    cv::Mat dst(src.rows, src.cols, CV_32FC(src.channels()));
+    const int size = src.cols * src.channels();
+    for (int i=0; i<src.rows; i++)
+        decode(src.ptr<quint16>(i), dst.ptr<float>(i), size);
+    return dst;
+}
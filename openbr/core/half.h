@@ -0,0 +1,45 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef HALF_HALF_H
+#define HALF_HALF_H
+
+#include <QtGlobal>
+#include <opencv2/core/core.hpp>
+
+/*!
+ * \brief IEEE 754 half precision storage for float matrices.
+ *
+ * Halves are stored as \c CV_16U matrices of the same shape and channel count, rounded to nearest even.
+ * Conversion uses F16C instructions when the processor supports them.
+ */
+namespace Half
+{
+    /*!
+     * \brief Depth of matrices holding halves.
+     *
+     * OpenCV 2.4 has no 16-bit float depth, so halves are raw bit patterns in \c CV_16U matrices
+     * and only mean something to decode() or to templates marked \c Half.
+     */
+    const int Depth = CV_16U;
+
+    void encode(const float *src, quint16 *dst, int size); /*!< \brief Converts \em size floats to halves. */
+    void decode(const quint16 *src, float *dst, int size); /*!< \brief Converts \em size halves to floats. */
+    cv::Mat encode(const cv::Mat &src); /*!< \brief Converts a \c CV_32F matrix to halves. */
+    cv::Mat decode(const cv::Mat &src); /*!< \brief Converts a matrix of halves to \c CV_32F. */
+}
+
+#endif // HALF_HALF_H
@@ -0,0 +1,165 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QByteArray>
+#include <QFile>
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+
+#include "logger.h"
+#include "qtutils.h"
+
+namespace
+{
+
+const unsigned long FlushInterval = 250; // Milliseconds
+
+struct Message
+{
+    QByteArray text;
+    Message *next;
+};
+
+// Messages are pushed on the front and taken all at once, so there is no ABA problem
+QAtomicPointer<Message> pending;
+QAtomicInt accepting;
+QAtomicInt synchronous; // Set once close() has started, after which appending threads write their own messages
+
+QMutex fileLock;
+QFile file;
+
+void drain()
+{
+    Message *message = pending.fetchAndStoreAcquire(NULL);
+    if (message == NULL) return;
+
+    // Restore arrival order
+    Message *ordered = NULL;
+    while (message != NULL) {
+        Message *next = message->next;
+        message->next = ordered;
+        ordered = message;
+        message = next;
+    }
+
+    QMutexLocker locker(&fileLock);
+    while (ordered != NULL) {
+        if (file.isWritable())
+            file.write(ordered->text);
+        Message *next = ordered->next;
+        delete ordered;
+        ordered = next;
+    }
+    file.flush();
+}
+
+class Writer : public QThread
+{
+    QMutex lock;
+    QWaitCondition stop;
+    bool stopping;
+
+    void run()
+    {
+        QMutexLocker locker(&lock);
+        while (!stopping) {
+            stop.wait(&lock, FlushInterval);
+            locker.unlock();
+            drain();
+            locker.relock();
+        }
+    }
+
+public:
+    Writer() : stopping(false) {}
+
+    void finish()
+    {
+        {
+            QMutexLocker locker(&lock);
+            stopping = true;
+            stop.wakeAll();
+        }
+        wait();
+    }
+};
+
+Writer *writer = NULL;
+
+// Joins the writer and writes what is queued when the process exits without br::Context::finalize()
+struct Closer
+{
+    ~Closer() { Logger::close(); }
+} closer;
+
+} // namespace
+
+void Logger::open(const QString &fileName)
+{
+    close();
+    if (fileName.isEmpty()) return;
+
+    {
+        QMutexLocker locker(&fileLock);
+        file.setFileName(fileName);
+        QtUtils::touchDir(file);
+        file.open(QFile::Append);
+        file.write("================================================================================\n");
+    }
+
+    writer = new Writer();
+    writer->start();
+    synchronous.storeRelease(0);
+    accepting.storeRelease(1);
+}
+
+void Logger::close()
+{
+    // A message pushed after the final drain below is written by the thread that pushed it
+    synchronous.fetchAndStoreOrdered(1);
+    if (writer != NULL) {
+        writer->finish();
+        delete writer;
+        writer = NULL;
+    }
+    drain();
+
+    QMutexLocker locker(&fileLock);
+    accepting.storeRelease(0);
+    file.close();
+}
+
+void Logger::append(const QString &message)
+{
+    if (accepting.loadAcquire() == 0) return;
+
+    Message *node = new Message();
+    node->text = message.toLocal8Bit();
+    do {
+        node->next = pending.loadAcquire();
+    } while (!pending.testAndSetOrdered(node->next, node));
+
+    if (synchronous.loadAcquire() != 0)
+        drain();
+}
+
+void Logger::flush()
+{
+    drain();
+}
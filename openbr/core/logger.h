@@ -0,0 +1,39 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef LOGGER_LOGGER_H
+#define LOGGER_LOGGER_H
+
+#include <QString>
+
+/*!
+ * \brief Buffered writer for br::Context::log.
+ *
+ * Messages are pushed onto a lock-free queue, so threads that log never wait on the disk,
+ * and a background thread appends them to the log file and flushes it every quarter second.
+ * Fatal messages flush synchronously before the process aborts.
+ * Once close() starts, messages are written by the thread appending them,
+ * and a process exiting without br::Context::finalize() still closes the log.
+ */
+namespace Logger
+{
+    void open(const QString &fileName); /*!< \brief Starts appending to \em fileName, or stops logging if it is empty. */
+    void close(); /*!< \brief Writes any queued messages and closes the log file. */
+    void append(const QString &message); /*!< \brief Queues \em message for the log file, if one is open. */
+    void flush(); /*!< \brief Writes and flushes queued messages on the calling thread. */
+}
+
+#endif // LOGGER_LOGGER_H
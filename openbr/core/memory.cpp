@@ -0,0 +1,141 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QStringList>
+#include <algorithm>
+#ifdef Q_OS_WIN
+#include <windows.h>
+#include <psapi.h>
+#elif defined(Q_OS_MAC)
+#include <mach/mach.h>
+#else
+#include <unistd.h>
+#endif
+#include <openbr/openbr_plugin.h>
+
+#include "memory.h"
+
+using namespace br;
+
+namespace
+{
+
+struct Peak
+{
+    qint64 calls, bytes, growth, resident;
+    Peak() : calls(0), bytes(0), growth(0), resident(0) {}
+};
+
+QMutex lock;
+QHash<QString, Peak> peaks;
+qint64 processPeak = 0;
+
+QString megabytes(qint64 bytes)
+{
+    return QString::number(bytes / (1024.0 * 1024.0), 'f', 1);
+}
+
+} // namespace
+
+bool Memory::enabled()
+{
+    return (Globals != NULL) && Globals->trackMemory;
+}
+
+qint64 Memory::resident()
+{
+#if defined(Q_OS_WIN)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return qint64(counters.WorkingSetSize);
+#elif defined(Q_OS_MAC)
+    mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) return 0;
+    return qint64(info.resident_size);
+#else
+    // The second field of statm is resident pages
+    QFile statm("/proc/self/statm");
+    if (!statm.open(QFile::ReadOnly)) return 0;
+    const QList<QByteArray> fields = statm.readAll().split(' ');
+    if (fields.size() < 2) return 0;
+    return fields[1].toLongLong() * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+void Memory::hold(const QString &owner, qint64 bytes)
+{
+    if (!enabled()) return;
+    const qint64 now = resident();
+    QMutexLocker locker(&lock);
+    Peak &peak = peaks[owner];
+    peak.bytes = std::max(peak.bytes, bytes);
+    peak.resident = std::max(peak.resident, now);
+    processPeak = std::max(processPeak, now);
+}
+
+void Memory::report(const QString &job)
+{
+    if (!enabled()) return;
+    const qint64 now = resident();
+    QMutexLocker locker(&lock);
+    processPeak = std::max(processPeak, now);
+
+    // Largest holders first
+    QList< QPair<qint64, QString> > owners;
+    QHashIterator<QString, Peak> i(peaks);
+    while (i.hasNext()) {
+        i.next();
+        owners.append(QPair<qint64, QString>(-std::max(i.value().bytes, i.value().growth), i.key()));
+    }
+    std::sort(owners.begin(), owners.end());
+
+    QStringList lines;
+    lines.append(QString("%1 memory, peak resident %2 MB").arg(job, megabytes(processPeak)));
+    lines.append("Owner,Calls,Peak Held (MB),Peak Growth (MB),Peak Resident (MB)");
+    for (int j=0; j<owners.size(); j++) {
+        const Peak &peak = peaks[owners[j].second];
+        lines.append(QString("\"%1\",%2,%3,%4,%5").arg(QString(owners[j].second).replace("\"", "\"\""), QString::number(peak.calls),
+                                                    megabytes(peak.bytes), megabytes(peak.growth), megabytes(peak.resident)));
+    }
+    fprintf(stderr, "%s\n", qPrintable(lines.join("\n")));
+
+    peaks.clear();
+    processPeak = 0;
+}
+
+Memory::Scope::Scope(const QString &owner)
+    : owner(owner), start(0), bytes(0)
+{
+    active = enabled();
+    if (active) start = resident();
+}
+
+Memory::Scope::~Scope()
+{
+    if (!active) return;
+    const qint64 end = resident();
+    QMutexLocker locker(&lock);
+    Peak &peak = peaks[owner];
+    peak.calls++;
+    peak.bytes = std::max(peak.bytes, bytes);
+    peak.growth = std::max(peak.growth, end - start);
+    peak.resident = std::max(peak.resident, end);
+    processPeak = std::max(processPeak, end);
+}
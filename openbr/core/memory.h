@@ -0,0 +1,51 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef MEMORY_MEMORY_H
+#define MEMORY_MEMORY_H
+
+#include <QString>
+
+/*!
+ * \brief Opt-in attribution of memory to pipeline stages, galleries and outputs, enabled by br::Context::trackMemory.
+ *
+ * Each owner records the most bytes it held at once in its matrices,
+ * and the most the process resident set grew and peaked while it ran.
+ */
+namespace Memory
+{
+    bool enabled(); /*!< \brief Returns \c true if br::Context::trackMemory is set. */
+    qint64 resident(); /*!< \brief Current resident set size of the process in bytes, \c 0 if unknown. */
+    void hold(const QString &owner, qint64 bytes); /*!< \brief \em owner currently holds \em bytes. */
+    void report(const QString &job); /*!< \brief Prints the peaks recorded since the last report and clears them. */
+
+    /*!
+     * \brief Attributes resident set growth during its lifetime to \em owner.
+     */
+    class Scope
+    {
+        QString owner;
+        qint64 start, bytes;
+        bool active;
+
+    public:
+        Scope(const QString &owner);
+        ~Scope();
+        void setBytes(qint64 bytes_) { bytes = bytes_; } /*!< \brief Bytes held by the owner's output. */
+    };
+}
+
+#endif // MEMORY_MEMORY_H
@@ -0,0 +1,157 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QAtomicInt>
+#include <QMap>
+#include <QMutex>
+#include <QStringList>
+#include <QThreadPool>
+#include <QVector>
+
+#include "metrics.h"
+
+namespace
+{
+
+// Upper bounds in seconds of the histogram buckets, spanning a fast transform to a slow gallery comparison
+const double Buckets[] = { 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+const int NumBuckets = sizeof(Buckets) / sizeof(Buckets[0]);
+
+struct Histogram
+{
+    QVector<qint64> counts; // Not cumulative, the last count is above every bound
+    double sum;
+    qint64 count;
+    Histogram() : counts(NumBuckets+1, 0), sum(0), count(0) {}
+};
+
+enum Type { Counter, Gauge };
+
+QAtomicInt active(0);
+QMutex lock;
+// Keyed by name then labels so each family is written together in a stable order
+QMap<QString, Type> types;
+QMap<QString, QMap<QString, double> > values;
+QMap<QString, QMap<QString, Histogram> > histograms;
+
+void add(const QString &name, const QString &labels, double value, Type type)
+{
+    if (!Metrics::enabled()) return;
+    QMutexLocker locker(&lock);
+    types.insert(name, type);
+    values[name][labels] += value;
+}
+
+QString sample(const QString &name, const QString &labels, const QString &value)
+{
+    return name + (labels.isEmpty() ? QString() : "{" + labels + "}") + " " + value;
+}
+
+QString join(const QString &labels, const QString &label)
+{
+    return labels.isEmpty() ? label : labels + "," + label;
+}
+
+} // namespace
+
+bool Metrics::enabled()
+{
+    return active.load() != 0;
+}
+
+void Metrics::setEnabled(bool enabled)
+{
+    active.store(enabled ? 1 : 0);
+}
+
+void Metrics::increment(const QString &name, double value, const QString &labels)
+{
+    add(name, labels, value, Counter);
+}
+
+void Metrics::adjust(const QString &name, double delta, const QString &labels)
+{
+    add(name, labels, delta, Gauge);
+}
+
+void Metrics::observe(const QString &name, double seconds, const QString &labels)
+{
+    if (!enabled()) return;
+    int bucket = 0;
+    while ((bucket < NumBuckets) && (seconds > Buckets[bucket]))
+        bucket++;
+
+    QMutexLocker locker(&lock);
+    Histogram &histogram = histograms[name][labels];
+    histogram.counts[bucket]++;
+    histogram.sum += seconds;
+    histogram.count++;
+}
+
+QString Metrics::exposition()
+{
+    QStringList lines;
+    QThreadPool *pool = QThreadPool::globalInstance();
+    lines.append("# TYPE br_thread_pool_active_threads gauge");
+    lines.append(sample("br_thread_pool_active_threads", QString(), QString::number(pool->activeThreadCount())));
+    lines.append("# TYPE br_thread_pool_max_threads gauge");
+    lines.append(sample("br_thread_pool_max_threads", QString(), QString::number(pool->maxThreadCount())));
+
+    QMutexLocker locker(&lock);
+    QMapIterator<QString, QMap<QString, double> > i(values);
+    while (i.hasNext()) {
+        i.next();
+        lines.append("# TYPE " + i.key() + (types.value(i.key()) == Counter ? " counter" : " gauge"));
+        QMapIterator<QString, double> j(i.value());
+        while (j.hasNext()) {
+            j.next();
+            lines.append(sample(i.key(), j.key(), QString::number(j.value(), 'g', 15)));
+        }
+    }
+
+    QMapIterator<QString, QMap<QString, Histogram> > h(histograms);
+    while (h.hasNext()) {
+        h.next();
+        lines.append("# TYPE " + h.key() + " histogram");
+        QMapIterator<QString, Histogram> j(h.value());
+        while (j.hasNext()) {
+            j.next();
+            const Histogram &histogram = j.value();
+            qint64 cumulative = 0;
+            for (int k=0; k<NumBuckets; k++) {
+                cumulative += histogram.counts[k];
+                lines.append(sample(h.key() + "_bucket", join(j.key(), "le=\"" + QString::number(Buckets[k]) + "\""), QString::number(cumulative)));
+            }
+            lines.append(sample(h.key() + "_bucket", join(j.key(), "le=\"+Inf\""), QString::number(histogram.count)));
+            lines.append(sample(h.key() + "_sum", j.key(), QString::number(histogram.sum, 'g', 15)));
+            lines.append(sample(h.key() + "_count", j.key(), QString::number(histogram.count)));
+        }
+    }
+
+    return lines.join("\n") + "\n";
+}
+
+Metrics::Timer::Timer(const QString &name, const QString &labels)
+    : name(name), labels(labels)
+{
+    active = enabled();
+    if (active) timer.start();
+}
+
+Metrics::Timer::~Timer()
+{
+    if (active) observe(name, timer.nsecsElapsed() / 1e9, labels);
+}
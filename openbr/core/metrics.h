@@ -0,0 +1,53 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef METRICS_METRICS_H
+#define METRICS_METRICS_H
+
+#include <QElapsedTimer>
+#include <QString>
+
+/*!
+ * \brief Process wide counters, gauges and latency histograms for long running services.
+ *
+ * Collection is off until setEnabled() is called, so batch runs pay only a flag check.
+ * \em labels are written verbatim inside the braces of the Prometheus text exposition format, for example <tt>stage="1 Open"</tt>.
+ */
+namespace Metrics
+{
+    bool enabled(); /*!< \brief Returns \c true if metrics are being collected. */
+    void setEnabled(bool enabled); /*!< \brief Starts or stops collection. */
+    void increment(const QString &name, double value = 1, const QString &labels = QString()); /*!< \brief Adds \em value to a counter. */
+    void adjust(const QString &name, double delta, const QString &labels = QString()); /*!< \brief Adds \em delta to a gauge. */
+    void observe(const QString &name, double seconds, const QString &labels = QString()); /*!< \brief Records a duration in a histogram. */
+    QString exposition(); /*!< \brief Every metric in the Prometheus text exposition format. */
+
+    /*!
+     * \brief Observes its own lifetime in the histogram \em name.
+     */
+    class Timer
+    {
+        QString name, labels;
+        QElapsedTimer timer;
+        bool active;
+
+    public:
+        Timer(const QString &name, const QString &labels = QString());
+        ~Timer();
+    };
+}
+
+#endif // METRICS_METRICS_H
@@ -0,0 +1,124 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QFile>
+#include <QList>
+#include <QMutex>
+#include <QStringList>
+#include <QThreadStorage>
+#ifdef Q_OS_LINUX
+#include <sched.h>
+#endif
+
+#include "numa.h"
+
+using namespace br;
+
+namespace
+{
+
+struct Topology
+{
+    QList< QList<int> > cpus; // Per node
+
+    Topology()
+    {
+#ifdef Q_OS_LINUX
+        for (int node=0; ; node++) {
+            QFile file(QString("/sys/devices/system/node/node%1/cpulist").arg(node));
+            if (!file.open(QFile::ReadOnly)) break;
+
+            // Ranges like "0-7,16-23"
+            QList<int> nodeCPUs;
+            foreach (const QString &range, QString::fromLatin1(file.readAll()).trimmed().split(',', QString::SkipEmptyParts)) {
+                const QStringList bounds = range.split('-');
+                const int first = bounds.first().toInt(), last = bounds.last().toInt();
+                for (int cpu=first; cpu<=last; cpu++)
+                    nodeCPUs.append(cpu);
+            }
+            if (!nodeCPUs.isEmpty()) cpus.append(nodeCPUs);
+        }
+#endif // Q_OS_LINUX
+    }
+
+    int totalCPUs() const
+    {
+        int total = 0;
+        foreach (const QList<int> &nodeCPUs, cpus) total += nodeCPUs.size();
+        return total;
+    }
+};
+
+const Topology &topology()
+{
+    static const Topology topology;
+    return topology;
+}
+
+QMutex PoolsLock;
+QList<QThreadPool*> Pools;
+QThreadStorage<int*> BoundNode; // Stores node+1 so a default constructed value means unbound
+
+} // namespace
+
+int NUMA::nodes()
+{
+    if (!Globals->numa) return 1;
+    return qMax(1, topology().cpus.size());
+}
+
+QThreadPool *NUMA::pool(int node)
+{
+    if (nodes() == 1) return QThreadPool::globalInstance();
+
+    QMutexLocker locker(&PoolsLock);
+    while (Pools.size() <= node) {
+        const Topology &t = topology();
+        QThreadPool *pool = new QThreadPool();
+        const int share = Globals->parallelism * t.cpus[Pools.size()].size() / qMax(1, t.totalCPUs());
+        pool->setMaxThreadCount(qMax(1, share));
+        Pools.append(pool);
+    }
+    return Pools[node];
+}
+
+void NUMA::bind(int node)
+{
+    if (nodes() == 1) return;
+    if (BoundNode.hasLocalData() && (*BoundNode.localData() == node+1)) return;
+
+#ifdef Q_OS_LINUX
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    foreach (int cpu, topology().cpus[node])
+        CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        qWarning("Failed to bind thread to NUMA node %d.", node);
+#endif // Q_OS_LINUX
+
+    if (!BoundNode.hasLocalData()) BoundNode.setLocalData(new int(0));
+    *BoundNode.localData() = node+1;
+}
+
+void NUMA::release()
+{
+    QMutexLocker locker(&PoolsLock);
+    foreach (QThreadPool *pool, Pools) {
+        pool->waitForDone();
+        delete pool;
+    }
+    Pools.clear();
+}
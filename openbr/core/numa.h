@@ -0,0 +1,37 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_NUMA_H
+#define BR_NUMA_H
+
+#include <QThreadPool>
+#include <openbr/openbr_plugin.h>
+
+/*!
+ * \brief Thread placement across NUMA nodes, enabled by setting br::Context::numa.
+ *
+ * Nodes and their CPUs are read from <tt>/sys/devices/system/node</tt>, so placement is Linux only;
+ * elsewhere, or with a single node, everything stays on QThreadPool::globalInstance().
+ */
+namespace NUMA
+{
+    int nodes(); /*!< \brief Nodes work should be split across, \c 1 unless br::Context::numa is set on a machine with several. */
+    QThreadPool *pool(int node); /*!< \brief Threads for \em node, sized to its share of br::Context::parallelism. */
+    void bind(int node); /*!< \brief Restricts the calling thread to the CPUs of \em node, once per thread. */
+    void release(); /*!< \brief Waits for and frees the pools of every node, called by br::Context::finalize(). */
+}
+
+#endif // BR_NUMA_H
@@ -310,6 +310,36 @@ bool OpenCVUtils::overlaps(const QList<Rect> &posRects, const Rect &negRect, dou
     return false;
 }
 
+QList<Rect> OpenCVUtils::searchRegions(const QList<QRectF> &regions, const Size &size, float margin, int minSize)
+{
+    const Rect bounds(0, 0, size.width, size.height);
+    QList<Rect> rois;
+    foreach (const QRectF &region, regions) {
+        Rect roi = toRect(region.adjusted(-margin*region.width(), -margin*region.height(), margin*region.width(), margin*region.height())) & bounds;
+        if (roi.area() == 0) continue;
+
+        // Absorb overlapping regions so no part of the image is searched twice
+        for (int i=0; i<rois.size(); i++) {
+            if ((rois[i] & roi).area() == 0) continue;
+            roi |= rois.takeAt(i);
+            i = -1;
+        }
+        rois.append(roi);
+    }
+
+    QList<Rect> result;
+    foreach (const Rect &roi, rois)
+        if ((roi.width >= minSize) && (roi.height >= minSize))
+            result.append(roi);
+    return result;
+}
+
+uchar *OpenCVUtils::alignedBuffer(QVector<uchar> &buffer, size_t bytes)
+{
+    buffer = QVector<uchar>(int(bytes + SIMDAlignment - 1), 0);
+    return alignPtr(buffer.data(), SIMDAlignment);
+}
+
 QDataStream &operator<<(QDataStream &stream, const Mat &m)
 {
     // Write header
@@ -21,6 +21,7 @@
 #include <QDebug>
 #include <QString>
 #include <QStringList>
+#include <QVector>
 #include <opencv2/core/core.hpp>
 
 namespace OpenCVUtils
@@ -89,7 +90,15 @@ namespace OpenCVUtils
     QList<QRectF> fromRects(const QList<cv::Rect> &cvRects);
     bool overlaps(const QList<cv::Rect> &posRects, const cv::Rect &negRect, double overlap);
 
+    // Regions grown by margin of their size on each side, clipped to size, merged where they overlap, and dropped when smaller than minSize
+    QList<cv::Rect> searchRegions(const QList<QRectF> &regions, const cv::Size &size, float margin = 0, int minSize = 1);
+
     int getFourcc();
+
+    // Layout of matrices packed for batch comparison, one per row starting on a SIMDAlignment byte boundary
+    const int SIMDAlignment = 64;
+    inline size_t alignedStep(size_t bytes) { return (bytes + SIMDAlignment - 1) / SIMDAlignment * SIMDAlignment; }
+    uchar *alignedBuffer(QVector<uchar> &buffer, size_t bytes); // Zero filled, buffer owns the memory
 }
 
 QDebug operator<<(QDebug dbg, const cv::Mat &m);
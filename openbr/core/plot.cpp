@@ -14,6 +14,13 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#ifndef BR_EMBEDDED
+#include <QGuiApplication>
+#include <QImage>
+#include <QPainter>
+#include <QSvgRenderer>
+#endif // BR_EMBEDDED
+#include <limits>
 #include "plot.h"
 #include "version.h"
 #include "openbr/core/qtutils.h"
@@ -213,11 +220,194 @@ struct RPlot
     }
 };
 
+// A curve read from one evaluation file for NativePlot
+struct Series
+{
+    QString name;
+    QVector<QPointF> points;
+};
+
+// Thins the curve to at most one point per bin, with bins evenly spaced in log10(x) so that low FAR detail survives.
+// Each bin keeps its highest point if highest, which preserves the upper envelope of an ROC,
+// and its lowest point otherwise, which preserves the lower envelope of a DET.
+static QVector<QPointF> logSample(const QVector<QPointF> &points, int bins, bool highest)
+{
+    double minX = std::numeric_limits<double>::max(), maxX = -std::numeric_limits<double>::max();
+    foreach (const QPointF &point, points)
+        if (point.x() > 0) {
+            minX = std::min(minX, log10(point.x()));
+            maxX = std::max(maxX, log10(point.x()));
+        }
+    if ((minX > maxX) || (points.size() <= bins)) return points;
+
+    QVector<QPointF> sampled;
+    int previousBin = -1;
+    foreach (const QPointF &point, points) {
+        if (point.x() <= 0) continue;
+        const int bin = (maxX == minX) ? 0 : std::min(bins-1, int((log10(point.x()) - minX) / (maxX - minX) * bins));
+        if (bin != previousBin) sampled.append(point);
+        else if (highest ? (point.y() > sampled.last().y()) : (point.y() < sampled.last().y())) sampled.last() = point;
+        previousBin = bin;
+    }
+    return sampled;
+}
+
+// Streams the (X,Y) rows of one plot type from an evaluation CSV
+static QVector<QPointF> readSeries(const QString &fileName, const QString &plot)
+{
+    QFile file(fileName);
+    if (!file.open(QFile::ReadOnly)) qFatal("Failed to open %s for reading.", qPrintable(fileName));
+
+    const QByteArray prefix = plot.toLatin1() + ",";
+    QVector<QPointF> points;
+    while (!file.atEnd()) {
+        const QByteArray line = file.readLine();
+        if (!line.startsWith(prefix)) continue;
+        const QList<QByteArray> words = line.trimmed().split(',');
+        if (words.size() < 3) continue;
+        points.append(QPointF(words[1].toDouble(), words[2].toDouble()));
+    }
+    return points;
+}
+
+static QString escapeXML(QString string)
+{
+    return string.replace("&", "&amp;").replace("<", "&lt;").replace(">", "&gt;").replace("\"", "&quot;");
+}
+
+// Renders the curves as a standalone SVG document with log10 or linear axes
+static QString renderSVG(const QString &title, const QString &xLabel, const QString &yLabel, const QList<Series> &series, bool logX, bool logY)
+{
+    static const char *colors[] = { "#E41A1C", "#377EB8", "#4DAF4A", "#984EA3", "#FF7F00", "#A65628", "#F781BF", "#999999" };
+    static const int numColors = sizeof(colors) / sizeof(colors[0]);
+    const int width = 800, height = 500, left = 70, right = 560, top = 40, bottom = 440;
+
+    // Axis ranges, log axes span whole decades
+    double x0 = std::numeric_limits<double>::max(), x1 = -x0, y0 = x0, y1 = -x0;
+    foreach (const Series &curve, series)
+        foreach (const QPointF &point, curve.points) {
+            if ((logX && (point.x() <= 0)) || (logY && (point.y() <= 0))) continue;
+            const double x = logX ? log10(point.x()) : point.x();
+            const double y = logY ? log10(point.y()) : point.y();
+            x0 = std::min(x0, x); x1 = std::max(x1, x);
+            y0 = std::min(y0, y); y1 = std::max(y1, y);
+        }
+    if (x0 > x1) { x0 = 0; x1 = 1; y0 = 0; y1 = 1; }
+    if (logX) { x0 = floor(x0); x1 = std::max(ceil(x1), x0+1); }
+    else      { x0 = std::min(x0, 0.0); x1 = std::max(x1, x0+1e-6); }
+    if (logY) { y0 = floor(y0); y1 = std::max(ceil(y1), y0+1); }
+    else      { y0 = std::min(y0, 0.0); y1 = std::max(y1, 1.0); }
+
+    QStringList svg;
+    svg.append(QString("<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%1\" height=\"%2\" font-family=\"sans-serif\" font-size=\"12\">").arg(width).arg(height));
+    svg.append(QString("<rect width=\"%1\" height=\"%2\" fill=\"white\"/>").arg(width).arg(height));
+    svg.append(QString("<text x=\"%1\" y=\"24\" text-anchor=\"middle\" font-size=\"14\">%2</text>").arg((left+right)/2).arg(escapeXML(title)));
+
+    // Grid and tick labels
+    const int xTicks = logX ? int(x1-x0) : 10, yTicks = logY ? int(y1-y0) : 10;
+    for (int i=0; i<=xTicks; i++) {
+        const double x = left + double(i)/xTicks*(right-left);
+        const double val = x0 + double(i)/xTicks*(x1-x0);
+        svg.append(QString("<line x1=\"%1\" y1=\"%2\" x2=\"%1\" y2=\"%3\" stroke=\"#DDDDDD\"/>").arg(x).arg(top).arg(bottom));
+        svg.append(QString("<text x=\"%1\" y=\"%2\" text-anchor=\"middle\">%3</text>").arg(x).arg(bottom+16).arg(logX ? QString("1e%1").arg(val) : QString::number(val, 'g', 3)));
+    }
+    for (int i=0; i<=yTicks; i++) {
+        const double y = bottom - double(i)/yTicks*(bottom-top);
+        const double val = y0 + double(i)/yTicks*(y1-y0);
+        svg.append(QString("<line x1=\"%1\" y1=\"%2\" x2=\"%3\" y2=\"%2\" stroke=\"#DDDDDD\"/>").arg(left).arg(y).arg(right));
+        svg.append(QString("<text x=\"%1\" y=\"%2\" text-anchor=\"end\">%3</text>").arg(left-6).arg(y+4).arg(logY ? QString("1e%1").arg(val) : QString::number(val, 'g', 3)));
+    }
+    svg.append(QString("<rect x=\"%1\" y=\"%2\" width=\"%3\" height=\"%4\" fill=\"none\" stroke=\"black\"/>").arg(left).arg(top).arg(right-left).arg(bottom-top));
+    svg.append(QString("<text x=\"%1\" y=\"%2\" text-anchor=\"middle\">%3</text>").arg((left+right)/2).arg(bottom+36).arg(escapeXML(xLabel)));
+    svg.append(QString("<text transform=\"translate(18,%1) rotate(-90)\" text-anchor=\"middle\">%2</text>").arg((top+bottom)/2).arg(escapeXML(yLabel)));
+
+    // Curves and legend
+    for (int i=0; i<series.size(); i++) {
+        QStringList coordinates;
+        foreach (const QPointF &point, series[i].points) {
+            if ((logX && (point.x() <= 0)) || (logY && (point.y() <= 0))) continue;
+            const double x = ((logX ? log10(point.x()) : point.x()) - x0) / (x1 - x0);
+            const double y = ((logY ? log10(point.y()) : point.y()) - y0) / (y1 - y0);
+            coordinates.append(QString("%1,%2").arg(left + x*(right-left), 0, 'f', 2).arg(bottom - y*(bottom-top), 0, 'f', 2));
+        }
+        const QString color = colors[i % numColors];
+        const QString dash = (i / numColors) % 2 ? " stroke-dasharray=\"6,3\"" : "";
+        svg.append(QString("<polyline fill=\"none\" stroke=\"%1\" stroke-width=\"1.5\"%2 points=\"%3\"/>").arg(color, dash, coordinates.join(" ")));
+        svg.append(QString("<line x1=\"%1\" y1=\"%2\" x2=\"%3\" y2=\"%2\" stroke=\"%4\" stroke-width=\"2\"%5/>").arg(right+20).arg(top+10+18*i).arg(right+44).arg(color, dash));
+        svg.append(QString("<text x=\"%1\" y=\"%2\">%3</text>").arg(right+50).arg(top+14+18*i).arg(escapeXML(series[i].name)));
+    }
+
+    svg.append("</svg>");
+    return svg.join("\n");
+}
+
+static bool writeFigure(const QString &svg, const QString &fileName, const QString &suffix)
+{
+    if (suffix == "svg") {
+        QtUtils::writeFile(fileName, svg);
+        return true;
+    }
+
+#ifndef BR_EMBEDDED
+    // Rasterizing needs fonts, which need a QGuiApplication
+    if (qobject_cast<QGuiApplication*>(QCoreApplication::instance()) != NULL) {
+        QSvgRenderer renderer(svg.toUtf8());
+        QImage image(renderer.defaultSize(), QImage::Format_RGB32);
+        image.fill(Qt::white);
+        QPainter painter(&image);
+        renderer.render(&painter);
+        painter.end();
+        return image.save(fileName);
+    }
+#endif // BR_EMBEDDED
+
+    qWarning("Unable to render %s, use an svg destination or run with a GUI application.", qPrintable(fileName));
+    return false;
+}
+
+// Renders the ROC, DET and CMC figures in process, one file each
+static bool NativePlot(QStringList files, const File &destination, bool show)
+{
+    if (files.isEmpty()) qFatal("Empty file list.");
+    qSort(files.begin(), files.end(), sortFiles);
+
+    const QFileInfo fileInfo(destination);
+    const QString basename = fileInfo.path() + "/" + fileInfo.completeBaseName();
+    const QString suffix = fileInfo.suffix().isEmpty() ? QString("svg") : fileInfo.suffix();
+    const int bins = destination.get<int>("bins", 1000);
+
+    QList<Series> rocs, dets, cmcs;
+    foreach (const QString &fileName, files) {
+        Series series;
+        series.name = getPivots(fileName, false).join(" ");
+
+        // DET rows hold (FAR, FRR), thinned once to the lowest FRR per bin and shared by the ROC as the highest TAR
+        series.points = logSample(readSeries(fileName, "DET"), bins, false);
+        dets.append(series);
+        for (int i=0; i<series.points.size(); i++)
+            series.points[i].setY(1 - series.points[i].y());
+        rocs.append(series);
+
+        series.points = readSeries(fileName, "CMC");
+        cmcs.append(series);
+    }
+
+    bool success = true;
+    success &= writeFigure(renderSVG("ROC", "False Accept Rate", "True Accept Rate", rocs, true, false), basename+"_ROC."+suffix, suffix);
+    success &= writeFigure(renderSVG("DET", "False Accept Rate", "False Reject Rate", dets, true, true), basename+"_DET."+suffix, suffix);
+    success &= writeFigure(renderSVG("CMC", "Rank", "Retrieval Rate", cmcs, true, false), basename+"_CMC."+suffix, suffix);
+    if (success && show) QtUtils::showFile(basename+"_ROC."+suffix);
+    return success;
+}
+
 // Does not work if dataset folder starts with a number
 bool Plot(const QStringList &files, const File &destination, bool show)
 {
     qDebug("Plotting %d file(s) to %s", files.size(), qPrintable(destination));
 
+    if (destination.getBool("native"))
+        return NativePlot(files, destination, show);
+
     const bool minimalist = destination.getBool("minimalist");
 
     // Use a br::file for simple storage of plot options
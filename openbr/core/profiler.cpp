@@ -0,0 +1,284 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QStringList>
+#include <QThread>
+#include <QThreadStorage>
+#include <time.h>
+#ifdef Q_OS_WIN
+#include <windows.h>
+#endif
+
+#include "profiler.h"
+#include "qtutils.h"
+
+using namespace br;
+
+namespace
+{
+
+struct Event
+{
+    QString name;
+    const char *category;
+    qint64 start, duration, cpu, bytes;
+    int thread;
+};
+
+struct Summary
+{
+    qint64 calls, wall, cpu, bytes, waits, wait;
+    Summary() : calls(0), wall(0), cpu(0), bytes(0), waits(0), wait(0) {}
+};
+
+struct Slot
+{
+    QAtomicInt ready;
+    int track, frame, thread;
+    const char *name;
+    qint64 begin, end; // end < 0 for instants
+    Slot() : track(0), frame(0), thread(0), name(NULL), begin(0), end(0) {}
+};
+
+// Later events are only summarized so long runs don't exhaust memory
+const int MaxEvents = 1 << 20;
+
+// Older frame events are overwritten once the ring wraps, so long runs keep their most recent history
+const int Capacity = 1 << 16;
+
+QMutex lock;
+bool forced = false;
+QAtomicPointer<QElapsedTimer> timer;
+QList<Event> events;
+QHash<QString, Summary> summaries;
+QHash<Qt::HANDLE, int> threads;
+QStringList tracks;
+
+Slot slots[Capacity];
+QAtomicInt next, slotThreads;
+QThreadStorage<int> slotThread;
+
+qint64 cpuTime()
+{
+#if defined(Q_OS_WIN)
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) return 0;
+    return ((qint64(kernel.dwHighDateTime) << 32 | kernel.dwLowDateTime) + (qint64(user.dwHighDateTime) << 32 | user.dwLowDateTime)) / 10;
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+    timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0;
+    return qint64(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+#else
+    return 0;
+#endif
+}
+
+void append(int track, const char *name, int frame, qint64 begin, qint64 end)
+{
+    if (track < 0) return;
+    if (!slotThread.hasLocalData())
+        slotThread.setLocalData(slotThreads.fetchAndAddRelaxed(1));
+    Slot &slot = slots[uint(next.fetchAndAddRelaxed(1)) % Capacity];
+    slot.ready.storeRelease(0);
+    slot.track = track;
+    slot.name = name;
+    slot.frame = frame;
+    slot.thread = slotThread.localData();
+    slot.begin = begin;
+    slot.end = end;
+    slot.ready.storeRelease(1);
+}
+
+} // namespace
+
+bool Profiler::enabled()
+{
+    return forced || ((Globals != NULL) && !Globals->profile.isEmpty());
+}
+
+void Profiler::setForced(bool forced_)
+{
+    QMutexLocker locker(&lock);
+    forced = forced_;
+}
+
+qint64 Profiler::now()
+{
+    // Lock free so per frame events don't serialize the stages they observe
+    QElapsedTimer *elapsed = timer.loadAcquire();
+    if (elapsed == NULL) {
+        QElapsedTimer *started = new QElapsedTimer();
+        started->start();
+        if (!timer.testAndSetOrdered(NULL, started)) delete started;
+        elapsed = timer.loadAcquire();
+    }
+    return elapsed->nsecsElapsed() / 1000;
+}
+
+qint64 Profiler::bytes(const TemplateList &templates)
+{
+    qint64 bytes = 0;
+    foreach (const Template &t, templates)
+        foreach (const cv::Mat &m, t)
+            bytes += m.total() * m.elemSize();
+    return bytes;
+}
+
+void Profiler::recordWait(const QString &name, qint64 microseconds)
+{
+    QMutexLocker locker(&lock);
+    Summary &summary = summaries[name];
+    summary.waits++;
+    summary.wait += microseconds;
+}
+
+int Profiler::track(const QString &name)
+{
+    QMutexLocker locker(&lock);
+    int index = tracks.indexOf(name);
+    if (index == -1) {
+        index = tracks.size();
+        tracks.append(name);
+    }
+    return index;
+}
+
+void Profiler::record(int track, const char *name, int frame, qint64 begin, qint64 end)
+{
+    append(track, name, frame, begin, qMax(begin, end));
+}
+
+void Profiler::mark(int track, const char *name, int frame)
+{
+    append(track, name, frame, now(), -1);
+}
+
+Profiler::Scope::Scope(const QString &name, const char *category)
+    : name(name), category(category), start(0), cpuStart(0), outputBytes(0)
+{
+    active = enabled();
+    if (!active) return;
+    start = now();
+    cpuStart = cpuTime();
+}
+
+Profiler::Scope::~Scope()
+{
+    if (!active) return;
+    const qint64 duration = now() - start;
+    const qint64 cpu = cpuTime() - cpuStart;
+
+    QMutexLocker locker(&lock);
+    Summary &summary = summaries[name];
+    summary.calls++;
+    summary.wall += duration;
+    summary.cpu += cpu;
+    summary.bytes += outputBytes;
+
+    if (events.size() < MaxEvents) {
+        const Qt::HANDLE handle = QThread::currentThreadId();
+        if (!threads.contains(handle)) threads.insert(handle, threads.size());
+        Event event;
+        event.name = name;
+        event.category = category;
+        event.start = start;
+        event.duration = duration;
+        event.cpu = cpu;
+        event.bytes = outputBytes;
+        event.thread = threads[handle];
+        events.append(event);
+    }
+}
+
+QString Profiler::takeSummary()
+{
+    QMutexLocker locker(&lock);
+    QStringList names;
+    QHashIterator<QString, Summary> i(summaries);
+    while (i.hasNext()) {
+        i.next();
+        const Summary &s = i.value();
+        names.append(QString("%1:{\"calls\":%2,\"wall\":%3,\"cpu\":%4,\"bytes\":%5,\"waits\":%6,\"wait\":%7}")
+                     .arg(QtUtils::toJsonString(i.key()), QString::number(s.calls), QString::number(s.wall), QString::number(s.cpu),
+                          QString::number(s.bytes), QString::number(s.waits), QString::number(s.wait)));
+    }
+    summaries.clear();
+    return "{" + names.join(",") + "}";
+}
+
+void Profiler::write()
+{
+    if ((Globals == NULL) || Globals->profile.isEmpty()) return;
+    QMutexLocker locker(&lock);
+
+    QStringList traceEvents;
+    foreach (const Event &event, events)
+        traceEvents.append(QString("{\"name\":%1,\"cat\":\"%2\",\"ph\":\"X\",\"ts\":%3,\"dur\":%4,\"pid\":0,\"tid\":%5,\"args\":{\"cpu\":%6,\"bytes\":%7}}")
+                           .arg(QtUtils::toJsonString(event.name), event.category, QString::number(event.start), QString::number(event.duration),
+                                QString::number(event.thread), QString::number(event.cpu), QString::number(event.bytes)));
+
+    // Process 0 holds the scopes, frame tracks follow it
+    for (int i=0; i<tracks.size(); i++)
+        traceEvents.append(QString("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%1,\"args\":{\"name\":%2}}").arg(QString::number(i+1), QtUtils::toJsonString(tracks[i])));
+
+    const int recorded = int(qMin(uint(next.loadAcquire()), uint(Capacity)));
+    for (int i=0; i<recorded; i++) {
+        const Slot &slot = slots[i];
+        if (slot.ready.loadAcquire() == 0) continue;
+        if (slot.end < 0)
+            traceEvents.append(QString("{\"name\":\"%1\",\"cat\":\"frame\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%2,\"pid\":%3,\"tid\":%4,\"args\":{\"frame\":%5}}")
+                               .arg(slot.name, QString::number(slot.begin), QString::number(slot.track+1), QString::number(slot.thread), QString::number(slot.frame)));
+        else
+            traceEvents.append(QString("{\"name\":\"%1\",\"cat\":\"frame\",\"ph\":\"X\",\"ts\":%2,\"dur\":%3,\"pid\":%4,\"tid\":%5,\"args\":{\"frame\":%6}}")
+                               .arg(slot.name, QString::number(slot.begin), QString::number(slot.end - slot.begin), QString::number(slot.track+1),
+                                    QString::number(slot.thread), QString::number(slot.frame)));
+    }
+
+    QFile trace(Globals->profile);
+    if (!trace.open(QFile::WriteOnly))
+        qFatal("Unable to open %s for writing.", qPrintable(Globals->profile));
+    trace.write(qPrintable("{\"traceEvents\":[\n" + traceEvents.join(",\n") + "\n]}\n"));
+    trace.close();
+
+    QStringList lines;
+    lines.append("Name,Calls,Wall (us),CPU (us),Output Bytes,Queued Frames,Queue Wait (us)");
+    QHashIterator<QString, Summary> i(summaries);
+    while (i.hasNext()) {
+        i.next();
+        const Summary &s = i.value();
+        lines.append(QString("\"%1\",%2,%3,%4,%5,%6,%7").arg(QString(i.key()).replace("\"", "\"\""), QString::number(s.calls), QString::number(s.wall), QString::number(s.cpu),
+                                                        QString::number(s.bytes), QString::number(s.waits), QString::number(s.wait)));
+    }
+
+    QFile summary(Globals->profile + ".csv");
+    if (!summary.open(QFile::WriteOnly))
+        qFatal("Unable to open %s for writing.", qPrintable(summary.fileName()));
+    summary.write(qPrintable(lines.join("\n") + "\n"));
+    summary.close();
+
+    events.clear();
+    summaries.clear();
+    threads.clear();
+    for (int i=0; i<recorded; i++)
+        slots[i].ready.storeRelease(0);
+    next.storeRelease(0);
+}
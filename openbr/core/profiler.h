@@ -0,0 +1,61 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef PROFILER_PROFILER_H
+#define PROFILER_PROFILER_H
+
+#include <QString>
+#include <openbr/openbr_plugin.h>
+
+/*!
+ * \brief Opt-in timing of pipeline stages, enabled by setting br::Context::profile.
+ *
+ * Records call counts, wall and CPU time, output bytes and queue waits per name,
+ * and writes them as a Chrome trace (viewable in chrome://tracing) with a CSV summary at br::Context::finalize().
+ * Per frame Stream events go to a fixed size ring buffer without locking, so recording doesn't serialize the stages it observes,
+ * and appear in the same trace with one process per track.
+ */
+namespace Profiler
+{
+    bool enabled(); /*!< \brief Returns \c true if br::Context::profile is set or collection is forced. */
+    void setForced(bool forced); /*!< \brief Collect timings even if br::Context::profile is not set, used by br::Benchmark(). */
+    qint64 now(); /*!< \brief Microseconds since profiling started. */
+    qint64 bytes(const br::TemplateList &templates); /*!< \brief Matrix bytes held by \em templates. */
+    void recordWait(const QString &name, qint64 microseconds); /*!< \brief Time a frame spent queued before \em name. */
+    int track(const QString &name); /*!< \brief Returns the trace process for per frame events named \em name, registering it if needed. */
+    void record(int track, const char *name, int frame, qint64 begin, qint64 end); /*!< \brief Records an interval of \em frame on \em track. */
+    void mark(int track, const char *name, int frame); /*!< \brief Records an instant on \em track concerning \em frame. */
+    QString takeSummary(); /*!< \brief Returns the per name summary since the last call as a JSON object, and clears it from the CSV summary. */
+    void write(); /*!< \brief Writes the trace and summary, called by br::Context::finalize(). */
+
+    /*!
+     * \brief Times its own lifetime as one call to \em name.
+     */
+    class Scope
+    {
+        QString name;
+        const char *category;
+        qint64 start, cpuStart, outputBytes;
+        bool active;
+
+    public:
+        Scope(const QString &name, const char *category);
+        ~Scope();
+        void setBytes(qint64 bytes) { outputBytes = bytes; } /*!< \brief Bytes produced by the call. */
+    };
+}
+
+#endif // PROFILER_PROFILER_H
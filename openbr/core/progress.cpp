@@ -0,0 +1,153 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QAtomicInt>
+#include <QList>
+#include <QThreadStorage>
+#include <algorithm>
+#include <openbr/openbr_plugin.h>
+
+#include "progress.h"
+
+using namespace br;
+
+namespace
+{
+
+QMutex scopesLock;
+QList<Progress*> scopes; // In the order they were opened
+QThreadStorage< QList<Progress*> > threadScopes; // Opened by each thread, innermost last
+QAtomicInt lastId(0);
+
+} // namespace
+
+Progress::Progress(const QString &name, double totalSteps)
+    : name(name), identifier(lastId.fetchAndAddOrdered(1) + 1), currentSteps(0), totalSteps(totalSteps)
+{
+    timer.start();
+    threadScopes.localData().append(this);
+    QMutexLocker locker(&scopesLock);
+    scopes.append(this);
+    if (scopes.size() == 1) {
+        Globals->startTime.start();
+        publish();
+    }
+}
+
+Progress::~Progress()
+{
+    threadScopes.localData().removeOne(this);
+    QMutexLocker locker(&scopesLock);
+    scopes.removeOne(this);
+    if (scopes.isEmpty()) {
+        Globals->currentStep = 0;
+        Globals->totalSteps = 0;
+    }
+}
+
+void Progress::publish() const
+{
+    Globals->currentStep = currentSteps;
+    Globals->totalSteps = totalSteps;
+}
+
+// The scopes lock is never taken while holding a scope's lock
+void Progress::addTotal(double steps)
+{
+    const bool outermost = (root() == this);
+    QMutexLocker locker(&lock);
+    totalSteps += steps;
+    if (outermost) publish();
+}
+
+void Progress::step(double steps)
+{
+    const bool outermost = (root() == this);
+    QMutexLocker locker(&lock);
+    currentSteps += steps;
+    if (outermost) publish();
+}
+
+double Progress::completed() const
+{
+    QMutexLocker locker(&lock);
+    return currentSteps;
+}
+
+double Progress::total() const
+{
+    QMutexLocker locker(&lock);
+    return totalSteps;
+}
+
+qint64 Progress::elapsed() const
+{
+    return timer.elapsed();
+}
+
+double Progress::rate() const
+{
+    const qint64 ms = std::max(qint64(1), timer.elapsed());
+    return 1000 * completed() / ms;
+}
+
+int Progress::remaining() const
+{
+    QMutexLocker locker(&lock);
+    if ((totalSteps <= 0) || (currentSteps <= 0)) return -1;
+    const double p = std::min(1.0, currentSteps / totalSteps);
+    return std::max(0, int((1 - p) / p * timer.elapsed() / 1000));
+}
+
+Progress *Progress::root()
+{
+    QMutexLocker locker(&scopesLock);
+    return scopes.isEmpty() ? NULL : scopes.first();
+}
+
+Progress *Progress::current()
+{
+    const QList<Progress*> &opened = threadScopes.localData();
+    if (!opened.isEmpty()) return opened.last();
+    return root();
+}
+
+bool Progress::step(int id, double steps)
+{
+    // Held so the scope can't close while it is stepped
+    QMutexLocker locker(&scopesLock);
+    foreach (Progress *scope, scopes)
+        if (scope->identifier == id) {
+            QMutexLocker scopeLocker(&scope->lock);
+            scope->currentSteps += steps;
+            if (scopes.first() == scope) scope->publish();
+            return true;
+        }
+    return false;
+}
+
+bool Progress::addTotal(int id, double steps)
+{
+    QMutexLocker locker(&scopesLock);
+    foreach (Progress *scope, scopes)
+        if (scope->identifier == id) {
+            QMutexLocker scopeLocker(&scope->lock);
+            scope->totalSteps += steps;
+            if (scopes.first() == scope) scope->publish();
+            return true;
+        }
+    return false;
+}
@@ -0,0 +1,63 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef PROGRESS_PROGRESS_H
+#define PROGRESS_PROGRESS_H
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QString>
+
+/*!
+ * \brief A scope of work whose steps and rate are counted separately from the scopes around it.
+ *
+ * Only the outermost open scope of the process drives br::Context::currentStep, br::Context::totalSteps and br::Context::startTime,
+ * so work nested inside a job, like enrolling a gallery inside a comparison, no longer resets the job's progress.
+ * A scope is closed by the thread that opened it and nests inside that thread's open scopes.
+ * Steps may be taken concurrently, from other threads through the scope's id(), which is safe even after the scope closes.
+ */
+class Progress
+{
+    QString name;
+    int identifier;
+    mutable QMutex lock;
+    double currentSteps, totalSteps;
+    QElapsedTimer timer;
+
+    void publish() const;
+
+public:
+    Progress(const QString &name, double totalSteps = 0); /*!< \brief Opens a scope of \em totalSteps. */
+    ~Progress(); /*!< \brief Closes the scope. */
+
+    void addTotal(double steps); /*!< \brief Grows the total, for work discovered while streaming. */
+    void step(double steps = 1); /*!< \brief Records completed steps. */
+
+    QString getName() const { return name; } /*!< \brief The scope's name. */
+    int id() const { return identifier; } /*!< \brief Identifies the scope to step(int, double), never \c 0 and never reused. */
+    double completed() const; /*!< \brief Steps completed. */
+    double total() const; /*!< \brief Steps expected. */
+    qint64 elapsed() const; /*!< \brief Milliseconds since the scope opened. */
+    double rate() const; /*!< \brief Steps per second of wall time since the scope opened. */
+    int remaining() const; /*!< \brief Estimated seconds remaining, \c -1 if unknown. */
+
+    static Progress *root(); /*!< \brief The outermost open scope, or \c NULL. */
+    static Progress *current(); /*!< \brief The innermost scope the calling thread opened and hasn't closed, otherwise root(). */
+    static bool step(int id, double steps = 1); /*!< \brief Records completed steps of the scope \em id, returns \c false if it is closed. */
+    static bool addTotal(int id, double steps); /*!< \brief Grows the total of the scope \em id, returns \c false if it is closed. */
+};
+
+#endif // PROGRESS_PROGRESS_H
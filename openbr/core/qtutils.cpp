@@ -438,6 +438,27 @@ QString toTime(int s)
     return QString("%1:%2:%3").arg(h,2,10,fillChar).arg(m,2,10,fillChar).arg(s,2,10,fillChar);
 }
 
+QString toJsonString(const QString &string)
+{
+    QString escaped;
+    escaped.reserve(string.size() + 2);
+    escaped.append('"');
+    foreach (const QChar &c, string) {
+        switch (c.unicode()) {
+          case '"':  escaped.append("\\\""); break;
+          case '\\': escaped.append("\\\\"); break;
+          case '\n': escaped.append("\\n"); break;
+          case '\r': escaped.append("\\r"); break;
+          case '\t': escaped.append("\\t"); break;
+          default:
+            if (c.unicode() < 0x20) escaped.append(QString("\\u%1").arg(int(c.unicode()), 4, 16, QLatin1Char('0')));
+            else                    escaped.append(c);
+        }
+    }
+    escaped.append('"');
+    return escaped;
+}
+
 float euclideanLength(const QPointF &point)
 {
     return sqrt(pow(point.x(), 2) + pow(point.y(), 2));
@@ -66,6 +66,7 @@ namespace QtUtils
     QRectF toRect(const QString &string, bool *ok = NULL);
     QStringList naturalSort(const QStringList &strings);
     QString toTime(int s);
+    QString toJsonString(const QString &string);
 
     /**** Process Utilities ****/
     bool runRScript(const QString &file);
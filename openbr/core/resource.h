@@ -20,10 +20,11 @@
 #include <QHash>
 #include <QList>
 #include <QMutex>
-#include <QSemaphore>
+#include <QPair>
 #include <QSharedPointer>
 #include <QString>
 #include <QThread>
+#include <QWaitCondition>
 #include <openbr/openbr_plugin.h>
 
 namespace br
@@ -45,48 +46,76 @@ class DefaultResourceMaker : public ResourceMaker<T>
 
 // Manage multiple copies of a limited resource in a thread-safe manner.
 // TimeVaryingTransform makes a strong assumption that ResourceMaker::Make
-// is only called in acquire, not in the constructor.
+// is only called in acquire, not in the constructor, unless prewarm is called.
+//
+// Released copies remember the thread that released them and are handed back
+// to that thread first, so heavy per-thread models stay in its cache. A thread
+// without one of its own creates a new copy while under the limit, then steals
+// the copy idle the longest.
 template <typename T>
 class Resource
 {
+    struct Pool
+    {
+        QMutex lock;
+        QWaitCondition released;
+        QList< QPair<QThread*, T*> > idle; // Most recently released last
+        int created, maxResources;
+
+        Pool() : created(0), maxResources(br::Globals->parallelism) {}
+        ~Pool()
+        {
+            for (int i=0; i<idle.size(); i++)
+                delete idle[i].second;
+        }
+    };
+
     QSharedPointer< ResourceMaker<T> > resourceMaker;
-    QSharedPointer< QList<T*> > availableResources;
-    QSharedPointer<QMutex> lock;
-    QSharedPointer<QSemaphore> totalResources;
+    QSharedPointer<Pool> pool;
 
 public:
     Resource(ResourceMaker<T> *rm = new DefaultResourceMaker<T>())
         : resourceMaker(rm)
-        , availableResources(new QList<T*>())
-        , lock(new QMutex())
-        , totalResources(new QSemaphore(br::Globals->parallelism))
+        , pool(new Pool())
     {}
 
-    ~Resource()
+    T *acquire() const
     {
-        qDeleteAll(*availableResources);
+        QThread *thread = QThread::currentThread();
+        QMutexLocker locker(&pool->lock);
+        forever {
+            for (int i=pool->idle.size()-1; i>=0; i--)
+                if (pool->idle[i].first == thread)
+                    return pool->idle.takeAt(i).second;
+
+            if (pool->created < qMax(pool->maxResources, 1)) {
+                pool->created++;
+                return resourceMaker->make();
+            }
+
+            if (!pool->idle.isEmpty())
+                return pool->idle.takeFirst().second;
+
+            pool->released.wait(&pool->lock);
+        }
     }
 
-    T *acquire() const
+    void release(T *resource) const
     {
-        totalResources->acquire();
-        lock->lock();
-
-        if (availableResources->isEmpty())
-            availableResources->append(resourceMaker->make());
-        T* resource = availableResources->takeFirst();
-
-        lock->unlock();
-
-        return resource;
+        QMutexLocker locker(&pool->lock);
+        pool->idle.append(QPair<QThread*, T*>(QThread::currentThread(), resource));
+        pool->released.wakeOne();
     }
 
-    void release(T *resource) const
+    // Create copies up to the limit ahead of the first acquire
+    void prewarm(int count = -1) const
     {
-        lock->lock();
-        availableResources->append(resource);
-        lock->unlock();
-        totalResources->release();
+        QMutexLocker locker(&pool->lock);
+        if (count < 0) count = pool->maxResources;
+        while ((pool->created < count) && (pool->created < qMax(pool->maxResources, 1))) {
+            pool->idle.append(QPair<QThread*, T*>(NULL, resourceMaker->make()));
+            pool->created++;
+        }
     }
 
     void setResourceMaker(ResourceMaker<T> *maker)
@@ -96,7 +125,9 @@ public:
 
     void setMaxResources(int max)
     {
-        totalResources = QSharedPointer<QSemaphore>(new QSemaphore(max));
+        QMutexLocker locker(&pool->lock);
+        pool->maxResources = max;
+        pool->released.wakeAll();
     }
 };
 
@@ -0,0 +1,81 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QHash>
+#include <QReadWriteLock>
+
+#include "shapecache.h"
+
+using namespace cv;
+
+namespace
+{
+
+// Bounds what the cache holds, it is emptied rather than grown past this
+const qint64 MaxBytes = qint64(64) * 1024 * 1024;
+
+struct Key
+{
+    QString owner;
+    int rows, cols, type;
+
+    Key(const QString &owner_, int rows_, int cols_, int type_)
+        : owner(owner_), rows(rows_), cols(cols_), type(type_) {}
+
+    bool operator==(const Key &other) const
+    {
+        return (rows == other.rows) && (cols == other.cols) && (type == other.type) && (owner == other.owner);
+    }
+};
+
+inline uint qHash(const Key &key)
+{
+    return qHash(key.owner) ^ ::qHash((quint64(key.rows) << 40) | (quint64(key.cols) << 16) | quint64(key.type));
+}
+
+QReadWriteLock lock;
+QHash<Key, Mat> artifacts;
+qint64 bytes = 0;
+
+} // namespace
+
+bool ShapeCache::find(const QString &owner, int rows, int cols, int type, Mat &artifact)
+{
+    QReadLocker locker(&lock);
+    QHash<Key, Mat>::const_iterator it = artifacts.constFind(Key(owner, rows, cols, type));
+    if (it == artifacts.constEnd())
+        return false;
+    artifact = it.value();
+    return true;
+}
+
+Mat ShapeCache::insert(const QString &owner, int rows, int cols, int type, const Mat &artifact)
+{
+    const Key key(owner, rows, cols, type);
+    QWriteLocker locker(&lock);
+    QHash<Key, Mat>::const_iterator it = artifacts.constFind(key);
+    if (it != artifacts.constEnd())
+        return it.value();
+
+    const qint64 size = artifact.total() * artifact.elemSize();
+    if (bytes + size > MaxBytes) {
+        artifacts.clear();
+        bytes = 0;
+    }
+    artifacts.insert(key, artifact);
+    bytes += size;
+    return artifact;
+}
@@ -0,0 +1,37 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef SHAPECACHE_SHAPECACHE_H
+#define SHAPECACHE_SHAPECACHE_H
+
+#include <QString>
+#include <opencv2/core/core.hpp>
+
+/*!
+ * \brief Process-wide, thread-safe store of constant artifacts keyed by owner and input shape.
+ *
+ * Transforms whose masks, kernels or tables depend only on their parameters and the input size and type
+ * look them up with find() and publish them with insert(), so each is built once per shape rather than once per template.
+ * The \em owner key is normally the transform's description(), so equivalent copies share entries.
+ * Cached matrices are shared and must be treated as read-only.
+ */
+namespace ShapeCache
+{
+    bool find(const QString &owner, int rows, int cols, int type, cv::Mat &artifact); /*!< \brief Sets \em artifact and returns \c true if one is cached. */
+    cv::Mat insert(const QString &owner, int rows, int cols, int type, const cv::Mat &artifact); /*!< \brief Caches \em artifact unless another thread won the race, returns the cached one. */
+}
+
+#endif // SHAPECACHE_SHAPECACHE_H
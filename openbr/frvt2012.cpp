@@ -14,6 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QThread>
+#include <QtConcurrent>
 #include <openbr/openbr_plugin.h>
 #include <openbr/plugins/openbr_internal.h>
 
@@ -113,6 +115,93 @@ int32_t match_templates(const uint8_t* verification_template, const uint32_t ver
     return 0;
 }
 
+// Enroll one face, which may yield several templates, for convert_multifaces_to_verification_templates
+static TemplateList enrollONEFACE(const ONEFACE &oneface)
+{
+    TemplateList templates;
+    templates.append(templateFromONEFACE(oneface));
+    templates >> *frvt2012_transform.data();
+    return templates;
+}
+
+int32_t convert_multifaces_to_verification_templates(const vector<MULTIFACE> &input_faces, vector<uint32_t> &template_sizes, const vector<uint8_t*> &proprietary_templates, vector<uint8_t> &qualities)
+{
+    if (proprietary_templates.size() < input_faces.size())
+        return 1;
+
+    // Map every face of every template through the shared transform at once,
+    // independent of Globals->parallelism which initialize() turns off for single calls
+    QList<ONEFACE> faces;
+    foreach (const MULTIFACE &multiface, input_faces)
+        foreach (const ONEFACE &oneface, multiface)
+            faces.append(oneface);
+    const QList<TemplateList> enrolled = QtConcurrent::blockingMapped(faces, enrollONEFACE);
+
+    template_sizes.resize(input_faces.size());
+    qualities.resize(input_faces.size());
+    int face = 0;
+    for (size_t i=0; i<input_faces.size(); i++) {
+        uint32_t &template_size = template_sizes[i];
+        template_size = 0;
+        for (size_t j=0; j<input_faces[i].size(); j++, face++)
+            foreach (const Template &t, enrolled[face]) {
+                memcpy(&proprietary_templates[i][template_size], t.m().data, frvt2012_template_size);
+                template_size += frvt2012_template_size;
+            }
+        qualities[i] = 100;
+    }
+    return 0;
+}
+
+// Arguments of match_templates_batch shared by its threads
+struct MatchBatch
+{
+    const uint8_t *verification_template;
+    uint32_t verification_template_size;
+    const vector<const uint8_t*> *enrollment_templates;
+    const vector<uint32_t> *enrollment_template_sizes;
+    vector<double> *similarities;
+};
+
+// Scores enrollment templates [begin, end), returns the match_templates() status
+static int32_t matchRange(const MatchBatch *batch, int begin, int end)
+{
+    int32_t result = 0;
+    for (int i=begin; i<end; i++)
+        if (match_templates(batch->verification_template, batch->verification_template_size,
+                            (*batch->enrollment_templates)[i], (*batch->enrollment_template_sizes)[i], (*batch->similarities)[i]) != 0)
+            result = 2;
+    return result;
+}
+
+int32_t match_templates_batch(const uint8_t* verification_template, const uint32_t verification_template_size, const vector<const uint8_t*> &enrollment_templates, const vector<uint32_t> &enrollment_template_sizes, vector<double> &similarities)
+{
+    if (enrollment_template_sizes.size() != enrollment_templates.size())
+        return 1;
+    similarities.resize(enrollment_templates.size());
+    MatchBatch batch;
+    batch.verification_template = verification_template;
+    batch.verification_template_size = verification_template_size;
+    batch.enrollment_templates = &enrollment_templates;
+    batch.enrollment_template_sizes = &enrollment_template_sizes;
+    batch.similarities = &similarities;
+
+    // One contiguous range of enrollment templates per thread
+    const int size = int(enrollment_templates.size());
+    const int chunks = std::max(1, std::min(QThread::idealThreadCount(), size / 64));
+    QList< QFuture<int32_t> > futures;
+    for (int i=0; i<chunks; i++) {
+        const int begin = int(qint64(size)*i/chunks), end = int(qint64(size)*(i+1)/chunks);
+        futures.append(QtConcurrent::run(matchRange, (const MatchBatch*)&batch, begin, end));
+    }
+
+    int32_t result = 0;
+    foreach (const QFuture<int32_t> &future, futures)
+        if (future.result() != 0)
+            result = future.result();
+    return result;
+}
+
 int32_t SdkEstimator::initialize_age_estimation(const string &configuration_location)
 {
     initialize(configuration_location);
@@ -262,6 +262,57 @@ BR_EXPORT int32_t match_templates(const uint8_t* verification_template,
                                   const uint32_t enrollment_template_size,
                                   double &similarity);
 
+/*!
+ * \brief
+ * Batch form of convert_multiface_to_verification_template(), not part of the
+ * FRVT 2012 API.
+ *
+ * The faces of every MULTIFACE are enrolled concurrently.
+ *
+ * \param[in] input_faces
+ * The MULTIFACE of each template.
+ *
+ * \param[out] template_sizes
+ * Resized to one size, in bytes, per template.
+ *
+ * \param[out] proprietary_templates
+ * One caller allocated buffer per template, each of the maximum template size
+ * from get_max_template_sizes().
+ *
+ * \param[out] qualities
+ * Resized to one quality per template.
+ *
+ * \return
+ *  0 Success
+ *  Other Vendor-defined failure.
+ */
+BR_EXPORT int32_t convert_multifaces_to_verification_templates(const std::vector<MULTIFACE> &input_faces,
+                                                               std::vector<uint32_t> &template_sizes,
+                                                               const std::vector<uint8_t*> &proprietary_templates,
+                                                               std::vector<uint8_t> &qualities);
+
+/*!
+ * \brief
+ * Batch form of match_templates(), not part of the FRVT 2012 API.
+ *
+ * Compares one verification template against many enrollment templates
+ * concurrently.
+ *
+ * \param[out] similarities
+ * Resized to one score per enrollment template, -1 for failed templates.
+ *
+ * \return
+ *  0 Success
+ *  2 The verification template or any enrollment template was the result of
+ * failed feature extraction
+ *  Other Vendor-defined failure.
+ */
+BR_EXPORT int32_t match_templates_batch(const uint8_t* verification_template,
+                                        const uint32_t verification_template_size,
+                                        const std::vector<const uint8_t*> &enrollment_templates,
+                                        const std::vector<uint32_t> &enrollment_template_sizes,
+                                        std::vector<double> &similarities);
+
 /*!
  * \brief Class D estimator abstraction.
  */
@@ -7,6 +7,7 @@
 #include <openbr/openbr.h>
 
 #include "templateviewer.h"
+#include "thumbnailcache.h"
 
 using namespace br;
 
@@ -45,7 +46,7 @@ void TemplateViewer::setFile(const File &file_)
         landmarks.append(QPointF());
     nearestLandmark = -1;
 
-    QtConcurrent::run(this, &TemplateViewer::refreshImage);
+    refresh();
 }
 
 void TemplateViewer::setEditable(bool enabled)
@@ -63,14 +64,29 @@ void TemplateViewer::setMousePoint(const QPointF &mousePoint)
 void TemplateViewer::setFormat(const QString &format)
 {
     this->format = format;
-    QtConcurrent::run(this, &TemplateViewer::refreshImage);
+    refresh();
+}
+
+void TemplateViewer::setThumbnailBound(const QSize &bound)
+{
+    thumbnailBound = bound;
 }
 
 /*** PRIVATE ***/
+void TemplateViewer::refresh()
+{
+    refreshes.ref();
+    QtConcurrent::run(this, &TemplateViewer::refreshImage);
+}
+
 void TemplateViewer::refreshImage()
 {
+    // Only the most recent refresh loads an image, earlier ones were queued for a file no longer shown
+    if (refreshes.deref()) return;
+
+    QString imageFile;
     if (file.isNull() || (format == "Photo")) {
-        setImage(file, true);
+        imageFile = file.name;
     } else {
         const QString path = QString(br_scratch_path()) + "/thumbnails";
         const QString hash = file.hash()+format;
@@ -83,24 +99,43 @@ void TemplateViewer::refreshImage()
             else if (format == "Features")
                 Enroll(file.flat(), path+"[postfix="+hash+",cache,algorithm=ColoredLBP]");
         }
-        setImage(processedFile, true);
+        imageFile = processedFile;
+    }
+
+    if (thumbnailBound.isValid() && !imageFile.isEmpty()) {
+        QSize size;
+        const QImage thumbnail = ThumbnailCache::load(imageFile, thumbnailBound, &size);
+        fullSize = size;
+        setImage(thumbnail, true);
+    } else {
+        fullSize = QSize();
+        setImage(imageFile, true);
     }
 }
 
+QSizeF TemplateViewer::imageSize() const
+{
+    // Landmarks are in the coordinates of the full size image, not the thumbnail
+    if (fullSize.isValid()) return fullSize;
+    return QSizeF(imageWidth(), imageHeight());
+}
+
 QPointF TemplateViewer::getImagePoint(const QPointF &sp) const
 {
     if (!pixmap() || isNull()) return QPointF();
-    QPointF ip = QPointF(imageWidth()*(sp.x() - (width() - pixmap()->width())/2)/pixmap()->width(),
-                        imageHeight()*(sp.y() - (height() - pixmap()->height())/2)/pixmap()->height());
-    if ((ip.x() < 0) || (ip.x() > imageWidth()) || (ip.y() < 0) || (ip.y() > imageHeight())) return QPointF();
+    const QSizeF size = imageSize();
+    QPointF ip = QPointF(size.width()*(sp.x() - (width() - pixmap()->width())/2)/pixmap()->width(),
+                        size.height()*(sp.y() - (height() - pixmap()->height())/2)/pixmap()->height());
+    if ((ip.x() < 0) || (ip.x() > size.width()) || (ip.y() < 0) || (ip.y() > size.height())) return QPointF();
     return ip;
 }
 
 QPointF TemplateViewer::getScreenPoint(const QPointF &ip) const
 {
     if (!pixmap() || isNull()) return QPointF();
-    return QPointF(ip.x()*pixmap()->width()/imageWidth() + (width()-pixmap()->width())/2,
-                   ip.y()*pixmap()->height()/imageHeight() + (height()-pixmap()->height())/2);
+    const QSizeF size = imageSize();
+    return QPointF(ip.x()*pixmap()->width()/size.width() + (width()-pixmap()->width())/2,
+                   ip.y()*pixmap()->height()/size.height() + (height()-pixmap()->height())/2);
 }
 
 /*** PROTECTED SLOTS ***/
@@ -243,8 +278,9 @@ void TemplateViewer::paintEvent(QPaintEvent *event)
     } else {
         if (!mousePoint.isNull() && !isNull()) {
             painter.setPen(QPen(normal));
-            painter.drawLine(getScreenPoint(QPointF(mousePoint.x(), 0)), getScreenPoint(QPointF(mousePoint.x(), imageHeight())));
-            painter.drawLine(getScreenPoint(QPointF(0, mousePoint.y())), getScreenPoint(QPointF(imageWidth(), mousePoint.y())));
+            const QSizeF size = imageSize();
+            painter.drawLine(getScreenPoint(QPointF(mousePoint.x(), 0)), getScreenPoint(QPointF(mousePoint.x(), size.height())));
+            painter.drawLine(getScreenPoint(QPointF(0, mousePoint.y())), getScreenPoint(QPointF(size.width(), mousePoint.y())));
         }
     }
 }
@@ -1,6 +1,7 @@
 #ifndef BR_TEMPLATEVIEWER_H
 #define BR_TEMPLATEVIEWER_H
 
+#include <QAtomicInt>
 #include <QDragEnterEvent>
 #include <QDropEvent>
 #include <QEvent>
@@ -8,6 +9,7 @@
 #include <QList>
 #include <QMouseEvent>
 #include <QPointF>
+#include <QSize>
 #include <QString>
 #include <QWidget>
 #include <openbr/openbr_plugin.h>
@@ -22,6 +24,8 @@ class BR_EXPORT TemplateViewer : public ImageViewer
     File file;
     QPointF mousePoint;
     QString format;
+    QSize thumbnailBound, fullSize;
+    QAtomicInt refreshes;
 
     bool editable;
     QList<QPointF> landmarks;
@@ -35,9 +39,12 @@ public slots:
     void setEditable(bool enabled);
     void setMousePoint(const QPointF &mousePoint);
     void setFormat(const QString &format);
+    void setThumbnailBound(const QSize &bound);
 
 private:
+    void refresh();
     void refreshImage();
+    QSizeF imageSize() const;
     QPointF getImagePoint(const QPointF &sp) const;
     QPointF getScreenPoint(const QPointF &ip) const;
 
@@ -1,4 +1,5 @@
 #include "templateviewergrid.h"
+#include "thumbnailcache.h"
 
 using namespace br;
 
@@ -6,8 +7,12 @@ using namespace br;
 /*** PUBLIC ***/
 TemplateViewerGrid::TemplateViewerGrid(QWidget *parent)
     : QWidget(parent)
+    , scrollBar(Qt::Vertical)
+    , format("Photo")
+    , size(0)
 {
     setLayout(&gridLayout);
+    connect(&scrollBar, SIGNAL(valueChanged(int)), this, SLOT(showFiles()));
     setFiles(FileList(16));
     setFiles(FileList(1));
 }
@@ -15,7 +20,10 @@ TemplateViewerGrid::TemplateViewerGrid(QWidget *parent)
 /*** PUBLIC SLOTS ***/
 void TemplateViewerGrid::setFiles(const FileList &files)
 {
-    const int size = std::max(1, (int)ceil(sqrt((float)files.size())));
+    this->files = files;
+
+    // Only the visible cells have viewers, the rest of the list is reached by scrolling
+    size = std::min(MaxSize, std::max(1, (int)ceil(sqrt((float)files.size()))));
     while (templateViewers.size() < size*size) {
         templateViewers.append(QSharedPointer<TemplateViewer>(new TemplateViewer()));
         connect(templateViewers.last().data(), SIGNAL(newInput(br::File)), this, SIGNAL(newInput(br::File)));
@@ -34,21 +42,29 @@ void TemplateViewerGrid::setFiles(const FileList &files)
         if (i < size*size) {
             gridLayout.addWidget(templateViewers[i].data(), i/size, i%size, 1, 1);
             templateViewers[i]->setVisible(true);
-        }
-
-        if (i < files.size()) {
-            templateViewers[i]->setFile(files[i]);
         } else {
-            templateViewers[i]->setDefaultText("<b>"+ (size > 1 ? QString() : QString("Drag Photo or Folder Here")) +"</b>");
             templateViewers[i]->setFile(QString());
         }
+    }
 
-        templateViewers[i]->setEditable(files.size() == 1);
+    const int rows = (files.size() + size - 1) / size;
+    scrollBar.blockSignals(true);
+    scrollBar.setRange(0, std::max(0, rows - size));
+    scrollBar.setPageStep(size);
+    scrollBar.setValue(0);
+    scrollBar.blockSignals(false);
+    if (rows > size) {
+        gridLayout.addWidget(&scrollBar, 0, size, size, 1);
+        scrollBar.setVisible(true);
     }
+
+    thumbnailBound = cellBound();
+    showFiles();
 }
 
 void TemplateViewerGrid::setFormat(const QString &format)
 {
+    this->format = format;
     foreach (const QSharedPointer<TemplateViewer> &templateViewer, templateViewers)
         templateViewer->setFormat(format);
 }
@@ -59,4 +75,56 @@ void TemplateViewerGrid::setMousePoint(const QPointF &mousePoint)
         templateViewer->setMousePoint(mousePoint);
 }
 
+/*** PRIVATE ***/
+QSize TemplateViewerGrid::cellBound() const
+{
+    // A single template is shown at full resolution
+    if (files.size() <= 1) return QSize();
+    return ThumbnailCache::bound(QSize(width()/size, height()/size));
+}
+
+/*** PRIVATE SLOTS ***/
+void TemplateViewerGrid::showFiles()
+{
+    const int first = scrollBar.value()*size;
+    for (int i=0; i<size*size; i++) {
+        templateViewers[i]->setThumbnailBound(thumbnailBound);
+        if (first+i < files.size()) {
+            templateViewers[i]->setFile(files[first+i]);
+        } else {
+            templateViewers[i]->setDefaultText("<b>"+ (size > 1 ? QString() : QString("Drag Photo or Folder Here")) +"</b>");
+            templateViewers[i]->setFile(QString());
+        }
+        templateViewers[i]->setEditable(files.size() == 1);
+    }
+
+    // Decode the next page while this one is viewed
+    QStringList next;
+    if (thumbnailBound.isValid() && (format == "Photo"))
+        foreach (const File &file, files.mid(first+size*size, size*size))
+            next.append(file.name);
+    ThumbnailCache::prefetch(next, thumbnailBound);
+}
+
+/*** PROTECTED SLOTS ***/
+void TemplateViewerGrid::resizeEvent(QResizeEvent *event)
+{
+    QWidget::resizeEvent(event);
+    event->accept();
+
+    // Reload only when the cells outgrow their thumbnails
+    const QSize bound = cellBound();
+    if (bound.isValid() && thumbnailBound.isValid() && (bound.width() <= thumbnailBound.width())) return;
+    if (bound == thumbnailBound) return;
+    thumbnailBound = bound;
+    showFiles();
+}
+
+void TemplateViewerGrid::wheelEvent(QWheelEvent *event)
+{
+    QWidget::wheelEvent(event);
+    event->accept();
+    scrollBar.setValue(scrollBar.value() - event->angleDelta().y()/120);
+}
+
 #include "moc_templateviewergrid.cpp"
@@ -3,7 +3,11 @@
 
 #include <QGridLayout>
 #include <QList>
+#include <QResizeEvent>
+#include <QScrollBar>
 #include <QSharedPointer>
+#include <QSize>
+#include <QWheelEvent>
 #include <openbr/openbr_plugin.h>
 
 #include "templateviewer.h"
@@ -16,9 +20,16 @@ class BR_EXPORT TemplateViewerGrid : public QWidget
     Q_OBJECT
 
     QGridLayout gridLayout;
+    QScrollBar scrollBar;
     QList< QSharedPointer<TemplateViewer> > templateViewers;
+    FileList files;
+    QString format;
+    QSize thumbnailBound;
+    int size;
 
 public:
+    static const int MaxSize = 8; /*!< \brief Rows and columns of visible cells, larger file lists scroll. */
+
     explicit TemplateViewerGrid(QWidget *parent = 0);
 
 public slots:
@@ -26,6 +37,16 @@ public slots:
     void setFormat(const QString &format);
     void setMousePoint(const QPointF &mousePoint);
 
+private:
+    QSize cellBound() const;
+
+private slots:
+    void showFiles();
+
+protected slots:
+    void resizeEvent(QResizeEvent *event);
+    void wheelEvent(QWheelEvent *event);
+
 signals:
     void newInput(br::File input);
     void newInput(QImage input);
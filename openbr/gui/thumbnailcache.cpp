@@ -0,0 +1,131 @@
+#include <QAtomicInt>
+#include <QCache>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QThreadPool>
+#include <openbr/openbr.h>
+
+#include "thumbnailcache.h"
+
+using namespace br;
+
+/*** STATIC ***/
+struct Thumbnail
+{
+    QImage image;
+    QSize fullSize;
+};
+
+static QMutex cacheLock;
+static QCache<QString, Thumbnail> cache(256*1024); // Cost in kilobytes
+static QAtomicInt prefetchGeneration;
+
+static QThreadPool *prefetchPool()
+{
+    static QThreadPool *pool = NULL;
+    QMutexLocker locker(&cacheLock);
+    if (pool == NULL) {
+        pool = new QThreadPool();
+        pool->setMaxThreadCount(1); // Leave the global pool to the visible cells
+    }
+    return pool;
+}
+
+struct Prefetch : public QRunnable
+{
+    QStringList files;
+    QSize bound;
+    int generation;
+
+    Prefetch(const QStringList &files, const QSize &bound, int generation)
+        : files(files), bound(bound), generation(generation) {}
+
+    void run()
+    {
+        foreach (const QString &file, files) {
+            if (prefetchGeneration.load() != generation) return;
+            ThumbnailCache::load(file, bound);
+        }
+    }
+};
+
+/*** PUBLIC ***/
+QSize ThumbnailCache::bound(const QSize &size)
+{
+    const int step = 128;
+    const int side = std::max(step, (std::max(size.width(), size.height()) + step - 1) / step * step);
+    return QSize(side, side);
+}
+
+QImage ThumbnailCache::load(const QString &file, const QSize &bound, QSize *fullSize)
+{
+    if (file.isEmpty()) return QImage();
+
+    const QFileInfo fileInfo(file);
+    const QString key = fileInfo.absoluteFilePath() + "|" + QString::number(fileInfo.lastModified().toMSecsSinceEpoch()) +
+                        "|" + QString::number(bound.width()) + "x" + QString::number(bound.height());
+
+    {
+        QMutexLocker locker(&cacheLock);
+        const Thumbnail *thumbnail = cache.object(key);
+        if (thumbnail != NULL) {
+            if (fullSize) *fullSize = thumbnail->fullSize;
+            return thumbnail->image;
+        }
+    }
+
+    Thumbnail *thumbnail = new Thumbnail();
+    const QString path = QString(br_scratch_path()) + "/thumbnails";
+    const QString diskFile = path + "/" + QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Md5).toHex() + ".png";
+
+    QImageReader diskReader(diskFile);
+    if (diskReader.canRead()) {
+        thumbnail->image = diskReader.read();
+        const QStringList size = thumbnail->image.text("Size").split('x');
+        if (size.size() == 2) thumbnail->fullSize = QSize(size[0].toInt(), size[1].toInt());
+    }
+
+    if (thumbnail->image.isNull() || !thumbnail->fullSize.isValid()) {
+        // Decoding at the reduced size is much faster than decoding and then scaling, particularly for JPEG
+        QImageReader reader(file);
+        thumbnail->fullSize = reader.size();
+        const bool scaled = thumbnail->fullSize.isValid() &&
+                            ((thumbnail->fullSize.width() > bound.width()) || (thumbnail->fullSize.height() > bound.height()));
+        if (scaled) reader.setScaledSize(thumbnail->fullSize.scaled(bound, Qt::KeepAspectRatio));
+        thumbnail->image = reader.read();
+        if (!thumbnail->fullSize.isValid()) thumbnail->fullSize = thumbnail->image.size();
+
+        if (scaled && !thumbnail->image.isNull()) {
+            QDir().mkpath(path);
+            QImage stored = thumbnail->image;
+            stored.setText("Size", QString::number(thumbnail->fullSize.width()) + "x" + QString::number(thumbnail->fullSize.height()));
+            stored.save(diskFile);
+        }
+    }
+
+    const QImage image = thumbnail->image;
+    if (fullSize) *fullSize = thumbnail->fullSize;
+
+    QMutexLocker locker(&cacheLock);
+    cache.insert(key, thumbnail, std::max(1, image.byteCount() / 1024));
+    return image;
+}
+
+void ThumbnailCache::prefetch(const QStringList &files, const QSize &bound)
+{
+    const int generation = prefetchGeneration.fetchAndAddOrdered(1) + 1;
+    if (files.isEmpty()) return;
+    prefetchPool()->start(new Prefetch(files, bound, generation));
+}
+
+void ThumbnailCache::setMemoryLimit(int megabytes)
+{
+    QMutexLocker locker(&cacheLock);
+    cache.setMaxCost(std::max(1, megabytes) * 1024);
+}
@@ -0,0 +1,31 @@
+#ifndef BR_THUMBNAILCACHE_H
+#define BR_THUMBNAILCACHE_H
+
+#include <QImage>
+#include <QSize>
+#include <QString>
+#include <QStringList>
+#include <openbr/openbr_export.h>
+
+namespace br
+{
+
+/*!
+ * \brief Downscaled images shared by the GUI viewers.
+ *
+ * Thumbnails are decoded at reduced size, kept in a least recently used memory cache and saved to
+ * br_scratch_path()/thumbnails so later sessions skip the full size decode.
+ * All functions are thread safe.
+ */
+class BR_EXPORT ThumbnailCache
+{
+public:
+    static QSize bound(const QSize &size); /*!< \brief Thumbnail size used for a cell of \em size, rounded up so nearby sizes share a thumbnail. */
+    static QImage load(const QString &file, const QSize &bound, QSize *fullSize = NULL); /*!< \brief Thumbnail of \em file within \em bound, optionally returning the original image size. */
+    static void prefetch(const QStringList &files, const QSize &bound); /*!< \brief Load thumbnails in the background, cancelling any earlier prefetch. */
+    static void setMemoryLimit(int megabytes); /*!< \brief Memory used by cached thumbnails, 256 MB by default. */
+};
+
+} // namespace br
+
+#endif // BR_THUMBNAILCACHE_H
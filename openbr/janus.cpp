@@ -2,15 +2,20 @@
   #define JANUS_LIBRARY
 #endif
 
+#include <QFile>
+#include <QFutureSynchronizer>
+#include <QtConcurrent>
 #include "janus.h"
 #include "openbr_plugin.h"
+#include "core/common.h"
+#include "core/opencvutils.h"
 
 // Use the provided default implementation of some functions
 #include "janus/src/janus.cpp"
 
 using namespace br;
 
-static QSharedPointer<Transform> transform;
+static QSharedPointer<Transform> transform, stream;
 static QSharedPointer<Distance> distance;
 
 janus_error janus_initialize(const char *sdk_path, const char *model_file)
@@ -21,6 +26,7 @@ janus_error janus_initialize(const char *sdk_path, const char *model_file)
     QString algorithm = model_file;
     if (algorithm.isEmpty()) algorithm = "Cvt(Gray)+Affine(88,88,0.25,0.35)+<FaceRecognitionExtraction>+<FaceRecognitionEmbedding>+<FaceRecognitionQuantization>:ByteL1";
     transform = Transform::fromAlgorithm(algorithm, false);
+    stream = Transform::fromAlgorithm(algorithm, true);
     distance = Distance::fromAlgorithm(algorithm);
     return JANUS_SUCCESS;
 }
@@ -33,7 +39,7 @@ janus_error janus_finalize()
 
 struct janus_incomplete_template_type
 {
-    QList<cv::Mat> data;
+    TemplateList images; // Enrolled together when the template is finalized
 };
 
 janus_error janus_initialize_template(janus_incomplete_template *incomplete_template)
@@ -45,10 +51,11 @@ janus_error janus_initialize_template(janus_incomplete_template *incomplete_temp
 janus_error janus_add_image(const janus_image image, const janus_attribute_list attributes, janus_incomplete_template incomplete_template)
 {
     Template t;
+    // Copied because the image is only enrolled at janus_finalize_template
     t.append(cv::Mat(image.height,
                      image.width,
                      image.color_space == JANUS_GRAY8 ? CV_8UC1 : CV_8UC1,
-                     image.data));
+                     image.data).clone());
     for (size_t i=0; i<attributes.size; i++)
         t.file.set(janus_attribute_to_string(attributes.attributes[i]), attributes.values[i]);
 
@@ -60,12 +67,34 @@ janus_error janus_add_image(const janus_image image, const janus_attribute_list
 
     t.file.set("Affine_0", QPointF(t.file.get<float>("JANUS_RIGHT_EYE_X"), t.file.get<float>("JANUS_RIGHT_EYE_Y")));
     t.file.set("Affine_1", QPointF(t.file.get<float>("JANUS_LEFT_EYE_X"), t.file.get<float>("JANUS_LEFT_EYE_Y")));
-    Template u;
-    transform->project(t, u);
-    incomplete_template->data.append(u);
+    incomplete_template->images.append(t);
     return JANUS_SUCCESS;
 }
 
+// Enroll every image of the template at once through the streamed algorithm
+static QList<cv::Mat> enroll(const TemplateList &images)
+{
+    QList<cv::Mat> data;
+    if (images.isEmpty())
+        return data;
+
+    TemplateList enrolled;
+    stream->project(images, enrolled);
+    if (enrolled.size() != images.size()) {
+        // The pipeline changed the number of templates, fall back to one image at a time
+        enrolled.clear();
+        foreach (const Template &image, images) {
+            Template u;
+            transform->project(image, u);
+            enrolled.append(u);
+        }
+    }
+
+    foreach (const Template &u, enrolled)
+        data.append(u);
+    return data;
+}
+
 janus_error janus_finalize_template(janus_incomplete_template incomplete_template, janus_template template_, size_t *bytes)
 {    
     size_t templateBytes = 0;
@@ -73,7 +102,8 @@ janus_error janus_finalize_template(janus_incomplete_template incomplete_templat
     *bytes = sizeof(templateBytes) + sizeof(numTemplates);
     janus_template pos = template_ + *bytes;
 
-    foreach (const cv::Mat &m, incomplete_template->data) {
+    const QList<cv::Mat> data = enroll(incomplete_template->images);
+    foreach (const cv::Mat &m, data) {
         assert(m.isContinuous());
         const size_t currentTemplateBytes = m.rows * m.cols * m.elemSize();
         if (templateBytes == 0)
@@ -94,6 +124,27 @@ janus_error janus_finalize_template(janus_incomplete_template incomplete_templat
     return JANUS_SUCCESS;
 }
 
+// Compare the query against targets, falling back to one comparison per row
+static void compareRows(const cv::Mat &targets, const cv::Mat &query, float *scores)
+{
+    if (distance->compare(targets, query, scores))
+        return;
+    for (int i=0; i<targets.rows; i++)
+        scores[i] = distance->compare(cv::Mat(targets.row(i)), query);
+}
+
+// Compare the query against every row of targets, a block of rows per thread
+static void compareAll(const cv::Mat &targets, const cv::Mat &query, float *scores)
+{
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<targets.rows; i+=Globals->blockSize) {
+        const cv::Mat block = targets.rowRange(i, std::min(targets.rows, i+Globals->blockSize));
+        if (Globals->parallelism > 1) futures.addFuture(QtConcurrent::run(compareRows, block, query, scores+i));
+        else                          compareRows(block, query, scores+i);
+    }
+    futures.waitForFinished();
+}
+
 janus_error janus_verify(const janus_template a, const size_t a_bytes, const janus_template b, const size_t b_bytes, double *similarity)
 {
     (void) a_bytes;
@@ -107,18 +158,22 @@ janus_error janus_verify(const janus_template a, const size_t a_bytes, const jan
     if (a_template_bytes != b_template_bytes)
         return JANUS_UNKNOWN_ERROR;
 
+    // The templates of b are contiguous rows, compared against each template of a at once
+    const cv::Mat targets(b_templates, a_template_bytes, CV_8UC1, b+2*sizeof(size_t));
+    QVector<float> scores(b_templates);
     float dist = 0;
-    for (size_t i=0; i<a_templates; i++)
-        for (size_t j=0; j<b_templates; j++)
-            dist += distance->compare(cv::Mat(1, a_template_bytes, CV_8UC1, a+2*sizeof(size_t)+i*a_template_bytes),
-                                      cv::Mat(1, b_template_bytes, CV_8UC1, b+2*sizeof(size_t)+i*b_template_bytes));
+    for (size_t i=0; i<a_templates; i++) {
+        compareRows(targets, cv::Mat(1, a_template_bytes, CV_8UC1, a+2*sizeof(size_t)+i*a_template_bytes), scores.data());
+        foreach (float score, scores)
+            dist += score;
+    }
     *similarity = a_templates * b_templates / dist;
     return JANUS_SUCCESS;
 }
 
 struct janus_incomplete_gallery_type
 {
-    QList< QPair<janus_template, janus_template_id> > templates;
+    QList< QPair<QByteArray, janus_template_id> > templates;
 };
 
 janus_error janus_initialize_gallery(janus_incomplete_gallery *incomplete_gallery)
@@ -129,14 +184,138 @@ janus_error janus_initialize_gallery(janus_incomplete_gallery *incomplete_galler
 
 janus_error janus_add_template(const janus_template template_, const size_t bytes, const janus_template_id template_id, janus_incomplete_gallery incomplete_gallery)
 {
-    (void) bytes;
-    incomplete_gallery->templates.append(QPair<janus_template, janus_template_id>(template_, template_id));
+    // The caller may free the template once it is added
+    incomplete_gallery->templates.append(QPair<QByteArray, janus_template_id>(QByteArray((const char*)template_, bytes), template_id));
     return JANUS_SUCCESS;
 }
 
+/*
+ * Gallery file layout, every section starting on a SIMDAlignment boundary:
+ *   GalleryHeader
+ *   rows template vectors, each padded with zeros to stride bytes
+ *   rows qint64 template ids, one per vector
+ */
+struct GalleryHeader
+{
+    quint32 magic, version;
+    quint64 templateBytes, stride, rows, rowsOffset, idsOffset;
+
+    static quint32 expectedMagic() { return 0x4752424A; } // "JBRG"
+    static quint64 alignedOffset(quint64 offset) { return OpenCVUtils::alignedStep(offset); }
+};
+
 janus_error janus_finalize_gallery(janus_incomplete_gallery incomplete_gallery, const char *gallery_file)
 {
-    (void) incomplete_gallery;
-    (void) gallery_file;
+    GalleryHeader header;
+    header.magic = GalleryHeader::expectedMagic();
+    header.version = 1;
+    header.templateBytes = 0;
+    header.rows = 0;
+
+    typedef QPair<QByteArray, janus_template_id> TemplateID;
+    foreach (const TemplateID &templateID, incomplete_gallery->templates) {
+        const size_t *sizes = reinterpret_cast<const size_t*>(templateID.first.constData());
+        if (header.templateBytes == 0)
+            header.templateBytes = sizes[0];
+        if ((sizes[1] > 0) && (sizes[0] != header.templateBytes)) {
+            delete incomplete_gallery;
+            return JANUS_UNKNOWN_ERROR;
+        }
+        header.rows += sizes[1];
+    }
+    header.stride = OpenCVUtils::alignedStep(header.templateBytes);
+    header.rowsOffset = GalleryHeader::alignedOffset(sizeof(GalleryHeader));
+    header.idsOffset = GalleryHeader::alignedOffset(header.rowsOffset + header.rows*header.stride);
+
+    QFile file(gallery_file);
+    if (!file.open(QFile::WriteOnly)) {
+        delete incomplete_gallery;
+        return JANUS_UNKNOWN_ERROR;
+    }
+
+    QByteArray data(header.idsOffset + header.rows*sizeof(qint64), 0);
+    memcpy(data.data(), &header, sizeof(GalleryHeader));
+    uchar *row = reinterpret_cast<uchar*>(data.data()) + header.rowsOffset;
+    qint64 *id = reinterpret_cast<qint64*>(data.data() + header.idsOffset);
+    foreach (const TemplateID &templateID, incomplete_gallery->templates) {
+        const size_t templates = reinterpret_cast<const size_t*>(templateID.first.constData())[1];
+        for (size_t i=0; i<templates; i++) {
+            memcpy(row, templateID.first.constData() + 2*sizeof(size_t) + i*header.templateBytes, header.templateBytes);
+            row += header.stride;
+            *id++ = templateID.second;
+        }
+    }
+    delete incomplete_gallery;
+
+    const bool written = (file.write(data) == data.size());
+    file.close();
+    return written ? JANUS_SUCCESS : JANUS_UNKNOWN_ERROR;
+}
+
+/*!
+ * \brief Find the \em requested_returns gallery templates most similar to \em template_.
+ *
+ * The gallery written by janus_finalize_gallery is memory mapped and every packed vector is compared with the batch distance,
+ * similarities aggregate a template's vectors the same way as janus_verify.
+ * Fills \em template_ids and \em similarities in decreasing similarity and sets \em actual_returns.
+ */
+JANUS_EXPORT janus_error janus_search(const janus_template template_, const size_t bytes, const char *gallery_file, const size_t requested_returns,
+                                      janus_template_id *template_ids, double *similarities, size_t *actual_returns)
+{
+    (void) bytes;
+    *actual_returns = 0;
+
+    QFile file(gallery_file);
+    if (!file.open(QFile::ReadOnly) || (file.size() < qint64(sizeof(GalleryHeader))))
+        return JANUS_UNKNOWN_ERROR;
+    const uchar *data = file.map(0, file.size());
+    if (data == NULL)
+        return JANUS_UNKNOWN_ERROR;
+
+    GalleryHeader header;
+    memcpy(&header, data, sizeof(GalleryHeader));
+    const size_t templateBytes = *(reinterpret_cast<size_t*>(template_)+0);
+    const size_t templates = *(reinterpret_cast<size_t*>(template_)+1);
+    if ((header.magic != GalleryHeader::expectedMagic()) || (header.version != 1) ||
+        (quint64(file.size()) < header.idsOffset + header.rows*sizeof(qint64)) ||
+        ((templates > 0) && (header.rows > 0) && (templateBytes != header.templateBytes)))
+        return JANUS_UNKNOWN_ERROR;
+
+    // Sum the distances to each gallery vector over the query's vectors
+    const cv::Mat targets(header.rows, header.templateBytes, CV_8UC1, const_cast<uchar*>(data) + header.rowsOffset, header.stride);
+    QVector<float> scores(header.rows), sums(header.rows, 0);
+    for (size_t i=0; i<templates; i++) {
+        compareAll(targets, cv::Mat(1, templateBytes, CV_8UC1, template_+2*sizeof(size_t)+i*templateBytes), scores.data());
+        for (int j=0; j<scores.size(); j++)
+            sums[j] += scores[j];
+    }
+
+    // Aggregate the vectors of each gallery template
+    const qint64 *ids = reinterpret_cast<const qint64*>(data + header.idsOffset);
+    QHash<qint64, int> indices;
+    QList<qint64> galleryIDs;
+    QList<float> dists, counts;
+    for (quint64 i=0; i<header.rows; i++) {
+        if (!indices.contains(ids[i])) {
+            indices.insert(ids[i], galleryIDs.size());
+            galleryIDs.append(ids[i]);
+            dists.append(0);
+            counts.append(0);
+        }
+        const int index = indices[ids[i]];
+        dists[index] += sums[i];
+        counts[index] += templates;
+    }
+
+    QList<float> similarity;
+    for (int i=0; i<galleryIDs.size(); i++)
+        similarity.append(counts[i] / dists[i]);
+
+    typedef QPair<float,int> Pair;
+    foreach (const Pair &pair, Common::TopK(similarity, int(requested_returns), true)) {
+        template_ids[*actual_returns] = janus_template_id(galleryIDs[pair.second]);
+        similarities[*actual_returns] = pair.first;
+        (*actual_returns)++;
+    }
     return JANUS_SUCCESS;
 }
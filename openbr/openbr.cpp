@@ -14,12 +14,17 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QThread>
+#include <QWaitCondition>
+#include <QtConcurrent>
 #include <openbr/openbr_plugin.h>
 
 #include "core/bee.h"
 #include "core/cluster.h"
+#include "core/common.h"
 #include "core/eval.h"
 #include "core/fuse.h"
+#include "core/opencvutils.h"
 #include "core/plot.h"
 #include "core/qtutils.h"
 #include "plugins/openbr_internal.h"
@@ -33,6 +38,11 @@ const char *br_about()
     return about.data();
 }
 
+void br_benchmark(const char *input, const char *output)
+{
+    Benchmark(File(input), File(output));
+}
+
 void br_cat(int num_input_galleries, const char *input_galleries[], const char *output_gallery)
 {
     Cat(QtUtils::toStringList(num_input_galleries, input_galleries), output_gallery);
@@ -64,6 +74,11 @@ void br_pairwise_compare(const char *target_gallery, const char *query_gallery,
     PairwiseCompare(File(target_gallery), File(query_gallery), File(output));
 }
 
+void br_deduplicate(const char *gallery, float threshold, const char *csv)
+{
+    Deduplicate(File(gallery), threshold, csv);
+}
+
 void br_convert(const char *file_type, const char *input_file, const char *output_file)
 {
     Convert(File(file_type), File(input_file), File(output_file));
@@ -300,6 +315,22 @@ void br_train_n(int num_inputs, const char *inputs[], const char *model)
     else                Train(File(inputs[0]), model);
 }
 
+void br_warm_up(const char *algorithm, int rows, int cols)
+{
+    const QString name = (algorithm == NULL) ? Globals->algorithm : QString(algorithm);
+    const Template blank(File("warm_up.png"), cv::Mat::zeros(rows, cols, CV_8UC3));
+
+    TemplateList src, dst;
+    src.append(blank);
+    Transform::fromAlgorithm(name, false)->project(src, dst);
+
+    // Also build the stream stages and their recycled wrapper
+    dst.clear();
+    Transform::fromAlgorithm(name, true)->project(src, dst);
+    if (!Distance::fromAlgorithm(name).isNull() && !dst.isEmpty())
+        Distance::fromAlgorithm(name)->compare(dst.first(), dst.first());
+}
+
 const char *br_version()
 {
     static QByteArray version = Context::version().toLocal8Bit();
@@ -323,6 +354,23 @@ br_template br_load_img(const char *data, int len)
     return (br_template)tmpl;
 }
 
+br_template br_wrap_img(unsigned char *data, int rows, int cols, int stride, int type)
+{
+    // The header refers to the caller's memory and never takes ownership of it
+    Template *tmpl = new Template(cv::Mat(rows, cols, type, data, stride));
+    return (br_template)tmpl;
+}
+
+br_template_list br_wrap_features(unsigned char *data, int rows, int cols, int type)
+{
+    TemplateList *tl = new TemplateList();
+    tl->reserve(rows);
+    const size_t step = size_t(cols) * CV_ELEM_SIZE(type);
+    for (int i=0; i<rows; i++)
+        tl->append(Template(File(QString::number(i)), cv::Mat(1, cols, type, data + i*step)));
+    return (br_template_list)tl;
+}
+
 unsigned char *br_unload_img(br_template tmpl)
 {
     Template *t = reinterpret_cast<Template*>(tmpl);
@@ -417,6 +465,65 @@ void br_enroll_template_list(br_template_list tl)
     Enroll(*realTL);
 }
 
+static TemplateList enrollTemplates(TemplateList tl)
+{
+    if (!tl.isEmpty())
+        Enroll(tl);
+    return tl;
+}
+
+// An asynchronous enrollment and the number of templates its caller provided rows for
+struct Enrollment
+{
+    QFuture<TemplateList> future;
+    int requested;
+};
+
+br_enrollment br_enroll_templates_async(br_template *tmpls, int num_tmpls)
+{
+    TemplateList tl;
+    tl.reserve(num_tmpls);
+    for (int i=0; i<num_tmpls; i++)
+        tl.append(*reinterpret_cast<Template*>(tmpls[i]));
+    Enrollment *enrollment = new Enrollment();
+    enrollment->future = QtConcurrent::run(enrollTemplates, tl);
+    enrollment->requested = num_tmpls;
+    return (br_enrollment)enrollment;
+}
+
+int br_enrollment_dims(br_enrollment enrollment)
+{
+    Enrollment *e = reinterpret_cast<Enrollment*>(enrollment);
+    foreach (const Template &t, e->future.result())
+        if (!t.isEmpty() && !t.m().empty())
+            return int(t.m().total() * t.m().channels());
+    return 0;
+}
+
+int br_take_enrollment(br_enrollment enrollment, float *features, int dims)
+{
+    Enrollment *e = reinterpret_cast<Enrollment*>(enrollment);
+    const TemplateList tl = e->future.result();
+    const int requested = e->requested;
+    delete e;
+
+    // Detection and failures to enroll can change the number of templates, the caller only has rows for those it gave
+    for (int i=0; i<requested; i++) {
+        float *row = features + qint64(i)*dims;
+        memset(row, 0, sizeof(float)*dims);
+        if ((i >= tl.size()) || tl[i].isEmpty() || tl[i].m().empty())
+            continue;
+
+        const cv::Mat m = tl[i].m().isContinuous() ? tl[i].m() : tl[i].m().clone();
+        cv::Mat values = m.reshape(1, 1);
+        const int n = std::min(dims, values.cols);
+        // Converted straight into the caller's memory
+        cv::Mat dst(1, n, CV_32FC1, row);
+        values.colRange(0, n).convertTo(dst, CV_32F);
+    }
+    return tl.size();
+}
+
 br_matrix_output br_compare_template_lists(br_template_list target, br_template_list query)
 {
     TemplateList *targetTL = reinterpret_cast<TemplateList*>(target);
@@ -470,3 +577,298 @@ void br_close_gallery(br_gallery gallery)
     Gallery *gal = reinterpret_cast<Gallery*>(gallery);
     delete gal;
 }
+
+
+// Keeps the k best targets of each query in a bounded heap as tiles of scores arrive
+class TopKSearchOutput : public Output
+{
+    typedef QPair<float,int> Candidate; // (score, target index)
+    static const int Stripes = 64;
+    QMutex locks[Stripes];
+
+public:
+    int k;
+    QVector< QVector<Candidate> > heaps;
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        Output::initialize(targetFiles, queryFiles);
+        selfSimilar = false;
+        heaps = QVector< QVector<Candidate> >(queryFiles.size());
+    }
+
+    void set(float value, int i, int j)
+    {
+        if (value == -std::numeric_limits<float>::max()) return;
+        QMutexLocker locker(&locks[i % Stripes]);
+        Common::PushTopK(heaps[i], Candidate(value, j), k);
+    }
+
+    void setTile(const cv::Mat &scores, int i, int j)
+    {
+        // Select the best candidates of each row locally before merging them under lock
+        QVector<Candidate> candidates; candidates.reserve(k);
+        for (int r=0; r<scores.rows; r++) {
+            candidates.clear();
+            const float *row = scores.ptr<float>(r);
+            for (int c=0; c<scores.cols; c++)
+                if (row[c] != -std::numeric_limits<float>::max())
+                    Common::PushTopK(candidates, Candidate(row[c], j+c), k);
+            if (candidates.isEmpty()) continue;
+            QMutexLocker locker(&locks[(i+r) % Stripes]);
+            foreach (const Candidate &candidate, candidates)
+                Common::PushTopK(heaps[i+r], candidate, k);
+        }
+    }
+};
+
+// Queries of concurrent br_search_templates calls searched together
+struct SearchBatch
+{
+    TemplateList queries;
+    int k;
+    bool done;
+    QVector< QVector< QPair<float,int> > > results; // Sorted best first
+    QWaitCondition finished;
+
+    SearchBatch() : k(1), done(false) {}
+};
+
+// Resident gallery and distance for br_search_templates
+struct SearchHandle
+{
+    TemplateList gallery;
+    QSharedPointer<Distance> distance;
+    unsigned long batchWindow; // Microseconds a batch waits for more queries
+
+    // Queries arriving while a batch is searched form the next batch
+    QMutex lock;
+    QWaitCondition idle;
+    bool searching;
+    QSharedPointer<SearchBatch> pending;
+
+    SearchHandle() : batchWindow(0), searching(false) {}
+
+    void search(SearchBatch *batch) const
+    {
+        TopKSearchOutput output;
+        output.k = batch->k;
+        output.initialize(gallery.files(), batch->queries.files());
+        output.setBlock(-1, -1);
+        distance->compare(gallery, batch->queries, &output);
+
+        for (int i=0; i<output.heaps.size(); i++)
+            std::sort_heap(output.heaps[i].begin(), output.heaps[i].end(), std::greater< QPair<float,int> >());
+        batch->results = output.heaps;
+    }
+};
+
+br_search br_make_search(const char *gallery)
+{
+    SearchHandle *search = new SearchHandle();
+    search->gallery = TemplateList::fromGallery(gallery);
+    search->distance = Distance::fromAlgorithm(Globals->algorithm);
+    search->batchWindow = std::max(0, File(gallery).get<int>("batchWindow", 0));
+
+    // Pack uniform templates into aligned rows once, so every search compares them in place
+    TemplateList &templates = search->gallery;
+    size_t bytes = 0;
+    bool uniform = !templates.isEmpty();
+    foreach (const Template &t, templates) {
+        if ((t.size() != 1) || !t.m().isContinuous()) { uniform = false; break; }
+        const size_t currentBytes = t.m().total() * t.m().elemSize();
+        if (bytes == 0) bytes = currentBytes;
+        if (currentBytes != bytes) { uniform = false; break; }
+    }
+    if (uniform) {
+        templates.stride = OpenCVUtils::alignedStep(bytes);
+        uchar *data = OpenCVUtils::alignedBuffer(templates.alignedData, templates.stride * templates.size());
+        for (int i=0; i<templates.size(); i++) {
+            const cv::Mat &m = templates[i].m();
+            uchar *dst = data + i*templates.stride;
+            memcpy(dst, m.data, bytes);
+            templates[i].m() = cv::Mat(m.rows, m.cols, m.type(), dst);
+        }
+    }
+    return (br_search)search;
+}
+
+br_template_list br_search_gallery(br_search search)
+{
+    return (br_template_list)&reinterpret_cast<SearchHandle*>(search)->gallery;
+}
+
+int br_search_templates(br_search search, br_template_list queries, int k, int *indices, float *scores)
+{
+    SearchHandle *handle = reinterpret_cast<SearchHandle*>(search);
+    const TemplateList &queryTL = *reinterpret_cast<TemplateList*>(queries);
+    k = std::max(1, k);
+
+    // The first caller of a batch searches it for everyone who joined, one scan of the gallery for all of their queries
+    QMutexLocker locker(&handle->lock);
+    QSharedPointer<SearchBatch> batch = handle->pending;
+    const bool leader = batch.isNull();
+    if (leader) {
+        batch = QSharedPointer<SearchBatch>(new SearchBatch());
+        handle->pending = batch;
+    }
+    const int offset = batch->queries.size();
+    batch->queries.append(queryTL);
+    batch->k = std::max(batch->k, k);
+
+    if (leader) {
+        if (handle->batchWindow > 0) {
+            locker.unlock();
+            QThread::usleep(handle->batchWindow);
+            locker.relock();
+        }
+        while (handle->searching)
+            handle->idle.wait(&handle->lock);
+        handle->pending.clear();
+        handle->searching = true;
+        locker.unlock();
+
+        handle->search(batch.data());
+
+        locker.relock();
+        handle->searching = false;
+        batch->done = true;
+        handle->idle.wakeAll();
+        batch->finished.wakeAll();
+    } else {
+        while (!batch->done)
+            batch->finished.wait(&handle->lock);
+    }
+    locker.unlock();
+
+    for (int i=0; i<queryTL.size(); i++) {
+        const QVector< QPair<float,int> > &heap = batch->results[offset+i];
+        for (int j=0; j<k; j++) {
+            indices[i*k+j] = (j < heap.size()) ? heap[j].second : -1;
+            scores[i*k+j] = (j < heap.size()) ? heap[j].first : -std::numeric_limits<float>::max();
+        }
+    }
+    return queryTL.size();
+}
+
+void br_free_search(br_search search)
+{
+    delete reinterpret_cast<SearchHandle*>(search);
+}
+
+// Enrolls submitted templates in batches on its own thread, see br_start_enrollment_job
+class EnrollmentJob : public QThread
+{
+    QSharedPointer<Transform> stream, transform;
+    br_enrollment_callback callback;
+    void *context;
+
+    QMutex lock;
+    QWaitCondition submitted, returned;
+    TemplateList pending;
+    QList<int> pendingIndices;
+    int submissions, inFlight, maxInFlight;
+    bool cancelled, finishing;
+
+public:
+    EnrollmentJob(int maxInFlight, br_enrollment_callback callback, void *context)
+        : callback(callback), context(context), submissions(0), inFlight(0), maxInFlight(std::max(1, maxInFlight)), cancelled(false), finishing(false)
+    {
+        transform = Transform::fromAlgorithm(Globals->algorithm, false);
+        stream = Transform::fromAlgorithm(Globals->algorithm, true);
+        start();
+    }
+
+    int submit(const Template &t)
+    {
+        QMutexLocker locker(&lock);
+        while (!cancelled && (inFlight >= maxInFlight))
+            returned.wait(&lock);
+        if (cancelled) return -1;
+
+        pending.append(t);
+        pendingIndices.append(submissions);
+        inFlight++;
+        submitted.wakeOne();
+        return submissions++;
+    }
+
+    void cancel()
+    {
+        QMutexLocker locker(&lock);
+        cancelled = true;
+        inFlight -= pending.size();
+        pending.clear();
+        pendingIndices.clear();
+        returned.wakeAll();
+    }
+
+    void finish()
+    {
+        {
+            QMutexLocker locker(&lock);
+            finishing = true;
+            submitted.wakeOne();
+        }
+        wait();
+    }
+
+private:
+    void run()
+    {
+        forever {
+            QMutexLocker locker(&lock);
+            while (pending.isEmpty() && !finishing)
+                submitted.wait(&lock);
+            if (pending.isEmpty())
+                return;
+
+            const TemplateList batch = pending;
+            const QList<int> indices = pendingIndices;
+            pending.clear();
+            pendingIndices.clear();
+            locker.unlock();
+
+            TemplateList enrolled;
+            stream->project(batch, enrolled);
+            if (enrolled.size() != batch.size()) {
+                // The pipeline changed the number of templates, fall back to one template at a time
+                enrolled.clear();
+                foreach (const Template &t, batch) {
+                    Template u;
+                    transform->project(t, u);
+                    enrolled.append(u);
+                }
+            }
+
+            for (int i=0; i<enrolled.size(); i++)
+                callback((br_template)&enrolled[i], indices[i], context);
+
+            locker.relock();
+            inFlight -= batch.size();
+            returned.wakeAll();
+        }
+    }
+};
+
+br_enrollment_job br_start_enrollment_job(int max_in_flight, br_enrollment_callback callback, void *context)
+{
+    return (br_enrollment_job)new EnrollmentJob(max_in_flight, callback, context);
+}
+
+int br_submit_template(br_enrollment_job job, br_template tmpl)
+{
+    return reinterpret_cast<EnrollmentJob*>(job)->submit(*reinterpret_cast<Template*>(tmpl));
+}
+
+void br_cancel_enrollment_job(br_enrollment_job job)
+{
+    reinterpret_cast<EnrollmentJob*>(job)->cancel();
+}
+
+void br_finish_enrollment_job(br_enrollment_job job)
+{
+    EnrollmentJob *enrollmentJob = reinterpret_cast<EnrollmentJob*>(job);
+    enrollmentJob->finish();
+    delete enrollmentJob;
+}
@@ -61,6 +61,22 @@ extern "C" {
  */
 BR_EXPORT const char *br_about();
 
+/*!
+ * \brief Measures enrollment throughput and latency of the algorithm set by \c -algorithm.
+ *
+ * The templates of \em input are replicated to \c count templates (default \c 64) and enrolled through a stream
+ * after \c warmup templates (default \c 8), once for every combination of the \c parallelism and \c readMode values
+ * given as \em input metadata, defaulting to the current br::Context::parallelism and \c Auto.
+ * Each run reports templates per second, per template latency percentiles and per stage timings from the profiler.
+ * \code
+ * $ br -algorithm FaceRecognition -benchmark "../data/family.jpg[count=128,parallelism=[1,2,4,8],readMode=[Auto,DistributeFrames]]" benchmark.json
+ * \endcode
+ * \param input The br::Input set of images to enroll.
+ * \param output Optional JSON file to contain the results, printed to the terminal by default.
+ * \see br_enroll
+ */
+BR_EXPORT void br_benchmark(const char *input, const char *output = "");
+
 /*!
  * \brief Wraps br::Cat()
  */
@@ -110,6 +126,15 @@ BR_EXPORT void br_compare_n(int num_targets, const char *target_galleries[], con
 
 BR_EXPORT void br_pairwise_compare(const char *target_gallery, const char *query_gallery, const char *output = "");
 
+/*!
+ * \brief Clusters the duplicate templates of a gallery without constructing its self-similarity matrix.
+ * \param gallery The br::Gallery file to deduplicate.
+ * \param threshold Pairs of templates scoring at least \c threshold are duplicates.
+ * \param csv The cluster results file to generate. Results are stored one row per cluster and use gallery indices.
+ * \see br_cluster
+ */
+BR_EXPORT void br_deduplicate(const char *gallery, float threshold, const char *csv);
+
 /*!
  * \brief Wraps br::Convert()
  */
@@ -230,6 +255,7 @@ BR_EXPORT bool br_is_classifier(const char *algorithm);
  * \param target_input The target br::Input.
  * \param query_input The query br::Input.
  * \param mask The file to contain the resulting \ref mask.
+ *             Append <tt>[packed]</tt> to store 2 bits per comparison instead of 8.
  * \see br_combine_masks
  */
 BR_EXPORT void br_make_mask(const char *target_input, const char *query_input, const char *mask);
@@ -291,6 +317,9 @@ BR_EXPORT const char *br_objects(const char *abstractions = ".*", const char *im
  * \return Returns \c true on success. Returns false on a failure to compile the figures due to a missing, out of date, or incomplete \c R installation.
  * \note This function requires a current <a href="http://www.r-project.org/">R</a> installation with the following packages:
  * \code install.packages(c("ggplot2", "gplots", "reshape", "scales")) \endcode
+ * \note Appending <tt>[native]</tt> to \em destination skips R and renders the ROC, DET and CMC figures in process to
+ *       <i>destination</i><tt>_ROC</tt>, <tt>_DET</tt> and <tt>_CMC</tt> with the <tt>.svg</tt> or <tt>.png</tt> suffix of \em destination.
+ *       Operating points are thinned to <tt>bins</tt> (default 1000) evenly spaced in log FAR, so very large CSVs render quickly.
  * \see br_eval
  */
 BR_EXPORT bool br_plot(int num_files, const char *files[], const char *destination, bool show = false);
@@ -423,6 +452,17 @@ BR_EXPORT void br_train(const char *input, const char *model = "");
  */
 BR_EXPORT void br_train_n(int num_inputs, const char *inputs[], const char *model = "");
 
+/*!
+ * \brief Loads \em algorithm and projects a blank \em rows x \em cols color image through it and its stream.
+ *
+ * Call before serving traffic so the first request does not pay for loading models,
+ * SDK initialization or per-thread resources.
+ * \param algorithm The algorithm to warm up, \c NULL for br::Context::algorithm.
+ * \param rows Height of the blank image.
+ * \param cols Width of the blank image.
+ */
+BR_EXPORT void br_warm_up(const char *algorithm = NULL, int rows = 480, int cols = 640);
+
 /*!
  * \brief Wraps br::Context::version()
  * \note \ref managed_return_value
@@ -444,6 +484,17 @@ typedef void* br_template;
 typedef void* br_template_list;
 typedef void* br_gallery;
 typedef void* br_matrix_output;
+typedef void* br_enrollment;
+typedef void* br_search;
+typedef void* br_enrollment_job;
+
+/*!
+ * \brief Called by an enrollment job for each enrolled template, from the job's thread.
+ * \param tmpl The enrolled br::Template, only valid for the duration of the call.
+ * \param index The order in which the template was submitted.
+ * \param context The pointer given to br_start_enrollment_job.
+ */
+typedef void (*br_enrollment_callback)(br_template tmpl, int index, void *context);
 /*!
   * \brief Load an image from a string buffer.
   *   Easy way to pass an image in memory from another programming language to openbr.
@@ -452,6 +503,27 @@ typedef void* br_matrix_output;
   * \see br_unload_img
   */
 BR_EXPORT br_template br_load_img(const char *data, int len);
+/*!
+  * \brief Wrap a decoded pixel buffer in a br::Template without copying it.
+  *   The buffer is owned by the caller and must stay valid until the template and its enrollment are freed.
+  * \param data The first pixel of the image.
+  * \param rows The height of the image.
+  * \param cols The width of the image.
+  * \param stride The number of bytes between the start of consecutive rows.
+  * \param type The OpenCV matrix type of the pixels, for example \c CV_8UC3 for interleaved BGR.
+  * \see br_enroll_templates_async
+  */
+BR_EXPORT br_template br_wrap_img(unsigned char *data, int rows, int cols, int stride, int type);
+/*!
+  * \brief Wrap the rows of a feature matrix in a br::TemplateList without copying them.
+  *   The matrix is owned by the caller and must stay valid until the list is freed.
+  * \param data The first value of the matrix, rows are contiguous.
+  * \param rows The number of templates.
+  * \param cols The number of values in each template.
+  * \param type The OpenCV matrix type of the values, \c CV_32FC1 or \c CV_8UC1 to match the features of the current \c -algorithm.
+  * \see br_search_templates
+  */
+BR_EXPORT br_template_list br_wrap_features(unsigned char *data, int rows, int cols, int type);
 /*!
   * \brief Unload an image to a string buffer.
   *   Easy way to pass an image from openbr to another programming language.
@@ -517,6 +589,28 @@ BR_EXPORT br_template_list br_enroll_template(br_template tmpl);
   * \param tl Pointer to a br::TemplateList.
   */
 BR_EXPORT void br_enroll_template_list(br_template_list tl);
+/*!
+  * \brief Start enrolling templates on a background thread.
+  *   The templates share their images with the originals, as made by br_wrap_img this means no pixels are copied.
+  * \param tmpls Pointers to br::Templates.
+  * \param num_tmpls The number of templates.
+  * \return A handle to the enrollment, released by br_take_enrollment.
+  */
+BR_EXPORT br_enrollment br_enroll_templates_async(br_template *tmpls, int num_tmpls);
+/*!
+  * \brief Wait for an enrollment and return the number of values in each feature vector.
+  */
+BR_EXPORT int br_enrollment_dims(br_enrollment enrollment);
+/*!
+  * \brief Wait for an enrollment, copy its feature vectors and free it.
+  * \param enrollment Handle from br_enroll_templates_async.
+  * \param features Caller provided memory for <tt>num_tmpls * dims</tt> floats, one row per template in order.
+  *   Rows of templates that failed to enroll are zero, vectors longer than \em dims are truncated.
+  *   At most \em num_tmpls rows are written, rows past the last enrolled template are zero.
+  * \param dims The number of floats in each row of \em features.
+  * \return The number of templates enrolled, which differs from \em num_tmpls when detection finds several or none in an image.
+  */
+BR_EXPORT int br_take_enrollment(br_enrollment enrollment, float *features, int dims);
 /*!
   * \brief Compare br::TemplateLists from the C API!
   * \return Pointer to a br::MatrixOutput.
@@ -555,6 +649,60 @@ BR_EXPORT void br_add_to_gallery(br_gallery gallery, br_template_list tl);
   */
 BR_EXPORT void br_close_gallery(br_gallery gallery);
 
+/*!
+  * \brief Load a gallery once for repeated top-k searches.
+  *   The gallery's templates are packed into aligned rows, compared with the distance of the current \c -algorithm.
+  *   Queries of br_search_templates calls that arrive while a search is running are searched together in the next scan of the gallery,
+  *   which also waits \c batchWindow microseconds for more queries if set, e.g. <tt>gallery.gal[batchWindow=500]</tt>.
+  * \param gallery String location of an enrolled gallery on disk.
+  * \return A handle released by br_free_search.
+  */
+BR_EXPORT br_search br_make_search(const char *gallery);
+/*!
+  * \brief Get the resident gallery of a search, to look up the templates behind returned indices.
+  *   Owned by the search.
+  */
+BR_EXPORT br_template_list br_search_gallery(br_search search);
+/*!
+  * \brief Find the \em k most similar gallery templates for each query without allocating a similarity matrix.
+  *   Safe to call from several threads, concurrent calls are batched into one search.
+  * \param search Handle from br_make_search.
+  * \param queries Pointer to an enrolled br::TemplateList.
+  * \param k The number of results per query.
+  * \param indices Caller provided memory for <tt>num_queries * k</tt> gallery indicies, -1 where there are fewer than \em k results.
+  * \param scores Caller provided memory for <tt>num_queries * k</tt> scores in decreasing order for each query.
+  * \return The number of queries searched.
+  */
+BR_EXPORT int br_search_templates(br_search search, br_template_list queries, int k, int *indices, float *scores);
+/*!
+  * \brief Free a search and its resident gallery.
+  */
+BR_EXPORT void br_free_search(br_search search);
+
+/*!
+  * \brief Start a job that enrolls templates as they are submitted.
+  *   Templates submitted while a batch is enrolling form the next batch, projected together through the algorithm's stream.
+  * \param max_in_flight The most templates submitted but not yet returned through \em callback, br_submit_template blocks beyond it.
+  * \param callback Receives each enrolled template.
+  * \param context Passed through to \em callback.
+  * \return A handle released by br_finish_enrollment_job.
+  */
+BR_EXPORT br_enrollment_job br_start_enrollment_job(int max_in_flight, br_enrollment_callback callback, void *context);
+/*!
+  * \brief Queue a copy of a br::Template for enrollment, sharing its images.
+  * \return The index passed to the callback for this template, or -1 if the job was cancelled.
+  */
+BR_EXPORT int br_submit_template(br_enrollment_job job, br_template tmpl);
+/*!
+  * \brief Drop templates not yet enrolled, their callbacks are never called.
+  *   The batch already enrolling still completes.
+  */
+BR_EXPORT void br_cancel_enrollment_job(br_enrollment_job job);
+/*!
+  * \brief Wait for every submitted template to be returned, or dropped if cancelled, and free the job.
+  */
+BR_EXPORT void br_finish_enrollment_job(br_enrollment_job job);
+
 /*! @}*/
 
 #ifdef __cplusplus
@@ -17,16 +17,22 @@
 #include <QCoreApplication>
 #include <QCryptographicHash>
 #include <QFutureSynchronizer>
+#include <QHash>
 #include <QLocalSocket>
 #include <QMetaProperty>
+#include <QMutex>
 #include <QPointF>
 #include <QProcess>
 #include <QRect>
 #include <QRegExp>
+#include <QRunnable>
+#include <QSet>
+#include <QSemaphore>
 #include <QThreadPool>
 #include <QtConcurrentRun>
 #include <algorithm>
 #include <iostream>
+#include <limits>
 
 #ifndef BR_EMBEDDED
 #include <QApplication>
@@ -36,7 +42,12 @@
 #include "version.h"
 #include "core/bee.h"
 #include "core/common.h"
+#include "core/distributed.h"
+#include "core/logger.h"
+#include "core/numa.h"
 #include "core/opencvutils.h"
+#include "core/profiler.h"
+#include "core/progress.h"
 #include "core/qtutils.h"
 
 using namespace br;
@@ -76,8 +87,8 @@ QString File::hash() const
 
 void File::append(const QMap<QString,QVariant> &metadata)
 {
-    foreach (const QString &key, metadata.keys())
-        set(key, metadata[key]);
+    for (QMap<QString,QVariant>::const_iterator it = metadata.constBegin(); it != metadata.constEnd(); ++it)
+        set(it.key(), it.value());
 }
 
 void File::append(const File &other)
@@ -90,7 +101,9 @@ void File::append(const File &other)
             name += value("separator").toString() + other.name;
         }
     }
-    append(other.m_metadata);
+    // Share the other metadata map instead of copying it key by key
+    if (m_metadata.isEmpty()) m_metadata = other.m_metadata;
+    else                      append(other.m_metadata);
 }
 
 QList<File> File::split() const
@@ -133,7 +146,9 @@ bool File::contains(const QString &key) const
 
 QVariant File::value(const QString &key) const
 {
-    return m_metadata.contains(key) ? m_metadata.value(key) : (key == "name" ? name : Globals->property(qPrintable(key)));
+    QVariantMap::const_iterator it = m_metadata.constFind(key);
+    if (it != m_metadata.constEnd()) return it.value();
+    return key == "name" ? QVariant(name) : Globals->value(key);
 }
 
 QVariant File::parse(const QString &value)
@@ -162,8 +177,18 @@ void File::set(const QString &key, const QString &value)
 
 bool File::getBool(const QString &key, bool defaultValue) const
 {
-    if (!contains(key)) return defaultValue;
-    QVariant variant = value(key);
+    // One lookup in the local metadata, then the global property index
+    QVariant variant;
+    QVariantMap::const_iterator it = m_metadata.constFind(key);
+    if (it != m_metadata.constEnd()) {
+        variant = it.value();
+    } else {
+        const int index = Globals->propertyIndex(key);
+        if (index < 0) return defaultValue;
+        const QMetaProperty property = Globals->metaObject()->property(index);
+        if (property.type() == QVariant::Bool) return property.read(Globals).toBool();
+        variant = property.read(Globals);
+    }
     if (variant.isNull() || !variant.canConvert<bool>()) return true;
     return variant.value<bool>();
 }
@@ -202,6 +227,14 @@ void File::appendPoints(const QList<QPointF> &points)
     m_metadata["Points"] = newPoints;
 }
 
+void File::setPoints(const QList<QPointF> &points)
+{
+    QList<QVariant> newPoints; newPoints.reserve(points.size());
+    foreach (const QPointF &point, points)
+        newPoints.append(point);
+    m_metadata.insert("Points", newPoints);
+}
+
 QList<QRectF> File::namedRects() const
 {
     QList<QRectF> rects;
@@ -246,6 +279,19 @@ void File::appendRects(const QList<cv::Rect> &rects)
     appendRects(OpenCVUtils::fromRects(rects));
 }
 
+void File::setRects(const QList<QRectF> &rects)
+{
+    QList<QVariant> newRects; newRects.reserve(rects.size());
+    foreach (const QRectF &rect, rects)
+        newRects.append(rect);
+    m_metadata.insert("Rects", newRects);
+}
+
+void File::setRects(const QList<cv::Rect> &rects)
+{
+    setRects(OpenCVUtils::fromRects(rects));
+}
+
 /* File - private methods */
 void File::init(const QString &file)
 {
@@ -488,6 +534,50 @@ TemplateList TemplateList::fromBuffer(const QByteArray &buffer)
     return templateList;
 }
 
+Mat TemplateList::matrix(int index) const
+{
+    const QList<Mat> mats = data(index);
+    if (mats.isEmpty()) return Mat();
+
+    // Row pitch of the shared buffer, found from the first gap when every matrix is a single row
+    const Mat &first = mats.first();
+    size_t step = (first.rows > 1) ? first.step[0] : 0;
+    bool shared = (first.data != NULL);
+    int rows = 0;
+    for (int i=0; i<mats.size() && shared; i++) {
+        const Mat &m = mats[i];
+        if ((m.dims != 2) || (m.cols != first.cols) || (m.type() != first.type())) {
+            shared = false;
+            break;
+        }
+        if (m.rows > 1) {
+            if (step == 0) step = m.step[0];
+            shared = (m.step[0] == step);
+        }
+        if (i > 0) {
+            const Mat &previous = mats[i-1];
+            const ptrdiff_t gap = m.data - previous.data;
+            if ((step == 0) && (gap > 0)) step = gap;
+            shared = shared && (gap == ptrdiff_t(previous.rows * step));
+        }
+        rows += m.rows;
+    }
+    if (step == 0) step = first.step[0];
+
+    if (shared && (step >= first.cols * first.elemSize()) && (step % first.elemSize1() == 0))
+        return Mat(rows, first.cols, first.type(), first.data, step);
+    return OpenCVUtils::toMatByRow(mats);
+}
+
+TemplateList TemplateList::fromMatrix(const Mat &m, const FileList &files)
+{
+    if (m.rows != files.size()) qFatal("Matrix rows %d do not match file count %d.", m.rows, files.size());
+    TemplateList templates; templates.reserve(files.size());
+    for (int i=0; i<files.size(); i++)
+        templates.append(Template(files[i], m.row(i)));
+    return templates;
+}
+
 // indexes some property, assigns an integer id to each unique value of propName
 // stores the index values in "Label" of the output template list
 TemplateList TemplateList::relabel(const TemplateList &tl, const QString &propName, bool preserveIntegers)
@@ -846,15 +936,33 @@ int br::Context::blocks(int size) const
     return std::ceil(1.f*size/blockSize);
 }
 
-bool br::Context::contains(const QString &name)
+// Context properties are fixed at compile time, so their indices are interned once
+static QHash<QString,int> contextPropertyIndices()
 {
-    QByteArray bytes = name.toLocal8Bit();
-    const char * c_name = bytes.constData();
+    QHash<QString,int> indices;
+    const QMetaObject &metaObject = br::Context::staticMetaObject;
+    for (int i=0; i<metaObject.propertyCount(); i++)
+        indices.insert(QString::fromLatin1(metaObject.property(i).name()), i);
+    return indices;
+}
 
-    for (int i=0; i<metaObject()->propertyCount(); i++)
-        if (!strcmp(c_name, metaObject()->property(i).name()))
-            return true;
-    return false;
+static const QHash<QString,int> ContextPropertyIndices = contextPropertyIndices();
+
+int br::Context::propertyIndex(const QString &name) const
+{
+    return ContextPropertyIndices.value(name, -1);
+}
+
+bool br::Context::contains(const QString &name) const
+{
+    return ContextPropertyIndices.contains(name);
+}
+
+QVariant br::Context::value(const QString &name) const
+{
+    const int index = propertyIndex(name);
+    if (index >= 0) return metaObject()->property(index).read(this);
+    return QObject::property(qPrintable(name)); // Dynamic properties
 }
 
 void br::Context::printStatus()
@@ -863,7 +971,10 @@ void br::Context::printStatus()
     const float p = progress();
     if (p < 1) {
         int s = timeRemaining();
-        fprintf(stderr, "%05.2f%%  REMAINING=%s  COUNT=%g  \r", 100 * p, QtUtils::toTime(s/1000.0f).toStdString().c_str(), totalSteps);
+        // Work nested inside the job reports its own rate beside the job's progress
+        const Progress *root = Progress::root(), *current = Progress::current();
+        const QString nested = (current != root) ? QString("  %1 RATE=%2/s").arg(current->getName(), QString::number(current->rate(), 'g', 3)) : QString();
+        fprintf(stderr, "%05.2f%%  REMAINING=%s  COUNT=%g%s  \r", 100 * p, QtUtils::toTime(s/1000.0f).toStdString().c_str(), totalSteps, qPrintable(nested));
     }
 }
 
@@ -882,13 +993,7 @@ void br::Context::setProperty(const QString &key, const QString &value)
         if (parallelism <= 0) parallelism = 1;
         QThreadPool::globalInstance()->setMaxThreadCount(parallelism);
     } else if (key == "log") {
-        logFile.close();
-        if (log.isEmpty()) return;
-
-        logFile.setFileName(log);
-        QtUtils::touchDir(logFile);
-        logFile.open(QFile::Append);
-        logFile.write("================================================================================\n");
+        Logger::open(log);
     }
 }
 
@@ -921,6 +1026,9 @@ void br::Context::initialize(int &argc, char *argv[], QString sdkPath, bool use_
 
     qInstallMessageHandler(messageHandler);
 
+    // MPI may consume its own arguments, so it starts before Qt sees them
+    Distributed::initialize(argc, argv);
+
     // We take in argc as a reference due to:
     //   https://bugreports.qt-project.org/browse/QTBUG-5637
     // QApplication should be initialized before anything else.
@@ -999,6 +1107,20 @@ void br::Context::initialize(int &argc, char *argv[], QString sdkPath, bool use_
         initializer->initialize();
 }
 
+static QMutex PreparedInitializersLock;
+static QMap<QString, QSharedPointer<Initializer> > PreparedInitializers;
+static QList< QSharedPointer<Initializer> > PreparationOrder;
+
+void br::Initializer::require(const QString &name)
+{
+    QMutexLocker locker(&PreparedInitializersLock);
+    if (PreparedInitializers.contains(name)) return;
+    QSharedPointer<Initializer> initializer(Factory<Initializer>::make("." + name));
+    initializer->prepare();
+    PreparedInitializers.insert(name, initializer);
+    PreparationOrder.append(initializer);
+}
+
 void br::Context::finalize()
 {
     // Trigger registered finalizers
@@ -1006,11 +1128,27 @@ void br::Context::finalize()
     foreach (const QSharedPointer<Initializer> &initializer, initializers)
         initializer->finalize();
 
+    // Release initializers prepared on demand after the finalizers, which can still free objects of their SDKs,
+    // most recently prepared first
+    {
+        QMutexLocker locker(&PreparedInitializersLock);
+        for (int i=PreparationOrder.size()-1; i>=0; i--)
+            PreparationOrder[i]->release();
+        PreparationOrder.clear();
+        PreparedInitializers.clear();
+    }
+
+    Profiler::write();
+    Logger::close();
+    NUMA::release();
+
     delete Globals;
     Globals = NULL;
 
     delete application;
     application = NULL;
+
+    Distributed::finalize();
 }
 
 QString br::Context::about()
@@ -1071,13 +1209,13 @@ void br::Context::messageHandler(QtMsgType type, const QMessageLogContext &conte
     std::cerr << txt.toStdString();
     Globals->mostRecentMessage = txt;
 
-    if (Globals->logFile.isWritable()) {
-        Globals->logFile.write(qPrintable(txt));
-        Globals->logFile.flush();
-    }
+    Logger::append(txt);
 
-    if (type == QtFatalMsg)
+    if (type == QtFatalMsg) {
+        Logger::flush();
+        Distributed::abort();
         abort(); // We abort so we can get a stack trace back to the code that triggered the message.
+    }
 }
 
 Context *br::Globals = NULL;
@@ -1088,12 +1226,13 @@ void Output::initialize(const FileList &targetFiles, const FileList &queryFiles)
     this->targetFiles = targetFiles;
     this->queryFiles = queryFiles;
     selfSimilar = (queryFiles == targetFiles) && (targetFiles.size() > 1) && (queryFiles.size() > 1);
+    if (blockSize <= 0) blockSize = Globals->blockSize;
 }
 
 void Output::setBlock(int rowBlock, int columnBlock)
 {
-    offset = QPoint((columnBlock == -1) ? 0 : Globals->blockSize*columnBlock,
-                    (rowBlock == -1) ? 0 : Globals->blockSize*rowBlock);
+    offset = QPoint((columnBlock == -1) ? 0 : blockSize*columnBlock,
+                    (rowBlock == -1) ? 0 : blockSize*rowBlock);
     if (!next.isNull()) next->setBlock(rowBlock, columnBlock);
 }
 
@@ -1103,20 +1242,275 @@ void Output::setRelative(float value, int i, int j)
     if (!next.isNull()) next->setRelative(value, i, j);
 }
 
-Output *Output::make(const File &file, const FileList &targetFiles, const FileList &queryFiles)
+void Output::setRelativeTile(const cv::Mat &scores, int i, int j)
+{
+    setTile(scores, i+offset.y(), j+offset.x());
+    if (!next.isNull()) next->setRelativeTile(scores, i, j);
+}
+
+// Reduces the scores of each query against the templates of a subject to one score per subject as blocks are compared,
+// forwarding them to an output whose targets are the subjects, see Output::make().
+// Subjects are numbered in order of first appearance, so galleries sorted by subject only hold the scores of a few blocks of subjects at a time.
+class SubjectOutput : public Output
+{
+public:
+    enum Reduction { Max, Mean, TopMean };
+
+private:
+    static const int Stripes = 64;
+
+    // Scores of a row block against the subject blocks it hasn't finished
+    struct RowBlock
+    {
+        QVector<bool> done; // Per target column block
+        QHash<int, Mat> states; // Per subject block, cellSize() doubles per query and subject
+        QSet<int> forwarded;
+    };
+
+    QSharedPointer<Output> subjects;
+    const QVector<int> subjectOf; // Target index to subject index
+    const int subjectCount;
+    const Reduction reduction;
+    const int n;
+    int columnBlocks, subjectBlocks, currentRowBlock, currentColumnBlock;
+    QVector< QVector<int> > requiredColumnBlocks; // Per subject block, the target column blocks holding its templates
+    QVector< QVector<int> > touchedSubjectBlocks; // Per target column block, the subject blocks of its templates
+    QMap<int, RowBlock> rowBlocks;
+    QMutex locks[Stripes];
+
+public:
+    SubjectOutput(Output *subjects_, const QVector<int> &subjectOf_, int subjectCount_, Reduction reduction_, int n_)
+        : subjects(subjects_), subjectOf(subjectOf_), subjectCount(subjectCount_), reduction(reduction_), n(std::max(1, n_)),
+          columnBlocks(0), subjectBlocks(0), currentRowBlock(-1), currentColumnBlock(-1) {}
+
+    ~SubjectOutput()
+    {
+        complete(currentRowBlock, currentColumnBlock);
+
+        // Forward whatever remains of blocks that were never compared
+        foreach (int rowBlock, rowBlocks.keys())
+            foreach (int subjectBlock, rowBlocks[rowBlock].states.keys())
+                forward(rowBlock, subjectBlock);
+    }
+
+    static Output *make(const File &file, const FileList &targetFiles, const FileList &queryFiles, int blockSize)
+    {
+        const QString reductionName = file.get<QString>("subjects");
+        Reduction reduction;
+        if      (reductionName == "Max")     reduction = Max;
+        else if (reductionName == "Mean")    reduction = Mean;
+        else if (reductionName == "TopMean") reduction = TopMean;
+        else    qFatal("Unknown subject reduction %s, expected Max, Mean or TopMean.", qPrintable(reductionName));
+
+        // A subject is a Label, templates without one are their own subject
+        QHash<QString, int> subjectIndex;
+        QVector<int> subjectOf(targetFiles.size());
+        FileList subjectFiles;
+        for (int j=0; j<targetFiles.size(); j++) {
+            const QString label = targetFiles[j].get<QString>("Label", QString());
+            const QString key = label.isEmpty() ? ("\n" + targetFiles[j].name) : label;
+            QHash<QString, int>::const_iterator it = subjectIndex.constFind(key);
+            if (it == subjectIndex.constEnd()) {
+                it = subjectIndex.insert(key, subjectFiles.size());
+                subjectFiles.append(targetFiles[j]);
+            }
+            subjectOf[j] = it.value();
+        }
+
+        File subjectsFile = file;
+        subjectsFile.remove("subjects");
+        subjectsFile.remove("topN");
+        Output *subjects = Factory<Output>::make(subjectsFile);
+        subjects->blockSize = blockSize;
+        subjects->initialize(subjectFiles, queryFiles);
+
+        SubjectOutput *output = new SubjectOutput(subjects, subjectOf, subjectFiles.size(), reduction, file.get<int>("topN", 3));
+        output->blockSize = subjects->blockSize;
+        output->initialize(targetFiles, queryFiles);
+        return output;
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        Output::initialize(targetFiles, queryFiles);
+        columnBlocks = int((qint64(targetFiles.size()) + blockSize - 1) / blockSize);
+        subjectBlocks = int((qint64(subjectCount) + blockSize - 1) / blockSize);
+        requiredColumnBlocks = QVector< QVector<int> >(subjectBlocks);
+        touchedSubjectBlocks = QVector< QVector<int> >(columnBlocks);
+        for (int j=0; j<targetFiles.size(); j++) {
+            const int columnBlock = j / blockSize;
+            const int subjectBlock = subjectOf[j] / blockSize;
+            if (!requiredColumnBlocks[subjectBlock].contains(columnBlock)) requiredColumnBlocks[subjectBlock].append(columnBlock);
+            if (!touchedSubjectBlocks[columnBlock].contains(subjectBlock)) touchedSubjectBlocks[columnBlock].append(subjectBlock);
+        }
+    }
+
+    // Blocks are compared one at a time, so no scores are arriving here
+    void setBlock(int rowBlock, int columnBlock)
+    {
+        complete(currentRowBlock, currentColumnBlock);
+        prepare(rowBlock, columnBlock);
+        currentRowBlock = rowBlock;
+        currentColumnBlock = columnBlock;
+        Output::setBlock(rowBlock, columnBlock);
+    }
+
+private:
+    int cellSize() const
+    {
+        return (reduction == Max) ? 1 : ((reduction == Mean) ? 2 : n);
+    }
+
+    int rows(int rowBlock) const
+    {
+        return int(std::min(qint64(blockSize), qint64(queryFiles.size()) - qint64(rowBlock)*blockSize));
+    }
+
+    int width(int subjectBlock) const
+    {
+        return int(std::min(qint64(blockSize), qint64(subjectCount) - qint64(subjectBlock)*blockSize));
+    }
+
+    void prepare(int rowBlock, int columnBlock)
+    {
+        if ((rowBlock < 0) || (columnBlock < 0) || (columnBlock >= columnBlocks)) return;
+        RowBlock &block = rowBlocks[rowBlock];
+        if (block.done.isEmpty()) block.done = QVector<bool>(columnBlocks, false);
+        foreach (int subjectBlock, touchedSubjectBlocks[columnBlock])
+            if (!block.states.contains(subjectBlock) && !block.forwarded.contains(subjectBlock))
+                block.states.insert(subjectBlock, Mat(rows(rowBlock), width(subjectBlock)*cellSize(), CV_64FC1,
+                                                      Scalar((reduction == Mean) ? 0 : -std::numeric_limits<double>::max())));
+    }
+
+    // Forwards the subject blocks whose templates have now all been compared against the row block
+    void complete(int rowBlock, int columnBlock)
+    {
+        if (!rowBlocks.contains(rowBlock) || (columnBlock < 0) || (columnBlock >= columnBlocks)) return;
+        RowBlock &block = rowBlocks[rowBlock];
+        block.done[columnBlock] = true;
+        foreach (int subjectBlock, touchedSubjectBlocks[columnBlock]) {
+            if (!block.states.contains(subjectBlock)) continue;
+            bool finished = true;
+            foreach (int required, requiredColumnBlocks[subjectBlock])
+                finished = finished && block.done[required];
+            if (finished) forward(rowBlock, subjectBlock);
+        }
+        if (block.forwarded.size() == subjectBlocks) rowBlocks.remove(rowBlock);
+    }
+
+    void forward(int rowBlock, int subjectBlock)
+    {
+        RowBlock &block = rowBlocks[rowBlock];
+        const Mat state = block.states.take(subjectBlock);
+        block.forwarded.insert(subjectBlock);
+
+        const int cellSize = this->cellSize();
+        Mat scores(state.rows, state.cols / cellSize, CV_32FC1);
+        for (int i=0; i<scores.rows; i++) {
+            const double *cell = state.ptr<double>(i);
+            float *score = scores.ptr<float>(i);
+            for (int k=0; k<scores.cols; k++, cell += cellSize) {
+                if (reduction == Max) {
+                    score[k] = float(std::max(cell[0], double(-std::numeric_limits<float>::max())));
+                } else if (reduction == Mean) {
+                    score[k] = (cell[1] > 0) ? float(cell[0] / cell[1]) : -std::numeric_limits<float>::max();
+                } else {
+                    double sum = 0;
+                    int count = 0;
+                    while ((count < cellSize) && (cell[count] != -std::numeric_limits<double>::max()))
+                        sum += cell[count++];
+                    score[k] = (count > 0) ? float(sum / count) : -std::numeric_limits<float>::max();
+                }
+            }
+        }
+
+        subjects->setBlock(rowBlock, subjectBlock);
+        subjects->setRelativeTile(scores, 0, 0);
+    }
+
+    void set(float value, int i, int j)
+    {
+        setTile(Mat(1, 1, CV_32FC1, Scalar(value)), i, j);
+    }
+
+    void setTile(const Mat &scores, int i, int j)
+    {
+        const int rowBlock = i / blockSize;
+        const QMap<int, RowBlock>::const_iterator block = rowBlocks.constFind(rowBlock);
+        if (block == rowBlocks.constEnd()) return;
+
+        const int cellSize = this->cellSize();
+        for (int r=0; r<scores.rows; r++) {
+            const int query = i + r;
+            const int row = query - rowBlock*blockSize;
+            const float *values = scores.ptr<float>(r);
+            int currentSubjectBlock = -1;
+            double *cells = NULL;
+
+            QMutexLocker locker(&locks[query % Stripes]);
+            for (int c=0; c<scores.cols; c++) {
+                const int target = j + c;
+                const float value = values[c];
+                if ((selfSimilar && (query == target)) || (value == -std::numeric_limits<float>::max())) continue;
+
+                const int subject = subjectOf[target];
+                if (subject / blockSize != currentSubjectBlock) {
+                    currentSubjectBlock = subject / blockSize;
+                    const QHash<int, Mat>::const_iterator state = block->states.constFind(currentSubjectBlock);
+                    cells = (state == block->states.constEnd()) ? NULL : const_cast<double*>(state->ptr<double>(row));
+                }
+                if (!cells) continue;
+
+                double *cell = cells + (subject % blockSize)*cellSize;
+                if (reduction == Max) {
+                    cell[0] = std::max(cell[0], double(value));
+                } else if (reduction == Mean) {
+                    cell[0] += value;
+                    cell[1]++;
+                } else if (value > cell[cellSize-1]) {
+                    // Keep the n best in descending order
+                    int k = cellSize-1;
+                    while ((k > 0) && (cell[k-1] < value)) {
+                        cell[k] = cell[k-1];
+                        k--;
+                    }
+                    cell[k] = value;
+                }
+            }
+        }
+    }
+};
+
+Output *Output::make(const File &file, const FileList &targetFiles, const FileList &queryFiles, int blockSize)
 {
     Output *output = NULL;
     FileList files = file.split();
     if (files.isEmpty()) files.append(File());
     foreach (const File &subfile, files) {
-        Output *newOutput = Factory<Output>::make(subfile);
-        newOutput->initialize(targetFiles, queryFiles);
+        Output *newOutput;
+        if (subfile.contains("subjects")) {
+            newOutput = SubjectOutput::make(subfile, targetFiles, queryFiles, blockSize);
+        } else {
+            newOutput = Factory<Output>::make(subfile);
+            newOutput->blockSize = blockSize;
+            newOutput->initialize(targetFiles, queryFiles);
+        }
         newOutput->next = QSharedPointer<Output>(output);
         output = newOutput;
     }
     return output;
 }
 
+/* Output - private methods */
+void Output::setTile(const cv::Mat &scores, int i, int j)
+{
+    for (int k=0; k<scores.rows; k++) {
+        const float *row = scores.ptr<float>(k);
+        for (int l=0; l<scores.cols; l++)
+            set(row[l], i+k, j+l);
+    }
+}
+
 /* MatrixOutput - public methods */
 void MatrixOutput::initialize(const FileList &targetFiles, const FileList &queryFiles)
 {
@@ -1141,6 +1535,11 @@ void MatrixOutput::set(float value, int i, int j)
     data.at<float>(i,j) = value;
 }
 
+void MatrixOutput::setTile(const cv::Mat &scores, int i, int j)
+{
+    scores.copyTo(data(Rect(j, i, scores.cols, scores.rows)));
+}
+
 BR_REGISTER(Output, MatrixOutput)
 
 /* Gallery - public methods */
@@ -1160,6 +1559,50 @@ FileList Gallery::files()
     return files;
 }
 
+TemplateList Gallery::readBlockAt(int block)
+{
+    (void) block;
+    qFatal("%s does not support random access.", qPrintable(file.flat()));
+    return TemplateList();
+}
+
+TemplateList Gallery::readAt(const QList<int> &indices)
+{
+    TemplateList templates;
+    templates.reserve(indices.size());
+
+    // Without random access the gallery is scanned once, keeping only the requested templates
+    if (blockCount() < 0) {
+        QHash<int, Template> requested;
+        foreach (int index, indices) requested.insert(index, Template());
+        bool done = false;
+        int count = 0;
+        while (!done)
+            foreach (const Template &t, readBlock(&done)) {
+                if (requested.contains(count)) requested[count] = t;
+                count++;
+            }
+        foreach (int index, indices) {
+            if ((index < 0) || (index >= count))
+                qFatal("Template %d out of range of %s.", index, qPrintable(file.flat()));
+            templates.append(requested[index]);
+        }
+        return templates;
+    }
+
+    // Each block holding a requested template is read once
+    QHash<int, TemplateList> blocks;
+    foreach (int index, indices) {
+        const int block = index / Globals->blockSize;
+        if (!blocks.contains(block)) blocks.insert(block, readBlockAt(block));
+        const TemplateList &templatesInBlock = blocks[block];
+        if (index % Globals->blockSize >= templatesInBlock.size())
+            qFatal("Template %d out of range of %s.", index, qPrintable(file.flat()));
+        templates.append(templatesInBlock[index % Globals->blockSize]);
+    }
+    return templates;
+}
+
 void Gallery::writeBlock(const TemplateList &templates)
 {
     foreach (const Template &t, templates) write(t);
@@ -1258,6 +1701,15 @@ static void _project(const Transform *transform, const Template *src, Template *
     }
 }
 
+// Projects element i of a template list for Common::ParallelFor
+struct ProjectElement
+{
+    const Transform *transform;
+    QVector<const Template*> src;
+    QVector<Template*> dst;
+    void operator()(int i) const { _project(transform, src[i], dst[i]); }
+};
+
 // Default project(TemplateList) calls project(Template) separately for each element
 void Transform::project(const TemplateList &src, TemplateList &dst) const
 {
@@ -1265,11 +1717,17 @@ void Transform::project(const TemplateList &src, TemplateList &dst) const
 
     for (int i=0; i<src.size(); i++)
         dst.append(Template());
-    QFutureSynchronizer<void> futures;
-    for (int i=0; i<dst.size(); i++)
-        if (Globals->parallelism > 1) futures.addFuture(QtConcurrent::run(_project, this, &src[i], &dst[i]));
-        else                          _project(this, &src[i], &dst[i]);
-    futures.waitForFinished();
+
+    // Elements are located up front so threads never touch the lists themselves
+    ProjectElement project;
+    project.transform = this;
+    project.src.reserve(src.size());
+    project.dst.reserve(dst.size());
+    for (int i=0; i<src.size(); i++) {
+        project.src.append(&src[i]);
+        project.dst.append(&dst[i]);
+    }
+    Common::ParallelFor(0, src.size(), project, Globals->parallelism);
 }
 
 QList<Transform *> Transform::getChildren() const
@@ -1339,36 +1797,388 @@ Distance *Distance::make(QString str, QObject *parent)
     return distance;
 }
 
+// Approximate size of the L2 cache, used to choose tile dimensions in Distance::compare
+static const int L2CacheBytes = 256*1024;
+static const int MaxTileSize = 128;
+
+static int tileSize(const TemplateList &templates)
+{
+    size_t bytes = 0;
+    foreach (const Template &t, templates)
+        if (!t.isEmpty()) {
+            bytes = t.bytes();
+            break;
+        }
+    if (bytes == 0) return MaxTileSize;
+    return std::max(1, std::min(MaxTileSize, int(L2CacheBytes / (2*bytes))));
+}
+
+// Copy a range of templates, packing their matrices into TemplateList::alignedData if they are uniform
+static TemplateList pack(const TemplateList &templates, int offset, int size)
+{
+    TemplateList packed(templates.mid(offset, size));
+
+    const Mat *reference = NULL;
+    int referenceIndex = 0;
+    size_t bytes = 0, stride = 0;
+    bool contiguous = true;
+    for (int i=0; i<packed.size(); i++) {
+        const Template &t = packed.at(i);
+        if (t.isEmpty()) {
+            contiguous = false;
+            continue;
+        }
+        if ((t.size() > 1) || !t.m().data || !t.m().isContinuous()) return packed;
+        const Mat &m = t.m();
+        if (reference == NULL) {
+            reference = &m;
+            referenceIndex = i;
+            bytes = m.total() * m.elemSize();
+            // Galleries that pad their templates record the padded size
+            stride = std::max(bytes, templates.stride);
+        } else {
+            if ((m.rows != reference->rows) || (m.cols != reference->cols) || (m.type() != reference->type())) return packed;
+            contiguous = contiguous && (m.data == reference->data + (i-referenceIndex) * stride);
+        }
+    }
+    if (reference == NULL) return packed;
+
+    // Templates from an aligned memGallery or an mmgGallery are already packed
+    packed.uniform = true;
+    if (contiguous) {
+        packed.stride = stride;
+        return packed;
+    }
+
+    // Otherwise pack them into aligned rows padded with zeros
+    const int rows = reference->rows, cols = reference->cols, type = reference->type();
+    packed.stride = OpenCVUtils::alignedStep(bytes);
+    uchar *data = OpenCVUtils::alignedBuffer(packed.alignedData, packed.stride * packed.size());
+    for (int i=0; i<packed.size(); i++) {
+        if (packed[i].isEmpty()) continue;
+        uchar *dst = data + i*packed.stride;
+        memcpy(dst, packed[i].m().data, bytes);
+        packed[i].m() = Mat(rows, cols, type, dst);
+    }
+    return packed;
+}
+
+// Returns the matrices of templates packed by pack() as a single matrix with one template per row
+static Mat packedMatrix(const TemplateList &packed)
+{
+    const Mat *reference = NULL;
+    int referenceIndex = 0;
+    for (int i=0; i<packed.size(); i++)
+        if (!packed[i].isEmpty()) {
+            reference = &packed[i].m();
+            referenceIndex = i;
+            break;
+        }
+
+    const uchar *data = reference->data - referenceIndex * packed.stride;
+    return Mat(packed.size(), reference->total() * reference->channels(), CV_MAKETYPE(reference->depth(), 1), const_cast<uchar*>(data), packed.stride);
+}
+
+// Returns true if pack() produced matrices of the same size and type for both template lists
+static bool packedCompatible(const TemplateList &a, const TemplateList &b)
+{
+    if (!a.uniform || !b.uniform) return false;
+    const Mat am = packedMatrix(a), bm = packedMatrix(b);
+    return (am.cols == bm.cols) && (am.type() == bm.type());
+}
+
+namespace br
+{
+
+// A tile compared on a thread bound to a NUMA node
+struct CompareTile : public QRunnable
+{
+    const Distance *distance;
+    const TemplateList *target, *query;
+    Output *output;
+    QRect tile;
+    int node;
+    QSemaphore *finished;
+
+    void run()
+    {
+        NUMA::bind(node);
+        distance->compareBlock(*target, *query, output, tile);
+        finished->release();
+    }
+};
+
+} // namespace br
+
+// Forwards the scores of a partition's targets and queries to their indices in the full comparison
+class PartitionOutput : public Output
+{
+    Output *output;
+    QList<int> targetIndices, queryIndices;
+
+public:
+    PartitionOutput(Output *output_, const QList<int> &targetIndices_, const QList<int> &queryIndices_)
+        : output(output_), targetIndices(targetIndices_), queryIndices(queryIndices_) {}
+
+    void setRelative(float value, int i, int j)
+    {
+        output->setRelative(value, queryIndices[i], targetIndices[j]);
+    }
+
+    void setRelativeTile(const Mat &scores, int i, int j)
+    {
+        // Forward runs of consecutive targets as a single tile
+        for (int k=0; k<scores.rows; k++)
+            for (int begin=0, end=1; begin<scores.cols; begin=end++) {
+                while ((end < scores.cols) && (targetIndices[j+end] == targetIndices[j+end-1]+1)) end++;
+                output->setRelativeTile(scores(Range(k, k+1), Range(begin, end)), queryIndices[i+k], targetIndices[j+begin]);
+            }
+    }
+
+private:
+    void set(float value, int i, int j)
+    {
+        (void) value; (void) i; (void) j;
+    }
+};
+
+// Normalizes a tile of scores, leaving the -FLT_MAX of empty and excluded pairs and any FLT_MAX as they are
+static void normalizeScores(const Distance *distance, Mat &scores)
+{
+    const Mat missing = (scores == -std::numeric_limits<float>::max());
+    const Mat saturated = (scores == std::numeric_limits<float>::max());
+    distance->normalizeTile(scores);
+    scores.setTo(-std::numeric_limits<float>::max(), missing);
+    scores.setTo(std::numeric_limits<float>::max(), saturated);
+}
+
+// Normalizes the tiles scored by a distance's normalizedDistance() before forwarding them
+class NormalizedOutput : public Output
+{
+    const Distance *distance;
+    Output *output;
+
+public:
+    NormalizedOutput(const Distance *distance_, Output *output_)
+        : distance(distance_), output(output_) {}
+
+    void setRelative(float value, int i, int j)
+    {
+        Mat score(1, 1, CV_32FC1, &value);
+        normalizeScores(distance, score);
+        output->setRelative(value, i, j);
+    }
+
+    void setRelativeTile(const Mat &scores, int i, int j)
+    {
+        Mat normalized = scores.clone();
+        normalizeScores(distance, normalized);
+        output->setRelativeTile(normalized, i, j);
+    }
+
+private:
+    void set(float value, int i, int j)
+    {
+        (void) value; (void) i; (void) j;
+    }
+};
+
+// Compares only the targets and queries sharing a partition, returns false if no pair would be skipped
+static bool comparePartitions(const Distance *distance, const TemplateList &target, const TemplateList &query, Output *output,
+                              const QList<int> &targetPartitions, const QList<int> &queryPartitions)
+{
+    QMap<int, QList<int> > partitionQueries;
+    for (int i=0; i<query.size(); i++)
+        partitionQueries[queryPartitions[i]].append(i);
+
+    bool skipped = false;
+    foreach (int targetPartition, targetPartitions)
+        if ((targetPartition != -1) && ((partitionQueries.size() > 1) || !partitionQueries.contains(targetPartition)))
+            skipped = true;
+    if (!skipped) return false;
+
+    QMapIterator<int, QList<int> > iterator(partitionQueries);
+    while (iterator.hasNext()) {
+        iterator.next();
+        const int partition = iterator.key();
+        const QList<int> &queryIndices = iterator.value();
+
+        // Targets in partition -1 are compared against every partition
+        TemplateList targets;
+        QList<int> targetIndices;
+        QList< QPair<int,int> > excludedRuns;
+        int longestRun = 0;
+        for (int j=0; j<target.size(); j++) {
+            if ((targetPartitions[j] == partition) || (targetPartitions[j] == -1)) {
+                targets.append(target[j]);
+                targetIndices.append(j);
+            } else {
+                if (!excludedRuns.isEmpty() && (excludedRuns.last().first + excludedRuns.last().second == j)) excludedRuns.last().second++;
+                else                                                                                            excludedRuns.append(QPair<int,int>(j, 1));
+                longestRun = std::max(longestRun, excludedRuns.last().second);
+            }
+        }
+
+        // Pairs across partitions are filled a run of targets at a time
+        if (longestRun > 0) {
+            const Mat excluded(1, longestRun, CV_32FC1, Scalar(-std::numeric_limits<float>::max()));
+            foreach (int i, queryIndices)
+                for (int k=0; k<excludedRuns.size(); k++)
+                    output->setRelativeTile(excluded.colRange(0, excludedRuns[k].second), i, excludedRuns[k].first);
+        }
+
+        if (targets.isEmpty()) continue;
+        TemplateList queries;
+        foreach (int i, queryIndices)
+            queries.append(query[i]);
+        PartitionOutput partitionOutput(output, targetIndices, queryIndices);
+        distance->compare(targets, queries, &partitionOutput);
+    }
+    return true;
+}
+
 void Distance::compare(const TemplateList &target, const TemplateList &query, Output *output) const
 {
-    const bool stepTarget = target.size() > query.size();
-    const int totalSize = std::max(target.size(), query.size());
-    int stepSize = ceil(float(totalSize) / float(std::max(1, abs(Globals->parallelism))));
-    QFutureSynchronizer<void> futures;
-    for (int i=0; i<totalSize; i+=stepSize) {
-        const TemplateList &targets(stepTarget ? TemplateList(target.mid(i, stepSize)) : target);
-        const TemplateList &queries(stepTarget ? query : TemplateList(query.mid(i, stepSize)));
-        const int targetOffset = stepTarget ? i : 0;
-        const int queryOffset = stepTarget ? 0 : i;
-        if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &Distance::compareBlock, targets, queries, output, targetOffset, queryOffset));
-        else                                                                           compareBlock (targets, queries, output, targetOffset, queryOffset);
+    // Score normalizations run their inner distance over the block and normalize whole tiles of its scores
+    if (const Distance *inner = normalizedDistance()) {
+        NormalizedOutput normalizedOutput(this, output);
+        inner->compare(target, query, &normalizedOutput);
+        return;
+    }
+
+    // Pairs across partitions can't match, so each partition is compared on its own
+    QList<int> targetPartitions, queryPartitions;
+    if (partition(target, targetPartitions) && partition(query, queryPartitions) &&
+        comparePartitions(this, target, query, output, targetPartitions, queryPartitions))
+        return;
+
+    // Divide the comparisons into tiles small enough for a tile of targets and queries to remain in cache
+    const int targetStep = tileSize(target);
+    const int queryStep = tileSize(query);
+
+    // Each node compares a contiguous share of the targets, packing its tiles into node local memory
+    const int nodes = Globals->parallelism ? std::min(NUMA::nodes(), target.size()) : 1;
+    if (nodes > 1) {
+        QSemaphore finished;
+        int tiles = 0;
+        for (int node=0; node<nodes; node++) {
+            const int begin = qint64(target.size()) * node / nodes, end = qint64(target.size()) * (node+1) / nodes;
+            for (int i=0; i<query.size(); i+=queryStep)
+                for (int j=begin; j<end; j+=targetStep) {
+                    CompareTile *compareTile = new CompareTile();
+                    compareTile->distance = this;
+                    compareTile->target = &target;
+                    compareTile->query = &query;
+                    compareTile->output = output;
+                    compareTile->tile = QRect(j, i, std::min(targetStep, end-j), std::min(queryStep, query.size()-i));
+                    compareTile->node = node;
+                    compareTile->finished = &finished;
+                    NUMA::pool(node)->start(compareTile);
+                    tiles++;
+                }
+        }
+        finished.acquire(tiles);
+        return;
     }
+
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<query.size(); i+=queryStep)
+        for (int j=0; j<target.size(); j+=targetStep) {
+            const QRect tile(j, i, std::min(targetStep, target.size()-j), std::min(queryStep, query.size()-i));
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &Distance::compareBlock, target, query, output, tile));
+            else                                                                           compareBlock (target, query, output, tile);
+        }
     futures.waitForFinished();
 }
 
 QList<float> Distance::compare(const TemplateList &targets, const Template &query) const
 {
+    if (const Distance *inner = normalizedDistance()) {
+        QVector<float> scores = inner->compare(targets, query).toVector();
+        Mat tile(1, scores.size(), CV_32FC1, scores.data());
+        if (!scores.isEmpty()) normalizeScores(this, tile);
+        return scores.toList();
+    }
+
     QList<float> scores; scores.reserve(targets.size());
-    foreach (const Template &target, targets)
-        scores.append(compare(target, query));
+
+    Mat excluded;
+    const bool filtered = exclude(targets, TemplateList() << query, excluded);
+
+    const TemplateList packedTargets = pack(targets, 0, targets.size());
+    const TemplateList packedQuery = pack(TemplateList() << query, 0, 1);
+    if (!query.isEmpty() && packedCompatible(packedTargets, packedQuery)) {
+        QVector<float> buffer(targets.size());
+        if (compare(packedMatrix(packedTargets), packedMatrix(packedQuery), buffer.data())) {
+            for (int i=0; i<targets.size(); i++)
+                scores.append((targets[i].isEmpty() || (filtered && excluded.at<uchar>(0, i))) ? -std::numeric_limits<float>::max() : buffer[i]);
+            return scores;
+        }
+    }
+
+    for (int i=0; i<targets.size(); i++)
+        scores.append((filtered && excluded.at<uchar>(0, i)) ? -std::numeric_limits<float>::max() : compare(targets[i], query));
     return scores;
 }
 
+bool Distance::compare(const Mat &targets, const Mat &query, float *scores) const
+{
+    (void) targets; (void) query; (void) scores;
+    return false;
+}
+
+bool Distance::compare(const Mat &targets, const Mat &queries, Mat &scores) const
+{
+    (void) targets; (void) queries; (void) scores;
+    return false;
+}
+
+bool Distance::exclude(const TemplateList &targets, const TemplateList &queries, Mat &excluded) const
+{
+    (void) targets; (void) queries; (void) excluded;
+    return false;
+}
+
+bool Distance::partition(const TemplateList &templates, QList<int> &partitions) const
+{
+    (void) templates; (void) partitions;
+    return false;
+}
+
 /* Distance - private methods */
-void Distance::compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+void Distance::compareBlock(const TemplateList &target, const TemplateList &query, Output *output, const QRect &tile) const
 {
-    for (int i=0; i<query.size(); i++)
-        for (int j=0; j<target.size(); j++)
-            if (target[j].isEmpty() || query[i].isEmpty()) output->setRelative(-std::numeric_limits<float>::max(),i+queryOffset, j+targetOffset);
-            else output->setRelative(compare(target[j], query[i]), i+queryOffset, j+targetOffset);
+    const TemplateList targets = pack(target, tile.x(), tile.width());
+    const TemplateList queries = pack(query, tile.y(), tile.height());
+
+    const bool batch = packedCompatible(targets, queries);
+    Mat targetMatrix, queryMatrix;
+    if (batch) {
+        targetMatrix = packedMatrix(targets);
+        queryMatrix = packedMatrix(queries);
+    }
+
+    // Pairs a metadata filter rejects are never compared
+    Mat excluded;
+    const bool filtered = exclude(targets, queries, excluded);
+
+    Mat scores(queries.size(), targets.size(), CV_32FC1);
+    const bool tiled = batch && compare(targetMatrix, queryMatrix, scores);
+    for (int i=0; i<queries.size(); i++) {
+        float *row = scores.ptr<float>(i);
+        const uchar *skip = filtered ? excluded.ptr<uchar>(i) : NULL;
+        if (queries[i].isEmpty()) {
+            for (int j=0; j<targets.size(); j++)
+                row[j] = -std::numeric_limits<float>::max();
+        } else if (tiled || (batch && compare(targetMatrix, queryMatrix.row(i), row))) {
+            for (int j=0; j<targets.size(); j++)
+                if (targets[j].isEmpty() || (skip && skip[j])) row[j] = -std::numeric_limits<float>::max();
+        } else {
+            for (int j=0; j<targets.size(); j++)
+                if (targets[j].isEmpty() || (skip && skip[j])) row[j] = -std::numeric_limits<float>::max();
+                else                                           row[j] = compare(targets[j], queries[i]);
+        }
+    }
+
+    output->setRelativeTile(scores, tile.y(), tile.x());
 }
@@ -30,6 +30,7 @@
 #include <QMap>
 #include <QPoint>
 #include <QPointF>
+#include <QRect>
 #include <QRectF>
 #include <QScopedPointer>
 #include <QSharedPointer>
@@ -312,7 +313,7 @@ struct BR_EXPORT File
     void appendPoint(const QPointF &point); /*!< \brief Adds a point to the file's point list. */
     void appendPoints(const QList<QPointF> &points); /*!< \brief Adds landmarks to the file's landmark list. */
     inline void clearPoints() { m_metadata["Points"] = QList<QVariant>(); } /*!< \brief Clears the file's landmark list. */
-    inline void setPoints(const QList<QPointF> &points) { clearPoints(); appendPoints(points); } /*!< \brief Overwrites the file's landmark list. */
+    void setPoints(const QList<QPointF> &points); /*!< \brief Overwrites the file's landmark list. */
 
     QList<QRectF> namedRects() const; /*!< \brief Returns rects convertible from metadata values. */
     QList<QRectF> rects() const; /*!< \brief Returns the file's rects list. */
@@ -321,8 +322,8 @@ struct BR_EXPORT File
     void appendRects(const QList<QRectF> &rects); /*!< \brief Adds rects to the file's rect list. */
     void appendRects(const QList<cv::Rect> &rects); /*!< \brief Adds rects to the file's rect list. */
     inline void clearRects() { m_metadata["Rects"] = QList<QVariant>(); } /*!< \brief Clears the file's rect list. */
-    inline void setRects(const QList<QRectF> &rects) { clearRects(); appendRects(rects); } /*!< \brief Overwrites the file's rect list. */
-    inline void setRects(const QList<cv::Rect> &rects) { clearRects(); appendRects(rects); } /*!< \brief Overwrites the file's rect list. */
+    void setRects(const QList<QRectF> &rects); /*!< \brief Overwrites the file's rect list. */
+    void setRects(const QList<cv::Rect> &rects); /*!< \brief Overwrites the file's rect list. */
 
 private:
     QMap<QString,QVariant> m_metadata;
@@ -445,10 +446,11 @@ struct TemplateList : public QList<Template>
 {
     bool uniform; /*!< \brief Reserved for internal use. True if all templates are aligned and of the same size and type. */
     QVector<uchar> alignedData; /*!< \brief Reserved for internal use. */
+    size_t stride; /*!< \brief Reserved for internal use. Bytes between the matrices of consecutive uniform templates. */
 
-    TemplateList() : uniform(false) {}
-    TemplateList(const QList<Template> &templates) : uniform(false) { append(templates); } /*!< \brief Initialize the template list from another template list. */
-    TemplateList(const QList<File> &files) : uniform(false) { foreach (const File &file, files) append(file); } /*!< \brief Initialize the template list from a file list. */
+    TemplateList() : uniform(false), stride(0) {}
+    TemplateList(const QList<Template> &templates) : uniform(false), stride(0) { append(templates); } /*!< \brief Initialize the template list from another template list. */
+    TemplateList(const QList<File> &files) : uniform(false), stride(0) { foreach (const File &file, files) append(file); } /*!< \brief Initialize the template list from a file list. */
     BR_EXPORT static TemplateList fromGallery(const File &gallery); /*!< \brief Create a template list from a br::Gallery. */
 
     /*!< \brief Create a template list from a memory buffer of individual templates. Compatible with '.gal' galleries. */
@@ -516,6 +518,19 @@ struct TemplateList : public QList<Template>
         return partitions;
     }
 
+    /*!
+     * \brief Returns the matrices at \em index stacked by row, as OpenCVUtils::toMatByRow.
+     *
+     * Matrices already laid out at a constant row pitch in one buffer, such as the templates of an aligned memGallery,
+     * are returned as a header over that buffer instead of being copied.
+     */
+    BR_EXPORT cv::Mat matrix(int index = 0) const;
+
+    /*!
+     * \brief Returns a template for each file holding the corresponding row of \em m, sharing its data.
+     */
+    BR_EXPORT static TemplateList fromMatrix(const cv::Mat &m, const FileList &files);
+
     /*!
      * \brief Returns #br::Template::file for each template in the list.
      */
@@ -614,7 +629,6 @@ private:
 class BR_EXPORT Context : public Object
 {
     Q_OBJECT
-    QFile logFile;
 
 public:
     /*!
@@ -631,6 +645,8 @@ public:
 
     /*!
      * \brief Optional log file to copy <tt>stderr</tt> to.
+     *
+     * Messages are queued and written by a background thread that flushes every quarter second, fatal messages are flushed before aborting.
      */
     Q_PROPERTY(QString log READ get_log WRITE set_log RESET reset_log)
     BR_PROPERTY(QString, log, "")
@@ -660,6 +676,73 @@ public:
     Q_PROPERTY(int blockSize READ get_blockSize WRITE set_blockSize RESET reset_blockSize)
     BR_PROPERTY(int, blockSize, parallelism * ((sizeof(void*) == 4) ? 128 : 1024))
 
+    /*!
+     * \brief Let br::Compare choose its block size from the template footprint and br::Context::compareMemory, \c true by default.
+     *
+     * Galleries are still read in blocks of br::Context::blockSize, which are regrouped or split into the blocks compared and given to outputs.
+     */
+    Q_PROPERTY(bool adaptiveBlockSize READ get_adaptiveBlockSize WRITE set_adaptiveBlockSize RESET reset_adaptiveBlockSize)
+    BR_PROPERTY(bool, adaptiveBlockSize, true)
+
+    /*!
+     * \brief Split comparisons across NUMA nodes, each comparing its share of the targets on threads bound to its CPUs, \c false by default.
+     *
+     * Linux only. Targets packed for comparison are then copied into memory local to the node comparing them.
+     */
+    Q_PROPERTY(bool numa READ get_numa WRITE set_numa RESET reset_numa)
+    BR_PROPERTY(bool, numa, false)
+
+    /*!
+     * \brief Megabytes of templates br::Compare may keep in memory to avoid re-reading a gallery for every block.
+     */
+    Q_PROPERTY(int compareMemory READ get_compareMemory WRITE set_compareMemory RESET reset_compareMemory)
+    BR_PROPERTY(int, compareMemory, (sizeof(void*) == 4) ? 256 : 2048)
+
+    /*!
+     * \brief Megabytes that sub-transforms training concurrently may use, \c 0 for no limit beyond br::Context::parallelism.
+     */
+    Q_PROPERTY(int trainingMemory READ get_trainingMemory WRITE set_trainingMemory RESET reset_trainingMemory)
+    BR_PROPERTY(int, trainingMemory, 0)
+
+    /*!
+     * \brief Project training templates through untrainable pipeline stages a block at a time,
+     *        spilling them to a temporary gallery beyond br::Context::trainingMemory megabytes.
+     */
+    Q_PROPERTY(bool outOfCoreTraining READ get_outOfCoreTraining WRITE set_outOfCoreTraining RESET reset_outOfCoreTraining)
+    BR_PROPERTY(bool, outOfCoreTraining, false)
+
+    /*!
+     * \brief Optional folder for per-stage training checkpoints, letting an interrupted training resume
+     *        from the last trainable pipeline stage it completed on the same inputs.
+     */
+    Q_PROPERTY(QString checkpointPath READ get_checkpointPath WRITE set_checkpointPath RESET reset_checkpointPath)
+    BR_PROPERTY(QString, checkpointPath, "")
+
+    /*!
+     * \brief Optional folder caching each template projected through the leading untrainable stages of a pipeline,
+     *        keyed by the input file and the description of those stages, so runs sharing the stages reuse their results.
+     */
+    Q_PROPERTY(QString prefixCachePath READ get_prefixCachePath WRITE set_prefixCachePath RESET reset_prefixCachePath)
+    BR_PROPERTY(QString, prefixCachePath, "")
+
+    /*!
+     * \brief Optional file to write a Chrome trace of pipeline stage timings to, with a CSV summary alongside.
+     */
+    Q_PROPERTY(QString profile READ get_profile WRITE set_profile RESET reset_profile)
+    BR_PROPERTY(QString, profile, "")
+
+    /*!
+     * \brief If \c true report the peak memory held by each pipeline stage, gallery and output at the end of train, enroll and compare, \c false by default.
+     */
+    Q_PROPERTY(bool trackMemory READ get_trackMemory WRITE set_trackMemory RESET reset_trackMemory)
+    BR_PROPERTY(bool, trackMemory, false)
+
+    /*!
+     * \brief Number of nearest neighbors kept per template for rank-order clustering, \c 20 by default.
+     */
+    Q_PROPERTY(int clusterNeighbors READ get_clusterNeighbors WRITE set_clusterNeighbors RESET reset_clusterNeighbors)
+    BR_PROPERTY(int, clusterNeighbors, 20)
+
     /*!
      * \brief If \c true no messages will be sent to the terminal, \c false by default.
      */
@@ -679,13 +762,13 @@ public:
     BR_PROPERTY(QString, mostRecentMessage, "")
 
     /*!
-     * \brief Used internally to compute progress() and timeRemaining().
+     * \brief Used internally to compute progress() and timeRemaining(), mirrors the outermost progress scope of the running job.
      */
     Q_PROPERTY(double currentStep READ get_currentStep WRITE set_currentStep RESET reset_currentStep)
     BR_PROPERTY(double, currentStep, 0)
 
     /*!
-     * \brief Used internally to compute progress() and timeRemaining().
+     * \brief Used internally to compute progress() and timeRemaining(), mirrors the outermost progress scope of the running job.
      */
     Q_PROPERTY(double totalSteps READ get_totalSteps WRITE set_totalSteps RESET reset_totalSteps)
     BR_PROPERTY(double, totalSteps, 0)
@@ -737,7 +820,20 @@ public:
      * \return \c true if \em name is a property, \c false otherwise.
      * \see set
      */
-    bool contains(const QString &name);
+    bool contains(const QString &name) const;
+
+    /*!
+     * \brief Returns the index of property \em name in the Context meta-object, or \c -1 if it is not a property.
+     *
+     * Indices are looked up in a table built once, avoiding a linear search of property names per call.
+     */
+    int propertyIndex(const QString &name) const;
+
+    /*!
+     * \brief Returns the value of property \em name, or an invalid QVariant if it is not set.
+     * \see contains
+     */
+    QVariant value(const QString &name) const;
 
     /*!
      * \brief Prints current progress statistics to \em stdout.
@@ -963,6 +1059,15 @@ public:
     virtual ~Initializer() {}
     virtual void initialize() const = 0;  /*!< \brief Called once at the end of br::Context::initialize(). */
     virtual void finalize() const {}  /*!< \brief Called once at the beginning of br::Context::finalize(). */
+    virtual void prepare() const {} /*!< \brief Called once by the first require() of this initializer, for setup only its plugins need. */
+    virtual void release() const {} /*!< \brief Called once after every finalize() if prepare() was called, in reverse order of preparation. */
+
+    /*!
+     * \brief Calls prepare() of the initializer registered as \em name unless it already has been.
+     *
+     * Plugins call this before first using an SDK, so startup does not pay for SDKs an invocation never uses.
+     */
+    static void require(const QString &name);
 };
 
 /*!
@@ -976,6 +1081,8 @@ public:
  *
  * An \em output is a br::File representing the result comparing templates.
  * br::File::suffix() is used to determine which plugin should handle the output.
+ * An output with a \c subjects=Max|Mean|TopMean parameter keeps one score per query and subject (template \c Label) instead,
+ * reducing the scores against the subject's templates as blocks are compared; \c TopMean averages the best \c topN (default \c 3).
  * \note Handle serialization to disk in the derived class destructor.
  */
 class BR_EXPORT Output : public Object
@@ -986,18 +1093,22 @@ public:
     FileList targetFiles; /*!< \brief List of files representing the gallery templates. */
     FileList queryFiles; /*!< \brief List of files representing the probe templates. */
     bool selfSimilar; /*!< \brief \c true if the \em targetFiles == \em queryFiles, \c false otherwise. */
+    int blockSize; /*!< \brief Rows and columns in a block given to setBlock(), br::Context::blockSize unless chosen by make(). */
 
+    Output() : blockSize(0) {}
     virtual ~Output() {}
     virtual void initialize(const FileList &targetFiles, const FileList &queryFiles); /*!< \brief Initializes class data members. */
     virtual void setBlock(int rowBlock, int columnBlock); /*!< \brief Set the current block. */
     virtual void setRelative(float value, int i, int j); /*!< \brief Set a score relative to the current block. */
+    virtual void setRelativeTile(const cv::Mat &scores, int i, int j); /*!< \brief Set a tile of \c CV_32FC1 scores whose top left corner is at (\em i, \em j) relative to the current block. */
 
-    static Output *make(const File &file, const FileList &targetFiles, const FileList &queryFiles); /*!< \brief Make an output from a file and gallery/probe file lists. */
+    static Output *make(const File &file, const FileList &targetFiles, const FileList &queryFiles, int blockSize = 0); /*!< \brief Make an output from a file and gallery/probe file lists, with blocks of \em blockSize or br::Context::blockSize if \c 0. */
 
 private:
     QSharedPointer<Output> next;
     QPoint offset;
     virtual void set(float value, int i, int j) = 0;
+    virtual void setTile(const cv::Mat &scores, int i, int j);
 };
 
 /*!
@@ -1022,6 +1133,7 @@ protected:
 private:
     void initialize(const FileList &targetFiles, const FileList &queryFiles);
     void set(float value, int i, int j);
+    void setTile(const cv::Mat &scores, int i, int j);
 };
 
 /*!
@@ -1066,8 +1178,11 @@ class BR_EXPORT Gallery : public Object
 public:
     virtual ~Gallery() {}
     TemplateList read(); /*!< \brief Retrieve all the stored templates. */
-    FileList files(); /*!< \brief Retrieve all the stored template files. */
+    virtual FileList files(); /*!< \brief Retrieve all the stored template files. */
     virtual TemplateList readBlock(bool *done) = 0; /*!< \brief Retrieve a portion of the stored templates. */
+    virtual int blockCount() { return -1; } /*!< \brief Number of blocks available to readBlockAt(), or -1 if the gallery can only be read sequentially. */
+    virtual TemplateList readBlockAt(int block); /*!< \brief Retrieve block \c block of br::Globals->blockSize templates, safe to call from several threads when blockCount() is not -1. */
+    virtual TemplateList readAt(const QList<int> &indices); /*!< \brief Retrieve the templates at \em indices into files(), safe to call from several threads when blockCount() is not -1, otherwise read with one sequential pass of readBlock(). */
     void writeBlock(const TemplateList &templates); /*!< \brief Serialize a template list. */
     virtual void write(const Template &t) = 0; /*!< \brief Serialize a template. */
     static Gallery *make(const File &file); /*!< \brief Make a gallery to/from a file on disk. */
@@ -1306,11 +1421,79 @@ public:
     virtual QList<float> compare(const TemplateList &targets, const Template &query) const; /*!< \brief Compute the normalized distance between a template and a template list. */
     virtual float compare(const Template &a, const Template &b) const = 0; /*!< \brief Compute the distance between two templates. */
 
+    /*!
+     * \brief Compute the distance between a query and a block of targets.
+     *
+     * \em targets is a single channel matrix with one flattened target template per row,
+     * \em query is a single row of the same type and width,
+     * and \em scores receives one result per target.
+     * Rows of \em targets are \c targets.step bytes apart, zero padded to a multiple of 64 bytes when laid out by memGallery
+     * or by the packing of non-contiguous templates; implementations relying on the padding must check it, callers may pass submatrices.
+     * Used by compare(const TemplateList&, const TemplateList&, Output*) for uniform single-matrix templates.
+     * \return \c false if the distance does not provide a batch implementation, in which case compare(const Template&, const Template&) is used instead.
+     */
+    virtual bool compare(const cv::Mat &targets, const cv::Mat &query, float *scores) const;
+
+    /*!
+     * \brief Compute the distances between a tile of queries and a tile of targets at once.
+     *
+     * \em targets and \em queries are laid out as in compare(const cv::Mat&, const cv::Mat&, float*) with one query per row of \em queries,
+     * and \em scores is a \c CV_32FC1 matrix with one row per query and one column per target.
+     * Lets a distance reduce the tile to matrix products instead of a pass over the targets per query.
+     * \return \c false if the distance does not provide a tile implementation, in which case each query is compared on its own.
+     */
+    virtual bool compare(const cv::Mat &targets, const cv::Mat &queries, cv::Mat &scores) const;
+
+    /*!
+     * \brief Marks the pairs compare() would score \c -FLT_MAX from template metadata alone, so their matrices are never compared.
+     *
+     * Called once per block of comparisons, letting filters index the target metadata once for every query in the block.
+     * \param targets The target templates.
+     * \param queries The query templates.
+     * \param excluded Set to a \em queries x \em targets \c CV_8UC1 matrix, non-zero where the pair is excluded.
+     * \return \c false if the distance does not filter on metadata, the default.
+     */
+    virtual bool exclude(const TemplateList &targets, const TemplateList &queries, cv::Mat &excluded) const;
+
+    /*!
+     * \brief Assigns each template to a partition, only pairs sharing a partition are compared.
+     *
+     * Lets compare() skip the blocks of pairs across partitions.
+     * Targets in partition \c -1 are compared against every partition.
+     * \param templates The templates to assign.
+     * \param partitions Set to the partition of each template.
+     * \return \c false if the distance does not partition templates, the default.
+     */
+    virtual bool partition(const TemplateList &templates, QList<int> &partitions) const;
+
+    /*!
+     * \brief Returns \c true if comparing \em a to \em b always scores the same as comparing \em b to \em a.
+     *
+     * Self-comparisons of symmetric distances compare only the blocks on and above the diagonal and mirror them into the output.
+     */
+    virtual bool symmetric() const { return false; }
+
+    /*!
+     * \brief The distance whose scores this distance normalizes, or \c NULL if it is not a score normalization.
+     *
+     * compare(const TemplateList&, const TemplateList&, Output*) then runs the returned distance over the block
+     * and normalizeTile() over each tile of scores it produces, instead of normalizing one pair at a time.
+     */
+    virtual const Distance *normalizedDistance() const { return NULL; }
+
+    /*!
+     * \brief Normalizes a \c CV_32FC1 tile of scores from normalizedDistance() in place.
+     *
+     * Scores of \c -FLT_MAX, which mark empty and excluded pairs, and of \c FLT_MAX are restored afterwards, so they pass through unchanged.
+     */
+    virtual void normalizeTile(cv::Mat &scores) const { (void) scores; }
+
 protected:
     inline Distance *make(const QString &description) { return make(description, this); } /*!< \brief Make a subdistance. */
 
 private:
-    virtual void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const;
+    friend struct CompareTile;
+    virtual void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, const QRect &tile) const;
 };
 
 /*!
@@ -1334,6 +1517,9 @@ BR_EXPORT void Train(const File &input, const File &model);
 BR_EXPORT FileList Enroll(const File &input, const File &gallery = File());
 /*!
  * \brief High-level function for enrolling templates.
+ *
+ * Looks the algorithm up on every call, services enrolling repeatedly can instead hold the handle returned by
+ * <tt>Transform::fromAlgorithm(algorithm, false)</tt> and project through it, which never touches the registry again.
  * \see br_enroll
  */
 BR_EXPORT void Enroll(TemplateList &tmpl);
@@ -1355,6 +1541,21 @@ BR_EXPORT void CompareTemplateLists(const TemplateList &target, const TemplateLi
  */
 BR_EXPORT void PairwiseCompare(const File &targetGallery, const File &queryGallery, const File &output);
 
+/*!
+ * \brief High-level function for clustering the duplicate templates of a gallery.
+ *
+ * Compares only the blocks on and above the diagonal of the self-similarity matrix, keeping the pairs scoring at least \em threshold,
+ * and merges them transitively into clusters of gallery indices.
+ * \see br_deduplicate
+ */
+BR_EXPORT QVector< QList<int> > Deduplicate(const File &gallery, float threshold, const QString &csv = QString());
+
+/*!
+ * \brief High-level function for measuring enrollment throughput.
+ * \see br_benchmark
+ */
+BR_EXPORT void Benchmark(const File &input, const File &output);
+
 /*!
  * \brief Change file formats.
  * \param fileType One of \c Format, \c Gallery, or \c Output.
@@ -14,6 +14,11 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
+#include <QtConcurrentRun>
+#include <algorithm>
+#include <cmath>
+#include <functional>
 #include <opencv2/objdetect/objdetect.hpp>
 #include "openbr_internal.h"
 #include "openbr/core/opencvutils.h"
@@ -52,6 +57,13 @@ private:
 /*!
  * \ingroup transforms
  * \brief Wraps OpenCV cascade classifier
+ *
+ * \em scaleFactor is the pyramid step and \em maxSize bounds the detection size (0 for no bound).
+ * With \em bands greater than one the range of detection sizes is split into that many bands
+ * searched concurrently, each with its own classifier, which reduces latency on single large images.
+ * If the template's metadata holds a list of rects under \em searchRegions, for example from \c SubtractBackground or \c TrackRegions,
+ * only those parts of the image, grown by \em searchMargin of their size on each side, are searched.
+ * Templates without the key are searched in full.
  * \author Josh Klontz \cite jklontz
  */
 class CascadeTransform : public UntrainableMetaTransform
@@ -59,13 +71,32 @@ class CascadeTransform : public UntrainableMetaTransform
     Q_OBJECT
     Q_PROPERTY(QString model READ get_model WRITE set_model RESET reset_model STORED false)
     Q_PROPERTY(int minSize READ get_minSize WRITE set_minSize RESET reset_minSize STORED false)
+    Q_PROPERTY(int maxSize READ get_maxSize WRITE set_maxSize RESET reset_maxSize STORED false)
+    Q_PROPERTY(float scaleFactor READ get_scaleFactor WRITE set_scaleFactor RESET reset_scaleFactor STORED false)
+    Q_PROPERTY(int minNeighbors READ get_minNeighbors WRITE set_minNeighbors RESET reset_minNeighbors STORED false)
+    Q_PROPERTY(int bands READ get_bands WRITE set_bands RESET reset_bands STORED false)
     Q_PROPERTY(bool ROCMode READ get_ROCMode WRITE set_ROCMode RESET reset_ROCMode STORED false)
     BR_PROPERTY(QString, model, "FrontalFace")
     BR_PROPERTY(int, minSize, 64)
+    BR_PROPERTY(int, maxSize, 0)
+    BR_PROPERTY(float, scaleFactor, 1.2)
+    BR_PROPERTY(int, minNeighbors, 5)
+    BR_PROPERTY(int, bands, 1)
     BR_PROPERTY(bool, ROCMode, false)
+    Q_PROPERTY(QString searchRegions READ get_searchRegions WRITE set_searchRegions RESET reset_searchRegions STORED false)
+    Q_PROPERTY(float searchMargin READ get_searchMargin WRITE set_searchMargin RESET reset_searchMargin STORED false)
+    BR_PROPERTY(QString, searchRegions, "SearchRegions")
+    BR_PROPERTY(float, searchMargin, 0)
 
     Resource<CascadeClassifier> cascadeResource;
 
+    struct Detections
+    {
+        vector<Rect> rects;
+        vector<int> rejectLevels;
+        vector<double> levelWeights;
+    };
+
     void init()
     {
         cascadeResource.setResourceMaker(new CascadeResourceMaker(model));
@@ -78,19 +109,115 @@ class CascadeTransform : public UntrainableMetaTransform
         if (!temp.isEmpty()) dst = temp.first();
     }
 
-    void project(const TemplateList &src, TemplateList &dst) const
+    void detect(CascadeClassifier *cascade, const Mat &m, bool enrollAll, int minObject, int maxObject, Detections *detections) const
+    {
+        const Size maxObjectSize = maxObject > 0 ? Size(maxObject, maxObject) : Size();
+        if (ROCMode) cascade->detectMultiScale(m, detections->rects, detections->rejectLevels, detections->levelWeights, scaleFactor, minNeighbors, (enrollAll ? 0 : CV_HAAR_FIND_BIGGEST_OBJECT) | CV_HAAR_SCALE_IMAGE, Size(minObject, minObject), maxObjectSize, true);
+        else         cascade->detectMultiScale(m, detections->rects, scaleFactor, minNeighbors, enrollAll ? 0 : CV_HAAR_FIND_BIGGEST_OBJECT, Size(minObject, minObject), maxObjectSize);
+    }
+
+    void detectBand(const Mat *m, bool enrollAll, int minObject, int maxObject, Detections *detections) const
     {
         CascadeClassifier *cascade = cascadeResource.acquire();
+        detect(cascade, *m, enrollAll, minObject, maxObject, detections);
+        cascadeResource.release(cascade);
+    }
+
+    static float overlap(const Rect &a, const Rect &b)
+    {
+        const float intersection = (a & b).area();
+        return intersection / (a.area() + b.area() - intersection);
+    }
+
+    // Search bands of detection sizes concurrently and merge the results
+    void detectBands(const Mat &m, bool enrollAll, Detections *detections) const
+    {
+        const int largest = maxSize > 0 ? std::min(maxSize, std::min(m.rows, m.cols)) : std::min(m.rows, m.cols);
+        if (largest <= minSize) return;
+
+        QVector<Detections> bandDetections(bands);
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<bands; i++) {
+            // Geometric bands, each extended by one pyramid step so objects on a boundary are found by one of them
+            const int minObject = qRound(minSize * std::pow(float(largest) / minSize, float(i) / bands));
+            const int maxObject = qRound(minSize * std::pow(float(largest) / minSize, float(i+1) / bands) * scaleFactor);
+            futures.addFuture(QtConcurrent::run(this, &CascadeTransform::detectBand, &m, enrollAll, minObject, maxObject, &bandDetections[i]));
+        }
+        futures.waitForFinished();
+
+        // Keep the largest of any overlapping detections from adjacent bands
+        typedef QPair<int, QPair<int,int> > Candidate; // (area, (band, index))
+        QList<Candidate> candidates;
+        for (int i=0; i<bands; i++)
+            for (size_t j=0; j<bandDetections[i].rects.size(); j++)
+                candidates.append(qMakePair(bandDetections[i].rects[j].area(), qMakePair(i, int(j))));
+        std::sort(candidates.begin(), candidates.end(), std::greater<Candidate>());
+
+        foreach (const Candidate &candidate, candidates) {
+            const Detections &band = bandDetections[candidate.second.first];
+            const int j = candidate.second.second;
+            bool suppressed = false;
+            for (size_t k=0; k<detections->rects.size() && !suppressed; k++)
+                suppressed = overlap(band.rects[j], detections->rects[k]) > 0.5;
+            if (suppressed) continue;
+
+            detections->rects.push_back(band.rects[j]);
+            if (band.rejectLevels.size() > size_t(j)) {
+                detections->rejectLevels.push_back(band.rejectLevels[j]);
+                detections->levelWeights.push_back(band.levelWeights[j]);
+            }
+            if (!enrollAll) break;
+        }
+    }
+
+    // Search each region separately, offsetting detections to image coordinates
+    void detectRegions(CascadeClassifier *cascade, const Mat &m, bool enrollAll, const QList<QRectF> &regions, Detections *detections) const
+    {
+        foreach (const Rect &roi, OpenCVUtils::searchRegions(regions, m.size(), searchMargin, minSize)) {
+            Detections regionDetections;
+            if (cascade) detect(cascade, m(roi), enrollAll, minSize, maxSize, &regionDetections);
+            else         detectBands(m(roi), enrollAll, &regionDetections);
+            for (size_t j=0; j<regionDetections.rects.size(); j++) {
+                detections->rects.push_back(regionDetections.rects[j] + roi.tl());
+                if (regionDetections.rejectLevels.size() > j) {
+                    detections->rejectLevels.push_back(regionDetections.rejectLevels[j]);
+                    detections->levelWeights.push_back(regionDetections.levelWeights[j]);
+                }
+            }
+        }
+
+        // Only the biggest object of the image is wanted
+        if (!enrollAll && (detections->rects.size() > 1)) {
+            size_t biggest = 0;
+            for (size_t j=1; j<detections->rects.size(); j++)
+                if (detections->rects[j].area() > detections->rects[biggest].area()) biggest = j;
+            Detections single;
+            single.rects.push_back(detections->rects[biggest]);
+            if (detections->rejectLevels.size() > biggest) {
+                single.rejectLevels.push_back(detections->rejectLevels[biggest]);
+                single.levelWeights.push_back(detections->levelWeights[biggest]);
+            }
+            *detections = single;
+        }
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        CascadeClassifier *cascade = bands > 1 ? NULL : cascadeResource.acquire();
         foreach (const Template &t, src) {
             const bool enrollAll = t.file.getBool("enrollAll");
+            const bool restricted = !searchRegions.isEmpty() && t.file.contains(searchRegions);
+            const QList<QRectF> regions = restricted ? t.file.getList<QRectF>(searchRegions, QList<QRectF>()) : QList<QRectF>();
 
             for (int i=0; i<t.size(); i++) {
                 const Mat &m = t[i];
-                vector<Rect> rects;
-                vector<int> rejectLevels;
-                vector<double> levelWeights;
-                if (ROCMode) cascade->detectMultiScale(m, rects, rejectLevels, levelWeights, 1.2, 5, (enrollAll ? 0 : CV_HAAR_FIND_BIGGEST_OBJECT) | CV_HAAR_SCALE_IMAGE, Size(minSize, minSize), Size(), true);
-                else         cascade->detectMultiScale(m, rects, 1.2, 5, enrollAll ? 0 : CV_HAAR_FIND_BIGGEST_OBJECT, Size(minSize, minSize));
+                Detections detections;
+                if (restricted)   detectRegions(cascade, m, enrollAll, regions, &detections);
+                else if (cascade) detect(cascade, m, enrollAll, minSize, maxSize, &detections);
+                else              detectBands(m, enrollAll, &detections);
+                vector<Rect> &rects = detections.rects;
+                const vector<int> &rejectLevels = detections.rejectLevels;
+                const vector<double> &levelWeights = detections.levelWeights;
 
                 if (!enrollAll && rects.empty())
                     rects.push_back(Rect(0, 0, m.cols, m.rows));
@@ -109,7 +236,7 @@ class CascadeTransform : public UntrainableMetaTransform
             }
         }
 
-        cascadeResource.release(cascade);
+        if (cascade) cascadeResource.release(cascade);
     }
 
     // TODO: Remove this code when ready to break binary compatibility
@@ -14,9 +14,13 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
+#include <QTemporaryFile>
+#include <QtConcurrentRun>
 #include <opencv2/flann/flann.hpp>
 
 #include "openbr_internal.h"
+#include "openbr/core/cluster.h"
 #include "openbr/core/common.h"
 #include "openbr/core/opencvutils.h"
 
@@ -28,6 +32,8 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Wraps OpenCV kmeans and flann.
+ *
+ * Set \em miniBatch to train with parallel mini-batch k-means instead, for large training sets.
  * \author Josh Klontz \cite jklontz
  */
 class KMeansTransform : public Transform
@@ -35,8 +41,14 @@ class KMeansTransform : public Transform
     Q_OBJECT
     Q_PROPERTY(int kTrain READ get_kTrain WRITE set_kTrain RESET reset_kTrain STORED false)
     Q_PROPERTY(int kSearch READ get_kSearch WRITE set_kSearch RESET reset_kSearch STORED false)
+    Q_PROPERTY(bool miniBatch READ get_miniBatch WRITE set_miniBatch RESET reset_miniBatch STORED false)
+    Q_PROPERTY(int batchSize READ get_batchSize WRITE set_batchSize RESET reset_batchSize STORED false)
+    Q_PROPERTY(int iterations READ get_iterations WRITE set_iterations RESET reset_iterations STORED false)
     BR_PROPERTY(int, kTrain, 256)
     BR_PROPERTY(int, kSearch, 1)
+    BR_PROPERTY(bool, miniBatch, false)
+    BR_PROPERTY(int, batchSize, 1024)
+    BR_PROPERTY(int, iterations, 100)
 
     Mat centers;
     mutable QScopedPointer<flann::Index> index;
@@ -50,7 +62,9 @@ class KMeansTransform : public Transform
     void train(const TemplateList &data)
     {
         Mat bestLabels;
-        const double compactness = kmeans(OpenCVUtils::toMatByRow(data.data()), kTrain, bestLabels, TermCriteria(TermCriteria::MAX_ITER, 10, 0), 3, KMEANS_PP_CENTERS, centers);
+        const Mat samples = data.matrix();
+        const double compactness = miniBatch ? MiniBatchKMeans(samples, kTrain, bestLabels, centers, batchSize, iterations)
+                                             : kmeans(samples, kTrain, bestLabels, TermCriteria(TermCriteria::MAX_ITER, 10, 0), 3, KMEANS_PP_CENTERS, centers);
         qDebug("KMeans compactness = %f", compactness);
         reindex();
     }
@@ -80,6 +94,13 @@ BR_REGISTER(Transform, KMeansTransform)
 /*!
  * \ingroup transforms
  * \brief K nearest neighbors classifier.
+ *
+ * With \em approximate set, training also builds a randomized kd-tree forest over the gallery and each query only scores
+ * the \em candidates gallery templates nearest to it in L2 with \em distance.
+ * The kd-tree is only used when \em distance is an L2 br::DistDistance, which ranks templates the same way.
+ * Other distances, galleries that are not uniform single-channel float vectors,
+ * and queries whose candidates cover fewer subjects than \em numSubjects fall back to exhaustive search.
+ * A query that still finds no neighbor fails to enroll.
  * \author Josh Klontz \cite jklontz
  */
 class KNNTransform : public Transform
@@ -92,6 +113,9 @@ class KNNTransform : public Transform
     Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
     Q_PROPERTY(QString outputVariable READ get_outputVariable WRITE set_outputVariable RESET reset_outputVariable STORED false)
     Q_PROPERTY(QString galleryName READ get_galleryName WRITE set_galleryName RESET reset_galleryName STORED false)
+    Q_PROPERTY(bool approximate READ get_approximate WRITE set_approximate RESET reset_approximate STORED false)
+    Q_PROPERTY(int candidates READ get_candidates WRITE set_candidates RESET reset_candidates STORED false)
+    Q_PROPERTY(int checks READ get_checks WRITE set_checks RESET reset_checks STORED false)
     BR_PROPERTY(int, k, 1)
     BR_PROPERTY(br::Distance*, distance, NULL)
     BR_PROPERTY(bool, weighted, false)
@@ -99,21 +123,109 @@ class KNNTransform : public Transform
     BR_PROPERTY(QString, inputVariable, "Label")
     BR_PROPERTY(QString, outputVariable, "KNN")
     BR_PROPERTY(QString, galleryName, "")
+    BR_PROPERTY(bool, approximate, false)
+    BR_PROPERTY(int, candidates, 64)
+    BR_PROPERTY(int, checks, 64)
 
     TemplateList gallery;
+    Mat features; // The gallery one row per template, referenced by the index
+    mutable QScopedPointer<flann::Index> index;
+    mutable QMutex mutex;
+
+    bool indexable() const
+    {
+        if (gallery.isEmpty()) return false;
+        const size_t dims = gallery.first().m().total();
+        foreach (const Template &t, gallery)
+            if ((t.size() != 1) || (t.m().type() != CV_32FC1) || !t.m().isContinuous() || (t.m().total() != dims))
+                return false;
+        return true;
+    }
+
+    // The kd-tree ranks candidates by L2 on the raw features, so it only stands in for a distance that ranks them the same way
+    bool agreesWithL2() const
+    {
+        if (distance->objectName() != "Dist") return false;
+        const QMetaProperty metric = distance->metaObject()->property(distance->metaObject()->indexOfProperty("metric"));
+        const char *key = metric.enumerator().valueToKey(metric.read(distance).toInt());
+        return (key != NULL) && !strcmp(key, "L2");
+    }
+
+    void buildIndex()
+    {
+        index.reset();
+        features.release();
+        if (!approximate || !agreesWithL2() || !indexable()) return;
+        features = OpenCVUtils::toMat(gallery.data());
+        index.reset(new flann::Index(features, flann::KDTreeIndexParams(4)));
+    }
 
     void train(const TemplateList &data)
     {
         distance->train(data);
         gallery = data;
+        buildIndex();
+    }
+
+    // Only the first k scores are needed unless subjects are removed and voting repeated
+    QList< QPair<float, int> > sort(const QList<float> &scores) const
+    {
+        if ((numSubjects == 1) && (k >= 1)) return Common::TopK(scores, k, true);
+        else                                return Common::Sort(scores, true);
+    }
+
+    QList< QPair<float, int> > nearest(const Template &src, bool exhaustive) const
+    {
+        if (exhaustive || !index || (src.size() != 1) || (src.m().type() != CV_32FC1) || (int(src.m().total()) != features.cols))
+            return sort(distance->compare(gallery, src));
+
+        Mat indices, dists;
+        {
+            QMutexLocker locker(&mutex);
+            index->knnSearch(src.m().isContinuous() ? src.m().reshape(1, 1) : src.m().clone().reshape(1, 1), indices, dists, std::min(candidates, gallery.size()), flann::SearchParams(checks));
+        }
+
+        TemplateList neighbors;
+        QList<int> neighborIndices;
+        for (int i=0; i<indices.cols; i++) {
+            const int j = indices.at<int>(0, i);
+            if ((j < 0) || (j >= gallery.size())) continue;
+            neighbors.append(gallery[j]);
+            neighborIndices.append(j);
+        }
+
+        QList< QPair<float, int> > sortedScores = sort(distance->compare(neighbors, src));
+        for (int i=0; i<sortedScores.size(); i++)
+            sortedScores[i].second = neighborIndices[sortedScores[i].second];
+        return sortedScores;
+    }
+
+    void removeSubject(QList< QPair<float, int> > &sortedScores, const QString &subject) const
+    {
+        for (int j=sortedScores.size()-1; j>=0; j--)
+            if (gallery[sortedScores[j].second].file.get<QString>(inputVariable) == subject)
+                sortedScores.removeAt(j);
     }
 
     void project(const Template &src, Template &dst) const
     {
-        QList< QPair<float, int> > sortedScores = Common::Sort(distance->compare(gallery, src), true);
+        bool exhaustive = !index;
+        QList< QPair<float, int> > sortedScores = nearest(src, exhaustive);
+        QString nearestName;
 
         QStringList subjects;
         for (int i=0; i<numSubjects; i++) {
+            // The candidates ran out before numSubjects subjects were found
+            if (sortedScores.isEmpty() && !exhaustive) {
+                exhaustive = true;
+                sortedScores = nearest(src, true);
+                foreach (const QString &subject, subjects)
+                    removeSubject(sortedScores, subject);
+            }
+            if (sortedScores.isEmpty())
+                break;
+            nearestName = gallery[sortedScores.first().second].file.name;
+
             QHash<QString, float> votes;
             const int max = (k < 1) ? sortedScores.size() : std::min(k, sortedScores.size());
             for (int j=0; j<max; j++)
@@ -122,29 +234,63 @@ class KNNTransform : public Transform
 
             // Remove subject from consideration
             if (subjects.size() < numSubjects)
-                for (int j=sortedScores.size()-1; j>=0; j--)
-                    if (gallery[sortedScores[j].second].file.get<QString>(inputVariable) == subjects.last())
-                        sortedScores.removeAt(j);
+                removeSubject(sortedScores, subjects.last());
+        }
+
+        if (subjects.isEmpty()) {
+            dst.file.set("FTE", true);
+            return;
         }
 
         dst.file.set(outputVariable, subjects.size() > 1 ? "[" + subjects.join(",") + "]" : subjects.first());
-        dst.file.set("Nearest", gallery[sortedScores[0].second].file.name);
+        dst.file.set("Nearest", nearestName);
     }
 
     void store(QDataStream &stream) const
     {
         stream << gallery;
+        if (!approximate) return;
+
+        QByteArray data;
+        if (index) {
+            QTemporaryFile tempFile;
+            tempFile.open();
+            tempFile.close();
+            index->save(qPrintable(tempFile.fileName()));
+            tempFile.open();
+            data = tempFile.readAll();
+            tempFile.close();
+        }
+        stream << data;
     }
 
     void load(QDataStream &stream)
     {
         stream >> gallery;
+        if (!approximate) return;
+
+        QByteArray data;
+        stream >> data;
+        index.reset();
+        features.release();
+        if (data.isEmpty() || !indexable()) return;
+
+        features = OpenCVUtils::toMat(gallery.data());
+        QTemporaryFile tempFile(QDir::tempPath()+"/KNN");
+        tempFile.open();
+        tempFile.write(data);
+        tempFile.close();
+        index.reset(new flann::Index());
+        if (!index->load(features, qPrintable(tempFile.fileName())))
+            buildIndex();
     }
 
     void init()
     {
-        if (!galleryName.isEmpty())
+        if (!galleryName.isEmpty()) {
             gallery = TemplateList::fromGallery(galleryName);
+            buildIndex();
+        }
     }
 };
 
@@ -175,7 +321,7 @@ class RandomCentroidsTransform : public Transform
 
     void train(const TemplateList &data)
     {
-        Mat flat = OpenCVUtils::toMatByRow(data.data());
+        const Mat flat = data.matrix();
         QList<int> sample = Common::RandSample(kTrain, flat.rows, 0, true);
         foreach (const int &idx, sample)
             centers.push_back(flat.row(idx));
@@ -204,6 +350,164 @@ class RandomCentroidsTransform : public Transform
 
 BR_REGISTER(Transform, RandomCentroidsTransform)
 
+/*!
+ * \ingroup distances
+ * \brief Inverted file index for sub-linear search \cite jegou11
+ *
+ * Training clusters the templates into \em lists coarse centroids with kmeans.
+ * At comparison time each target is assigned to its nearest centroid and each query is only compared against the targets in its \em probes nearest lists.
+ * Targets that are not probed receive <tt>-std::numeric_limits<float>::max()</tt>.
+ * \author Josh Klontz \cite jklontz
+ */
+class IVFDistance : public Distance
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Distance *distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
+    Q_PROPERTY(int lists READ get_lists WRITE set_lists RESET reset_lists STORED false)
+    Q_PROPERTY(int probes READ get_probes WRITE set_probes RESET reset_probes STORED false)
+    BR_PROPERTY(br::Distance*, distance, NULL)
+    BR_PROPERTY(int, lists, 256)
+    BR_PROPERTY(int, probes, 8)
+
+    // Assignment of a gallery's templates to centroids
+    struct InvertedLists
+    {
+        TemplateList targets; // Holds the gallery's matrices so the identity of their buffers can't be reused by another gallery
+        QVector< QVector<int> > members;
+
+        bool matches(const TemplateList &other) const
+        {
+            if (other.size() != targets.size()) return false;
+            for (int i=0; i<other.size(); i++)
+                if ((other[i].size() != targets[i].size()) || (!other[i].isEmpty() && (other[i].m().data != targets[i].m().data)))
+                    return false;
+            return true;
+        }
+    };
+
+    Mat centers;
+    mutable QScopedPointer<flann::Index> index;
+    mutable QMutex indexLock, cacheLock;
+    mutable QSharedPointer<InvertedLists> cache; // Inverted lists of the most recently searched gallery
+
+    static Mat flatten(const Template &t)
+    {
+        Mat m;
+        t.m().reshape(1, 1).convertTo(m, CV_32F);
+        return m;
+    }
+
+    void reindex()
+    {
+        index.reset(new flann::Index(centers, flann::LinearIndexParams()));
+    }
+
+    QList<int> nearest(const Template &t, int k) const
+    {
+        Mat dists, indicies;
+        {
+            QMutexLocker locker(&indexLock);
+            index->knnSearch(flatten(t), indicies, dists, std::min(k, centers.rows));
+        }
+        return OpenCVUtils::matrixToVector<int>(indicies.reshape(1, 1));
+    }
+
+    QSharedPointer<InvertedLists> assign(const TemplateList &targets) const
+    {
+        QSharedPointer<InvertedLists> ivf(new InvertedLists());
+        ivf->targets = targets;
+        ivf->members.resize(centers.rows);
+        for (int i=0; i<targets.size(); i++)
+            if (!targets[i].isEmpty())
+                ivf->members[nearest(targets[i], 1).first()].append(i);
+        return ivf;
+    }
+
+    // Single query comparisons reuse the lists of the last gallery while it holds the very same matrices
+    QSharedPointer<InvertedLists> invertedLists(const TemplateList &targets) const
+    {
+        QMutexLocker locker(&cacheLock);
+        if (!cache || !cache->matches(targets))
+            cache = assign(targets);
+        return cache;
+    }
+
+    void train(const TemplateList &src)
+    {
+        distance->train(src);
+
+        QList<Mat> data;
+        foreach (const Template &t, src)
+            if (!t.isEmpty()) data.append(flatten(t));
+
+        Mat bestLabels;
+        const double compactness = kmeans(OpenCVUtils::toMatByRow(data), std::min(lists, data.size()), bestLabels, TermCriteria(TermCriteria::MAX_ITER, 10, 0), 3, KMEANS_PP_CENTERS, centers);
+        qDebug("IVF compactness = %f", compactness);
+        reindex();
+    }
+
+    void compare(const TemplateList &target, const TemplateList &query, Output *output) const
+    {
+        // Assign the targets once before comparing queries in parallel
+        const QSharedPointer<InvertedLists> ivf = assign(target);
+
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<query.size(); i++)
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &IVFDistance::compareQuery, ivf.data(), query, i, output));
+            else                                                          compareQuery(ivf.data(), query, i, output);
+        futures.waitForFinished();
+    }
+
+    QList<float> compare(const InvertedLists &ivf, const Template &query) const
+    {
+        const TemplateList &targets = ivf.targets;
+        QList<float> scores; scores.reserve(targets.size());
+        for (int i=0; i<targets.size(); i++)
+            scores.append(-std::numeric_limits<float>::max());
+        if (query.isEmpty())
+            return scores;
+
+        foreach (int list, nearest(query, probes))
+            foreach (int i, ivf.members[list])
+                scores[i] = distance->compare(targets[i], query);
+        return scores;
+    }
+
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        return compare(*invertedLists(targets), query);
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        return distance->compare(a, b);
+    }
+
+    void compareQuery(const InvertedLists *ivf, const TemplateList &queries, int i, Output *output) const
+    {
+        const QList<float> scores = compare(*ivf, queries[i]);
+        Mat row(1, scores.size(), CV_32FC1);
+        for (int j=0; j<scores.size(); j++)
+            row.at<float>(0, j) = scores[j];
+        output->setRelativeTile(row, i, 0);
+    }
+
+    void store(QDataStream &stream) const
+    {
+        distance->store(stream);
+        stream << centers;
+    }
+
+    void load(QDataStream &stream)
+    {
+        distance->load(stream);
+        stream >> centers;
+        reindex();
+    }
+};
+
+BR_REGISTER(Distance, IVFDistance)
+
 } // namespace br
 
 #include "cluster.moc"
@@ -17,6 +17,7 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include "openbr_internal.h"
 
+#include "openbr/core/arena.h"
 #include "openbr/core/opencvutils.h"
 
 using namespace cv;
@@ -132,7 +133,10 @@ private:
 
     void project(const Template &src, Template &dst) const
     {
-        resize(src, dst, Size((columns == -1) ? src.m().cols*rows/src.m().rows : columns, rows), 0, 0, method);
+        const Size size((columns == -1) ? src.m().cols*rows/src.m().rows : columns, rows);
+        Mat m = MatArena::get(size.height, size.width, src.m().type());
+        resize(src, m, size, 0, 0, method);
+        dst = m;
     }
 };
 
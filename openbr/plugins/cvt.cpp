@@ -16,6 +16,7 @@
 
 #include <opencv2/imgproc/imgproc.hpp>
 #include "openbr_internal.h"
+#include "openbr/core/half.h"
 #include "openbr/core/opencvutils.h"
 
 using namespace cv;
@@ -68,6 +69,8 @@ BR_REGISTER(Transform, CvtTransform)
 /*!
  * \ingroup transforms
  * \brief Convert to floating point format.
+ *
+ * Every matrix of a template stored at half precision by CvtHalfTransform is decoded.
  * \author Josh Klontz \cite jklontz
  */
 class CvtFloatTransform : public UntrainableTransform
@@ -76,12 +79,52 @@ class CvtFloatTransform : public UntrainableTransform
 
     void project(const Template &src, Template &dst) const
     {
-        src.m().convertTo(dst, CV_32F);
+        if (src.file.getBool("Half")) {
+            dst.clear();
+            foreach (const Mat &m, src)
+                dst.append((m.depth() == Half::Depth) ? Half::decode(m) : m);
+            dst.file.remove("Half");
+        } else {
+            src.m().convertTo(dst, CV_32F);
+        }
     }
 };
 
 BR_REGISTER(Transform, CvtFloatTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Store floating point matrices at half precision.
+ *
+ * Halves the memory and bandwidth of float intermediates held between stages, for example a gallery of preprocessed crops,
+ * at about three significant digits. Every matrix is converted to the \c CV_16U bit patterns of Half::Depth
+ * and the template is marked \c Half, CvtFloatTransform converts it back.
+ * Stages in between should only move the matrices, all arithmetic stays in single precision.
+ * \author Josh Klontz \cite jklontz
+ */
+class CvtHalfTransform : public UntrainableTransform
+{
+    Q_OBJECT
+
+    void project(const Template &src, Template &dst) const
+    {
+        if (src.file.getBool("Half")) {
+            dst = src;
+            return;
+        }
+
+        dst.clear();
+        foreach (const Mat &m, src) {
+            Mat f = m;
+            if (f.depth() != CV_32F) m.convertTo(f, CV_32F);
+            dst.append(Half::encode(f));
+        }
+        dst.file.set("Half", true);
+    }
+};
+
+BR_REGISTER(Transform, CvtHalfTransform)
+
 /*!
  * \ingroup transforms
  * \brief Convert to uchar format
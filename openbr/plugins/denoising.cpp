@@ -14,8 +14,11 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
+#include <QtConcurrentRun>
 #include <opencv2/photo/photo.hpp>
 #include "openbr_internal.h"
+#include "openbr/core/opencvutils.h"
 
 using namespace cv;
 
@@ -25,6 +28,9 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Wraps OpenCV Non-Local Means Denoising
+ *
+ * The image is denoised in \em tileSize square tiles concurrently, each padded by the half widths of the template and search windows
+ * so the result matches denoising the whole image. With \em onlyRects only the template's rects, for example the detected face, are denoised.
  * \author Josh Klontz \cite jklontz
  */
 class NLMeansDenoisingTransform : public UntrainableTransform
@@ -35,11 +41,38 @@ class NLMeansDenoisingTransform : public UntrainableTransform
     Q_PROPERTY(int searchWindowSize READ get_searchWindowSize WRITE set_searchWindowSize RESET reset_searchWindowSize STORED false)
     BR_PROPERTY(float, h, 3)
     BR_PROPERTY(int, templateWindowSize, 7)
+    Q_PROPERTY(int tileSize READ get_tileSize WRITE set_tileSize RESET reset_tileSize STORED false)
+    Q_PROPERTY(bool onlyRects READ get_onlyRects WRITE set_onlyRects RESET reset_onlyRects STORED false)
     BR_PROPERTY(int, searchWindowSize, 21)
+    BR_PROPERTY(int, tileSize, 256)
+    BR_PROPERTY(bool, onlyRects, false)
+
+    void denoiseTile(const Mat *src, Mat *dst, Rect tile) const
+    {
+        const int padding = templateWindowSize/2 + searchWindowSize/2;
+        const Rect padded = Rect(tile.x - padding, tile.y - padding, tile.width + 2*padding, tile.height + 2*padding) & Rect(0, 0, src->cols, src->rows);
+        Mat denoised;
+        fastNlMeansDenoising((*src)(padded), denoised, h, templateWindowSize, searchWindowSize);
+        denoised(Rect(tile.tl() - padded.tl(), tile.size())).copyTo((*dst)(tile));
+    }
 
     void project(const Template &src, Template &dst) const
     {
-        fastNlMeansDenoising(src, dst, h, templateWindowSize, searchWindowSize);
+        const Mat &m = src;
+        const Rect bounds(0, 0, m.cols, m.rows);
+        // Overlapping rects are merged so no pixel is written by two tiles
+        const QList<Rect> regions = onlyRects ? OpenCVUtils::searchRegions(src.file.rects(), m.size()) : QList<Rect>() << bounds;
+
+        Mat result = onlyRects ? m.clone() : Mat(m.size(), m.type());
+        const int step = tileSize > 0 ? tileSize : std::max(m.rows, m.cols);
+        QFutureSynchronizer<void> futures;
+        foreach (const Rect &region, regions)
+            for (int y=region.y; y<region.br().y; y+=step)
+                for (int x=region.x; x<region.br().x; x+=step)
+                    futures.addFuture(QtConcurrent::run(this, &NLMeansDenoisingTransform::denoiseTile, &m, &result,
+                                                        Rect(x, y, std::min(step, region.br().x - x), std::min(step, region.br().y - y))));
+        futures.waitForFinished();
+        dst = result;
     }
 };
 
@@ -14,13 +14,20 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QCache>
+#include <QCryptographicHash>
+#include <QHash>
+#include <QMutex>
+#include <QSharedPointer>
 #include <QFutureSynchronizer>
 #include <QtConcurrentRun>
+#include <algorithm>
 #include <numeric>
 #include <opencv2/imgproc/imgproc.hpp>
 #include "openbr_internal.h"
 
 #include "openbr/core/distance_sse.h"
+#include "openbr/core/opencvutils.h"
 #include "openbr/core/qtutils.h"
 
 using namespace cv;
@@ -95,6 +102,12 @@ private:
         return negLogPlusOne ? -log(result+1) : result;
     }
 
+    bool symmetric() const
+    {
+        // OpenCV's chi-squared normalizes by the first histogram
+        return metric != ChiSquared;
+    }
+
     static float cosine(const Mat &a, const Mat &b)
     {
         float dot = 0;
@@ -136,6 +149,11 @@ class DefaultDistance : public Distance
     {
         return distance->compare(a, b);
     }
+
+    bool symmetric() const
+    {
+        return distance->symmetric();
+    }
 };
 
 BR_REGISTER(Distance, DefaultDistance)
@@ -173,6 +191,37 @@ class PipeDistance : public Distance
         }
         return result;
     }
+
+    // Any sub-distance that rejects a pair rejects it for the pipe
+    bool exclude(const TemplateList &targets, const TemplateList &queries, Mat &excluded) const
+    {
+        bool filtered = false;
+        foreach (br::Distance *distance, distances) {
+            Mat subExcluded;
+            if (!distance->exclude(targets, queries, subExcluded)) continue;
+            if (filtered) excluded |= subExcluded;
+            else          excluded = subExcluded;
+            filtered = true;
+        }
+        return filtered;
+    }
+
+    // Partitioned by the first sub-distance that partitions
+    bool partition(const TemplateList &templates, QList<int> &partitions) const
+    {
+        foreach (br::Distance *distance, distances)
+            if (distance->partition(templates, partitions))
+                return true;
+        return false;
+    }
+
+    bool symmetric() const
+    {
+        foreach (br::Distance *distance, distances)
+            if (!distance->symmetric())
+                return false;
+        return !distances.isEmpty();
+    }
 };
 
 BR_REGISTER(Distance, PipeDistance)
@@ -182,6 +231,9 @@ BR_REGISTER(Distance, PipeDistance)
  * \brief Fuses similarity scores across multiple matrices of compared templates
  * \author Scott Klum \cite sklum
  * \note Operation: Mean, sum, min, max are supported.
+ * \note Setting \em threshold cascades the matrices in order, cheapest first:
+ *       a pair stops once its fused score can no longer reach \em threshold given no matrix scores above \em maxScore,
+ *       and is scored with that upper bound instead.
  */
 class FuseDistance : public Distance
 {
@@ -189,6 +241,8 @@ class FuseDistance : public Distance
     Q_ENUMS(Operation)
     Q_PROPERTY(QString description READ get_description WRITE set_description RESET reset_description STORED false)
     Q_PROPERTY(Operation operation READ get_operation WRITE set_operation RESET reset_operation STORED false)
+    Q_PROPERTY(float threshold READ get_threshold WRITE set_threshold RESET reset_threshold STORED false)
+    Q_PROPERTY(float maxScore READ get_maxScore WRITE set_maxScore RESET reset_maxScore STORED false)
 
     QList<br::Distance*> distances;
 
@@ -199,6 +253,8 @@ public:
 private:
     BR_PROPERTY(QString, description, "IdenticalDistance")
     BR_PROPERTY(Operation, operation, Mean)
+    BR_PROPERTY(float, threshold, -std::numeric_limits<float>::max())
+    BR_PROPERTY(float, maxScore, std::numeric_limits<float>::max())
 
     void train(const TemplateList &src)
     {
@@ -220,9 +276,15 @@ private:
     {
         if (a.size() != b.size()) qFatal("Comparison size mismatch");
 
+        const bool cascade = (threshold != -std::numeric_limits<float>::max());
         QList<float> scores;
-        for (int i=0; i<distances.size(); i++)
+        for (int i=0; i<distances.size(); i++) {
             scores.append(distances[i]->compare(Template(a.file, a[i]),Template(b.file, b[i])));
+            if (cascade && (i < distances.size()-1)) {
+                const float bound = upperBound(scores);
+                if (bound < threshold) return bound;
+            }
+        }
 
         switch (operation) {
           case Mean:
@@ -242,6 +304,25 @@ private:
         }
     }
 
+    // The highest fused score reachable once the remaining matrices are compared
+    float upperBound(const QList<float> &scores) const
+    {
+        const double remaining = double(maxScore) * (distances.size() - scores.size());
+        switch (operation) {
+          case Mean:
+            return (std::accumulate(scores.begin(),scores.end(),0.0) + remaining)/(float)distances.size();
+          case Sum:
+            return std::accumulate(scores.begin(),scores.end(),0.0) + remaining;
+          case Min:
+            return *std::min_element(scores.begin(),scores.end());
+          case Max:
+            return std::max(*std::max_element(scores.begin(),scores.end()), maxScore);
+          default:
+            qFatal("Invalid operation.");
+        }
+        return std::numeric_limits<float>::max();
+    }
+
     void store(QDataStream &stream) const
     {
         stream << distances.size();
@@ -262,6 +343,244 @@ private:
 
 BR_REGISTER(Distance, FuseDistance)
 
+/*!
+ * \ingroup distances
+ * \brief Two stage search, a coarse scan of compact codes shortlists the targets re-scored by an exact distance.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Templates carry both representations, matrix \em coarseIndex is scanned with \em coarse
+ * (for example codes from Binarize or ProductQuantization) and matrix \em exactIndex is compared with \em exact.
+ * When \em gallery is set the searched gallery is the resident tier and only needs to hold the compact codes,
+ * for example in a \c mem or \c mmg gallery, while the exact templates stay on disk in \em gallery, matched by file name.
+ * Only the shortlisted targets are read from it, in concurrent chunks of file order, and the \em cache most recently read are kept in memory.
+ * Each query re-scores its \em shortlist best coarse matches in every block of targets (all of them if \c 0 or less),
+ * the other targets receive <tt>-std::numeric_limits<float>::max()</tt>.
+ */
+class RerankDistance : public Distance
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Distance *coarse READ get_coarse WRITE set_coarse RESET reset_coarse)
+    Q_PROPERTY(br::Distance *exact READ get_exact WRITE set_exact RESET reset_exact)
+    Q_PROPERTY(int shortlist READ get_shortlist WRITE set_shortlist RESET reset_shortlist STORED false)
+    Q_PROPERTY(int coarseIndex READ get_coarseIndex WRITE set_coarseIndex RESET reset_coarseIndex STORED false)
+    Q_PROPERTY(int exactIndex READ get_exactIndex WRITE set_exactIndex RESET reset_exactIndex STORED false)
+    Q_PROPERTY(QString gallery READ get_gallery WRITE set_gallery RESET reset_gallery STORED false)
+    Q_PROPERTY(int cache READ get_cache WRITE set_cache RESET reset_cache STORED false)
+    BR_PROPERTY(br::Distance*, coarse, make("ByteL1"))
+    BR_PROPERTY(br::Distance*, exact, make("Dist(L2)"))
+    BR_PROPERTY(int, shortlist, 100)
+    BR_PROPERTY(int, coarseIndex, 0)
+    BR_PROPERTY(int, exactIndex, 1)
+    BR_PROPERTY(QString, gallery, "")
+    BR_PROPERTY(int, cache, 100000)
+
+    // The exact templates on disk
+    struct ColdTier
+    {
+        QSharedPointer<Gallery> gallery;
+        QHash<QString, int> index; // File name to position in the gallery
+        QMutex cacheLock;
+        QCache<int, Template> templates;
+    };
+
+    mutable QMutex galleryLock;
+    mutable QSharedPointer<ColdTier> coldTier;
+
+    // Orders target indices by descending coarse score
+    struct ByScore
+    {
+        const float *scores;
+        bool operator()(int a, int b) const { return scores[a] > scores[b]; }
+    };
+
+    static Template matrix(const Template &t, int index)
+    {
+        return (index < t.size()) ? Template(t.file, t[index]) : Template(t.file);
+    }
+
+    static TemplateList matrices(const TemplateList &templates, int index)
+    {
+        TemplateList result; result.reserve(templates.size());
+        foreach (const Template &t, templates)
+            result.append(matrix(t, index));
+        return result;
+    }
+
+    QSharedPointer<ColdTier> cold() const
+    {
+        QMutexLocker locker(&galleryLock);
+        if (coldTier.isNull()) {
+            coldTier = QSharedPointer<ColdTier>(new ColdTier());
+            coldTier->gallery = QSharedPointer<Gallery>(Gallery::make(gallery));
+            const FileList files = coldTier->gallery->files();
+            for (int i=0; i<files.size(); i++)
+                coldTier->index.insert(files[i].name, i);
+            coldTier->templates.setMaxCost(std::max(cache, 0));
+        }
+        return coldTier;
+    }
+
+    // Sets the exact templates of the wanted targets, reading those that aren't cached from the cold tier
+    void fetch(const TemplateList &targets, const QList<int> &wanted, TemplateList &result) const
+    {
+        QSharedPointer<ColdTier> tier = cold();
+        QList<int> positions, missing;
+        {
+            QMutexLocker locker(&tier->cacheLock);
+            foreach (int j, wanted) {
+                QHash<QString, int>::const_iterator it = tier->index.constFind(targets[j].file.name);
+                if (it == tier->index.constEnd())
+                    continue;
+                if (const Template *t = tier->templates.object(it.value())) {
+                    result[j] = *t;
+                } else {
+                    positions.append(it.value());
+                    missing.append(j);
+                }
+            }
+        }
+        if (positions.isEmpty())
+            return;
+
+        // Gallery::readAt() reads each chunk in file order, chunks are read concurrently
+        const int chunk = std::max(64, positions.size() / std::max(1, Globals->parallelism) + 1);
+        QList< QFuture<TemplateList> > futures;
+        QList<TemplateList> chunks;
+        for (int begin=0; begin<positions.size(); begin+=chunk)
+            if (Globals->parallelism) futures.append(QtConcurrent::run(tier->gallery.data(), &Gallery::readAt, positions.mid(begin, chunk)));
+            else                      chunks.append(tier->gallery->readAt(positions.mid(begin, chunk)));
+        foreach (const QFuture<TemplateList> &future, futures)
+            chunks.append(future.result());
+
+        QMutexLocker locker(&tier->cacheLock);
+        int i = 0;
+        foreach (const TemplateList &templates, chunks)
+            foreach (const Template &t, templates) {
+                result[missing[i]] = t;
+                tier->templates.insert(positions[i], new Template(t));
+                i++;
+            }
+    }
+
+    TemplateList exactTargets(const TemplateList &targets) const
+    {
+        if (gallery.isEmpty())
+            return matrices(targets, exactIndex);
+
+        TemplateList result(targets.files());
+        QList<int> wanted;
+        for (int j=0; j<targets.size(); j++)
+            wanted.append(j);
+        fetch(targets, wanted, result);
+        return result;
+    }
+
+    void train(const TemplateList &src)
+    {
+        coarse->train(matrices(src, coarseIndex));
+        exact->train(exactTargets(src));
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        const Template target = exactTargets(TemplateList() << a).first();
+        const Template query = matrix(b, exactIndex);
+        if (target.isEmpty() || query.isEmpty()) return -std::numeric_limits<float>::max();
+        return exact->compare(target, query);
+    }
+
+    void compare(const TemplateList &target, const TemplateList &query, Output *output) const
+    {
+        // The coarse scan goes through the usual block comparison, batched kernels and filters included
+        QScopedPointer<MatrixOutput> coarseScores(MatrixOutput::make(FileList(target.size()), FileList(query.size())));
+        coarse->compare(matrices(target, coarseIndex), matrices(query, coarseIndex), coarseScores.data());
+
+        // Every query is shortlisted before re-ranking so the cold tier is read once per block
+        QVector< QVector<int> > shortlists(query.size());
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<query.size(); i++)
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &RerankDistance::shortlistQuery, coarseScores->data, i, &shortlists[i]));
+            else                                                          shortlistQuery(coarseScores->data, i, &shortlists[i]);
+        futures.waitForFinished();
+
+        TemplateList targets;
+        if (gallery.isEmpty()) {
+            targets = matrices(target, exactIndex);
+        } else {
+            QVector<bool> shortlisted(target.size(), false);
+            QList<int> wanted;
+            foreach (const QVector<int> &candidates, shortlists)
+                foreach (int j, candidates)
+                    if (!shortlisted[j]) {
+                        shortlisted[j] = true;
+                        wanted.append(j);
+                    }
+            std::sort(wanted.begin(), wanted.end());
+            targets = TemplateList(target.files());
+            fetch(target, wanted, targets);
+        }
+
+        for (int i=0; i<query.size(); i++)
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &RerankDistance::rerank, shortlists[i], targets, query, i, output));
+            else                                                          rerank(shortlists[i], targets, query, i, output);
+        futures.waitForFinished();
+    }
+
+    void shortlistQuery(const Mat &coarseScores, int i, QVector<int> *candidates) const
+    {
+        const float *scores = coarseScores.ptr<float>(i);
+        candidates->reserve(coarseScores.cols);
+        for (int j=0; j<coarseScores.cols; j++)
+            if (scores[j] != -std::numeric_limits<float>::max())
+                candidates->append(j);
+
+        if ((shortlist > 0) && (candidates->size() > shortlist)) {
+            ByScore byScore;
+            byScore.scores = scores;
+            std::nth_element(candidates->begin(), candidates->begin()+shortlist, candidates->end(), byScore);
+            candidates->resize(shortlist);
+        }
+    }
+
+    void rerank(const QVector<int> &candidates, const TemplateList &targets, const TemplateList &queries, int i, Output *output) const
+    {
+        Mat row(1, targets.size(), CV_32FC1, Scalar(-std::numeric_limits<float>::max()));
+        const Template query = matrix(queries[i], exactIndex);
+        if (!query.isEmpty())
+            foreach (int j, candidates)
+                if (!targets[j].isEmpty())
+                    row.at<float>(0, j) = exact->compare(targets[j], query);
+        output->setRelativeTile(row, i, 0);
+    }
+};
+
+BR_REGISTER(Distance, RerankDistance)
+
+// True if the bytes between the end of each row and the next are all zero
+static bool zeroPadded(const Mat &rows)
+{
+    const size_t bytes = rows.cols * rows.elemSize();
+    for (int i=0; i<rows.rows; i++) {
+        const uchar *padding = rows.ptr(i) + bytes;
+        for (size_t j=0; j<rows.step-bytes; j++)
+            if (padding[j]) return false;
+    }
+    return true;
+}
+
+// Returns a copy of the query padded like the targets if their rows are SIMD aligned and zero padded, see Distance::compare()
+// The padding is checked rather than assumed, a submatrix of a wider matrix has the columns it leaves out in its place
+static const uchar *alignedQuery(const Mat &targets, const Mat &query, QVector<uchar> &buffer)
+{
+    if ((targets.step != OpenCVUtils::alignedStep(targets.cols * targets.elemSize())) ||
+        (alignPtr(targets.data, OpenCVUtils::SIMDAlignment) != targets.data) ||
+        !zeroPadded(targets))
+        return NULL;
+    uchar *data = OpenCVUtils::alignedBuffer(buffer, targets.step);
+    memcpy(data, query.data, query.cols * query.elemSize());
+    return data;
+}
+
 /*!
  * \ingroup distances
  * \brief Fast 8-bit L1 distance
@@ -275,6 +594,28 @@ class ByteL1Distance : public Distance
     {
         return l1(a.m().data, b.m().data, a.m().total());
     }
+
+    bool compare(const Mat &targets, const Mat &query, float *scores) const
+    {
+        QVector<uchar> buffer;
+        const uchar *aligned = alignedQuery(targets, query, buffer);
+        if (aligned != NULL) {
+            // Zero padding contributes nothing to the distance, registered sizes have a fully unrolled kernel
+            const FixedL1Function kernel = fixed_l1(int(targets.step));
+            if (kernel) for (int i=0; i<targets.rows; i++) scores[i] = kernel(targets.ptr(i), aligned);
+            else        for (int i=0; i<targets.rows; i++) scores[i] = aligned_l1(targets.ptr(i), aligned, targets.step);
+            return true;
+        }
+
+        for (int i=0; i<targets.rows; i++)
+            scores[i] = l1(targets.ptr(i), query.data, targets.cols);
+        return true;
+    }
+
+    bool symmetric() const
+    {
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, ByteL1Distance)
@@ -292,10 +633,71 @@ class HalfByteL1Distance : public Distance
     {
         return packed_l1(a.m().data, b.m().data, a.m().total());
     }
+
+    bool compare(const Mat &targets, const Mat &query, float *scores) const
+    {
+        QVector<uchar> buffer;
+        const uchar *aligned = alignedQuery(targets, query, buffer);
+        if (aligned != NULL) {
+            // Zero padding contributes nothing to the distance, registered sizes have a fully unrolled kernel
+            const FixedL1Function kernel = fixed_packed_l1(int(targets.step));
+            if (kernel) for (int i=0; i<targets.rows; i++) scores[i] = kernel(targets.ptr(i), aligned);
+            else        for (int i=0; i<targets.rows; i++) scores[i] = aligned_packed_l1(targets.ptr(i), aligned, targets.step);
+            return true;
+        }
+
+        for (int i=0; i<targets.rows; i++)
+            scores[i] = packed_l1(targets.ptr(i), query.data, targets.cols);
+        return true;
+    }
+
+    bool symmetric() const
+    {
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, HalfByteL1Distance)
 
+/*!
+ * \ingroup distances
+ * \brief Fast Hamming distance between bit-packed binary codes, like those made by br::BinarizeTransform
+ * \author Josh Klontz \cite jklontz
+ */
+class HammingDistance : public Distance
+{
+    Q_OBJECT
+
+    float compare(const Template &a, const Template &b) const
+    {
+        return hamming(a.m().data, b.m().data, a.m().total() * a.m().elemSize());
+    }
+
+    bool compare(const Mat &targets, const Mat &query, float *scores) const
+    {
+        QVector<uchar> buffer;
+        const uchar *aligned = alignedQuery(targets, query, buffer);
+        if (aligned != NULL) {
+            // Zero padding contributes nothing to the distance, registered sizes have a fully unrolled kernel
+            const FixedL1Function kernel = fixed_hamming(int(targets.step));
+            if (kernel) for (int i=0; i<targets.rows; i++) scores[i] = kernel(targets.ptr(i), aligned);
+            else        for (int i=0; i<targets.rows; i++) scores[i] = aligned_hamming(targets.ptr(i), aligned, targets.step);
+            return true;
+        }
+
+        for (int i=0; i<targets.rows; i++)
+            scores[i] = hamming(targets.ptr(i), query.data, targets.cols * targets.elemSize());
+        return true;
+    }
+
+    bool symmetric() const
+    {
+        return true;
+    }
+};
+
+BR_REGISTER(Distance, HammingDistance)
+
 /*!
  * \ingroup distances
  * \brief Returns -log(distance(a,b)+1)
@@ -317,6 +719,11 @@ class NegativeLogPlusOneDistance : public Distance
         return -log(distance->compare(a,b)+1);
     }
 
+    bool symmetric() const
+    {
+        return distance->symmetric();
+    }
+
     void store(QDataStream &stream) const
     {
         distance->store(stream);
@@ -367,19 +774,113 @@ class OnlineDistance : public Distance
     BR_PROPERTY(br::Distance*, distance, NULL)
     BR_PROPERTY(float, alpha, 0.1f)
 
-    mutable QHash<QString,float> scoreHash;
-    mutable QMutex mutex;
+    // Targets are spread over independently locked shards so comparison threads rarely wait on each other
+    struct Shard
+    {
+        QHash<QString,float> scoreHash;
+        QMutex mutex;
+    };
+    static const int Shards = 64;
+    mutable Shard shards[Shards];
 
     float compare(const Template &target, const Template &query) const
     {
         float currentScore = distance->compare(target, query);
 
-        QMutexLocker mutexLocker(&mutex);
-        return scoreHash[target.file.name] = (1.0- alpha) * scoreHash[target.file.name] + alpha * currentScore;
+        Shard &shard = shards[qHash(target.file.name) % Shards];
+        QMutexLocker mutexLocker(&shard.mutex);
+        float &score = shard.scoreHash[target.file.name];
+        return score = (1.0- alpha) * score + alpha * currentScore;
     }
 };
 
 BR_REGISTER(Distance, OnlineDistance)
 
+/*!
+ * \ingroup distances
+ * \brief Caches the scores of recently compared pairs, for services that compare the same pairs repeatedly.
+ *
+ * Templates read from a gallery are identified by their file name, the gallery's name and their \c Index in it,
+ * so a template is assumed not to change while it keeps them.
+ * Other templates are identified by their file and a SHA-1 digest of their matrices, so a reused file name never returns a stale score.
+ * At most \em capacity scores are kept and the least recently used are evicted first.
+ * \author Josh Klontz \cite jklontz
+ */
+class ScoreCacheDistance : public Distance
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Distance* distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
+    Q_PROPERTY(int capacity READ get_capacity WRITE set_capacity RESET reset_capacity STORED false)
+    BR_PROPERTY(br::Distance*, distance, NULL)
+    BR_PROPERTY(int, capacity, 100000)
+
+    struct Shard
+    {
+        QCache<QString,float> scores;
+        QMutex mutex;
+    };
+    static const int Shards = 16;
+    mutable Shard shards[Shards];
+
+    void init()
+    {
+        for (int i=0; i<Shards; i++) {
+            QMutexLocker locker(&shards[i].mutex);
+            shards[i].scores.clear();
+            shards[i].scores.setMaxCost(std::max(1, capacity/Shards));
+        }
+    }
+
+    void train(const TemplateList &src)
+    {
+        distance->train(src);
+        init();
+    }
+
+    static QString identity(const Template &t)
+    {
+        if (t.file.contains("Index"))
+            return t.file.name + '\t' + t.file.get<QString>("Gallery", QString()) + '\t' + t.file.get<QString>("Index");
+
+        QCryptographicHash digest(QCryptographicHash::Sha1);
+        foreach (const Mat &m, t) {
+            const int header[3] = { m.type(), m.rows, m.cols };
+            digest.addData((const char*)header, sizeof(header));
+            for (int i=0; i<m.rows; i++)
+                digest.addData((const char*)m.ptr(i), int(m.cols * m.elemSize()));
+        }
+        return t.file.flat() + '\t' + digest.result().toHex();
+    }
+
+    float compare(const Template &target, const Template &query) const
+    {
+        const QString key = identity(target) + '\n' + identity(query);
+        Shard &shard = shards[qHash(key) % Shards];
+        {
+            QMutexLocker locker(&shard.mutex);
+            const float *score = shard.scores.object(key);
+            if (score != NULL) return *score;
+        }
+
+        const float score = distance->compare(target, query);
+        QMutexLocker locker(&shard.mutex);
+        shard.scores.insert(key, new float(score));
+        return score;
+    }
+
+    void store(QDataStream &stream) const
+    {
+        distance->store(stream);
+    }
+
+    void load(QDataStream &stream)
+    {
+        distance->load(stream);
+        init();
+    }
+};
+
+BR_REGISTER(Distance, ScoreCacheDistance)
+
 } // namespace br
 #include "distance.moc"
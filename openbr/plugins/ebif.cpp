@@ -1,8 +1,9 @@
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include "openbr_internal.h"
-#include "openbr/core/common.h"
+#include "openbr/core/gabor.h"
 #include "openbr/core/opencvutils.h"
+#include "openbr/core/shapecache.h"
 
 using namespace cv;
 
@@ -26,24 +27,39 @@ class EBIFTransform : public UntrainableTransform
     BR_PROPERTY(int, N, 6)
     BR_PROPERTY(int, M, 9)
 
-    QList<Transform*> orientations;
+    QList<Mat> kReals, kImaginaries;
+    int xRadius, yRadius; // Largest wavelet half widths, the reflected border every scale is padded by
+    QString owner;
 
     void init()
     {
-        for (int m=0; m<M; m++)
-            orientations.append(make(QString("Gabor(%1,%2,%3,%4,%5,Phase)+Abs").arg(
-                                     QString::number(5), // lambda = 5 (just one wavelength)
-                                     QString::number(CV_PI*m/M), // M orientations between 0 and pi
-                                     QString::number(0), // psi = 0 (no offset)
-                                     QString::number(3), // sigma = 3 (just one width)
-                                     QString::number(1) // gamma = 1 (no skew)
-                                     )));
+        kReals.clear();
+        kImaginaries.clear();
+        xRadius = yRadius = 0;
+        for (int m=0; m<M; m++) {
+            Mat kReal, kImaginary;
+            Gabor::wavelet(5, // lambda = 5 (just one wavelength)
+                           CV_PI*m/M, // M orientations between 0 and pi
+                           0, // psi = 0 (no offset)
+                           3, // sigma = 3 (just one width)
+                           1, // gamma = 1 (no skew)
+                           kReal, kImaginary);
+            kReals.append(kReal);
+            kImaginaries.append(kImaginary);
+            xRadius = std::max(xRadius, kReal.cols/2);
+            yRadius = std::max(yRadius, kReal.rows/2);
+        }
+        owner = description();
     }
 
     void project(const Template &src, Template &dst) const
     {
-        // Compute the image pyramid
-        Template scales;
+        // Filter each scale of the image pyramid with every orientation, pooling adjacent scales as soon as both are available
+        QList< QList<float> > features;
+        for (int m=0; m<M; m++)
+            features.append(QList<float>());
+
+        QList<Mat> previous;
         float scaleFactor = 1;
         for (int n=0; n<N; n++) {
             Mat scale;
@@ -51,22 +67,13 @@ class EBIFTransform : public UntrainableTransform
             const int height = src.m().rows * scaleFactor;
             resize(src, scale, Size(width, height));
             scale.convertTo(scale, CV_32F);
-            scales.append(scale);
             scaleFactor /= sqrt(2.f);
-        }
 
-        // Mean and standard deviation pooling
-        QList< QList<float> > features;
-        foreach (Transform *orientation, orientations) {
-            // Compute the reponse wavelet response
-            Template response;
-            orientation->project(scales, response);
-
-            // Pool for each two adjacent features
-            QList<float> orientedFeatures;
-            for (int i=0; i<N-1; i++)
-                orientedFeatures.append(pool(response[i], response[i+1]));
-            features.append(orientedFeatures);
+            const QList<Mat> current = phases(scale);
+            if (n > 0)
+                for (int m=0; m<M; m++)
+                    features[m].append(pool(previous[m], current[m]));
+            previous = current;
         }
 
         // L2 normalization across orientations
@@ -92,31 +99,88 @@ class EBIFTransform : public UntrainableTransform
         }
     }
 
+    // Gabor(5,theta,0,3,1,Phase)+Abs for every orientation, which is filter2D with a reflected border followed by cartToPolar.
+    // The scale is padded and transformed once, then correlated with each wavelet's cached spectrum.
+    QList<Mat> phases(const Mat &scale) const
+    {
+        Mat padded;
+        copyMakeBorder(scale, padded, yRadius, yRadius, xRadius, xRadius, BORDER_REFLECT_101);
+        const Size size(getOptimalDFTSize(padded.cols), getOptimalDFTSize(padded.rows));
+        copyMakeBorder(padded, padded, 0, size.height - padded.rows, 0, size.width - padded.cols, BORDER_CONSTANT, Scalar(0));
+
+        QList<Mat> spectra;
+        for (int m=0; m<M; m++) {
+            const QString key = owner + "/" + QString::number(m);
+            Mat spectrum;
+            if (!ShapeCache::find(key, size.height, size.width, CV_32FC2, spectrum))
+                spectrum = ShapeCache::insert(key, size.height, size.width, CV_32FC2, Gabor::spectrum(kReals[m], kImaginaries[m], size));
+            spectra.append(spectrum);
+        }
+
+        QList<Mat> correlations;
+#ifdef BR_WITH_GPU
+        if (GPU::available()) GPU::correlate(padded, spectra, correlations);
+#endif // BR_WITH_GPU
+        if (correlations.isEmpty()) {
+            Mat image;
+            dft(padded, image, DFT_COMPLEX_OUTPUT);
+            foreach (const Mat &spectrum, spectra) {
+                Mat product, correlation;
+                mulSpectrums(image, spectrum, product, 0, true);
+                idft(product, correlation, DFT_SCALE | DFT_COMPLEX_OUTPUT);
+                correlations.append(correlation);
+            }
+        }
+
+        // Correlating with kReal + i*kImaginary yields real - i*imaginary, phase is already non-negative so Abs is a no-op
+        QList<Mat> dst;
+        for (int m=0; m<M; m++) {
+            const Rect roi(xRadius - kReals[m].cols/2, yRadius - kReals[m].rows/2, scale.cols, scale.rows);
+            std::vector<Mat> mv;
+            split(correlations[m](roi), mv);
+            Mat angle;
+            phase(mv[0], -mv[1], angle);
+            dst.append(angle);
+        }
+        return dst;
+    }
+
+    // Mean and standard deviation of each 3x3 cell of top and the 4x4 cell of bottom beneath it
     QList<float> pool(const Mat &bottom, const Mat &top) const
     {
         QList<float> features;
         for (int i=0; i<=top.rows-3; i+=3) {
             for (int j=0; j<=top.cols-3; j+=3) {
-                QList<float> vals; vals.reserve(3*3 + 4*4);
+                float vals[3*3 + 4*4];
+                int count = 0;
 
                 // Top values
                 for (int k=0; k<3; k++) {
                     const float *data = top.ptr<float>(i+k, j);
                     for (int l=0; l<3; l++)
-                        vals.append(data[l]);
+                        vals[count++] = data[l];
                 }
 
                 // Bottom values
                 for (int k=0; k<4; k++) {
                     const float *data = bottom.ptr<float>(4*i/3+k, 4*j/3);
                     for (int l=0; l<4; l++)
-                        vals.append(data[l]);
+                        vals[count++] = data[l];
+                }
+
+                double mean = 0;
+                for (int k=0; k<count; k++)
+                    mean += vals[k];
+                mean /= count;
+
+                double variance = 0;
+                for (int k=0; k<count; k++) {
+                    const double delta = vals[k] - mean;
+                    variance += delta * delta;
                 }
 
-                double mean, stddev;
-                Common::MeanStdDev(vals, &mean, &stddev);
                 features.append(mean);
-                features.append(stddev);
+                features.append(sqrt(variance/count));
             }
         }
 
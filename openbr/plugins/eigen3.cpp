@@ -14,15 +14,130 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
+#include <QtConcurrentRun>
+#include <QVector>
 #include <Eigen/Dense>
 #include "openbr_internal.h"
 
 #include "openbr/core/common.h"
 #include "openbr/core/eigenutils.h"
+#include "openbr/core/opencvutils.h"
 
 namespace br
 {
 
+static const int ProjectionBatchSize = 256;
+
+typedef Eigen::Map< Eigen::Matrix<float,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>, 0, Eigen::OuterStride<> > RowMajorMap;
+typedef Eigen::Map< const Eigen::Matrix<float,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>, 0, Eigen::OuterStride<> > ConstRowMajorMap;
+
+// View of a single channel float matrix with one template per row, rows are step bytes apart
+static ConstRowMajorMap rowMajorMap(const cv::Mat &m)
+{
+    return ConstRowMajorMap((const float*)m.data, m.rows, m.cols, Eigen::OuterStride<>(m.step1()));
+}
+
+// Project up to ProjectionBatchSize templates of src starting at begin with a single matrix product
+static void projectBatch(const TemplateList *src, TemplateList *dst, int begin, const Eigen::MatrixXf *projection, const Eigen::VectorXf *mean)
+{
+    const int end = std::min(begin+ProjectionBatchSize, src->size());
+    const int dimsIn = mean->size();
+    Eigen::MatrixXf in(dimsIn, end-begin);
+    for (int i=begin; i<end; i++)
+        in.col(i-begin) = Eigen::Map<const Eigen::VectorXf>((*src)[i].m().ptr<float>(), dimsIn) - *mean;
+
+    const Eigen::MatrixXf out = projection->transpose() * in;
+    for (int i=begin; i<end; i++) {
+        Template &t = (*dst)[i];
+        t.file = (*src)[i].file;
+        t = cv::Mat(1, out.rows(), CV_32FC1);
+        Eigen::Map<Eigen::VectorXf>(t.m().ptr<float>(), out.rows()) = out.col(i-begin);
+    }
+}
+
+// Stack the templates as columns and project them a batch at a time, returning false if they are not all single 32-bit vectors of the right size
+static bool projectBatches(const TemplateList &src, TemplateList &dst, const Eigen::MatrixXf &projection, const Eigen::VectorXf &mean)
+{
+    foreach (const Template &t, src)
+        if ((t.size() != 1) || (t.m().type() != CV_32FC1) || !t.m().isContinuous() || (int(t.m().total()) != mean.size()))
+            return false;
+
+    dst.clear();
+    dst.reserve(src.size());
+
+#ifdef BR_WITH_GPU
+    if ((src.size() >= ProjectionBatchSize) && GPU::available()) {
+        // Eigen's column major dimsIn x dimsOut projection is the row major dimsOut x dimsIn matrix GPU::project() takes
+        const cv::Mat projectionRows(projection.cols(), projection.rows(), CV_32FC1, (void*) projection.data());
+        const cv::Mat meanRow(1, mean.size(), CV_32FC1, (void*) mean.data());
+        cv::Mat out;
+        GPU::project(OpenCVUtils::toMat(src.data()), meanRow, projectionRows, out);
+        dst = TemplateList::fromMatrix(out, src.files());
+        return true;
+    }
+#endif // BR_WITH_GPU
+
+    for (int i=0; i<src.size(); i++)
+        dst.append(Template());
+
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<src.size(); i+=ProjectionBatchSize)
+        if (Globals->parallelism > 1) futures.addFuture(QtConcurrent::run(projectBatch, &src, &dst, i, &projection, &mean));
+        else                          projectBatch(&src, &dst, i, &projection, &mean);
+    futures.waitForFinished();
+    return true;
+}
+
+static const int TrainingBlockSize = 1024;
+
+struct CovarianceProduct
+{
+    const TemplateList *data;
+    int begin, end;
+    const Eigen::VectorXf *mean;
+    const Eigen::MatrixXf *basis;
+    Eigen::MatrixXf product;
+};
+
+// Accumulates sum((x-mean)(x-mean)^T basis) over templates [begin, end), one block of columns at a time
+static void accumulateCovarianceProduct(CovarianceProduct *job)
+{
+    const int dimsIn = job->mean->size();
+    job->product = Eigen::MatrixXf::Zero(dimsIn, job->basis->cols());
+    for (int b=job->begin; b<job->end; b+=TrainingBlockSize) {
+        const int n = std::min(b+TrainingBlockSize, job->end) - b;
+        Eigen::MatrixXf block(dimsIn, n);
+        for (int i=0; i<n; i++)
+            block.col(i) = Eigen::Map<const Eigen::VectorXf>((*job->data)[b+i].m().ptr<float>(), dimsIn) - *job->mean;
+        job->product += block * (block.transpose() * *job->basis);
+    }
+}
+
+// The unnormalized covariance of data times basis, without materializing the data matrix
+static Eigen::MatrixXf covarianceProduct(const TemplateList &data, const Eigen::VectorXf &mean, const Eigen::MatrixXf &basis)
+{
+    const int chunks = std::max(1, std::min(Globals->parallelism, (data.size() + TrainingBlockSize - 1) / TrainingBlockSize));
+    QVector<CovarianceProduct> jobs(chunks);
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<chunks; i++) {
+        CovarianceProduct &job = jobs[i];
+        job.data = &data;
+        job.begin = qint64(data.size()) * i / chunks;
+        job.end = qint64(data.size()) * (i+1) / chunks;
+        job.mean = &mean;
+        job.basis = &basis;
+        if (chunks > 1) futures.addFuture(QtConcurrent::run(accumulateCovarianceProduct, &job));
+        else            accumulateCovarianceProduct(&job);
+    }
+    futures.waitForFinished();
+
+    Eigen::MatrixXf product = jobs[0].product;
+    for (int i=1; i<chunks; i++)
+        product += jobs[i].product;
+    return product;
+}
+
 /*!
  * \ingroup transforms
  * \brief Projects input into learned Principal Component Analysis subspace.
@@ -39,6 +154,9 @@ protected:
     Q_PROPERTY(float keep READ get_keep WRITE set_keep RESET reset_keep STORED false)
     Q_PROPERTY(int drop READ get_drop WRITE set_drop RESET reset_drop STORED false)
     Q_PROPERTY(bool whiten READ get_whiten WRITE set_whiten RESET reset_whiten STORED false)
+    Q_PROPERTY(bool randomized READ get_randomized WRITE set_randomized RESET reset_randomized STORED false)
+    Q_PROPERTY(int oversample READ get_oversample WRITE set_oversample RESET reset_oversample STORED false)
+    Q_PROPERTY(int powerIterations READ get_powerIterations WRITE set_powerIterations RESET reset_powerIterations STORED false)
 
     /*!
      *     keep <  0: All eigenvalues are retained.
@@ -50,13 +168,21 @@ protected:
     BR_PROPERTY(int, drop, 0)
     BR_PROPERTY(bool, whiten, false)
 
+    /*!
+     * Randomized subspace iteration for large training sets: templates are streamed in blocks in 32-bit precision
+     * and only the leading keep + drop (+ oversample) components are estimated, keep must be >= 1.
+     */
+    BR_PROPERTY(bool, randomized, false)
+    BR_PROPERTY(int, oversample, 10)
+    BR_PROPERTY(int, powerIterations, 2)
+
     Eigen::VectorXf mean, eVals;
     Eigen::MatrixXf eVecs;
 
     int originalRows;
 
 public:
-    PCATransform() : keep(0.95), drop(0), whiten(false) {}
+    PCATransform() : keep(0.95), drop(0), whiten(false), randomized(false), oversample(10), powerIterations(2) {}
 
 private:
     double residualReconstructionError(const Template &src) const
@@ -76,6 +202,11 @@ private:
             qFatal("Requires single channel 32-bit floating point matrices.");
 
         originalRows = trainingSet.first().m().rows;
+        if (randomized) {
+            trainRandomized(trainingSet);
+            return;
+        }
+
         int dimsIn = trainingSet.first().m().rows * trainingSet.first().m().cols;
         const int instances = trainingSet.size();
 
@@ -87,6 +218,45 @@ private:
         trainCore(data);
     }
 
+    void trainRandomized(const TemplateList &trainingSet)
+    {
+        if (keep < 1) qFatal("Randomized PCA requires keep >= 1.");
+        const int dimsIn = trainingSet.first().m().rows * trainingSet.first().m().cols;
+        const int instances = trainingSet.size();
+        const int components = std::min(std::min(dimsIn, instances), (int)keep + drop + oversample);
+        if (keep + drop > components)
+            qFatal("Insufficient samples, needed at least %d but only got %d.", (int)keep + drop, components);
+
+        Eigen::VectorXd sum = Eigen::VectorXd::Zero(dimsIn);
+        foreach (const Template &t, trainingSet)
+            sum += Eigen::Map<const Eigen::VectorXf>(t.m().ptr<float>(), dimsIn).cast<double>();
+        mean = (sum / instances).cast<float>();
+
+        // Subspace iteration on the covariance from a random start
+        Eigen::MatrixXf basis = Eigen::MatrixXf::Random(dimsIn, components);
+        for (int i=0; i<=powerIterations; i++) {
+            Eigen::HouseholderQR<Eigen::MatrixXf> qr(covarianceProduct(trainingSet, mean, basis));
+            basis = qr.householderQ() * Eigen::MatrixXf::Identity(dimsIn, components);
+        }
+
+        // Rayleigh-Ritz, returns eigenvectors/eigenvalues in increasing order by eigenvalue
+        const Eigen::MatrixXf reduced = basis.transpose() * covarianceProduct(trainingSet, mean, basis) / (instances-1.0);
+        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> eSolver(reduced);
+        const Eigen::VectorXf allEVals = eSolver.eigenvalues();
+        const Eigen::MatrixXf allEVecs = basis * eSolver.eigenvectors();
+
+        eVals = Eigen::VectorXf((int)keep, 1);
+        eVecs = Eigen::MatrixXf(dimsIn, (int)keep);
+        for (int i=0; i<keep; i++) {
+            int index = components-(i+drop+1);
+            eVals(i) = allEVals(index);
+            eVecs.col(i) = allEVecs.col(index) / allEVecs.col(index).norm();
+            if (whiten) eVecs.col(i) /= sqrt(eVals(i));
+        }
+
+        if (Globals->verbose) qDebug() << "Randomized PCA Training:\n\tDimsIn =" << dimsIn << "\n\tKeep =" << keep;
+    }
+
     void project(const Template &src, Template &dst) const
     {
         dst = cv::Mat(1, keep, CV_32FC1);
@@ -99,6 +269,12 @@ private:
         outMap = eVecs.transpose() * (inMap - mean);
     }
 
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (!projectBatches(src, dst, eVecs, mean))
+            Transform::project(src, dst);
+    }
+
     void store(QDataStream &stream) const
     {
         stream << keep << drop << whiten << originalRows << mean << eVals << eVecs;
@@ -493,6 +669,12 @@ class LDATransform : public Transform
         outMap = projection.transpose() * (inMap - mean);
     }
 
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (!projectBatches(src, dst, projection, mean))
+            Transform::project(src, dst);
+    }
+
     void store(QDataStream &stream) const
     {
         stream << pcaKeep << directLDA << directDrop << dimsOut << mean << projection;
@@ -522,6 +704,20 @@ class L1Distance : public Distance
         Eigen::Map<Eigen::VectorXf> bMap((float*)b.m().data, size);
         return (aMap-bMap).cwiseAbs().sum();
     }
+
+    bool compare(const cv::Mat &targets, const cv::Mat &query, float *scores) const
+    {
+        if (targets.type() != CV_32FC1) return false;
+        Eigen::Map< const Eigen::Matrix<float,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>, 0, Eigen::OuterStride<> > targetsMap((const float*)targets.data, targets.rows, targets.cols, Eigen::OuterStride<>(targets.step1()));
+        Eigen::Map<const Eigen::RowVectorXf> queryMap((const float*)query.data, query.cols);
+        Eigen::Map<Eigen::VectorXf>(scores, targets.rows) = (targetsMap.rowwise()-queryMap).cwiseAbs().rowwise().sum();
+        return true;
+    }
+
+    bool symmetric() const
+    {
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, L1Distance)
@@ -542,10 +738,100 @@ class L2Distance : public Distance
         Eigen::Map<Eigen::VectorXf> bMap((float*)b.m().data, size);
         return (aMap-bMap).squaredNorm();
     }
+
+    bool compare(const cv::Mat &targets, const cv::Mat &query, float *scores) const
+    {
+        if (targets.type() != CV_32FC1) return false;
+        Eigen::Map< const Eigen::Matrix<float,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>, 0, Eigen::OuterStride<> > targetsMap((const float*)targets.data, targets.rows, targets.cols, Eigen::OuterStride<>(targets.step1()));
+        Eigen::Map<const Eigen::RowVectorXf> queryMap((const float*)query.data, query.cols);
+        Eigen::Map<Eigen::VectorXf>(scores, targets.rows) = (targetsMap.rowwise()-queryMap).rowwise().squaredNorm();
+        return true;
+    }
+
+    // ||a-b||^2 = ||a||^2 + ||b||^2 - 2a.b, so the tile is one matrix product plus the norms of its rows
+    bool compare(const cv::Mat &targets, const cv::Mat &queries, cv::Mat &scores) const
+    {
+        if ((targets.type() != CV_32FC1) || (queries.type() != CV_32FC1)) return false;
+        const ConstRowMajorMap targetsMap = rowMajorMap(targets), queriesMap = rowMajorMap(queries);
+        RowMajorMap scoresMap((float*)scores.data, scores.rows, scores.cols, Eigen::OuterStride<>(scores.step1()));
+        scoresMap.noalias() = (-2.f * queriesMap) * targetsMap.transpose();
+        scoresMap.colwise() += queriesMap.rowwise().squaredNorm();
+        scoresMap.rowwise() += targetsMap.rowwise().squaredNorm().transpose();
+        scoresMap = scoresMap.cwiseMax(0.f); // Rounding can leave identical pairs slightly negative
+        return true;
+    }
+
+    bool symmetric() const
+    {
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, L2Distance)
 
+/*!
+ * \ingroup distances
+ * \brief Cosine similarity computed using eigen.
+ *
+ * Scores match Dist(Cosine), except that a template with zero norm scores \c 0 instead of \c NaN.
+ * \author Josh Klontz \cite jklontz
+ */
+class CosineDistance : public Distance
+{
+    Q_OBJECT
+
+    static float inverseNorm(float squaredNorm)
+    {
+        return squaredNorm > 0 ? 1 / std::sqrt(squaredNorm) : 0;
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        const int size = a.m().rows * a.m().cols;
+        Eigen::Map<Eigen::VectorXf> aMap((float*)a.m().data, size);
+        Eigen::Map<Eigen::VectorXf> bMap((float*)b.m().data, size);
+        return aMap.dot(bMap) * inverseNorm(aMap.squaredNorm()) * inverseNorm(bMap.squaredNorm());
+    }
+
+    bool compare(const cv::Mat &targets, const cv::Mat &query, float *scores) const
+    {
+        if (targets.type() != CV_32FC1) return false;
+        const ConstRowMajorMap targetsMap = rowMajorMap(targets);
+        Eigen::Map<const Eigen::RowVectorXf> queryMap((const float*)query.data, query.cols);
+        Eigen::Map<Eigen::VectorXf> scoresMap(scores, targets.rows);
+        scoresMap.noalias() = targetsMap * queryMap.transpose();
+        for (int i=0; i<targets.rows; i++)
+            scores[i] *= inverseNorm(targetsMap.row(i).squaredNorm());
+        scoresMap *= inverseNorm(queryMap.squaredNorm());
+        return true;
+    }
+
+    // The tile is one matrix product scaled by the inverse norms of its rows and columns
+    bool compare(const cv::Mat &targets, const cv::Mat &queries, cv::Mat &scores) const
+    {
+        if ((targets.type() != CV_32FC1) || (queries.type() != CV_32FC1)) return false;
+        const ConstRowMajorMap targetsMap = rowMajorMap(targets), queriesMap = rowMajorMap(queries);
+        RowMajorMap scoresMap((float*)scores.data, scores.rows, scores.cols, Eigen::OuterStride<>(scores.step1()));
+        scoresMap.noalias() = queriesMap * targetsMap.transpose();
+
+        Eigen::VectorXf queryNorms(queries.rows);
+        for (int i=0; i<queries.rows; i++)
+            queryNorms[i] = inverseNorm(queriesMap.row(i).squaredNorm());
+        Eigen::RowVectorXf targetNorms(targets.rows);
+        for (int j=0; j<targets.rows; j++)
+            targetNorms[j] = inverseNorm(targetsMap.row(j).squaredNorm());
+        scoresMap = queryNorms.asDiagonal() * scoresMap * targetNorms.asDiagonal();
+        return true;
+    }
+
+    bool symmetric() const
+    {
+        return true;
+    }
+};
+
+BR_REGISTER(Distance, CosineDistance)
+
 } // namespace br
 
 #include "eigen3.moc"
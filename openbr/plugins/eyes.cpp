@@ -35,6 +35,7 @@
 
 #include <opencv2/imgproc/imgproc.hpp>
 #include "openbr_internal.h"
+#include "openbr/core/arena.h"
 #include "openbr/core/opencvutils.h"
 
 using namespace cv;
@@ -58,6 +59,7 @@ class ASEFEyesTransform : public UntrainableTransform
     Mat left_filter_dft, right_filter_dft, lut;
     Rect left_rect, right_rect;
     int width, height;
+    int left_rows, right_rows; // Rows of each correlation that contain its search rectangle
 
 public:
     ASEFEyesTransform()
@@ -138,6 +140,10 @@ public:
         dft(left_filter, left_filter_dft, CV_DXT_FORWARD);
         dft(right_filter, right_filter_dft, CV_DXT_FORWARD);
 
+        // The inverse transforms only need to produce rows down to the bottom of each search rectangle
+        left_rows = std::min(left_rect.y + left_rect.height, r);
+        right_rows = std::min(right_rect.y + right_rect.height, r);
+
         // Create the look up table for the log transform
         lut = Mat(256, 1, CV_32F);
         for (int i=0; i<256; i++) lut.at<float>(i, 0) = std::log((float)i+1);
@@ -151,21 +157,23 @@ private:
         Mat gray;
         OpenCVUtils::cvtGray(src.m()(roi), gray);
 
-        Mat image_tile;
+        Mat image_tile = MatArena::get(height, width, CV_8UC1);
         // (r,c) == (128, 128) EyeLocatorASEF128x128.fel
-        resize(gray, image_tile, Size(height, width));
+        resize(gray, image_tile, Size(width, height));
 
         // _preprocess
-        Mat image;
+        Mat image = MatArena::get(height, width, CV_32FC1);
         LUT(image_tile, lut, image);
+        MatArena::put(image_tile);
 
-        // correlate
-        Mat left_corr, right_corr;
+        // correlate, sharing the face spectrum between both filters
+        Mat left_corr = MatArena::get(height, width, CV_32FC1), right_corr = MatArena::get(height, width, CV_32FC1);
         dft(image, image, CV_DXT_FORWARD);
         mulSpectrums(image, left_filter_dft, left_corr, 0, true);
         mulSpectrums(image, right_filter_dft, right_corr, 0, true);
-        dft(left_corr, left_corr, CV_DXT_INV_SCALE);
-        dft(right_corr, right_corr, CV_DXT_INV_SCALE);
+        MatArena::put(image);
+        dft(left_corr, left_corr, CV_DXT_INV_SCALE, left_rows);
+        dft(right_corr, right_corr, CV_DXT_INV_SCALE, right_rows);
 
         // locateEyes
         double minVal, maxVal;
@@ -181,6 +189,9 @@ private:
         float second_eye_x = (right_rect.x + maxLoc.x)*gray.cols/width+roi.x;
         float second_eye_y = (right_rect.y + maxLoc.y)*gray.rows/height+roi.y;
 
+        MatArena::put(left_corr);
+        MatArena::put(right_corr);
+
         dst.m() = src.m();
         dst.file.appendPoint(QPointF(first_eye_x, first_eye_y));
         dst.file.appendPoint(QPointF(second_eye_x, second_eye_y));
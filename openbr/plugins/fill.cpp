@@ -14,6 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
+#include <QtConcurrentRun>
 #include <opencv2/photo/photo.hpp>
 #include "openbr_internal.h"
 
@@ -25,6 +27,9 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Wraps OpenCV inpainting
+ *
+ * Only the \em tileSize square tiles with pixels to fill are inpainted, concurrently, each padded by \em overlap pixels of context.
+ * Holes much larger than \em overlap may be filled differently than when inpainting the whole image, a \em tileSize of zero does that.
  * \author Josh Klontz \cite jklontz
  */
 class InpaintTransform : public UntrainableTransform
@@ -33,6 +38,8 @@ class InpaintTransform : public UntrainableTransform
     Q_ENUMS(Method)
     Q_PROPERTY(int radius READ get_radius WRITE set_radius RESET reset_radius STORED false)
     Q_PROPERTY(Method method READ get_method WRITE set_method RESET reset_method STORED false)
+    Q_PROPERTY(int tileSize READ get_tileSize WRITE set_tileSize RESET reset_tileSize STORED false)
+    Q_PROPERTY(int overlap READ get_overlap WRITE set_overlap RESET reset_overlap STORED false)
 
 public:
     /*!< */
@@ -42,6 +49,8 @@ public:
 private:
     BR_PROPERTY(int, radius, 1)
     BR_PROPERTY(Method, method, NavierStokes)
+    BR_PROPERTY(int, tileSize, 256)
+    BR_PROPERTY(int, overlap, 32)
     Transform *cvtGray;
 
     void init()
@@ -49,9 +58,33 @@ private:
         cvtGray = make("Cvt(Gray)");
     }
 
+    void inpaintTile(const Mat *src, const Mat *mask, Mat *dst, Rect tile) const
+    {
+        const Rect padded = Rect(tile.x - overlap, tile.y - overlap, tile.width + 2*overlap, tile.height + 2*overlap) & Rect(0, 0, src->cols, src->rows);
+        Mat inpainted;
+        inpaint((*src)(padded), (*mask)(padded), inpainted, radius, method);
+        inpainted(Rect(tile.tl() - padded.tl(), tile.size())).copyTo((*dst)(tile));
+    }
+
     void project(const Template &src, Template &dst) const
     {
-        inpaint(src, (*cvtGray)(src)<5, dst, radius, method);
+        const Mat &m = src;
+        const Mat mask = (*cvtGray)(src)<5;
+        if (tileSize <= 0) {
+            inpaint(m, mask, dst, radius, method);
+            return;
+        }
+
+        Mat result = m.clone();
+        QFutureSynchronizer<void> futures;
+        for (int y=0; y<m.rows; y+=tileSize)
+            for (int x=0; x<m.cols; x+=tileSize) {
+                const Rect tile(x, y, std::min(tileSize, m.cols - x), std::min(tileSize, m.rows - y));
+                if (countNonZero(mask(tile)) == 0) continue;
+                futures.addFuture(QtConcurrent::run(this, &InpaintTransform::inpaintTile, &m, &mask, &result, tile));
+            }
+        futures.waitForFinished();
+        dst = result;
     }
 };
 
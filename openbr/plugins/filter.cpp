@@ -16,6 +16,8 @@
 
 #include <opencv2/imgproc/imgproc.hpp>
 #include "openbr_internal.h"
+#include "openbr/core/arena.h"
+#include "openbr/core/shapecache.h"
 #include "openbr/core/tanh_sse.h"
 
 using namespace cv;
@@ -23,6 +25,23 @@ using namespace cv;
 namespace br
 {
 
+static Size getGaussianKernelSize(double sigma)
+{
+    // Inverts OpenCV's conversion from kernel size to sigma:
+    // sigma = ((ksize-1)*0.5 - 1)*0.3 + 0.8
+    // See documentation for cv::getGaussianKernel()
+    int ksize = ((sigma - 0.8) / 0.3 + 1) * 2 + 1;
+    if (ksize % 2 == 0) ksize++;
+    return Size(ksize, ksize);
+}
+
+static void makeGammaLUT(float gamma, Mat &lut)
+{
+    lut.create(256, 1, CV_32FC1);
+    if (gamma == 0) for (int i=0; i<256; i++) lut.at<float>(i,0) = log((float)i);
+    else            for (int i=0; i<256; i++) lut.at<float>(i,0) = pow(i, gamma);
+}
+
 /*!
  * \ingroup transforms
  * \brief Gamma correction
@@ -38,9 +57,7 @@ class GammaTransform : public UntrainableTransform
 
     void init()
     {
-        lut.create(256, 1, CV_32FC1);
-        if (gamma == 0) for (int i=0; i<256; i++) lut.at<float>(i,0) = log((float)i);
-        else            for (int i=0; i<256; i++) lut.at<float>(i,0) = pow(i, gamma);
+        makeGammaLUT(gamma, lut);
     }
 
     void project(const Template &src, Template &dst) const
@@ -51,6 +68,16 @@ class GammaTransform : public UntrainableTransform
 
 BR_REGISTER(Transform, GammaTransform)
 
+// The separable kernel GaussianBlur() would build for an input of the given depth, computed once per owner
+static Mat gaussianKernel(const QString &owner, int ksize, double sigma, int depth)
+{
+    const int ktype = std::max(depth, CV_32F);
+    Mat kernel;
+    if (!ShapeCache::find(owner, ksize, 1, ktype, kernel))
+        kernel = ShapeCache::insert(owner, ksize, 1, ktype, getGaussianKernel(ksize, sigma, ktype));
+    return kernel;
+}
+
 /*!
  * \ingroup transforms
  * \brief Gaussian blur
@@ -62,9 +89,25 @@ class BlurTransform : public UntrainableTransform
     Q_PROPERTY(float sigma READ get_sigma WRITE set_sigma RESET reset_sigma STORED false)
     BR_PROPERTY(float, sigma, 1)
 
+    QString owner;
+
+    void init()
+    {
+        owner = description();
+    }
+
     void project(const Template &src, Template &dst) const
     {
-        GaussianBlur(src, dst, Size(0,0), sigma);
+        const int depth = src.m().depth();
+        const int ksize = cvRound(sigma*(depth == CV_8U ? 3 : 4)*2 + 1) | 1;
+        Mat m = MatArena::get(src.m().rows, src.m().cols, src.m().type());
+        if (ksize == 1) {
+            src.m().copyTo(m);
+        } else {
+            const Mat kernel = gaussianKernel(owner, ksize, sigma, depth);
+            sepFilter2D(src, m, -1, kernel, kernel);
+        }
+        dst = m;
     }
 };
 
@@ -84,28 +127,23 @@ class DoGTransform : public UntrainableTransform
     BR_PROPERTY(float, sigma1, 2)
 
     Size ksize0, ksize1;
-
-    static Size getKernelSize(double sigma)
-    {
-        // Inverts OpenCV's conversion from kernel size to sigma:
-        // sigma = ((ksize-1)*0.5 - 1)*0.3 + 0.8
-        // See documentation for cv::getGaussianKernel()
-        int ksize = ((sigma - 0.8) / 0.3 + 1) * 2 + 1;
-        if (ksize % 2 == 0) ksize++;
-        return Size(ksize, ksize);
-    }
+    QString owner;
 
     void init()
     {
-        ksize0 = getKernelSize(sigma0);
-        ksize1 = getKernelSize(sigma1);
+        ksize0 = getGaussianKernelSize(sigma0);
+        ksize1 = getGaussianKernelSize(sigma1);
+        owner = description();
     }
 
     void project(const Template &src, Template &dst) const
     {
+        const int depth = src.m().depth();
+        const Mat k0 = gaussianKernel(owner, ksize0.width, 0, depth);
+        const Mat k1 = gaussianKernel(owner, ksize1.width, 0, depth);
         Mat g0, g1;
-        GaussianBlur(src, g0, ksize0, 0);
-        GaussianBlur(src, g1, ksize1, 0);
+        sepFilter2D(src, g0, -1, k0, k0);
+        sepFilter2D(src, g1, -1, k1, k1);
         subtract(g0, g1, dst);
     }
 };
@@ -217,6 +255,101 @@ class ContrastEqTransform : public UntrainableTransform
 
 BR_REGISTER(Transform, ContrastEqTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Fused <tt>Blur(sigma)+Gamma(gamma)+DoG(sigma0,sigma1)+ContrastEq(a,t)</tt>.
+ *
+ * Computes the difference of gaussians in place and folds both contrast equalization stages and the
+ * hyperbolic tangent into three passes over it, matching the separate transforms within float tolerance.
+ * \author Josh Klontz \cite jklontz
+ * \see ContrastEqTransform
+ */
+class TanTriggsTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(float sigma READ get_sigma WRITE set_sigma RESET reset_sigma STORED false)
+    Q_PROPERTY(float gamma READ get_gamma WRITE set_gamma RESET reset_gamma STORED false)
+    Q_PROPERTY(float sigma0 READ get_sigma0 WRITE set_sigma0 RESET reset_sigma0 STORED false)
+    Q_PROPERTY(float sigma1 READ get_sigma1 WRITE set_sigma1 RESET reset_sigma1 STORED false)
+    Q_PROPERTY(float a READ get_a WRITE set_a RESET reset_a STORED false)
+    Q_PROPERTY(float t READ get_t WRITE set_t RESET reset_t STORED false)
+    BR_PROPERTY(float, sigma, 1.1)
+    BR_PROPERTY(float, gamma, 0.2)
+    BR_PROPERTY(float, sigma0, 1)
+    BR_PROPERTY(float, sigma1, 2)
+    BR_PROPERTY(float, a, 0.1)
+    BR_PROPERTY(float, t, 10)
+
+    Mat lut;
+    Size ksize0, ksize1;
+
+    void init()
+    {
+        makeGammaLUT(gamma, lut);
+        ksize0 = getGaussianKernelSize(sigma0);
+        ksize1 = getGaussianKernelSize(sigma1);
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        // Colour images are equalized on their luminance
+        Mat gray;
+        switch (src.m().channels()) {
+          case 1: gray = src.m(); break;
+          case 3: cvtColor(src, gray, CV_BGR2GRAY); break;
+          case 4: cvtColor(src, gray, CV_BGRA2GRAY); break;
+          default: qFatal("Expected 1, 3, or 4 channel source matrix.");
+        }
+
+        const int rows = gray.rows, cols = gray.cols;
+        const bool bytes = (gray.depth() == CV_8U);
+        Mat blurred = MatArena::get(rows, cols, bytes ? CV_8UC1 : CV_32FC1), corrected = MatArena::get(rows, cols, CV_32FC1),
+            g0 = MatArena::get(rows, cols, CV_32FC1), g1 = MatArena::get(rows, cols, CV_32FC1);
+        if (bytes) {
+            GaussianBlur(gray, blurred, Size(0,0), sigma);
+            LUT(blurred, lut, corrected);
+        } else {
+            // Other depths have no lookup table, so gamma is computed as Gamma would for 8-bit values
+            gray.convertTo(corrected, CV_32F);
+            GaussianBlur(corrected, blurred, Size(0,0), sigma);
+            if (gamma == 0) log(blurred, corrected);
+            else            pow(blurred, gamma, corrected);
+        }
+        GaussianBlur(corrected, g0, ksize0, 0);
+        GaussianBlur(corrected, g1, ksize1, 0);
+
+        const int n = g0.rows * g0.cols;
+        float *d = (float*)g0.ptr();
+        const float *p = (const float*)g1.ptr();
+
+        // Difference of gaussians and the first stage statistic
+        double sum = 0;
+        for (int i=0; i<n; i++) {
+            d[i] -= p[i];
+            sum += pow(fabs(d[i]), a);
+        }
+        const float scale1 = 1/pow((float)(sum/n), 1.f/a);
+
+        // Second stage statistic
+        sum = 0;
+        for (int i=0; i<n; i++)
+            sum += pow(std::min(fabs(d[i]*scale1), t), a);
+        const float scale2 = 1/pow((float)(sum/n), 1.f/a);
+
+        // Hyperbolic tangent
+        for (int i=0; i<n; i++)
+            d[i] = fast_tanh((d[i]*scale1)*scale2);
+
+        // The intermediates go back to this thread's arena for the next face
+        MatArena::put(blurred);
+        MatArena::put(corrected);
+        MatArena::put(g1);
+        dst = g0;
+    }
+};
+
+BR_REGISTER(Transform, TanTriggsTransform)
+
 /*!
  * \ingroup transforms
  * \brief Raise each element to the specified power.
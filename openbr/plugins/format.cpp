@@ -16,10 +16,14 @@
 
 #include <QDate>
 #include <QSize>
+#include <QThread>
+#include <QWaitCondition>
 #ifndef BR_EMBEDDED
+#include <QImageReader>
 #include <QtXml>
 #endif // BR_EMBEDDED
 #include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 #include "openbr_internal.h"
 
 #include "openbr/core/bee.h"
@@ -46,25 +50,21 @@ public:
         if (!file.exists() )
             return Template();
         
+        // Constructing the capture opens the file, opening it again would decode the header twice
         VideoCapture videoSource(file.name.toStdString());
-        videoSource.open(file.name.toStdString() );
-        
-    
+
         Template frames;
         if (!videoSource.isOpened()) {
             qWarning("video file open failed");
             return frames;
         }
 
-        bool open = true;
-        while(open) {
-            cv::Mat frame;
-            open = videoSource.read(frame);
-            if (!open) break;
+        const int frameCount = int(videoSource.get(CV_CAP_PROP_FRAME_COUNT));
+        if (frameCount > 0) frames.reserve(frameCount);
 
-            frames.append(cv::Mat());
-            frames.back() = frame.clone();
-        }
+        cv::Mat frame;
+        while (videoSource.read(frame))
+            frames.append(frame.clone());
 
         return frames;
     }
@@ -198,12 +198,39 @@ BR_REGISTER(Format, csvFormat)
 /*!
  * \ingroup formats
  * \brief Reads image files.
+ *
+ * If the file has a \c maxSize (set by OpenTransform), JPEGs are decoded at the largest power of two reduction
+ * (DCT scaling) that keeps the longer side at least \c maxSize.
  * \author Josh Klontz \cite jklontz
  */
 class DefaultFormat : public Format
 {
     Q_OBJECT
 
+#ifndef BR_EMBEDDED
+    static Mat readReduced(const QString &fileName, int maxSize)
+    {
+        QImageReader reader(fileName);
+        const QSize size = reader.size();
+        if (!size.isValid()) return Mat();
+
+        int denominator = 1;
+        while ((denominator < 8) && (std::max(size.width(), size.height()) / (denominator*2) >= maxSize))
+            denominator *= 2;
+        if (denominator == 1) return Mat();
+
+        // libjpeg produces exactly this size when scaling by 1/denominator
+        reader.setScaledSize(QSize((size.width()+denominator-1)/denominator, (size.height()+denominator-1)/denominator));
+        QImage image = reader.read();
+        if (image.isNull()) return Mat();
+        image = image.convertToFormat(QImage::Format_RGB888);
+
+        Mat bgr;
+        cvtColor(Mat(image.height(), image.width(), CV_8UC3, image.bits(), image.bytesPerLine()), bgr, CV_RGB2BGR);
+        return bgr;
+    }
+#endif // BR_EMBEDDED
+
     Template read() const
     {
         Template t;
@@ -216,7 +243,15 @@ class DefaultFormat : public Format
                 t = url->read();
             }
         } else {
-            Mat m = imread(file.resolved().toStdString());
+            Mat m;
+#ifndef BR_EMBEDDED
+            const int maxSize = file.get<int>("maxSize", -1);
+            const QString suffix = file.suffix().toLower();
+            if ((maxSize > 0) && ((suffix == "jpg") || (suffix == "jpeg")))
+                m = readReduced(file.resolved(), maxSize);
+#endif // BR_EMBEDDED
+            if (!m.data)
+                m = imread(file.resolved().toStdString());
             if (m.data) {
                 t.append(m);
             } else {
@@ -602,23 +637,85 @@ BR_REGISTER(Format, rawFormat)
 
 /*!
  * \ingroup formats
- * \brief Retrieves an image from a webcam.
+ * \brief Retrieves the freshest image from a webcam.
+ *
+ * A capture thread reads the camera continuously and keeps only its newest frame,
+ * so frames buffered by the driver while the caller was busy are dropped rather than returned late.
  * \author Josh Klontz \cite jklontz
  */
 class webcamFormat : public Format
 {
     Q_OBJECT
 
+    class Grabber : public QThread
+    {
+        VideoCapture videoCapture;
+        QMutex lock;
+        QWaitCondition updated;
+        Mat latest;
+        bool fresh, stopping, failed;
+        int dropped;
+
+        void run()
+        {
+            forever {
+                Mat m;
+                const bool res = videoCapture.read(m);
+
+                QMutexLocker locker(&lock);
+                if (stopping) return;
+                if (!res) {
+                    failed = true;
+                    updated.wakeAll();
+                    return;
+                }
+                if (fresh) dropped++;
+                latest = m.clone();
+                fresh = true;
+                updated.wakeAll();
+            }
+        }
+
+    public:
+        Grabber() : videoCapture(0), fresh(false), stopping(false), failed(!videoCapture.isOpened()), dropped(0)
+        {
+            if (!failed) start();
+        }
+
+        ~Grabber()
+        {
+            {
+                QMutexLocker locker(&lock);
+                stopping = true;
+            }
+            wait();
+            if (dropped > 0)
+                qDebug("Dropped %d stale webcam frames.", dropped);
+        }
+
+        Mat next()
+        {
+            QMutexLocker locker(&lock);
+            while (!fresh && !failed)
+                updated.wait(&lock);
+            if (!fresh) return Mat();
+            fresh = false;
+            return latest;
+        }
+    };
+
     Template read() const
     {
-        static QScopedPointer<VideoCapture> videoCapture;
+        static QScopedPointer<Grabber> grabber;
+        static QMutex mutex;
 
-        if (videoCapture.isNull())
-            videoCapture.reset(new VideoCapture(0));
+        {
+            QMutexLocker locker(&mutex);
+            if (grabber.isNull())
+                grabber.reset(new Grabber());
+        }
 
-        Mat m;
-        videoCapture->read(m);
-        return Template(m);
+        return Template(grabber->next());
     }
 
     void write(const Template &t) const
@@ -31,7 +31,9 @@ private:
     {
         buffer.append(src);
         if (buffer.size() < n) return;
+        // Matrices are shared with the buffered frames, not copied
         Template out;
+        out.reserve(n);
         foreach (const Template &t, buffer) out.append(t);
         out.file = buffer.takeFirst().file;
         dst.append(out);
@@ -62,6 +64,7 @@ BR_REGISTER(Transform, AggregateFrames)
  * \author Austin Blanton \cite imaus10
  *
  * For a video with m frames, DropFrames will pass on m/n frames.
+ * As the first transform of a Stream, the stream only reads the frames DropFrames keeps.
  */
 class DropFrames : public UntrainableMetaTransform
 {
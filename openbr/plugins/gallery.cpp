@@ -14,17 +14,30 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QDateTime>
+#include <QFileInfo>
+#include <QReadWriteLock>
 #include <QRegularExpression>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThread>
+#include <QThreadPool>
+#include <QFutureSynchronizer>
 #include <QtConcurrentRun>
 #ifndef BR_EMBEDDED
 #include <QNetworkAccessManager>
 #include <QNetworkReply>
 #include <QSqlDatabase>
+#include <QSqlDriver>
 #include <QSqlError>
 #include <QSqlQuery>
 #include <QSqlRecord>
 #endif // BR_EMBEDDED
 #include <opencv2/highgui/highgui.hpp>
+#include <algorithm>
+#include <limits>
+#include <math.h>
+#include <string.h>
 #include "openbr_internal.h"
 
 #include "openbr/core/bee.h"
@@ -88,6 +101,18 @@ BR_REGISTER(Gallery, arffGallery)
  *
  * Designed to be a literal translation of templates to disk.
  * Compatible with TemplateList::fromBuffer.
+ *
+ * An append-only <tt>.index</tt> file next to the gallery records the offset and br::File of every template,
+ * so files() and appending with deduplication don't read the templates.
+ * A missing or stale index is rebuilt from the gallery the first time it is needed.
+ * The index also gives random access to blocks, which may be read from several threads at once.
+ *
+ * Templates are deleted by name with <tt>delete=[name1,name2]</tt>, or replaced by writing with <tt>replace=true</tt>,
+ * which deletes the templates of the same name written before the gallery was opened.
+ * Deleted templates are recorded in an append-only <tt>.tombstones</tt> file and skipped by every read, so they are never compared.
+ * Once \em compact (default \c 0.5) of the templates are deleted the live ones are rewritten to a new gallery in the background,
+ * readers only wait while the files are swapped.
+ * Set \em matrices to the indices of the template matrices to write, e.g. <tt>targets.gal[matrices=[0]]</tt> keeps only the first.
  * \author Josh Klontz \cite jklontz
  */
 class galGallery : public Gallery
@@ -95,33 +120,196 @@ class galGallery : public Gallery
     Q_OBJECT
     QFile gallery;
     QDataStream stream;
+    QFile index;
+    QDataStream indexStream;
+    QFile tombstones;
+    QDataStream tombstoneStream;
+    bool appending, replacing;
+    QList<int> keepMatrices; // Indices of the matrices written, all of them if empty
+    float compactFraction;
+    qint64 sessionBegin; // Templates before this offset were written before the gallery was opened
+
+    // Held for reading while the files are in use and for writing while compaction swaps them
+    QReadWriteLock filesLock;
+
+    QMutex offsetsLock;
+    QList<qint64> offsets; // Of each live template, loaded by the first random access
+    bool offsetsLoaded;
+    QSet<qint64> dead; // Offsets of the deleted templates
+
+    // Offsets of the live templates by name, loaded by the first delete or replace
+    QHash<QString, QList<qint64> > names;
+    bool namesLoaded;
+    int liveCount;
+    QFuture<void> compaction;
+
+public:
+    galGallery() : filesLock(QReadWriteLock::Recursive) {}
 
+    ~galGallery()
+    {
+        compaction.waitForFinished();
+    }
+
+private:
     void init()
     {
         gallery.setFileName(file);
-        if (file.get<bool>("remove"))
+        index.setFileName(file.name + ".index");
+        tombstones.setFileName(file.name + ".tombstones");
+        if (file.get<bool>("remove")) {
             gallery.remove();
+            index.remove();
+            tombstones.remove();
+        }
+        recover();
         QtUtils::touchDir(gallery);
         QFile::OpenMode mode = QFile::ReadWrite;
 
-        if (file.get<bool>("append"))
+        appending = file.get<bool>("append");
+        if (appending)
             mode |= QFile::Append;
+        replacing = file.get<bool>("replace");
+        keepMatrices = file.getList<int>("matrices", QList<int>());
+        compactFraction = file.get<float>("compact", 0.5);
 
         if (!gallery.open(mode))
             qFatal("Can't open gallery: %s", qPrintable(gallery.fileName()));
         stream.setDevice(&gallery);
+        sessionBegin = gallery.size();
+
+        // Galleries remain usable without an index, e.g. in a read-only directory
+        if (index.open(QFile::ReadWrite | QFile::Append))
+            indexStream.setDevice(&index);
+        offsetsLoaded = false;
+        namesLoaded = false;
+        liveCount = 0;
+
+        dead.clear();
+        if (tombstones.open(QFile::ReadWrite | QFile::Append)) {
+            tombstoneStream.setDevice(&tombstones);
+            QDataStream tombstoneReader(&tombstones);
+            tombstones.seek(0);
+            while (!tombstoneReader.atEnd()) {
+                qint64 offset;
+                tombstoneReader >> offset;
+                dead.insert(offset);
+            }
+        }
+
+        if (file.contains("delete")) {
+            QReadLocker locker(&filesLock);
+            foreach (const QString &name, file.getList<QString>("delete"))
+                remove(name, gallery.size());
+        }
+    }
+
+    int blockCount()
+    {
+        QReadLocker filesLocker(&filesLock);
+        QMutexLocker locker(&offsetsLock);
+        if (!offsetsLoaded) {
+            FileList files;
+            offsets.clear();
+            if (!readLiveIndex(files, offsets))
+                offsets.clear();
+            offsetsLoaded = true;
+        }
+
+        if (offsets.isEmpty() && (gallery.size() > 0) && dead.isEmpty())
+            return -1;
+        return (offsets.size() + Globals->blockSize - 1) / Globals->blockSize;
+    }
+
+    TemplateList readBlockAt(int block)
+    {
+        QReadLocker filesLocker(&filesLock);
+        if (blockCount() < 0)
+            return Gallery::readBlockAt(block);
+
+        QList<qint64> blockOffsets;
+        {
+            QMutexLocker locker(&offsetsLock);
+            blockOffsets = offsets.mid(block * Globals->blockSize, Globals->blockSize);
+        }
+        TemplateList templates;
+        if (blockOffsets.isEmpty())
+            return templates;
+
+        // Each call reads through its own handle so blocks can be loaded concurrently
+        QFile reader(gallery.fileName());
+        if (!reader.open(QFile::ReadOnly))
+            qFatal("Can't read block %d of gallery: %s", block, qPrintable(gallery.fileName()));
+        QDataStream blockReader(&reader);
+        templates.reserve(blockOffsets.size());
+        foreach (qint64 offset, blockOffsets) {
+            // Consecutive live templates don't need a seek
+            if ((reader.pos() != offset) && !reader.seek(offset))
+                qFatal("Can't read block %d of gallery: %s", block, qPrintable(gallery.fileName()));
+            Template t;
+            blockReader >> t;
+            templates.append(t);
+        }
+        return templates;
+    }
+
+    // Orders requested templates by their offset in the gallery
+    struct ByOffset
+    {
+        const QList<qint64> *offsets;
+        bool operator()(const QPair<int,int> &a, const QPair<int,int> &b) const { return (*offsets)[a.second] < (*offsets)[b.second]; }
+    };
+
+    TemplateList readAt(const QList<int> &indices)
+    {
+        QReadLocker filesLocker(&filesLock);
+        if (blockCount() < 0)
+            return Gallery::readAt(indices);
+
+        QList<qint64> liveOffsets;
+        {
+            QMutexLocker locker(&offsetsLock);
+            liveOffsets = offsets;
+        }
+
+        // Read in file order through a handle of our own, seeking past the templates that weren't requested
+        QVector< QPair<int,int> > requests(indices.size()); // (position, template)
+        for (int i=0; i<indices.size(); i++) {
+            if ((indices[i] < 0) || (indices[i] >= liveOffsets.size()))
+                qFatal("Template %d out of range of gallery: %s", indices[i], qPrintable(gallery.fileName()));
+            requests[i] = qMakePair(i, indices[i]);
+        }
+        ByOffset byOffset;
+        byOffset.offsets = &liveOffsets;
+        std::sort(requests.begin(), requests.end(), byOffset);
+
+        QFile reader(gallery.fileName());
+        if (!reader.open(QFile::ReadOnly))
+            qFatal("Can't read gallery: %s", qPrintable(gallery.fileName()));
+        QDataStream templateReader(&reader);
+        QVector<Template> templates(indices.size());
+        for (int i=0; i<requests.size(); i++) {
+            const qint64 offset = liveOffsets[requests[i].second];
+            if ((reader.pos() != offset) && !reader.seek(offset))
+                qFatal("Can't read template %d of gallery: %s", requests[i].second, qPrintable(gallery.fileName()));
+            templateReader >> templates[requests[i].first];
+        }
+        return templates.toList();
     }
 
     TemplateList readBlock(bool *done)
     {
+        QReadLocker filesLocker(&filesLock);
         if (stream.atEnd())
             gallery.seek(0);
 
         TemplateList templates;
         while ((templates.size() < Globals->blockSize) && !stream.atEnd()) {
+            const qint64 offset = gallery.pos();
             Template m;
             stream >> m;
-            templates.append(m);
+            if (!isDead(offset))
+                templates.append(m);
         }
 
         *done = stream.atEnd();
@@ -133,27 +321,963 @@ class galGallery : public Gallery
         if (t.isEmpty() && t.file.isNull())
             return;
 
-        stream << t;
+        QReadLocker filesLocker(&filesLock);
+
+        // Appends always go to the end of the file regardless of the read position
+        const qint64 offset = appending ? gallery.size() : gallery.pos();
+        if (!appending && (offset == 0)) {
+            if (index.isOpen())
+                index.resize(0);
+            if (tombstones.isOpen())
+                tombstones.resize(0);
+            QMutexLocker locker(&offsetsLock);
+            dead.clear();
+            names.clear();
+            liveCount = 0;
+            sessionBegin = 0;
+        }
+
+        if (replacing)
+            remove(t.file.name, sessionBegin);
+
+        if (keepMatrices.isEmpty()) {
+            stream << t;
+        } else {
+            Template kept(t.file);
+            foreach (int i, keepMatrices)
+                if (i < t.size())
+                    kept.append(t[i]);
+            stream << kept;
+        }
+
+        if (index.isOpen())
+            indexStream << offset << (appending ? gallery.size() : gallery.pos()) << t.file;
+
+        if (namesLoaded) {
+            names[t.file.name].append(offset);
+            liveCount++;
+        }
+
+        QMutexLocker locker(&offsetsLock);
+        offsetsLoaded = false;
+        offsets.clear();
+    }
+
+    FileList files()
+    {
+        QReadLocker filesLocker(&filesLock);
+        FileList files;
+        QList<qint64> offsets;
+        if (readLiveIndex(files, offsets))
+            return files;
+        return Gallery::files();
+    }
+
+    bool isDead(qint64 offset)
+    {
+        QMutexLocker locker(&offsetsLock);
+        return dead.contains(offset);
+    }
+
+    // Deletes the live templates named name before offset end, the caller holds filesLock
+    void remove(const QString &name, qint64 end)
+    {
+        if (!namesLoaded) {
+            FileList files;
+            QList<qint64> offsets;
+            if (readLiveIndex(files, offsets))
+                for (int i=0; i<files.size(); i++)
+                    names[files[i].name].append(offsets[i]);
+            liveCount = offsets.size();
+            namesLoaded = true;
+        }
+
+        QHash<QString, QList<qint64> >::iterator it = names.find(name);
+        if (it == names.end())
+            return;
+        if (!tombstones.isOpen())
+            qFatal("Can't delete from gallery without tombstones: %s", qPrintable(tombstones.fileName()));
+
+        QList<qint64> &live = it.value();
+        {
+            QMutexLocker locker(&offsetsLock);
+            for (int i=live.size()-1; i>=0; i--) {
+                if (live[i] >= end)
+                    continue;
+                tombstoneStream << live[i];
+                dead.insert(live[i]);
+                live.removeAt(i);
+                liveCount--;
+            }
+            offsetsLoaded = false;
+            offsets.clear();
+        }
+        if (live.isEmpty())
+            names.erase(it);
+        tombstones.flush();
+
+        int deadCount;
+        {
+            QMutexLocker locker(&offsetsLock);
+            deadCount = dead.size();
+        }
+        if (!compaction.isRunning() && (deadCount > 0) && (deadCount >= compactFraction * (deadCount + liveCount)))
+            compaction = QtConcurrent::run(this, &galGallery::compact);
+    }
+
+    // The gallery, index and tombstones, which compaction replaces together
+    QStringList fileNames() const
+    {
+        return QStringList() << gallery.fileName() << index.fileName() << tombstones.fileName();
+    }
+
+    // Replaces the files with their compactions, the caller holds filesLock and has closed them.
+    // The old files are set aside as backups with the gallery first and the compactions moved in with the gallery last,
+    // so a gallery that is missing while its backup exists marks an interrupted swap, which recover() rolls back.
+    void swap(const QStringList &compactions)
+    {
+        const QStringList names = fileNames();
+        for (int i=0; i<names.size(); i++)
+            if (QFile::exists(names[i]) && !QFile::rename(names[i], names[i] + ".backup"))
+                qFatal("Can't replace gallery with its compaction: %s", qPrintable(gallery.fileName()));
+        for (int i=names.size()-1; i>=0; i--)
+            if (!QFile::rename(compactions[i], names[i]))
+                qFatal("Can't replace gallery with its compaction: %s", qPrintable(gallery.fileName()));
+        for (int i=names.size()-1; i>=0; i--)
+            QFile::remove(names[i] + ".backup");
+    }
+
+    // Finishes or rolls back a swap() interrupted by a crash
+    void recover()
+    {
+        const QStringList names = fileNames();
+        if (QFile::exists(names[0] + ".backup")) {
+            const bool swapped = QFile::exists(names[0]);
+            for (int i=names.size()-1; i>=0; i--) {
+                if (!QFile::exists(names[i] + ".backup")) continue;
+                if (swapped) {
+                    QFile::remove(names[i] + ".backup");
+                } else {
+                    QFile::remove(names[i]);
+                    if (!QFile::rename(names[i] + ".backup", names[i]))
+                        qFatal("Can't restore gallery from its backup: %s", qPrintable(names[i]));
+                }
+            }
+        }
+        QFile::remove(file.name + ".compact");
+        QFile::remove(file.name + ".compact.index");
+        QFile::remove(file.name + ".compact.tombstones");
+    }
+
+    // Copies the live templates of the gallery into a new one
+    static qint64 copy(QDataStream &reader, const QList<qint64> &offsets, QDataStream &writer, QDataStream &indexWriter, QMap<qint64,qint64> &moved)
+    {
+        QIODevice *source = reader.device(), *destination = writer.device();
+        foreach (qint64 offset, offsets) {
+            if ((source->pos() != offset) && !source->seek(offset))
+                return -1;
+            Template t;
+            reader >> t;
+            const qint64 newOffset = destination->pos();
+            writer << t;
+            indexWriter << newOffset << destination->pos() << t.file;
+            moved.insert(offset, newOffset);
+        }
+        return destination->pos();
+    }
+
+    // Maps an offset in the old gallery to the first live template at or after it in the compacted one
+    static qint64 movedOffset(const QMap<qint64,qint64> &moved, qint64 offset, qint64 newSize)
+    {
+        QMap<qint64,qint64>::const_iterator it = moved.lowerBound(offset);
+        return (it == moved.constEnd()) ? newSize : it.value();
+    }
+
+    void compact()
+    {
+        FileList files;
+        QList<qint64> live;
+        qint64 snapshotEnd;
+        {
+            QWriteLocker filesLocker(&filesLock);
+            gallery.flush();
+            snapshotEnd = gallery.size();
+            if (!readLiveIndex(files, live))
+                return;
+        }
+
+        QFile reader(gallery.fileName()), compacted(file.name + ".compact"), compactedIndex(file.name + ".compact.index");
+        if (!reader.open(QFile::ReadOnly) || !compacted.open(QFile::WriteOnly) || !compactedIndex.open(QFile::WriteOnly)) {
+            qWarning("Can't compact gallery: %s", qPrintable(gallery.fileName()));
+            return;
+        }
+        QDataStream galleryReader(&reader), galleryWriter(&compacted), indexWriter(&compactedIndex);
+        QMap<qint64,qint64> moved;
+        if (copy(galleryReader, live, galleryWriter, indexWriter, moved) < 0) {
+            qWarning("Can't compact gallery: %s", qPrintable(gallery.fileName()));
+            return;
+        }
+
+        QWriteLocker filesLocker(&filesLock);
+
+        // Templates written during the copy
+        gallery.flush();
+        index.flush();
+        files.clear();
+        live.clear();
+        if (!readLiveIndex(files, live)) {
+            qWarning("Can't compact gallery: %s", qPrintable(gallery.fileName()));
+            return;
+        }
+        QList<qint64> tail;
+        foreach (qint64 offset, live)
+            if (offset >= snapshotEnd)
+                tail.append(offset);
+        const qint64 newSize = copy(galleryReader, tail, galleryWriter, indexWriter, moved);
+        if (newSize < 0) {
+            qWarning("Can't compact gallery: %s", qPrintable(gallery.fileName()));
+            return;
+        }
+        compacted.close();
+        compactedIndex.close();
+        reader.close();
+
+        // Templates deleted during the copy, tombstoned at their compacted offsets
+        QSet<qint64> newDead;
+        {
+            QMutexLocker locker(&offsetsLock);
+            foreach (qint64 offset, dead)
+                if (moved.contains(offset))
+                    newDead.insert(moved[offset]);
+        }
+        QFile compactedTombstones(file.name + ".compact.tombstones");
+        if (!compactedTombstones.open(QFile::WriteOnly | QFile::Truncate)) {
+            qWarning("Can't compact gallery: %s", qPrintable(gallery.fileName()));
+            return;
+        }
+        {
+            QDataStream tombstoneWriter(&compactedTombstones);
+            foreach (qint64 offset, newDead)
+                tombstoneWriter << offset;
+        }
+        compactedTombstones.close();
+
+        const qint64 position = gallery.pos();
+        gallery.close();
+        index.close();
+        tombstones.close();
+        swap(QStringList() << compacted.fileName() << compactedIndex.fileName() << compactedTombstones.fileName());
+
+        QFile::OpenMode mode = QFile::ReadWrite;
+        if (appending)
+            mode |= QFile::Append;
+        if (!gallery.open(mode) || !index.open(QFile::ReadWrite | QFile::Append) || !tombstones.open(QFile::ReadWrite | QFile::Append))
+            qFatal("Can't reopen compacted gallery: %s", qPrintable(gallery.fileName()));
+        gallery.seek(movedOffset(moved, position, newSize));
+        stream.setDevice(&gallery);
+        indexStream.setDevice(&index);
+        tombstoneStream.setDevice(&tombstones);
+        sessionBegin = movedOffset(moved, sessionBegin, newSize);
+
+        if (namesLoaded) {
+            QMutableHashIterator<QString, QList<qint64> > it(names);
+            while (it.hasNext()) {
+                it.next();
+                for (int i=0; i<it.value().size(); i++)
+                    it.value()[i] = moved.value(it.value()[i]);
+            }
+        }
+
+        QMutexLocker locker(&offsetsLock);
+        dead = newDead;
+        offsetsLoaded = false;
+        offsets.clear();
+    }
+
+    // Reads the index without the deleted templates
+    bool readLiveIndex(FileList &files, QList<qint64> &offsets)
+    {
+        if (!readIndex(files, offsets)) {
+            rebuildIndex();
+            files.clear();
+            offsets.clear();
+            if (!readIndex(files, offsets))
+                return false;
+        }
+
+        QSet<qint64> deleted;
+        {
+            QMutexLocker locker(&offsetsLock);
+            deleted = dead;
+        }
+        if (deleted.isEmpty())
+            return true;
+
+        FileList liveFiles;
+        QList<qint64> liveOffsets;
+        for (int i=0; i<offsets.size(); i++) {
+            if (deleted.contains(offsets[i]))
+                continue;
+            liveFiles.append(files[i]);
+            liveOffsets.append(offsets[i]);
+        }
+        files = liveFiles;
+        offsets = liveOffsets;
+        return true;
+    }
+
+    // Returns false unless the index covers exactly the templates in the gallery
+    bool readIndex(FileList &files, QList<qint64> &offsets)
+    {
+        if (!index.isOpen())
+            return false;
+        index.flush();
+
+        QFile reader(index.fileName());
+        if (!reader.open(QFile::ReadOnly))
+            return false;
+        QDataStream indexReader(&reader);
+
+        qint64 end = 0;
+        while (!indexReader.atEnd()) {
+            qint64 offset;
+            File f;
+            indexReader >> offset >> end >> f;
+            if (indexReader.status() != QDataStream::Ok)
+                return false;
+            offsets.append(offset);
+            files.append(f);
+        }
+        return end == gallery.size();
+    }
+
+    void rebuildIndex()
+    {
+        if (!index.isOpen())
+            return;
+
+        QFile reader(gallery.fileName());
+        if (!reader.open(QFile::ReadOnly))
+            return;
+        QDataStream galleryReader(&reader);
+
+        index.resize(0);
+        while (!galleryReader.atEnd()) {
+            const qint64 offset = reader.pos();
+            Template t;
+            galleryReader >> t;
+            indexStream << offset << reader.pos() << t.file;
+        }
     }
 };
 
 BR_REGISTER(Gallery, galGallery)
 
+/*!
+ * \ingroup galleries
+ * \brief A binary gallery with compact metadata.
+ *
+ * Metadata keys are interned: each key is written once per writing session and then referenced by a 16-bit id.
+ * Values are length prefixed so a reader can skip the fields it doesn't need.
+ * Set \em fields to the metadata keys to load, e.g. <tt>targets.cgal[fields=[Label]]</tt>, by default every field is loaded.
+ * \author Josh Klontz \cite jklontz
+ */
+class cgalGallery : public Gallery
+{
+    Q_OBJECT
+
+    enum Record { Reset = 0, Key = 1, Entry = 2 };
+
+    QFile gallery;
+    QDataStream stream;
+    QHash<QString,quint16> writeKeys;
+    bool writing;
+    QList<QString> readKeys;
+    QList<bool> readWanted;
+    QSet<QString> fields;
+    bool allFields;
+
+    void init()
+    {
+        gallery.setFileName(file);
+        if (file.get<bool>("remove"))
+            gallery.remove();
+        QtUtils::touchDir(gallery);
+        QFile::OpenMode mode = QFile::ReadWrite;
+
+        if (file.get<bool>("append"))
+            mode |= QFile::Append;
+
+        if (!gallery.open(mode))
+            qFatal("Can't open gallery: %s", qPrintable(gallery.fileName()));
+        stream.setDevice(&gallery);
+
+        writing = false;
+        allFields = !file.contains("fields");
+        fields = QSet<QString>::fromList(file.getList<QString>("fields", QList<QString>()));
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        if (stream.atEnd()) {
+            gallery.seek(0);
+            readKeys.clear();
+            readWanted.clear();
+        }
+
+        TemplateList templates;
+        while ((templates.size() < Globals->blockSize) && !stream.atEnd()) {
+            quint8 record;
+            stream >> record;
+            if (record == Reset) {
+                readKeys.clear();
+                readWanted.clear();
+            } else if (record == Key) {
+                QString key;
+                stream >> key;
+                readKeys.append(key);
+                readWanted.append(allFields || fields.contains(key));
+            } else if (record == Entry) {
+                templates.append(readTemplate());
+            } else {
+                qFatal("Corrupt gallery: %s", qPrintable(gallery.fileName()));
+            }
+        }
+
+        *done = stream.atEnd();
+        return templates;
+    }
+
+    Template readTemplate()
+    {
+        Template t;
+        quint16 count;
+        stream >> t.file.name >> count;
+        for (int i=0; i<count; i++) {
+            quint16 id;
+            quint32 size;
+            stream >> id >> size;
+            if (id >= readKeys.size())
+                qFatal("Undefined metadata key in gallery: %s", qPrintable(gallery.fileName()));
+            if (!readWanted[id]) {
+                stream.skipRawData(size);
+                continue;
+            }
+            QVariant value;
+            stream >> value;
+            t.file.set(readKeys[id], value);
+        }
+
+        qint32 size;
+        stream >> size;
+        for (int i=0; i<size; i++) {
+            qint32 rows, cols, type;
+            stream >> rows >> cols >> type;
+            cv::Mat m(rows, cols, type);
+            const int len = rows*cols*m.elemSize();
+            if ((len > 0) && (stream.readRawData((char*)m.data, len) != len))
+                qFatal("Corrupt gallery: %s", qPrintable(gallery.fileName()));
+            t.append(m);
+        }
+        return t;
+    }
+
+    void write(const Template &t)
+    {
+        if (t.isEmpty() && t.file.isNull())
+            return;
+
+        // Ids are only valid within a session, so appending never depends on what was written before
+        if (!writing) {
+            stream << quint8(Reset);
+            writing = true;
+        }
+
+        const QMap<QString,QVariant> metadata = t.file.localMetadata();
+        QMapIterator<QString,QVariant> i(metadata);
+        while (i.hasNext()) {
+            i.next();
+            if (writeKeys.contains(i.key())) continue;
+            if (writeKeys.size() > std::numeric_limits<quint16>::max())
+                qFatal("Too many metadata keys for gallery: %s", qPrintable(gallery.fileName()));
+            stream << quint8(Key) << i.key();
+            writeKeys.insert(i.key(), writeKeys.size());
+        }
+
+        stream << quint8(Entry) << t.file.name << quint16(metadata.size());
+        i.toFront();
+        while (i.hasNext()) {
+            i.next();
+            QByteArray value;
+            QDataStream valueStream(&value, QIODevice::WriteOnly);
+            valueStream << i.value();
+            stream << writeKeys[i.key()] << quint32(value.size());
+            stream.writeRawData(value.constData(), value.size());
+        }
+
+        stream << qint32(t.size());
+        foreach (const cv::Mat &matrix, t) {
+            const cv::Mat m = matrix.isContinuous() ? matrix : matrix.clone();
+            stream << qint32(m.rows) << qint32(m.cols) << qint32(m.type());
+            stream.writeRawData((const char*)m.data, m.rows*m.cols*m.elemSize());
+        }
+    }
+};
+
+BR_REGISTER(Gallery, cgalGallery)
+
+/*!
+ * \ingroup galleries
+ * \brief A binary gallery compressed in independent blocks.
+ *
+ * Every Globals->blockSize templates are serialized like a galGallery and compressed together,
+ * each block prefixed by its template count and compressed size so the blocks can be found without decompressing them.
+ * Blocks are read at random, so br::Compare decompresses the next block on its prefetch thread.
+ * Set \em level to trade write speed for size, from 1 (fastest, default) to 9.
+ * \author Josh Klontz \cite jklontz
+ */
+class zgalGallery : public Gallery
+{
+    Q_OBJECT
+    Q_PROPERTY(int level READ get_level WRITE set_level RESET reset_level STORED false)
+    BR_PROPERTY(int, level, 1)
+
+    QFile gallery;
+    TemplateList pending; // Written templates not yet compressed
+    qint64 readOffset;
+    bool appending, written;
+
+    QMutex offsetsLock;
+    QList<qint64> offsets; // Of each block, loaded by the first random access
+    bool offsetsLoaded;
+
+    ~zgalGallery()
+    {
+        flush();
+    }
+
+    void init()
+    {
+        gallery.setFileName(file);
+        if (file.get<bool>("remove"))
+            gallery.remove();
+        QtUtils::touchDir(gallery);
+        QFile::OpenMode mode = QFile::ReadWrite;
+
+        appending = file.get<bool>("append");
+        if (appending)
+            mode |= QFile::Append;
+
+        if (!gallery.open(mode))
+            qFatal("Can't open gallery: %s", qPrintable(gallery.fileName()));
+        readOffset = 0;
+        written = false;
+        offsetsLoaded = false;
+    }
+
+    int blockCount()
+    {
+        flush();
+        QMutexLocker locker(&offsetsLock);
+        if (!offsetsLoaded) {
+            // Only the block headers are read
+            QFile reader(gallery.fileName());
+            if (reader.open(QFile::ReadOnly)) {
+                QDataStream headerReader(&reader);
+                qint64 offset = 0;
+                while (offset + 2*qint64(sizeof(quint32)) <= reader.size()) {
+                    quint32 count, size;
+                    reader.seek(offset);
+                    headerReader >> count >> size;
+                    const qint64 next = offset + 2*sizeof(quint32) + size;
+                    if (next > reader.size()) break;
+                    offsets.append(offset);
+                    offset = next;
+                }
+            }
+            offsetsLoaded = true;
+        }
+        return offsets.size();
+    }
+
+    TemplateList readBlockAt(int block)
+    {
+        if ((block < 0) || (block >= blockCount()))
+            return TemplateList();
+
+        // Copied under the lock flush() clears the offsets with
+        qint64 offset;
+        {
+            QMutexLocker locker(&offsetsLock);
+            if (block >= offsets.size())
+                return TemplateList();
+            offset = offsets[block];
+        }
+
+        // Each call reads through its own handle so blocks can be loaded concurrently
+        QFile reader(gallery.fileName());
+        if (!reader.open(QFile::ReadOnly) || !reader.seek(offset))
+            qFatal("Can't read block %d of gallery: %s", block, qPrintable(gallery.fileName()));
+        return decompressBlock(reader);
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        flush();
+
+        QFile reader(gallery.fileName());
+        if (!reader.open(QFile::ReadOnly) || !reader.seek(readOffset))
+            qFatal("Can't read gallery: %s", qPrintable(gallery.fileName()));
+        const TemplateList templates = decompressBlock(reader);
+
+        *done = reader.atEnd();
+        readOffset = *done ? 0 : reader.pos();
+        return templates;
+    }
+
+    TemplateList decompressBlock(QFile &reader)
+    {
+        TemplateList templates;
+        if (reader.atEnd())
+            return templates;
+
+        QDataStream headerReader(&reader);
+        quint32 count, size;
+        headerReader >> count >> size;
+        const QByteArray compressed = reader.read(size);
+        if ((headerReader.status() != QDataStream::Ok) || (compressed.size() != int(size)))
+            qFatal("Corrupt gallery: %s", qPrintable(gallery.fileName()));
+
+        QByteArray data = qUncompress(compressed);
+        QDataStream blockReader(&data, QIODevice::ReadOnly);
+        templates.reserve(count);
+        for (quint32 i=0; i<count; i++) {
+            Template t;
+            blockReader >> t;
+            templates.append(t);
+        }
+        return templates;
+    }
+
+    void write(const Template &t)
+    {
+        if (t.isEmpty() && t.file.isNull())
+            return;
+
+        pending.append(t);
+        if (pending.size() >= Globals->blockSize)
+            flush();
+    }
+
+    void flush()
+    {
+        if (pending.isEmpty())
+            return;
+
+        QByteArray data;
+        QDataStream blockWriter(&data, QIODevice::WriteOnly);
+        foreach (const Template &t, pending)
+            blockWriter << t;
+        const QByteArray compressed = qCompress(data, level);
+
+        // Unless appending, writing replaces what was in the gallery
+        if (!appending && !written)
+            gallery.resize(0);
+        written = true;
+        gallery.seek(gallery.size());
+        QDataStream headerWriter(&gallery);
+        headerWriter << quint32(pending.size()) << quint32(compressed.size());
+        gallery.write(compressed);
+        gallery.flush();
+        pending.clear();
+
+        QMutexLocker locker(&offsetsLock);
+        offsetsLoaded = false;
+        offsets.clear();
+    }
+};
+
+BR_REGISTER(Gallery, zgalGallery)
+
+/*!
+ * \ingroup initializers
+ * \brief Initialization support for mmgGallery.
+ * \author Josh Klontz \cite jklontz
+ *
+ * Mappings are kept open until br::Context::finalize() so that matrices returned by mmgGallery::readBlock() outlive the gallery that read them.
+ */
+class MappedGalleries : public Initializer
+{
+    Q_OBJECT
+
+    void initialize() const {}
+
+    void finalize() const
+    {
+        QMutexLocker locker(&mappingsLock);
+        mappings.clear();
+    }
+
+public:
+    static QHash<QString, QSharedPointer<QFile> > mappings; /*!< Memory mapped gallery files keyed by file name. */
+    static QHash<QString, uchar*> addresses; /*!< Start of each mapping. */
+    static QMutex mappingsLock;
+
+    static const uchar *map(const QString &fileName, qint64 *size)
+    {
+        QMutexLocker locker(&mappingsLock);
+        if (!mappings.contains(fileName)) {
+            QSharedPointer<QFile> mapping(new QFile(fileName));
+            if (!mapping->open(QFile::ReadOnly))
+                qFatal("Can't open gallery: %s", qPrintable(fileName));
+            uchar *address = mapping->size() > 0 ? mapping->map(0, mapping->size()) : NULL;
+            if ((mapping->size() > 0) && !address)
+                qFatal("Can't memory map gallery: %s", qPrintable(fileName));
+            mappings.insert(fileName, mapping);
+            addresses.insert(fileName, address);
+        }
+        *size = mappings[fileName]->size();
+        return addresses[fileName];
+    }
+
+    static void unmap(const QString &fileName)
+    {
+        QMutexLocker locker(&mappingsLock);
+        mappings.remove(fileName);
+        addresses.remove(fileName);
+    }
+};
+
+QHash<QString, QSharedPointer<QFile> > MappedGalleries::mappings;
+QHash<QString, uchar*> MappedGalleries::addresses;
+QMutex MappedGalleries::mappingsLock;
+
+BR_REGISTER(Initializer, MappedGalleries)
+
+/*!
+ * \ingroup galleries
+ * \brief A memory mapped gallery of fixed-size templates.
+ *
+ * Template matrices are stored contiguously with a fixed stride in the gallery file,
+ * following a small header describing their size and type.
+ * Template metadata is stored separately in a <tt>.meta</tt> sidecar file.
+ * Matrices returned by readBlock() point directly into the memory mapped file,
+ * no template data is copied or parsed, and they should be treated as read-only.
+ * All templates must contain at most one continuous matrix of the same size and type.
+ * \author Josh Klontz \cite jklontz
+ */
+class mmgGallery : public Gallery
+{
+    Q_OBJECT
+
+    struct Header
+    {
+        char magic[4];
+        qint32 version, rows, cols, type;
+        qint32 reserved[3]; // Pad to 32 bytes to keep template data aligned
+
+        Header() : version(1), rows(0), cols(0), type(0)
+        {
+            memcpy(magic, "BRMM", 4);
+            reserved[0] = reserved[1] = reserved[2] = 0;
+        }
+
+        size_t stride() const
+        {
+            return size_t(rows) * size_t(cols) * CV_ELEM_SIZE(type);
+        }
+    };
+
+    Header header;
+    const uchar *data;
+    qint64 dataSize;
+    QFile metadata, templates;
+    QDataStream stream;
+    qint32 rowsWritten;
+    bool headerWritten;
+
+    ~mmgGallery()
+    {
+        if (templates.isOpen() && !headerWritten)
+            writeHeader();
+    }
+
+    void init()
+    {
+        data = NULL;
+        dataSize = 0;
+        rowsWritten = 0;
+        headerWritten = false;
+        metadata.setFileName(file.name + ".meta");
+        templates.setFileName(file.name);
+    }
+
+    void openForReading()
+    {
+        if (metadata.openMode() == QFile::ReadOnly)
+            return;
+
+        if (templates.isOpen()) {
+            if (!headerWritten)
+                writeHeader();
+            templates.close();
+        }
+        metadata.close();
+        if (!metadata.exists())
+            return;
+        if (!metadata.open(QFile::ReadOnly))
+            qFatal("Can't open gallery metadata: %s", qPrintable(metadata.fileName()));
+        stream.setDevice(&metadata);
+
+        data = MappedGalleries::map(file.name, &dataSize);
+        if (dataSize < qint64(sizeof(Header)) || memcmp(data, "BRMM", 4))
+            qFatal("Invalid memory mapped gallery: %s", qPrintable(file.name));
+        memcpy(&header, data, sizeof(Header));
+    }
+
+    void openForWriting()
+    {
+        if (file.get<bool>("append", false))
+            qFatal("Appending to memory mapped galleries is not supported.");
+
+        // Outstanding matrices from a previous read will no longer be valid
+        MappedGalleries::unmap(file.name);
+        metadata.close();
+
+        QtUtils::touchDir(templates);
+        if (!templates.open(QFile::WriteOnly | QFile::Truncate))
+            qFatal("Can't open gallery: %s", qPrintable(templates.fileName()));
+        if (!metadata.open(QFile::WriteOnly | QFile::Truncate))
+            qFatal("Can't open gallery metadata: %s", qPrintable(metadata.fileName()));
+        stream.setDevice(&metadata);
+    }
+
+    void writeHeader()
+    {
+        templates.seek(0);
+        templates.write((const char*)&header, sizeof(Header));
+        headerWritten = true;
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        openForReading();
+
+        TemplateList templateList;
+        if (!metadata.isOpen()) {
+            *done = true;
+            return templateList;
+        }
+
+        if (stream.atEnd())
+            metadata.seek(0);
+
+        const size_t stride = header.stride();
+        while ((templateList.size() < Globals->blockSize) && !stream.atEnd()) {
+            qint32 row;
+            File f;
+            stream >> row >> f;
+            if (row < 0) {
+                templateList.append(f);
+            } else {
+                const qint64 offset = qint64(sizeof(Header)) + qint64(row) * qint64(stride);
+                if (offset + qint64(stride) > dataSize)
+                    qFatal("Truncated memory mapped gallery: %s", qPrintable(file.name));
+                templateList.append(Template(f, cv::Mat(header.rows, header.cols, header.type, const_cast<uchar*>(data + offset))));
+            }
+        }
+
+        *done = stream.atEnd();
+        return templateList;
+    }
+
+    void write(const Template &t)
+    {
+        if (t.isEmpty() && t.file.isNull())
+            return;
+
+        if (!templates.isOpen())
+            openForWriting();
+
+        if (t.size() > 1)
+            qFatal("Can't handle multi-matrix template %s.", qPrintable(t.file.flat()));
+
+        qint32 row = -1;
+        if (!t.isNull()) {
+            const cv::Mat &m = t.m();
+            if (!m.isContinuous())
+                qFatal("Requires continuous matrix data for %s.", qPrintable(t.file.flat()));
+
+            if (!headerWritten) {
+                header.rows = m.rows;
+                header.cols = m.cols;
+                header.type = m.type();
+                writeHeader();
+            } else if ((m.rows != header.rows) || (m.cols != header.cols) || (m.type() != header.type)) {
+                qFatal("Expected a %dx%d matrix of type %d for %s.", header.rows, header.cols, header.type, qPrintable(t.file.flat()));
+            }
+
+            templates.write((const char*)m.data, header.stride());
+            row = rowsWritten++;
+        }
+
+        stream << row << t.file;
+    }
+};
+
+BR_REGISTER(Gallery, mmgGallery)
+
 /*!
  * \ingroup galleries
  * \brief Reads/writes templates to/from folders.
+ *
+ * Except on Windows, templates are written by a pool of \em writers threads behind a bounded queue.
  * \author Josh Klontz \cite jklontz
  * \param regexp An optional regular expression to match against the files extension.
+ * \param writers Number of threads writing templates to disk.
  */
 class EmptyGallery : public Gallery
 {
     Q_OBJECT
     Q_PROPERTY(QString regexp READ get_regexp WRITE set_regexp RESET reset_regexp STORED false)
+    Q_PROPERTY(int writers READ get_writers WRITE set_writers RESET reset_writers STORED false)
     BR_PROPERTY(QString, regexp, QString())
+    BR_PROPERTY(int, writers, 4)
+
+    struct Writer : public QRunnable
+    {
+        const Template t;
+        const QString destination;
+        QSemaphore *queue;
+
+        Writer(const Template &t_, const QString &destination_, QSemaphore *queue_)
+            : t(t_), destination(destination_), queue(queue_) {}
+
+        void run()
+        {
+            writeTemplate(t, destination);
+            queue->release();
+        }
+    };
+
+    QScopedPointer<QSemaphore> queue; // Free slots for pending writes
+    QThreadPool writerPool;
+
+    ~EmptyGallery()
+    {
+        writerPool.waitForDone();
+    }
+
+    QList< QFuture<TemplateList> > futures;
+    int next; // Subfolder returned by the next call to readBlock(), the root folder is last
+    bool started;
 
     void init()
     {
         QtUtils::touchDir(QDir(file.name));
+        started = false;
+        writerPool.setMaxThreadCount(qMax(1, writers));
+        queue.reset(new QSemaphore(16 * writerPool.maxThreadCount()));
     }
 
     TemplateList readBlock(bool *done)
@@ -164,19 +1288,31 @@ class EmptyGallery : public Gallery
         // Enrolling a null file is used as an idiom to initialize an algorithm
         if (file.isNull()) return templates;
 
-        // Add immediate subfolders
+        // Scan all immediate subfolders in parallel, returning one subfolder per block as its scan completes
         QDir dir(file);
-        QList< QFuture<TemplateList> > futures;
-        foreach (const QString &folder, QtUtils::naturalSort(dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot))) {
-            const QDir subdir = dir.absoluteFilePath(folder);
-            futures.append(QtConcurrent::run(&EmptyGallery::getTemplates, subdir));
+        if (!started) {
+            foreach (const QString &folder, QtUtils::naturalSort(dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot))) {
+                const QDir subdir = dir.absoluteFilePath(folder);
+                futures.append(QtConcurrent::run(&EmptyGallery::getTemplates, subdir));
+            }
+            next = 0;
+            started = true;
+        }
+
+        if (next < futures.size()) {
+            templates = futures[next].result();
+            futures[next] = QFuture<TemplateList>();
+        } else {
+            // Add root folder
+            foreach (const QString &fileName, QtUtils::getFiles(file.name, false))
+                templates.append(File(fileName, dir.dirName()));
         }
-        foreach (const QFuture<TemplateList> &future, futures)
-            templates.append(future.result());
 
-        // Add root folder
-        foreach (const QString &fileName, QtUtils::getFiles(file.name, false))
-            templates.append(File(fileName, dir.dirName()));
+        *done = (++next > futures.size());
+        if (*done) {
+            futures.clear();
+            started = false;
+        }
 
         if (!regexp.isEmpty()) {
             QRegExp re(regexp);
@@ -193,16 +1329,26 @@ class EmptyGallery : public Gallery
 
     void write(const Template &t)
     {
-        static QMutex diskLock;
-
         // Enrolling a null file is used as an idiom to initialize an algorithm
         if (file.name.isEmpty()) return;
 
         const QString newFormat = file.get<QString>("newFormat",QString());
         QString destination = file.name + "/" + (file.getBool("preservePath") ? t.file.path()+"/" : QString());
         destination += (newFormat.isEmpty() ? t.file.fileName() : t.file.baseName()+newFormat);
+        makeDirectory(QFileInfo(destination).absolutePath());
 
+#ifdef Q_OS_WIN
+        static QMutex diskLock;
         QMutexLocker diskLocker(&diskLock); // Windows prefers to crash when writing to disk in parallel
+        writeTemplate(t, destination);
+#else
+        queue->acquire();
+        writerPool.start(new Writer(t, destination, queue.data()));
+#endif
+    }
+
+    static void writeTemplate(const Template &t, const QString &destination)
+    {
         if (t.isNull()) {
             QtUtils::copyFile(t.file.resolved(), destination);
         } else {
@@ -211,6 +1357,18 @@ class EmptyGallery : public Gallery
         }
     }
 
+    // Creates each destination folder once instead of checking for it on every write
+    static void makeDirectory(const QString &path)
+    {
+        static QSet<QString> created;
+        static QMutex createdLock;
+
+        QMutexLocker locker(&createdLock);
+        if (created.contains(path)) return;
+        QtUtils::touchDir(QDir(path));
+        created.insert(path);
+    }
+
     static TemplateList getTemplates(const QDir &dir)
     {
         const QStringList files = QtUtils::getFiles(dir, true);
@@ -265,29 +1423,316 @@ class matrixGallery : public Gallery
         if (templates.isEmpty())
             return;
 
-        QScopedPointer<Format> format(Factory<Format>::make(getFormat()));
-        format->write(Template(file, OpenCVUtils::toMat(templates.data())));
+        QScopedPointer<Format> format(Factory<Format>::make(getFormat()));
+        format->write(Template(file, OpenCVUtils::toMat(templates.data())));
+    }
+
+    File getFormat() const
+    {
+        return file.name.left(file.name.size() - file.suffix().size()) + extension;
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        *done = true;
+        return TemplateList() << getFormat();
+    }
+
+    void write(const Template &t)
+    {
+        templates.append(t);
+    }
+};
+
+BR_REGISTER(Gallery, matrixGallery)
+
+/*!
+ * \brief Templates of a memGallery.
+ *
+ * Each writing thread appends to its own segment, numbering every template in the order it was written,
+ * segments are moved into the contiguous aligned chunks of the merged list in that order when the gallery is read.
+ * Chunks are never reallocated, so blocks returned earlier remain valid as the gallery grows.
+ *
+ * A snapshot stores the merged templates already aligned: a header, the serialized metadata,
+ * then the matrices at the page aligned data offset laid out as align() packs them,
+ * so restore() memory maps it and points the matrices into the mapping without copying or parsing them.
+ */
+class MemoryGallery
+{
+    struct SnapshotHeader
+    {
+        char magic[4];
+        qint32 version;
+        qint64 sourceSize, sourceModified; // Of the gallery the snapshot was taken from
+        qint64 tombstonesSize, tombstonesModified; // Of its removed templates, zero if there aren't any
+        qint64 metadataSize, dataOffset;
+
+        SnapshotHeader() : version(2), sourceSize(0), sourceModified(0), tombstonesSize(0), tombstonesModified(0), metadataSize(0), dataOffset(0)
+        {
+            memcpy(magic, "BRMS", 4);
+        }
+
+        // Identifies the state of the source gallery, removing templates changes it without touching the gallery itself
+        void setSource(const QString &source)
+        {
+            const QFileInfo gallery(source), tombstones(source + ".tombstones");
+            sourceSize = gallery.size();
+            sourceModified = gallery.lastModified().toMSecsSinceEpoch();
+            tombstonesSize = tombstones.exists() ? tombstones.size() : 0;
+            tombstonesModified = tombstones.exists() ? tombstones.lastModified().toMSecsSinceEpoch() : 0;
+        }
+
+        bool sameSource(const SnapshotHeader &other) const
+        {
+            return (sourceSize == other.sourceSize) && (sourceModified == other.sourceModified) &&
+                   (tombstonesSize == other.tombstonesSize) && (tombstonesModified == other.tombstonesModified);
+        }
+    };
+
+    struct Segment
+    {
+        QMutex lock;
+        TemplateList templates;
+        QVector<int> sequence; // Of each template
+    };
+    typedef QPair<int, Template> Write;
+
+    QReadWriteLock segmentsLock;
+    QHash<Qt::HANDLE, QSharedPointer<Segment> > threadSegments;
+    QList< QSharedPointer<Segment> > segments; // In order of each thread's first write
+    QAtomicInt writes;
+
+    QMutex mergeLock;
+    QList<Write> held; // Written after a template whose write hasn't finished
+    int mergedWrites;
+    QReadWriteLock mergedLock;
+    TemplateList merged;
+    QList< QVector<uchar> > chunks;
+
+public:
+    MemoryGallery() : writes(0), mergedWrites(0) {}
+
+    void append(const Template &t)
+    {
+        QSharedPointer<Segment> segment = threadSegment();
+        QMutexLocker locker(&segment->lock);
+        segment->sequence.append(writes.fetchAndAddOrdered(1));
+        segment->templates.append(t);
+    }
+
+    TemplateList mid(int pos, int length)
+    {
+        // Readers starting from the beginning pick up everything written so far
+        if (pos == 0) merge();
+        QReadLocker locker(&mergedLock);
+        TemplateList templates = merged.mid(pos, length);
+        if (!templates.isEmpty() && aligns(templates.first()))
+            templates.stride = OpenCVUtils::alignedStep(templates.first().m().total() * templates.first().m().elemSize());
+        return templates;
+    }
+
+    // Writes the templates merged so far to a temporary file renamed over fileName,
+    // processes serving an earlier snapshot keep their mapping of it
+    void snapshot(const QString &fileName, const QString &source)
+    {
+        merge();
+        QReadLocker locker(&mergedLock);
+
+        QByteArray metadata;
+        QDataStream metadataStream(&metadata, QIODevice::WriteOnly);
+        qint64 dataSize = 0;
+        metadataStream << qint32(merged.size());
+        foreach (const Template &t, merged) {
+            const bool mapped = aligns(t);
+            metadataStream << mapped;
+            if (mapped) {
+                const cv::Mat &m = t.m();
+                metadataStream << t.file << qint32(m.rows) << qint32(m.cols) << qint32(m.type()) << dataSize;
+                dataSize += OpenCVUtils::alignedStep(m.total() * m.elemSize());
+            } else {
+                metadataStream << t;
+            }
+        }
+
+        SnapshotHeader header;
+        header.setSource(source);
+        header.metadataSize = metadata.size();
+        const qint64 page = 4096;
+        header.dataOffset = (qint64(sizeof(SnapshotHeader)) + metadata.size() + page - 1) / page * page;
+
+        QFile file(fileName + ".tmp");
+        if (!file.open(QFile::WriteOnly | QFile::Truncate)) {
+            qWarning("Can't write gallery snapshot: %s", qPrintable(file.fileName()));
+            return;
+        }
+        file.write((const char*)&header, sizeof(SnapshotHeader));
+        file.write(metadata);
+        file.write(QByteArray(int(header.dataOffset - file.pos()), 0));
+        foreach (const Template &t, merged) {
+            if (!aligns(t)) continue;
+            const cv::Mat &m = t.m();
+            const qint64 size = m.total() * m.elemSize();
+            file.write((const char*)m.ptr(), size);
+            file.write(QByteArray(int(OpenCVUtils::alignedStep(size) - size), 0));
+        }
+
+        if ((file.error() != QFile::NoError) || !file.flush()) {
+            qWarning("Can't write gallery snapshot: %s", qPrintable(file.fileName()));
+            file.remove();
+            return;
+        }
+        file.close();
+        QFile::remove(fileName);
+        if (!file.rename(fileName))
+            qWarning("Can't replace gallery snapshot: %s", qPrintable(fileName));
+    }
+
+    // Appends the templates of a snapshot taken from the same source, returns false if there isn't one
+    bool restore(const QString &fileName, const QString &source)
+    {
+        if (!QFile::exists(fileName))
+            return false;
+
+        qint64 size;
+        const uchar *data = MappedGalleries::map(fileName, &size);
+        SnapshotHeader header, expected;
+        expected.setSource(source);
+        if (size >= qint64(sizeof(SnapshotHeader)))
+            memcpy(&header, data, sizeof(SnapshotHeader));
+        if ((size < qint64(sizeof(SnapshotHeader))) || memcmp(header.magic, expected.magic, 4) || (header.version != expected.version) ||
+            !header.sameSource(expected) ||
+            (header.dataOffset < qint64(sizeof(SnapshotHeader)) + header.metadataSize) || (header.dataOffset > size)) {
+            MappedGalleries::unmap(fileName);
+            return false;
+        }
+
+        const QByteArray metadata = QByteArray::fromRawData((const char*)data + sizeof(SnapshotHeader), int(header.metadataSize));
+        QDataStream metadataStream(metadata);
+        qint32 count;
+        metadataStream >> count;
+        TemplateList templates;
+        templates.reserve(count);
+        for (int i=0; i<count; i++) {
+            bool mapped;
+            metadataStream >> mapped;
+            if (mapped) {
+                File f;
+                qint32 rows, cols, type;
+                qint64 offset;
+                metadataStream >> f >> rows >> cols >> type >> offset;
+                if (header.dataOffset + offset + qint64(rows) * cols * CV_ELEM_SIZE(type) > size)
+                    qFatal("Truncated gallery snapshot: %s", qPrintable(fileName));
+                // Read-only like the matrices of an mmgGallery
+                templates.append(Template(f, cv::Mat(rows, cols, type, const_cast<uchar*>(data + header.dataOffset + offset))));
+            } else {
+                Template t;
+                metadataStream >> t;
+                templates.append(t);
+            }
+        }
+        if (metadataStream.status() != QDataStream::Ok)
+            qFatal("Corrupt gallery snapshot: %s", qPrintable(fileName));
+
+        QMutexLocker mergeLocker(&mergeLock);
+        QWriteLocker locker(&mergedLock);
+        merged.append(templates);
+        return true;
+    }
+
+private:
+    QSharedPointer<Segment> threadSegment()
+    {
+        const Qt::HANDLE thread = QThread::currentThreadId();
+        {
+            QReadLocker locker(&segmentsLock);
+            QSharedPointer<Segment> segment = threadSegments.value(thread);
+            if (!segment.isNull()) return segment;
+        }
+
+        QWriteLocker locker(&segmentsLock);
+        QSharedPointer<Segment> &segment = threadSegments[thread];
+        if (segment.isNull()) {
+            segment = QSharedPointer<Segment>(new Segment());
+            segments.append(segment);
+        }
+        return segment;
+    }
+
+    void merge()
+    {
+        QMutexLocker mergeLocker(&mergeLock);
+
+        QList< QSharedPointer<Segment> > current;
+        {
+            QReadLocker locker(&segmentsLock);
+            current = segments;
+        }
+
+        foreach (const QSharedPointer<Segment> &segment, current) {
+            QMutexLocker locker(&segment->lock);
+            for (int i=0; i<segment->templates.size(); i++)
+                held.append(Write(segment->sequence[i], segment->templates[i]));
+            segment->templates.clear();
+            segment->sequence.clear();
+        }
+        if (held.isEmpty()) return;
+
+        // Merge in write order up to the first write still in progress, the rest waits for the next merge
+        std::sort(held.begin(), held.end(), writtenBefore);
+        int ready = 0;
+        while ((ready < held.size()) && (held[ready].first == mergedWrites + ready))
+            ready++;
+        TemplateList pending;
+        pending.reserve(ready);
+        for (int i=0; i<ready; i++)
+            pending.append(held[i].second);
+        held = held.mid(ready);
+        mergedWrites += ready;
+        if (pending.isEmpty()) return;
+
+        // Only the new templates are copied
+        const QVector<uchar> chunk = align(pending);
+        QWriteLocker locker(&mergedLock);
+        chunks.append(chunk);
+        merged.append(pending);
     }
 
-    File getFormat() const
+    // Packs single matrix templates into one buffer, each starting on a SIMD boundary and zero padded to the next,
+    // so uniform templates are equally spaced rows that batch distances can read with aligned loads
+    static QVector<uchar> align(TemplateList &templates)
     {
-        return file.name.left(file.name.size() - file.suffix().size()) + extension;
+        size_t bytes = 0;
+        foreach (const Template &t, templates)
+            if (aligns(t))
+                bytes += OpenCVUtils::alignedStep(t.m().total() * t.m().elemSize());
+
+        QVector<uchar> alignedData;
+        uchar *data = OpenCVUtils::alignedBuffer(alignedData, bytes);
+        size_t offset = 0;
+        for (int i=0; i<templates.size(); i++) {
+            Template &t = templates[i];
+            if (!aligns(t)) continue;
+
+            cv::Mat &m = t;
+            const size_t size = m.total() * m.elemSize();
+            memcpy(&data[offset], m.ptr(), size);
+            m = cv::Mat(m.rows, m.cols, m.type(), &data[offset]);
+            offset += OpenCVUtils::alignedStep(size);
+        }
+        return alignedData;
     }
 
-    TemplateList readBlock(bool *done)
+    static bool aligns(const Template &t)
     {
-        *done = true;
-        return TemplateList() << getFormat();
+        return (t.size() == 1) && t.m().data && t.m().isContinuous();
     }
 
-    void write(const Template &t)
+    static bool writtenBefore(const Write &a, const Write &b)
     {
-        templates.append(t);
+        return a.first < b.first;
     }
 };
 
-BR_REGISTER(Gallery, matrixGallery)
-
 /*!
  * \ingroup initializers
  * \brief Initialization support for memGallery.
@@ -301,49 +1746,64 @@ class MemoryGalleries : public Initializer
 
     void finalize() const
     {
+        QMutexLocker locker(&lock);
         galleries.clear();
     }
 
 public:
-    static QHash<File, TemplateList> galleries; /*!< TODO */
-    static QHash<File, bool> aligned; /*!< TODO */
+    static QHash<File, QSharedPointer<MemoryGallery> > galleries; /*!< \brief Galleries by file name. */
+    static QMutex lock; /*!< \brief Guards \ref galleries. */
 };
 
-QHash<File, TemplateList> MemoryGalleries::galleries;
-QHash<File, bool> MemoryGalleries::aligned;
+QHash<File, QSharedPointer<MemoryGallery> > MemoryGalleries::galleries;
+QMutex MemoryGalleries::lock;
 
 BR_REGISTER(Initializer, MemoryGalleries)
 
 /*!
  * \ingroup galleries
  * \brief A gallery held in memory.
+ *
+ * Safe to write from several threads and to read while being written.
+ * <tt>name.gal.mem</tt> starts with the templates of <tt>name.gal</tt>, which are snapshot to <tt>name.gal.snapshot</tt>
+ * so later processes memory map them instead of reading and aligning the gallery again, unless <tt>snapshot=false</tt>.
+ * A snapshot is only used while the size and modification time of the gallery and its <tt>.tombstones</tt> match those it was taken from.
  * \author Josh Klontz \cite jklontz
  */
 class memGallery : public Gallery
 {
     Q_OBJECT
     int block;
+    QSharedPointer<MemoryGallery> gallery;
 
     void init()
     {
         block = 0;
+
+        QMutexLocker locker(&MemoryGalleries::lock);
+        gallery = MemoryGalleries::galleries.value(file);
+        if (!gallery.isNull()) return;
+
+        gallery = QSharedPointer<MemoryGallery>(new MemoryGallery());
+        MemoryGalleries::galleries.insert(file, gallery);
         File galleryFile = file.name.mid(0, file.name.size()-4);
-        if ((galleryFile.suffix() == "gal") && galleryFile.exists() && !MemoryGalleries::galleries.contains(file)) {
-            QSharedPointer<Gallery> gallery(Factory<Gallery>::make(galleryFile));
-            MemoryGalleries::galleries[file] = gallery->read();
-            align(MemoryGalleries::galleries[file]);
-            MemoryGalleries::aligned[file] = true;
+        if ((galleryFile.suffix() == "gal") && galleryFile.exists()) {
+            const QString snapshot = galleryFile.name + ".snapshot";
+            const bool snapshots = file.get<bool>("snapshot", true);
+            if (snapshots && gallery->restore(snapshot, galleryFile.name))
+                return;
+
+            QSharedPointer<Gallery> sourceGallery(Factory<Gallery>::make(galleryFile));
+            foreach (const Template &t, sourceGallery->read())
+                gallery->append(t);
+            if (snapshots)
+                gallery->snapshot(snapshot, galleryFile.name);
         }
     }
 
     TemplateList readBlock(bool *done)
     {
-        if (!MemoryGalleries::aligned[file]) {
-            align(MemoryGalleries::galleries[file]);
-            MemoryGalleries::aligned[file] = true;
-        }
-
-        TemplateList templates = MemoryGalleries::galleries[file].mid(block*Globals->blockSize, Globals->blockSize);
+        TemplateList templates = gallery->mid(block*Globals->blockSize, Globals->blockSize);
         *done = (templates.size() < Globals->blockSize);
         block = *done ? 0 : block+1;
         return templates;
@@ -351,42 +1811,105 @@ class memGallery : public Gallery
 
     void write(const Template &t)
     {
-        MemoryGalleries::galleries[file].append(t);
-        MemoryGalleries::aligned[file] = false;
+        gallery->append(t);
+    }
+};
+
+BR_REGISTER(Gallery, memGallery)
+
+/*!
+ * \brief Reads a text file a block of lines at a time without copying it.
+ *
+ * The file is memory mapped and lines are found with \c memchr, each is returned as a range of the mapping
+ * that stays valid until close(). Empty lines are skipped, lines are simplified when parsed like QtUtils::readLines().
+ */
+class LineReader
+{
+    QFile file;
+    QByteArray contents; // If the file can't be mapped
+    const char *position, *end;
+
+public:
+    struct Line
+    {
+        const char *data;
+        int size;
+    };
+
+    LineReader() : position(NULL), end(NULL) {}
+
+    bool isOpen() const
+    {
+        return file.isOpen();
     }
 
-    static void align(TemplateList &templates)
+    void open(const QString &fileName)
     {
-        if (!templates.empty() && templates[0].size() > 1) return;
+        file.setFileName(fileName);
+        if (!file.open(QFile::ReadOnly)) qFatal("Unable to open %s for reading.", qPrintable(fileName));
+        const qint64 size = file.size();
+        const uchar *mapped = (size > 0) ? file.map(0, size) : NULL;
+        if (mapped == NULL) contents = file.readAll();
+        position = mapped ? reinterpret_cast<const char*>(mapped) : contents.constData();
+        end = position + (mapped ? size : contents.size());
+    }
 
-        bool uniform = true;
-        QVector<uchar> alignedData(templates.bytes<size_t>());
-        size_t offset = 0;
-        for (int i=0; i<templates.size(); i++) {
-            Template &t = templates[i];
-            if (t.size() > 1) qFatal("Can't handle multi-matrix template %s.", qPrintable(t.file.flat()));
+    // Call after parsing the last block so the next read starts over
+    void close()
+    {
+        file.close();
+        contents.clear();
+        position = end = NULL;
+    }
 
-            cv::Mat &m = t;
-            if (m.data) {
-                const size_t size = m.total() * m.elemSize();
-                if (!m.isContinuous()) qFatal("Requires continuous matrix data of size %d for %s.", (int)size, qPrintable(t.file.flat()));
-                memcpy(&(alignedData.data()[offset]), m.ptr(), size);
-                m = cv::Mat(m.rows, m.cols, m.type(), &(alignedData.data()[offset]));
-                offset += size;
+    QVector<Line> read(int n, bool *done)
+    {
+        QVector<Line> lines;
+        lines.reserve(n);
+        while ((lines.size() < n) && (position < end)) {
+            const char *newline = static_cast<const char*>(memchr(position, '\n', end - position));
+            const char *lineEnd = newline ? newline : end;
+            if (lineEnd > position) {
+                const Line line = { position, int(lineEnd - position) };
+                lines.append(line);
             }
-            uniform = uniform &&
-                      (m.rows == templates.first().m().rows) &&
-                      (m.cols == templates.first().m().cols) &&
-                      (m.type() == templates.first().m().type());
+            position = newline ? newline + 1 : end;
         }
+        *done = (position >= end);
+        return lines;
+    }
 
-        templates.uniform = uniform;
-        templates.alignedData = alignedData;
+    // QString::simplified() of the UTF-8 bytes, decoded directly when already simple ASCII
+    static QString simplified(const char *data, int size)
+    {
+        while ((size > 0) && isSpace(data[0])) { data++; size--; }
+        while ((size > 0) && isSpace(data[size-1])) size--;
+        for (int i=0; i<size; i++)
+            if ((uchar(data[i]) >= 0x80) || (isSpace(data[i]) && ((data[i] != ' ') || isSpace(data[i+1]))))
+                return QString::fromUtf8(data, size).simplified();
+        return QString::fromLatin1(data, size);
     }
 
-};
+    // The simplified fields between commas, like splitting a simplified line at "\s*,\s*"
+    static QStringList split(const Line &line)
+    {
+        QStringList words;
+        const char *begin = line.data, *end = line.data + line.size;
+        while (true) {
+            const char *comma = static_cast<const char*>(memchr(begin, ',', end - begin));
+            words.append(simplified(begin, int((comma ? comma : end) - begin)));
+            if (!comma) break;
+            begin = comma + 1;
+        }
+        return words;
+    }
 
-BR_REGISTER(Gallery, memGallery)
+private:
+    static inline bool isSpace(char c)
+    {
+        return (c == ' ') || (c == '\t') || (c == '\n') || (c == '\v') || (c == '\f') || (c == '\r');
+    }
+};
 
 /*!
  * \ingroup galleries
@@ -406,6 +1929,8 @@ class csvGallery : public Gallery
     BR_PROPERTY(int, fileIndex, 0)
 
     FileList files;
+    LineReader reader;
+    QStringList headers;
 
     ~csvGallery()
     {
@@ -448,15 +1973,33 @@ class csvGallery : public Gallery
     {
         *done = true;
         TemplateList templates;
-        if (!file.exists()) return templates;
+        if (!reader.isOpen()) {
+            if (!file.exists()) return templates;
+            reader.open(file);
+            bool headerOnly;
+            const QVector<LineReader::Line> header = reader.read(1, &headerOnly);
+            headers = header.isEmpty() ? QStringList() : LineReader::split(header.first());
+        }
 
-        QStringList lines = QtUtils::readLines(file);
-        QRegExp regexp("\\s*,\\s*");
-        QStringList headers;
-        if (!lines.isEmpty()) headers = lines.takeFirst().split(regexp);
+        // Split the next block of lines in parallel
+        const QVector<LineReader::Line> lines = reader.read(Globals->blockSize, done);
+        const int step = qMax(1, (lines.size() + Globals->parallelism - 1) / qMax(1, Globals->parallelism));
+        QList< QFuture<TemplateList> > futures;
+        for (int i=0; i<lines.size(); i+=step)
+            futures.append(QtConcurrent::run(&csvGallery::parseLines, lines.mid(i, step), headers));
+        foreach (const QFuture<TemplateList> &future, futures)
+            templates.append(future.result());
 
-        foreach (const QString &line, lines) {
-            QStringList words = line.split(regexp);
+        if (*done) reader.close();
+        return templates;
+    }
+
+    static TemplateList parseLines(const QVector<LineReader::Line> &lines, const QStringList &headers)
+    {
+        TemplateList templates;
+        templates.reserve(lines.size());
+        foreach (const LineReader::Line &line, lines) {
+            const QStringList words = LineReader::split(line);
             if (words.size() != headers.size()) continue;
             File f;
             for (int i=0; i<words.size(); i++) {
@@ -465,7 +2008,6 @@ class csvGallery : public Gallery
             }
             templates.append(f);
         }
-
         return templates;
     }
 
@@ -512,6 +2054,7 @@ class txtGallery : public Gallery
     BR_PROPERTY(QString, metadataKey, "")
 
     QStringList lines;
+    LineReader reader;
 
     ~txtGallery()
     {
@@ -522,11 +2065,30 @@ class txtGallery : public Gallery
     {
         *done = true;
         TemplateList templates;
-        if (!file.exists()) return templates;
+        if (!reader.isOpen()) {
+            if (!file.exists()) return templates;
+            reader.open(file);
+        }
 
-        foreach (const QString &line, QtUtils::readLines(file))
-            templates.append(File(line));
-        *done = true;
+        // Parse the next block of lines in parallel
+        const QVector<LineReader::Line> lines = reader.read(Globals->blockSize, done);
+        const int step = qMax(1, (lines.size() + Globals->parallelism - 1) / qMax(1, Globals->parallelism));
+        QList< QFuture<TemplateList> > futures;
+        for (int i=0; i<lines.size(); i+=step)
+            futures.append(QtConcurrent::run(&txtGallery::parseLines, lines.mid(i, step)));
+        foreach (const QFuture<TemplateList> &future, futures)
+            templates.append(future.result());
+
+        if (*done) reader.close();
+        return templates;
+    }
+
+    static TemplateList parseLines(const QVector<LineReader::Line> &lines)
+    {
+        TemplateList templates;
+        templates.reserve(lines.size());
+        foreach (const LineReader::Line &line, lines)
+            templates.append(File(LineReader::simplified(line.data, line.size)));
         return templates;
     }
 
@@ -556,10 +2118,15 @@ class xmlGallery : public Gallery
             BEE::writeSigset(file, files, ignoreMetadata);
     }
 
+    QScopedPointer<BEE::SigsetReader> reader;
+
     TemplateList readBlock(bool *done)
     {
-        *done = true;
-        return TemplateList(BEE::readSigset(file, ignoreMetadata));
+        if (reader.isNull())
+            reader.reset(new BEE::SigsetReader(file, ignoreMetadata));
+        const TemplateList templates(reader->read(Globals->blockSize, done));
+        if (*done) reader.reset();
+        return templates;
     }
 
     void write(const Template &t)
@@ -604,13 +2171,89 @@ BR_REGISTER(Gallery, templateGallery)
 /*!
  * \ingroup galleries
  * \brief Database input.
+ *
+ * With a \em query (optionally after an \em import of a CSV file into a table), the query selects the files to enroll.
+ * Otherwise templates are stored in \em table as one row per template with indexed \c File and \c Label columns and the serialized template,
+ * written in one transaction per block of templates and read back a block at a time through a forward-only cursor.
+ * Set \em label to read only the templates of one subject, and \em pattern to read only those whose \c File matches an SQL \c LIKE pattern.
+ * Both are bound as parameters, never pasted into the statement.
  * \author Josh Klontz \cite jklontz
  */
 class dbGallery : public Gallery
 {
     Q_OBJECT
+    Q_PROPERTY(QString table READ get_table WRITE set_table RESET reset_table STORED false)
+    Q_PROPERTY(QString label READ get_label WRITE set_label RESET reset_label STORED false)
+    Q_PROPERTY(QString pattern READ get_pattern WRITE set_pattern RESET reset_pattern STORED false)
+    BR_PROPERTY(QString, table, "templates")
+    BR_PROPERTY(QString, label, QString())
+    BR_PROPERTY(QString, pattern, QString())
+
+    TemplateList pending; // Written templates not yet inserted
+#ifndef BR_EMBEDDED
+    QSqlDatabase db;
+    QScopedPointer<QSqlQuery> cursor;
+    bool created;
+#endif // BR_EMBEDDED
+
+    ~dbGallery()
+    {
+        flush();
+#ifndef BR_EMBEDDED
+        cursor.reset();
+        if (db.isValid()) {
+            const QString connection = db.connectionName();
+            db.close();
+            db = QSqlDatabase();
+            QSqlDatabase::removeDatabase(connection);
+        }
+#endif // BR_EMBEDDED
+    }
 
     TemplateList readBlock(bool *done)
+    {
+        if (file.contains("query"))
+            return readQuery(done);
+
+        TemplateList templates;
+        *done = true;
+#ifndef BR_EMBEDDED
+        flush();
+        if (cursor.isNull()) {
+            open();
+            if (!db.tables().contains(table)) return templates;
+
+            QStringList conditions;
+            if (!label.isEmpty()) conditions.append("Label = ?");
+            if (!pattern.isEmpty()) conditions.append("File LIKE ?");
+
+            cursor.reset(new QSqlQuery(db));
+            cursor->setForwardOnly(true);
+            if (!cursor->prepare("SELECT Template FROM " + tableName() + (conditions.isEmpty() ? QString() : " WHERE " + conditions.join(" AND ")) + " ORDER BY rowid"))
+                qFatal("%s.", qPrintable(cursor->lastError().text()));
+            if (!label.isEmpty()) cursor->addBindValue(label);
+            if (!pattern.isEmpty()) cursor->addBindValue(pattern);
+            if (!cursor->exec())
+                qFatal("%s.", qPrintable(cursor->lastError().text()));
+        }
+
+        *done = false;
+        while (templates.size() < Globals->blockSize) {
+            if (!cursor->next()) {
+                *done = true;
+                break;
+            }
+            Template t;
+            QDataStream stream(cursor->value(0).toByteArray());
+            stream >> t;
+            templates.append(t);
+        }
+        if (*done) cursor.reset();
+#endif // BR_EMBEDDED
+        return templates;
+    }
+
+    TemplateList readQuery(bool *done)
     {
         TemplateList templates;
         br::File import = file.get<QString>("import", "");
@@ -618,9 +2261,7 @@ class dbGallery : public Gallery
         QString subset = file.get<QString>("subset", "");
 
 #ifndef BR_EMBEDDED
-        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE");
-        db.setDatabaseName(file);
-        if (!db.open()) qFatal("Failed to open SQLite database %s.", qPrintable(file.name));
+        open();
 
         if (!import.isNull()) {
             qDebug("Parsing %s", qPrintable(import.name));
@@ -742,8 +2383,6 @@ class dbGallery : public Gallery
                 numSubjects--;
             }
         }
-
-        db.close();
 #endif // BR_EMBEDDED
 
         *done = true;
@@ -752,13 +2391,77 @@ class dbGallery : public Gallery
 
     void write(const Template &t)
     {
-        (void) t;
+        if (t.isEmpty() && t.file.isNull())
+            return;
+
+        pending.append(t);
+        if (pending.size() >= Globals->blockSize)
+            flush();
+    }
+
+    void flush()
+    {
+        if (pending.isEmpty())
+            return;
+
+#ifndef BR_EMBEDDED
+        open();
+        if (!db.transaction()) qFatal("%s.", qPrintable(db.lastError().text()));
+
+        QSqlQuery q(db);
+        if (!created) {
+            if (!q.exec("CREATE TABLE IF NOT EXISTS " + tableName() + " (File STRING, Label STRING, Template BLOB);") ||
+                !q.exec("CREATE INDEX IF NOT EXISTS " + tableName("_File") + " ON " + tableName() + " (File);") ||
+                !q.exec("CREATE INDEX IF NOT EXISTS " + tableName("_Label") + " ON " + tableName() + " (Label);"))
+                qFatal("%s.", qPrintable(q.lastError().text()));
+            created = true;
+        }
+
+        QVariantList files, labels, blobs;
+        foreach (const Template &t, pending) {
+            QByteArray blob;
+            QDataStream stream(&blob, QIODevice::WriteOnly);
+            stream << t;
+            files.append(t.file.name);
+            labels.append(t.file.get<QString>("Label", QString()));
+            blobs.append(blob);
+        }
+
+        if (!q.prepare("INSERT INTO " + tableName() + " (File, Label, Template) VALUES (?, ?, ?)"))
+            qFatal("%s.", qPrintable(q.lastError().text()));
+        q.addBindValue(files);
+        q.addBindValue(labels);
+        q.addBindValue(blobs);
+        if (!q.execBatch()) qFatal("%s.", qPrintable(q.lastError().text()));
+        if (!db.commit()) qFatal("%s.", qPrintable(db.lastError().text()));
+#else // BR_EMBEDDED
         qFatal("Not supported.");
+#endif // BR_EMBEDDED
+        pending.clear();
     }
 
+#ifndef BR_EMBEDDED
+    void open()
+    {
+        if (db.isOpen()) return;
+        // Each gallery has its own connection so several can be open at once
+        db = QSqlDatabase::addDatabase("QSQLITE", "dbGallery" + QString::number(quintptr(this)));
+        db.setDatabaseName(file);
+        if (!db.open()) qFatal("Failed to open SQLite database %s.", qPrintable(file.name));
+    }
+
+    // Identifiers can't be bound, so the table name is quoted by the driver instead
+    QString tableName(const QString &suffix = QString()) const
+    {
+        return db.driver()->escapeIdentifier(table + suffix, QSqlDriver::TableName);
+    }
+#endif // BR_EMBEDDED
+
     void init()
     {
-        //
+#ifndef BR_EMBEDDED
+        created = false;
+#endif // BR_EMBEDDED
     }
 };
 
@@ -822,30 +2525,196 @@ class googleGallery : public Gallery
 
 BR_REGISTER(Gallery, googleGallery)
 
+// Count, mean, variance and range of a stream of values, mergeable across threads
+struct Moments
+{
+    qint64 count;
+    double mean, m2, min, max;
+
+    Moments() : count(0), mean(0), m2(0), min(std::numeric_limits<double>::max()), max(-std::numeric_limits<double>::max()) {}
+
+    void add(double value)
+    {
+        count++;
+        const double delta = value - mean;
+        mean += delta / count;
+        m2 += delta * (value - mean);
+        min = std::min(min, value);
+        max = std::max(max, value);
+    }
+
+    void merge(const Moments &other)
+    {
+        if (other.count == 0) return;
+        const qint64 total = count + other.count;
+        const double delta = other.mean - mean;
+        mean += delta * other.count / total;
+        m2 += other.m2 + delta * delta * count * other.count / total;
+        count = total;
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+    }
+
+    double stdDev() const
+    {
+        return (count > 1) ? sqrt(m2 / (count - 1)) : 0;
+    }
+};
+
+// Moments plus quantiles from a logarithmic histogram, accurate to 1% of the value
+struct Summary : public Moments
+{
+    QMap<int, qint64> negative, positive;
+    qint64 zeros;
+
+    Summary() : zeros(0) {}
+
+    static double gamma() { return 1.02; }
+    static int bucket(double magnitude) { return int(ceil(log(magnitude) / log(gamma()))); }
+    static double value(int bucket) { return 2 * pow(gamma(), bucket) / (gamma() + 1); }
+
+    void add(double value)
+    {
+        Moments::add(value);
+        if      (value > 0) positive[bucket(value)]++;
+        else if (value < 0) negative[bucket(-value)]++;
+        else                zeros++;
+    }
+
+    void merge(const Summary &other)
+    {
+        Moments::merge(other);
+        for (QMap<int, qint64>::const_iterator it = other.negative.begin(); it != other.negative.end(); it++)
+            negative[it.key()] += it.value();
+        for (QMap<int, qint64>::const_iterator it = other.positive.begin(); it != other.positive.end(); it++)
+            positive[it.key()] += it.value();
+        zeros += other.zeros;
+    }
+
+    double quantile(double q) const
+    {
+        if (count == 0) return 0;
+        const qint64 rank = qint64(q * (count - 1));
+        qint64 seen = 0;
+        double result = max;
+        bool found = false;
+        QMapIterator<int, qint64> it(negative);
+        it.toBack();
+        while (!found && it.hasPrevious()) {
+            it.previous();
+            if ((seen += it.value()) > rank) { result = -value(it.key()); found = true; }
+        }
+        if (!found && ((seen += zeros) > rank)) { result = 0; found = true; }
+        for (QMap<int, qint64>::const_iterator jt = positive.begin(); !found && (jt != positive.end()); jt++)
+            if ((seen += jt.value()) > rank) { result = value(jt.key()); found = true; }
+        return std::min(max, std::max(min, result));
+    }
+};
+
+// Statistics of a block of templates, blocks are summarized in parallel and merged in order
+struct Statistics
+{
+    QSet<QString> subjects;
+    int emptyTemplates;
+    Moments bytes;
+    QMap<QString, qint64> keys;
+    QMap<QString, Summary> values;
+    QVector<Moments> dimensions;
+
+    Statistics() : emptyTemplates(0) {}
+
+    void add(const Template &t, bool perDimension)
+    {
+        subjects.insert(t.file.get<QString>("Label"));
+        const int templateBytes = t.bytes();
+        if (templateBytes == 0) emptyTemplates++;
+        else                    bytes.add(templateBytes);
+
+        const QMap<QString,QVariant> metadata = t.file.localMetadata();
+        for (QMap<QString,QVariant>::const_iterator it = metadata.begin(); it != metadata.end(); it++) {
+            keys[it.key()]++;
+            bool ok = false;
+            const double value = it.value().toDouble(&ok);
+            if (ok) values[it.key()].add(value);
+        }
+
+        if (perDimension && !t.isEmpty() && t.m().data) {
+            cv::Mat m;
+            t.m().reshape(1, 1).convertTo(m, CV_64F);
+            if (dimensions.size() < m.cols) dimensions.resize(m.cols);
+            const double *data = m.ptr<double>();
+            for (int i=0; i<m.cols; i++)
+                dimensions[i].add(data[i]);
+        }
+    }
+
+    void merge(const Statistics &other)
+    {
+        subjects.unite(other.subjects);
+        emptyTemplates += other.emptyTemplates;
+        bytes.merge(other.bytes);
+        for (QMap<QString, qint64>::const_iterator it = other.keys.begin(); it != other.keys.end(); it++)
+            keys[it.key()] += it.value();
+        for (QMap<QString, Summary>::const_iterator it = other.values.begin(); it != other.values.end(); it++)
+            values[it.key()].merge(it.value());
+        if (dimensions.size() < other.dimensions.size()) dimensions.resize(other.dimensions.size());
+        for (int i=0; i<other.dimensions.size(); i++)
+            dimensions[i].merge(other.dimensions[i]);
+    }
+
+    static Statistics compute(const TemplateList &templates, bool perDimension)
+    {
+        Statistics statistics;
+        foreach (const Template &t, templates)
+            statistics.add(t, perDimension);
+        return statistics;
+    }
+};
+
 /*!
  * \ingroup galleries
  * \brief Print template statistics.
+ *
+ * Written templates are summarized a block at a time on the thread pool, so the writer isn't held up,
+ * and the merged statistics are printed once the gallery is closed.
+ * Numeric metadata values are reported with their mean, standard deviation and quartiles,
+ * set \em dimensions to also report the mean, standard deviation and range of each matrix element.
  * \author Josh Klontz \cite jklontz
  */
 class statGallery : public Gallery
 {
     Q_OBJECT
-    QSet<QString> subjects;
-    QList<int> bytes;
+    Q_PROPERTY(bool dimensions READ get_dimensions WRITE set_dimensions RESET reset_dimensions STORED false)
+    BR_PROPERTY(bool, dimensions, false)
+
+    TemplateList pending;
+    QList< QFuture<Statistics> > futures;
+    Statistics statistics;
 
     ~statGallery()
     {
-        int emptyTemplates = 0;
-        for (int i=bytes.size()-1; i>=0; i--)
-            if (bytes[i] == 0) {
-                bytes.removeAt(i);
-                emptyTemplates++;
-            }
+        flush();
+        while (!futures.isEmpty())
+            statistics.merge(futures.takeFirst().result());
 
-        double bytesMean, bytesStdDev;
-        Common::MeanStdDev(bytes, &bytesMean, &bytesStdDev);
         printf("Subjects: %d\nEmpty Templates: %d/%d\nBytes/Template: %.4g +/- %.4g\n",
-               subjects.size(), emptyTemplates, emptyTemplates+bytes.size(), bytesMean, bytesStdDev);
+               statistics.subjects.size(), statistics.emptyTemplates, int(statistics.emptyTemplates+statistics.bytes.count),
+               statistics.bytes.mean, statistics.bytes.stdDev());
+
+        for (QMap<QString, qint64>::const_iterator it = statistics.keys.begin(); it != statistics.keys.end(); it++) {
+            if (!statistics.values.contains(it.key())) {
+                printf("%s: %lld\n", qPrintable(it.key()), it.value());
+                continue;
+            }
+            const Summary &summary = statistics.values[it.key()];
+            printf("%s: %lld, %.4g +/- %.4g [%.4g, %.4g, %.4g, %.4g, %.4g]\n", qPrintable(it.key()), it.value(),
+                   summary.mean, summary.stdDev(), summary.min, summary.quantile(0.25), summary.quantile(0.5), summary.quantile(0.75), summary.max);
+        }
+
+        for (int i=0; i<statistics.dimensions.size(); i++) {
+            const Moments &moments = statistics.dimensions[i];
+            printf("Dimension %d: %.4g +/- %.4g [%.4g, %.4g]\n", i, moments.mean, moments.stdDev(), moments.min, moments.max);
+        }
     }
 
     TemplateList readBlock(bool *done)
@@ -856,13 +2725,195 @@ class statGallery : public Gallery
 
     void write(const Template &t)
     {
-        subjects.insert(t.file.get<QString>("Label"));
-        bytes.append(t.bytes());
+        pending.append(t);
+        if (pending.size() >= std::max(1, Globals->blockSize / std::max(1, Globals->parallelism)))
+            flush();
+    }
+
+    void flush()
+    {
+        if (pending.isEmpty()) return;
+        futures.append(QtConcurrent::run(Statistics::compute, pending, dimensions));
+        pending.clear();
+
+        // Bound the templates held by blocks waiting to be summarized
+        while (futures.size() > 2*std::max(1, Globals->parallelism))
+            statistics.merge(futures.takeFirst().result());
     }
 };
 
 BR_REGISTER(Gallery, statGallery)
 
+/*!
+ * \ingroup galleries
+ * \brief Generates reproducible templates of random or clustered feature vectors for scale testing.
+ *
+ * Nothing is stored, template \c i is a function of \em seed and \c i alone, so blocks are generated on demand,
+ * at random and in parallel, and galleries of millions of templates can be streamed into another gallery without staging them:
+ * \code
+ * $ br -convert Gallery "gallery.synthetic[count=10000000,dimensions=256,type=uchar,subjects=1000000]" gallery.mmg
+ * \endcode
+ * Each template is one row of \em dimensions features, stored as:
+ * - \c float, one \c CV_32F per dimension.
+ * - \c uchar, one byte per dimension.
+ * - \c packed, four bits per dimension as for br::HalfByteL1Distance.
+ * - \c bits, one bit per dimension as for br::HammingDistance.
+ *
+ * \em clustered templates are drawn around a center per subject with standard deviation \em noise,
+ * otherwise every template is independent noise.
+ * Subjects are assigned uniformly, or following Zipf's law with exponent \em skew if it is positive,
+ * and templates carry their subject as \c Label and \em metadataBytes characters of \c Metadata.
+ * \author Josh Klontz \cite jklontz
+ */
+class syntheticGallery : public Gallery
+{
+    Q_OBJECT
+    Q_PROPERTY(int count READ get_count WRITE set_count RESET reset_count STORED false)
+    Q_PROPERTY(int dimensions READ get_dimensions WRITE set_dimensions RESET reset_dimensions STORED false)
+    Q_PROPERTY(QString type READ get_type WRITE set_type RESET reset_type STORED false)
+    Q_PROPERTY(int subjects READ get_subjects WRITE set_subjects RESET reset_subjects STORED false)
+    Q_PROPERTY(float skew READ get_skew WRITE set_skew RESET reset_skew STORED false)
+    Q_PROPERTY(bool clustered READ get_clustered WRITE set_clustered RESET reset_clustered STORED false)
+    Q_PROPERTY(float noise READ get_noise WRITE set_noise RESET reset_noise STORED false)
+    Q_PROPERTY(int metadataBytes READ get_metadataBytes WRITE set_metadataBytes RESET reset_metadataBytes STORED false)
+    Q_PROPERTY(int seed READ get_seed WRITE set_seed RESET reset_seed STORED false)
+    BR_PROPERTY(int, count, 1000)
+    BR_PROPERTY(int, dimensions, 256)
+    BR_PROPERTY(QString, type, "uchar")
+    BR_PROPERTY(int, subjects, 100)
+    BR_PROPERTY(float, skew, 0)
+    BR_PROPERTY(bool, clustered, true)
+    BR_PROPERTY(float, noise, 0.5)
+    BR_PROPERTY(int, metadataBytes, 0)
+    BR_PROPERTY(int, seed, 0)
+
+    QVector<double> cumulative; // Zipf distribution of subjects
+    int position;
+
+    void init()
+    {
+        if ((count < 0) || (dimensions <= 0) || (subjects <= 0))
+            qFatal("Invalid synthetic gallery %s.", qPrintable(file.flat()));
+        if (!(QStringList() << "float" << "uchar" << "packed" << "bits").contains(type))
+            qFatal("Unknown synthetic template type %s.", qPrintable(type));
+        if (((type == "packed") && (dimensions % 2 != 0)) || ((type == "bits") && (dimensions % 8 != 0)))
+            qFatal("Synthetic %s templates need a dimensionality that fills whole bytes.", qPrintable(type));
+
+        cumulative.clear();
+        if (skew > 0) {
+            cumulative.resize(subjects);
+            double total = 0;
+            for (int i=0; i<subjects; i++)
+                cumulative[i] = (total += 1 / pow(double(i+1), double(skew)));
+            for (int i=0; i<subjects; i++)
+                cumulative[i] /= total;
+        }
+        position = 0;
+    }
+
+    int subject(int index, cv::RNG &rng) const
+    {
+        if (cumulative.isEmpty()) return index % subjects;
+        const double *begin = cumulative.constData();
+        return std::min(subjects-1, int(std::lower_bound(begin, begin + subjects, rng.uniform(0., 1.)) - begin));
+    }
+
+    Template generate(int index) const
+    {
+        // Independent streams per template and subject, so any template can be generated alone
+        cv::RNG rng(quint64(seed) * 0x9E3779B97F4A7C15ULL + quint64(index) + 1);
+        const int label = subject(index, rng);
+
+        cv::Mat features(1, dimensions, CV_32FC1);
+        rng.fill(features, cv::RNG::NORMAL, 0, clustered ? noise : 1);
+        if (clustered) {
+            cv::RNG centerRNG(quint64(seed) * 0xC2B2AE3D27D4EB4FULL + quint64(label) + 1);
+            cv::Mat center(1, dimensions, CV_32FC1);
+            centerRNG.fill(center, cv::RNG::NORMAL, 0, 1);
+            features += center;
+        }
+
+        cv::Mat m;
+        if (type == "float") {
+            m = features;
+        } else {
+            // Two standard deviations either side of zero span the byte
+            cv::Mat bytes;
+            features.convertTo(bytes, CV_8U, 64, 128);
+            if (type == "uchar") {
+                m = bytes;
+            } else if (type == "packed") {
+                m = cv::Mat(1, dimensions/2, CV_8UC1);
+                for (int j=0; j<dimensions/2; j++)
+                    m.at<uchar>(0,j) = ((bytes.at<uchar>(0,2*j+0) >> 4) << 4) + (bytes.at<uchar>(0,2*j+1) >> 4);
+            } else {
+                m = cv::Mat(1, dimensions/8, CV_8UC1);
+                for (int j=0; j<dimensions/8; j++) {
+                    uchar byte = 0;
+                    for (int k=0; k<8; k++)
+                        byte |= uchar(features.at<float>(0,8*j+k) > 0) << k;
+                    m.at<uchar>(0,j) = byte;
+                }
+            }
+        }
+
+        Template t(File(QString("synthetic%1").arg(index)), m);
+        t.file.set("Label", label);
+        if (metadataBytes > 0) t.file.set("Metadata", QString(metadataBytes, QChar('a' + index % 26)));
+        return t;
+    }
+
+    static void generateRange(const syntheticGallery *gallery, TemplateList *templates, int offset, int begin, int end)
+    {
+        for (int i=begin; i<end; i++)
+            (*templates)[i] = gallery->generate(offset + i);
+    }
+
+    int blockCount()
+    {
+        return int((qint64(count) + Globals->blockSize - 1) / Globals->blockSize);
+    }
+
+    TemplateList readBlockAt(int block)
+    {
+        if ((block < 0) || (block >= blockCount()))
+            return TemplateList();
+
+        const int offset = block * Globals->blockSize;
+        const int size = std::min(Globals->blockSize, count - offset);
+        TemplateList templates;
+        templates.reserve(size);
+        for (int i=0; i<size; i++)
+            templates.append(Template());
+
+        const int chunk = std::max(1, size / std::max(1, QThreadPool::globalInstance()->maxThreadCount() * 4));
+        QFutureSynchronizer<void> futures;
+        for (int begin=0; begin<size; begin+=chunk) {
+            const int end = std::min(size, begin+chunk);
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(generateRange, this, &templates, offset, begin, end));
+            else                                        generateRange(this, &templates, offset, begin, end);
+        }
+        futures.waitForFinished();
+        return templates;
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        const TemplateList templates = readBlockAt(position++);
+        *done = (position >= blockCount());
+        if (*done) position = 0;
+        return templates;
+    }
+
+    void write(const Template &t)
+    {
+        (void) t;
+        qFatal("Synthetic galleries are read only.");
+    }
+};
+
+BR_REGISTER(Gallery, syntheticGallery)
+
 /*!
  * \ingroup galleries
  * \brief Implements the FDDB detection format.
@@ -0,0 +1,6 @@
+set(BR_WITH_GPU OFF CACHE BOOL "Offload linear projection and distance matrices to a CUDA device through opencv_gpu")
+
+if(${BR_WITH_GPU})
+  add_definitions(-DBR_WITH_GPU)
+  set(BR_THIRDPARTY_SRC ${BR_THIRDPARTY_SRC} plugins/gpu.cpp)
+endif()
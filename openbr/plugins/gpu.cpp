@@ -0,0 +1,246 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QMutex>
+#include <opencv2/gpu/gpu.hpp>
+#include "openbr_internal.h"
+
+#include "openbr/core/distance_sse.h"
+#include "openbr/core/opencvutils.h"
+
+using namespace cv;
+
+namespace br
+{
+
+namespace GPU
+{
+
+// Whether opencv_gpu was built with CUDA and CUBLAS and a device is present, checked once
+bool available()
+{
+    static QMutex lock;
+    static int status = -1;
+    QMutexLocker locker(&lock);
+    if (status == -1) {
+        status = 0;
+        try {
+            if (gpu::getCudaEnabledDeviceCount() > 0) {
+                gpu::GpuMat a(Mat::ones(2, 2, CV_32FC1)), b;
+                gpu::gemm(a, a, 1, gpu::GpuMat(), 0, b);
+                status = 1;
+            }
+        } catch (const cv::Exception &) {}
+        if (Globals->verbose) qDebug("GPU offload %s.", status ? "enabled" : "unavailable, using the CPU");
+    }
+    return status == 1;
+}
+
+// Rows of a matrix with the given bytes per row that fit in a share of free device memory
+static int batchRows(size_t bytesPerRow, int rows)
+{
+    const size_t budget = gpu::DeviceInfo().freeMemory() / 4;
+    return std::max(1, (int)std::min(size_t(rows), budget / std::max(size_t(1), bytesPerRow)));
+}
+
+// A rows x cols device matrix whose rows are all row
+static void repeatRow(const gpu::GpuMat &row, int rows, gpu::GpuMat &dst)
+{
+    const gpu::GpuMat ones(Mat::ones(rows, 1, CV_32FC1));
+    gpu::gemm(ones, row, 1, gpu::GpuMat(), 0, dst);
+}
+
+void project(const Mat &src, const Mat &mean, const Mat &projection, Mat &dst)
+{
+    // (src - mean) * projection^T computed as src * projection^T - mean * projection^T
+    Mat offset;
+    gemm(mean, projection, 1, Mat(), 0, offset, GEMM_2_T);
+
+    const gpu::GpuMat projectionDevice(projection), offsetDevice(offset);
+    dst.create(src.rows, projection.rows, CV_32FC1);
+    const int step = batchRows(sizeof(float) * (src.cols + 2*projection.rows), src.rows);
+    for (int i=0; i<src.rows; i+=step) {
+        const Range rows(i, std::min(i+step, src.rows));
+        gpu::GpuMat in(src.rowRange(rows)), offsets, out;
+        repeatRow(offsetDevice, in.rows, offsets);
+        gpu::gemm(in, projectionDevice, 1, offsets, -1, out, GEMM_2_T);
+        Mat block = dst.rowRange(rows);
+        out.download(block);
+    }
+}
+
+void correlate(const Mat &src, const QList<Mat> &spectra, QList<Mat> &dst)
+{
+    // The forward transform is shared by every spectrum, each product is inverse transformed and scaled on the device
+    std::vector<Mat> mv;
+    mv.push_back(src);
+    mv.push_back(Mat::zeros(src.size(), CV_32FC1));
+    Mat complex;
+    merge(mv, complex);
+
+    const gpu::GpuMat image(complex);
+    gpu::GpuMat imageSpectrum;
+    gpu::dft(image, imageSpectrum, src.size());
+
+    dst.clear();
+    const float scale = 1.f / src.total();
+    foreach (const Mat &spectrum, spectra) {
+        gpu::GpuMat kernel(spectrum), product, correlation;
+        gpu::mulAndScaleSpectrums(imageSpectrum, kernel, product, 0, scale, true);
+        gpu::dft(product, correlation, src.size(), DFT_INVERSE);
+        Mat result;
+        correlation.download(result);
+        dst.append(result);
+    }
+}
+
+} // namespace GPU
+
+/*!
+ * \ingroup distances
+ * \brief L1, L2 and byte L1 distance matrices computed on a CUDA device.
+ *
+ * Scores match Dist(L1), Dist(L2) and ByteL1 respectively.
+ * Each block of targets is uploaded once and compared against every query a batch at a time,
+ * sized to the free device memory, with tiles of scores written straight to the output.
+ * Without a device, or for templates that are not uniform single matrices, the comparison runs on the CPU.
+ * \author Josh Klontz \cite jklontz
+ */
+class GPUDistance : public Distance
+{
+    Q_OBJECT
+    Q_ENUMS(Metric)
+    Q_PROPERTY(Metric metric READ get_metric WRITE set_metric RESET reset_metric STORED false)
+    Q_PROPERTY(bool negLogPlusOne READ get_negLogPlusOne WRITE set_negLogPlusOne RESET reset_negLogPlusOne STORED false)
+
+public:
+    /*!< */
+    enum Metric { L1,
+                  L2,
+                  ByteL1 };
+
+private:
+    BR_PROPERTY(Metric, metric, L2)
+    BR_PROPERTY(bool, negLogPlusOne, true)
+
+    float score(float distance) const
+    {
+        if (metric == ByteL1) return distance;
+        return negLogPlusOne ? -log(distance+1) : distance;
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        if ((a.m().size != b.m().size) ||
+            (a.m().type() != b.m().type()))
+                return -std::numeric_limits<float>::max();
+
+        if (metric == ByteL1) return l1(a.m().data, b.m().data, a.m().total());
+        return score(norm(a, b, metric == L1 ? NORM_L1 : NORM_L2));
+    }
+
+    static bool uniform(const TemplateList &templates, int type, size_t total)
+    {
+        foreach (const Template &t, templates)
+            if ((t.size() != 1) || (t.m().type() != type) || !t.m().isContinuous() || (t.m().total() != total))
+                return false;
+        return true;
+    }
+
+    void compare(const TemplateList &target, const TemplateList &query, Output *output) const
+    {
+        const int type = (metric == ByteL1) ? CV_8UC1 : CV_32FC1;
+        if (target.isEmpty() || query.isEmpty() || !GPU::available() ||
+            !uniform(target, type, target.first().m().total()) ||
+            !uniform(query, type, target.first().m().total())) {
+            Distance::compare(target, query, output);
+            return;
+        }
+
+        const Mat targets = OpenCVUtils::toMat(target.data());
+        const Mat queries = OpenCVUtils::toMat(query.data());
+        const int dims = targets.cols;
+
+        // Targets and queries share device memory, and L1 also needs a target sized scratch matrix per query
+        const int targetStep = GPU::batchRows(sizeof(float) * dims * ((metric == L2) ? 2 : 4), targets.rows);
+        for (int j=0; j<targets.rows; j+=targetStep) {
+            gpu::GpuMat targetBlock, targetNorms;
+            gpu::GpuMat(targets.rowRange(j, std::min(j+targetStep, targets.rows))).convertTo(targetBlock, CV_32F);
+            if (metric == L2) {
+                gpu::GpuMat squared, norms;
+                gpu::multiply(targetBlock, targetBlock, squared);
+                gpu::reduce(squared, norms, 1, CV_REDUCE_SUM);
+                gpu::transpose(norms, targetNorms);
+            }
+
+            const int queryStep = GPU::batchRows(sizeof(float) * (dims + targetBlock.rows), queries.rows);
+            for (int i=0; i<queries.rows; i+=queryStep) {
+                gpu::GpuMat queryBlock;
+                gpu::GpuMat(queries.rowRange(i, std::min(i+queryStep, queries.rows))).convertTo(queryBlock, CV_32F);
+
+                Mat scores;
+                if (metric == L2) scores = l2(queryBlock, targetBlock, targetNorms);
+                else              scores = l1(queryBlock, targetBlock);
+
+                for (int r=0; r<scores.rows; r++) {
+                    float *row = scores.ptr<float>(r);
+                    for (int c=0; c<scores.cols; c++)
+                        row[c] = score(row[c]);
+                }
+                output->setRelativeTile(scores, i, j);
+            }
+        }
+    }
+
+    // ||q||^2 + ||t||^2 - 2 q.t for every pair, accumulated with rank one products to broadcast the norms
+    static Mat l2(const gpu::GpuMat &queries, const gpu::GpuMat &targets, const gpu::GpuMat &targetNorms)
+    {
+        gpu::GpuMat squared, queryNorms, distances;
+        gpu::multiply(queries, queries, squared);
+        gpu::reduce(squared, queryNorms, 1, CV_REDUCE_SUM);
+
+        const gpu::GpuMat targetOnes(Mat::ones(1, targets.rows, CV_32FC1)), queryOnes(Mat::ones(queries.rows, 1, CV_32FC1));
+        gpu::gemm(queries, targets, -2, gpu::GpuMat(), 0, distances, GEMM_2_T);
+        gpu::gemm(queryNorms, targetOnes, 1, distances, 1, distances);
+        gpu::gemm(queryOnes, targetNorms, 1, distances, 1, distances);
+
+        Mat result;
+        distances.download(result);
+        result = max(result, 0); // Cancellation can leave tiny negative values
+        sqrt(result, result);
+        return result;
+    }
+
+    static Mat l1(const gpu::GpuMat &queries, const gpu::GpuMat &targets)
+    {
+        Mat result(queries.rows, targets.rows, CV_32FC1);
+        gpu::GpuMat repeated, difference, sums;
+        for (int i=0; i<queries.rows; i++) {
+            GPU::repeatRow(queries.row(i), targets.rows, repeated);
+            gpu::absdiff(targets, repeated, difference);
+            gpu::reduce(difference, sums, 1, CV_REDUCE_SUM);
+            Mat row = result.row(i);
+            sums.reshape(1, 1).download(row);
+        }
+        return result;
+    }
+};
+
+BR_REGISTER(Distance, GPUDistance)
+
+} // namespace br
+
+#include "gpu.moc"
@@ -1,4 +1,5 @@
 #include <QApplication>
+#include <QAtomicPointer>
 #include <QLabel>
 #include <QElapsedTimer>
 #include <QWaitCondition>
@@ -130,6 +131,7 @@ protected:
     QMutex lock;
     QWaitCondition wait;
     QPixmap pixmap;
+    QAtomicPointer<QImage> latest; // Posted by postImage but not yet shown by the main thread
 
 public:
 
@@ -141,9 +143,28 @@ public:
     ~DisplayWindow()
     {
         QApplication::instance()->removeEventFilter(this);
+        delete latest.fetchAndStoreOrdered(NULL);
+    }
+
+    // Safe to call from any thread and never waits on the main thread. A frame the main
+    // thread hasn't gotten to yet is replaced rather than queued behind, so a busy GUI
+    // drops frames instead of holding up the caller.
+    void postImage(const QImage & input)
+    {
+        QImage * stale = latest.fetchAndStoreOrdered(new QImage(input));
+        if (stale) delete stale; // showLatest is already queued
+        else QMetaObject::invokeMethod(this, "showLatest", Qt::QueuedConnection);
     }
 
 public slots:
+    void showLatest()
+    {
+        QImage * input = latest.fetchAndStoreOrdered(NULL);
+        if (!input) return;
+        showImage(QPixmap::fromImage(*input));
+        delete input;
+    }
+
     void showImage(const QPixmap & input)
     {
         pixmap = input;
@@ -365,6 +386,9 @@ private:
  * \brief Displays templates in a GUI pop-up window using QT.
  * \author Charles Otto \cite caotto
  * Can be used with parallelism enabled, although it is considered TimeVarying.
+ * Frames are handed to the window through a single slot mailbox, when the GUI thread falls behind
+ * the newest frame replaces the one waiting, so displaying never slows the pipeline down.
+ * Set displayFPS to show at most that many frames per second, the others are not even converted.
  */
 class ShowTransform : public TimeVaryingTransform
 {
@@ -376,6 +400,9 @@ public:
     Q_PROPERTY(QStringList keys READ get_keys WRITE set_keys RESET reset_keys STORED false)
     BR_PROPERTY(QStringList, keys, QStringList())
 
+    Q_PROPERTY(float displayFPS READ get_displayFPS WRITE set_displayFPS RESET reset_displayFPS STORED false)
+    BR_PROPERTY(float, displayFPS, 0)
+
     ShowTransform() : TimeVaryingTransform(false, false)
     {
         displayBuffer = NULL;
@@ -397,9 +424,16 @@ public:
     {
         dst = src;
 
-        if (src.empty())
+        if (src.empty() || !window)
             return;
 
+        // Decimate independently of the rate the pipeline runs at
+        if (displayFPS > 0) {
+            if (displayTimer.isValid() && (displayTimer.elapsed() < 1000 / displayFPS))
+                return;
+            displayTimer.start();
+        }
+
         foreach (const Template & t, src) {
             // build label
             QString newTitle;
@@ -413,17 +447,14 @@ public:
                 }
 
             }
-            emit this->changeTitle(newTitle);
+            if (newTitle != title) {
+                title = newTitle;
+                emit this->changeTitle(title);
+            }
 
             foreach (const cv::Mat &m, t) {
                 if (!m.data) continue;
-                qImageBuffer = toQImage(m);
-                displayBuffer->convertFromImage(qImageBuffer);
-
-                // Emit an explicit copy of our pixmap so that the pixmap used
-                // by the main thread isn't damaged when we update displayBuffer
-                // later.
-                emit updateImage(displayBuffer->copy(displayBuffer->rect()));
+                window->postImage(toQImage(m));
 
                 // Blocking wait for a key-press
                 if (this->waitInput)
@@ -457,6 +488,8 @@ public:
         if (window)
             delete window;
 
+        title = QString();
+        displayTimer.invalidate();
         window = creator.getItem<WindowType>();
         // Connect our signals to the window's slots
         connect(this, SIGNAL(updateImage(QPixmap)), window,SLOT(showImage(QPixmap)));
@@ -470,6 +503,8 @@ protected:
     DisplayWindow * window;
     QImage qImageBuffer;
     QPixmap * displayBuffer;
+    QString title;
+    QElapsedTimer displayTimer;
 
 signals:
     void updateImage(const QPixmap & input);
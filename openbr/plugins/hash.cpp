@@ -15,6 +15,11 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <QCryptographicHash>
+#include <QFutureSynchronizer>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QtConcurrentRun>
+#include <limits>
 #include "openbr_internal.h"
 #include "openbr/core/qtutils.h"
 
@@ -90,6 +95,180 @@ class KernelHashTransform : public UntrainableTransform
 
 BR_REGISTER(Transform, KernelHashTransform)
 
+/*!
+ * \ingroup distances
+ * \brief Locality-sensitive hashing index for sub-linear search over hash code templates, such as those from br::KernelHashTransform.
+ *
+ * Each of \em tables hash tables keys a template by the codes at \em width positions drawn from \em seed.
+ * Targets are bucketed once per gallery and each query is only compared by \em distance, which is required, against the targets it collides with in at least one table.
+ * More \em tables raise recall, a larger \em width makes buckets smaller and search faster.
+ * Targets that do not collide receive <tt>-std::numeric_limits<float>::max()</tt>.
+ * \author Josh Klontz \cite jklontz
+ * \see IVFDistance
+ */
+class LSHDistance : public Distance
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Distance *distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
+    Q_PROPERTY(int tables READ get_tables WRITE set_tables RESET reset_tables STORED false)
+    Q_PROPERTY(int width READ get_width WRITE set_width RESET reset_width STORED false)
+    Q_PROPERTY(int seed READ get_seed WRITE set_seed RESET reset_seed STORED false)
+    BR_PROPERTY(br::Distance*, distance, NULL)
+    BR_PROPERTY(int, tables, 8)
+    BR_PROPERTY(int, width, 8)
+    BR_PROPERTY(int, seed, 0)
+
+    // Buckets of a gallery's templates in every table
+    struct Index
+    {
+        TemplateList targets; // Holds the gallery's matrices so the identity of their buffers can't be reused by another gallery
+        int length;
+        QVector< QVector<int> > positions;
+        QVector< QHash<quint64, QVector<int> > > buckets;
+
+        bool matches(const TemplateList &other) const
+        {
+            if (other.size() != targets.size()) return false;
+            for (int i=0; i<other.size(); i++)
+                if ((other[i].size() != targets[i].size()) || (!other[i].isEmpty() && (other[i].m().data != targets[i].m().data)))
+                    return false;
+            return true;
+        }
+    };
+
+    // Indices of the most recently searched galleries, most recent first
+    static const int CacheSize = 4;
+    mutable QMutex cacheLock;
+    mutable QList< QSharedPointer<Index> > cache;
+
+    static int length(const Template &t)
+    {
+        return int(t.m().total() * t.m().elemSize());
+    }
+
+    static quint64 bucket(const Template &t, const QVector<int> &positions)
+    {
+        // FNV-1a over the sampled codes
+        const uchar *data = t.m().ptr();
+        quint64 hash = Q_UINT64_C(14695981039346656037);
+        foreach (int position, positions) {
+            hash ^= data[position];
+            hash *= Q_UINT64_C(1099511628211);
+        }
+        return hash;
+    }
+
+    void init()
+    {
+        if (distance == NULL) qFatal("LSH requires a distance.");
+    }
+
+    // Searches reuse the index of a recent gallery while it holds the very same matrices
+    QSharedPointer<Index> index(const TemplateList &targets) const
+    {
+        QMutexLocker locker(&cacheLock);
+        for (int i=0; i<cache.size(); i++)
+            if (cache[i]->matches(targets)) {
+                cache.move(i, 0);
+                return cache.first();
+            }
+
+        QSharedPointer<Index> lsh(new Index());
+        lsh->targets = targets;
+        lsh->length = 0;
+        foreach (const Template &t, targets)
+            if (!t.isEmpty()) { lsh->length = length(t); break; }
+
+        RNG rng(seed);
+        lsh->positions.resize(tables);
+        lsh->buckets.resize(tables);
+        for (int i=0; i<tables; i++) {
+            for (int j=0; j<width; j++)
+                lsh->positions[i].append(rng.uniform(0, std::max(1, lsh->length)));
+            for (int j=0; j<targets.size(); j++)
+                if (!targets[j].isEmpty() && (length(targets[j]) == lsh->length))
+                    lsh->buckets[i][bucket(targets[j], lsh->positions[i])].append(j);
+        }
+
+        cache.prepend(lsh);
+        while (cache.size() > CacheSize)
+            cache.removeLast();
+        return lsh;
+    }
+
+    void train(const TemplateList &src)
+    {
+        distance->train(src);
+    }
+
+    // The targets are bucketed once and their index shared by the queries compared in parallel
+    void compare(const TemplateList &target, const TemplateList &query, Output *output) const
+    {
+        const QSharedPointer<Index> lsh = index(target);
+
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<query.size(); i++)
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &LSHDistance::compareQuery, lsh, query, i, output));
+            else                                                          compareQuery(lsh, query, i, output);
+        futures.waitForFinished();
+    }
+
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        return search(*index(targets), query);
+    }
+
+    QList<float> search(const Index &lsh, const Template &query) const
+    {
+        const TemplateList &targets = lsh.targets;
+        QList<float> scores; scores.reserve(targets.size());
+        for (int i=0; i<targets.size(); i++)
+            scores.append(-std::numeric_limits<float>::max());
+
+        if (query.isEmpty() || (length(query) != lsh.length))
+            return scores;
+
+        QVector<bool> scored(targets.size(), false);
+        for (int i=0; i<tables; i++) {
+            QHash<quint64, QVector<int> >::const_iterator it = lsh.buckets[i].constFind(bucket(query, lsh.positions[i]));
+            if (it == lsh.buckets[i].constEnd())
+                continue;
+            foreach (int j, it.value())
+                if (!scored[j]) {
+                    scores[j] = distance->compare(targets[j], query);
+                    scored[j] = true;
+                }
+        }
+        return scores;
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        return distance->compare(a, b);
+    }
+
+    void compareQuery(const QSharedPointer<Index> &lsh, const TemplateList &queries, int i, Output *output) const
+    {
+        const QList<float> scores = search(*lsh, queries[i]);
+        Mat row(1, scores.size(), CV_32FC1);
+        for (int j=0; j<scores.size(); j++)
+            row.at<float>(0, j) = scores[j];
+        output->setRelativeTile(row, i, 0);
+    }
+
+    void store(QDataStream &stream) const
+    {
+        distance->store(stream);
+    }
+
+    void load(QDataStream &stream)
+    {
+        distance->load(stream);
+    }
+};
+
+BR_REGISTER(Distance, LSHDistance)
+
 } // namespace br
 
 #include "hash.moc"
@@ -14,6 +14,7 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <limits>
 #include <opencv2/imgproc/imgproc.hpp>
 #include "openbr_internal.h"
 #include "openbr/core/common.h"
@@ -27,6 +28,8 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Histograms the matrix
+ *
+ * 8-bit matrices, such as LBP codes, are histogrammed with a bin lookup table in one pass over all channels.
  * \author Josh Klontz \cite jklontz
  */
 class HistTransform : public UntrainableTransform
@@ -39,10 +42,43 @@ class HistTransform : public UntrainableTransform
     BR_PROPERTY(float, min, 0)
     BR_PROPERTY(int, dims, -1)
 
+    // Counts every channel in one pass, binning values the way calcHist() does for 8-bit data
+    static void histogram8U(const Mat &src, float min, float max, Mat &m)
+    {
+        const int dims = m.cols, channels = src.channels();
+        const double a = dims / double(max - min), b = -a * min;
+        int lut[256];
+        for (int v=0; v<256; v++) {
+            const int bin = cvFloor(v*a + b);
+            lut[v] = ((bin >= 0) && (bin < dims)) ? bin : -1;
+        }
+
+        QVector<int> counts(channels * dims, 0);
+        for (int i=0; i<src.rows; i++) {
+            const uchar *row = src.ptr<uchar>(i);
+            for (int j=0; j<src.cols; j++)
+                for (int c=0; c<channels; c++) {
+                    const int bin = lut[row[j*channels+c]];
+                    if (bin >= 0) counts[c*dims+bin]++;
+                }
+        }
+
+        for (int c=0; c<channels; c++)
+            for (int k=0; k<dims; k++)
+                m.at<float>(c, k) = counts[c*dims+k];
+    }
+
     void project(const Template &src, Template &dst) const
     {
         const int dims = this->dims == -1 ? max - min : this->dims;
 
+        if (src.m().depth() == CV_8U) {
+            Mat m(src.m().channels(), dims, CV_32FC1);
+            histogram8U(src, min, max, m);
+            dst += m;
+            return;
+        }
+
         std::vector<Mat> mv;
         split(src, mv);
         Mat m(mv.size(), dims, CV_32FC1);
@@ -69,6 +105,8 @@ BR_REGISTER(Transform, HistTransform)
 /*!
  * \ingroup transforms
  * \brief Quantizes the values into bins.
+ *
+ * With \em split, 8-bit bins are scattered to their outputs in one pass rather than one comparison pass per bin.
  * \author Josh Klontz \cite jklontz
  */
 class BinTransform : public UntrainableTransform
@@ -106,6 +144,25 @@ class BinTransform : public UntrainableTransform
         vals.convertTo(dst, bins > 256 ? CV_16U : CV_8U, bins/(max-min), floor);
         if (!split) return;
 
+        if (dst.m().depth() == CV_8U) {
+            const Mat binned = dst;
+            QList<Mat> outputs; outputs.reserve(bins);
+            for (int i=0; i<bins; i++)
+                outputs.append(Mat::zeros(binned.rows, binned.cols, CV_8UC1));
+            QVector<uchar*> rows(bins);
+            for (int i=0; i<binned.rows; i++) {
+                const uchar *bin = binned.ptr<uchar>(i);
+                const float *weight = weights.data ? weights.ptr<float>(i) : NULL;
+                for (int k=0; k<bins; k++)
+                    rows[k] = outputs[k].ptr<uchar>(i);
+                for (int j=0; j<binned.cols; j++)
+                    if (bin[j] < bins)
+                        rows[bin[j]][j] = weight ? saturate_cast<uchar>(255.f*weight[j]) : 255;
+            }
+            dst.clear(); dst.append(outputs);
+            return;
+        }
+
         QList<Mat> outputs; outputs.reserve(bins);
         for (int i=0; i<bins; i++) {
             Mat output = (dst == i);
@@ -125,17 +182,49 @@ BR_REGISTER(Transform, BinTransform)
 /*!
  * \ingroup transforms
  * \brief Converts each element to its rank-ordered value.
+ *
+ * Tied elements share the rank of the first of them, 8 and 16-bit matrices are ranked with a counting sort.
  * \author Josh Klontz \cite jklontz
  */
 class RankTransform : public UntrainableTransform
 {
     Q_OBJECT
 
+    // The rank of a value is the number of smaller elements
+    template <typename T>
+    static void countingRank(const Mat &m, Mat &dst)
+    {
+        const int values = int(std::numeric_limits<T>::max()) + 1;
+        QVector<int> ranks(values, 0);
+        for (int i=0; i<m.rows; i++) {
+            const T *row = m.ptr<T>(i);
+            for (int j=0; j<m.cols; j++)
+                ranks[row[j]]++;
+        }
+
+        int smaller = 0;
+        for (int v=0; v<values; v++) {
+            const int count = ranks[v];
+            ranks[v] = smaller;
+            smaller += count;
+        }
+
+        for (int i=0; i<m.rows; i++) {
+            const T *row = m.ptr<T>(i);
+            float *ranked = dst.ptr<float>(i);
+            for (int j=0; j<m.cols; j++)
+                ranked[j] = ranks[row[j]];
+        }
+    }
+
     void project(const Template &src, Template &dst) const
     {
         const Mat &m = src;
         assert(m.channels() == 1);
         dst = Mat(m.rows, m.cols, CV_32FC1);
+        if (m.depth() == CV_8U)  { countingRank<uchar>(m, dst);  return; }
+        if (m.depth() == CV_16U) { countingRank<ushort>(m, dst); return; }
+
         typedef QPair<float,int> Tuple;
         QList<Tuple> tuples = Common::Sort(OpenCVUtils::matrixToVector<float>(m));
 
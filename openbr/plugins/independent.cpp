@@ -9,7 +9,7 @@ using namespace cv;
 namespace br
 {
 
-static TemplateList Downsample(const TemplateList &templates, int classes, int instances, float fraction, const QString & inputVariable)
+TemplateList Downsample(const TemplateList &templates, int classes, int instances, float fraction, const QString & inputVariable)
 {
     // Return early when no downsampling is required
     if ((classes == std::numeric_limits<int>::max()) &&
@@ -131,9 +131,11 @@ class IndependentTransform : public MetaTransform
 
     bool timeVarying() const { return transform->timeVarying(); }
 
-    static void _train(Transform *transform, const TemplateList *data)
+    static void _train(Transform *transform, const TemplateList *data, TrainingSlots *slots)
     {
+        slots->acquire();
         transform->train(*data);
+        slots->release();
     }
 
     void train(const TemplateList &data)
@@ -154,9 +156,11 @@ class IndependentTransform : public MetaTransform
         while (transforms.size() < templatesList.size())
             transforms.append(transform->clone());
 
+        // The copies share the matrix data, only the headers are per copy
+        TrainingSlots slots(templatesList.isEmpty() ? 0 : TrainingSlots::bytes(templatesList.first()), templatesList.size());
         QFutureSynchronizer<void> futures;
         for (int i=0; i<templatesList.size(); i++)
-            futures.addFuture(QtConcurrent::run(_train, transforms[i], &templatesList[i]));
+            futures.addFuture(QtConcurrent::run(_train, transforms[i], &templatesList[i], &slots));
         futures.waitForFinished();
     }
 
@@ -26,6 +26,71 @@ class IntegralTransform : public UntrainableTransform
 
 BR_REGISTER(Transform, IntegralTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Caches integral images of every channel at each level of an image pyramid.
+ *
+ * Channels (e.g. gradient histograms or LBP codes) are computed once on the full image by the preceding transforms
+ * and resampled per level, so sliding window detectors read window sums in constant time at every scale.
+ * Levels are area averaged, which is meaningless for codes, so set \em categorical to sample channels such as LBP codes by nearest neighbor.
+ * Levels are stored as the template's matrices and their scales relative to the input in the \c Scales metadata.
+ * \author Josh Klontz \cite jklontz
+ */
+class IntegralPyramidTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(float scaleFactor READ get_scaleFactor WRITE set_scaleFactor RESET reset_scaleFactor STORED false)
+    Q_PROPERTY(int minSize READ get_minSize WRITE set_minSize RESET reset_minSize STORED false)
+    Q_PROPERTY(bool categorical READ get_categorical WRITE set_categorical RESET reset_categorical STORED false)
+    BR_PROPERTY(float, scaleFactor, 0.75)
+    BR_PROPERTY(int, minSize, 24)
+    BR_PROPERTY(bool, categorical, false)
+
+    void project(const Template &src, Template &dst) const
+    {
+        if ((scaleFactor <= 0) || (scaleFactor >= 1)) qFatal("Expected 0 < scaleFactor < 1.");
+
+        const Mat &m = src.m();
+        dst.file = src.file;
+        QList<float> scales;
+        Mat level = m;
+        float scale = 1;
+        while (min(level.rows, level.cols) >= minSize) {
+            Mat sums;
+            integral(level, sums, m.depth() == CV_8U ? CV_32S : CV_64F);
+            dst.append(sums);
+            scales.append(scale);
+
+            scale /= scaleFactor;
+            resize(m, level, Size(qRound(m.cols / scale), qRound(m.rows / scale)), 0, 0, categorical ? INTER_NEAREST : INTER_AREA);
+        }
+        dst.file.setList<float>("Scales", scales);
+    }
+};
+
+BR_REGISTER(Transform, IntegralPyramidTransform)
+
+/*!
+ * \brief Mean of each channel in \em count boxes \em size columns wide, every \em step columns from \em top, spanning the rows from \em top to \em bottom of an integral image.
+ *
+ * The column differences are shared by every box in the row and computed once with packed integer arithmetic,
+ * \em buffer needs room for them, <tt>((count-1)*step+size+1)*channels</tt> values.
+ */
+static void boxMeans(const qint32 *top, const qint32 *bottom, int channels, int size, int step, int count, float area, qint32 *buffer, float *dst)
+{
+    typedef Eigen::Map< const Eigen::Array<qint32,Eigen::Dynamic,1> > IntegralRow;
+    const int length = ((count-1)*step + size + 1) * channels;
+    Eigen::Map< Eigen::Array<qint32,Eigen::Dynamic,1> >(buffer, length) = IntegralRow(bottom, length) - IntegralRow(top, length);
+
+    for (int i=0; i<count; i++) {
+        const qint32 *left = buffer + i*step*channels;
+        const qint32 *right = left + size*channels;
+        float *y = dst + i*channels;
+        for (int c=0; c<channels; c++)
+            y[c] = float(right[c] - left[c]) / area;
+    }
+}
+
 /*!
  * \ingroup transforms
  * \brief Sliding window feature extraction from a multi-channel integral image.
@@ -47,7 +112,6 @@ class IntegralSamplerTransform : public UntrainableTransform
 
     void project(const Template &src, Template &dst) const
     {
-        typedef Eigen::Map< const Eigen::Matrix<qint32,Eigen::Dynamic,1> > InputDescriptor;
         typedef Eigen::Map< const Eigen::Matrix<float,Eigen::Dynamic,1> > SecondOrderInputDescriptor;
         typedef Eigen::Map< Eigen::Matrix<float,Eigen::Dynamic,1> > OutputDescriptor;
 
@@ -71,25 +135,21 @@ class IntegralSamplerTransform : public UntrainableTransform
 
         const qint32 *dataIn = (qint32*)m.data;
         float *dataOut = (float*)n.data;
+        Mat columnSums(1, rowStep, CV_32SC1);
         idealSize = min(m.rows, m.cols)-1;
         int index = 0;
         for (int scale=0; scale<scales; scale++) {
             const int currentSize(idealSize);
             const int currentStep(idealSize*stepFactor);
+            const int numDown = 1+(m.rows-currentSize-1)/currentStep;
+            const int numAcross = 1+(m.cols-currentSize-1)/currentStep;
+            // Each row of windows is computed at once, straight into the descriptor
             for (int i=currentSize; i<m.rows; i+=currentStep) {
-                for (int j=currentSize; j<m.cols; j+=currentStep) {
-                    InputDescriptor a(dataIn+((i-currentSize)*rowStep+(j-currentSize)*channels), channels, 1);
-                    InputDescriptor b(dataIn+((i-currentSize)*rowStep+ j             *channels), channels, 1);
-                    InputDescriptor c(dataIn+(i              *rowStep+(j-currentSize)*channels), channels, 1);
-                    InputDescriptor d(dataIn+(i              *rowStep+ j             *channels), channels, 1);
-                    OutputDescriptor y(dataOut+(index*channels), channels, 1);
-                    y = (d-b-c+a).cast<float>()/(currentSize*currentSize);
-                    index++;
-                }
+                boxMeans(dataIn+(i-currentSize)*rowStep, dataIn+i*rowStep, channels, currentSize, currentStep, numAcross,
+                         currentSize*currentSize, columnSums.ptr<qint32>(), dataOut+index*channels);
+                index += numAcross;
             }
             if (secondOrder) {
-                const int numDown = 1+(m.rows-currentSize-1)/currentStep;
-                const int numAcross = 1+(m.cols-currentSize-1)/currentStep;
                 const float *dataIn = n.ptr<float>(index - numDown*numAcross);
                 for (int i=0; i<numDown; i++) {
                     for (int j=0; j<numAcross; j++) {
@@ -139,7 +199,6 @@ class RecursiveIntegralSamplerTransform : public Transform
 
     Transform *subTransform;
 
-    typedef Eigen::Map< const Eigen::Matrix<qint32,Eigen::Dynamic,1> > InputDescriptor;
     typedef Eigen::Map< Eigen::Matrix<float,Eigen::Dynamic,1> > OutputDescriptor;
     typedef Eigen::Map< const Eigen::Matrix<float,Eigen::Dynamic,1> > SecondOrderInputDescriptor;
 
@@ -154,28 +213,20 @@ class RecursiveIntegralSamplerTransform : public Transform
         }
     }
 
-    static void integralHistogram(const Mat &src, const int x, const int y, const int width, const int height, Mat &dst, int index)
-    {
-        const int channels = src.channels();
-        OutputDescriptor(dst.ptr<float>(index), channels, 1) =
-            (  InputDescriptor(src.ptr<qint32>(y+height, x+width), channels, 1)
-             - InputDescriptor(src.ptr<qint32>(y,        x+width), channels, 1)
-             - InputDescriptor(src.ptr<qint32>(y+height, x),       channels, 1)
-             + InputDescriptor(src.ptr<qint32>(y,        x),       channels, 1)).cast<float>()/(height*width);
-    }
-
     void computeDescriptor(const Mat &src, Mat &dst) const
     {
         const int channels = src.channels();
         const int rows = src.rows-1; // Integral images have an extra row and column
         const int columns = src.cols-1;
+        const int width = columns/2, height = rows/2;
+        const float area = width*height;
 
+        // The top and bottom quadrant pairs each share their column sums
         Mat tmp(5, channels, CV_32FC1);
-        integralHistogram(src,         0,      0, columns/2, rows/2, tmp, 0);
-        integralHistogram(src, columns/2,      0, columns/2, rows/2, tmp, 1);
-        integralHistogram(src,         0, rows/2, columns/2, rows/2, tmp, 2);
-        integralHistogram(src, columns/2, rows/2, columns/2, rows/2, tmp, 3);
-        integralHistogram(src, columns/4, rows/4, columns/2, rows/2, tmp, 4);
+        Mat columnSums(1, (2*width+1)*channels, CV_32SC1);
+        boxMeans(src.ptr<qint32>(0),             src.ptr<qint32>(height),          channels, width, width, 2, area, columnSums.ptr<qint32>(), tmp.ptr<float>(0));
+        boxMeans(src.ptr<qint32>(height),        src.ptr<qint32>(2*height),        channels, width, width, 2, area, columnSums.ptr<qint32>(), tmp.ptr<float>(2));
+        boxMeans(src.ptr<qint32>(rows/4, columns/4), src.ptr<qint32>(rows/4+height, columns/4), channels, width, width, 1, area, columnSums.ptr<qint32>(), tmp.ptr<float>(4));
         const SecondOrderInputDescriptor a(tmp.ptr<float>(0), channels, 1);
         const SecondOrderInputDescriptor b(tmp.ptr<float>(1), channels, 1);
         const SecondOrderInputDescriptor c(tmp.ptr<float>(2), channels, 1);
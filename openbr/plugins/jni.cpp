@@ -1,8 +1,10 @@
 //Need to include location of jvm.dll (jdk version) and its parent directory in the environment variables
 
+#include <QThreadStorage>
 #include <limits>
 #include "openbr_internal.h"
 #include "openbr/core/resource.h"
+#include "openbr/openbr.h"
 #include <jni.h>
 
 namespace br
@@ -19,9 +21,23 @@ class JNIInitializer : public Initializer
     public:
         static JavaVM* jvm;
         static JavaVMInitArgs vm_args;
+        static bool ownsJVM; // False when OpenBR is loaded by a running JavaVM
 
     void initialize() const
     {
+        Globals->abbreviations.insert("JNIHelloWorld","Open+JNI(HelloWorld)");
+    }
+
+    // The JavaVM is only started once a thread needs an environment
+    void prepare() const
+    {
+        // Only one JavaVM may exist per process, reuse the one that loaded us through the Java bindings
+        jsize createdJVMs = 0;
+        if ((JNI_GetCreatedJavaVMs(&jvm, 1, &createdJVMs) == JNI_OK) && (createdJVMs > 0)) {
+            ownsJVM = false;
+            return;
+        }
+
         JNIEnv *env;
         JavaVMOption options[1];
 
@@ -36,24 +52,65 @@ class JNIInitializer : public Initializer
         vm_args.ignoreUnrecognized = JNI_FALSE;
 
         JNI_CreateJavaVM(&jvm, (void**)&env, &vm_args);
+        ownsJVM = true;
+    }
 
-        Globals->abbreviations.insert("JNIHelloWorld","Open+JNI(HelloWorld)");
+    void release() const
+    {
+        if (ownsJVM) jvm->DestroyJavaVM();
+        jvm = NULL;
     }
 
-    void finalize() const
+    // The calling thread's environment, attached once and detached when the thread exits
+    static JNIEnv *env()
     {
-        jvm->DestroyJavaVM();
+        if (!threads.hasLocalData()) {
+            Initializer::require("JNI");
+            threads.setLocalData(new AttachedThread());
+        }
+        return threads.localData()->env;
     }
+
+private:
+    struct AttachedThread
+    {
+        JNIEnv *env;
+
+        AttachedThread() : env(NULL)
+        {
+            //Attach current thread to the thread of the JavaVM and access env
+            jvm->AttachCurrentThreadAsDaemon((void**)&env, NULL);
+            if (jvm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) != JNI_OK)
+                qFatal("Failed to initialize JNI environment");
+        }
+
+        ~AttachedThread()
+        {
+            if (jvm != NULL) jvm->DetachCurrentThread();
+        }
+    };
+
+    static QThreadStorage<AttachedThread*> threads;
 };
 
 JavaVM *JNIInitializer::jvm;
 JavaVMInitArgs JNIInitializer::vm_args;
+bool JNIInitializer::ownsJVM = false;
+QThreadStorage<JNIInitializer::AttachedThread*> JNIInitializer::threads;
 
 BR_REGISTER(Initializer, JNIInitializer)
 
 /*!
  * \ingroup transforms
  * \brief Execute Java code from OpenBR using the JNI
+ *
+ * Calls the first of these static methods that \em className provides:
+ * - <tt>projectBatch(String[] fileNames, ByteBuffer[] images, int[] rows, int[] cols, int[] types)</tt> once per template list,
+ * - <tt>project(String fileName, ByteBuffer image, int rows, int cols, int type)</tt> once per template,
+ * - <tt>project(String fileName)</tt> once per template.
+ *
+ * Images are direct ByteBuffers over the template's first matrix, so Java reads and may modify the pixels in place.
+ * Threads stay attached to the JavaVM between calls.
  * \author Jordan Cheney \cite jcheney
  */
 
@@ -63,27 +120,72 @@ class JNITransform : public UntrainableTransform
     Q_PROPERTY(QString className READ get_className WRITE set_className RESET reset_className STORED false)
     BR_PROPERTY(QString, className, "")
 
-    void project(const Template &src, Template &dst) const
+    jclass cls;
+    jmethodID projectBatch, projectImage, projectFile;
+
+public:
+    // Whole templates, so template lists reach projectBatch instead of being split by Independent
+    JNITransform() : UntrainableTransform(false) {}
+
+private:
+    bool projectsTemplates() const
     {
-        (void)dst; //Eliminates a compiler warning.
+        return projectBatch == NULL;
+    }
 
-		JNIEnv *env;
+    void init()
+    {
+        cls = NULL;
+        projectBatch = projectImage = projectFile = NULL;
+        if (className.isEmpty()) return;
 
-        //Attach current thread to the thread of the JavaVM and access env
-        JNIInitializer::jvm->AttachCurrentThreadAsDaemon((void**)&env, NULL);
-        if (JNIInitializer::jvm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) != JNI_OK) {
-            qFatal("Failed to initialize JNI environment");
-        }
+        JNIEnv *env = JNIInitializer::env();
 
         //Convert QString to const char*
         QByteArray tmpClass = className.toLocal8Bit();
         const char* charClassName = tmpClass.constData();
 
-        //Call java method
-        jclass cls = env->FindClass(charClassName);
-        if (cls == NULL) { qFatal("Class not found"); }
-        jmethodID mid = env->GetStaticMethodID(cls, "project", "(Ljava/lang/String;)V");
-        if (mid == NULL) { qFatal("MethodID not found"); }
+        // Resolved once and shared by every thread
+        jclass localClass = env->FindClass(charClassName);
+        if (localClass == NULL) { qFatal("Class not found"); }
+        cls = (jclass) env->NewGlobalRef(localClass);
+        env->DeleteLocalRef(localClass);
+
+        projectBatch = staticMethod(env, "projectBatch", "([Ljava/lang/String;[Ljava/nio/ByteBuffer;[I[I[I)V");
+        projectImage = staticMethod(env, "project", "(Ljava/lang/String;Ljava/nio/ByteBuffer;III)V");
+        projectFile = staticMethod(env, "project", "(Ljava/lang/String;)V");
+        if ((projectBatch == NULL) && (projectImage == NULL) && (projectFile == NULL)) { qFatal("MethodID not found"); }
+    }
+
+    jmethodID staticMethod(JNIEnv *env, const char *name, const char *signature) const
+    {
+        jmethodID mid = env->GetStaticMethodID(cls, name, signature);
+        if (mid == NULL) env->ExceptionClear(); // Optional methods raise NoSuchMethodError
+        return mid;
+    }
+
+    // The matrix Java sees, made continuous so a single buffer covers it
+    static cv::Mat image(Template &t)
+    {
+        if (t.isEmpty()) return cv::Mat();
+        if (!t.m().isContinuous())
+            t.m() = t.m().clone();
+        return t.m();
+    }
+
+    static jobject byteBuffer(JNIEnv *env, const cv::Mat &m)
+    {
+        if (!m.data) return NULL;
+        return env->NewDirectByteBuffer(m.data, jlong(m.total() * m.elemSize()));
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        dst = src;
+        const cv::Mat m = image(dst);
+
+        JNIEnv *env = JNIInitializer::env();
+        env->PushLocalFrame(4);
 
         QByteArray tmp = src.file.name.toLocal8Bit();
         const char* fileName = tmp.constData();
@@ -91,14 +193,206 @@ class JNITransform : public UntrainableTransform
         //Convert char* to java compatible string
         jstring jfileName = env->NewStringUTF(fileName);
 
-        env->CallStaticObjectMethod(cls, mid, jfileName);
+        if (projectImage != NULL) env->CallStaticVoidMethod(cls, projectImage, jfileName, byteBuffer(env, m), jint(m.rows), jint(m.cols), jint(m.type()));
+        else if (projectFile != NULL) env->CallStaticVoidMethod(cls, projectFile, jfileName);
+        else {
+            TemplateList dsts; dsts.append(dst);
+            callBatch(env, dsts);
+            dst = dsts.first();
+        }
+
+        env->PopLocalFrame(NULL);
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (projectBatch == NULL) {
+            UntrainableTransform::project(src, dst);
+            return;
+        }
+
+        dst = src;
+        for (int i=0; i<dst.size(); i++)
+            image(dst[i]);
 
-        JNIInitializer::jvm->DetachCurrentThread();
-	}
+        JNIEnv *env = JNIInitializer::env();
+        env->PushLocalFrame(8);
+        callBatch(env, dst);
+        env->PopLocalFrame(NULL);
+    }
+
+    // One JNI crossing for the whole list, call within a local frame
+    void callBatch(JNIEnv *env, TemplateList &templates) const
+    {
+        const jsize size = templates.size();
+        jclass stringClass = env->FindClass("java/lang/String");
+        jclass bufferClass = env->FindClass("java/nio/ByteBuffer");
+        jobjectArray fileNames = env->NewObjectArray(size, stringClass, NULL);
+        jobjectArray images = env->NewObjectArray(size, bufferClass, NULL);
+        QVector<jint> rows(size), cols(size), types(size);
+
+        for (jsize i=0; i<size; i++) {
+            const cv::Mat m = image(templates[i]);
+            jstring fileName = env->NewStringUTF(templates[i].file.name.toLocal8Bit().constData());
+            env->SetObjectArrayElement(fileNames, i, fileName);
+            env->DeleteLocalRef(fileName);
+            jobject buffer = byteBuffer(env, m);
+            env->SetObjectArrayElement(images, i, buffer);
+            if (buffer != NULL) env->DeleteLocalRef(buffer);
+            rows[i] = m.rows; cols[i] = m.cols; types[i] = m.type();
+        }
+
+        jintArray jrows = env->NewIntArray(size), jcols = env->NewIntArray(size), jtypes = env->NewIntArray(size);
+        env->SetIntArrayRegion(jrows, 0, size, rows.data());
+        env->SetIntArrayRegion(jcols, 0, size, cols.data());
+        env->SetIntArrayRegion(jtypes, 0, size, types.data());
+        env->CallStaticVoidMethod(cls, projectBatch, fileNames, images, jrows, jcols, jtypes);
+    }
 };
 
 BR_REGISTER(Transform, JNITransform)
 
 } // namespace br
 
+/*
+ * Native methods of share/openbr/Java/OpenBR.java.
+ * Each call crosses JNI once for a whole batch of images,
+ * wrapping the pixels of direct ByteBuffers through br_wrap_img without copying them.
+ * Invalid arguments raise an IllegalArgumentException in the calling Java thread instead of aborting the JavaVM.
+ */
+
+// Raise an IllegalArgumentException, the native method should return right away
+static void throwIllegalArgument(JNIEnv *env, const QString &message)
+{
+    jclass exception = env->FindClass("java/lang/IllegalArgumentException");
+    if (exception != NULL) env->ThrowNew(exception, qPrintable(message));
+}
+
+static void freeImages(const QList<br_template> &templates)
+{
+    foreach (br_template tmpl, templates)
+        br_free_template(tmpl);
+}
+
+// Wrap the images of a batch, free them with freeImages
+// Returns false with an exception pending if the arguments don't describe the images
+static bool wrapImages(JNIEnv *env, jobjectArray images, jintArray rows, jintArray cols, jintArray strides, jintArray types, QList<br_template> &templates)
+{
+    if ((images == NULL) || (rows == NULL) || (cols == NULL) || (strides == NULL) || (types == NULL)) {
+        throwIllegalArgument(env, "Image arrays must not be null.");
+        return false;
+    }
+    const jsize size = env->GetArrayLength(images);
+    if ((env->GetArrayLength(rows) < size) || (env->GetArrayLength(cols) < size) || (env->GetArrayLength(strides) < size) || (env->GetArrayLength(types) < size)) {
+        throwIllegalArgument(env, "Image size arrays are shorter than the image array.");
+        return false;
+    }
+    QVector<jint> r(size), c(size), s(size), t(size);
+    env->GetIntArrayRegion(rows, 0, size, r.data());
+    env->GetIntArrayRegion(cols, 0, size, c.data());
+    env->GetIntArrayRegion(strides, 0, size, s.data());
+    env->GetIntArrayRegion(types, 0, size, t.data());
+    for (jsize i=0; i<size; i++) {
+        jobject image = env->GetObjectArrayElement(images, i);
+        unsigned char *data = (image == NULL) ? NULL : (unsigned char*) env->GetDirectBufferAddress(image);
+        if (image != NULL) env->DeleteLocalRef(image);
+        if (data == NULL) {
+            freeImages(templates);
+            templates.clear();
+            throwIllegalArgument(env, QString("Image %1 is not a direct ByteBuffer.").arg(i));
+            return false;
+        }
+        templates.append(br_wrap_img(data, r[i], c[i], s[i], t[i]));
+    }
+    return true;
+}
+
+extern "C" JNIEXPORT void JNICALL Java_OpenBR_initialize(JNIEnv *env, jclass, jstring sdkPath, jstring algorithm)
+{
+    int argc = 1;
+    char arg1[1]; arg1[0]='\0';
+    char *argv[] = { arg1 };
+    const char *sdk = env->GetStringUTFChars(sdkPath, NULL);
+    br_initialize(argc, argv, sdk);
+    env->ReleaseStringUTFChars(sdkPath, sdk);
+
+    const char *alg = env->GetStringUTFChars(algorithm, NULL);
+    br_set_property("algorithm", alg);
+    env->ReleaseStringUTFChars(algorithm, alg);
+}
+
+extern "C" JNIEXPORT void JNICALL Java_OpenBR_shutdown(JNIEnv *, jclass)
+{
+    br_finalize();
+}
+
+extern "C" JNIEXPORT jint JNICALL Java_OpenBR_enroll(JNIEnv *env, jclass, jobjectArray images, jintArray rows, jintArray cols, jintArray strides, jintArray types, jfloatArray features, jint dims)
+{
+    if ((images == NULL) || (features == NULL) || (env->GetArrayLength(features) < env->GetArrayLength(images) * dims)) {
+        throwIllegalArgument(env, "Feature array too small.");
+        return 0;
+    }
+    QList<br_template> templates;
+    if (!wrapImages(env, images, rows, cols, strides, types, templates))
+        return 0;
+    QVector<br_template> tmpls = templates.toVector();
+    br_enrollment enrollment = br_enroll_templates_async(tmpls.data(), tmpls.size());
+
+    // Wait outside the critical section, which blocks the garbage collector
+    br_enrollment_dims(enrollment);
+    float *data = (float*) env->GetPrimitiveArrayCritical(features, NULL);
+    const int enrolled = br_take_enrollment(enrollment, data, dims);
+    env->ReleasePrimitiveArrayCritical(features, data, 0);
+
+    freeImages(templates);
+    return enrolled;
+}
+
+extern "C" JNIEXPORT jlong JNICALL Java_OpenBR_makeSearch(JNIEnv *env, jclass, jstring gallery)
+{
+    if (gallery == NULL) {
+        throwIllegalArgument(env, "Gallery must not be null.");
+        return 0;
+    }
+    const char *name = env->GetStringUTFChars(gallery, NULL);
+    br_search search = br_make_search(name);
+    env->ReleaseStringUTFChars(gallery, name);
+    return jlong(search);
+}
+
+extern "C" JNIEXPORT jint JNICALL Java_OpenBR_search(JNIEnv *env, jclass, jlong search, jobjectArray images, jintArray rows, jintArray cols, jintArray strides, jintArray types, jint k, jintArray indices, jfloatArray scores)
+{
+    if (k < 1) {
+        throwIllegalArgument(env, "k must be at least 1.");
+        return 0;
+    }
+    if ((images == NULL) || (indices == NULL) || (scores == NULL) ||
+        (env->GetArrayLength(indices) < env->GetArrayLength(images) * k) || (env->GetArrayLength(scores) < env->GetArrayLength(images) * k)) {
+        throwIllegalArgument(env, "Result arrays too small.");
+        return 0;
+    }
+    QList<br_template> templates;
+    if (!wrapImages(env, images, rows, cols, strides, types, templates))
+        return 0;
+    br::TemplateList queries;
+    foreach (br_template tmpl, templates)
+        queries.append(*reinterpret_cast<br::Template*>(tmpl));
+    if (!queries.isEmpty())
+        br_enroll_template_list((br_template_list)&queries);
+
+    QVector<jint> i(queries.size()*k);
+    QVector<jfloat> s(queries.size()*k);
+    const int searched = br_search_templates((br_search)search, (br_template_list)&queries, k, i.data(), s.data());
+    env->SetIntArrayRegion(indices, 0, i.size(), i.data());
+    env->SetFloatArrayRegion(scores, 0, s.size(), s.data());
+
+    freeImages(templates);
+    return searched;
+}
+
+extern "C" JNIEXPORT void JNICALL Java_OpenBR_freeSearch(JNIEnv *, jclass, jlong search)
+{
+    br_free_search((br_search)search);
+}
+
 #include "jni.moc"
@@ -14,7 +14,10 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
+#include <QtConcurrentRun>
 #include <opencv2/features2d/features2d.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/objdetect/objdetect.hpp>
 #include <opencv2/nonfree/nonfree.hpp>
 #include "openbr_internal.h"
@@ -133,7 +136,67 @@ class KeyPointMatcherDistance : public Distance
         std::vector< std::vector<DMatch> > matches;
         if (a.m().rows < b.m().rows) descriptorMatcher->knnMatch(a, b, matches, 2);
         else                         descriptorMatcher->knnMatch(b, a, matches, 2);
+        return similarity(matches);
+    }
+
+    // Each template is indexed once, so every pair matches against a prebuilt index instead of rebuilding it
+    void compare(const TemplateList &target, const TemplateList &query, Output *output) const
+    {
+        Indexes indexes;
+        indexes.target = &target;
+        indexes.query = &query;
+        indexes.targets.resize(target.size());
+        indexes.queries.resize(query.size());
+
+        QFutureSynchronizer<void> futures;
+        for (int j=0; j<target.size(); j++)
+            futures.addFuture(QtConcurrent::run(this, &KeyPointMatcherDistance::index, &target[j], &indexes.targets[j]));
+        for (int i=0; i<query.size(); i++)
+            futures.addFuture(QtConcurrent::run(this, &KeyPointMatcherDistance::index, &query[i], &indexes.queries[i]));
+        futures.waitForFinished();
+
+        for (int i=0; i<query.size(); i++)
+            futures.addFuture(QtConcurrent::run(this, &KeyPointMatcherDistance::compareQuery, &indexes, i, output));
+        futures.waitForFinished();
+    }
+
+    struct Indexes
+    {
+        const TemplateList *target, *query;
+        QVector< Ptr<DescriptorMatcher> > targets, queries;
+    };
 
+    void index(const Template *t, Ptr<DescriptorMatcher> *dst) const
+    {
+        if (t->m().rows < 2) return;
+        *dst = descriptorMatcher->clone(true);
+        (*dst)->add(std::vector<Mat>(1, t->m()));
+        (*dst)->train();
+    }
+
+    void compareQuery(const Indexes *indexes, int i, Output *output) const
+    {
+        const Template &b = (*indexes->query)[i];
+        Mat scores(1, indexes->target->size(), CV_32FC1);
+        for (int j=0; j<indexes->target->size(); j++) {
+            const Template &a = (*indexes->target)[j];
+            if (a.isEmpty() || b.isEmpty()) {
+                scores.at<float>(0, j) = -std::numeric_limits<float>::max();
+            } else if ((a.m().rows < 2) || (b.m().rows < 2)) {
+                scores.at<float>(0, j) = 0;
+            } else {
+                // The smaller template's descriptors are matched against the larger template's index
+                std::vector< std::vector<DMatch> > matches;
+                if (a.m().rows < b.m().rows) indexes->queries[i]->knnMatch(a.m(), matches, 2);
+                else                         indexes->targets[j]->knnMatch(b.m(), matches, 2);
+                scores.at<float>(0, j) = similarity(matches);
+            }
+        }
+        output->setRelativeTile(scores, i, 0);
+    }
+
+    float similarity(const std::vector< std::vector<DMatch> > &matches) const
+    {
         QList<float> distances;
         foreach (const std::vector<DMatch> &match, matches) {
             if (match[0].distance / match[1].distance > maxRatio) continue;
@@ -178,6 +241,120 @@ class SIFTDescriptorTransform : public UntrainableTransform
 
 BR_REGISTER(Transform, SIFTDescriptorTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief SIFT descriptors on a regular grid, computed from one gradient field shared by every grid point.
+ *
+ * Lays out its output like <tt>Grid(rows,columns)+SIFTDescriptor(size)</tt>, one row of 128 values per grid point in row major order.
+ * Gradients are computed once per image, and because dense keypoints are not rotated the Gaussian and spatial bin weights
+ * are separable and computed once per image for a window row or column.
+ * Values follow the OpenCV SIFT descriptor without being bit identical to it, so models trained on SIFTDescriptor need retraining.
+ * \author Josh Klontz \cite jklontz
+ */
+class DenseSIFTDescriptorTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(int rows READ get_rows WRITE set_rows RESET reset_rows STORED false)
+    Q_PROPERTY(int columns READ get_columns WRITE set_columns RESET reset_columns STORED false)
+    Q_PROPERTY(int size READ get_size WRITE set_size RESET reset_size STORED false)
+    BR_PROPERTY(int, rows, 10)
+    BR_PROPERTY(int, columns, 10)
+    BR_PROPERTY(int, size, 12)
+
+    static const int Cells = 4; // Spatial bins across each side of the descriptor
+    static const int Orientations = 8;
+
+    // Interpolation of one window offset into its two nearest spatial bins
+    struct Tap
+    {
+        int bin;
+        float low, high; // Weights of bin and bin+1, including the Gaussian window
+    };
+
+    void project(const Template &src, Template &dst) const
+    {
+        if (src.m().channels() != 1) qFatal("Expected single channel image.");
+        Mat image;
+        src.m().convertTo(image, CV_32F);
+        GaussianBlur(image, image, Size(), 1.6);
+
+        // Shared gradient field, y increases upwards as in SIFT
+        Mat dx, dy, magnitude, angle;
+        filter2D(image, dx, CV_32F, (Mat_<float>(1,3) << -1, 0, 1));
+        filter2D(image, dy, CV_32F, (Mat_<float>(3,1) << 1, 0, -1));
+        cartToPolar(dx, dy, magnitude, angle, true);
+
+        // Window taps are the same for every grid point and both axes
+        const float cellWidth = 3 * size / 2.f;
+        const int radius = qRound(cellWidth * (Cells+1) / 2);
+        std::vector<Tap> taps(2*radius+1);
+        for (int offset=-radius; offset<=radius; offset++) {
+            const float cell = offset / cellWidth;
+            const float position = cell + Cells/2.f - 0.5f;
+            const float gaussian = exp(-cell*cell / (0.5f*Cells*Cells));
+            Tap &tap = taps[offset+radius];
+            tap.bin = cvFloor(position);
+            tap.high = gaussian * (position - tap.bin);
+            tap.low = gaussian - tap.high;
+        }
+
+        const int descriptorSize = Cells*Cells*Orientations;
+        Mat descriptors(rows*columns, descriptorSize, CV_32FC1, Scalar(0));
+        const float rowStep = float(image.rows) / rows;
+        const float columnStep = float(image.cols) / columns;
+        for (int i=0; i<rows; i++) {
+            for (int j=0; j<columns; j++) {
+                float *histogram = descriptors.ptr<float>(i*columns+j);
+                const int centerY = qRound(rowStep*(i+0.5f));
+                const int centerX = qRound(columnStep*(j+0.5f));
+
+                // Border pixels have no central difference
+                const int top = std::max(1, centerY-radius), bottom = std::min(image.rows-2, centerY+radius);
+                const int left = std::max(1, centerX-radius), right = std::min(image.cols-2, centerX+radius);
+                for (int y=top; y<=bottom; y++) {
+                    const Tap &rowTap = taps[y-centerY+radius];
+                    const float *magnitudes = magnitude.ptr<float>(y);
+                    const float *angles = angle.ptr<float>(y);
+                    for (int x=left; x<=right; x++) {
+                        const Tap &columnTap = taps[x-centerX+radius];
+                        const float orientation = angles[x] * Orientations / 360.f;
+                        const int o0 = cvFloor(orientation);
+                        const float o1Weight = orientation - o0;
+                        const int orientations[2] = { o0 % Orientations, (o0+1) % Orientations };
+                        const float orientationWeights[2] = { 1 - o1Weight, o1Weight };
+
+                        for (int r=0; r<2; r++) {
+                            const int rowBin = rowTap.bin + r;
+                            if ((rowBin < 0) || (rowBin >= Cells)) continue;
+                            const float rowWeight = magnitudes[x] * (r == 0 ? rowTap.low : rowTap.high);
+                            for (int c=0; c<2; c++) {
+                                const int columnBin = columnTap.bin + c;
+                                if ((columnBin < 0) || (columnBin >= Cells)) continue;
+                                const float weight = rowWeight * (c == 0 ? columnTap.low : columnTap.high);
+                                float *bins = histogram + (rowBin*Cells + columnBin)*Orientations;
+                                bins[orientations[0]] += weight * orientationWeights[0];
+                                bins[orientations[1]] += weight * orientationWeights[1];
+                            }
+                        }
+                    }
+                }
+
+                // Normalize, clip large gradients and rescale to bytes as OpenCV does
+                Mat descriptor(1, descriptorSize, CV_32FC1, histogram);
+                const float threshold = 0.2f * norm(descriptor);
+                cv::min(descriptor, double(threshold), descriptor);
+                const double scale = 512 / std::max(norm(descriptor), double(FLT_EPSILON));
+                for (int k=0; k<descriptorSize; k++)
+                    histogram[k] = saturate_cast<uchar>(histogram[k] * scale);
+            }
+        }
+
+        dst += descriptors;
+    }
+};
+
+BR_REGISTER(Transform, DenseSIFTDescriptorTransform)
+
 /*!
  * \ingroup transforms
  * \brief OpenCV HOGDescriptor wrapper
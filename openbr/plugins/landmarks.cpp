@@ -1,5 +1,6 @@
 #include <opencv2/opencv.hpp>
 #include "openbr_internal.h"
+#include "openbr/core/common.h"
 #include "openbr/core/qtutils.h"
 #include "openbr/core/opencvutils.h"
 #include "openbr/core/eigenutils.h"
@@ -26,84 +27,79 @@ class ProcrustesTransform : public Transform
 
     Eigen::MatrixXf meanShape;
 
-    void train(const TemplateList &data)
+    // The points and the corners of the last rect (assumed to be the bounding box),
+    // centered at the origin and scaled to unit norm, one point per row
+    static bool normalizedShape(const File &file, Eigen::MatrixXd &shape, Eigen::RowVector2d &mean, double &norm)
     {
-        QList< QList<QPointF> > normalizedPoints;
-
-        // Normalize all sets of points
-        foreach (br::Template datum, data) {
-            QList<QPointF> points = datum.file.points();
-            QList<QRectF> rects = datum.file.rects();
-
-            if (points.empty() || rects.empty()) continue;
-
-            // Assume rect appended last was bounding box
-            points.append(rects.last().topLeft());
-            points.append(rects.last().topRight());
-            points.append(rects.last().bottomLeft());
-            points.append(rects.last().bottomRight());
-
-            // Center shape at origin
-            Scalar mean = cv::mean(OpenCVUtils::toPoints(points).toVector().toStdVector());
-            for (int i = 0; i < points.size(); i++) points[i] -= QPointF(mean[0],mean[1]);
-
-            // Remove scale component
-            float norm = cv::norm(OpenCVUtils::toPoints(points).toVector().toStdVector());
-            for (int i = 0; i < points.size(); i++) points[i] /= norm;
+        const QList<QPointF> points = file.points();
+        const QList<QRectF> rects = file.rects();
+        if (points.empty() || rects.empty()) return false;
+
+        const QRectF &rect = rects.last();
+        shape.resize(points.size() + 4, 2);
+        for (int i = 0; i < points.size(); i++) shape.row(i) << points[i].x(), points[i].y();
+        shape.row(points.size())     << rect.left(),  rect.top();
+        shape.row(points.size() + 1) << rect.right(), rect.top();
+        shape.row(points.size() + 2) << rect.left(),  rect.bottom();
+        shape.row(points.size() + 3) << rect.right(), rect.bottom();
+
+        mean = shape.colwise().mean();
+        shape.rowwise() -= mean;
+        norm = shape.norm();
+        shape /= norm;
+        return true;
+    }
 
-            normalizedPoints.append(points);
+    struct NormalizeShapes
+    {
+        const TemplateList *data;
+        QVector<Eigen::MatrixXd> *shapes;
+
+        void operator()(int i) const
+        {
+            Eigen::RowVector2d mean;
+            double norm;
+            if (!normalizedShape((*data)[i].file, (*shapes)[i], mean, norm))
+                (*shapes)[i].resize(0, 2);
         }
+    };
 
-        if (normalizedPoints.empty()) qFatal("Unable to calculate normalized points");
+    void train(const TemplateList &data)
+    {
+        // Normalize all sets of points
+        QVector<Eigen::MatrixXd> shapes(data.size());
+        NormalizeShapes normalizeShapes;
+        normalizeShapes.data = &data;
+        normalizeShapes.shapes = &shapes;
+        Common::ParallelFor(0, data.size(), normalizeShapes, Globals->parallelism);
 
         // Determine mean shape, assuming all shapes contain the same number of points
-        meanShape = Eigen::MatrixXf(normalizedPoints[0].size(), 2);
-
-        for (int i = 0; i < normalizedPoints[0].size(); i++) {
-            double x = 0;
-            double y = 0;
-
-            for (int j = 0; j < normalizedPoints.size(); j++) {
-                x += normalizedPoints[j][i].x();
-                y += normalizedPoints[j][i].y();
-            }
-
-            x /= (double)normalizedPoints.size();
-            y /= (double)normalizedPoints.size();
-
-            meanShape(i,0) = x;
-            meanShape(i,1) = y;
+        Eigen::MatrixXd sum;
+        int count = 0;
+        foreach (const Eigen::MatrixXd &shape, shapes) {
+            if (shape.rows() == 0) continue;
+            if (count == 0) sum = Eigen::MatrixXd::Zero(shape.rows(), 2);
+            else if (shape.rows() != sum.rows()) qFatal("Procrustes requires the same number of points in every template.");
+            sum += shape;
+            count++;
         }
+
+        if (count == 0) qFatal("Unable to calculate normalized points");
+        meanShape = (sum / count).cast<float>();
     }
 
     void project(const Template &src, Template &dst) const
     {
-        QList<QPointF> points = src.file.points();
-        QList<QRectF> rects = src.file.rects();
-
-        if (points.empty() || rects.empty()) {
+        Eigen::MatrixXd shape;
+        Eigen::RowVector2d mean;
+        double norm;
+        if (!normalizedShape(src.file, shape, mean, norm)) {
             dst = src;
             if (Globals->verbose) qWarning("Procrustes alignment failed because points or rects are empty.");
             return;
         }
 
-        // Assume rect appended last was bounding box
-        points.append(rects.last().topLeft());
-        points.append(rects.last().topRight());
-        points.append(rects.last().bottomLeft());
-        points.append(rects.last().bottomRight());
-
-        Scalar mean = cv::mean(OpenCVUtils::toPoints(points).toVector().toStdVector());
-        for (int i = 0; i < points.size(); i++) points[i] -= QPointF(mean[0],mean[1]);
-
-        Eigen::MatrixXf srcMat(points.size(), 2);
-        float norm = cv::norm(OpenCVUtils::toPoints(points).toVector().toStdVector());
-        for (int i = 0; i < points.size(); i++) {
-            points[i] /= norm;
-            srcMat(i,0) = points[i].x();
-            srcMat(i,1) = points[i].y();
-        }
-
+        const Eigen::MatrixXf srcMat = shape.cast<float>();
         Eigen::JacobiSVD<Eigen::MatrixXf> svd(srcMat.transpose()*meanShape, Eigen::ComputeThinU | Eigen::ComputeThinV);
         Eigen::MatrixXf R = svd.matrixU()*svd.matrixV().transpose();
 
@@ -112,7 +108,7 @@ class ProcrustesTransform : public Transform
         // Store procrustes stats in the order:
         // R(0,0), R(1,0), R(1,1), R(0,1), mean_x, mean_y, norm
         QList<float> procrustesStats;
-        procrustesStats << R(0,0) << R(1,0) << R(1,1) << R(0,1) << mean[0] << mean[1] << norm;
+        procrustesStats << R(0,0) << R(1,0) << R(1,1) << R(0,1) << mean(0) << mean(1) << norm;
         dst.file.setList<float>("ProcrustesStats",procrustesStats);
 
         if (warp) {
@@ -19,33 +19,24 @@
 #include <limits>
 #include "openbr_internal.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
+
 using namespace cv;
 
 namespace br
 {
 
 /*!
- * \ingroup transforms
- * \brief Ahonen, T.; Hadid, A.; Pietikainen, M.;
- * "Face Description with Local Binary Patterns: Application to Face Recognition"
- * Pattern Analysis and Machine Intelligence, IEEE Transactions, vol.28, no.12, pp.2037-2041, Dec. 2006
- * \author Josh Klontz \cite jklontz
+ * \brief Computes LBP codes a row at a time, shared by LBPTransform and LBPHistTransform.
  */
-class LBPTransform : public UntrainableTransform
+struct LBPKernel
 {
-    Q_OBJECT
-    Q_PROPERTY(int radius READ get_radius WRITE set_radius RESET reset_radius STORED false)
-    Q_PROPERTY(int maxTransitions READ get_maxTransitions WRITE set_maxTransitions RESET reset_maxTransitions STORED false)
-    Q_PROPERTY(bool rotationInvariant READ get_rotationInvariant WRITE set_rotationInvariant RESET reset_rotationInvariant STORED false)
-    BR_PROPERTY(int, radius, 1)
-    BR_PROPERTY(int, maxTransitions, 8)
-    BR_PROPERTY(bool, rotationInvariant, false)
-
+    int radius;
     uchar lut[256];
     uchar null;
 
-    friend class ColoredU2Transform;
-
     /* Returns the number of 0->1 or 1->0 transitions in i */
     static int numTransitions(int i)
     {
@@ -71,8 +62,9 @@ class LBPTransform : public UntrainableTransform
         return min;
     }
 
-    void init()
+    void init(int radius, int maxTransitions, bool rotationInvariant)
     {
+        this->radius = radius;
         bool set[256];
         uchar uid = 0;
         for (int i=0; i<256; i++) {
@@ -96,33 +88,213 @@ class LBPTransform : public UntrainableTransform
                 lut[i] = null; // Set to null id
     }
 
-    void project(const Template &src, Template &dst) const
+    // Either CV_8UC1 or CV_32FC1, comparisons give the same codes for both
+    Mat prepare(const Mat &src) const
     {
-        Mat m; src.m().convertTo(m, CV_32F); assert(m.isContinuous() && (m.channels() == 1));
-        Mat n(m.rows, m.cols, CV_8UC1);
-        n = null; // Initialize to NULL LBP pattern
-
-        const float *p = (const float*)m.ptr();
-        for (int r=radius; r<m.rows-radius; r++) {
-            for (int c=radius; c<m.cols-radius; c++) {
-                const float cval  =     (p[(r+0*radius)*m.cols+c+0*radius]);
-                n.at<uchar>(r, c) = lut[(p[(r-1*radius)*m.cols+c-1*radius] >= cval ? 128 : 0) |
-                                        (p[(r-1*radius)*m.cols+c+0*radius] >= cval ? 64  : 0) |
-                                        (p[(r-1*radius)*m.cols+c+1*radius] >= cval ? 32  : 0) |
-                                        (p[(r+0*radius)*m.cols+c+1*radius] >= cval ? 16  : 0) |
-                                        (p[(r+1*radius)*m.cols+c+1*radius] >= cval ? 8   : 0) |
-                                        (p[(r+1*radius)*m.cols+c+0*radius] >= cval ? 4   : 0) |
-                                        (p[(r+1*radius)*m.cols+c-1*radius] >= cval ? 2   : 0) |
-                                        (p[(r+0*radius)*m.cols+c-1*radius] >= cval ? 1   : 0)];
+        if (src.channels() != 1) qFatal("Expected single channel source.");
+        if (src.depth() == CV_8U) return src;
+        Mat m; src.convertTo(m, CV_32F);
+        return m;
+    }
+
+    template <typename T>
+    inline uchar code(const T *up, const T *mid, const T *down, int c) const
+    {
+        const T cval = mid[c];
+        return lut[(up  [c-radius] >= cval ? 128 : 0) |
+                   (up  [c       ] >= cval ? 64  : 0) |
+                   (up  [c+radius] >= cval ? 32  : 0) |
+                   (mid [c+radius] >= cval ? 16  : 0) |
+                   (down[c+radius] >= cval ? 8   : 0) |
+                   (down[c       ] >= cval ? 4   : 0) |
+                   (down[c-radius] >= cval ? 2   : 0) |
+                   (mid [c-radius] >= cval ? 1   : 0)];
+    }
+
+    // Writes the codes of row r of m (from prepare()) into dst, the border gets the null pattern
+    void codeRow(const Mat &m, int r, uchar *dst) const
+    {
+        memset(dst, null, m.cols);
+        if ((r < radius) || (r >= m.rows-radius)) return;
+        const int end = m.cols - radius;
+        int c = radius;
+
+        if (m.depth() == CV_8U) {
+            const uchar *up = m.ptr<uchar>(r-radius), *mid = m.ptr<uchar>(r), *down = m.ptr<uchar>(r+radius);
+#ifdef __SSE2__
+            // 16 codes per iteration, a >= b when max(a, b) == a
+            const int offsets[8][2] = { {-1,-1}, {-1,0}, {-1,1}, {0,1}, {1,1}, {1,0}, {1,-1}, {0,-1} };
+            const uchar *rows[3] = { up, mid, down };
+            uchar codes[16];
+            for (; c+16 <= end; c+=16) {
+                const __m128i cval = _mm_loadu_si128((const __m128i*)(mid+c));
+                __m128i pattern = _mm_setzero_si128();
+                for (int k=0; k<8; k++) {
+                    const __m128i neighbor = _mm_loadu_si128((const __m128i*)(rows[offsets[k][0]+1] + c + offsets[k][1]*radius));
+                    const __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(neighbor, cval), neighbor);
+                    pattern = _mm_or_si128(pattern, _mm_and_si128(ge, _mm_set1_epi8((char)(128 >> k))));
+                }
+                _mm_storeu_si128((__m128i*)codes, pattern);
+                for (int i=0; i<16; i++)
+                    dst[c+i] = lut[codes[i]];
+            }
+#endif // __SSE2__
+            for (; c<end; c++)
+                dst[c] = code(up, mid, down, c);
+        } else {
+            const float *up = m.ptr<float>(r-radius), *mid = m.ptr<float>(r), *down = m.ptr<float>(r+radius);
+#ifdef __SSE2__
+            // 4 codes per iteration
+            const int offsets[8][2] = { {-1,-1}, {-1,0}, {-1,1}, {0,1}, {1,1}, {1,0}, {1,-1}, {0,-1} };
+            const float *rows[3] = { up, mid, down };
+            int codes[4];
+            for (; c+4 <= end; c+=4) {
+                const __m128 cval = _mm_loadu_ps(mid+c);
+                __m128i pattern = _mm_setzero_si128();
+                for (int k=0; k<8; k++) {
+                    const __m128 ge = _mm_cmpge_ps(_mm_loadu_ps(rows[offsets[k][0]+1] + c + offsets[k][1]*radius), cval);
+                    pattern = _mm_or_si128(pattern, _mm_and_si128(_mm_castps_si128(ge), _mm_set1_epi32(128 >> k)));
+                }
+                _mm_storeu_si128((__m128i*)codes, pattern);
+                for (int i=0; i<4; i++)
+                    dst[c+i] = lut[codes[i]];
             }
+#endif // __SSE2__
+            for (; c<end; c++)
+                dst[c] = code(up, mid, down, c);
         }
+    }
+};
+
+/*!
+ * \ingroup transforms
+ * \brief Ahonen, T.; Hadid, A.; Pietikainen, M.;
+ * "Face Description with Local Binary Patterns: Application to Face Recognition"
+ * Pattern Analysis and Machine Intelligence, IEEE Transactions, vol.28, no.12, pp.2037-2041, Dec. 2006
+ * \author Josh Klontz \cite jklontz
+ */
+class LBPTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(int radius READ get_radius WRITE set_radius RESET reset_radius STORED false)
+    Q_PROPERTY(int maxTransitions READ get_maxTransitions WRITE set_maxTransitions RESET reset_maxTransitions STORED false)
+    Q_PROPERTY(bool rotationInvariant READ get_rotationInvariant WRITE set_rotationInvariant RESET reset_rotationInvariant STORED false)
+    BR_PROPERTY(int, radius, 1)
+    BR_PROPERTY(int, maxTransitions, 8)
+    BR_PROPERTY(bool, rotationInvariant, false)
+
+    LBPKernel kernel;
 
+    void init()
+    {
+        kernel.init(radius, maxTransitions, rotationInvariant);
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const Mat m = kernel.prepare(src);
+        Mat n(m.rows, m.cols, CV_8UC1);
+        for (int r=0; r<m.rows; r++)
+            kernel.codeRow(m, r, n.ptr<uchar>(r));
         dst += n;
     }
 };
 
 BR_REGISTER(Transform, LBPTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Fused LBP, RectRegions and Hist.
+ *
+ * Equivalent to <tt>LBP(radius,maxTransitions,rotationInvariant)+RectRegions(width,height,widthStep,heightStep)+Hist(max,min,dims)</tt>
+ * without materializing the code image or the region matrices.
+ * Codes are computed one band of \em height rows at a time and counted straight into each region's histogram.
+ * \author Josh Klontz \cite jklontz
+ */
+class LBPHistTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(int radius READ get_radius WRITE set_radius RESET reset_radius STORED false)
+    Q_PROPERTY(int maxTransitions READ get_maxTransitions WRITE set_maxTransitions RESET reset_maxTransitions STORED false)
+    Q_PROPERTY(bool rotationInvariant READ get_rotationInvariant WRITE set_rotationInvariant RESET reset_rotationInvariant STORED false)
+    Q_PROPERTY(int width READ get_width WRITE set_width RESET reset_width STORED false)
+    Q_PROPERTY(int height READ get_height WRITE set_height RESET reset_height STORED false)
+    Q_PROPERTY(int widthStep READ get_widthStep WRITE set_widthStep RESET reset_widthStep STORED false)
+    Q_PROPERTY(int heightStep READ get_heightStep WRITE set_heightStep RESET reset_heightStep STORED false)
+    Q_PROPERTY(int dims READ get_dims WRITE set_dims RESET reset_dims STORED false)
+    Q_PROPERTY(float min READ get_min WRITE set_min RESET reset_min STORED false)
+    Q_PROPERTY(float max READ get_max WRITE set_max RESET reset_max STORED false)
+    BR_PROPERTY(int, radius, 1)
+    BR_PROPERTY(int, maxTransitions, 8)
+    BR_PROPERTY(bool, rotationInvariant, false)
+    BR_PROPERTY(int, width, 8)
+    BR_PROPERTY(int, height, 8)
+    BR_PROPERTY(int, widthStep, -1)
+    BR_PROPERTY(int, heightStep, -1)
+    BR_PROPERTY(int, dims, -1)
+    BR_PROPERTY(float, min, 0)
+    BR_PROPERTY(float, max, 256)
+
+    LBPKernel kernel;
+    int bin[256]; // Histogram bin of each code, -1 when out of range
+
+    void init()
+    {
+        kernel.init(radius, maxTransitions, rotationInvariant);
+
+        // Same uniform binning as calcHist on 8-bit input
+        const int dims = this->dims == -1 ? max - min : this->dims;
+        const double a = dims / ((double)max - min), b = -a * min;
+        for (int i=0; i<256; i++) {
+            const int index = cvFloor(i*a + b);
+            bin[i] = (index < 0 || index >= dims) ? -1 : index;
+        }
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const int widthStep = this->widthStep == -1 ? width : this->widthStep;
+        const int heightStep = this->heightStep == -1 ? height : this->heightStep;
+        const int dims = this->dims == -1 ? max - min : this->dims;
+
+        const Mat m = kernel.prepare(src);
+        const int xMax = m.cols - width;
+        const int yMax = m.rows - height;
+        if ((xMax < 0) || (yMax < 0)) return;
+        const int columns = xMax / widthStep + 1;
+        const int rows = yMax / heightStep + 1;
+
+        // RectRegions orders regions by column then row
+        QList<Mat> histograms;
+        for (int i=0; i<columns*rows; i++)
+            histograms.append(Mat(1, dims, CV_32FC1, Scalar(0)));
+
+        Mat band(height, m.cols, CV_8UC1);
+        for (int j=0; j<rows; j++) {
+            const int y = j * heightStep;
+            for (int r=0; r<height; r++)
+                kernel.codeRow(m, y+r, band.ptr<uchar>(r));
+
+            for (int i=0; i<columns; i++) {
+                float *hist = histograms[i*rows + j].ptr<float>();
+                const int x = i * widthStep;
+                for (int r=0; r<height; r++) {
+                    const uchar *codes = band.ptr<uchar>(r) + x;
+                    for (int c=0; c<width; c++) {
+                        const int index = bin[codes[c]];
+                        if (index >= 0) hist[index]++;
+                    }
+                }
+            }
+        }
+
+        foreach (const Mat &hist, histograms)
+            dst += hist;
+    }
+};
+
+BR_REGISTER(Transform, LBPHistTransform)
+
 /*!
  * \ingroup transforms
  * \brief For visualization of LBP patterns.
@@ -152,7 +324,7 @@ class ColoredU2Transform : public UntrainableTransform
 
             uchar uid = 0;
             for (int i=0; i<256; i++) {
-                const int transitions = LBPTransform::numTransitions(i);
+                const int transitions = LBPKernel::numTransitions(i);
                 int u2;
                 if   (transitions <= 2) u2 = uid++;
                 else                    u2 = 58;
@@ -18,6 +18,10 @@
 #include <limits>
 #include "openbr_internal.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
+
 using namespace cv;
 
 namespace br
@@ -50,6 +54,18 @@ class LTPTransform : public UntrainableTransform
         }
     }
 
+    inline unsigned short code(const float *up, const float *mid, const float *down, int c, float thresholdNeg) const
+    {
+        const float cval = mid[c];
+        const float neighbors[8] = { up[c-radius], up[c], up[c+radius], mid[c+radius], down[c+radius], down[c], down[c-radius], mid[c-radius] };
+        unsigned short pattern = 0;
+        for (int k=0; k<8; k++) {
+            const float diff = neighbors[k] - cval;
+            pattern += lut[k][diff > threshold ? 0 : (diff < thresholdNeg ? 1 : 2)];
+        }
+        return pattern;
+    }
+
     void project(const Template &src, Template &dst) const
     {
         Mat m; src.m().convertTo(m, CV_32F); assert(m.isContinuous() && (m.channels() == 1));
@@ -58,52 +74,35 @@ class LTPTransform : public UntrainableTransform
         n = null; 
         float thresholdNeg = -1.0 * threshold; //compute once (can move to init)
 
-        const float *p = (const float*)m.ptr();
-        float diff;
         for (int r=radius; r<m.rows-radius; r++) {
-            for (int c=radius; c<m.cols-radius; c++) {
-                const float cval  = (p[(r+0*radius)*m.cols+c+0*radius]);
-
-                diff = p[(r-1*radius)*m.cols+c-1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) = lut[0][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) = lut[0][1];
-                else                            n.at<unsigned short>(r,c) = lut[0][2];
-
-                diff = p[(r-1*radius)*m.cols+c+0*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[1][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[1][1];
-                else                            n.at<unsigned short>(r,c) += lut[1][2];
-
-                diff = p[(r-1*radius)*m.cols+c+1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[2][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[2][1];
-                else                            n.at<unsigned short>(r,c) += lut[2][2];
-
-                diff = p[(r+0*radius)*m.cols+c+1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[3][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[3][1];
-                else                            n.at<unsigned short>(r,c) += lut[3][2];
-
-                diff = p[(r+1*radius)*m.cols+c+1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[4][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[4][1];
-                else                            n.at<unsigned short>(r,c) += lut[4][2];
-
-                diff = p[(r+1*radius)*m.cols+c+0*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[5][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[5][1];
-                else                            n.at<unsigned short>(r,c) += lut[5][2];
-
-                diff = p[(r+1*radius)*m.cols+c-1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[6][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[6][1];
-                else                            n.at<unsigned short>(r,c) += lut[6][2];
-
-                diff = p[(r+0*radius)*m.cols+c-1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[7][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[7][1];
-                else                            n.at<unsigned short>(r,c) += lut[7][2];
+            const float *up = m.ptr<float>(r-radius), *mid = m.ptr<float>(r), *down = m.ptr<float>(r+radius);
+            unsigned short *out = n.ptr<unsigned short>(r);
+            const int end = m.cols - radius;
+            int c = radius;
+#ifdef __SSE2__
+            // 4 codes per iteration, the pattern is the sum of one lut entry per neighbor
+            const int offsets[8][2] = { {-1,-1}, {-1,0}, {-1,1}, {0,1}, {1,1}, {1,0}, {1,-1}, {0,-1} };
+            const float *rows[3] = { up, mid, down };
+            const __m128 upper = _mm_set1_ps(threshold), lower = _mm_set1_ps(thresholdNeg);
+            int codes[4];
+            for (; c+4 <= end; c+=4) {
+                const __m128 cval = _mm_loadu_ps(mid+c);
+                __m128i pattern = _mm_setzero_si128();
+                for (int k=0; k<8; k++) {
+                    const __m128 diff = _mm_sub_ps(_mm_loadu_ps(rows[offsets[k][0]+1] + c + offsets[k][1]*radius), cval);
+                    const __m128i above = _mm_castps_si128(_mm_cmpgt_ps(diff, upper));
+                    const __m128i below = _mm_andnot_si128(above, _mm_castps_si128(_mm_cmplt_ps(diff, lower)));
+                    pattern = _mm_add_epi32(pattern, _mm_set1_epi32(lut[k][2]));
+                    pattern = _mm_add_epi32(pattern, _mm_and_si128(above, _mm_set1_epi32(lut[k][0] - lut[k][2])));
+                    pattern = _mm_add_epi32(pattern, _mm_and_si128(below, _mm_set1_epi32(lut[k][1] - lut[k][2])));
+                }
+                _mm_storeu_si128((__m128i*)codes, pattern);
+                for (int i=0; i<4; i++)
+                    out[c+i] = codes[i];
             }
+#endif // __SSE2__
+            for (; c<end; c++)
+                out[c] = code(up, mid, down, c, thresholdNeg);
         }
 
         dst += n;
@@ -16,6 +16,7 @@
 
 #include <opencv2/imgproc/imgproc.hpp>
 #include "openbr_internal.h"
+#include "openbr/core/shapecache.h"
 
 using namespace cv;
 
@@ -31,13 +32,24 @@ class MaskTransform : public UntrainableTransform
 {
     Q_OBJECT
 
+    QString owner;
+
+    void init()
+    {
+        owner = description();
+    }
+
     void project(const Template &src, Template &dst) const
     {
         const Mat &m = src;
-        Mat mask(m.size(), CV_8UC1);
-        mask.setTo(1);
-        const float SCALE = 1.1;
-        ellipse(mask, RotatedRect(Point2f(m.cols/2, m.rows/2), Size2f(SCALE*m.cols, SCALE*m.rows), 0), 0, -1);
+        Mat mask;
+        if (!ShapeCache::find(owner, m.rows, m.cols, CV_8UC1, mask)) {
+            mask = Mat(m.size(), CV_8UC1);
+            mask.setTo(1);
+            const float SCALE = 1.1;
+            ellipse(mask, RotatedRect(Point2f(m.cols/2, m.rows/2), Size2f(SCALE*m.cols, SCALE*m.rows), 0), 0, -1);
+            mask = ShapeCache::insert(owner, m.rows, m.cols, CV_8UC1, mask);
+        }
         dst = m.clone();
         dst.m().setTo(0, mask);
     }
@@ -107,9 +119,121 @@ class SkinMaskTransform : public UntrainableTransform
 
 BR_REGISTER(Transform, SkinMaskTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Fuses SkinMask/(Cvt(Gray)+GradientMask)+And into one pass over a YCrCb image.
+ *
+ * The Y channel of CV_BGR2YCrCb matches CV_BGR2GRAY, so the output is identical to the unfused pipeline.
+ * \author Josh Klontz \cite jklontz
+ */
+class SkinGradientMaskTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(int delta READ get_delta WRITE set_delta RESET reset_delta STORED false)
+    BR_PROPERTY(int, delta, 1)
+
+    void project(const Template &src, Template &dst) const
+    {
+        const Mat &m = src;
+        if (m.type() != CV_8UC3) qFatal("Requires 8UC3 matrices.");
+        Mat ycrcb;
+        cvtColor(m, ycrcb, CV_BGR2YCrCb);
+        Mat mask(m.rows, m.cols, CV_8UC1);
+
+        for (int i=0; i<m.rows; i++) {
+            const quint8 *previous = (i > 0) ? ycrcb.ptr<quint8>(i-1) : NULL;
+            const quint8 *current = ycrcb.ptr<quint8>(i);
+            const quint8 *next = (i+1 < m.rows) ? ycrcb.ptr<quint8>(i+1) : NULL;
+            quint8 *out = mask.ptr<quint8>(i);
+            for (int j=0; j<m.cols; j++) {
+                const quint8 *pixel = current + 3*j;
+                const int Cr = pixel[1], Cb = pixel[2];
+                if (!((Cr>130 && Cr<170) && (Cb>70 && Cb<125))) { out[j] = 0; continue; }
+                const int Y = pixel[0];
+                const bool flat = (!previous     || (abs(previous[3*j]-Y) <= delta)) &&
+                                  ((j+1>=m.cols) || (abs(pixel[3]-Y)      <= delta)) &&
+                                  (!next         || (abs(next[3*j]-Y)     <= delta)) &&
+                                  ((j==0)        || (abs(pixel[-3]-Y)     <= delta));
+                out[j] = flat ? 255 : 0;
+            }
+        }
+
+        dst = mask;
+    }
+};
+
+BR_REGISTER(Transform, SkinGradientMaskTransform)
+
+struct MinOp
+{
+    static quint8 identity() { return 255; }
+    static quint8 apply(quint8 a, quint8 b) { return std::min(a, b); }
+};
+
+struct MaxOp
+{
+    static quint8 identity() { return 0; }
+    static quint8 apply(quint8 a, quint8 b) { return std::max(a, b); }
+};
+
+// van Herk/Gil-Werman running min or max along n elements of lanes parallel lines,
+// three comparisons per element regardless of the kernel size k.
+// Elements outside the line take the identity, matching OpenCV's default morphology border.
+template <typename Op>
+static void vanHerk(const quint8 *src, int srcElement, int srcLane, quint8 *dst, int dstElement, int dstLane,
+                    int n, int lanes, int k, int anchor, QVector<quint8> &g, QVector<quint8> &h)
+{
+    // Output element y is the window over padded elements [y, y+k-1], padded to whole blocks of k
+    const int padded = ((n + 2*(k-1)) / k) * k;
+    g.resize(padded*lanes);
+    h.resize(padded*lanes);
+
+    for (int p=0; p<padded; p++) {
+        const int i = p - anchor;
+        const bool inside = (i >= 0) && (i < n);
+        quint8 *gp = g.data() + p*lanes;
+        for (int j=0; j<lanes; j++) {
+            const quint8 v = inside ? src[i*srcElement + j*srcLane] : Op::identity();
+            gp[j] = (p % k == 0) ? v : Op::apply(gp[j-lanes], v);
+        }
+    }
+
+    for (int p=padded-1; p>=0; p--) {
+        const int i = p - anchor;
+        const bool inside = (i >= 0) && (i < n);
+        quint8 *hp = h.data() + p*lanes;
+        for (int j=0; j<lanes; j++) {
+            const quint8 v = inside ? src[i*srcElement + j*srcLane] : Op::identity();
+            hp[j] = (p % k == k-1) ? v : Op::apply(hp[j+lanes], v);
+        }
+    }
+
+    for (int y=0; y<n; y++) {
+        const quint8 *hp = h.data() + y*lanes;
+        const quint8 *gp = g.data() + (y+k-1)*lanes;
+        for (int j=0; j<lanes; j++)
+            dst[y*dstElement + j*dstLane] = Op::apply(hp[j], gp[j]);
+    }
+}
+
+// Separable rectangular erosion or dilation of an 8UC1 matrix, rows then columns
+template <typename Op>
+static void vanHerk(const Mat &src, Mat &dst, int k)
+{
+    const int anchor = k/2;
+    Mat rows(src.size(), CV_8UC1);
+    QVector<quint8> g, h;
+    for (int i=0; i<src.rows; i++)
+        vanHerk<Op>(src.ptr<quint8>(i), 1, 0, rows.ptr<quint8>(i), 1, 0, src.cols, 1, k, anchor, g, h);
+    dst.create(src.size(), CV_8UC1);
+    vanHerk<Op>(rows.ptr<quint8>(), rows.step, 1, dst.ptr<quint8>(), dst.step, 1, src.rows, src.cols, k, anchor, g, h);
+}
+
 /*!
  * \ingroup transforms
  * \brief Morphological operator
+ *
+ * Erode and Dilate on 8UC1 matrices use a van Herk/Gil-Werman filter whose cost does not grow with radius.
  * \author Josh Klontz \cite jklontz
  */
 class MorphTransform : public UntrainableTransform
@@ -137,13 +261,21 @@ private:
 
     void init()
     {
-        Mat kernel = Mat(radius, radius, CV_8UC1);
+        kernel = Mat(radius, radius, CV_8UC1);
         kernel.setTo(255);
     }
 
     void project(const Template &src, Template &dst) const
     {
-        morphologyEx(src, dst, op, kernel);
+        const Mat &m = src;
+        if ((m.type() == CV_8UC1) && (radius > 1) && ((op == Erode) || (op == Dilate))) {
+            Mat n;
+            if (op == Erode) vanHerk<MinOp>(m, n, radius);
+            else             vanHerk<MaxOp>(m, n, radius);
+            dst = n;
+        } else {
+            morphologyEx(src, dst, op, kernel);
+        }
     }
 };
 
@@ -14,12 +14,18 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QCryptographicHash>
+#include <QDateTime>
 #include <QFutureSynchronizer>
+#include <QLinkedList>
 #include <QRegularExpression>
+#include <QSaveFile>
+#include <QTemporaryFile>
 #include <QtConcurrentRun>
 #include "openbr_internal.h"
 #include "openbr/core/common.h"
 #include "openbr/core/opencvutils.h"
+#include "openbr/core/profiler.h"
 #include "openbr/core/qtutils.h"
 #include "openbr/core/resource.h"
 
@@ -31,35 +37,42 @@ namespace br
 static TemplateList Expanded(const TemplateList &templates)
 {
     TemplateList expanded;
+    expanded.reserve(templates.size());
     foreach (const Template &t, templates) {
+        const bool enrollAll = t.file.get<bool>("enrollAll", false);
         if (t.isEmpty()) {
-            if (!t.file.get<bool>("enrollAll", false))
+            if (!enrollAll)
                 expanded.append(t);
             continue;
         }
 
-        const bool fte = t.file.get<bool>("FTE", false);
-        QList<QPointF> points = t.file.points();
-        QList<QRectF> rects = t.file.rects();
+        if (t.file.get<bool>("FTE", false) && enrollAll)
+            continue;
+
+        const QList<QPointF> points = t.file.points();
+        const QList<QRectF> rects = t.file.rects();
         if (points.size() % t.size() != 0) qFatal("Uneven point count.");
         if (rects.size() % t.size() != 0) qFatal("Uneven rect count.");
         const int pointStep = points.size() / t.size();
         const int rectStep = rects.size() / t.size();
 
+        // Each expanded template shares the source metadata until its own rects and points are written,
+        // which detaches it exactly once
         for (int i=0; i<t.size(); i++) {
-            if (!fte || !t.file.get<bool>("enrollAll", false)) {
-                expanded.append(Template(t.file, t[i]));
-                expanded.last().file.setRects(rects.mid(i*rectStep, rectStep));
-                expanded.last().file.setPoints(points.mid(i*pointStep, pointStep));
-            }
+            expanded.append(Template(t.file, t[i]));
+            File &file = expanded.last().file;
+            file.setRects(rects.mid(i*rectStep, rectStep));
+            file.setPoints(points.mid(i*pointStep, pointStep));
         }
     }
     return expanded;
 }
 
-static void _train(Transform *transform, const QList<TemplateList> *data)
+static void _trainLimited(Transform *transform, const QList<TemplateList> *data, TrainingSlots *slots)
 {
+    slots->acquire();
     transform->train(*data);
+    slots->release();
 }
 
 /*!
@@ -76,26 +89,195 @@ class PipeTransform : public CompositeTransform
 {
     Q_OBJECT    
 
+    // Training data without the templates rejected by an earlier stage
+    static QList<TemplateList> accepted(const QList<TemplateList> &data)
+    {
+        QList<TemplateList> result(data);
+        for (int i=0; i<result.size(); i++) {
+            bool rejected = false;
+            foreach (const Template &t, result[i])
+                if (Rejected(t)) { rejected = true; break; }
+            if (!rejected) continue;
+
+            TemplateList templates;
+            foreach (const Template &t, data[i])
+                if (!Rejected(t)) templates.append(t);
+            result[i] = templates;
+        }
+        return result;
+    }
+
     void _projectPartial(TemplateList *srcdst, int startIndex, int stopIndex)
     {
         for (int i=startIndex; i<stopIndex; i++)
             *srcdst >> *transforms[i];
     }
 
+    // Samples the training templates of a DownsampleTraining stage by label before they are projected,
+    // leaving its fraction to be applied by the stage itself
+    static TemplateList presample(const TemplateList &data, const Transform *stage)
+    {
+        if (!stage->inherits("br::DownsampleTrainingTransform")) return data;
+        return Downsample(data, stage->property("classes").toInt(), stage->property("instances").toInt(), 1, stage->property("inputVariable").toString());
+    }
+
+    // Projects a block at a time through transforms [startIndex, stopIndex), moving the projected
+    // templates to a temporary gallery once they exceed br::Context::trainingMemory.
+    // Each source block is released as it is projected, so the source and projected sets never peak together,
+    // and the spill is read back a block at a time into the list the next trainable stage needs.
+    void _projectBlocks(TemplateList *srcdst, int startIndex, int stopIndex)
+    {
+        const qint64 budget = qint64(Globals->trainingMemory) * 1024 * 1024;
+        QTemporaryFile spillFile(QDir::tempPath() + "/TrainingXXXXXX.gal");
+        QScopedPointer<Gallery> spill;
+
+        TemplateList projected;
+        qint64 bytes = 0;
+        for (int i=0; i<srcdst->size(); i+=Globals->blockSize) {
+            TemplateList block = srcdst->mid(i, Globals->blockSize);
+            for (int j=i; j<std::min(i+Globals->blockSize, srcdst->size()); j++)
+                (*srcdst)[j] = Template();
+            _projectPartial(&block, startIndex, stopIndex);
+            bytes += TrainingSlots::bytes(block);
+            projected.append(block);
+
+            if (!spill && (budget > 0) && (bytes > budget)) {
+                if (!spillFile.open()) qFatal("Failed to create %s", qPrintable(spillFile.fileTemplate()));
+                spillFile.close();
+                spill.reset(Gallery::make(spillFile.fileName()));
+            }
+
+            if (spill) {
+                spill->writeBlock(projected);
+                projected.clear();
+            }
+        }
+
+        if (spill) {
+            spill.reset();
+            QScopedPointer<Gallery> gallery(Gallery::make(spillFile.fileName()));
+            bool done = false;
+            while (!done)
+                projected.append(gallery->readBlock(&done));
+            gallery.reset();
+            QFile::remove(spillFile.fileName() + ".index");
+        }
+        *srcdst = projected;
+    }
+
+    // Checkpoint of the first stopIndex transforms trained on inputs, see br::Context::checkpointPath
+    QString checkpointFile(const QString &inputs, int stopIndex, const QString &suffix) const
+    {
+        QStringList prefix;
+        for (int i=0; i<stopIndex; i++)
+            prefix.append(transforms[i]->description());
+        return Globals->checkpointPath + "/" + QtUtils::shortTextHash(prefix.join("+") + "\n" + inputs) + suffix;
+    }
+
+    // The last stage boundary whose projections were checkpointed along with every trainable stage before it
+    int resumeIndex(const QString &inputs) const
+    {
+        for (int i=transforms.size(); i>0; i--) {
+            if (!QFileInfo(checkpointFile(inputs, i, ".templates")).exists()) continue;
+            bool complete = true;
+            for (int j=0; j<i; j++)
+                if (transforms[j]->timeVarying() ||
+                    (transforms[j]->trainable && !QFileInfo(checkpointFile(inputs, j+1, ".model")).exists()))
+                    complete = false;
+            if (complete) return i;
+        }
+        return 0;
+    }
+
+    void loadModel(const QString &inputs, int index)
+    {
+        QByteArray data;
+        QtUtils::readFile(checkpointFile(inputs, index+1, ".model"), data, true);
+        QDataStream stream(&data, QFile::ReadOnly);
+        transforms[index]->load(stream);
+    }
+
+    // Written under a temporary name so an interrupted run never leaves a partial checkpoint
+    static void writeCheckpoint(const QString &file, const QByteArray &data)
+    {
+        QtUtils::writeFile(file + ".tmp", data, -1);
+        QFile::remove(file);
+        if (!QFile::rename(file + ".tmp", file))
+            qFatal("Failed to write checkpoint %s.", qPrintable(file));
+    }
+
+    // A stage trained again invalidates the checkpoints of the stages after it
+    void storeModel(const QString &inputs, int index) const
+    {
+        for (int i=index+1; i<=transforms.size(); i++) {
+            if (i < transforms.size()) QFile::remove(checkpointFile(inputs, i+1, ".model"));
+            QFile::remove(checkpointFile(inputs, i, ".templates"));
+        }
+
+        QByteArray data;
+        QDataStream stream(&data, QFile::WriteOnly);
+        transforms[index]->store(stream);
+        writeCheckpoint(checkpointFile(inputs, index+1, ".model"), data);
+    }
+
     void train(const QList<TemplateList> &data)
     {
         if (!trainable) return;
 
         QList<TemplateList> dataLines(data);
 
+        // Resume from the last checkpointed stage trained on the same inputs
+        const bool checkpoint = !Globals->checkpointPath.isEmpty();
+        QString inputs;
+        bool retrained = false;
         int i = 0;
+        if (checkpoint) {
+            QStringList names;
+            foreach (const TemplateList &templates, data) {
+                foreach (const Template &t, templates)
+                    names.append(t.file.name);
+                names.append(QString());
+            }
+            inputs = names.join("\n");
+
+            i = resumeIndex(inputs);
+            if (i > 0) {
+                qDebug("Resuming training at %s", qPrintable(i < transforms.size() ? transforms[i]->objectName() : QString("the end")));
+                for (int j=0; j<i; j++)
+                    if (transforms[j]->trainable)
+                        loadModel(inputs, j);
+                QByteArray projected;
+                QtUtils::readFile(checkpointFile(inputs, i, ".templates"), projected, true);
+                QDataStream stream(&projected, QFile::ReadOnly);
+                stream >> dataLines;
+            }
+        }
+
+        // The leading untrainable stages may already be cached for these inputs
+        if ((i == 0) && (prefixStages > 0) && !Globals->prefixCachePath.isEmpty()) {
+            fprintf(stderr, "\n%s projecting cached prefix...", qPrintable(transforms[0]->objectName()));
+            for (int j=0; j < dataLines.size(); j++)
+                dataLines[j] = projectPrefix(dataLines[j]);
+            i = prefixStages;
+        }
+
         while (i < transforms.size()) {
             fprintf(stderr, "\n%s", qPrintable(transforms[i]->objectName()));
 
             // Conditional statement covers likely case that first transform is untrainable
             if (transforms[i]->trainable) {
-                fprintf(stderr, " training...");
-                transforms[i]->train(dataLines);
+                // Stages after a retrained stage see different inputs, so their checkpoints are stale
+                if (checkpoint && !retrained && QFileInfo(checkpointFile(inputs, i+1, ".model")).exists()) {
+                    fprintf(stderr, " loading...");
+                    loadModel(inputs, i);
+                } else {
+                    fprintf(stderr, " training...");
+                    transforms[i]->train(accepted(dataLines));
+                    if (checkpoint) {
+                        storeModel(inputs, i);
+                        retrained = true;
+                    }
+                }
             }
 
             // if the transform is time varying, we can't project it in parallel
@@ -123,12 +305,28 @@ class PipeTransform : public CompositeTransform
                 nextTrainableTransform++;
 
             fprintf(stderr, " projecting...");
-            QFutureSynchronizer<void> futures;
-            for (int j=0; j < dataLines.size(); j++)
-                futures.addFuture(QtConcurrent::run(this, &PipeTransform::_projectPartial, &dataLines[j], i, nextTrainableTransform));
-            futures.waitForFinished();
+            if (Globals->outOfCoreTraining) {
+                // Only the templates the next trainable stage samples are projected, one block at a time
+                if (nextTrainableTransform < transforms.size())
+                    for (int j=0; j < dataLines.size(); j++)
+                        dataLines[j] = presample(dataLines[j], transforms[nextTrainableTransform]);
+                for (int j=0; j < dataLines.size(); j++)
+                    _projectBlocks(&dataLines[j], i, nextTrainableTransform);
+            } else {
+                QFutureSynchronizer<void> futures;
+                for (int j=0; j < dataLines.size(); j++)
+                    futures.addFuture(QtConcurrent::run(this, &PipeTransform::_projectPartial, &dataLines[j], i, nextTrainableTransform));
+                futures.waitForFinished();
+            }
 
             i = nextTrainableTransform;
+
+            if (checkpoint) {
+                QByteArray projected;
+                QDataStream stream(&projected, QFile::WriteOnly);
+                stream << dataLines;
+                writeCheckpoint(checkpointFile(inputs, i, ".templates"), projected);
+            }
         }
     }
 
@@ -136,6 +334,8 @@ class PipeTransform : public CompositeTransform
     {
         dst = src;
         foreach (Transform *f, transforms) {
+            if (Rejected(dst)) break;
+            Profiler::Scope scope(f->objectName(), "transform");
             try {
                 f->projectUpdate(dst);
             } catch (...) {
@@ -153,7 +353,9 @@ class PipeTransform : public CompositeTransform
         dst = src;
         foreach (Transform *f, transforms)
         {
+            Profiler::Scope scope(f->objectName(), "transform");
             f->projectUpdate(dst);
+            if (Profiler::enabled()) scope.setBytes(Profiler::bytes(dst));
         }
     }
 
@@ -197,32 +399,251 @@ class PipeTransform : public CompositeTransform
         transforms = flattened;
 
         CompositeTransform::init();
+
+        // Runs of consecutive leaf stages that map each template independently are fused,
+        // so each template goes through the whole run while it's still in cache
+        fusedEnds = QVector<int>(transforms.size());
+        for (int i=transforms.size()-1; i>=0; i--)
+            fusedEnds[i] = (fusable(transforms[i]) && (i+1 < transforms.size()) && fusable(transforms[i+1])) ? fusedEnds[i+1] : i+1;
+
+        prefixStages = 0;
+        QStringList descriptions;
+        while ((prefixStages < transforms.size()) && !transforms[prefixStages]->trainable && !transforms[prefixStages]->timeVarying())
+            descriptions.append(transforms[prefixStages++]->description());
+        prefixDescription = descriptions.join("+");
+    }
+
+public:
+    // Projects srcdst through stages [begin, end) as _project does, so a Fork branch can resume after a shared prefix
+    void projectStages(TemplateList &srcdst, int begin, int end) const
+    {
+        int i = begin;
+        while (i < end) {
+            const int stop = std::min((fusedEnds.size() == transforms.size()) ? fusedEnds[i] : i+1, end);
+            if (stop - i == 1) {
+                const Transform *f = transforms[i];
+                Profiler::Scope scope(f->objectName(), "transform");
+                srcdst >> *f;
+                if (Profiler::enabled()) scope.setBytes(Profiler::bytes(srcdst));
+            } else {
+                QStringList names;
+                for (int j=i; j<stop; j++)
+                    names.append(transforms[j]->objectName());
+                Profiler::Scope scope(names.join("+"), "transform");
+
+                // Stages see single template lists, so stages expanding a template still work
+                QVector<TemplateList> projected(srcdst.size());
+                FusedStages fused;
+                fused.transforms = &transforms;
+                fused.begin = i;
+                fused.end = stop;
+                fused.src = &srcdst;
+                fused.dst = &projected;
+                Common::ParallelFor(0, srcdst.size(), fused, Globals->parallelism);
+
+                TemplateList result;
+                result.reserve(srcdst.size());
+                foreach (const TemplateList &templates, projected)
+                    result.append(templates);
+                srcdst = result;
+                if (Profiler::enabled()) scope.setBytes(Profiler::bytes(srcdst));
+            }
+            i = stop;
+        }
+    }
+
+    void projectStages(Template &srcdst, int begin, int end) const
+    {
+        const File file = srcdst.file;
+        for (int i=begin; (i<end) && !Rejected(srcdst); i++) {
+            const Transform *f = transforms[i];
+            Profiler::Scope scope(f->objectName(), "transform");
+            try {
+                srcdst >> *f;
+            } catch (...) {
+                qWarning("Exception triggered when processing %s with transform %s", qPrintable(file.flat()), qPrintable(f->objectName()));
+                srcdst = Template(file);
+                srcdst.file.set("FTE", true);
+            }
+        }
+    }
+
+protected:
+    // The leading stages that neither train nor vary over time, whose projections br::Context::prefixCachePath keeps
+    int prefixStages;
+    QString prefixDescription;
+
+    QString prefixCacheFile(const File &file) const
+    {
+        const QString key = prefixDescription + "\n" + file.flat() + "\n" + QFileInfo(file.name).lastModified().toString(Qt::ISODate);
+        return Globals->prefixCachePath + "/" + QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1).toHex() + ".templates";
+    }
+
+    // A template projected through the prefix stages, a stage throwing fails to enroll it like _project()
+    TemplateList projectPrefixStages(const Template &src, bool *ok) const
+    {
+        TemplateList dst;
+        dst.append(src);
+        for (int i=0; i<prefixStages; i++) {
+            try {
+                dst >> *transforms[i];
+            } catch (...) {
+                qWarning("Exception triggered when processing %s with transform %s", qPrintable(src.file.flat()), qPrintable(transforms[i]->objectName()));
+                Template fte(src.file);
+                fte.file.set("FTE", true);
+                dst = TemplateList() << fte;
+                *ok = false;
+                return dst;
+            }
+        }
+        *ok = true;
+        return dst;
+    }
+
+    // A template projected through the prefix stages, computed and cached if it isn't already
+    TemplateList projectPrefix(const Template &src) const
+    {
+        bool ok;
+        if (Globals->prefixCachePath.isEmpty()) return projectPrefixStages(src, &ok);
+
+        const QString file = prefixCacheFile(src.file);
+        if (QFileInfo(file).exists()) {
+            QByteArray data;
+            QtUtils::readFile(file, data, true);
+            QDataStream stream(&data, QFile::ReadOnly);
+            TemplateList dst;
+            stream >> dst;
+            if (stream.status() == QDataStream::Ok) return dst;
+        }
+
+        // Failures aren't cached, a later run may have the resources the stage lacked
+        const TemplateList dst = projectPrefixStages(src, &ok);
+        if (!ok) return dst;
+
+        // Concurrent runs may write the same entry, whichever commits last is kept
+        QByteArray data;
+        QDataStream stream(&data, QFile::WriteOnly);
+        stream << dst;
+        QtUtils::touchDir(QFileInfo(file));
+        QSaveFile entry(file);
+        if (!entry.open(QFile::WriteOnly) || (entry.write(qCompress(data)) < 0) || !entry.commit())
+            qWarning("Failed to write prefix cache entry %s.", qPrintable(file));
+        return dst;
+    }
+
+    // Projects template i through the prefix stages for Common::ParallelFor
+    struct PrefixStages
+    {
+        const PipeTransform *pipe;
+        const TemplateList *src;
+        QVector<TemplateList> *dst;
+
+        void operator()(int i) const
+        {
+            (*dst)[i] = pipe->projectPrefix(src->at(i));
+        }
+    };
+
+public:
+    // The number of stages in the fused run starting at stage, one where it runs on its own
+    Q_INVOKABLE int fusedLength(int stage) const
+    {
+        return ((stage < 0) || (stage >= fusedEnds.size())) ? 1 : fusedEnds[stage] - stage;
+    }
+
+    // The leading stages projectPrefix() projects through, which CrossValidate projects once for all of its folds
+    Q_INVOKABLE int prefixLength() const
+    {
+        return prefixStages;
+    }
+
+    // Projects src through the prefix stages in parallel, reusing br::Context::prefixCachePath when it is set
+    Q_INVOKABLE br::TemplateList projectPrefix(const br::TemplateList &src) const
+    {
+        QVector<TemplateList> projected(src.size());
+        PrefixStages prefix;
+        prefix.pipe = this;
+        prefix.src = &src;
+        prefix.dst = &projected;
+        Common::ParallelFor(0, src.size(), prefix, Globals->parallelism);
+
+        TemplateList dst;
+        dst.reserve(src.size());
+        foreach (const TemplateList &templates, projected)
+            dst.append(templates);
+        return dst;
     }
 
 protected:
+    // One past the last stage of the fused run starting at each stage
+    QVector<int> fusedEnds;
+
+    // Transform::make() wraps every independent stage in Independent, which maps each matrix through the stage it wraps
+    static const Transform *unwrapIndependent(const Transform *transform)
+    {
+        if (QString(transform->metaObject()->className()) != "br::IndependentTransform") return transform;
+        const Transform *stage = transform->property("transform").value<br::Transform*>();
+        return stage ? stage : transform;
+    }
+
+    // Stages with a list project of their own, like JNI's projectBatch, must see the whole list
+    static bool fusable(const Transform *transform)
+    {
+        const Transform *stage = unwrapIndependent(transform);
+        const UntrainableTransform *untrainable = dynamic_cast<const UntrainableTransform*>(stage);
+        return !stage->trainable && !stage->timeVarying() &&
+               untrainable && untrainable->projectsTemplates() &&
+               !dynamic_cast<const UntrainableMetaTransform*>(stage);
+    }
+
+    // Projects template i through stages [begin, end) for Common::ParallelFor
+    struct FusedStages
+    {
+        const QList<Transform*> *transforms;
+        int begin, end;
+        const TemplateList *src;
+        QVector<TemplateList> *dst;
+
+        void operator()(int i) const
+        {
+            TemplateList srcdst;
+            srcdst.append(src->at(i));
+            for (int j=begin; j<end; j++) {
+                if ((srcdst.size() == 1) && Rejected(srcdst.first())) break;
+                srcdst >> *transforms->at(j);
+            }
+            (*dst)[i] = srcdst;
+        }
+    };
+
     // Template list project -- process templates in parallel through Transform::project
     // or if parallelism is disabled, handle them sequentially
    void _project(const TemplateList &src, TemplateList &dst) const
     {
         dst = src;
-        foreach (const Transform *f, transforms) {
-            dst >> *f;
+        int i = 0;
+        if ((prefixStages > 0) && !Globals->prefixCachePath.isEmpty()) {
+            Profiler::Scope scope(prefixDescription, "transform");
+            dst = projectPrefix(src);
+            i = prefixStages;
         }
+        projectStages(dst, i, transforms.size());
     }
 
    // Single template const project, pass the template through each sub-transform, one after the other
    virtual void _project(const Template & src, Template & dst) const
    {
        dst = src;
-       foreach (const Transform *f, transforms) {
-           try {
-               dst >> *f;
-           } catch (...) {
-               qWarning("Exception triggered when processing %s with transform %s", qPrintable(src.file.flat()), qPrintable(f->objectName()));
-               dst = Template(src.file);
-               dst.file.set("FTE", true);
+       int begin = 0;
+       if ((prefixStages > 0) && !Globals->prefixCachePath.isEmpty()) {
+           // Prefixes expanding the template into several aren't cached here
+           const TemplateList prefix = projectPrefix(src);
+           if (prefix.size() == 1) {
+               dst = prefix.first();
+               begin = prefixStages;
            }
        }
+       projectStages(dst, begin, transforms.size());
    }
 };
 
@@ -271,14 +692,12 @@ class ContractTransform : public UntrainableMetaTransform
         if (src.empty()) return;
         Template out;
 
+        QList<QRectF> rects;
         foreach (const Template & t, src) {
             out.merge(t);
+            rects.append(t.file.rects());
         }
-        out.file.clearRects();
-        foreach (const Template & t, src) {
-            if (!t.file.rects().empty())
-                out.file.appendRects(t.file.rects());
-        }
+        out.file.setRects(rects);
         dst.clear();
         dst.append(out);
     }
@@ -298,6 +717,8 @@ BR_REGISTER(Transform, ContractTransform)
  * \author Josh Klontz \cite jklontz
  *
  * The source br::Template is seperately given to each transform and the results are appended together.
+ * Leading untrainable stages that branches have in common, like the \c Gradient of
+ * <tt>(Gradient+Bin(0,360,8))/(Gradient+Bin(0,180,4))</tt>, are computed once per template and shared read only.
  *
  * \see PipeTransform
  */
@@ -305,12 +726,101 @@ class ForkTransform : public CompositeTransform
 {
     Q_OBJECT
 
+    // Per branch, its stages and the descriptions of their prefixes shared with another branch, empty if there are none
+    QList< QList<Transform*> > branchStages;
+    QList<QStringList> sharedPrefixes;
+    bool sharing;
+
+    static QList<Transform*> stagesOf(Transform *branch)
+    {
+        PipeTransform *pipe = dynamic_cast<PipeTransform*>(branch);
+        return pipe ? pipe->transforms : (QList<Transform*>() << branch);
+    }
+
+    // Projects srcdst through stages [begin, end) of branch i, leaving the stage loop to the branch's pipe
+    template <typename T>
+    void projectStages(int i, T &srcdst, int begin, int end) const
+    {
+        if (begin >= end) return;
+        const PipeTransform *pipe = dynamic_cast<const PipeTransform*>(transforms[i]);
+        if (pipe) {
+            pipe->projectStages(srcdst, begin, end);
+        } else {
+            T dst;
+            transforms[i]->project(srcdst, dst);
+            srcdst = dst;
+        }
+    }
+
+    void init()
+    {
+        CompositeTransform::init();
+
+        branchStages.clear();
+        QList<QStringList> descriptions;
+        foreach (Transform *branch, transforms) {
+            branchStages.append(stagesOf(branch));
+            QStringList stages;
+            foreach (const Transform *stage, branchStages.last())
+                stages.append((stage->trainable || stage->timeVarying()) ? QString() : stage->description());
+            descriptions.append(stages);
+        }
+
+        sharedPrefixes.clear();
+        sharing = false;
+        for (int i=0; i<transforms.size(); i++) {
+            int shared = 0;
+            for (int j=0; j<transforms.size(); j++) {
+                if (i == j) continue;
+                int length = 0;
+                while ((length < descriptions[i].size()) && (length < descriptions[j].size()) &&
+                       !descriptions[i][length].isEmpty() && (descriptions[i][length] == descriptions[j][length]))
+                    length++;
+                shared = std::max(shared, length);
+            }
+
+            QStringList prefixes;
+            for (int length=1; length<=shared; length++)
+                prefixes.append(QStringList(descriptions[i].mid(0, length)).join("+"));
+            sharedPrefixes.append(prefixes);
+            sharing = sharing || (shared > 0);
+        }
+    }
+
+    // Projects branch i from the longest of its shared prefixes already in cache, adding the rest of them
+    template <typename T>
+    T projectBranch(int i, const T &src, QHash<QString, T> &cache) const
+    {
+        const QStringList &prefixes = sharedPrefixes[i];
+        if (prefixes.isEmpty()) {
+            T dst;
+            transforms[i]->project(src, dst);
+            return dst;
+        }
+
+        int start = prefixes.size();
+        while ((start > 0) && !cache.contains(prefixes[start-1])) start--;
+        T dst = (start > 0) ? cache.value(prefixes[start-1]) : src;
+
+        // Each shared prefix not yet computed is cached for the other branches on the way
+        for (int j=start; j<prefixes.size(); j++) {
+            projectStages(i, dst, j, j+1);
+            cache.insert(prefixes[j], dst);
+        }
+        projectStages(i, dst, prefixes.size(), branchStages[i].size());
+        return dst;
+    }
+
     void train(const QList<TemplateList> &data)
     {
         if (!trainable) return;
+        qint64 bytes = 0;
+        foreach (const TemplateList &templates, data)
+            bytes += TrainingSlots::bytes(templates);
+        TrainingSlots slots(bytes, transforms.size());
         QFutureSynchronizer<void> futures;
         for (int i=0; i<transforms.size(); i++)
-            futures.addFuture(QtConcurrent::run(_train, transforms[i], &data));
+            futures.addFuture(QtConcurrent::run(_trainLimited, transforms[i], &data, &slots));
         futures.waitForFinished();
     }
 
@@ -375,11 +885,12 @@ protected:
     // Apply each transform to src, concatenate the results
     void _project(const Template &src, Template &dst) const
     {
-        foreach (const Transform *f, transforms) {
+        QHash<QString, Template> cache;
+        for (int i=0; i<transforms.size(); i++) {
             try {
-                dst.merge((*f)(src));
+                dst.merge(sharing ? projectBranch(i, src, cache) : (*transforms[i])(src));
             } catch (...) {
-                qWarning("Exception triggered when processing %s with transform %s", qPrintable(src.file.flat()), qPrintable(f->objectName()));
+                qWarning("Exception triggered when processing %s with transform %s", qPrintable(src.file.flat()), qPrintable(transforms[i]->objectName()));
                 dst = Template(src.file);
                 dst.file.set("FTE", true);
             }
@@ -390,11 +901,13 @@ protected:
     {
         dst.reserve(src.size());
         for (int i=0; i<src.size(); i++) dst.append(Template(src[i].file));
-        foreach (const Transform *f, transforms) {
+        QHash<QString, TemplateList> cache;
+        for (int i=0; i<transforms.size(); i++) {
             TemplateList m;
-            f->project(src, m);
+            if (sharing) m = projectBranch(i, src, cache);
+            else         transforms[i]->project(src, m);
             if (m.size() != dst.size()) qFatal("TemplateList is of an unexpected size.");
-            for (int i=0; i<src.size(); i++) dst[i].merge(m[i]);
+            for (int j=0; j<src.size(); j++) dst[j].merge(m[j]);
         }
     }
 
@@ -402,51 +915,165 @@ protected:
 
 BR_REGISTER(Transform, ForkTransform)
 
+/*!
+ * \brief A least recently used cache of templates striped across independently locked shards.
+ *
+ * Insertions are serialized outside any shared lock and appended to an on-disk log in batches,
+ * which is replayed and compacted when the cache is opened.
+ * A crash loses at most the last unflushed batch.
+ */
+class TemplateCache
+{
+    typedef QPair<QString, Template> Entry;
+
+    struct Shard
+    {
+        QMutex lock;
+        QLinkedList<Entry> entries; // Most recently used first
+        QHash<QString, QLinkedList<Entry>::iterator> index;
+    };
+
+    static const int NumShards = 16;
+    Shard shards[NumShards];
+    int capacity; // Per shard
+    QMutex logLock;
+    QFile log;
+    QByteArray pending; // Serialized records not yet written to the log
+    static const int FlushBytes = 1 << 20;
+
+    Shard &shard(const QString &key)
+    {
+        return shards[qHash(key) % NumShards];
+    }
+
+    void insert(Shard &s, const QString &key, const Template &t)
+    {
+        if (s.index.contains(key)) s.entries.erase(s.index.take(key));
+        s.entries.prepend(Entry(key, t));
+        s.index.insert(key, s.entries.begin());
+        while (s.entries.size() > capacity) {
+            s.index.remove(s.entries.last().first);
+            s.entries.removeLast();
+        }
+    }
+
+    void flush()
+    {
+        if (!log.isOpen() || pending.isEmpty()) return;
+        if (log.write(pending) != pending.size()) qWarning("Failed to write %s.", qPrintable(log.fileName()));
+        log.flush();
+        pending.clear();
+    }
+
+public:
+    TemplateCache() : capacity(std::numeric_limits<int>::max()) {}
+
+    ~TemplateCache()
+    {
+        QMutexLocker locker(&logLock);
+        flush();
+    }
+
+    void open(const QString &fileName, int maxSize)
+    {
+        QMutexLocker locker(&logLock);
+        capacity = std::max(1, maxSize / NumShards);
+        if (log.isOpen()) return;
+
+        // Replay the log, dropping a final record cut short by a crash
+        int records = 0, entries = 0;
+        QFile file(fileName);
+        if (file.open(QFile::ReadOnly)) {
+            QDataStream stream(&file);
+            qint64 valid = 0;
+            while (!stream.atEnd()) {
+                QString key;
+                Template t;
+                stream >> key >> t;
+                if (stream.status() != QDataStream::Ok) break;
+                insert(shard(key), key, t);
+                valid = file.pos();
+                records++;
+            }
+            file.close();
+            if (valid < file.size()) file.resize(valid);
+        }
+        for (int i=0; i<NumShards; i++)
+            entries += shards[i].entries.size();
+
+        // Rewrite the log when it is mostly superseded or evicted records
+        log.setFileName(fileName);
+        const bool compact = records > 2*entries;
+        QtUtils::touchDir(log);
+        if (!log.open(compact ? QFile::WriteOnly : (QFile::WriteOnly | QFile::Append)))
+            qFatal("Unable to open %s for writing.", qPrintable(fileName));
+        if (compact) {
+            // Least recently used first, replaying prepends each record so the order is restored
+            QDataStream stream(&log);
+            for (int i=0; i<NumShards; i++) {
+                QLinkedList<Entry>::const_iterator it = shards[i].entries.constEnd();
+                while (it != shards[i].entries.constBegin()) {
+                    --it;
+                    stream << it->first << it->second;
+                }
+            }
+        }
+        log.flush();
+    }
+
+    bool lookup(const QString &key, Template &dst)
+    {
+        Shard &s = shard(key);
+        QMutexLocker locker(&s.lock);
+        if (!s.index.contains(key)) return false;
+        dst = s.index.value(key)->second;
+        insert(s, key, dst);
+        return true;
+    }
+
+    void insert(const QString &key, const Template &t)
+    {
+        Shard &s = shard(key);
+        {
+            QMutexLocker locker(&s.lock);
+            insert(s, key, t);
+        }
+
+        QByteArray record;
+        QDataStream stream(&record, QIODevice::WriteOnly);
+        stream << key << t;
+
+        QMutexLocker locker(&logLock);
+        if (!log.isOpen()) return;
+        pending.append(record);
+        if (pending.size() >= FlushBytes) flush();
+    }
+};
+
 /*!
  * \ingroup transforms
  * \brief Caches br::Transform::project() results.
+ *
+ * At most \em capacity templates are kept in memory, evicting the least recently used.
+ * Results are logged to \c Cache.log as they are computed so they survive a crash.
  * \author Josh Klontz \cite jklontz
  */
 class CacheTransform : public MetaTransform
 {
     Q_OBJECT
     Q_PROPERTY(br::Transform* transform READ get_transform WRITE set_transform RESET reset_transform)
+    Q_PROPERTY(int capacity READ get_capacity WRITE set_capacity RESET reset_capacity STORED false)
     BR_PROPERTY(br::Transform*, transform, NULL)
+    BR_PROPERTY(int, capacity, 1 << 20)
 
-    static QHash<QString, Template> cache;
-    static QMutex cacheLock;
-
-public:
-    ~CacheTransform()
-    {
-        if (cache.isEmpty()) return;
+    static TemplateCache cache;
 
-        // Write to cache
-        QFile file("Cache");
-        if (!file.open(QFile::WriteOnly))
-            qFatal("Unable to open %s for writing.", qPrintable(file.fileName()));
-        QDataStream stream(&file);
-        stream << cache;
-        file.close();
-    }
-
-private:
     void init()
     {
         if (!transform) return;
 
         trainable = transform->trainable;
-        if (!cache.isEmpty()) return;
-
-        // Read from cache
-        QFile file("Cache");
-        if (file.exists()) {
-            if (!file.open(QFile::ReadOnly))
-                qFatal("Unable to open %s for reading.", qPrintable(file.fileName()));
-            QDataStream stream(&file);
-            stream >> cache;
-            file.close();
-        }
+        cache.open("Cache.log", capacity);
     }
 
     void train(const QList<TemplateList> &data)
@@ -457,19 +1084,14 @@ private:
     void project(const Template &src, Template &dst) const
     {
         const QString &file = src.file;
-        if (cache.contains(file)) {
-            dst = cache[file];
-        } else {
+        if (!cache.lookup(file, dst)) {
             transform->project(src, dst);
-            cacheLock.lock();
-            cache[file] = dst;
-            cacheLock.unlock();
+            cache.insert(file, dst);
         }
     }
 };
 
-QHash<QString, Template> CacheTransform::cache;
-QMutex CacheTransform::cacheLock;
+TemplateCache CacheTransform::cache;
 
 BR_REGISTER(Transform, CacheTransform)
 
@@ -555,6 +1177,9 @@ BR_REGISTER(Transform, LoadStoreTransform)
 /*!
  * \ingroup transforms
  * \brief Flags images that failed to enroll based on the specified transform.
+ *
+ * With \em skip the flagged templates are also emptied, so the remaining stages of the enclosing pipes pass them through
+ * rather than extracting features from them, and later stages are trained without them.
  * \author Josh Klontz \cite jklontz
  */
 class FTETransform : public Transform
@@ -563,9 +1188,11 @@ class FTETransform : public Transform
     Q_PROPERTY(br::Transform* transform READ get_transform WRITE set_transform RESET reset_transform)
     Q_PROPERTY(float min READ get_min WRITE set_min RESET reset_min)
     Q_PROPERTY(float max READ get_max WRITE set_max RESET reset_max)
+    Q_PROPERTY(bool skip READ get_skip WRITE set_skip RESET reset_skip STORED false)
     BR_PROPERTY(br::Transform*, transform, NULL)
     BR_PROPERTY(float, min, -std::numeric_limits<float>::max())
     BR_PROPERTY(float, max,  std::numeric_limits<float>::max())
+    BR_PROPERTY(bool, skip, false)
 
     void train(const TemplateList &data)
     {
@@ -592,9 +1219,10 @@ class FTETransform : public Transform
         transform->project(src, projectedSrc);
         const float val = projectedSrc.file.get<float>(transform->objectName());
 
-        dst = src;
+        const bool fte = (val < min) || (val > max);
+        dst = (fte && skip) ? Template(src.file) : src;
         dst.file.set(transform->objectName(), val);
-        dst.file.set("FTE", (val < min) || (val > max));
+        dst.file.set("FTE", fte);
     }
 };
 
@@ -606,6 +1234,15 @@ static void _projectList(const Transform *transform, const TemplateList *src, Te
     transform->project(*src, *dst);
 }
 
+// Projects list i for Common::ParallelFor
+struct ProjectList
+{
+    const Transform *transform;
+    QVector<const TemplateList*> src;
+    QVector<TemplateList*> dst;
+    void operator()(int i) const { _projectList(transform, src[i], dst[i]); }
+};
+
 class DistributeTemplateTransform : public MetaTransform
 {
     Q_OBJECT
@@ -673,29 +1310,19 @@ public:
         QList<TemplateList> input_buffer;
         input_buffer.reserve(src.size());
 
-        QFutureSynchronizer<void> futures;
-
         for (int i =0; i < src.size();i++) {
             input_buffer.append(TemplateList());
             output_buffer.append(TemplateList());
-        }
-        QList<QFuture<void> > temp;
-        temp.reserve(src.size());
-        for (int i=0; i<src.size(); i++) {
             input_buffer[i].append(src[i]);
-
-            if (Globals->parallelism > 1) temp.append(QtConcurrent::run(_projectList, transform, &input_buffer[i], &output_buffer[i]));
-            else _projectList(transform, &input_buffer[i], &output_buffer[i]);
-        }
-        // We add the futures in reverse order, since in Qt 5.1 at least the
-        // waiting thread will wait on them in the order added (which for uniform priority
-        // threads is the order of execution), and we want the waiting thread to go in the opposite order
-        // so that it can steal runnables and do something besides wait.
-        for (int i = temp.size() - 1; i >= 0; i--) {
-            futures.addFuture(temp[i]);
         }
 
-        futures.waitForFinished();
+        ProjectList project;
+        project.transform = transform;
+        for (int i=0; i<src.size(); i++) {
+            project.src.append(&input_buffer[i]);
+            project.dst.append(&output_buffer[i]);
+        }
+        Common::ParallelFor(0, src.size(), project, Globals->parallelism);
 
         for (int i=0; i<src.size(); i++) dst.append(output_buffer[i]);
     }
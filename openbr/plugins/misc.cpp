@@ -19,6 +19,7 @@
 #include <opencv2/highgui/highgui.hpp>
 #include "openbr_internal.h"
 #include "openbr/core/opencvutils.h"
+#include "openbr/core/progress.h"
 #include "openbr/core/qtutils.h"
 
 using namespace cv;
@@ -29,18 +30,24 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Applies br::Format to br::Template::file::name and appends results.
+ *
+ * A positive \em maxSize lets formats decode at a reduced resolution whose longer side is still at least \em maxSize,
+ * pair it with <tt>LimitSize(maxSize)</tt>.
  * \author Josh Klontz \cite jklontz
  */
 class OpenTransform : public UntrainableMetaTransform
 {
     Q_OBJECT
+    Q_PROPERTY(int maxSize READ get_maxSize WRITE set_maxSize RESET reset_maxSize STORED false)
+    BR_PROPERTY(int, maxSize, -1)
 
     void project(const Template &src, Template &dst) const
     {
         if (!src.isEmpty()) { dst = src; return; }
         if (Globals->verbose) qDebug("Opening %s", qPrintable(src.file.flat()));
         dst.file = src.file;
-        foreach (const File &file, src.file.split()) {
+        foreach (File file, src.file.split()) {
+            if (maxSize > 0) file.set("maxSize", maxSize);
             QScopedPointer<Format> format(Factory<Format>::make(file));
             Template t = format->read();
             if (t.isEmpty()) qWarning("Can't open %s from %s", qPrintable(file.flat()), qPrintable(QDir::currentPath()));
@@ -509,7 +516,9 @@ class ProgressCounterTransform : public TimeVaryingTransform
     Q_OBJECT
 
     Q_PROPERTY(int totalTemplates READ get_totalTemplates WRITE set_totalTemplates RESET reset_totalTemplates STORED false)
+    Q_PROPERTY(int scope READ get_scope WRITE set_scope RESET reset_scope STORED false)
     BR_PROPERTY(int, totalTemplates, 1)
+    BR_PROPERTY(int, scope, 0) // Progress::id() of the job this counter was built for, steps the context directly if 0
 
     void projectUpdate(const TemplateList &src, TemplateList &dst)
     {
@@ -527,7 +536,8 @@ class ProgressCounterTransform : public TimeVaryingTransform
             timer.start();
         }
 
-        Globals->currentStep++;
+        if (scope != 0) Progress::step(scope);
+        else            Globals->currentStep++;
 
         return;
     }
@@ -1,36 +1,313 @@
-#include "openbr_internal.h"
+#include <QDir>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QWaitCondition>
+#include <opencv2/highgui/highgui.hpp>
 #include <mongoose.h>
+#include "openbr_internal.h"
+#include "openbr/core/common.h"
+#include "openbr/core/metrics.h"
+#include "openbr/core/qtutils.h"
+
+using namespace cv;
 
 namespace br
 {
 
+/*!
+ * \brief Enrolls templates from concurrent requests together through the algorithm's streamed transform.
+ *
+ * The first request to arrive while no batch is running projects every pending template in one call,
+ * requests arriving in the meantime wait and form the next batch.
+ */
+class EnrollmentQueue
+{
+    struct Job
+    {
+        Template src, dst;
+        bool done;
+        Job(const Template &src_) : src(src_), done(false) {}
+    };
+
+    QMutex lock;
+    QWaitCondition finished;
+    QList<Job*> pending;
+    bool busy;
+
+public:
+    QSharedPointer<Transform> stream, transform;
+
+    EnrollmentQueue() : busy(false) {}
+
+    Template enroll(const Template &src)
+    {
+        Job job(src);
+        QMutexLocker locker(&lock);
+        pending.append(&job);
+        Metrics::adjust("br_enrollment_queue_depth", 1);
+        while (!job.done) {
+            if (busy) {
+                finished.wait(&lock);
+                continue;
+            }
+
+            busy = true;
+            const QList<Job*> batch = pending;
+            pending.clear();
+            Metrics::adjust("br_enrollment_queue_depth", -batch.size());
+            locker.unlock();
+            project(batch);
+            Metrics::increment("br_templates_enrolled_total", batch.size());
+            locker.relock();
+            foreach (Job *completed, batch)
+                completed->done = true;
+            busy = false;
+            finished.wakeAll();
+        }
+        return job.dst;
+    }
+
+private:
+    void project(const QList<Job*> &batch) const
+    {
+        TemplateList src, dst;
+        foreach (const Job *job, batch)
+            src.append(job->src);
+        stream->project(src, dst);
+
+        if (dst.size() == src.size()) {
+            for (int i=0; i<batch.size(); i++)
+                batch[i]->dst = dst[i];
+        } else {
+            // The pipeline changed the number of templates, fall back to one template per request
+            foreach (Job *job, batch)
+                transform->project(job->src, job->dst);
+        }
+    }
+};
+
+/*!
+ * \brief Algorithm and galleries kept resident between requests.
+ *
+ * Requests take their own references to the enrollment queue and distance,
+ * so changing the algorithm never frees them while an earlier request is still using them.
+ */
+struct MongooseService
+{
+    static QString algorithm;
+    static QSharedPointer<Distance> distance;
+    static QSharedPointer<EnrollmentQueue> enrollment;
+    static QHash<QString, TemplateList> galleries;
+    static QMutex lock;
+
+    static void load(QSharedPointer<EnrollmentQueue> &currentEnrollment, QSharedPointer<Distance> &currentDistance)
+    {
+        QMutexLocker locker(&lock);
+        if (algorithm != Globals->algorithm) {
+            // Loaded once through AlgorithmManager and shared by every request
+            QSharedPointer<EnrollmentQueue> queue(new EnrollmentQueue());
+            queue->transform = Transform::fromAlgorithm(Globals->algorithm, false);
+            queue->stream = Transform::fromAlgorithm(Globals->algorithm, true);
+            enrollment = queue;
+            distance = Distance::fromAlgorithm(Globals->algorithm);
+            algorithm = Globals->algorithm;
+        }
+        currentEnrollment = enrollment;
+        currentDistance = distance;
+    }
+
+    static TemplateList gallery(const QString &name)
+    {
+        QMutexLocker locker(&lock);
+        return galleries.value(name);
+    }
+};
+
+QString MongooseService::algorithm;
+QSharedPointer<Distance> MongooseService::distance;
+QSharedPointer<EnrollmentQueue> MongooseService::enrollment;
+QHash<QString, TemplateList> MongooseService::galleries;
+QMutex MongooseService::lock;
+
+static int reply(struct mg_connection *conn, int status, const QString &json)
+{
+    const QByteArray content = json.toUtf8();
+    mg_printf(conn,
+              "HTTP/1.1 %d %s\r\n"
+              "Content-Type: application/json\r\n"
+              "Content-Length: %d\r\n" // Always set Content-Length
+              "\r\n",
+              status, status == 200 ? "OK" : "Error", content.size());
+    mg_write(conn, content.data(), content.size());
+
+    // Returning non-zero tells mongoose that our function has replied to
+    // the client, and mongoose should not send client any more data.
+    return 1;
+}
+
+static int replyMetrics(struct mg_connection *conn)
+{
+    const QByteArray content = Metrics::exposition().toUtf8();
+    mg_printf(conn,
+              "HTTP/1.1 200 OK\r\n"
+              "Content-Type: text/plain; version=0.0.4\r\n"
+              "Content-Length: %d\r\n"
+              "\r\n",
+              content.size());
+    mg_write(conn, content.data(), content.size());
+    return 1;
+}
+
+static int error(struct mg_connection *conn, int status, const QString &message)
+{
+    return reply(conn, status, "{\"error\":" + QtUtils::toJsonString(message) + "}");
+}
+
+static QString variable(const struct mg_request_info *request_info, const char *name, const QString &defaultValue = QString())
+{
+    if (request_info->query_string == NULL) return defaultValue;
+    char value[1024];
+    if (mg_get_var(request_info->query_string, strlen(request_info->query_string), name, value, sizeof(value)) < 0)
+        return defaultValue;
+    return QString::fromUtf8(value);
+}
+
+// Larger request bodies are refused before any of them is read
+static const qint64 MaxBodyBytes = qint64(32) * 1024 * 1024;
+
+static bool body(struct mg_connection *conn, QByteArray &data)
+{
+    const char *contentLength = mg_get_header(conn, "Content-Length");
+    const qint64 length = (contentLength == NULL) ? 0 : QByteArray(contentLength).toLongLong();
+    if ((length < 0) || (length > MaxBodyBytes)) return false;
+    data = QByteArray(int(length), 0);
+    int bytesRead = 0;
+    while (bytesRead < data.size()) {
+        const int n = mg_read(conn, data.data() + bytesRead, data.size() - bytesRead);
+        if (n <= 0) break;
+        bytesRead += n;
+    }
+    data.truncate(bytesRead);
+    return true;
+}
+
+// Decode and enroll the image in the request body
+static bool enroll(EnrollmentQueue *enrollment, const QByteArray &data, const QString &name, Template &dst)
+{
+    if (data.isEmpty()) return false;
+    const Mat image = imdecode(Mat(1, data.size(), CV_8UC1, (void*) data.data()), 1);
+    if (!image.data) return false;
+
+    Template src(File(name.isEmpty() ? QString(".post") : name));
+    src.append(image);
+    dst = enrollment->enroll(src);
+    return !dst.isEmpty();
+}
+
+// The gallery file under BR_GALLERY_DIRECTORY that the client named, or an empty file if it is outside or the directory isn't set
+static File galleryFile(const QString &fileName)
+{
+    const QByteArray directory = qgetenv("BR_GALLERY_DIRECTORY");
+    if (directory.isEmpty()) return File();
+    const QString root = QDir(QString::fromLocal8Bit(directory)).canonicalPath();
+    File file(fileName);
+    const QString path = QFileInfo(QDir(root).filePath(file.name)).canonicalFilePath();
+    if (root.isEmpty() || path.isEmpty() || !path.startsWith(root + "/")) return File();
+    file.name = path;
+    return file;
+}
+
 // This function will be called by mongoose on every new request.
-static int begin_request_handler(struct mg_connection *conn) {
-  const struct mg_request_info *request_info = mg_get_request_info(conn);
-  char content[100];
-
-  // Prepare the message we're going to send
-  int content_length = snprintf(content, sizeof(content),
-                                "Hello from mongoose! Remote port: %d",
-                                request_info->remote_port);
-
-  // Send HTTP reply to the client
-  mg_printf(conn,
-            "HTTP/1.1 200 OK\r\n"
-            "Content-Type: text/plain\r\n"
-            "Content-Length: %d\r\n"        // Always set Content-Length
-            "\r\n"
-            "%s",
-            content_length, content);
-
-  // Returning non-zero tells mongoose that our function has replied to
-  // the client, and mongoose should not send client any more data.
-  return 1;
+static int begin_request_handler(struct mg_connection *conn)
+{
+    const struct mg_request_info *request_info = mg_get_request_info(conn);
+    const QString uri = request_info->uri;
+    const QString galleryName = variable(request_info, "gallery", "default");
+
+    // Scraped independently of the algorithm so an idle service is still visible
+    if (uri == "/metrics")
+        return replyMetrics(conn);
+
+    // Latency per request type, unknown paths share one label so they can't grow the registry
+    const bool known = (QStringList() << "/load" << "/enroll" << "/verify" << "/search").contains(uri);
+    const QString labels = "uri=\"" + (known ? uri : QString("other")) + "\"";
+    Metrics::increment("br_http_requests_total", 1, labels);
+    Metrics::Timer metric("br_http_request_seconds", labels);
+
+    if (Globals->algorithm.isEmpty())
+        return error(conn, 503, "No algorithm set.");
+    QSharedPointer<EnrollmentQueue> enrollment;
+    QSharedPointer<Distance> distance;
+    MongooseService::load(enrollment, distance);
+
+    if (uri == "/load") {
+        // Make an already enrolled gallery resident
+        const QString fileName = variable(request_info, "file");
+        if (fileName.isEmpty()) return error(conn, 400, "Missing file.");
+        const File file = galleryFile(fileName);
+        if (file.isNull()) return error(conn, 403, "File " + fileName + " is not in the gallery directory.");
+        const TemplateList templates = TemplateList::fromGallery(file);
+        QMutexLocker locker(&MongooseService::lock);
+        MongooseService::galleries[galleryName].append(templates);
+        return reply(conn, 200, "{\"gallery\":" + QtUtils::toJsonString(galleryName) + ",\"templates\":" + QString::number(MongooseService::galleries[galleryName].size()) + "}");
+    }
+
+    QByteArray data;
+    if (!body(conn, data))
+        return error(conn, 413, "Request body exceeds " + QString::number(MaxBodyBytes) + " bytes.");
+
+    Template query;
+    if (!enroll(enrollment.data(), data, variable(request_info, "name"), query))
+        return error(conn, 400, "Failed to enroll image.");
+
+    if (uri == "/enroll") {
+        QMutexLocker locker(&MongooseService::lock);
+        MongooseService::galleries[galleryName].append(query);
+        return reply(conn, 200, "{\"gallery\":" + QtUtils::toJsonString(galleryName) + ",\"templates\":" + QString::number(MongooseService::galleries[galleryName].size()) + "}");
+    }
+
+    const TemplateList gallery = MongooseService::gallery(galleryName);
+    if (uri == "/verify") {
+        const QString target = variable(request_info, "target");
+        for (int i=gallery.size()-1; i>=0; i--)
+            if (gallery[i].file.name == target) {
+                Metrics::increment("br_comparisons_total");
+                return reply(conn, 200, "{\"target\":" + QtUtils::toJsonString(target) + ",\"score\":" + QString::number(distance->compare(gallery[i], query)) + "}");
+            }
+        return error(conn, 404, "Unknown target " + target + ".");
+    }
+
+    if (uri == "/search") {
+        const int k = variable(request_info, "k", "1").toInt();
+        Metrics::increment("br_comparisons_total", gallery.size());
+        typedef QPair<float,int> Pair;
+        QStringList results;
+        foreach (const Pair &pair, Common::TopK(distance->compare(gallery, query), k, true))
+            results.append("{\"target\":" + QtUtils::toJsonString(gallery[pair.second].file.name) + ",\"score\":" + QString::number(pair.first) + "}");
+        return reply(conn, 200, "{\"results\":[" + results.join(",") + "]}");
+    }
+
+    return error(conn, 404, "Unknown request " + uri + ".");
 }
 
 /*!
  * \ingroup initializers
- * \brief Initialize mongoose server
+ * \brief Enrollment and search service over HTTP.
+ *
+ * Listens on the ports in the \c BR_LISTENING_PORTS environment variable (default \c 8080)
+ * and serves the algorithm set by \c -algorithm, loading it once for all requests.
+ * Images are posted as the request body, of at most 32 MB.
+ * - <tt>POST /enroll?gallery=G&name=N</tt> enrolls the image into resident gallery \c G.
+ * - <tt>POST /verify?gallery=G&target=N</tt> compares the image against template \c N of \c G.
+ * - <tt>POST /search?gallery=G&k=K</tt> returns the \c K best matches in \c G.
+ * - <tt>GET /load?gallery=G&file=F</tt> appends enrolled gallery file \c F to \c G,
+ *   \c F is relative to the \c BR_GALLERY_DIRECTORY environment variable and \c /load is refused without it.
+ * - <tt>GET /metrics</tt> returns enrollment and comparison counters, enrollment queue depth, Stream frame pool usage,
+ *   thread pool occupancy and per stage and per request latency histograms in the Prometheus text format.
+ *
+ * Responses other than \c /metrics are JSON.
+ * \author Josh Klontz \cite jklontz
  */
 class MongooseInitializer : public Initializer
 {
@@ -41,14 +318,17 @@ class MongooseInitializer : public Initializer
 
     void initialize() const
     {
+        const QByteArray ports = qgetenv("BR_LISTENING_PORTS").isEmpty() ? QByteArray("8080") : qgetenv("BR_LISTENING_PORTS");
+
         // List of options. Last element must be NULL.
-        const char *options[] = { "listening_ports", "8080", NULL };
+        const char *options[] = { "listening_ports", ports.constData(), NULL };
 
         // Prepare callbacks structure. We have only one callback, the rest are NULL.
         memset(&callbacks, 0, sizeof(callbacks));
         callbacks.begin_request = begin_request_handler;
 
         // Start the web server.
+        Metrics::setEnabled(true);
         ctx = mg_start(&callbacks, NULL, options);
     }
 
@@ -56,6 +336,13 @@ class MongooseInitializer : public Initializer
     {
         // Stop the server.
         mg_stop(ctx);
+        Metrics::setEnabled(false);
+
+        QMutexLocker locker(&MongooseService::lock);
+        MongooseService::galleries.clear();
+        MongooseService::enrollment.clear();
+        MongooseService::distance.clear();
+        MongooseService::algorithm.clear();
     }
 };
 
@@ -1,5 +1,8 @@
+#include <algorithm>
+#include <functional>
 #include <opencv2/video/tracking.hpp>
 #include <opencv2/video/background_segm.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 #include "openbr_internal.h"
 #include "openbr/core/opencvutils.h"
 
@@ -53,28 +56,184 @@ class OpticalFlowTransform : public UntrainableMetaTransform
 
 BR_REGISTER(Transform, OpticalFlowTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Optical flow between consecutive frames of each video, reusing each frame's preprocessing for the next pair.
+ *
+ * Replaces <tt>AggregateFrames(2)+OpticalFlow</tt>: every frame after the first of a video yields the flow from the previous frame,
+ * with that frame's metadata. Frames are converted to gray once rather than once per pair they belong to, and videos are told apart by file name.
+ * With \em sparse, Lucas-Kanade flow is computed only at the previous frame's points, for example from \c Grid,
+ * giving one row of x and y displacement per point, zero where the point was lost. Each frame's image pyramid is then built once and reused as the next pair's previous pyramid.
+ * \author Austin Blanton \cite imaus10
+ */
+class IncrementalOpticalFlowTransform : public TimeVaryingTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(double pyr_scale READ get_pyr_scale WRITE set_pyr_scale RESET reset_pyr_scale STORED false)
+    Q_PROPERTY(int levels READ get_levels WRITE set_levels RESET reset_levels STORED false)
+    Q_PROPERTY(int winsize READ get_winsize WRITE set_winsize RESET reset_winsize STORED false)
+    Q_PROPERTY(int iterations READ get_iterations WRITE set_iterations RESET reset_iterations STORED false)
+    Q_PROPERTY(int poly_n READ get_poly_n WRITE set_poly_n RESET reset_poly_n STORED false)
+    Q_PROPERTY(double poly_sigma READ get_poly_sigma WRITE set_poly_sigma RESET reset_poly_sigma STORED false)
+    Q_PROPERTY(int flags READ get_flags WRITE set_flags RESET reset_flags STORED false)
+    Q_PROPERTY(bool sparse READ get_sparse WRITE set_sparse RESET reset_sparse STORED false)
+    Q_PROPERTY(int maxLevel READ get_maxLevel WRITE set_maxLevel RESET reset_maxLevel STORED false)
+    // Dense defaults match OpticalFlow
+    BR_PROPERTY(double, pyr_scale, 0.1)
+    BR_PROPERTY(int, levels, 1)
+    BR_PROPERTY(int, winsize, 5)
+    BR_PROPERTY(int, iterations, 10)
+    BR_PROPERTY(int, poly_n, 7)
+    BR_PROPERTY(double, poly_sigma, 1.1)
+    BR_PROPERTY(int, flags, 0)
+    BR_PROPERTY(bool, sparse, false)
+    BR_PROPERTY(int, maxLevel, 3)
+
+    struct Frame
+    {
+        File file;
+        Mat gray;
+        std::vector<Mat> pyramid; // Only for sparse flow
+    };
+
+    QHash<QString, Frame> previous; // Last frame of each video
+
+public:
+    IncrementalOpticalFlowTransform() : TimeVaryingTransform(false, false) {}
+
+private:
+    void train(const TemplateList &data)
+    {
+        (void) data;
+    }
+
+    void projectUpdate(const TemplateList &src, TemplateList &dst)
+    {
+        foreach (const Template &t, src) {
+            Frame current;
+            current.file = t.file;
+            current.gray = t.m();
+            if (current.gray.channels() != 1) OpenCVUtils::cvtGray(t.m(), current.gray);
+            if (sparse) buildOpticalFlowPyramid(current.gray, current.pyramid, Size(winsize, winsize), maxLevel);
+
+            QHash<QString, Frame>::iterator last = previous.find(t.file.name);
+            if (last != previous.end()) {
+                Template out(last->file);
+                out += sparse ? sparseFlow(*last, current) : denseFlow(*last, current);
+                dst.append(out);
+                *last = current;
+            } else {
+                previous.insert(t.file.name, current);
+            }
+        }
+    }
+
+    Mat denseFlow(const Frame &prev, const Frame &next) const
+    {
+        Mat flow, flowOneCh;
+        calcOpticalFlowFarneback(prev.gray, next.gray, flow, pyr_scale, levels, winsize, iterations, poly_n, poly_sigma, flags);
+        std::vector<Mat> channels(2);
+        split(flow, channels);
+        magnitude(channels[0], channels[1], flowOneCh);
+        return flowOneCh;
+    }
+
+    Mat sparseFlow(const Frame &prev, const Frame &next) const
+    {
+        std::vector<Point2f> prevPoints, nextPoints;
+        foreach (const QPointF &point, prev.file.points())
+            prevPoints.push_back(OpenCVUtils::toPoint(point));
+        Mat displacements(int(prevPoints.size()), 2, CV_32FC1, Scalar(0));
+        if (prevPoints.empty()) return displacements;
+
+        std::vector<uchar> status;
+        std::vector<float> error;
+        calcOpticalFlowPyrLK(prev.pyramid, next.pyramid, prevPoints, nextPoints, status, error, Size(winsize, winsize), maxLevel);
+        for (size_t i=0; i<prevPoints.size(); i++) {
+            if (!status[i]) continue;
+            displacements.at<float>(int(i), 0) = nextPoints[i].x - prevPoints[i].x;
+            displacements.at<float>(int(i), 1) = nextPoints[i].y - prevPoints[i].y;
+        }
+        return displacements;
+    }
+
+    void finalize(TemplateList &output)
+    {
+        (void) output;
+        previous.clear();
+    }
+
+    void store(QDataStream &stream) const
+    {
+        (void) stream;
+    }
+
+    void load(QDataStream &stream)
+    {
+        (void) stream;
+    }
+};
+
+BR_REGISTER(Transform, IncrementalOpticalFlowTransform)
+
 /*!
  * \ingroup transforms
  * \brief Wraps OpenCV's BackgroundSubtractorMOG2 and puts the foreground mask in the Template metadata.
+ *
+ * The model can be kept at \em scale times the frame resolution and learn from only every \em updateEvery frames,
+ * frames in between are still segmented.
+ * If \em regions is set, the bounding boxes of foreground areas of at least \em minArea frame pixels, grown by \em margin of their size on each side,
+ * are stored as a list of rects under that key, for example <tt>SubtractBackground(regions=SearchRegions)</tt> restricts a following \c Cascade to the moving parts of the frame.
  * \author Austin Blanton \cite imaus10
  */
 class SubtractBackgroundTransform : public TimeVaryingTransform
 {
     Q_OBJECT
+    Q_PROPERTY(float scale READ get_scale WRITE set_scale RESET reset_scale STORED false)
+    Q_PROPERTY(int updateEvery READ get_updateEvery WRITE set_updateEvery RESET reset_updateEvery STORED false)
+    Q_PROPERTY(QString regions READ get_regions WRITE set_regions RESET reset_regions STORED false)
+    Q_PROPERTY(int minArea READ get_minArea WRITE set_minArea RESET reset_minArea STORED false)
+    Q_PROPERTY(float margin READ get_margin WRITE set_margin RESET reset_margin STORED false)
+    BR_PROPERTY(float, scale, 1)
+    BR_PROPERTY(int, updateEvery, 1)
+    BR_PROPERTY(QString, regions, "")
+    BR_PROPERTY(int, minArea, 0)
+    BR_PROPERTY(float, margin, 0.25)
 
     BackgroundSubtractorMOG2 mog;
+    int frames;
 
 public:
-    SubtractBackgroundTransform() : TimeVaryingTransform(false, false) {}
+    SubtractBackgroundTransform() : TimeVaryingTransform(false, false), frames(0) {}
 
 private:
     void projectUpdate(const Template &src, Template &dst)
     {
         dst = src;
+        Mat frame = src;
+        if (scale != 1) resize(src, frame, Size(), scale, scale, INTER_AREA);
+
+        // A learning rate of zero segments the frame without updating the model
         Mat mask;
-        mog(src, mask);
+        mog(frame, mask, (frames++ % std::max(1, updateEvery) == 0) ? -1 : 0);
         erode(mask, mask, Mat());
         dilate(mask, mask, Mat());
+
+        if (!regions.isEmpty()) {
+            std::vector< std::vector<Point> > contours;
+            findContours(mask.clone(), contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE);
+            const QRectF bounds(0, 0, src.m().cols, src.m().rows);
+            QList<QRectF> rects;
+            foreach (const std::vector<Point> &contour, contours) {
+                const Rect box = boundingRect(contour);
+                const QRectF rect(box.x / scale, box.y / scale, box.width / scale, box.height / scale);
+                if (rect.width() * rect.height() < minArea) continue;
+                rects.append(rect.adjusted(-margin*rect.width(), -margin*rect.height(), margin*rect.width(), margin*rect.height()) & bounds);
+            }
+            dst.file.setList<QRectF>(regions, rects);
+        }
+
+        if (scale != 1) resize(mask, mask, src.m().size(), 0, 0, INTER_NEAREST);
         dst.file.set("Mask", QVariant::fromValue(mask));
     }
 
@@ -87,11 +246,327 @@ private:
     {
         (void) output;
         mog = BackgroundSubtractorMOG2();
+        frames = 0;
     }
 };
 
 BR_REGISTER(Transform, SubtractBackgroundTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Tracking by detection, restricting \em transform to the neighborhood of the previous frame's detections.
+ *
+ * Each frame of a video, told apart by file name, gets the rects \em transform found in the previous frame,
+ * grown by \em margin of their size on each side, appended to its \em searchRegions list, which detectors
+ * such as \c Cascade, \c SlidingWindow and \c HOGDetect honor. Frames after one with no detections,
+ * and every \em redetectEvery frames so new objects are found, are searched in full.
+ * \author Josh Klontz \cite jklontz
+ */
+class TrackRegionsTransform : public WrapperTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(QString searchRegions READ get_searchRegions WRITE set_searchRegions RESET reset_searchRegions STORED false)
+    Q_PROPERTY(float margin READ get_margin WRITE set_margin RESET reset_margin STORED false)
+    Q_PROPERTY(int redetectEvery READ get_redetectEvery WRITE set_redetectEvery RESET reset_redetectEvery STORED false)
+    BR_PROPERTY(QString, searchRegions, "SearchRegions")
+    BR_PROPERTY(float, margin, 0.5)
+    BR_PROPERTY(int, redetectEvery, 30)
+
+    struct Track
+    {
+        QList<QRectF> rects;
+        int frames;
+        Track() : frames(0) {}
+    };
+
+    QHash<QString, Track> tracks; // Of each video
+
+public:
+    TrackRegionsTransform() : WrapperTransform(false) {}
+
+private:
+    bool timeVarying() const { return true; }
+
+    void project(const Template &src, Template &dst) const
+    {
+        timeInvariantAlias.project(src, dst);
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        timeInvariantAlias.project(src, dst);
+    }
+
+    void projectUpdate(const Template &src, Template &dst)
+    {
+        TemplateList output;
+        projectUpdate(TemplateList() << src, output);
+        if (!output.isEmpty()) dst = output.first();
+    }
+
+    void projectUpdate(const TemplateList &src, TemplateList &dst)
+    {
+        foreach (const Template &t, src) {
+            Track &track = tracks[t.file.name];
+            Template u = t;
+            const bool restricted = !track.rects.isEmpty() && (track.frames % std::max(1, redetectEvery) != 0);
+            if (restricted) {
+                QList<QRectF> regions = t.file.getList<QRectF>(searchRegions, QList<QRectF>());
+                foreach (const QRectF &rect, track.rects)
+                    regions.append(rect.adjusted(-margin*rect.width(), -margin*rect.height(), margin*rect.width(), margin*rect.height()));
+                u.file.setList<QRectF>(searchRegions, regions);
+            }
+
+            TemplateList output;
+            transform->projectUpdate(TemplateList() << u, output);
+
+            // Detections are the rects the input did not already have
+            const QList<QRectF> previous = t.file.rects();
+            QList<QRectF> found;
+            for (int i=0; i<output.size(); i++) {
+                foreach (const QRectF &rect, output[i].file.rects())
+                    if (!previous.contains(rect) && !found.contains(rect))
+                        found.append(rect);
+                if (restricted && !t.file.contains(searchRegions))
+                    output[i].file.remove(searchRegions);
+            }
+            dst.append(output);
+
+            track.rects = found;
+            track.frames = found.isEmpty() ? 0 : track.frames + 1;
+        }
+    }
+
+    void finalize(TemplateList &output)
+    {
+        WrapperTransform::finalize(output);
+        tracks.clear();
+    }
+};
+
+BR_REGISTER(Transform, TrackRegionsTransform)
+
+/*!
+ * \ingroup transforms
+ * \brief Associates detections across frames and only projects \em transform on each track's best frames.
+ *
+ * Each call to project is one frame of each video, told apart by file name, and each template one detection, for example after \c Cascade+Expand.
+ * A detection joins the unmatched track of the previous frames whose rect it overlaps most, by intersection over union of at least \em minIoU,
+ * or starts a new track. With \em appearance greater than zero, the match score mixes in that much of the normalized correlation of small gray thumbnails.
+ * Tracks not seen for more than \em maxAge frames are dropped, and each detection's track is stored as \c TrackID.
+ *
+ * \em transform, for example enrollment, is only projected on a track's first frame and on frames whose \em quality metadata,
+ * such as \c Confidence or \c DFFS with \em lowerIsBetter, improves on the track's best, at most \em maxEnrollments times.
+ * Other frames reuse the matrices of the track's last projection and the metadata it added, or only \em keys if given,
+ * with point and rect values moved along with the detection.
+ * \author Josh Klontz \cite jklontz
+ */
+class TrackTransform : public WrapperTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(float minIoU READ get_minIoU WRITE set_minIoU RESET reset_minIoU STORED false)
+    Q_PROPERTY(float appearance READ get_appearance WRITE set_appearance RESET reset_appearance STORED false)
+    Q_PROPERTY(int maxAge READ get_maxAge WRITE set_maxAge RESET reset_maxAge STORED false)
+    Q_PROPERTY(QString quality READ get_quality WRITE set_quality RESET reset_quality STORED false)
+    Q_PROPERTY(bool lowerIsBetter READ get_lowerIsBetter WRITE set_lowerIsBetter RESET reset_lowerIsBetter STORED false)
+    Q_PROPERTY(int maxEnrollments READ get_maxEnrollments WRITE set_maxEnrollments RESET reset_maxEnrollments STORED false)
+    Q_PROPERTY(QStringList keys READ get_keys WRITE set_keys RESET reset_keys STORED false)
+    BR_PROPERTY(float, minIoU, 0.3)
+    BR_PROPERTY(float, appearance, 0)
+    BR_PROPERTY(int, maxAge, 5)
+    BR_PROPERTY(QString, quality, "Confidence")
+    BR_PROPERTY(bool, lowerIsBetter, false)
+    BR_PROPERTY(int, maxEnrollments, 3)
+    BR_PROPERTY(QStringList, keys, QStringList())
+
+    struct Track
+    {
+        int id;
+        QRectF rect;
+        Mat thumbnail;
+        int age; // Frames since last seen
+        float best;
+        int enrollments;
+        Template output; // Of the last projection
+        QRectF outputRect;
+        QStringList added;
+        Track() : id(0), age(0), best(0), enrollments(0) {}
+    };
+
+    QHash<QString, QList<Track> > tracks; // Of each video
+    int nextID;
+
+public:
+    TrackTransform() : WrapperTransform(false), nextID(0) {}
+
+private:
+    bool timeVarying() const { return true; }
+
+    void project(const Template &src, Template &dst) const
+    {
+        timeInvariantAlias.project(src, dst);
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        timeInvariantAlias.project(src, dst);
+    }
+
+    void projectUpdate(const Template &src, Template &dst)
+    {
+        TemplateList output;
+        projectUpdate(TemplateList() << src, output);
+        if (!output.isEmpty()) dst = output.first();
+    }
+
+    static float intersectionOverUnion(const QRectF &a, const QRectF &b)
+    {
+        const QRectF intersection = a & b;
+        const float overlap = intersection.width() * intersection.height();
+        return overlap / (a.width() * a.height() + b.width() * b.height() - overlap);
+    }
+
+    static Mat thumbnail(const Mat &m, const QRectF &rect)
+    {
+        const Rect roi = OpenCVUtils::toRect(rect) & Rect(0, 0, m.cols, m.rows);
+        if (roi.area() == 0) return Mat();
+        Mat gray = m(roi), small;
+        if (gray.channels() != 1) OpenCVUtils::cvtGray(m(roi), gray);
+        resize(gray, small, Size(16, 16), 0, 0, INTER_AREA);
+        small.convertTo(small, CV_32F);
+        return small;
+    }
+
+    static float similarity(const Mat &a, const Mat &b)
+    {
+        if (a.empty() || b.empty()) return 0;
+        Mat result;
+        matchTemplate(a, b, result, CV_TM_CCOEFF_NORMED);
+        return result.at<float>(0, 0);
+    }
+
+    void projectUpdate(const TemplateList &src, TemplateList &dst)
+    {
+        // Detections of each video, in order of first appearance
+        QList<QString> videos;
+        QHash<QString, QList<int> > detections;
+        for (int i=0; i<src.size(); i++) {
+            if (!detections.contains(src[i].file.name)) videos.append(src[i].file.name);
+            detections[src[i].file.name].append(i);
+        }
+
+        QVector<int> trackOf(src.size(), -1);
+        foreach (const QString &video, videos) {
+            QList<Track> &videoTracks = tracks[video];
+            const QList<int> &indices = detections[video];
+
+            QVector<Mat> thumbnails(src.size());
+            typedef QPair<float, QPair<int,int> > Candidate; // (score, (track, detection))
+            QList<Candidate> candidates;
+            foreach (int i, indices) {
+                const QList<QRectF> rects = src[i].file.rects();
+                if (rects.isEmpty()) continue;
+                if (appearance > 0) thumbnails[i] = thumbnail(src[i], rects.last());
+                for (int j=0; j<videoTracks.size(); j++) {
+                    const float iou = intersectionOverUnion(videoTracks[j].rect, rects.last());
+                    if (iou < minIoU) continue;
+                    const float score = appearance > 0 ? (1-appearance)*iou + appearance*similarity(videoTracks[j].thumbnail, thumbnails[i]) : iou;
+                    candidates.append(qMakePair(score, qMakePair(j, i)));
+                }
+            }
+            std::sort(candidates.begin(), candidates.end(), std::greater<Candidate>());
+
+            QVector<bool> matched(videoTracks.size(), false);
+            foreach (const Candidate &candidate, candidates) {
+                const int j = candidate.second.first, i = candidate.second.second;
+                if (matched[j] || (trackOf[i] != -1)) continue;
+                matched[j] = true;
+                trackOf[i] = videoTracks[j].id;
+            }
+
+            for (int j=0; j<videoTracks.size(); j++)
+                if (!matched[j]) videoTracks[j].age++;
+
+            foreach (int i, indices) {
+                const QList<QRectF> rects = src[i].file.rects();
+                if (rects.isEmpty()) continue;
+                if (trackOf[i] == -1) {
+                    Track track;
+                    track.id = trackOf[i] = nextID++;
+                    videoTracks.append(track);
+                }
+                Track &track = findTrack(videoTracks, trackOf[i]);
+                track.rect = rects.last();
+                track.thumbnail = thumbnails[i];
+                track.age = 0;
+            }
+
+            for (int j=videoTracks.size()-1; j>=0; j--)
+                if (videoTracks[j].age > maxAge) videoTracks.removeAt(j);
+        }
+
+        for (int i=0; i<src.size(); i++) {
+            const Template &t = src[i];
+            if (trackOf[i] == -1) {
+                transform->projectUpdate(TemplateList() << t, dst);
+                continue;
+            }
+
+            Track &track = findTrack(tracks[t.file.name], trackOf[i]);
+            const float q = t.file.get<float>(quality, 0);
+            const bool better = (track.enrollments == 0) || (lowerIsBetter ? q < track.best : q > track.best);
+            if (better && (track.enrollments < maxEnrollments)) {
+                TemplateList output;
+                transform->projectUpdate(TemplateList() << t, output);
+                if (!output.isEmpty()) {
+                    track.output = output.first();
+                    track.outputRect = track.rect;
+                    track.added = keys;
+                    if (track.added.isEmpty())
+                        foreach (const QString &key, track.output.file.localKeys())
+                            if (!t.file.localKeys().contains(key)) track.added.append(key);
+                    track.best = q;
+                    track.enrollments++;
+                }
+                for (int j=0; j<output.size(); j++)
+                    output[j].file.set("TrackID", track.id);
+                dst.append(output);
+            } else {
+                Template out(t.file);
+                foreach (const Mat &m, track.output)
+                    out.append(m);
+
+                const QPointF offset = track.rect.center() - track.outputRect.center();
+                foreach (const QString &key, track.added) {
+                    const QVariant value = track.output.file.value(key);
+                    if      (value.type() == QVariant::PointF) out.file.set(key, value.toPointF() + offset);
+                    else if (value.type() == QVariant::RectF)  out.file.set(key, value.toRectF().translated(offset));
+                    else                                       out.file.set(key, value);
+                }
+                out.file.set("TrackID", track.id);
+                dst.append(out);
+            }
+        }
+    }
+
+    static Track &findTrack(QList<Track> &videoTracks, int id)
+    {
+        for (int j=0; j<videoTracks.size(); j++)
+            if (videoTracks[j].id == id) return videoTracks[j];
+        qFatal("Track %d not found.", id);
+        return videoTracks.first();
+    }
+
+    void finalize(TemplateList &output)
+    {
+        WrapperTransform::finalize(output);
+        tracks.clear();
+        nextID = 0;
+    }
+};
+
+BR_REGISTER(Transform, TrackTransform)
+
 } // namespace br
 
 #include "motion.moc"
@@ -237,7 +237,7 @@ class RowWiseMeanCenterTransform : public Transform
 
     void train(const TemplateList &data)
     {
-        Mat m = OpenCVUtils::toMatByRow(data.data());
+        const Mat m = data.matrix();
         mean = Mat(1, m.cols, m.type());
         for (int i=0; i<m.cols; i++)
             mean.col(i) = cv::mean(m.col(i));
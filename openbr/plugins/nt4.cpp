@@ -1,8 +1,10 @@
 #include <QDebug>
 #include <QFileInfo>
+#include <QFutureSynchronizer>
 #include <QProcess>
 #include <QString>
 #include <QStringList>
+#include <QtConcurrentRun>
 #include <NCore.h>
 #include <NImages.h>
 #include <NLExtractor.h>
@@ -53,13 +55,18 @@ class NT4Initializer : public Initializer
 
     void initialize() const
     {
-        NCoreOnStart();
         Globals->abbreviations.insert("NT4Face", "Open+NT4DetectFace!NT4EnrollFace:NT4Compare");
         Globals->abbreviations.insert("NT4Iris", "Open+NT4EnrollIris:NT4Compare");
+    }
+
+    // Licenses are only obtained once an NT4Context is needed
+    void prepare() const
+    {
+        NCoreOnStart();
         manageLicenses(true);
     }
 
-    void finalize() const
+    void release() const
     {
         manageLicenses(false);
         NCoreOnExitEx(false);
@@ -81,6 +88,7 @@ struct NT4Context
 
     NT4Context()
     {
+        Initializer::require("NT4");
         NResult result;
 
         // Face
@@ -424,35 +432,58 @@ class NT4Compare : public Distance
 
     Resource<NT4Context> contexts;
 
-    float compare(const br::Template &a, const br::Template &b) const
+    // One identification started on target a, matched against each of the queries
+    void identify(const Mat &a, const TemplateList &queries, float *scores) const
     {
+        for (int i=0; i<queries.size(); i++)
+            scores[i] = -std::numeric_limits<float>::max();
+        if (!a.data) return;
+
         NT4Context *context = contexts.acquire();
 
-        NResult result;
+        NResult result = NMIdentifyStartEx(context->matcher, a.data, a.rows*a.cols, NULL);
+        if (NFailed(result)) qFatal("NT4Compare::compare NMIdentifyStart() failed, result=%i.", result);
 
-        const Mat &srcA = a;
-        if (srcA.data) {
-            result = NMIdentifyStartEx(context->matcher, srcA.data, srcA.rows*srcA.cols, NULL);
-            if (NFailed(result)) qFatal("NT4Compare::compare NMIdentifyStart() failed, result=%i.", result);
-        }
-
-        const Mat &srcB = b;
-        float score = -std::numeric_limits<float>::max();
-        if (srcA.data && srcB.data) {
+        for (int i=0; i<queries.size(); i++) {
+            const Mat &b = queries[i];
+            if (!b.data) continue;
             NInt pScore;
-            result = NMIdentifyNextEx(context->matcher, srcB.data, srcB.rows*srcB.cols, NULL, &pScore);
+            result = NMIdentifyNextEx(context->matcher, b.data, b.rows*b.cols, NULL, &pScore);
             if (NFailed(result)) qFatal("NT4Compare::compare NMIdentifyNext() failed, result=%i.",result);
-            score = float(pScore);
+            scores[i] = float(pScore);
         }
 
-        if (srcA.data) {
-            result = NMIdentifyEnd(context->matcher);
-            if (NFailed(result)) qFatal("NT4Compare::compare NMIdentifyEnd() failed, result=%i.", result);
-        }
+        result = NMIdentifyEnd(context->matcher);
+        if (NFailed(result)) qFatal("NT4Compare::compare NMIdentifyEnd() failed, result=%i.", result);
 
         contexts.release(context);
+    }
+
+    // Scores column j of the block
+    void compareTarget(const TemplateList &targets, const TemplateList &queries, Output *output, int j) const
+    {
+        Mat scores(queries.size(), 1, CV_32FC1);
+        identify(targets[j], queries, scores.ptr<float>());
+        output->setRelativeTile(scores, 0, j);
+    }
+
+    float compare(const br::Template &a, const br::Template &b) const
+    {
+        float score;
+        identify(a, TemplateList() << b, &score);
         return score;
     }
+
+    // Each target is identified against the whole block of queries at once, targets in parallel
+    void compare(const TemplateList &targets, const TemplateList &queries, Output *output) const
+    {
+        if (queries.isEmpty()) return;
+        QFutureSynchronizer<void> futures;
+        for (int j=0; j<targets.size(); j++)
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &NT4Compare::compareTarget, targets, queries, output, j));
+            else                                                                          compareTarget (targets, queries, output, j);
+        futures.waitForFinished();
+    }
 };
 
 BR_REGISTER(Distance, NT4Compare)
@@ -1,6 +1,7 @@
 #ifndef OPENBR_INTERNAL_H
 #define OPENBR_INTERNAL_H
 
+#include <QSemaphore>
 #include "openbr/openbr_plugin.h"
 #include "openbr/core/resource.h"
 
@@ -13,6 +14,10 @@ class BR_EXPORT UntrainableTransform : public Transform
 {
     Q_OBJECT
 
+public:
+    /*!< \brief True unless project(const TemplateList&, TemplateList&) is overridden to do more than project each template, so br::PipeTransform may fuse the transform with its neighbors. */
+    virtual bool projectsTemplates() const { return true; }
+
 protected:
     UntrainableTransform(bool independent = true) : Transform(independent, false) {} /*!< \brief Construct an untrainable transform. */
 
@@ -302,6 +307,57 @@ protected:
     CompositeTransform() : TimeVaryingTransform(false) {}
 };
 
+/*!
+ * \brief Bounds how many sub-transforms train at once.
+ *
+ * Each sub-transform is assumed to need twice the bytes of its training templates,
+ * at most br::Context::parallelism train together and together they stay within br::Context::trainingMemory megabytes.
+ */
+class TrainingSlots
+{
+    QSemaphore semaphore;
+
+public:
+    TrainingSlots(qint64 bytesPerTransform, int transforms)
+    {
+        int slots = std::max(1, std::min(transforms, Globals->parallelism));
+        if ((Globals->trainingMemory > 0) && (bytesPerTransform > 0))
+            slots = std::max(1, (int)std::min(qint64(slots), qint64(Globals->trainingMemory) * 1024 * 1024 / (2 * bytesPerTransform)));
+        semaphore.release(slots);
+    }
+
+    void acquire() { semaphore.acquire(); }
+    void release() { semaphore.release(); }
+
+    static qint64 bytes(const TemplateList &templates)
+    {
+        qint64 total = 0;
+        foreach (const Template &t, templates)
+            foreach (const cv::Mat &m, t)
+                total += m.total() * m.elemSize();
+        return total;
+    }
+};
+
+#ifdef BR_WITH_GPU
+// Implemented in plugins/gpu.cpp
+namespace GPU
+{
+    bool available(); // A CUDA device with CUBLAS support is present
+    void project(const cv::Mat &src, const cv::Mat &mean, const cv::Mat &projection, cv::Mat &dst); // dst = (src - mean) * projection^T, one template per row
+    void correlate(const cv::Mat &src, const QList<cv::Mat> &spectra, QList<cv::Mat> &dst); // Complex correlation of a 32FC1 image with each DFT-sized 32FC2 spectrum
+}
+#endif // BR_WITH_GPU
+
+// Templates rejected by a failure to enroll are emptied and flagged FTE, later stages pass them through untouched
+inline bool Rejected(const Template &t)
+{
+    return t.isEmpty() && t.file.get<bool>("FTE", false);
+}
+
+// Implemented in plugins/independent.cpp
+TemplateList Downsample(const TemplateList &templates, int classes, int instances, float fraction, const QString &inputVariable);
+
 class EnrollmentWorker;
 
 // Implemented in plugins/process.cpp
@@ -23,15 +23,24 @@
 #include <QFileInfo>
 #include <QFutureSynchronizer>
 #include <QList>
+#include <QMap>
 #include <QMutex>
 #include <QPair>
+#include <QReadWriteLock>
+#include <QSharedPointer>
+#include <QThread>
 #include <QVector>
 #include <QtConcurrent>
 #include <QtGlobal>
 #include <opencv2/highgui/highgui.hpp>
+#include <algorithm>
+#include <functional>
 #include <iostream>
 #include <limits>
 #include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
 #include "openbr_internal.h"
 
 #include "openbr/core/bee.h"
@@ -63,27 +72,290 @@ class DefaultOutput : public MatrixOutput
 
 BR_REGISTER(Output, DefaultOutput)
 
+// Writes value as QString::number(float) does, the shorter of %f and %e at six significant digits, independent of the locale.
+// Returns the number of characters written, at most 16.
+static int formatScore(float value, char *text)
+{
+    static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                     1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    char *p = text;
+    double v = value;
+    if (v != v) { memcpy(p, "nan", 3); return 3; }
+    if (v < 0) { *p++ = '-'; v = -v; }
+    if (v > std::numeric_limits<float>::max()) { memcpy(p, "inf", 3); return int(p - text) + 3; }
+    if (v == 0) { *p++ = '0'; return int(p - text); }
+
+    // Scaling by an exact power of ten leaves one rounding, so only values within its error of a tie need the exact conversion
+    int exponent = int(floor(log10(v)));
+    double scaled = 0;
+    for (int attempt=0; attempt<2; attempt++) {
+        const int shift = 5 - exponent;
+        if ((shift < -22) || (shift > 22)) { scaled = -1; break; }
+        scaled = shift >= 0 ? v * powers[shift] : v / powers[-shift];
+        if      (scaled >= 999999.5) exponent++;
+        else if (scaled < 99999.5)   exponent--;
+        else break;
+    }
+    const double fraction = scaled - floor(scaled);
+    if ((scaled < 99999.5) || (scaled >= 999999.5) || (fabs(fraction - 0.5) < 1e-9)) {
+        const QByteArray exact = QByteArray::number(v, 'g', 6);
+        memcpy(p, exact.constData(), exact.size());
+        return int(p - text) + exact.size();
+    }
+
+    int mantissa = int(floor(scaled + 0.5));
+    char digits[6];
+    for (int i=5; i>=0; i--) {
+        digits[i] = char('0' + mantissa % 10);
+        mantissa /= 10;
+    }
+    int significant = 6;
+    while (digits[significant-1] == '0') significant--;
+
+    if ((exponent < -4) || (exponent >= 6)) {
+        *p++ = digits[0];
+        if (significant > 1) {
+            *p++ = '.';
+            for (int i=1; i<significant; i++) *p++ = digits[i];
+        }
+        *p++ = 'e';
+        *p++ = exponent < 0 ? '-' : '+';
+        const int magnitude = abs(exponent);
+        if (magnitude >= 100) *p++ = char('0' + magnitude / 100);
+        *p++ = char('0' + magnitude / 10 % 10);
+        *p++ = char('0' + magnitude % 10);
+    } else if (exponent >= 0) {
+        for (int i=0; i<=exponent; i++) *p++ = digits[i];
+        if (significant > exponent+1) {
+            *p++ = '.';
+            for (int i=exponent+1; i<significant; i++) *p++ = digits[i];
+        }
+    } else {
+        *p++ = '0';
+        *p++ = '.';
+        for (int i=0; i<-exponent-1; i++) *p++ = '0';
+        for (int i=0; i<significant; i++) *p++ = digits[i];
+    }
+    return int(p - text);
+}
+
+static inline void appendScore(QByteArray &text, float value)
+{
+    char buffer[16];
+    text.append(buffer, formatScore(value, buffer));
+}
+
+/*!
+ * \brief Base class for text outputs written a band of rows at a time.
+ *
+ * Scores are kept for one band of \em blockSize query rows, which is formatted in parallel, a row per task,
+ * and appended to the file once all its column blocks are set. Bands are written in order, so a band completed
+ * early, as when comparisons iterate over target blocks in the outer loop, waits in memory for the ones before it.
+ * Lines are separated by newlines and written as by QtUtils::writeFile(), including the \c terminal and \c buffer names.
+ */
+class TextOutput : public Output
+{
+    Q_OBJECT
+
+    struct Band
+    {
+        cv::Mat scores;
+        int blocks; // Column blocks set
+        Band() : blocks(0) {}
+    };
+
+    QMap<int, Band> bands; // Not yet written
+    int rowBlock, nextBand, columnBlocks;
+    cv::Mat current; // Scores of rowBlock
+    qint64 currentRow; // First row of current
+    QFile text;
+    bool active, terminal, buffer, empty;
+
+    // Formats the rows of a band for Common::ParallelFor
+    struct FormatRows
+    {
+        const TextOutput *output;
+        const cv::Mat *scores;
+        int firstRow;
+        QVector<QByteArray> *rows;
+
+        void operator()(int i) const
+        {
+            output->formatRow(firstRow + i, scores->ptr<float>(i), (*rows)[i]);
+        }
+    };
+
+public:
+    TextOutput() : rowBlock(-1), nextBand(0), columnBlocks(1), currentRow(0), active(false), terminal(false), buffer(false), empty(true) {}
+
+protected:
+    virtual QByteArray header() const { return QByteArray(); } /*!< \brief The first line, if not empty. */
+    virtual void formatRow(int row, const float *scores, QByteArray &lines) const = 0; /*!< \brief Formats the lines of query \em row, without a trailing newline. */
+
+    // Called first by derived destructors, while formatRow() can still be called
+    void finish()
+    {
+        if (rowBlock != -1) {
+            bands[rowBlock].blocks++;
+            rowBlock = -1;
+        }
+        current.release();
+
+        // Incomplete bands are written with the scores they have
+        while (!bands.isEmpty())
+            writeBand(bands.begin().key());
+
+        if (active && terminal) {
+            fputs("\n", stdout);
+            fflush(stdout);
+        }
+        text.close();
+        active = false;
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        Output::initialize(targetFiles, queryFiles);
+        columnBlocks = std::max(1, int((qint64(targetFiles.size()) + blockSize - 1) / blockSize));
+        if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
+
+        const QString baseName = file.baseName();
+        terminal = (baseName == "terminal");
+        buffer = (baseName == "buffer");
+        if (buffer) {
+            Globals->buffer.clear();
+        } else if (!terminal) {
+            text.setFileName(file);
+            QtUtils::touchDir(text);
+            if (!text.open(QFile::WriteOnly))
+                qFatal("Failed to open %s for writing.", qPrintable(file));
+        }
+        active = true;
+        write(header());
+    }
+
+    void setBlock(int rowBlock, int columnBlock)
+    {
+        Output::setBlock(rowBlock, columnBlock);
+        if (this->rowBlock != -1) {
+            bands[this->rowBlock].blocks++;
+            writeCompleteBands();
+        }
+
+        this->rowBlock = std::max(rowBlock, 0);
+        current = band(this->rowBlock).scores;
+        currentRow = qint64(this->rowBlock) * blockSize;
+    }
+
+private:
+    Band &band(int index)
+    {
+        Band &band = bands[index];
+        if (band.scores.empty()) {
+            const qint64 firstRow = qint64(index) * blockSize;
+            band.scores = cv::Mat(int(std::max(qint64(0), std::min(qint64(queryFiles.size()) - firstRow, qint64(blockSize)))), targetFiles.size(), CV_32FC1, cv::Scalar(0));
+        }
+        return band;
+    }
+
+    // Like MatrixOutput, columns beyond the last target continue on the following rows.
+    // Rows outside the current band, which are only set by single threaded callers, go to their own band.
+    void set(float value, int i, int j)
+    {
+        const qint64 row = i - currentRow;
+        if ((row < 0) || (row >= current.rows)) {
+            cv::Mat &scores = band(int(i / blockSize)).scores;
+            if ((j < scores.cols) && (i % blockSize < scores.rows))
+                scores.at<float>(i % blockSize, j) = value;
+            return;
+        }
+
+        const size_t index = size_t(row) * current.cols + j;
+        if (index < current.total())
+            current.ptr<float>()[index] = value;
+    }
+
+    void setTile(const cv::Mat &scores, int i, int j)
+    {
+        scores.copyTo(current(cv::Rect(j, int(i - currentRow), scores.cols, scores.rows)));
+    }
+
+    void writeCompleteBands()
+    {
+        while (bands.contains(nextBand) && (bands[nextBand].blocks >= columnBlocks))
+            writeBand(nextBand);
+    }
+
+    void writeBand(int index)
+    {
+        const Band band = bands.take(index);
+        nextBand = index + 1;
+        if (!active || band.scores.empty()) return;
+
+        QVector<QByteArray> rows(band.scores.rows);
+        FormatRows format;
+        format.output = this;
+        format.scores = &band.scores;
+        format.firstRow = int(qint64(index) * blockSize);
+        format.rows = &rows;
+        Common::ParallelFor(0, band.scores.rows, format, Globals->parallelism);
+
+        foreach (const QByteArray &row, rows)
+            write(row);
+    }
+
+    void write(const QByteArray &lines)
+    {
+        if (!active || lines.isEmpty()) return;
+        QByteArray data;
+        data.reserve(lines.size() + 1);
+        if (!empty) data.append('\n');
+        data.append(lines);
+        empty = false;
+
+        if      (terminal) fwrite(data.constData(), 1, data.size(), stdout);
+        else if (buffer)   Globals->buffer.append(data);
+        else if (text.write(data) != data.size())
+            qFatal("Failed to write %s.", qPrintable(file));
+    }
+};
+
 /*!
  * \ingroup outputs
  * \brief Comma separated values output.
  * \author Josh Klontz \cite jklontz
  */
-class csvOutput : public MatrixOutput
+class csvOutput : public TextOutput
 {
     Q_OBJECT
 
+    QList<QByteArray> queryNames;
+
     ~csvOutput()
     {
-        if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
-        QStringList lines;
-        lines.append("File," + targetFiles.names().join(","));
-        for (int i=0; i<queryFiles.size(); i++) {
-            QStringList words;
-            for (int j=0; j<targetFiles.size(); j++)
-                words.append(toString(i,j));  // The toString idiom is used to output match scores - see MatrixOutput
-            lines.append(queryFiles[i].name+","+words.join(","));
+        finish();
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        foreach (const File &query, queryFiles)
+            queryNames.append(query.name.toLocal8Bit());
+        TextOutput::initialize(targetFiles, queryFiles);
+    }
+
+    QByteArray header() const
+    {
+        return ("File," + targetFiles.names().join(",")).toLocal8Bit();
+    }
+
+    void formatRow(int row, const float *scores, QByteArray &lines) const
+    {
+        lines.reserve(queryNames[row].size() + 12*targetFiles.size());
+        lines.append(queryNames[row]);
+        for (int j=0; j<targetFiles.size(); j++) {
+            lines.append(',');
+            appendScore(lines, scores[j]);
         }
-        QtUtils::writeFile(file, lines);
     }
 };
 
@@ -92,6 +364,9 @@ BR_REGISTER(Output, csvOutput)
 /*!
  * \ingroup outputs
  * \brief Matrix-like output for heat maps.
+ *
+ * Row \em i of the output is the mean of every score set for patch \em i, ignoring missing scores.
+ * Each thread accumulates into its own buffer, the buffers are only reduced when the block changes.
  * \author Scott Klum \cite sklum
  */
 class heatOutput : public MatrixOutput
@@ -100,10 +375,18 @@ class heatOutput : public MatrixOutput
     Q_PROPERTY(int patches READ get_patches WRITE set_patches RESET reset_patches STORED false)
     BR_PROPERTY(int, patches, -1)
 
+    // Sum of scores in the first column, count in the second
+    typedef QSharedPointer<cv::Mat> Accumulator;
+
+    QReadWriteLock accumulatorsLock;
+    QHash<QThread*, Accumulator> accumulators;
+    cv::Mat totals;
+
     ~heatOutput()
     {
         if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
 
+        reduce();
         QStringList lines;
         for (int i=0; i<data.rows; i++) {
             lines.append(toString(i,0));
@@ -116,6 +399,70 @@ class heatOutput : public MatrixOutput
         if (patches == -1) qFatal("Heat output requires the number of patches");
         Output::initialize(targetFiles, queryFiles);
         data.create(patches, 1, CV_32FC1);
+        data.setTo(-std::numeric_limits<float>::max());
+        totals = cv::Mat::zeros(patches, 2, CV_64FC1);
+    }
+
+    void setBlock(int rowBlock, int columnBlock)
+    {
+        // Blocks are compared one after another, so no thread is accumulating here
+        reduce();
+        Output::setBlock(rowBlock, columnBlock);
+    }
+
+    // Only the calling thread writes to the returned buffer
+    cv::Mat &accumulator()
+    {
+        QThread *thread = QThread::currentThread();
+        {
+            QReadLocker locker(&accumulatorsLock);
+            QHash<QThread*, Accumulator>::const_iterator it = accumulators.constFind(thread);
+            if (it != accumulators.constEnd()) return **it;
+        }
+
+        QWriteLocker locker(&accumulatorsLock);
+        Accumulator &accumulator = accumulators[thread];
+        accumulator = Accumulator(new cv::Mat(cv::Mat::zeros(patches, 2, CV_64FC1)));
+        return *accumulator;
+    }
+
+    void reduce()
+    {
+        QWriteLocker locker(&accumulatorsLock);
+        if (accumulators.isEmpty()) return;
+        foreach (const Accumulator &accumulator, accumulators) {
+            totals += *accumulator;
+            accumulator->setTo(0);
+        }
+
+        for (int i=0; i<patches; i++) {
+            const double count = totals.at<double>(i, 1);
+            if (count > 0) data.at<float>(i, 0) = totals.at<double>(i, 0) / count;
+        }
+    }
+
+    void set(float value, int i, int j)
+    {
+        (void) j;
+        if (value == -std::numeric_limits<float>::max()) return;
+        double *patch = accumulator().ptr<double>(i);
+        patch[0] += value;
+        patch[1]++;
+    }
+
+    void setTile(const cv::Mat &scores, int i, int j)
+    {
+        (void) j;
+        cv::Mat &sums = accumulator();
+        for (int k=0; k<scores.rows; k++) {
+            double *patch = sums.ptr<double>(i+k);
+            const float *row = scores.ptr<float>(k);
+            for (int l=0; l<scores.cols; l++) {
+                if (row[l] == -std::numeric_limits<float>::max()) continue;
+                patch[0] += row[l];
+                patch[1]++;
+            }
+        }
     }
 };
 
@@ -126,42 +473,56 @@ BR_REGISTER(Output, heatOutput)
  * \brief One score per row.
  * \author Josh Klontz \cite jklontz
  */
-class meltOutput : public MatrixOutput
+class meltOutput : public TextOutput
 {
     Q_OBJECT
 
+    QList<QByteArray> queryNames, targetNames;
+    QList<QString> queryLabels, targetLabels;
+    bool genuineOnly, impostorOnly;
+    QByteArray keys, values;
+
     ~meltOutput()
     {
-        if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
-        const bool genuineOnly = file.contains("Genuine") && !file.contains("Impostor");
-        const bool impostorOnly = file.contains("Impostor") && !file.contains("Genuine");
+        finish();
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        genuineOnly = file.contains("Genuine") && !file.contains("Impostor");
+        impostorOnly = file.contains("Impostor") && !file.contains("Genuine");
 
         QMap<QString,QVariant> args = file.localMetadata();
         args.remove("Genuine");
         args.remove("Impostor");
+        foreach (const QString &key, args.keys()) keys += "," + key.toLocal8Bit();
+        foreach (const QVariant &value, args.values()) values += "," + value.toString().toLocal8Bit();
+
+        foreach (const File &query, queryFiles) queryNames.append(query.name.toLocal8Bit());
+        foreach (const File &target, targetFiles) targetNames.append(target.name.toLocal8Bit());
+        queryLabels = File::get<QString>(queryFiles, "Label");
+        targetLabels = File::get<QString>(targetFiles, "Label");
+        TextOutput::initialize(targetFiles, queryFiles);
+    }
 
-        QString keys; foreach (const QString &key, args.keys()) keys += "," + key;
-        QString values; foreach (const QVariant &value, args.values()) values += "," + value.toString();
-
-        QStringList lines;
-        if (file.baseName() != "terminal") lines.append(QString("Query,Target,Mask,Similarity%1").arg(keys));
-
-        QList<QString> queryLabels = File::get<QString>(queryFiles, "Label");
-        QList<QString> targetLabels = File::get<QString>(targetFiles, "Label");
+    QByteArray header() const
+    {
+        return file.baseName() != "terminal" ? "Query,Target,Mask,Similarity" + keys : QByteArray();
+    }
 
-        for (int i=0; i<queryFiles.size(); i++) {
-            for (int j=(selfSimilar ? i+1 : 0); j<targetFiles.size(); j++) {
-                const bool genuine = queryLabels[i] == targetLabels[j];
-                if ((genuineOnly && !genuine) || (impostorOnly && genuine)) continue;
-                lines.append(QString("%1,%2,%3,%4%5").arg(queryFiles[i],
-                                                          targetFiles[j],
-                                                          QString::number(genuine),
-                                                          QString::number(data.at<float>(i,j)),
-                                                          values));
-            }
+    void formatRow(int row, const float *scores, QByteArray &lines) const
+    {
+        for (int j=(selfSimilar ? row+1 : 0); j<targetFiles.size(); j++) {
+            const bool genuine = queryLabels[row] == targetLabels[j];
+            if ((genuineOnly && !genuine) || (impostorOnly && genuine)) continue;
+            if (!lines.isEmpty()) lines.append('\n');
+            lines.append(queryNames[row]);
+            lines.append(',');
+            lines.append(targetNames[j]);
+            lines.append(genuine ? ",1," : ",0,");
+            appendScore(lines, scores[j]);
+            lines.append(values);
         }
-
-        QtUtils::writeFile(file, lines);
     }
 };
 
@@ -177,19 +538,22 @@ class mtxOutput : public Output
     Q_OBJECT
     int headerSize, rowBlock, columnBlock;
     cv::Mat blockScores;
+    QFile matrix; // Kept open and written one block at a time
 
     ~mtxOutput()
     {
         writeBlock();
+        matrix.close();
     }
 
     void setBlock(int rowBlock, int columnBlock)
     {
         if ((rowBlock == 0) && (columnBlock == 0)) {
             // Initialize the file
-            QFile f(file);
-            QtUtils::touchDir(f);
-            if (!f.open(QFile::WriteOnly))
+            matrix.close();
+            matrix.setFileName(file);
+            QtUtils::touchDir(matrix);
+            if (!matrix.open(QFile::ReadWrite | QFile::Truncate))
                 qFatal("Unable to open %s for writing.", qPrintable(file));
             const int endian = 0x12345678;
             QByteArray header;
@@ -204,19 +568,22 @@ class mtxOutput : public Output
             header.append(" ");
             header.append(QByteArray((const char*)&endian, 4));
             header.append("\n");
-            headerSize = f.write(header);
-            const float defaultValue = -std::numeric_limits<float>::max();
-            for (int i=0; i<targetFiles.size()*queryFiles.size(); i++)
-                f.write((const char*)&defaultValue, 4);
-            f.close();
+            headerSize = matrix.write(header);
+
+            // Comparisons not yet written read as the lowest score, a row at a time
+            const QVector<float> defaultRow(targetFiles.size(), -std::numeric_limits<float>::max());
+            for (int i=0; i<queryFiles.size(); i++)
+                if (matrix.write((const char*)defaultRow.data(), sizeof(float)*defaultRow.size()) != qint64(sizeof(float)*defaultRow.size()))
+                    qFatal("Failed to allocate %s.", qPrintable(file));
+            matrix.flush();
         } else {
             writeBlock();
         }
 
         this->rowBlock = rowBlock;
         this->columnBlock = columnBlock;
-        blockScores = cv::Mat(std::min(queryFiles.size()-rowBlock*Globals->blockSize, Globals->blockSize),
-                              std::min(targetFiles.size()-columnBlock*Globals->blockSize, Globals->blockSize),
+        blockScores = cv::Mat(std::min(queryFiles.size()-rowBlock*blockSize, blockSize),
+                              std::min(targetFiles.size()-columnBlock*blockSize, blockSize),
                               CV_32FC1);
     }
 
@@ -225,22 +592,32 @@ class mtxOutput : public Output
         blockScores.at<float>(i,j) = value;
     }
 
+    void setRelativeTile(const cv::Mat &scores, int i, int j)
+    {
+        scores.copyTo(blockScores(cv::Rect(j, i, scores.cols, scores.rows)));
+    }
+
     void set(float value, int i, int j)
     {
         (void) value; (void) i; (void) j;
         qFatal("Logic error.");
     }
 
+    // Map only the rows this block covers, so the matrix is never held in memory
     void writeBlock()
     {
-        QFile f(file);
-        if (!f.open(QFile::ReadWrite))
-            qFatal("Unable to open %s for modifying.", qPrintable(file));
-        for (int i=0; i<blockScores.rows; i++) {
-            f.seek(headerSize + sizeof(float)*(quint64(rowBlock*Globals->blockSize+i)*targetFiles.size()+(columnBlock*Globals->blockSize)));
-            f.write((const char*)blockScores.row(i).data, sizeof(float)*blockScores.cols);
-        }
-        f.close();
+        if (blockScores.empty() || !matrix.isOpen())
+            return;
+
+        const qint64 rowBytes = sizeof(float)*qint64(targetFiles.size());
+        const qint64 offset = headerSize + rowBytes*(qint64(rowBlock)*blockSize);
+        uchar *rows = matrix.map(offset, rowBytes*blockScores.rows);
+        if (rows == NULL)
+            qFatal("Unable to map %s for modifying.", qPrintable(file));
+        for (int i=0; i<blockScores.rows; i++)
+            memcpy(rows + rowBytes*i + sizeof(float)*qint64(columnBlock)*blockSize, blockScores.ptr(i), sizeof(float)*blockScores.cols);
+        matrix.unmap(rows);
+        blockScores.release();
     }
 };
 
@@ -271,7 +648,7 @@ class rrOutput : public MatrixOutput
             if (simple) files.append(queryFiles[i]);
 
             typedef QPair<float,int> Pair;
-            foreach (const Pair &pair, Common::Sort(OpenCVUtils::matrixToVector<float>(data.row(i)), true, limit)) {
+            foreach (const Pair &pair, Common::TopK(OpenCVUtils::matrixToVector<float>(data.row(i)), limit, true)) {
                 if (Globals->crossValidate > 0 ? (targetFiles[pair.second].get<int>("Partition",-1) == -1 || targetFiles[pair.second].get<int>("Partition",-1) == queryFiles[i].get<int>("Partition",-1)) : true) {
                     if (pair.first < threshold) break;
                     File target = targetFiles[pair.second];
@@ -357,35 +734,67 @@ BR_REGISTER(Output, EmptyOutput)
 
 /*!
  * \ingroup outputs
- * \brief Evaluate the output matrix.
+ * \brief Evaluate the scores as they are computed.
+ *
+ * Each tile of scores is masked and accumulated in a br::ScoreHistogram, one per cross validation partition,
+ * so the similarity matrix is never stored.
+ * Labels, file names and partitions are indexed once in initialize() by BEE::indexMask to keep string comparisons out of the compare loop.
  * \author Josh Klontz \cite jklontz
  */
-class evalOutput : public MatrixOutput
+class evalOutput : public Output
 {
     Q_OBJECT
     Q_PROPERTY(bool crossValidate READ get_crossValidate WRITE set_crossValidate RESET reset_crossValidate STORED false)
     BR_PROPERTY(bool, crossValidate, true)
 
+    BEE::MaskIndex targetIndex, queryIndex;
+    QList< QSharedPointer<ScoreHistogram> > histograms; // One per partition
+
     ~evalOutput()
     {
-        if (data.data) {
-            const QString csv = QString(file.name).replace(".eval", ".csv");
-            if ((Globals->crossValidate == 0) || (!crossValidate)) {
-                Evaluate(data,targetFiles, queryFiles, csv);
-            } else {
-                QFutureSynchronizer<float> futures;
-                for (int i=0; i<Globals->crossValidate; i++)
-                    futures.addFuture(QtConcurrent::run(Evaluate, data, targetFiles, queryFiles, csv.arg(QString::number(i)), i));
-                futures.waitForFinished();
-
-                QList<float> TARs;
-                foreach (const QFuture<float> &future, futures.futures())
-                    TARs.append(future.result());
-
-                double mean, stddev;
-                Common::MeanStdDev(TARs, &mean, &stddev);
-                qDebug("TAR @ FAR = 0.01: %.3f +/- %.3f", mean, stddev);
-            }
+        if (histograms.isEmpty()) return;
+        const QString csv = QString(file.name).replace(".eval", ".csv");
+        if (histograms.size() == 1) {
+            histograms.first()->evaluate(targetFiles.size(), csv);
+        } else {
+            QFutureSynchronizer<float> futures;
+            for (int i=0; i<histograms.size(); i++)
+                futures.addFuture(QtConcurrent::run(histograms[i].data(), &ScoreHistogram::evaluate, targetFiles.size(), csv.arg(QString::number(i))));
+            futures.waitForFinished();
+
+            QList<float> TARs;
+            foreach (const QFuture<float> &future, futures.futures())
+                TARs.append(future.result());
+
+            double mean, stddev;
+            Common::MeanStdDev(TARs, &mean, &stddev);
+            qDebug("TAR @ FAR = 0.01: %.3f +/- %.3f", mean, stddev);
+        }
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        Output::initialize(targetFiles, queryFiles);
+
+        BEE::indexMask(targetFiles, queryFiles, &targetIndex, &queryIndex);
+
+        const int partitions = ((Globals->crossValidate == 0) || !crossValidate) ? 1 : Globals->crossValidate;
+        histograms.clear();
+        for (int i=0; i<partitions; i++)
+            histograms.append(QSharedPointer<ScoreHistogram>(new ScoreHistogram(queryFiles.size())));
+    }
+
+    void set(float value, int i, int j)
+    {
+        setTile(cv::Mat(1, 1, CV_32FC1, cv::Scalar(value)), i, j);
+    }
+
+    void setTile(const cv::Mat &scores, int i, int j)
+    {
+        cv::Mat mask(scores.rows, scores.cols, CV_8UC1);
+        for (int partition=0; partition<histograms.size(); partition++) {
+            BEE::fillMask(targetIndex, queryIndex, partition, mask, i, j);
+            histograms[partition]->add(scores, mask, i);
         }
     }
 };
@@ -428,21 +837,33 @@ class rankOutput : public MatrixOutput
         QStringList lines;
 
         for (int i=0; i<queryFiles.size(); i++) {
+            // The rank is one more than the number of impostors sorting ahead of the best genuine match,
+            // so it is counted in two linear passes rather than by sorting the row
             typedef QPair<float,int> Pair;
-            int rank = 1;
-            foreach (const Pair &pair, Common::Sort(OpenCVUtils::matrixToVector<float>(data.row(i)), true)) {
-                if (Globals->crossValidate > 0 ? (targetFiles[pair.second].get<int>("Partition",-1) == -1 || targetFiles[pair.second].get<int>("Partition",-1) == queryFiles[i].get<int>("Partition",-1)) : true) {
-                    if (QString(targetFiles[pair.second]) != QString(queryFiles[i])) {
-                        if (targetFiles[pair.second].get<QString>("Label") == queryFiles[i].get<QString>("Label")) {
-                            ranks.append(rank);
-                            positions.append(pair.second);
-                            scores.append(pair.first);
-                            break;
+            const QList<float> row = OpenCVUtils::matrixToVector<float>(data.row(i));
+            QList<int> candidates;
+            Pair best(0, -1);
+            for (int j=0; j<row.size(); j++) {
+                if (Globals->crossValidate > 0 ? (targetFiles[j].get<int>("Partition",-1) == -1 || targetFiles[j].get<int>("Partition",-1) == queryFiles[i].get<int>("Partition",-1)) : true) {
+                    if (QString(targetFiles[j]) != QString(queryFiles[i])) {
+                        if (targetFiles[j].get<QString>("Label") == queryFiles[i].get<QString>("Label")) {
+                            if ((best.second == -1) || (Pair(row[j], j) > best))
+                                best = Pair(row[j], j);
+                        } else {
+                            candidates.append(j);
                         }
-                        rank++;
                     }
                 }
             }
+            if (best.second == -1) continue;
+
+            int rank = 1;
+            foreach (int j, candidates)
+                if (Pair(row[j], j) > best)
+                    rank++;
+            ranks.append(rank);
+            positions.append(best.second);
+            scores.append(best.first);
         }
 
         typedef QPair<int,int> RankPair;
@@ -595,6 +1016,119 @@ class bestOutput : public Output
 
 BR_REGISTER(Output, bestOutput)
 
+/*!
+ * \ingroup outputs
+ * \brief The \em k highest scoring targets for each query, without storing the similarity matrix.
+ *
+ * Keeps a bounded heap per query, so memory is proportional to <tt>queries*k</tt>.
+ * Candidates scoring below \em threshold are discarded.
+ * Each query is written as soon as its row block has been compared against every target, in whichever order blocks arrive.
+ * \author Josh Klontz \cite jklontz
+ */
+class topkOutput : public Output
+{
+    Q_OBJECT
+
+    typedef QPair<float,int> Candidate; // (score, target index)
+    typedef std::greater<Candidate> MinHeap;
+
+    static const int Stripes = 64;
+    int k, written, currentRowBlock;
+    float threshold;
+    QVector< QVector<Candidate> > heaps;
+    QVector<int> completedColumnBlocks; // Per row block
+    QMutex locks[Stripes];
+
+    ~topkOutput()
+    {
+        write(queryFiles.size());
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        Output::initialize(targetFiles, queryFiles);
+        k = file.get<int>("k", 1);
+        threshold = file.get<float>("threshold", -std::numeric_limits<float>::max());
+        written = 0;
+        currentRowBlock = -1;
+        heaps = QVector< QVector<Candidate> >(queryFiles.size());
+        completedColumnBlocks = QVector<int>(int((qint64(queryFiles.size()) + blockSize - 1) / blockSize), 0);
+
+        QFile f(file);
+        QtUtils::touchDir(f);
+        if (!f.open(QFile::WriteOnly))
+            qFatal("Unable to open %s for writing.", qPrintable(file));
+        f.write("Value,Target,Query\n");
+        f.close();
+    }
+
+    void setBlock(int rowBlock, int columnBlock)
+    {
+        // The previous block is complete, write the leading row blocks compared against every target
+        if ((currentRowBlock >= 0) && (currentRowBlock < completedColumnBlocks.size())) {
+            completedColumnBlocks[currentRowBlock]++;
+            const int columnBlocks = int((qint64(targetFiles.size()) + blockSize - 1) / blockSize);
+            int completedRowBlocks = written / blockSize;
+            while ((completedRowBlocks < completedColumnBlocks.size()) && (completedColumnBlocks[completedRowBlocks] >= columnBlocks))
+                completedRowBlocks++;
+            write(int(std::min(qint64(queryFiles.size()), qint64(completedRowBlocks)*blockSize)));
+        }
+        currentRowBlock = rowBlock;
+        Output::setBlock(rowBlock, columnBlock);
+    }
+
+    void merge(const QVector<Candidate> &candidates, int i)
+    {
+        if (candidates.isEmpty()) return;
+        QMutexLocker locker(&locks[i % Stripes]);
+        foreach (const Candidate &candidate, candidates)
+            Common::PushTopK(heaps[i], candidate, k);
+    }
+
+    void set(float value, int i, int j)
+    {
+        if ((selfSimilar && (i == j)) || (value < threshold)) return;
+        merge(QVector<Candidate>() << Candidate(value, j), i);
+    }
+
+    void setTile(const cv::Mat &scores, int i, int j)
+    {
+        // Select the best candidates of each row locally before merging them under lock
+        QVector<Candidate> candidates; candidates.reserve(k);
+        for (int r=0; r<scores.rows; r++) {
+            candidates.clear();
+            const float *row = scores.ptr<float>(r);
+            for (int c=0; c<scores.cols; c++)
+                if ((row[c] >= threshold) && !(selfSimilar && (i+r == j+c)))
+                    Common::PushTopK(candidates, Candidate(row[c], j+c), k);
+            merge(candidates, i+r);
+        }
+    }
+
+    void write(int end)
+    {
+        if (end <= written) return;
+
+        QStringList lines;
+        for (int i=written; i<end; i++) {
+            QVector<Candidate> &heap = heaps[i];
+            std::sort_heap(heap.begin(), heap.end(), MinHeap());
+            foreach (const Candidate &candidate, heap)
+                lines.append(QString::number(candidate.first) + "," + targetFiles[candidate.second] + "," + queryFiles[i]);
+            heap = QVector<Candidate>();
+        }
+        written = end;
+
+        QFile f(file);
+        if (!f.open(QFile::Append))
+            qFatal("Unable to open %s for appending.", qPrintable(file));
+        if (!lines.isEmpty()) f.write(qPrintable(lines.join("\n") + "\n"));
+        f.close();
+    }
+};
+
+BR_REGISTER(Output, topkOutput)
+
 /*!
  * \ingroup outputs
  * \brief Score histogram.
@@ -14,12 +14,26 @@ foreach(DIR ${BR_THIRDPARTY_PLUGINS_DIR})
   set(BR_THIRDPARTY_PLUGINS ${BR_THIRDPARTY_PLUGINS} ${PLUGINS})
 endforeach()
 
+# Embedded deployments can build only the plugins their algorithm needs,
+# either a list of plugin file names or a preset named after the algorithm
+set(BR_EMBEDDED_PLUGINS "" CACHE STRING "Plugins to build, all of them if empty, or a preset: FaceRecognition")
+mark_as_advanced(BR_EMBEDDED_PLUGINS)
+if("${BR_EMBEDDED_PLUGINS}" STREQUAL "FaceRecognition")
+  set(BR_PLUGIN_SUBSET algorithms distance format gallery independent meta misc output process stream # Framework
+                       cascade cvt eigen3 eyes filter keypoint lbp mask normalize quality quantize random regions register)
+else()
+  set(BR_PLUGIN_SUBSET ${BR_EMBEDDED_PLUGINS})
+endif()
+
 file(GLOB PLUGINS plugins/*.cpp plugins/*.h)
 foreach(PLUGIN ${PLUGINS} ${BR_THIRDPARTY_PLUGINS})
   get_filename_component(PLUGIN_BASENAME ${PLUGIN} NAME_WE)
   get_filename_component(PLUGIN_PATH ${PLUGIN} PATH)
   set(PLUGIN_CMAKE "${PLUGIN_PATH}/${PLUGIN_BASENAME}.cmake")
-  if(EXISTS ${PLUGIN_CMAKE})
+  list(FIND BR_PLUGIN_SUBSET ${PLUGIN_BASENAME} PLUGIN_INDEX)
+  if(BR_PLUGIN_SUBSET AND (PLUGIN_INDEX EQUAL -1) AND NOT (PLUGIN_BASENAME STREQUAL "openbr_internal"))
+    # Not needed by the embedded algorithm
+  elseif(EXISTS ${PLUGIN_CMAKE})
     include(${PLUGIN_CMAKE})
   else()
     set(BR_THIRDPARTY_SRC ${BR_THIRDPARTY_SRC} ${PLUGIN})
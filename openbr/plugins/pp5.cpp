@@ -1,12 +1,16 @@
 #include <QDebug>
 #include <QFileInfo>
+#include <QFutureSynchronizer>
 #include <QMap>
 #include <QMutex>
+#include <QScopedPointer>
 #include <QSharedPointer>
 #include <QString>
 #include <QStringList>
 #include <QThreadPool>
 #include <QVariant>
+#include <QVector>
+#include <QtConcurrentRun>
 #include <pittpatt_errors.h>
 #include <pittpatt_raw_image_io.h>
 #include <pittpatt_sdk.h>
@@ -44,13 +48,18 @@ class PP5Initializer : public Initializer
 
     void initialize() const
     {
-        TRY(ppr_initialize_sdk(qPrintable(Globals->sdkPath + "/share/openbr/models/pp5/"), my_license_id, my_license_key))
         Globals->abbreviations.insert("PP5","Open+Expand+PP5Enroll:PP5Compare");
         Globals->abbreviations.insert("PP5Register", "Open+PP5Enroll(true)+RenameFirst([eyeL,PP5_Landmark0_Right_Eye],Affine_0)+RenameFirst([eyeR,PP5_Landmark1_Left_Eye],Affine_1)");
         Globals->abbreviations.insert("PP5CropFace", "Open+PP5Enroll(true)+RenameFirst([eyeL,PP5_Landmark0_Right_Eye],Affine_0)+RenameFirst([eyeR,PP5_Landmark1_Left_Eye],Affine_1)+Affine(128,128,0.25,0.35)+Cvt(Gray)");
     }
 
-    void finalize() const
+    // The SDK is only initialized once a PP5Context is needed
+    void prepare() const
+    {
+        TRY(ppr_initialize_sdk(qPrintable(Globals->sdkPath + "/share/openbr/models/pp5/"), my_license_id, my_license_key))
+    }
+
+    void release() const
     {
         ppr_finalize_sdk();
     }
@@ -69,6 +78,7 @@ struct PP5Context
 
     PP5Context()
     {
+        Initializer::require("PP5");
         ppr_settings_type default_settings = ppr_get_default_settings();
 
         default_settings.detection.adaptive_max_size = 1.f;
@@ -238,6 +248,25 @@ class PP5EnrollTransform : public UntrainableMetaTransform
         if (srcList.empty())
             return;
 
+        // Contiguous chunks are enrolled concurrently, each on a context of its own
+        const int chunks = std::max(1, std::min(Globals->parallelism, srcList.size()));
+        QVector<TemplateList> chunkDsts(chunks);
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<chunks; i++) {
+            const int begin = int(qint64(srcList.size()) * i / chunks), end = int(qint64(srcList.size()) * (i+1) / chunks);
+            const TemplateList chunk = srcList.mid(begin, end-begin);
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &PP5EnrollTransform::projectChunk, chunk, &chunkDsts[i]));
+            else                                                                                    projectChunk (chunk, &chunkDsts[i]);
+        }
+        futures.waitForFinished();
+
+        foreach (const TemplateList &chunkDst, chunkDsts)
+            dstList.append(chunkDst);
+    }
+
+    void projectChunk(const TemplateList &srcList, TemplateList *dsts) const
+    {
+        TemplateList &dstList = *dsts;
         PP5Context *context = contexts.acquire();
 
         foreach (const Template &src, srcList) {
@@ -312,12 +341,12 @@ class PP5CompareDistance : public Distance
         targetList.append(target);
         TemplateList queryList;
         queryList.append(query);
-        MatrixOutput *score = MatrixOutput::make(targetList.files(), queryList.files());
-        compare(targetList, queryList, score);
+        QScopedPointer<MatrixOutput> score(MatrixOutput::make(targetList.files(), queryList.files()));
+        compare(targetList, queryList, score.data());
         return score->data.at<float>(0);
-
     }
 
+    // Whole blocks are compared as two SDK galleries, which PP5 compares on its own comparison threads
     void compare(const TemplateList &target, const TemplateList &query, Output *output) const
     {
         ppr_gallery_type target_gallery, query_gallery;
@@ -330,17 +359,20 @@ class PP5CompareDistance : public Distance
         ppr_similarity_matrix_type similarity_matrix;
         TRY(ppr_compare_galleries(context, query_gallery, target_gallery, &similarity_matrix))
 
+        cv::Mat scores(query_face_ids.size(), target_face_ids.size(), CV_32FC1);
         for (int i=0; i<query_face_ids.size(); i++) {
             int query_face_id = query_face_ids[i];
+            float *row = scores.ptr<float>(i);
             for (int j=0; j<target_face_ids.size(); j++) {
                 int target_face_id = target_face_ids[j];
                 float score = -std::numeric_limits<float>::max();
                 if ((query_face_id != -1) && (target_face_id != -1)) {
                     TRY(ppr_get_face_similarity_score(context, similarity_matrix, query_face_id, target_face_id, &score))
                 }
-                output->setRelative(score, i, j);
+                row[j] = score;
             }
         }
+        if (!scores.empty()) output->setRelativeTile(scores, 0, 0);
 
         ppr_free_similarity_matrix(similarity_matrix);
         ppr_free_gallery(target_gallery);
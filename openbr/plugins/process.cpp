@@ -2,11 +2,14 @@
 
 #include <QBuffer>
 #include <QCoreApplication>
+#include <QFutureSynchronizer>
 #include <QLocalServer>
 #include <QLocalSocket>
 #include <QMutex>
 #include <QProcess>
+#include <QSharedMemory>
 #include <QUuid>
+#include <QtConcurrentRun>
 #include <QWaitCondition>
 
 #include "openbr_internal.h"
@@ -17,6 +20,117 @@ using namespace cv;
 namespace br
 {
 
+/*!
+ * \brief Carries matrix payloads between processes through a shared memory segment.
+ *
+ * The sending side owns the segment and copies each matrix into it once, only the headers and offsets
+ * travel over the socket. The receiver attaches to the segment named in the message and reads in place.
+ */
+class SharedMemoryChannel
+{
+    static const int Alignment = 16;
+    static qint64 minimumSize() { return 1 << 22; }
+
+    QSharedMemory *segment;
+    QString baseKey;
+    int generation;
+    qint64 head;
+
+    static qint64 align(qint64 bytes)
+    {
+        return (bytes + Alignment - 1) / Alignment * Alignment;
+    }
+
+    void create(qint64 bytes)
+    {
+        delete segment;
+        segment = new QSharedMemory(baseKey + "_" + QString::number(generation++));
+        if (!segment->create(qMax(2*bytes, minimumSize())))
+            qFatal("Failed to create shared memory segment %s: %s", qPrintable(segment->key()), qPrintable(segment->errorString()));
+        head = 0;
+    }
+
+    void attach(const QString &key)
+    {
+        delete segment;
+        segment = new QSharedMemory(key);
+        if (!segment->attach())
+            qFatal("Failed to attach shared memory segment %s: %s", qPrintable(key), qPrintable(segment->errorString()));
+    }
+
+public:
+    SharedMemoryChannel() : segment(NULL), generation(0), head(0) {}
+    ~SharedMemoryChannel() { delete segment; }
+
+    void setKey(const QString &key)
+    {
+        baseKey = key;
+    }
+
+    // Copy the matrices of src into the segment and describe them in the returned message
+    QByteArray write(const TemplateList &src)
+    {
+        qint64 bytes = 0;
+        foreach (const Template &t, src)
+            foreach (const Mat &m, t) {
+                if (m.dims > 2) qFatal("Can't share matrices with more than two dimensions.");
+                bytes += align(m.total()*m.elemSize());
+            }
+
+        // Grow by replacing the segment, the receiver follows the key in the message
+        if ((segment == NULL) || (bytes > segment->size())) create(bytes);
+        // Requests and replies alternate, so once a message is sent the previous one has been consumed
+        if (head + bytes > segment->size()) head = 0;
+
+        QByteArray message;
+        QDataStream stream(&message, QIODevice::WriteOnly);
+        stream << segment->key() << src.size();
+        uchar *base = (uchar*) segment->data();
+        foreach (const Template &t, src) {
+            stream << t.file << t.size();
+            foreach (const Mat &m, t) {
+                stream << m.rows << m.cols << m.type() << head;
+                if (m.empty()) continue;
+                Mat shared(m.rows, m.cols, m.type(), base + head);
+                m.copyTo(shared);
+                head += align(m.total()*m.elemSize());
+            }
+        }
+        return message;
+    }
+
+    // Rebuild the templates described by message, the matrices reference the segment unless copy is set
+    TemplateList read(const QByteArray &message, bool copy)
+    {
+        QDataStream stream(message);
+        QString key;
+        int count;
+        stream >> key >> count;
+        if ((segment == NULL) || (segment->key() != key)) attach(key);
+
+        uchar *base = (uchar*) segment->data();
+        TemplateList dst;
+        for (int i=0; i<count; i++) {
+            Template t;
+            int size;
+            stream >> t.file >> size;
+            for (int j=0; j<size; j++) {
+                int rows, cols, type;
+                qint64 offset;
+                stream >> rows >> cols >> type >> offset;
+                if (rows*cols == 0) {
+                    t.append(Mat(rows, cols, type));
+                    continue;
+                }
+                Mat shared(rows, cols, type, base + offset);
+                t.append(copy ? shared.clone() : shared);
+            }
+            dst.append(t);
+        }
+        return dst;
+    }
+};
+
 class CommunicationManager : public QObject
 {
     Q_OBJECT
@@ -52,6 +166,7 @@ public:
         connect(&outbound, SIGNAL(stateChanged(QLocalSocket::LocalSocketState)), this, SLOT(outboundStateChanged(QLocalSocket::LocalSocketState) ) );
 
         inbound = NULL;
+        failed = false;
         basis->start();
     }
 
@@ -146,12 +261,17 @@ public slots:
     {
         SignalType signal=  sendType;
         qint64 signal_wrote = outbound.write((char *) &signal, sizeof(signal));
-        if (signal_wrote != sizeof(signal))
+        if (signal_wrote != sizeof(signal)) {
             qDebug() << key << " inconsistent signal size";
+            failed = true;
+            return;
+        }
 
         bool res = outbound.waitForBytesWritten(-1);
-        if (!res)
+        if (!res) {
             qDebug() << key << " failed to wait for bytes written in signal size";
+            failed = true;
+        }
     }
 
     void readSignalInternal()
@@ -161,6 +281,8 @@ public slots:
             if (!size_ready)
             {
                 qDebug("Failed to received object size in signal!");
+                failed = true;
+                return;
             }
         }
 
@@ -182,23 +304,29 @@ public slots:
         qint64 size_wrote = outbound.write((char *) &serializedSize, sizeof(serializedSize));
         if (size_wrote != sizeof(serializedSize)) {
             qDebug() << key << "inconsistent size sent in send data!";
+            failed = true;
             return;
         }
         bool res = outbound.waitForBytesWritten(-1);
         
         if (!res) {
             qDebug() << key << " wait for bytes failed!";
+            failed = true;
             return;
         }
 
         qint64 data_wrote = outbound.write(writeArray.data(), serializedSize);
-        if (data_wrote != serializedSize)
+        if (data_wrote != serializedSize) {
             qDebug() << key << " inconsistent data written!";
+            failed = true;
+            return;
+        }
 
         while (outbound.bytesToWrite() > 0) {
             bool write_res = outbound.waitForBytesWritten(-1);
             if (!write_res) {
                 qDebug() << key << " wait for bytes failed!";
+                failed = true;
                 return;
             }
         }
@@ -216,12 +344,14 @@ public slots:
             {
                 qDebug() << key << " Failed to received object size in read data!";
                 qDebug() << key << "inbound status: " << inbound->state() << " error: " << inbound->errorString();
+                failed = true;
                 return;
             }
         }
         qint64 sizeBytesRead = inbound->read((char *) &bufferSize, sizeof(bufferSize));
         if (sizeBytesRead != sizeof(bufferSize)) {
             qDebug("failed to read size of buffer!");
+            failed = true;
             return;
         }
 
@@ -236,6 +366,7 @@ public slots:
 
                 if (!ready_res) {
                     qDebug() << key << "failed to wait for data!";
+                    failed = true;
                     return;
                 }
             }
@@ -257,7 +388,7 @@ public slots:
     void shutdownInternal()
     {
         outbound.abort();
-        inbound->abort();
+        if (inbound) inbound->abort();
         server.close();
     }
 
@@ -283,6 +414,9 @@ public:
     QByteArray readArray;
     QByteArray writeArray;
 
+    SharedMemoryChannel readChannel;
+    SharedMemoryChannel sendChannel;
+
     SignalType readSignal;
     QMutex receivedLock;
     QWaitCondition receivedWait;
@@ -296,6 +430,9 @@ public:
 
     QLocalSocket * inbound;
     QLocalSocket outbound;
+
+    // Set once the other process stops responding
+    bool failed;
     QLocalServer server;
 
 
@@ -351,14 +488,31 @@ public:
         return true;
     }
 
+    // Only the matrix headers go over the socket, the data is exchanged through shared memory
+    bool readTemplates(TemplateList &input, bool copy)
+    {
+        emit pulseReadSerialized();
+        if (failed) return false;
+        input = readChannel.read(readArray, copy);
+        return true;
+    }
+
+    bool sendTemplates(const TemplateList &output)
+    {
+        writeArray = sendChannel.write(output);
+        emit pulseSendSerialized();
+        return !failed;
+    }
+
     SignalType sendType;
-    void sendSignal(SignalType signal)
+    bool sendSignal(SignalType signal)
     {
         sendType = signal;
         if (QThread::currentThread() == this->thread() )
             this->sendSignalInternal();
         else
             emit pulseSignal();
+        return !failed;
     }
 
     void startServer(QString server)
@@ -397,6 +551,7 @@ public:
         comm = new CommunicationManager();
         name = baseName;
         comm->key = "worker_"+baseName.mid(1,5);
+        comm->sendChannel.setKey(baseName+"_worker");
         comm->startServer(baseName+"_worker");
         comm->connectToRemote(baseName+"_master");
 
@@ -417,9 +572,10 @@ public:
             TemplateList inList;
             TemplateList outList;
 
-            comm->readData(inList);
+            // The input is only valid until the reply is sent and the master writes the next batch
+            comm->readTemplates(inList, false);
             transform->projectUpdate(inList,outList);
-            comm->sendData(outList);
+            comm->sendTemplates(outList);
         }
         comm->shutdown();
     }
@@ -443,6 +599,7 @@ public:
         this->moveToThread(QCoreApplication::instance()->thread());
         workerProcess.moveToThread(QCoreApplication::instance()->thread());
         connect(this, SIGNAL(pulseEnd()), this, SLOT(endProcessInternal()), Qt::BlockingQueuedConnection);
+        connect(this, SIGNAL(pulseKill()), this, SLOT(killProcessInternal()), Qt::BlockingQueuedConnection);
         connect(this, SIGNAL(pulseStart(QStringList)), this, SLOT(startProcessInternal(QStringList)), Qt::BlockingQueuedConnection);
     }
     QProcess workerProcess;
@@ -453,6 +610,13 @@ public:
         else
             endProcessInternal();
     }
+    void killProcess()
+    {
+        if (QThread::currentThread() != QCoreApplication::instance()->thread())
+            emit pulseKill();
+        else
+            killProcessInternal();
+    }
     void startProcess(QStringList arguments)
     {
         if (QThread::currentThread() != QCoreApplication::instance()->thread() )
@@ -462,6 +626,7 @@ public:
     }
 signals:
     void pulseEnd();
+    void pulseKill();
     void pulseStart(QStringList);
 
 protected slots:
@@ -470,6 +635,12 @@ protected slots:
         workerProcess.waitForFinished(-1);
     }
 
+    void killProcessInternal()
+    {
+        workerProcess.kill();
+        workerProcess.waitForFinished(-1);
+    }
+
     void startProcessInternal(QStringList arguments)
     {
         workerProcess.setProcessChannelMode(QProcess::ForwardedChannels);
@@ -479,56 +650,20 @@ protected slots:
 };
 
 /*!
- * \ingroup transforms
- * \brief Interface to a separate process
- * \author Charles Otto \cite caotto
+ * \brief A worker process and the connection to it.
  */
-class ProcessWrapperTransform : public TimeVaryingTransform
+struct ProcessWorker
 {
-    Q_OBJECT
-
-    Q_PROPERTY(QString transform READ get_transform WRITE set_transform RESET reset_transform)
-    BR_PROPERTY(QString, transform, "")
-
-    QString baseKey;
-
     ProcessInterface workerProcess;
     CommunicationManager * comm;
 
-    void projectUpdate(const TemplateList &src, TemplateList &dst)
-    {
-
-        if (!processActive)
-        {
-            activateProcess();
-        }
-        comm->sendSignal(CommunicationManager::INPUT_AVAILABLE);
-
-        comm->sendData(src);
-
-        comm->readData(dst);
-    }
-
-
-    void train(const TemplateList& data)
-    {
-        (void) data;
-    }
-
-    // create the process
-    void init()
-    {
-        processActive = false;
-    }
-
-    void activateProcess()
+    ProcessWorker(const QString &transform)
     {
         comm = new CommunicationManager();
-        processActive = true;
 
         // generate a uuid for our local servers
         QUuid id = QUuid::createUuid();
-        baseKey = id.toString();
+        QString baseKey = id.toString();
 
         QStringList argumentList;
         argumentList.append("-useGui");
@@ -545,6 +680,7 @@ class ProcessWrapperTransform : public TimeVaryingTransform
         argumentList.append(baseKey);
 
         comm->key = "master_"+baseKey.mid(1,5);
+        comm->sendChannel.setKey(baseKey+"_master");
 
         comm->startServer(baseKey+"_master");
         workerProcess.startProcess(argumentList);
@@ -552,28 +688,141 @@ class ProcessWrapperTransform : public TimeVaryingTransform
         comm->connectToRemote(baseKey+"_worker");
     }
 
-    bool timeVarying() const {
-        return false;
+    ~ProcessWorker()
+    {
+        // end the process, or make sure a failed one is gone
+        if (!comm->failed) {
+            comm->sendSignal(CommunicationManager::SHOULD_END);
+            workerProcess.endProcess();
+        } else {
+            workerProcess.killProcess();
+        }
+        comm->shutdown();
+        comm->shutDownThread();
+        delete comm;
     }
 
-    ~ProcessWrapperTransform()
+    // Returns false if the worker failed before replying
+    bool project(const TemplateList &src, TemplateList &dst)
     {
-        // end the process
-        if (this->processActive) {
-            comm->sendSignal(CommunicationManager::SHOULD_END);
+        return comm->sendSignal(CommunicationManager::INPUT_AVAILABLE)
+               && comm->sendTemplates(src)
+               // Copy out of shared memory, the results outlive the next round trip
+               && comm->readTemplates(dst, true);
+    }
+};
 
-            workerProcess.endProcess();
-            processActive = false;
-            comm->shutdown();
-            comm->shutDownThread();
+/*!
+ * \ingroup transforms
+ * \brief Interface to a pool of separate processes
+ *
+ * Up to \c workers processes are started on demand, each running one batch at a time.
+ * Concurrent calls go to different processes and large batches are split across them.
+ * A process that fails with a batch in flight is replaced and the batch is sent again, up to \c retries times.
+ * \author Charles Otto \cite caotto
+ */
+class ProcessWrapperTransform : public TimeVaryingTransform
+{
+    Q_OBJECT
 
-            delete comm;
+    Q_PROPERTY(QString transform READ get_transform WRITE set_transform RESET reset_transform)
+    Q_PROPERTY(int workers READ get_workers WRITE set_workers RESET reset_workers STORED false)
+    Q_PROPERTY(int retries READ get_retries WRITE set_retries RESET reset_retries STORED false)
+    BR_PROPERTY(QString, transform, "")
+    BR_PROPERTY(int, workers, 1)
+    BR_PROPERTY(int, retries, 3)
+
+    QMutex poolLock;
+    QWaitCondition available;
+    QList<ProcessWorker*> idle;
+    int spawned;
+
+    void projectUpdate(const TemplateList &src, TemplateList &dst)
+    {
+        const int batches = qMin(qMax(workers, 1), src.size());
+        if (batches <= 1) {
+            projectBatch(src, &dst);
+            return;
+        }
+
+        QVector<TemplateList> inputs(batches), outputs(batches);
+        for (int i=0; i<src.size(); i++)
+            inputs[i*batches/src.size()].append(src[i]);
+
+        QFutureSynchronizer<void> futures;
+        for (int i=1; i<batches; i++)
+            futures.addFuture(QtConcurrent::run(this, &ProcessWrapperTransform::projectBatch, inputs[i], &outputs[i]));
+        projectBatch(inputs[0], &outputs[0]);
+        futures.waitForFinished();
+
+        foreach (const TemplateList &output, outputs)
+            dst.append(output);
+    }
+
+    void projectBatch(const TemplateList &src, TemplateList *dst)
+    {
+        for (int attempt=0; ; attempt++) {
+            ProcessWorker *worker = acquire();
+            TemplateList output;
+            if (worker->project(src, output)) {
+                release(worker);
+                dst->append(output);
+                return;
+            }
+
+            // The process died with this batch in flight, replace it and requeue the batch
+            discard(worker);
+            if (attempt >= retries)
+                qFatal("ProcessWrapper batch failed after %d attempts.", attempt+1);
+            qWarning("ProcessWrapper worker failed, restarting it (attempt %d of %d).", attempt+1, retries);
         }
     }
 
+    ProcessWorker *acquire()
+    {
+        QMutexLocker locker(&poolLock);
+        while (idle.isEmpty()) {
+            if (spawned < qMax(workers, 1)) {
+                spawned++;
+                locker.unlock();
+                return new ProcessWorker(transform);
+            }
+            available.wait(&poolLock);
+        }
+        return idle.takeLast();
+    }
+
+    void release(ProcessWorker *worker)
+    {
+        QMutexLocker locker(&poolLock);
+        idle.append(worker);
+        available.wakeOne();
+    }
+
+    void discard(ProcessWorker *worker)
+    {
+        delete worker;
+        QMutexLocker locker(&poolLock);
+        spawned--;
+        available.wakeOne();
+    }
+
+    void train(const TemplateList& data)
+    {
+        (void) data;
+    }
+
+    bool timeVarying() const {
+        return false;
+    }
+
+    ~ProcessWrapperTransform()
+    {
+        qDeleteAll(idle);
+    }
+
 public:
-    bool processActive;
-    ProcessWrapperTransform() : TimeVaryingTransform(false,false) { processActive = false; }
+    ProcessWrapperTransform() : TimeVaryingTransform(false,false), spawned(0) {}
 };
 
 BR_REGISTER(Transform, ProcessWrapperTransform)
@@ -1,8 +1,11 @@
 #include <QCoreApplication>
 #include <QNetworkAccessManager>
+#include <QNetworkDiskCache>
 #include <QNetworkReply>
 #include <QTcpServer>
 #include <QTcpSocket>
+#include <QThread>
+#include <QWaitCondition>
 #include <opencv2/highgui/highgui.hpp>
 #include <http_parser.h>
 #include "openbr_internal.h"
@@ -12,10 +15,187 @@ using namespace cv;
 namespace br
 {
 
+/*!
+ * \brief Downloads shared by every urlFormat, on one network thread.
+ *
+ * A single QNetworkAccessManager keeps HTTP connections alive between requests,
+ * at most \c downloads requests are in flight at once, and responses are optionally
+ * kept in an on-disk HTTP cache at \c cache.
+ * Downloads fetched ahead of their readers stop starting once \c downloads responses are waiting to be taken,
+ * so a reader that stops early leaves a bounded number behind, and those are freed at shutdown.
+ */
+class URLFetcher : public QObject
+{
+    Q_OBJECT
+
+    struct Download
+    {
+        QByteArray data;
+        int references, prefetched; // Readers still to take it, of which fetched ahead of time
+        bool finished;
+        Download() : references(0), prefetched(0), finished(false) {}
+    };
+
+    QThread thread;
+    QNetworkAccessManager *manager;
+    QMutex lock;
+    QWaitCondition downloaded;
+    QHash<QString, Download> downloads; // Queued, in flight, or waiting to be taken
+    QStringList queue;
+    int inFlight, maxInFlight;
+    int unclaimed; // Finished downloads only fetched ahead of time
+    bool cached;
+
+public:
+    static QScopedPointer<URLFetcher> fetcher;
+    static QMutex fetcherLock;
+
+    URLFetcher(int maxInFlight, const QString &cache)
+        : inFlight(0), maxInFlight(std::max(1, maxInFlight)), unclaimed(0), cached(!cache.isEmpty())
+    {
+        manager = new QNetworkAccessManager(this);
+        if (cached) {
+            QNetworkDiskCache *diskCache = new QNetworkDiskCache(manager);
+            diskCache->setCacheDirectory(cache);
+            manager->setCache(diskCache);
+        }
+        moveToThread(&thread);
+        thread.start();
+    }
+
+    ~URLFetcher()
+    {
+        thread.quit();
+        thread.wait();
+    }
+
+    // Configured by the first file to be read
+    static URLFetcher *instance(const File &file)
+    {
+        QMutexLocker locker(&fetcherLock);
+        if (fetcher.isNull())
+            fetcher.reset(new URLFetcher(file.get<int>("downloads", 16), file.get<QString>("cache", QString())));
+        return fetcher.data();
+    }
+
+    // Start downloading urls without waiting for them, each should later be taken once
+    void fetch(const QStringList &urls)
+    {
+        QMutexLocker locker(&lock);
+        foreach (const QString &url, urls) {
+            downloads[url].prefetched++;
+            reference(url);
+        }
+    }
+
+    // Wait for the response to url, downloading it if it wasn't fetched ahead of time
+    QByteArray take(const QString &url)
+    {
+        QMutexLocker locker(&lock);
+        if (downloads.contains(url) && (downloads[url].prefetched > 0)) {
+            Download &download = downloads[url];
+            const bool waiting = !claimed(download);
+            download.prefetched--;
+            // Either a queued prefetch jumps the queue or a finished one makes room for the next
+            if (waiting && (download.finished || queue.removeOne(url))) {
+                if (download.finished) unclaimed--;
+                else                   queue.prepend(url);
+                QMetaObject::invokeMethod(this, "startDownloads", Qt::QueuedConnection);
+            }
+        } else {
+            reference(url);
+        }
+
+        while (!downloads[url].finished)
+            downloaded.wait(&lock);
+
+        Download &download = downloads[url];
+        const QByteArray data = download.data;
+        if (--download.references == 0)
+            downloads.remove(url);
+        else if (!claimed(download))
+            unclaimed++;
+        return data;
+    }
+
+    // Frees the downloads nobody took
+    static void release()
+    {
+        QMutexLocker locker(&fetcherLock);
+        fetcher.reset();
+    }
+
+private:
+    // Call with lock held
+    static bool claimed(const Download &download)
+    {
+        return download.references > download.prefetched;
+    }
+
+    // Call with lock held
+    void reference(const QString &url)
+    {
+        if (downloads[url].references++ > 0)
+            return;
+        if (claimed(downloads[url])) queue.prepend(url);
+        else                         queue.append(url);
+        QMetaObject::invokeMethod(this, "startDownloads", Qt::QueuedConnection);
+    }
+
+private slots:
+    void startDownloads()
+    {
+        QMutexLocker locker(&lock);
+        while ((inFlight < maxInFlight) && !queue.isEmpty()) {
+            // Waited for downloads are at the front, the rest wait while too many are left untaken
+            if (!claimed(downloads[queue.first()]) && (unclaimed + inFlight >= maxInFlight))
+                break;
+            const QString url = queue.takeFirst();
+            QNetworkRequest request(url);
+            request.setAttribute(QNetworkRequest::User, url);
+            request.setAttribute(QNetworkRequest::CacheLoadControlAttribute, cached ? QNetworkRequest::PreferCache : QNetworkRequest::AlwaysNetwork);
+            QNetworkReply *reply = manager->get(request);
+            connect(reply, SIGNAL(finished()), this, SLOT(finishDownload()));
+            inFlight++;
+        }
+    }
+
+    void finishDownload()
+    {
+        QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+        if (reply->error()) qWarning("%s (%s)", qPrintable(reply->errorString()), qPrintable(QString::number(reply->error())));
+
+        {
+            QMutexLocker locker(&lock);
+            Download &download = downloads[reply->request().attribute(QNetworkRequest::User).toString()];
+            download.data = reply->readAll();
+            download.finished = true;
+            if (!claimed(download)) unclaimed++;
+            inFlight--;
+            downloaded.wakeAll();
+        }
+
+        reply->deleteLater();
+        startDownloads();
+    }
+};
+
+QScopedPointer<URLFetcher> URLFetcher::fetcher;
+QMutex URLFetcher::fetcherLock;
+
+static QString urlOf(const File &file)
+{
+    return QString(file.name).remove(".url");
+}
+
 /*!
  * \ingroup formats
  * \brief Reads image files from the web.
+ *
+ * Downloads share keep-alive connections, \c -downloads (default 16) limits the requests in flight
+ * and \c -cache names a directory for an on-disk HTTP cache.
  * \author Josh Klontz \cite jklontz
+ * \see DownloadTransform
  */
 class urlFormat : public Format
 {
@@ -25,16 +205,7 @@ class urlFormat : public Format
     {
         Template t;
 
-        QNetworkAccessManager networkAccessManager;
-        QNetworkRequest request(QString(file.name).remove(".url"));
-        request.setAttribute(QNetworkRequest::CacheLoadControlAttribute, QNetworkRequest::AlwaysNetwork);
-        QNetworkReply *reply = networkAccessManager.get(request);
-
-        while (!reply->isFinished()) QCoreApplication::processEvents();
-        if (reply->error()) qWarning("%s (%s)", qPrintable(reply->errorString()), qPrintable(QString::number(reply->error())));
-
-        QByteArray data = reply->readAll();
-        delete reply;
+        QByteArray data = URLFetcher::instance(file)->take(urlOf(file));
 
         Mat m = imdecode(Mat(1, data.size(), CV_8UC1, data.data()), 1);
         if (m.data) t.append(m);
@@ -51,6 +222,57 @@ class urlFormat : public Format
 
 BR_REGISTER(Format, urlFormat)
 
+/*!
+ * \ingroup initializers
+ * \brief Frees the downloads urlFormat fetched ahead of time and never read.
+ * \author Josh Klontz \cite jklontz
+ */
+class URLFetchers : public Initializer
+{
+    Q_OBJECT
+
+    void initialize() const {}
+
+    void finalize() const
+    {
+        URLFetcher::release();
+    }
+};
+
+BR_REGISTER(Initializer, URLFetchers)
+
+/*!
+ * \ingroup transforms
+ * \brief Starts downloading every .url file in the template list at once.
+ *
+ * Place before Open so the downloads overlap instead of running one per thread.
+ * \author Josh Klontz \cite jklontz
+ */
+class DownloadTransform : public UntrainableMetaTransform
+{
+    Q_OBJECT
+
+    void project(const Template &src, Template &dst) const
+    {
+        dst = src;
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        dst = src;
+        QStringList urls;
+        foreach (const Template &t, src)
+            if (t.isEmpty())
+                foreach (const File &file, t.file.split())
+                    if (file.suffix() == "url")
+                        urls.append(urlOf(file));
+        if (!urls.isEmpty())
+            URLFetcher::instance(src.first().file)->fetch(urls);
+    }
+};
+
+BR_REGISTER(Transform, DownloadTransform)
+
 /*!
  * \ingroup galleries
  * \brief Handle POST requests
@@ -202,6 +424,282 @@ class postFormat : public Format
 
 BR_REGISTER(Format, postFormat)
 
+/*!
+ * \brief A framed TCP connection of tcpGallery, on a thread of its own that owns the socket.
+ *
+ * A QTcpSocket may only be used from the thread it lives on, while a gallery is written, read and destroyed
+ * by whichever threads hold it, so every socket operation is a blocking call queued to this thread.
+ * Frames are a quint64 length followed by that many bytes, at most \c MaxFrameSize.
+ */
+class TCPChannel : public QObject
+{
+    Q_OBJECT
+
+    QThread thread;
+    QTcpSocket *socket;
+
+public:
+    // Frames are read into a single QByteArray, larger lengths are rejected as corrupt
+    static const qint64 MaxFrameSize = Q_INT64_C(1) << 30;
+
+    TCPChannel() : socket(NULL)
+    {
+        moveToThread(&thread);
+        thread.start();
+    }
+
+    ~TCPChannel()
+    {
+        close();
+        thread.quit();
+        thread.wait();
+    }
+
+    void connectTo(const QString &host, int port)
+    {
+        QMetaObject::invokeMethod(this, "openConnection", Qt::BlockingQueuedConnection, Q_ARG(QString, host), Q_ARG(int, port));
+    }
+
+    // Listens on port until one sender connects
+    void accept(int port)
+    {
+        QMetaObject::invokeMethod(this, "acceptConnection", Qt::BlockingQueuedConnection, Q_ARG(int, port));
+    }
+
+    void send(const QByteArray &frame)
+    {
+        QMetaObject::invokeMethod(this, "sendFrame", Qt::BlockingQueuedConnection, Q_ARG(QByteArray, frame));
+    }
+
+    QByteArray receive()
+    {
+        QByteArray frame;
+        QMetaObject::invokeMethod(this, "receiveFrame", Qt::BlockingQueuedConnection, Q_RETURN_ARG(QByteArray, frame));
+        return frame;
+    }
+
+    // Disconnects, waiting for the unsent data to be written
+    void close()
+    {
+        QMetaObject::invokeMethod(this, "closeConnection", Qt::BlockingQueuedConnection);
+    }
+
+private:
+    QByteArray readBytes(qint64 size)
+    {
+        QByteArray data;
+        data.reserve(int(size));
+        while (data.size() < size) {
+            if ((socket->bytesAvailable() == 0) && !socket->waitForReadyRead(-1))
+                qFatal("Connection to %s:%d lost (%s).", qPrintable(socket->peerName()), socket->peerPort(), qPrintable(socket->errorString()));
+            data.append(socket->read(size - data.size()));
+        }
+        return data;
+    }
+
+private slots:
+    void openConnection(const QString &host, int port)
+    {
+        socket = new QTcpSocket(this);
+        socket->connectToHost(host, port);
+        if (!socket->waitForConnected(-1))
+            qFatal("Unable to connect to %s:%d (%s).", qPrintable(host), port, qPrintable(socket->errorString()));
+    }
+
+    void acceptConnection(int port)
+    {
+        QTcpServer server;
+        if (!server.listen(QHostAddress::Any, port))
+            qFatal("Unable to listen on port %d (%s).", port, qPrintable(server.errorString()));
+        qDebug("Listening on %s:%d", qPrintable(server.serverAddress().toString()), server.serverPort());
+        if (!server.waitForNewConnection(-1))
+            qFatal("Failed to accept a connection on port %d (%s).", port, qPrintable(server.errorString()));
+        socket = server.nextPendingConnection();
+        socket->setParent(this);
+        server.close();
+    }
+
+    void sendFrame(const QByteArray &frame)
+    {
+        QByteArray header;
+        {
+            QDataStream stream(&header, QIODevice::WriteOnly);
+            stream << quint64(frame.size());
+        }
+        socket->write(header);
+        socket->write(frame);
+        while (socket->bytesToWrite() > 0)
+            if (!socket->waitForBytesWritten(-1))
+                qFatal("Failed to send to %s:%d (%s).", qPrintable(socket->peerName()), socket->peerPort(), qPrintable(socket->errorString()));
+    }
+
+    QByteArray receiveFrame()
+    {
+        quint64 size;
+        {
+            QDataStream stream(readBytes(sizeof(quint64)));
+            stream >> size;
+        }
+        if (size > quint64(MaxFrameSize))
+            qFatal("Rejected a %llu byte frame from %s:%d, frames are at most %lld bytes.",
+                   (unsigned long long)size, qPrintable(socket->peerName()), socket->peerPort(), (long long)MaxFrameSize);
+        return readBytes(qint64(size));
+    }
+
+    // The socket is deleted here so its notifiers are released on the thread that owns them
+    void closeConnection()
+    {
+        if (socket == NULL) return;
+        socket->disconnectFromHost();
+        if (socket->state() != QAbstractSocket::UnconnectedState)
+            socket->waitForDisconnected();
+        delete socket;
+        socket = NULL;
+    }
+};
+
+/*!
+ * \ingroup galleries
+ * \brief Streams templates between processes over TCP.
+ *
+ * Writing to <tt>name.tcp[host=h,port=p]</tt> connects to \c h:\c p (\c host is \c localhost by default) and sends the templates in framed batches of \c batch (default 256),
+ * keeping up to \c window (default 4) batches in flight before waiting for the receiver to acknowledge one,
+ * so a slow receiver throttles the sender instead of buffering without bound.
+ * Reading <tt>name.tcp[port=p]</tt> listens on \c p, accepts one sender and returns a block per batch until the sender closes the gallery.
+ * A batch is acknowledged once read, after it has been appended to <tt>into</tt> if set, so
+ * <tt>into=search.mem</tt> streams enrolled templates straight into a search node's memGallery without touching disk.
+ * Frames longer than TCPChannel::MaxFrameSize are rejected.
+ * \author Josh Klontz \cite jklontz
+ */
+class tcpGallery : public Gallery
+{
+    Q_OBJECT
+    Q_PROPERTY(QString host READ get_host WRITE set_host RESET reset_host STORED false)
+    BR_PROPERTY(QString, host, "localhost")
+
+    enum FrameType { Batch = 1, End = 2, Ack = 3 };
+
+    struct Frame
+    {
+        qint32 type, sequence;
+        TemplateList templates;
+        Frame(qint32 type_ = Batch, qint32 sequence_ = 0) : type(type_), sequence(sequence_) {}
+    };
+
+    QScopedPointer<TCPChannel> channel;
+
+    // Sending
+    QMutex writeLock;
+    TemplateList batch;
+    qint32 sent, acknowledged;
+
+    // Receiving
+    QScopedPointer<Gallery> into;
+    bool ended;
+
+    void init()
+    {
+        sent = acknowledged = 0;
+        ended = false;
+    }
+
+    ~tcpGallery()
+    {
+        if (channel.isNull())
+            return;
+
+        QMutexLocker locker(&writeLock);
+        if (!batch.isEmpty())
+            sendBatch();
+        send(Frame(End, sent++));
+        while (acknowledged < sent)
+            receiveAck();
+        channel.reset();
+    }
+
+    void send(const Frame &frame)
+    {
+        QByteArray body;
+        QDataStream stream(&body, QIODevice::WriteOnly);
+        stream << frame.type << frame.sequence << frame.templates;
+        channel->send(body);
+    }
+
+    Frame receive()
+    {
+        Frame frame;
+        const QByteArray body = channel->receive();
+        QDataStream stream(body);
+        stream >> frame.type >> frame.sequence >> frame.templates;
+        if (stream.status() != QDataStream::Ok)
+            qFatal("Received a corrupt frame.");
+        return frame;
+    }
+
+    // Call with writeLock held
+    void sendBatch()
+    {
+        while (sent - acknowledged >= file.get<int>("window", 4))
+            receiveAck();
+        Frame frame(Batch, sent++);
+        frame.templates = batch;
+        batch.clear();
+        send(frame);
+    }
+
+    void receiveAck()
+    {
+        const Frame ack = receive();
+        if ((ack.type != Ack) || (ack.sequence != acknowledged))
+            qFatal("Unexpected acknowledgment %d of frame %d.", ack.sequence, acknowledged);
+        acknowledged++;
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        *done = true;
+        if (ended)
+            return TemplateList();
+        if (channel.isNull()) {
+            channel.reset(new TCPChannel());
+            channel->accept(file.get<int>("port"));
+            if (file.contains("into"))
+                into.reset(Gallery::make(file.get<QString>("into")));
+        }
+
+        const Frame frame = receive();
+        if (!into.isNull())
+            into->writeBlock(frame.templates);
+        // The sender only runs window batches ahead of this acknowledgment
+        send(Frame(Ack, frame.sequence));
+
+        if (frame.type == End) {
+            ended = true;
+            channel.reset();
+            into.reset();
+            return TemplateList();
+        }
+
+        *done = false;
+        return frame.templates;
+    }
+
+    void write(const Template &t)
+    {
+        QMutexLocker locker(&writeLock);
+        if (channel.isNull()) {
+            channel.reset(new TCPChannel());
+            channel->connectTo(host, file.get<int>("port"));
+        }
+
+        batch.append(t);
+        if (batch.size() >= file.get<int>("batch", 256))
+            sendBatch();
+    }
+};
+
+BR_REGISTER(Gallery, tcpGallery)
+
 } // namespace br
 
 #include "qtnetwork.moc"
@@ -1,5 +1,8 @@
 #include <QFutureSynchronizer>
+#include <QHash>
+#include <QScopedPointer>
 #include <QtConcurrent>
+#include <limits>
 #include "openbr_internal.h"
 
 #include "openbr/core/common.h"
@@ -26,19 +29,54 @@ class ImpostorUniquenessMeasureTransform : public Transform
     BR_PROPERTY(QString, inputVariable, "Label")
 
     TemplateList impostors;
+    QHash<QString,int> labelIds;
+    QVector<int> impostorLabels; // Index into labelIds of each impostor's label
 
-    float calculateIUM(const Template &probe, const TemplateList &gallery) const
+    // Impostors are packed into aligned rows once, so the batch distance API compares against them without copying
+    void index()
     {
-        const QString probeLabel = probe.file.get<QString>(inputVariable);
-        TemplateList subset = gallery;
-        for (int j=subset.size()-1; j>=0; j--)
-            if (subset[j].file.get<QString>(inputVariable) == probeLabel)
-                subset.removeAt(j);
+        labelIds.clear();
+        impostorLabels.clear();
+        impostorLabels.reserve(impostors.size());
+        foreach (const Template &t, impostors) {
+            const QString label = t.file.get<QString>(inputVariable);
+            if (!labelIds.contains(label)) labelIds.insert(label, labelIds.size());
+            impostorLabels.append(labelIds[label]);
+        }
 
-        QList<float> scores = distance->compare(subset, probe);
-        float min, max;
-        Common::MinMax(scores, &min, &max);
-        double mean = Common::Mean(scores);
+        if (impostors.isEmpty()) return;
+        const cv::Mat &reference = impostors.first().m();
+        foreach (const Template &t, impostors)
+            if ((t.size() != 1) || !t.m().isContinuous() || (t.m().rows != reference.rows) || (t.m().cols != reference.cols) || (t.m().type() != reference.type()))
+                return;
+
+        const size_t bytes = reference.total() * reference.elemSize();
+        const int rows = reference.rows, cols = reference.cols, type = reference.type();
+        impostors.stride = OpenCVUtils::alignedStep(bytes);
+        uchar *data = OpenCVUtils::alignedBuffer(impostors.alignedData, impostors.stride * impostors.size());
+        for (int i=0; i<impostors.size(); i++) {
+            uchar *dst = data + i*impostors.stride;
+            memcpy(dst, impostors[i].m().data, bytes);
+            impostors[i].m() = cv::Mat(rows, cols, type, dst);
+        }
+        impostors.uniform = true;
+    }
+
+    // Scores against impostors sharing the probe's label are skipped
+    float calculateIUM(const Template &probe, const float *scores) const
+    {
+        const int probeLabel = labelIds.value(probe.file.get<QString>(inputVariable), -1);
+        float min = std::numeric_limits<float>::max(), max = -std::numeric_limits<float>::max();
+        double sum = 0;
+        int count = 0;
+        for (int j=0; j<impostors.size(); j++) {
+            if (impostorLabels[j] == probeLabel) continue;
+            min = std::min(min, scores[j]);
+            max = std::max(max, scores[j]);
+            sum += scores[j];
+            count++;
+        }
+        const double mean = sum / count;
         return (max-mean)/(max-min);
     }
 
@@ -46,10 +84,17 @@ class ImpostorUniquenessMeasureTransform : public Transform
     {
         distance->train(data);
         impostors = data;
+        index();
 
+        // Score the impostors against each other a block of probes at a time
         QList<float> iums; iums.reserve(impostors.size());
-        for (int i=0; i<data.size(); i++)
-            iums.append(calculateIUM(impostors[i], impostors));
+        for (int i=0; i<impostors.size(); i+=Globals->blockSize) {
+            const TemplateList probes = impostors.mid(i, Globals->blockSize);
+            QScopedPointer<MatrixOutput> scores(MatrixOutput::make(impostors.files(), probes.files()));
+            distance->compare(impostors, probes, scores.data());
+            for (int j=0; j<probes.size(); j++)
+                iums.append(calculateIUM(probes[j], scores->data.ptr<float>(j)));
+        }
 
         Common::MeanStdDev(iums, &mean, &stddev);
     }
@@ -57,7 +102,8 @@ class ImpostorUniquenessMeasureTransform : public Transform
     void project(const Template &src, Template &dst) const
     {
         dst = src;
-        float ium = calculateIUM(src, impostors);
+        const QVector<float> scores = distance->compare(impostors, src).toVector();
+        float ium = calculateIUM(src, scores.data());
         dst.file.set("Impostor_Uniqueness_Measure", ium);
         dst.file.set("Impostor_Uniqueness_Measure_Bin", ium < mean-stddev ? 0 : (ium < mean+stddev ? 1 : 2));
     }
@@ -72,6 +118,7 @@ class ImpostorUniquenessMeasureTransform : public Transform
     {
         distance->load(stream);
         stream >> mean >> stddev >> impostors;
+        index();
     }
 };
 
@@ -90,10 +137,24 @@ struct KDE
         Common::MinMax(scores, &min, &max);
         Common::MeanStdDev(scores, &mean, &stddev);
         double h = Common::KernelDensityBandwidth(scores);
+
+        // Estimate the density from a histogram of the scores, its bins are far narrower than the bandwidth
+        const int histogramSize = 4096;
+        const double width = (max > min) ? double(max-min)/histogramSize : 1;
+        QVector<int> histogram(histogramSize, 0);
+        foreach (float score, scores)
+            histogram[std::min(int((score-min)/width), histogramSize-1)]++;
+
         const int size = 255;
         bins.reserve(size);
-        for (int i=0; i<size; i++)
-            bins.append(Common::KernelDensityEstimation(scores, min + (max-min)*i/(size-1), h));
+        for (int i=0; i<size; i++) {
+            const double x = min + (max-min)*i/(size-1);
+            double y = 0;
+            for (int j=0; j<histogramSize; j++)
+                if (histogram[j] > 0)
+                    y += histogram[j] * exp(-pow((min + width*(j+0.5) - x)/h, 2)/2);
+            bins.append(y / (sqrt(2*CV_PI) * scores.size() * h));
+        }
     }
 
     float operator()(float score, bool gaussian = true) const
@@ -133,6 +194,36 @@ struct MP
     }
 };
 
+/* Match Probability sampled for linear interpolation */
+struct MPTable
+{
+    float min, max, step;
+    QVector<float> samples;
+    MPTable() : min(0), max(0), step(1) {}
+    MPTable(const MP &mp, bool gaussian, int size = 4096)
+        : min(std::min(mp.genuine.min, mp.impostor.min)), max(std::max(mp.genuine.max, mp.impostor.max)), step(1)
+    {
+        if (!(max > min) || (!gaussian && (mp.genuine.bins.isEmpty() || mp.impostor.bins.isEmpty()))) return;
+        step = (max-min)/(size-1);
+        samples.reserve(size);
+        for (int i=0; i<size; i++)
+            samples.append(mp(min + step*i, gaussian));
+    }
+
+    // Scores outside the sampled range must be evaluated by the MP itself
+    inline bool contains(float score) const
+    {
+        return !samples.isEmpty() && (score >= min) && (score <= max);
+    }
+
+    inline float operator()(float score) const
+    {
+        const float x = (score-min)/step;
+        const int i = std::min(int(x), samples.size()-2);
+        return samples[i] + (samples[i+1]-samples[i])*(x-i);
+    }
+};
+
 QDataStream &operator<<(QDataStream &stream, const MP &nmp)
 {
     return stream << nmp.genuine << nmp.impostor;
@@ -143,9 +234,55 @@ QDataStream &operator>>(QDataStream &stream, MP &nmp)
     return stream >> nmp.genuine >> nmp.impostor;
 }
 
+/* Scores of a share of the training pairs */
+struct PairScores
+{
+    const Distance *distance;
+    const TemplateList *templates;
+    QList< QPair<int,int> > pairs;
+    QList<float> scores;
+};
+
+static void scorePairs(PairScores *pairScores)
+{
+    pairScores->scores.reserve(pairScores->pairs.size());
+    typedef QPair<int,int> Pair;
+    foreach (const Pair &pair, pairScores->pairs) {
+        const float score = pairScores->distance->compare((*pairScores->templates)[pair.first], (*pairScores->templates)[pair.second]);
+        if (score != -std::numeric_limits<float>::max())
+            pairScores->scores.append(score);
+    }
+}
+
+// Scores the pairs in parallel
+static QList<float> scorePairs(const Distance *distance, const TemplateList &templates, const QList< QPair<int,int> > &pairs)
+{
+    const int chunkSize = 4096;
+    QList<PairScores> chunks;
+    for (int i=0; i<pairs.size(); i+=chunkSize) {
+        PairScores chunk;
+        chunk.distance = distance;
+        chunk.templates = &templates;
+        chunk.pairs = pairs.mid(i, chunkSize);
+        chunks.append(chunk);
+    }
+
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<chunks.size(); i++)
+        futures.addFuture(QtConcurrent::run(scorePairs, &chunks[i]));
+    futures.waitForFinished();
+
+    QList<float> scores;
+    for (int i=0; i<chunks.size(); i++)
+        scores.append(chunks[i].scores);
+    return scores;
+}
+
 /*!
  * \ingroup distances
  * \brief Match Probability \cite klare12
+ * \param impostors Most impostor pairs scored in training, sampled at random when there are more.
+ * \param genuines Most genuine pairs scored in training, sampled at random when there are more.
  * \author Josh Klontz \cite jklontz
  */
 class MatchProbabilityDistance : public Distance
@@ -155,39 +292,107 @@ class MatchProbabilityDistance : public Distance
     Q_PROPERTY(bool gaussian READ get_gaussian WRITE set_gaussian RESET reset_gaussian STORED false)
     Q_PROPERTY(bool crossModality READ get_crossModality WRITE set_crossModality RESET reset_crossModality STORED false)
     Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
+    Q_PROPERTY(int impostors READ get_impostors WRITE set_impostors RESET reset_impostors STORED false)
+    Q_PROPERTY(int genuines READ get_genuines WRITE set_genuines RESET reset_genuines STORED false)
 
     MP mp;
+    MPTable table;
 
     void train(const TemplateList &src)
     {
         distance->train(src);
 
         const QList<int> labels = src.indexProperty(inputVariable);
-        QScopedPointer<MatrixOutput> matrixOutput(MatrixOutput::make(FileList(src.size()), FileList(src.size())));
-        distance->compare(src, src, matrixOutput.data());
+        QStringList modalities;
+        if (crossModality)
+            foreach (const Template &t, src)
+                modalities.append(t.file.get<QString>("MODALITY"));
+
+        // Genuine pairs enumerated label by label, a reproducible reservoir sample of genuines of them if there are more
+        typedef QPair<int,int> Pair;
+        QHash<int, QList<int> > labelIndices;
+        for (int i=0; i<src.size(); i++)
+            labelIndices[labels[i]].append(i);
+
+        QList<Pair> genuinePairs;
+        qint64 genuinePairCount = 0, eligibleGenuinePairs = 0;
+        cv::RNG genuineRNG(0);
+        foreach (const QList<int> &indices, labelIndices) {
+            genuinePairCount += qint64(indices.size()) * (indices.size()-1) / 2;
+            for (int i=0; i<indices.size(); i++)
+                for (int j=0; j<i; j++) {
+                    if (crossModality && (modalities[indices[i]] == modalities[indices[j]]))
+                        continue;
+                    const Pair pair(indices[i], indices[j]);
+                    if (genuinePairs.size() < genuines) {
+                        genuinePairs.append(pair);
+                    } else {
+                        const quint64 random = (quint64(genuineRNG.next()) << 32) | genuineRNG.next();
+                        const qint64 slot = qint64(random % quint64(eligibleGenuinePairs + 1));
+                        if (slot < genuines) genuinePairs[int(slot)] = pair;
+                    }
+                    eligibleGenuinePairs++;
+                }
+        }
 
-        QList<float> genuineScores, impostorScores;
-        genuineScores.reserve(labels.size());
-        impostorScores.reserve(labels.size()*labels.size());
-        for (int i=0; i<src.size(); i++) {
-            for (int j=0; j<i; j++) {
-                const float score = matrixOutput.data()->data.at<float>(i, j);
-                if (score == -std::numeric_limits<float>::max()) continue;
-                if (crossModality && src[i].file.get<QString>("MODALITY") == src[j].file.get<QString>("MODALITY")) continue;
-                if (labels[i] == labels[j]) genuineScores.append(score);
-                else                        impostorScores.append(score);
+        // Every impostor pair if there are at most impostors of them, otherwise a reproducible random sample
+        QList<Pair> impostorPairs;
+        const qint64 impostorPairCount = qint64(src.size()) * (src.size()-1) / 2 - genuinePairCount;
+        if (impostorPairCount <= impostors) {
+            for (int i=0; i<src.size(); i++)
+                for (int j=0; j<i; j++)
+                    if ((labels[i] != labels[j]) && (!crossModality || (modalities[i] != modalities[j])))
+                        impostorPairs.append(Pair(i, j));
+        } else {
+            cv::RNG rng(0);
+            impostorPairs.reserve(impostors);
+            qint64 attempts = 0;
+            while ((impostorPairs.size() < impostors) && (attempts++ < 100*qint64(impostors))) {
+                const int i = rng.uniform(0, src.size()), j = rng.uniform(0, src.size());
+                if ((labels[i] != labels[j]) && (!crossModality || (modalities[i] != modalities[j])))
+                    impostorPairs.append(Pair(i, j));
             }
         }
 
-        mp = MP(genuineScores, impostorScores);
+        mp = MP(scorePairs(distance, src, genuinePairs), scorePairs(distance, src, impostorPairs));
+        table = MPTable(mp, gaussian);
     }
 
-    float compare(const Template &target, const Template &query) const
+    inline float normalize(float rawScore, bool scoreNormalization) const
     {
-        const float rawScore = distance->compare(target, query);
         if (rawScore == -std::numeric_limits<float>::max()) return rawScore;
-        if (!Globals->scoreNormalization) return -log(rawScore+1);
-        return mp(rawScore, gaussian);
+        if (!scoreNormalization) return -log(rawScore+1);
+        return table.contains(rawScore) ? table(rawScore) : mp(rawScore, gaussian);
+    }
+
+    float compare(const Template &target, const Template &query) const
+    {
+        return normalize(distance->compare(target, query), Globals->scoreNormalization);
+    }
+
+    // Normalizes a block of raw scores from the wrapped distance's batch implementation
+    bool compare(const cv::Mat &targets, const cv::Mat &query, float *scores) const
+    {
+        if (!distance->compare(targets, query, scores)) return false;
+        const bool scoreNormalization = Globals->scoreNormalization;
+        for (int i=0; i<targets.rows; i++)
+            scores[i] = normalize(scores[i], scoreNormalization);
+        return true;
+    }
+
+    const Distance *normalizedDistance() const
+    {
+        return distance;
+    }
+
+    void normalizeTile(cv::Mat &scores) const
+    {
+        const bool scoreNormalization = Globals->scoreNormalization;
+        for (int i=0; i<scores.rows; i++) {
+            float *row = scores.ptr<float>(i);
+            for (int j=0; j<scores.cols; j++)
+                row[j] = normalize(row[j], scoreNormalization);
+        }
     }
 
     void store(QDataStream &stream) const
@@ -200,6 +405,7 @@ class MatchProbabilityDistance : public Distance
     {
         distance->load(stream);
         stream >> mp;
+        table = MPTable(mp, gaussian);
     }
 
 protected:
@@ -207,6 +413,8 @@ protected:
     BR_PROPERTY(bool, gaussian, true)
     BR_PROPERTY(bool, crossModality, false)
     BR_PROPERTY(QString, inputVariable, "Label")
+    BR_PROPERTY(int, impostors, 1000000)
+    BR_PROPERTY(int, genuines, 1000000)
 };
 
 BR_REGISTER(Distance, MatchProbabilityDistance)
@@ -255,6 +463,22 @@ class ZScoreDistance : public Distance
         return score;
     }
 
+    const Distance *normalizedDistance() const
+    {
+        return distance;
+    }
+
+    void normalizeTile(cv::Mat &scores) const
+    {
+        const float low = (min - mean) / stddev, high = (max - mean) / stddev, scale = 1 / stddev, offset = -mean / stddev;
+        for (int i=0; i<scores.rows; i++) {
+            float *row = scores.ptr<float>(i);
+            for (int j=0; j<scores.cols; j++)
+                row[j] = (row[j] == -std::numeric_limits<float>::max()) ? low :
+                         ((row[j] == std::numeric_limits<float>::max()) ? high : row[j] * scale + offset);
+        }
+    }
+
     void store(QDataStream &stream) const
     {
         distance->store(stream);
@@ -422,6 +646,16 @@ class UnitDistance : public Distance
     {
         return a * (distance->compare(target, query) - b);
     }
+
+    const Distance *normalizedDistance() const
+    {
+        return distance;
+    }
+
+    void normalizeTile(cv::Mat &scores) const
+    {
+        scores.convertTo(scores, CV_32FC1, a, -a*b);
+    }
 };
 
 BR_REGISTER(Distance, UnitDistance)
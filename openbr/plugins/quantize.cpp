@@ -126,15 +126,11 @@ class BayesianQuantizationDistance : public Distance
 
     QVector<float> loglikelihoods;
 
-    static void computeLogLikelihood(const Mat &data, const QList<int> &labels, float *loglikelihood)
+    static void computeLogLikelihood(const uchar *vals, const QVector<int> &labels, float *loglikelihood)
     {
-        const QList<uchar> vals = OpenCVUtils::matrixToVector<uchar>(data);
-        if (vals.size() != labels.size())
-            qFatal("Logic error.");
-
         QVector<quint64> genuines(256, 0), impostors(256,0);
-        for (int i=0; i<vals.size(); i++)
-            for (int j=i+1; j<vals.size(); j++)
+        for (int i=0; i<labels.size(); i++)
+            for (int j=i+1; j<labels.size(); j++)
                 if (labels[i] == labels[j]) genuines[abs(vals[i]-vals[j])]++;
                 else                        impostors[abs(vals[i]-vals[j])]++;
 
@@ -148,19 +144,36 @@ class BayesianQuantizationDistance : public Distance
             loglikelihood[i] = log((float(genuines[i]+1)/totalGenuines)/(float(impostors[i]+1)/totalImpostors));
     }
 
+    // Fits dimension i from row i of the transposed training data for Common::ParallelFor
+    struct LogLikelihoods
+    {
+        const Mat *dimensions;
+        const QVector<int> *labels;
+        float *loglikelihoods;
+
+        void operator()(int i) const
+        {
+            computeLogLikelihood(dimensions->ptr<uchar>(i), *labels, &loglikelihoods[i*256]);
+        }
+    };
+
     void train(const TemplateList &src)
     {
         if ((src.first().size() > 1) || (src.first().m().type() != CV_8UC1))
             qFatal("Expected sigle matrix templates of type CV_8UC1!");
 
-        const Mat data = OpenCVUtils::toMat(src.data());
-        const QList<int> templateLabels = src.indexProperty(inputVariable);
-        loglikelihoods = QVector<float>(data.cols*256, 0);
+        // One contiguous row per dimension, so each dimension's pass reads sequentially
+        const Mat dimensions = OpenCVUtils::toMat(src.data()).t();
+        const QVector<int> templateLabels = src.indexProperty(inputVariable).toVector();
+        if (dimensions.cols != templateLabels.size())
+            qFatal("Logic error.");
+        loglikelihoods = QVector<float>(dimensions.rows*256, 0);
 
-        QFutureSynchronizer<void> futures;
-        for (int i=0; i<data.cols; i++)
-            futures.addFuture(QtConcurrent::run(&BayesianQuantizationDistance::computeLogLikelihood, data.col(i), templateLabels, &loglikelihoods.data()[i*256]));
-        futures.waitForFinished();
+        LogLikelihoods fit;
+        fit.dimensions = &dimensions;
+        fit.labels = &templateLabels;
+        fit.loglikelihoods = loglikelihoods.data();
+        Common::ParallelFor(0, dimensions.rows, fit, Globals->parallelism);
     }
 
     float compare(const Template &a, const Template &b) const
@@ -190,6 +203,8 @@ BR_REGISTER(Distance, BayesianQuantizationDistance)
 /*!
  * \ingroup transforms
  * \brief Approximate floats as signed bit.
+ *
+ * Packs eight bits per byte, compare with br::HammingDistance.
  * \author Josh Klontz \cite jklontz
  */
 class BinarizeTransform : public UntrainableTransform
@@ -204,14 +219,14 @@ class BinarizeTransform : public UntrainableTransform
         Mat n(m.rows, m.cols/8, CV_8UC1);
         for (int i=0; i<m.rows; i++)
             for (int j=0; j<m.cols-7; j+=8)
-                n.at<uchar>(i,j) = ((m.at<float>(i,j+0) > 0) << 0) +
-                                   ((m.at<float>(i,j+1) > 0) << 1) +
-                                   ((m.at<float>(i,j+2) > 0) << 2) +
-                                   ((m.at<float>(i,j+3) > 0) << 3) +
-                                   ((m.at<float>(i,j+4) > 0) << 4) +
-                                   ((m.at<float>(i,j+5) > 0) << 5) +
-                                   ((m.at<float>(i,j+6) > 0) << 6) +
-                                   ((m.at<float>(i,j+7) > 0) << 7);
+                n.at<uchar>(i,j/8) = ((m.at<float>(i,j+0) > 0) << 0) +
+                                     ((m.at<float>(i,j+1) > 0) << 1) +
+                                     ((m.at<float>(i,j+2) > 0) << 2) +
+                                     ((m.at<float>(i,j+3) > 0) << 3) +
+                                     ((m.at<float>(i,j+4) > 0) << 4) +
+                                     ((m.at<float>(i,j+5) > 0) << 5) +
+                                     ((m.at<float>(i,j+6) > 0) << 6) +
+                                     ((m.at<float>(i,j+7) > 0) << 7);
         dst = n;
     }
 };
@@ -246,9 +261,64 @@ BR_REGISTER(Transform, PackTransform)
 
 QVector<Mat> ProductQuantizationLUTs;
 
+// Codebook of a ProductQuantizationTransform, for comparing unquantized queries to codes
+struct ProductQuantizationCodebook
+{
+    QList<Mat> centers; // 256 rows per subspace
+    int step, offset;
+    QSharedPointer<Distance> distance; // Null unless the LUT holds distances between centers, outlives the transform
+
+    ProductQuantizationCodebook() : step(0), offset(0) {}
+};
+
+QVector<ProductQuantizationCodebook> ProductQuantizationCodebooks;
+
+// Held while the LUTs and codebooks are added to or replaced
+QMutex ProductQuantizationLock;
+
+// Distance between codes a and b of the triangular LUT for one subspace
+static inline float lookup(const float *lut, int a, int b)
+{
+    const int y = max(a, b);
+    const int x = min(a, b);
+    return lut[x + (y+1)*y/2];
+}
+
+// Asymmetric distance computation table of the query's distance to every code in every subspace
+static QVector<float> tabulate(const float *lut, const uchar *query, int elements)
+{
+    QVector<float> table(elements*256);
+    float *tableData = table.data();
+    for (int j=0; j<elements; j++) {
+        const float *subspace = lut + j*256*(256+1)/2;
+        for (int k=0; k<256; k++)
+            tableData[j*256+k] = lookup(subspace, query[j], k);
+    }
+    return table;
+}
+
+// Sum the tabulated distances of a target's codes, using independent accumulators to overlap the loads
+static inline float scan(const float *table, const uchar *codes, int elements)
+{
+    float d0 = 0, d1 = 0, d2 = 0, d3 = 0;
+    int j = 0;
+    for (; j+4<=elements; j+=4) {
+        d0 += table[(j+0)*256 + codes[j+0]];
+        d1 += table[(j+1)*256 + codes[j+1]];
+        d2 += table[(j+2)*256 + codes[j+2]];
+        d3 += table[(j+3)*256 + codes[j+3]];
+    }
+    for (; j<elements; j++)
+        d0 += table[j*256 + codes[j]];
+    return (d0 + d1) + (d2 + d3);
+}
+
 /*!
  * \ingroup distances
  * \brief Distance in a product quantized space \cite jegou11
+ *
+ * Queries made by br::ProductQuantizationTransform with \em adc set also carry their unquantized vector,
+ * which is compared to the target codes by asymmetric distance computation from the codebook.
  * \author Josh Klontz \cite jklontz
  */
 class ProductQuantizationDistance : public Distance
@@ -257,10 +327,36 @@ class ProductQuantizationDistance : public Distance
     Q_PROPERTY(bool bayesian READ get_bayesian WRITE set_bayesian RESET reset_bayesian STORED false)
     BR_PROPERTY(bool, bayesian, false)
 
+    // Distance from the centers of a's codes to the unquantized vector of b in each subspace
+    static float compareUnquantized(const ProductQuantizationCodebook &codebook, const Mat &a, const Mat &b)
+    {
+        const Mat m = b.reshape(1, 1);
+        const uchar *codes = a.data + sizeof(quint16);
+        float distance = 0;
+        for (int j=0; j<codebook.centers.size(); j++) {
+            const Mat subvector = m.colRange(max(0, j*codebook.step-codebook.offset), (j+1)*codebook.step-codebook.offset);
+            distance += codebook.distance->compare(codebook.centers[j].row(codes[j]), subvector);
+        }
+        return distance;
+    }
+
+    // Either template may carry its unquantized vector, in which case only the other one's codes are compared to it
     float compare(const Template &a, const Template &b) const
     {
         float distance = 0;
-        for (int i=0; i<a.size(); i++) {
+        if (unquantized(a) != unquantized(b)) {
+            const Template &codes = unquantized(a) ? b : a;
+            const Template &vector = unquantized(a) ? a : b;
+            const quint16 index = *reinterpret_cast<const quint16*>(codes[0].data);
+            const ProductQuantizationCodebook &codebook = ProductQuantizationCodebooks[index];
+            if (codebook.distance) {
+                distance = compareUnquantized(codebook, codes[0], vector[1]);
+                return bayesian ? distance : -log(distance+1);
+            }
+        }
+
+        const int codes = (unquantized(a) || unquantized(b)) ? 1 : a.size();
+        for (int i=0; i<codes; i++) {
             const int elements = a[i].total()-sizeof(quint16);
             uchar *aData = a[i].data;
             uchar *bData = b[i].data;
@@ -282,6 +378,95 @@ class ProductQuantizationDistance : public Distance
         if (!bayesian) distance = -log(distance+1);
         return distance;
     }
+
+    // Asymmetric distance computation table of the unquantized query's distance to every center in every subspace
+    static QVector<float> tabulateUnquantized(const ProductQuantizationCodebook &codebook, const Mat &query)
+    {
+        const Mat m = query.reshape(1, 1);
+        const int elements = codebook.centers.size();
+        QVector<float> table(elements*256);
+        for (int j=0; j<elements; j++) {
+            const Mat subvector = m.colRange(max(0, j*codebook.step-codebook.offset), (j+1)*codebook.step-codebook.offset);
+            for (int k=0; k<256; k++)
+                table[j*256+k] = codebook.distance->compare(codebook.centers[j].row(k), subvector);
+        }
+        return table;
+    }
+
+    static bool unquantized(const Template &query)
+    {
+        return (query.size() == 2) && (query[1].depth() == CV_32F);
+    }
+
+    void compareQuery(const TemplateList *targets, const Template *query, int i, Output *output) const
+    {
+        const bool asymmetric = unquantized(*query);
+        Mat row(1, targets->size(), CV_32FC1, Scalar(-std::numeric_limits<float>::max()));
+        QVector<float> table;
+        int tableIndex = -1;
+        for (int k=0; k<targets->size(); k++) {
+            const Template &target = (*targets)[k];
+            if (target.isEmpty()) continue;
+            const uchar *codes = target.m().data;
+            const int elements = int(target.m().total()) - int(sizeof(quint16));
+            const quint16 index = *reinterpret_cast<const quint16*>(codes);
+            if (index != tableIndex) {
+                // Bayesian LUTs aren't distances between centers, the query's codes are tabulated instead
+                const ProductQuantizationCodebook &codebook = ProductQuantizationCodebooks[index];
+                table = (asymmetric && codebook.distance) ? tabulateUnquantized(codebook, (*query)[1])
+                                                          : tabulate((const float*)ProductQuantizationLUTs[index].data, (*query)[0].data + sizeof(quint16), elements);
+                tableIndex = index;
+            }
+            const float distance = scan(table.constData(), codes + sizeof(quint16), elements);
+            row.at<float>(0, k) = bayesian ? distance : -log(distance+1);
+        }
+        output->setRelativeTile(row, i, 0);
+    }
+
+    // Queries carrying their unquantized vector are compared to the codes of each target without quantization error.
+    // Single code queries against more targets than codes are tabulated once per query for the whole gallery,
+    // the tiles compare(const Mat&, const Mat&, float*) sees are too small to amortize the table.
+    void compare(const TemplateList &target, const TemplateList &query, Output *output) const
+    {
+        bool asymmetric = !query.isEmpty();
+        foreach (const Template &q, query)
+            asymmetric = asymmetric && unquantized(q);
+        bool tabulated = !query.isEmpty() && (target.size() > 256);
+        foreach (const Template &q, query)
+            tabulated = tabulated && (q.size() == 1) && (q.m().type() == CV_8UC1);
+        foreach (const Template &t, target)
+            tabulated = tabulated && (t.size() <= 1);
+        if (!asymmetric && !tabulated) {
+            Distance::compare(target, query, output);
+            return;
+        }
+
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<query.size(); i++)
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &ProductQuantizationDistance::compareQuery, &target, &query[i], i, output));
+            else                                                                                              compareQuery (&target, &query[i], i, output);
+        futures.waitForFinished();
+    }
+
+    bool compare(const Mat &targets, const Mat &query, float *scores) const
+    {
+        if (targets.type() != CV_8UC1) return false;
+        const int elements = targets.cols-sizeof(quint16);
+        const uchar *bData = query.data + sizeof(quint16);
+
+        for (int i=0; i<targets.rows; i++) {
+            const uchar *aData = targets.ptr(i);
+            const quint16 index = *reinterpret_cast<const quint16*>(aData);
+            aData += sizeof(quint16);
+
+            const float *lut = (const float*)ProductQuantizationLUTs[index].data;
+            float distance = 0;
+            for (int j=0; j<elements; j++)
+                distance += lookup(lut + j*256*(256+1)/2, aData[j], bData[j]);
+            scores[i] = bayesian ? distance : -log(distance+1);
+        }
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, ProductQuantizationDistance)
@@ -332,6 +517,86 @@ class RecursiveProductQuantizationDistance : public Distance
                + compareRecursive(a, b, i+1+2*subSize, subSize, evidence)
                + compareRecursive(a, b, i+1+3*subSize, subSize, evidence);
     }
+
+    // Walks every target through the tree together, compacting the targets that survive each node
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        QVector<float> scores(targets.size(), 0);
+        QVector<int> survivors; survivors.reserve(targets.size());
+        for (int k=0; k<targets.size(); k++)
+            if (!targets[k].isEmpty()) survivors.append(k);
+        if (!query.isEmpty())
+            compareBatch(targets, query, 0, query.size(), survivors, QVector<float>(survivors.size(), 0), targets.size() > 256, scores.data());
+
+        QList<float> result; result.reserve(targets.size());
+        for (int k=0; k<targets.size(); k++)
+            result.append(((query.isEmpty() || targets[k].isEmpty())) ? -std::numeric_limits<float>::max() : scores[k]);
+        return result;
+    }
+
+    // Tabulating the query node costs 256 lookups per subspace, decided once from the size of the whole gallery
+    void compareBatch(const TemplateList &targets, const Template &query, int i, int size,
+                      const QVector<int> &survivors, const QVector<float> &evidence, bool adc, float *scores) const
+    {
+        const int elements = query[i].total()-sizeof(quint16);
+        const uchar *bData = query[i].data + sizeof(quint16);
+        const int subSize = (size-1)/4;
+
+        QVector<float> table;
+        int tableIndex = -1;
+
+        QVector<int> nextSurvivors;
+        QVector<float> nextEvidence;
+        for (int s=0; s<survivors.size(); s++) {
+            const int k = survivors[s];
+            const uchar *aData = targets[k][i].data;
+            const quint16 index = *reinterpret_cast<const quint16*>(aData);
+            aData += sizeof(quint16);
+
+            const float *lut = (const float*)ProductQuantizationLUTs[index].data;
+            float similarity = 0;
+            if (adc) {
+                if (index != tableIndex) {
+                    table = tabulate(lut, bData, elements);
+                    tableIndex = index;
+                }
+                similarity = scan(table.constData(), aData, elements);
+            } else {
+                for (int j=0; j<elements; j++)
+                    similarity += lookup(lut + j*256*(256+1)/2, aData[j], bData[j]);
+            }
+
+            scores[k] += similarity;
+            const float nodeEvidence = evidence[s] + similarity;
+            if ((nodeEvidence >= t) && (subSize > 0)) {
+                nextSurvivors.append(k);
+                nextEvidence.append(nodeEvidence);
+            }
+        }
+
+        if (nextSurvivors.isEmpty()) return;
+        for (int c=0; c<4; c++)
+            compareBatch(targets, query, i+1+c*subSize, subSize, nextSurvivors, nextEvidence, adc, scores);
+    }
+
+    void compareQuery(const TemplateList *targets, const Template *query, int i, Output *output) const
+    {
+        const QList<float> scores = compare(*targets, *query);
+        Mat row(1, scores.size(), CV_32FC1);
+        for (int j=0; j<scores.size(); j++)
+            row.at<float>(0, j) = scores[j];
+        output->setRelativeTile(row, i, 0);
+    }
+
+    void compare(const TemplateList &target, const TemplateList &query, Output *output) const
+    {
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<query.size(); i++) {
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &RecursiveProductQuantizationDistance::compareQuery, &target, &query[i], i, output));
+            else                                                                                                      compareQuery (&target, &query[i], i, output);
+        }
+        futures.waitForFinished();
+    }
 };
 
 BR_REGISTER(Distance, RecursiveProductQuantizationDistance)
@@ -339,6 +604,10 @@ BR_REGISTER(Distance, RecursiveProductQuantizationDistance)
 /*!
  * \ingroup transforms
  * \brief Product quantization \cite jegou11
+ *
+ * Set \em miniBatch to train each subspace codebook with mini-batch k-means, subspaces are trained in parallel either way.
+ * Set \em adc to append the unquantized vector to each template so br::ProductQuantizationDistance compares queries without quantizing them,
+ * and store only the codes in target galleries, e.g. <tt>targets.gal[matrices=[0]]</tt>.
  * \author Josh Klontz \cite jklontz
  */
 class ProductQuantizationTransform : public Transform
@@ -348,10 +617,14 @@ class ProductQuantizationTransform : public Transform
     Q_PROPERTY(br::Distance *distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
     Q_PROPERTY(bool bayesian READ get_bayesian WRITE set_bayesian RESET reset_bayesian STORED false)
     Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
+    Q_PROPERTY(bool miniBatch READ get_miniBatch WRITE set_miniBatch RESET reset_miniBatch STORED false)
+    Q_PROPERTY(bool adc READ get_adc WRITE set_adc RESET reset_adc STORED false)
     BR_PROPERTY(int, n, 2)
     BR_PROPERTY(br::Distance*, distance, Distance::make("L2", this))
     BR_PROPERTY(bool, bayesian, false)
     BR_PROPERTY(QString, inputVariable, "Label")
+    BR_PROPERTY(bool, miniBatch, false)
+    BR_PROPERTY(bool, adc, false)
 
     quint16 index;
     QList<Mat> centers;
@@ -359,13 +632,13 @@ class ProductQuantizationTransform : public Transform
 public:
     ProductQuantizationTransform()
     {
+        QMutexLocker locker(&ProductQuantizationLock);
         if (ProductQuantizationLUTs.size() > std::numeric_limits<quint16>::max())
             qFatal("Out of LUT space!"); // Unlikely
 
-        static QMutex mutex;
-        QMutexLocker locker(&mutex);
         index = ProductQuantizationLUTs.size();
         ProductQuantizationLUTs.append(Mat());
+        ProductQuantizationCodebooks.append(ProductQuantizationCodebook());
     }
 
 private:
@@ -410,7 +683,8 @@ private:
     void _train(const Mat &data, const QList<int> &labels, Mat *lut, Mat *center)
     {
         Mat clusterLabels;
-        kmeans(data, 256, clusterLabels, TermCriteria(TermCriteria::MAX_ITER, 10, 0), 3, KMEANS_PP_CENTERS, *center);
+        if (miniBatch) MiniBatchKMeans(data, 256, clusterLabels, *center);
+        else           kmeans(data, 256, clusterLabels, TermCriteria(TermCriteria::MAX_ITER, 10, 0), 3, KMEANS_PP_CENTERS, *center);
 
         Mat fullLUT(1, 256*256, CV_32FC1);
         for (int i=0; i<256; i++)
@@ -482,8 +756,7 @@ private:
 
         const QList<int> labels = src.indexProperty(inputVariable);
 
-        Mat &lut = ProductQuantizationLUTs[index];
-        lut = Mat(getDims(data.cols), 256*(256+1)/2, CV_32FC1);
+        Mat lut(getDims(data.cols), 256*(256+1)/2, CV_32FC1);
 
         QList<Mat> subdata, subluts;
         const int offset = getOffset(data.cols);
@@ -499,6 +772,21 @@ private:
             else                                                                                               _train (subdata[i], labels, &subluts[i], &centers[i]);
         }
         futures.waitForFinished();
+
+        QMutexLocker locker(&ProductQuantizationLock);
+        ProductQuantizationLUTs[index] = lut;
+        registerCodebook();
+    }
+
+    // The subspace layout is recovered from the centers, the first subspace is narrower by the offset.
+    // Called with ProductQuantizationLock held.
+    void registerCodebook()
+    {
+        ProductQuantizationCodebook &codebook = ProductQuantizationCodebooks[index];
+        codebook.centers = centers;
+        codebook.step = centers.isEmpty() ? 0 : centers.last().cols;
+        codebook.offset = centers.isEmpty() ? 0 : codebook.step - centers.first().cols;
+        codebook.distance = bayesian ? QSharedPointer<Distance>() : QSharedPointer<Distance>(Distance::make(distance->description(), NULL));
     }
 
     int getIndex(const Mat &m, const Mat &center) const
@@ -525,6 +813,11 @@ private:
         memcpy(dst.m().data, &index, sizeof(quint16));
         for (int i=0; i<dims; i++)
             dst.m().at<uchar>(0,sizeof(quint16)+i) = getIndex(m.colRange(max(0, i*step-offset), (i+1)*step-offset), centers[i]);
+        if (adc) {
+            Mat unquantized;
+            m.convertTo(unquantized, CV_32F);
+            dst.append(unquantized);
+        }
     }
 
     void store(QDataStream &stream) const
@@ -535,14 +828,157 @@ private:
     void load(QDataStream &stream)
     {
         stream >> index >> centers;
+        QMutexLocker locker(&ProductQuantizationLock);
         while (ProductQuantizationLUTs.size() <= index)
             ProductQuantizationLUTs.append(Mat());
+        while (ProductQuantizationCodebooks.size() <= index)
+            ProductQuantizationCodebooks.append(ProductQuantizationCodebook());
         stream >> ProductQuantizationLUTs[index];
+        registerCodebook();
     }
 };
 
 BR_REGISTER(Transform, ProductQuantizationTransform)
 
+QVector<Mat> SymmetricQuantizationScales;
+
+/*!
+ * \ingroup transforms
+ * \brief Approximate floats as signed bytes with a trained scale for each dimension.
+ *
+ * Each dimension \em d is stored as round(x_d / s_d), s_d = max|x_d| / 127 over the training data,
+ * so it is reconstructed within s_d/2 of its value for training values and clamped beyond them.
+ * Output rows are the signed codes followed by the quint16 index of the scales, compare with br::SymmetricQuantizationDistance.
+ * \author Josh Klontz \cite jklontz
+ */
+class SymmetricQuantizationTransform : public Transform
+{
+    Q_OBJECT
+
+    quint16 index;
+
+public:
+    SymmetricQuantizationTransform()
+    {
+        if (SymmetricQuantizationScales.size() > std::numeric_limits<quint16>::max())
+            qFatal("Out of scale space!"); // Unlikely
+
+        static QMutex mutex;
+        QMutexLocker locker(&mutex);
+        index = SymmetricQuantizationScales.size();
+        SymmetricQuantizationScales.append(Mat());
+    }
+
+private:
+    void train(const TemplateList &src)
+    {
+        const Mat data = OpenCVUtils::toMat(src.data());
+        Mat &scales = SymmetricQuantizationScales[index];
+        // The second row holds the squared scales that weight the distance
+        scales = Mat(2, data.cols, CV_32FC1);
+        for (int j=0; j<data.cols; j++) {
+            double minVal, maxVal;
+            minMaxLoc(data.col(j), &minVal, &maxVal);
+            const double range = std::max(fabs(minVal), fabs(maxVal));
+            scales.at<float>(0, j) = (range > 0) ? range/127 : 1;
+            scales.at<float>(1, j) = scales.at<float>(0, j) * scales.at<float>(0, j);
+        }
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const Mat m = src.m().reshape(1, 1);
+        const Mat &scales = SymmetricQuantizationScales[index];
+        if ((m.type() != CV_32FC1) || (m.cols != scales.cols))
+            qFatal("Expected CV_32FC1 matrix with %d elements.", scales.cols);
+
+        dst = Mat(1, m.cols+sizeof(quint16), CV_8UC1);
+        schar *codes = (schar*)dst.m().data;
+        const float *x = m.ptr<float>();
+        const float *s = scales.ptr<float>(0);
+        for (int j=0; j<m.cols; j++)
+            codes[j] = schar(cvRound(std::max(-127.f, std::min(127.f, x[j] / s[j]))));
+        memcpy(codes + m.cols, &index, sizeof(quint16));
+    }
+
+    void store(QDataStream &stream) const
+    {
+        stream << index << SymmetricQuantizationScales[index];
+    }
+
+    void load(QDataStream &stream)
+    {
+        stream >> index;
+        while (SymmetricQuantizationScales.size() <= index)
+            SymmetricQuantizationScales.append(Mat());
+        stream >> SymmetricQuantizationScales[index];
+    }
+};
+
+BR_REGISTER(Transform, SymmetricQuantizationTransform)
+
+/*!
+ * \ingroup distances
+ * \brief Squared L2 distance, or cosine similarity, between templates of br::SymmetricQuantizationTransform.
+ *
+ * Codes are compared as integers and weighted by the squared scale of their dimension,
+ * equal to the distance between the reconstructed features.
+ * \author Josh Klontz \cite jklontz
+ */
+class SymmetricQuantizationDistance : public Distance
+{
+    Q_OBJECT
+    Q_PROPERTY(bool cosine READ get_cosine WRITE set_cosine RESET reset_cosine STORED false)
+    BR_PROPERTY(bool, cosine, false)
+
+    // The scales index trails the codes so they start on the row's alignment
+    static inline const float *weights(const uchar *data, int elements)
+    {
+        quint16 index;
+        memcpy(&index, data + elements, sizeof(quint16));
+        return SymmetricQuantizationScales[index].ptr<float>(1);
+    }
+
+    inline float score(const schar *a, const schar *b, const float *w, int elements) const
+    {
+        if (!cosine) {
+            float distance = 0;
+            for (int j=0; j<elements; j++) {
+                const int difference = a[j] - b[j];
+                distance += w[j] * (difference * difference);
+            }
+            return distance;
+        }
+
+        float dot = 0, aa = 0, bb = 0;
+        for (int j=0; j<elements; j++) {
+            dot += w[j] * (a[j] * b[j]);
+            aa  += w[j] * (a[j] * a[j]);
+            bb  += w[j] * (b[j] * b[j]);
+        }
+        return ((aa > 0) && (bb > 0)) ? dot / sqrt(aa * bb) : 0;
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        const int elements = a.m().total() - sizeof(quint16);
+        const float *w = weights(a.m().data, elements);
+        return score((const schar*)a.m().data, (const schar*)b.m().data, w, elements);
+    }
+
+    bool compare(const Mat &targets, const Mat &query, float *scores) const
+    {
+        if (targets.type() != CV_8UC1) return false;
+        const int elements = query.cols - sizeof(quint16);
+        const float *w = weights(query.data, elements);
+        for (int i=0; i<targets.rows; i++)
+            scores[i] = score((const schar*)targets.ptr(i), (const schar*)query.data, w, elements);
+        return true;
+    }
+};
+
+BR_REGISTER(Distance, SymmetricQuantizationDistance)
+
 } // namespace br
 
 #include "quantize.moc"
@@ -51,16 +51,12 @@ class BayesianQuantizationTransform : public Transform
 //        computeThresholdsRecursive(cumulativeGenuines.mid(index), cumulativeImpostors.mid(index), thresholds, thresholdIndex);
     }
 
-    static void computeThresholds(const Mat &data, const QList<int> &labels, float *thresholds)
+    static void computeThresholds(const float *vals, const QVector<int> &labels, float *thresholds)
     {
-        const QList<float> vals = OpenCVUtils::matrixToVector<float>(data);
-        if (vals.size() != labels.size())
-            qFatal("Logic error.");
-
         typedef QPair<float,bool> LabeledScore;
-        QList<LabeledScore> labeledScores; labeledScores.reserve(vals.size());
-        for (int i=0; i<vals.size(); i++)
-            for (int j=i+1; j<vals.size(); j++)
+        QList<LabeledScore> labeledScores; labeledScores.reserve(labels.size());
+        for (int i=0; i<labels.size(); i++)
+            for (int j=i+1; j<labels.size(); j++)
                 labeledScores.append(LabeledScore(fabs(vals[i]-vals[j]), labels[i] == labels[j]));
         std::sort(labeledScores.begin(), labeledScores.end());
 
@@ -78,17 +74,34 @@ class BayesianQuantizationTransform : public Transform
         computeThresholdsRecursive(cumulativeGenuines, cumulativeImpostors, thresholds, 127);
     }
 
+    // Fits dimension i from row i of the transposed training data for Common::ParallelFor
+    struct Thresholds
+    {
+        const Mat *dimensions;
+        const QVector<int> *labels;
+        float *thresholds;
+
+        void operator()(int i) const
+        {
+            computeThresholds(dimensions->ptr<float>(i), *labels, &thresholds[i*256]);
+        }
+    };
+
     void train(const TemplateList &src)
     {
-        const Mat data = OpenCVUtils::toMat(src.data());
-        const QList<int> labels = src.indexProperty(inputVariable);
+        // One contiguous row per dimension, so each dimension's pass reads sequentially
+        const Mat dimensions = OpenCVUtils::toMat(src.data()).t();
+        const QVector<int> labels = src.indexProperty(inputVariable).toVector();
+        if (dimensions.cols != labels.size())
+            qFatal("Logic error.");
 
-        thresholds = QVector<float>(256*data.cols);
+        thresholds = QVector<float>(256*dimensions.rows);
 
-        QFutureSynchronizer<void> futures;
-        for (int i=0; i<data.cols; i++)
-            futures.addFuture(QtConcurrent::run(&BayesianQuantizationTransform::computeThresholds, data.col(i), labels, &thresholds.data()[i*256]));
-        futures.waitForFinished();
+        Thresholds fit;
+        fit.dimensions = &dimensions;
+        fit.labels = &labels;
+        fit.thresholds = thresholds.data();
+        Common::ParallelFor(0, dimensions.rows, fit, Globals->parallelism);
     }
 
     void project(const Template &src, Template &dst) const
@@ -17,6 +17,7 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include "openbr_internal.h"
 
+#include "openbr/core/arena.h"
 #include "openbr/core/opencvutils.h"
 
 using namespace cv;
@@ -29,6 +30,7 @@ namespace br
  * \brief Performs a two or three point registration.
  * \author Josh Klontz \cite jklontz
  * \note Method: Area should be used for shrinking an image, Cubic for slow but accurate enlargment, Bilin for fast enlargement.
+ * \note Set \em grayscale to fuse a following <tt>Cvt(Gray)</tt>, converting only the registered pixels instead of the entire source image.
  */
 class AffineTransform : public UntrainableTransform
 {
@@ -53,6 +55,7 @@ private:
     Q_PROPERTY(float x3 READ get_x3 WRITE set_x3 RESET reset_x3 STORED false)
     Q_PROPERTY(float y3 READ get_y3 WRITE set_y3 RESET reset_y3 STORED false)
     Q_PROPERTY(Method method READ get_method WRITE set_method RESET reset_method STORED false)
+    Q_PROPERTY(bool grayscale READ get_grayscale WRITE set_grayscale RESET reset_grayscale STORED false)
     BR_PROPERTY(int, width, 64)
     BR_PROPERTY(int, height, 64)
     BR_PROPERTY(float, x1, 0)
@@ -62,6 +65,7 @@ private:
     BR_PROPERTY(float, x3, -1)
     BR_PROPERTY(float, y3, -1)
     BR_PROPERTY(Method, method, Bilin)
+    BR_PROPERTY(bool, grayscale, false)
 
     static Point2f getThirdAffinePoint(const Point2f &a, const Point2f &b)
     {
@@ -91,7 +95,9 @@ private:
             const QList<Point2f> landmarks = OpenCVUtils::toPoints(src.file.points());
 
             if ((landmarks.size() < 2) || (!twoPoints && (landmarks.size() < 3))) {
-                resize(src, dst, Size(width, height));
+                Mat m = MatArena::get(height, width, src.m().type());
+                resize(src, m, Size(width, height));
+                output(m, dst);
                 return;
             } else {
                 srcPoints[0] = landmarks[0];
@@ -105,7 +111,22 @@ private:
         }
         if (twoPoints) srcPoints[2] = getThirdAffinePoint(srcPoints[0], srcPoints[1]);
 
-        warpAffine(src, dst, getAffineTransform(srcPoints, dstPoints), Size(width, height), method);
+        Mat m = MatArena::get(height, width, src.m().type());
+        warpAffine(src, m, getAffineTransform(srcPoints, dstPoints), Size(width, height), method);
+        output(m, dst);
+    }
+
+    void output(Mat &m, Template &dst) const
+    {
+        if (!grayscale || (m.channels() == 1)) {
+            dst = m;
+            return;
+        }
+
+        Mat gray = MatArena::get(height, width, CV_MAKETYPE(m.depth(), 1));
+        cvtColor(m, gray, m.channels() == 4 ? CV_BGRA2GRAY : CV_BGR2GRAY);
+        MatArena::put(m);
+        dst = gray;
     }
 };
 
@@ -1,4 +1,8 @@
+#include <QHash>
+#include <QVector>
+#include <opencv2/core/core.hpp>
 #include <stdint.h>
+#include <string.h>
 #include "openbr_internal.h"
 
 using namespace cv;
@@ -6,9 +10,48 @@ using namespace cv;
 namespace br
 {
 
+// A word of a sentence, either the raw matrix of rows written by earlier versions of Sentence or its summary:
+// the squared norm of its rows and the sum of its rows in double precision.
+// Summaries let a pair of words be compared in time linear in the columns, since
+// sum_ij |a_i - b_j|^2 = |B| sum_i |a_i|^2 + |A| sum_j |b_j|^2 - 2 (sum_i a_i).(sum_j b_j)
+struct SentenceWord
+{
+    int32_t word, rows, columns;
+    const float *data;
+    const double *sums;
+    double squares;
+
+    // Reads the word at buffer and returns the start of the next one
+    const uchar *read(const uchar *buffer)
+    {
+        word = *reinterpret_cast<const int32_t*>(buffer);
+        rows = *reinterpret_cast<const int32_t*>(buffer+4);
+        columns = *reinterpret_cast<const int32_t*>(buffer+8);
+        if (rows < 0) {
+            rows = -rows;
+            data = NULL;
+            squares = *reinterpret_cast<const double*>(buffer+16);
+            sums = reinterpret_cast<const double*>(buffer+24);
+            return buffer + 24 + 8*columns;
+        } else {
+            data = reinterpret_cast<const float*>(buffer+12);
+            sums = NULL;
+            return buffer + 12 + 4*rows*columns;
+        }
+    }
+
+    static int bytes(int columns)
+    {
+        return 24 + 8*columns;
+    }
+};
+
 /*!
  * \ingroup transforms
  * \brief Ordered words
+ *
+ * Each matrix of the template is a word, identified by its index, of feature vector rows.
+ * Only the sum and squared norm of a word's rows are kept, which is all SentenceSimilarity needs.
  * \author Josh Klontz \cite jklontz
  */
 class SentenceTransform : public UntrainableMetaTransform
@@ -17,18 +60,27 @@ class SentenceTransform : public UntrainableMetaTransform
 
     void project(const Template &src, Template &dst) const
     {
-        QByteArray sentence;
-        QDataStream stream(&sentence, QIODevice::WriteOnly);
+        int size = 0;
+        for (int i=0; i<src.size(); i++)
+            if (src[i].data) size += SentenceWord::bytes(src[i].total() * src[i].channels() / std::max(1, src[i].rows));
+
+        dst.file = src.file;
+        dst.m() = Mat(1, size, CV_8UC1, Scalar(0));
+        uchar *buffer = dst.m().data;
         for (int i=0; i<src.size(); i++) {
-            const Mat &m = src[i];
-            if (!m.data) continue;
-            stream.writeRawData((const char*)&i, 4);
-            stream.writeRawData((const char*)&m.rows, 4);
-            stream.writeRawData((const char*)&m.cols, 4);
-            stream.writeRawData((const char*)m.data, 4*m.rows*m.cols);
+            if (!src[i].data) continue;
+            Mat m;
+            src[i].reshape(1, src[i].rows).convertTo(m, CV_64F);
+            const int32_t header[4] = { i, -m.rows, m.cols, 0 };
+            memcpy(buffer, header, 16);
+
+            Mat sums;
+            reduce(m, sums, 0, CV_REDUCE_SUM, CV_64F);
+            const double squares = m.dot(m);
+            memcpy(buffer+16, &squares, 8);
+            memcpy(buffer+24, sums.data, 8*m.cols);
+            buffer += SentenceWord::bytes(m.cols);
         }
-        dst.file = src.file;
-        dst.m() = Mat(1, sentence.size(), CV_8UC1, sentence.data()).clone();
     }
 };
 
@@ -37,52 +89,113 @@ BR_REGISTER(Transform, SentenceTransform)
 /*!
  * \ingroup distances
  * \brief Distance between sentences
+ *
+ * Pairs without a word in common score \c -FLT_MAX, found from an inverted index of the targets' words before comparing them.
  * \author Josh Klontz \cite jklontz
  */
 class SentenceSimilarityDistance : public Distance
 {
     Q_OBJECT
 
+    static double distance(const SentenceWord &a, const SentenceWord &b)
+    {
+        if (a.sums && b.sums) {
+            double dot = 0;
+            for (int k=0; k<a.columns; k++)
+                dot += a.sums[k] * b.sums[k];
+            return std::max(0.0, b.rows*a.squares + a.rows*b.squares - 2*dot);
+        }
+
+        if (a.data && b.data) {
+            double distance = 0;
+            for (int i=0; i<a.rows; i++)
+                for (int j=0; j<b.rows; j++)
+                    for (int k=0; k<a.columns; k++) {
+                        const double difference = a.data[i*a.columns+k] - b.data[j*b.columns+k];
+                        distance += difference * difference;
+                    }
+            return distance;
+        }
+
+        // A raw word against a summarized one, summarize the raw one
+        const SentenceWord &raw = a.data ? a : b;
+        const SentenceWord &summary = a.data ? b : a;
+        QVector<double> sums(raw.columns, 0);
+        double squares = 0;
+        for (int i=0; i<raw.rows; i++)
+            for (int k=0; k<raw.columns; k++) {
+                const double value = raw.data[i*raw.columns+k];
+                sums[k] += value;
+                squares += value * value;
+            }
+        SentenceWord summarized = raw;
+        summarized.data = NULL;
+        summarized.sums = sums.data();
+        summarized.squares = squares;
+        return distance(summarized, summary);
+    }
+
     float compare(const Template &a, const Template &b) const
     {
-        uchar *aBuffer = a.m().data;
-        uchar *bBuffer = b.m().data;
+        const uchar *aBuffer = a.m().data;
+        const uchar *bBuffer = b.m().data;
         const uchar *aEnd = aBuffer + a.m().cols;
         const uchar *bEnd = bBuffer + b.m().cols;
 
-        int32_t aWord, bWord, aRows, bRows, aColumns, bColumns;
-        float *aData, *bData;
-        aWord = aRows = aColumns = -2;
-        bWord = bRows = bColumns = -1;
-        aData = bData = NULL;
+        SentenceWord aWord, bWord;
+        aWord.word = -2;
+        bWord.word = -1;
 
-        float distance = 0;
+        double distance = 0;
         int comparisons = 0;
         while (true) {
-            if (aWord < bWord) {
+            if (aWord.word < bWord.word) {
                 if (aBuffer == aEnd) return distance == 0 ? -std::numeric_limits<float>::max() : comparisons / distance;
-                aWord = *reinterpret_cast<int32_t*>(aBuffer);
-                aRows = *reinterpret_cast<int32_t*>(aBuffer+4);
-                aColumns = *reinterpret_cast<int32_t*>(aBuffer+8);
-                aData = reinterpret_cast<float*>(aBuffer+12);
-                aBuffer += 12 + 4*aRows*aColumns;
-            } else if (bWord < aWord) {
+                aBuffer = aWord.read(aBuffer);
+            } else if (bWord.word < aWord.word) {
                 if (bBuffer == bEnd) return comparisons == 0 ? -std::numeric_limits<float>::max() : comparisons / distance;
-                bWord = *reinterpret_cast<int32_t*>(bBuffer);
-                bRows = *reinterpret_cast<int32_t*>(bBuffer+4);
-                bColumns = *reinterpret_cast<int32_t*>(bBuffer+8);
-                bData = reinterpret_cast<float*>(bBuffer+12);
-                bBuffer += 12 + 4*bRows*bColumns;
+                bBuffer = bWord.read(bBuffer);
             } else {
-                for (int i=0; i<aRows; i++)
-                    for (int j=0; j<bRows; j++)
-                        for (int k=0; k<aColumns; k++)
-                            distance += pow(aData[i*aColumns+k] - bData[j*bColumns+k], 2.f);
-                comparisons += aRows * bRows * aColumns;
-                aWord = -2;
-                bWord = -1;
+                distance += SentenceSimilarityDistance::distance(aWord, bWord);
+                comparisons += aWord.rows * bWord.rows * aWord.columns;
+                aWord.word = -2;
+                bWord.word = -1;
+            }
+        }
+    }
+
+    static QVector<int32_t> words(const Template &t)
+    {
+        QVector<int32_t> words;
+        const uchar *buffer = t.m().data;
+        const uchar *end = buffer + t.m().cols;
+        SentenceWord word;
+        while (buffer != end) {
+            buffer = word.read(buffer);
+            words.append(word.word);
+        }
+        return words;
+    }
+
+    // Sentences sharing no word are never compared
+    bool exclude(const TemplateList &targets, const TemplateList &queries, Mat &excluded) const
+    {
+        QHash< int32_t, QVector<int> > index;
+        for (int j=0; j<targets.size(); j++)
+            foreach (int32_t word, words(targets[j]))
+                index[word].append(j);
+
+        excluded = Mat(queries.size(), targets.size(), CV_8UC1, Scalar(1));
+        for (int i=0; i<queries.size(); i++) {
+            uchar *row = excluded.ptr<uchar>(i);
+            foreach (int32_t word, words(queries[i])) {
+                QHash< int32_t, QVector<int> >::const_iterator it = index.constFind(word);
+                if (it == index.constEnd()) continue;
+                foreach (int j, it.value())
+                    row[j] = 0;
             }
         }
+        return true;
     }
 };
 
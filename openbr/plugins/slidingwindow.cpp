@@ -6,6 +6,8 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <Eigen/Dense>
+#include <algorithm>
+#include <limits>
 
 using namespace cv;
 using namespace Eigen;
@@ -36,6 +38,9 @@ static float getAspectRatio(const TemplateList &data)
  * \ingroup transforms
  * \brief Applies a transform to a sliding window.
  *        Discards negative detections.
+ *
+ * If the template's metadata holds a list of rects under \em searchRegions, only windows inside those rects,
+ * grown by \em searchMargin of their size on each side, are evaluated.
  * \author Austin Blanton \cite imaus10
  */
 class SlidingWindowTransform : public Transform
@@ -47,15 +52,18 @@ class SlidingWindowTransform : public Transform
     Q_PROPERTY(float threshold READ get_threshold WRITE set_threshold RESET reset_threshold STORED false)
     Q_PROPERTY(float stepFraction READ get_stepFraction WRITE set_stepFraction RESET reset_stepFraction STORED false)
     Q_PROPERTY(int ignoreBorder READ get_ignoreBorder WRITE set_ignoreBorder RESET reset_ignoreBorder STORED true)
+    Q_PROPERTY(QString searchRegions READ get_searchRegions WRITE set_searchRegions RESET reset_searchRegions STORED false)
+    Q_PROPERTY(float searchMargin READ get_searchMargin WRITE set_searchMargin RESET reset_searchMargin STORED false)
     BR_PROPERTY(br::Transform *, transform, NULL)
     BR_PROPERTY(int, windowWidth, 24)
     BR_PROPERTY(bool, takeFirst, false)
     BR_PROPERTY(float, threshold, 0)
     BR_PROPERTY(float, stepFraction, 0.25)
     BR_PROPERTY(int, ignoreBorder, 0)
+    BR_PROPERTY(QString, searchRegions, "SearchRegions")
+    BR_PROPERTY(float, searchMargin, 0)
 
 private:
-    int windowHeight;
     bool skipProject;
 
     void train(const TemplateList &data)
@@ -98,31 +106,58 @@ private:
     }
 
  protected:
-     void projectHelp(const Template &src, Template &dst, int windowWidth, int windowHeight, float scale = 1) const
-     {
+    int windowHeight;
 
+    // extent is 1 when src is an integral image, whose windows need one extra row and column
+    void projectHelp(const Template &src, Template &dst, int windowWidth, int windowHeight, float scale = 1, int extent = 0) const
+    {
         dst = src;
         if (skipProject) {
             dst = src;
             return;
         }
 
-        Template windowTemplate(src.file, src);
+        // Search regions are in image coordinates, windows are placed in the coordinates of this scale
+        QList<Rect> rois;
+        if (!searchRegions.isEmpty() && src.file.contains(searchRegions)) {
+            QList<QRectF> regions;
+            foreach (const QRectF &region, src.file.getList<QRectF>(searchRegions, QList<QRectF>()))
+                regions.append(QRectF(region.x() / scale, region.y() / scale, region.width() / scale + extent, region.height() / scale + extent));
+            rois = OpenCVUtils::searchRegions(regions, src.m().size(), searchMargin);
+        } else {
+            rois.append(Rect(0, 0, src.m().cols, src.m().rows));
+        }
+
         QList<float> confidences = dst.file.getList<float>("Confidences", QList<float>());
-        for (float y = 0; y + windowHeight < src.m().rows; y += windowHeight*stepFraction) {
-            for (float x = 0; x + windowWidth < src.m().cols; x += windowWidth*stepFraction) {
-                Mat windowMat(src, Rect(x + ignoreBorder, y + ignoreBorder, windowWidth - ignoreBorder * 2, windowHeight - ignoreBorder * 2));
-                windowTemplate.replace(0,windowMat);
-                Template detect;
-                transform->project(windowTemplate, detect);
-                float conf = detect.m().at<float>(0);
-
-                // the result will be in the Label
-                if (conf > threshold) {
-                    dst.file.appendRect(QRectF(x*scale, y*scale, windowWidth*scale, windowHeight*scale));
-                    confidences.append(conf);
-                    if (takeFirst)
-                        return;
+        foreach (const Rect &roi, rois) {
+            for (float y = roi.y; y + windowHeight < roi.y + roi.height; y += windowHeight*stepFraction) {
+                // Evaluate a row of adjacent windows as one batch
+                QList<float> xs;
+                TemplateList windows;
+                for (float x = roi.x; x + windowWidth < roi.x + roi.width; x += windowWidth*stepFraction) {
+                    Mat windowMat(src, Rect(x + ignoreBorder, y + ignoreBorder, windowWidth - ignoreBorder * 2 + extent, windowHeight - ignoreBorder * 2 + extent));
+                    windows.append(Template(src.file, windowMat));
+                    xs.append(x);
+                }
+                if (windows.isEmpty()) continue;
+
+                TemplateList detections;
+                transform->project(windows, detections);
+                if (detections.size() != windows.size())
+                    qFatal("SlidingWindow expects one detection per window.");
+
+                for (int i=0; i<detections.size(); i++) {
+                    float conf = detections[i].m().at<float>(0);
+
+                    // the result will be in the Label
+                    if (conf > threshold) {
+                        dst.file.appendRect(QRectF(xs[i]*scale, y*scale, windowWidth*scale, windowHeight*scale));
+                        confidences.append(conf);
+                        if (takeFirst) {
+                            dst.file.setList<float>("Confidences", confidences);
+                            return;
+                        }
+                    }
                 }
             }
         }
@@ -132,10 +167,127 @@ private:
 
 BR_REGISTER(Transform, SlidingWindowTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief A soft cascade of increasingly expensive stages for SlidingWindowTransform.
+ *
+ * Each stage is trained on the samples the previous stages kept, then given the rejection threshold that
+ * retains \em detectionRate of the positive samples. Windows scoring below a stage's threshold are rejected
+ * with the lowest score and without evaluating the remaining stages, the last stage's score is returned for windows that pass them all.
+ * \author Josh Klontz \cite jklontz
+ */
+class SoftCascadeTransform : public Transform
+{
+    Q_OBJECT
+    Q_PROPERTY(QList<br::Transform*> stages READ get_stages WRITE set_stages RESET reset_stages)
+    Q_PROPERTY(float detectionRate READ get_detectionRate WRITE set_detectionRate RESET reset_detectionRate STORED false)
+    Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
+    Q_PROPERTY(QString positive READ get_positive WRITE set_positive RESET reset_positive STORED false)
+    BR_PROPERTY(QList<br::Transform*>, stages, QList<br::Transform*>())
+    BR_PROPERTY(float, detectionRate, 0.99)
+    BR_PROPERTY(QString, inputVariable, "Label")
+    BR_PROPERTY(QString, positive, "pos")
+
+    QList<float> thresholds;
+
+    static float score(const Template &t)
+    {
+        return t.m().at<float>(0);
+    }
+
+    void train(const TemplateList &data)
+    {
+        if (stages.isEmpty()) qFatal("SoftCascade expects at least one stage.");
+
+        thresholds.clear();
+        TemplateList remaining = data;
+        for (int i=0; i<stages.size(); i++) {
+            if (stages[i]->trainable)
+                stages[i]->train(remaining);
+            if (i == stages.size()-1)
+                break;
+
+            TemplateList scored;
+            stages[i]->project(remaining, scored);
+
+            QList<float> positives;
+            for (int j=0; j<remaining.size(); j++)
+                if (remaining[j].file.get<QString>(inputVariable, QString()) == positive)
+                    positives.append(score(scored[j]));
+            std::sort(positives.begin(), positives.end());
+            const float threshold = positives.isEmpty() ? -std::numeric_limits<float>::max()
+                                                        : positives[qMin(positives.size()-1, int((1-detectionRate) * positives.size()))];
+            thresholds.append(threshold);
+
+            TemplateList survivors;
+            for (int j=0; j<remaining.size(); j++)
+                if (score(scored[j]) >= threshold)
+                    survivors.append(remaining[j]);
+            qDebug("SoftCascade stage %d keeps %d of %d samples.", i, survivors.size(), remaining.size());
+            remaining = survivors;
+        }
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        TemplateList dsts;
+        project(TemplateList() << src, dsts);
+        dst = dsts.first();
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        dst.clear();
+        QList<int> active;
+        for (int i=0; i<src.size(); i++) {
+            dst.append(Template(src[i].file, Mat(1, 1, CV_32FC1, Scalar(-std::numeric_limits<float>::max()))));
+            active.append(i);
+        }
+
+        // Only windows that survived every previous stage reach the next one
+        for (int i=0; i<stages.size() && !active.isEmpty(); i++) {
+            TemplateList in, out;
+            foreach (int index, active)
+                in.append(src[index]);
+            stages[i]->project(in, out);
+
+            QList<int> survivors;
+            for (int j=0; j<active.size(); j++) {
+                if (i == stages.size()-1) {
+                    dst[active[j]] = out[j];
+                } else if (score(out[j]) >= thresholds[i]) {
+                    survivors.append(active[j]);
+                }
+            }
+            active = survivors;
+        }
+    }
+
+    void store(QDataStream &stream) const
+    {
+        foreach (const Transform *stage, stages)
+            stage->store(stream);
+        stream << thresholds;
+    }
+
+    void load(QDataStream &stream)
+    {
+        foreach (Transform *stage, stages)
+            stage->load(stream);
+        stream >> thresholds;
+    }
+};
+
+BR_REGISTER(Transform, SoftCascadeTransform)
+
 /*!
  * \ingroup transforms
  * \brief Overloads SlidingWindowTransform for integral images that should be
  *        sampled at multiple scales.
+ *
+ * Reads the pyramid of integral images cached by IntegralPyramidTransform, so channels are
+ * integrated once per level and every window is a view into the cached level.
+ * A template holding a single integral image is treated as one level.
  * \author Josh Klontz \cite jklontz
  */
 class IntegralSlidingWindowTransform : public SlidingWindowTransform
@@ -145,8 +297,21 @@ class IntegralSlidingWindowTransform : public SlidingWindowTransform
  private:
     void project(const Template &src, Template &dst) const
     {
-        // TODO: call SlidingWindowTransform::project on multiple scales
-        SlidingWindowTransform::projectHelp(src, dst, 24, 24);
+        const QList<float> scales = src.file.getList<float>("Scales", QList<float>());
+        if (scales.size() != src.size()) {
+            SlidingWindowTransform::projectHelp(src, dst, windowWidth, windowHeight, src.file.get<float>("scale", 1), 1);
+            return;
+        }
+
+        File file = src.file;
+        for (int i=0; i<src.size(); i++) {
+            Template level(file, src[i]);
+            SlidingWindowTransform::projectHelp(level, dst, windowWidth, windowHeight, scales[i], 1);
+            file = dst.file;
+            if (takeFirst && !file.rects().isEmpty())
+                break;
+        }
+        dst = Template(file, src);
     }
 };
 
@@ -334,11 +499,17 @@ BR_REGISTER(Transform, Detector)
 /*!
  * \ingroup transforms
  * \brief Detects objects with OpenCV's built-in HOG detection.
+ *
+ * Honors \em searchRegions and \em searchMargin like SlidingWindowTransform.
  * \author Austin Blanton \cite imaus10
  */
 class HOGDetectTransform : public UntrainableTransform
 {
     Q_OBJECT
+    Q_PROPERTY(QString searchRegions READ get_searchRegions WRITE set_searchRegions RESET reset_searchRegions STORED false)
+    Q_PROPERTY(float searchMargin READ get_searchMargin WRITE set_searchMargin RESET reset_searchMargin STORED false)
+    BR_PROPERTY(QString, searchRegions, "SearchRegions")
+    BR_PROPERTY(float, searchMargin, 0)
 
     HOGDescriptor hog;
 
@@ -352,9 +523,19 @@ class HOGDetectTransform : public UntrainableTransform
         dst = src;
         std::vector<Rect> objLocs;
         QList<Rect> rects;
-        hog.detectMultiScale(src, objLocs);
-        foreach (const Rect &obj, objLocs)
-            rects.append(obj);
+        if (!searchRegions.isEmpty() && src.file.contains(searchRegions)) {
+            const Mat &m = src;
+            foreach (const Rect &roi, OpenCVUtils::searchRegions(src.file.getList<QRectF>(searchRegions, QList<QRectF>()), m.size(), searchMargin)) {
+                if ((roi.width < hog.winSize.width) || (roi.height < hog.winSize.height)) continue;
+                hog.detectMultiScale(m(roi), objLocs);
+                foreach (const Rect &obj, objLocs)
+                    rects.append(obj + roi.tl());
+            }
+        } else {
+            hog.detectMultiScale(src, objLocs);
+            foreach (const Rect &obj, objLocs)
+                rects.append(obj);
+        }
         dst.file.setRects(rects);
     }
 };
@@ -48,6 +48,10 @@ BR_REGISTER(Initializer, StasmInitializer)
 /*!
  * \ingroup transforms
  * \brief Wraps STASM key point detector
+ *
+ * With \em useRects the shapes are fit at the template's rects, for example from an upstream \c Cascade,
+ * all in one call instead of running Stasm's face detector again.
+ * Each face's points are appended in rect order and \c StasmRightEye and \c StasmLeftEye are those of the first face found.
  * \author Scott Klum \cite sklum
  */
 class StasmTransform : public UntrainableTransform
@@ -60,6 +64,8 @@ class StasmTransform : public UntrainableTransform
     BR_PROPERTY(bool, clearLandmarks, false)
     Q_PROPERTY(QStringList pinEyes READ get_pinEyes WRITE set_pinEyes RESET reset_pinEyes STORED false)
     BR_PROPERTY(QStringList, pinEyes, QStringList())
+    Q_PROPERTY(bool useRects READ get_useRects WRITE set_useRects RESET reset_useRects STORED false)
+    BR_PROPERTY(bool, useRects, false)
 
     Resource<StasmCascadeClassifier> stasmCascadeResource;
 
@@ -120,15 +126,48 @@ class StasmTransform : public UntrainableTransform
             }
         }
 
-        if (!foundFace) stasm_search_single(&foundFace, landmarks, reinterpret_cast<const char*>(src.m().data), src.m().cols, src.m().rows, *stasmCascade, NULL, NULL);
-
-        if (stasm3Format) {
-            nLandmarks = 76;
-            stasm_convert_shape(landmarks, nLandmarks);
+        // Landmarks of every face found, 2 * stasm_NLANDMARKS values each
+        QVector<float> shapes;
+        if (foundFace) {
+            shapes = QVector<float>(2 * stasm_NLANDMARKS);
+            qCopy(landmarks, landmarks + 2 * stasm_NLANDMARKS, shapes.begin());
+        } else if (useRects && !src.file.rects().isEmpty()) {
+            const QList<QRectF> rects = src.file.rects();
+            QVector<int> faceRects(4 * rects.size());
+            for (int i=0; i<rects.size(); i++) {
+                const QRect rect = rects[i].toRect();
+                faceRects[4*i+0] = rect.x();
+                faceRects[4*i+1] = rect.y();
+                faceRects[4*i+2] = rect.width();
+                faceRects[4*i+3] = rect.height();
+            }
+            QVector<int> found(rects.size());
+            QVector<float> candidates(2 * stasm_NLANDMARKS * rects.size());
+            stasm_search_rects(rects.size(), faceRects.data(), found.data(), candidates.data(),
+                               reinterpret_cast<const char*>(src.m().data), src.m().cols, src.m().rows, *stasmCascade);
+            for (int i=0; i<rects.size(); i++)
+                if (found[i]) shapes += candidates.mid(2 * stasm_NLANDMARKS * i, 2 * stasm_NLANDMARKS);
+            foundFace = !shapes.isEmpty();
+        } else {
+            stasm_search_single(&foundFace, landmarks, reinterpret_cast<const char*>(src.m().data), src.m().cols, src.m().rows, *stasmCascade, NULL, NULL);
+            if (foundFace) {
+                shapes = QVector<float>(2 * stasm_NLANDMARKS);
+                qCopy(landmarks, landmarks + 2 * stasm_NLANDMARKS, shapes.begin());
+            }
         }
 
         stasmCascadeResource.release(stasmCascade);
 
+        const int faces = shapes.size() / (2 * stasm_NLANDMARKS);
+        if (stasm3Format) nLandmarks = 76;
+        QList<QPointF> points;
+        for (int face=0; face<faces; face++) {
+            float *shape = shapes.data() + 2 * stasm_NLANDMARKS * face;
+            if (stasm3Format) stasm_convert_shape(shape, nLandmarks);
+            for (int i = 0; i < nLandmarks; i++)
+                points.append(QPointF(shape[2 * i], shape[2 * i + 1]));
+        }
+
         // For convenience, if these are the only points/rects we want to deal with as the algorithm progresses
         if (clearLandmarks) {
             dst.file.clearPoints();
@@ -139,11 +178,6 @@ class StasmTransform : public UntrainableTransform
             if (Globals->verbose) qWarning("No face found in %s.", qPrintable(src.file.fileName()));
             dst.file.set("FTE",true);
         } else {
-            QList<QPointF> points;
-            for (int i = 0; i < nLandmarks; i++) {
-                QPointF point(landmarks[2 * i], landmarks[2 * i + 1]);
-                points.append(point);
-            }
             dst.file.set("StasmRightEye", points[38]);
             dst.file.set("StasmLeftEye", points[39]);
             dst.file.appendPoints(points);
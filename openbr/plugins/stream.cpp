@@ -1,14 +1,22 @@
 #include <QReadWriteLock>
 #include <QWaitCondition>
-#include <QThreadPool>
+#include <QAtomicInt>
+#include <QRunnable>
+#include <QThread>
 #include <QSemaphore>
+#include <QElapsedTimer>
 #include <QMap>
 #include <opencv/highgui.h>
 #include <QtConcurrent>
 #include "openbr_internal.h"
 
 #include "openbr/core/common.h"
+#include "openbr/core/arena.h"
+#include "openbr/core/memory.h"
+#include "openbr/core/metrics.h"
 #include "openbr/core/opencvutils.h"
+#include "openbr/core/profiler.h"
+#include "openbr/core/progress.h"
 #include "openbr/core/qtutils.h"
 
 using namespace cv;
@@ -22,7 +30,8 @@ class Idiocy : public QObject
 public:
     enum StreamModes { StreamVideo,
                      DistributeFrames,
-                     Auto};
+                     Auto,
+                     StreamGallery};
 
     Q_ENUMS(StreamModes)
 };
@@ -30,17 +39,24 @@ public:
 class FrameData
 {
 public:
+    FrameData() : sequenceNumber(0), readTime(0), queuedTime(0), reorderTime(0) {}
+
     int sequenceNumber;
     TemplateList data;
+    qint64 readTime; // Milliseconds since the data source opened
+    qint64 queuedTime; // Profiler::now() when handed to the next stage
+    qint64 reorderTime; // Profiler::now() when buffered ahead of an earlier frame
 };
 
 // A buffer shared between adjacent processing stages in a stream
 class SharedBuffer
 {
 public:
-    SharedBuffer() {}
+    SharedBuffer() : profileTrack(-1) {}
     virtual ~SharedBuffer() {}
 
+    int profileTrack; // Of the stage reading from this buffer
+
     virtual void addItem(FrameData * input)=0;
     virtual void reset()=0;
 
@@ -63,6 +79,7 @@ public:
     {
         QMutexLocker bufferLock(&bufferGuard);
 
+        input->reorderTime = (Profiler::enabled() && (input->sequenceNumber != next_target)) ? Profiler::now() : 0;
         buffer.insert(input->sequenceNumber, input);
     }
 
@@ -71,6 +88,8 @@ public:
         QMutexLocker bufferLock(&bufferGuard);
 
         if (buffer.empty() || buffer.begin().key() != this->next_target) {
+            // Later frames are ready but the stage is stalled on an earlier one
+            if (!buffer.empty() && Profiler::enabled()) Profiler::mark(profileTrack, "reorder stall", next_target);
             return NULL;
         }
 
@@ -84,6 +103,7 @@ public:
 
         FrameData * output = result.value();
         buffer.erase(result);
+        if (output->reorderTime > 0) Profiler::record(profileTrack, "reorder wait", output->sequenceNumber, output->reorderTime, Profiler::now());
         return output;
     }
 
@@ -201,28 +221,136 @@ public:
     virtual bool isOpen()=0;
     virtual void close()=0;
     virtual bool getNextTemplate(Template & output)=0;
+    // True if getNextTemplate sets FrameNumber itself, to the frame's position in its source
+    virtual bool numbersFrames() const { return false; }
 protected:
     Template basis;
 };
 
+#ifdef Q_OS_WIN
 static QMutex openLock;
+#endif // Q_OS_WIN
 
 // Read a video frame by frame using cv::VideoCapture
+// The video is opened and decoded on a dedicated thread into a small ring buffer,
+// so decoding overlaps with handing frames to the pipeline, and start() can open
+// videos ahead of time. With a frame step of n only frames 0, n, 2n, ... are returned.
+// The frames in between are grabbed without being retrieved, and every frame is
+// numbered by counting those decoded, as seeking need not land on the frame asked for.
+// In latest mode the decoder never waits for the pipeline: it keeps grabbing and
+// replaces the buffered frame, so a slow pipeline always gets the freshest frame
+// and the frames it missed are counted as dropped.
 class VideoReader : public TemplateProcessor
 {
+    // Frames decoded ahead of the pipeline
+    int ringSize() const { return latest ? 1 : 16; }
+
+    enum State { Closed, Opening, Open, Failed };
+
+    class Decoder : public QThread
+    {
+    public:
+        VideoReader *reader;
+        void run() { reader->decode(); }
+    };
+
 public:
-    VideoReader() {}
+    VideoReader(int step = 1, bool latest = false) : step(std::max(1, step)), latest(latest), state(Closed), dropped(0)
+    {
+        decoder.reader = this;
+    }
 
-    bool open(Template &input)
+    ~VideoReader()
     {
+        close();
+    }
+
+    // Begin opening and decoding the video without waiting for it
+    void start(const Template &input)
+    {
+        close();
         basis = input;
+        state = Opening;
+        stopping = false;
+        finished = false;
+        decoder.start();
+    }
+
+    bool open(Template &input)
+    {
+        start(input);
+        return isOpen();
+    }
+
+    bool isOpen()
+    {
+        QMutexLocker locker(&lock);
+        while (state == Opening)
+            notEmpty.wait(&lock);
+        return state == Open;
+    }
+
+    void close()
+    {
+        if (state == Closed) return;
+
+        {
+            QMutexLocker locker(&lock);
+            stopping = true;
+            notFull.wakeAll();
+        }
+        decoder.wait();
+
+        if (dropped > 0)
+            qDebug("Dropped %d stale frames from %s.", dropped, qPrintable(basis.file.name));
+        dropped = 0;
+
+        video.release();
+        ring.clear();
+        state = Closed;
+    }
+
+    bool getNextTemplate(Template & output)
+    {
+        if (!isOpen()) {
+            qDebug("video source is not open");
+            return false;
+        }
+        output.file = basis.file;
+        output.m() = cv::Mat();
 
+        QMutexLocker locker(&lock);
+        while (ring.isEmpty() && !finished)
+            notEmpty.wait(&lock);
+
+        if (ring.isEmpty()) {
+            // The video capture broke, return false.
+            locker.unlock();
+            close();
+            return false;
+        }
+
+        const QPair<int, cv::Mat> frame = ring.takeFirst();
+        notFull.wakeOne();
+        locker.unlock();
+
+        output.m() = frame.second;
+        if (numbersFrames())
+            output.file.set("FrameNumber", frame.first);
+        return true;
+    }
+
+    bool numbersFrames() const { return step > 1; }
+
+protected:
+    void openCapture()
+    {
         // We can open either files (well actually this includes addresses of ip cameras
         // through ffmpeg), or webcams. Webcam VideoCaptures are created through a separate
         // overload of open that takes an integer, not a string.
         // So, does this look like an integer?
         bool is_int = false;
-        int anInt = input.file.name.toInt(&is_int);
+        int anInt = basis.file.name.toInt(&is_int);
         if (is_int)
         {
             bool rc = video.open(anInt);
@@ -238,46 +366,80 @@ public:
         } else {
             // Yes, we should specify absolute path:
             // http://stackoverflow.com/questions/9396459/loading-a-video-in-opencv-in-python
-            QString fileName = (Globals->path.isEmpty() ? "" : Globals->path + "/") + input.file.name;
+            QString fileName = (Globals->path.isEmpty() ? "" : Globals->path + "/") + basis.file.name;
+#ifdef Q_OS_WIN
             // On windows, this appears to not be thread-safe
             QMutexLocker lock(&openLock);
-            video.open(QFileInfo(fileName).absoluteFilePath().toStdString());
+#endif // Q_OS_WIN
+            const std::string path = QFileInfo(fileName).absoluteFilePath().toStdString();
+#if !defined(CV_VERSION_EPOCH) && ((CV_VERSION_MAJOR > 4) || ((CV_VERSION_MAJOR == 4) && ((CV_VERSION_MINOR > 5) || ((CV_VERSION_MINOR == 5) && (CV_VERSION_REVISION >= 2)))))
+            // Prefer a hardware decoder, OpenCV falls back to software if there isn't one
+            std::vector<int> params;
+            params.push_back(cv::CAP_PROP_HW_ACCELERATION);
+            params.push_back(cv::VIDEO_ACCELERATION_ANY);
+            if (!video.open(path, cv::CAP_ANY, params))
+#endif
+            video.open(path);
         }
-
-        return video.isOpened();
     }
 
-    bool isOpen() { return video.isOpened(); }
-
-    void close() { video.release(); }
-
-    bool getNextTemplate(Template & output)
+    void decode()
     {
-        if (!isOpen()) {
-            qDebug("video source is not open");
-            return false;
+        openCapture();
+        {
+            QMutexLocker locker(&lock);
+            state = video.isOpened() ? Open : Failed;
+            notEmpty.wakeAll();
+            if (state == Failed) return;
         }
-        output.file = basis.file;
-        output.m() = cv::Mat();
 
-        cv::Mat temp;
-        bool res = video.read(temp);
+        int frameNumber = 0; // Frames decoded so far
+        forever {
+            cv::Mat temp;
+            const bool res = video.read(temp);
+
+            QMutexLocker locker(&lock);
+            while (!latest && !stopping && (ring.size() >= ringSize()))
+                notFull.wait(&lock);
+            if (stopping) return;
+            if (!res) {
+                finished = true;
+                notEmpty.wakeAll();
+                return;
+            }
 
-        if (!res) {
-            // The video capture broke, return false.
-            output.m() = cv::Mat();
-            close();
-            return false;
+            // This clone is critical, if we don't do it then the matrix will
+            // be an alias of an internal buffer of the video source, leading
+            // to various problems later.
+            if (latest && (ring.size() >= ringSize())) {
+                ring.removeFirst();
+                dropped++;
+                Metrics::increment("br_stream_frames_dropped");
+            }
+            ring.append(QPair<int, cv::Mat>(frameNumber, temp.clone()));
+            notEmpty.wakeOne();
+            locker.unlock();
+
+            frameNumber++;
+            for (int i=1; i<step; i++) {
+                if (!video.grab()) break;
+                frameNumber++;
+            }
         }
-
-        // This clone is critical, if we don't do it then the matrix will
-        // be an alias of an internal buffer of the video source, leading
-        // to various problems later.
-        output.m() = temp.clone();
-        return true;
     }
-protected:
+
     cv::VideoCapture video;
+    int step;
+    bool latest;
+
+    // Shared with the decoder thread
+    QMutex lock;
+    QWaitCondition notEmpty, notFull; // notEmpty also signals the end of opening
+    QList< QPair<int, cv::Mat> > ring;
+    State state;
+    bool stopping, finished;
+    int dropped;
+    Decoder decoder;
 };
 
 
@@ -319,37 +481,103 @@ protected:
     bool data_ok;
 };
 
+// Returns the templates of a gallery as it reads them block by block, so enrollment starts with the first block.
+// Each template is numbered by its Index in the gallery, and a file that is a Format rather than a Gallery is its own only template.
+// With ProgressScope set on the input, the total of that br::Progress scope grows by each block read.
+class GalleryReader : public TemplateProcessor
+{
+    QScopedPointer<Gallery> gallery;
+    TemplateList block;
+    int next, index, scope;
+    bool done;
+
+public:
+    GalleryReader() : next(0), index(0), scope(0), done(true) {}
+
+    bool open(Template &input)
+    {
+        basis = Template(input.file);
+        scope = basis.file.get<int>("ProgressScope", 0);
+        basis.file.remove("ProgressScope");
+        gallery.reset(Gallery::make(basis.file));
+        block.clear();
+        next = index = 0;
+        done = false;
+        return true;
+    }
+
+    bool isOpen() { return !gallery.isNull(); }
+
+    void close()
+    {
+        gallery.reset();
+        block.clear();
+    }
+
+    bool getNextTemplate(Template &output)
+    {
+        while (next >= block.size()) {
+            if (done || gallery.isNull()) return false;
+            block = gallery->readBlock(&done);
+            next = 0;
+            if (done && block.isEmpty() && (index == 0))
+                block.append(basis);
+            if (scope != 0) Progress::addTotal(scope, block.size());
+        }
+
+        output = block[next++];
+        output.file.set("Index", index++);
+        output.file.set("Gallery", basis.file.name);
+        return true;
+    }
+};
 
 // Interface for sequentially getting data from some data source.
 // Given a TemplateList, return single template frames sequentially by applying a TemplateProcessor
 // to each individual template.
+//
+// The number of frames in flight is bounded by a budget that starts at
+// initialFrames and adapts as frames return: enough frames to cover the measured
+// pipeline latency at the measured read rate (plus one per thread), but never
+// more than fit in memoryLimit megabytes at the measured frame size.
 class DataSource
 {
+    // A look ahead frame and the frame being returned must both fit in the budget
+    static int minimumFrames() { return 2; }
+
 public:
-    DataSource(int maxFrames=500)
+    DataSource(int initialFrames=500, int memoryLimit=0)
     {
         // The sequence number of the last frame
         final_frame = -1;
-        for (int i=0; i < maxFrames;i++)
-        {
-            allFrames.addItem(new FrameData());
-        }
         frameSource = NULL;
+        budget = std::max(minimumFrames(), initialFrames);
+        maxBytes = qint64(memoryLimit) * 1024 * 1024;
+        outstanding = peakOutstanding = 0;
+        latency = readInterval = frameBytes = 0;
+        lastReadTime = -1;
+        frameStep = 1;
+        fanIn = 1;
+        latest = false;
+        clock.start();
     }
 
     virtual ~DataSource()
     {
+        clearPrefetched();
         while (true)
         {
             FrameData * frame = allFrames.tryGetItem();
             if (frame == NULL)
                 break;
             delete frame;
+            Metrics::adjust("br_stream_frames_allocated", -1);
         }
     }
 
     void close()
     {
+        clearPrefetched();
         if (this->frameSource)
         {
             frameSource->close();
@@ -363,9 +591,28 @@ public:
         return this->templates.size();
     }
 
+    // Only read every n-th frame of videos, set when the stream starts by dropping frames
+    void setFrameStep(int n)
+    {
+        frameStep = std::max(1, n);
+    }
+
+    // Always return the freshest video frame, dropping the ones the pipeline was too slow for, set by Stream's latest property
+    void setLatest(bool enabled)
+    {
+        latest = enabled;
+    }
+
+    // Open up to n videos at once, set by Stream's sources property
+    void setFanIn(int n)
+    {
+        fanIn = std::max(1, n);
+    }
+
     bool open(const TemplateList & input, br::Idiocy::StreamModes _mode)
     {
         // Set up variables specific to us
+        clearPrefetched();
         current_template_idx = 0;
         templates = input;
         mode = _mode;
@@ -377,6 +624,8 @@ public:
         final_frame = -1;
         // Start our sequence numbers from the input index
         next_sequence_number = 0;
+        next_frame_number = 0;
+        lastReadTime = -1;
 
         // Actually open the data source
         bool open_res = openNextTemplate();
@@ -388,7 +637,7 @@ public:
         }
 
         // Try to get a frame from the global pool
-        FrameData * firstFrame = allFrames.tryGetItem();
+        FrameData * firstFrame = acquireFrame();
 
         // If this fails, things have gone pretty badly.
         if (firstFrame == NULL) {
@@ -427,7 +676,7 @@ public:
 
         // Try to get a FrameData from the pool, if we can't it means too many
         // frames are already out, and we will return NULL to indicate failure
-        FrameData * aFrame = allFrames.tryGetItem();
+        FrameData * aFrame = acquireFrame();
         if (aFrame == NULL)
             return NULL;
 
@@ -439,7 +688,7 @@ public:
         {
             QMutexLocker lock(&last_frame_update);
             final_frame = lookAhead.back()->sequenceNumber;
-            allFrames.addItem(aFrame);
+            releaseFrame(aFrame);
         }
         else {
             lookAhead.push_back(aFrame);
@@ -466,9 +715,10 @@ public:
     {
         int frameNumber = inputFrame->sequenceNumber;
 
-        inputFrame->data.clear();
+        updateBudget(clock.elapsed() - inputFrame->readTime);
+        MatArena::put(inputFrame->data);
         inputFrame->sequenceNumber = -1;
-        allFrames.addItem(inputFrame);
+        releaseFrame(inputFrame);
 
         bool rval = false;
 
@@ -503,6 +753,32 @@ public:
 
 protected:
 
+    // Videos that are streamed frame by frame rather than returned directly
+    bool usesVideo(int index) const
+    {
+        if (mode == br::Idiocy::StreamVideo) return true;
+        if (mode == br::Idiocy::Auto) return templates[index].empty();
+        return false;
+    }
+
+    // Start opening and decoding the next fanIn-1 videos while the current one is read
+    void prefetch()
+    {
+        for (int i=current_template_idx+1; (i<current_template_idx+fanIn) && (i<templates.size()); i++) {
+            if (prefetched.contains(i) || !usesVideo(i))
+                continue;
+            VideoReader *reader = new VideoReader(frameStep, latest);
+            reader->start(templates[i]);
+            prefetched.insert(i, reader);
+        }
+    }
+
+    void clearPrefetched()
+    {
+        qDeleteAll(prefetched);
+        prefetched.clear();
+    }
+
     bool openNextTemplate()
     {
         if (this->current_template_idx >= this->templates.size())
@@ -514,26 +790,45 @@ protected:
             if (frameSource)
                 frameSource->close();
 
-            if (mode == br::Idiocy::Auto)
+            if (prefetched.contains(current_template_idx))
             {
+                // Already opening on its own thread
                 delete frameSource;
-                if (this->templates[this->current_template_idx].empty())
-                    frameSource = new VideoReader();
-                else
-                    frameSource = new DirectReturn();
-            }
-            else if (mode == br::Idiocy::DistributeFrames)
-            {
-                if (!frameSource)
-                    frameSource = new DirectReturn();
+                frameSource = prefetched.take(current_template_idx);
+                prefetch();
+                open_res = frameSource->isOpen();
             }
-            else if (mode == br::Idiocy::StreamVideo)
+            else
             {
-                if (!frameSource)
-                    frameSource = new VideoReader();
+                if (mode == br::Idiocy::Auto)
+                {
+                    delete frameSource;
+                    if (this->templates[this->current_template_idx].empty())
+                        frameSource = new VideoReader(frameStep, latest);
+                    else
+                        frameSource = new DirectReturn();
+                }
+                else if (mode == br::Idiocy::DistributeFrames)
+                {
+                    if (!frameSource)
+                        frameSource = new DirectReturn();
+                }
+                else if (mode == br::Idiocy::StreamVideo)
+                {
+                    if (!frameSource)
+                        frameSource = new VideoReader(frameStep, latest);
+                }
+                else if (mode == br::Idiocy::StreamGallery)
+                {
+                    // Each input template names a gallery of its own
+                    delete frameSource;
+                    frameSource = new GalleryReader();
+                }
+
+                prefetch();
+                open_res = frameSource->open(this->templates[current_template_idx]);
             }
 
-            open_res = frameSource->open(this->templates[current_template_idx]);
             if (!open_res)
             {
                 current_template_idx++;
@@ -554,14 +849,39 @@ protected:
         {
             got_frame = frameSource->getNextTemplate(aTemplate);
 
+            // Sources that can't skip frames themselves are thinned here,
+            // so the dropped frames never enter the pipeline
+            int frameNumber = next_sequence_number;
+            if (got_frame && !frameSource->numbersFrames() && (frameStep > 1)) {
+                frameNumber = next_frame_number++;
+                if (frameNumber % frameStep != 0) {
+                    got_frame = false;
+                    continue;
+                }
+            }
+
             // OK we got a frame
             if (got_frame) {
                 // set the sequence number and tempalte of this frame
                 output.sequenceNumber = next_sequence_number;
                 output.data.append(aTemplate);
                 // set the frame number in the template's metadata
-                output.data.last().file.set("FrameNumber", output.sequenceNumber);
+                if (!frameSource->numbersFrames())
+                    output.data.last().file.set("FrameNumber", frameNumber);
                 next_sequence_number++;
+
+                // Measure the read rate and frame size for the frame budget
+                static const double alpha = 0.1;
+                size_t bytes = 0;
+                foreach (const Mat &m, aTemplate)
+                    bytes += m.total() * m.elemSize();
+                output.readTime = clock.elapsed();
+                output.queuedTime = Profiler::enabled() ? Profiler::now() : 0;
+                QMutexLocker lock(&budgetLock);
+                if (lastReadTime >= 0)
+                    readInterval = (readInterval == 0) ? output.readTime - lastReadTime : (1-alpha)*readInterval + alpha*(output.readTime - lastReadTime);
+                lastReadTime = output.readTime;
+                frameBytes = (frameBytes == 0) ? bytes : (1-alpha)*frameBytes + alpha*bytes;
                 return true;
             }
 
@@ -579,6 +899,72 @@ protected:
         return false;
     }
 
+    // Current frame budget, frames in flight, and the most frames in flight at once
+    void counters(int *currentBudget, int *currentOutstanding, int *currentPeak)
+    {
+        QMutexLocker lock(&budgetLock);
+        *currentBudget = budget;
+        *currentOutstanding = outstanding;
+        *currentPeak = peakOutstanding;
+    }
+
+    // Take a frame from the pool, or allocate one, unless the budget is exhausted
+    FrameData * acquireFrame()
+    {
+        {
+            QMutexLocker lock(&budgetLock);
+            if (outstanding >= budget)
+                return NULL;
+            outstanding++;
+            peakOutstanding = std::max(peakOutstanding, outstanding);
+        }
+
+        Metrics::adjust("br_stream_frames_outstanding", 1);
+        FrameData * frame = allFrames.tryGetItem();
+        if (frame) return frame;
+        Metrics::adjust("br_stream_frames_allocated", 1);
+        return new FrameData();
+    }
+
+    void releaseFrame(FrameData * frame)
+    {
+        allFrames.addItem(frame);
+        Metrics::adjust("br_stream_frames_outstanding", -1);
+        QMutexLocker lock(&budgetLock);
+        outstanding--;
+    }
+
+    void updateBudget(qint64 frameLatency)
+    {
+        // Exponential moving averages, weighted towards recent frames
+        static const double alpha = 0.1;
+        QMutexLocker lock(&budgetLock);
+        latency = (latency == 0) ? frameLatency : (1-alpha)*latency + alpha*frameLatency;
+
+        // Little's law, frames in flight = latency * arrival rate
+        int frames = Globals->parallelism + int(ceil(latency / std::max(readInterval, 0.01)));
+        if ((maxBytes > 0) && (frameBytes > 0))
+            frames = std::min(frames, int(std::min(maxBytes / qint64(frameBytes), qint64(std::numeric_limits<int>::max()))));
+        // Queued frames only add latency when reading the freshest frame
+        if (latest)
+            frames = std::min(frames, Globals->parallelism + minimumFrames());
+        budget = std::max(minimumFrames(), frames);
+    }
+
+    QMutex budgetLock;
+    int budget, outstanding, peakOutstanding;
+    qint64 maxBytes;
+    double latency, readInterval, frameBytes;
+    qint64 lastReadTime;
+    QElapsedTimer clock;
+
+    // Step between the video frames read
+    int frameStep;
+    int fanIn;
+    bool latest;
+    // Videos after the current one, already opening, by template index
+    QMap<int, VideoReader *> prefetched;
+
     // Index of the template in the templatelist we are currently reading from
     int current_template_idx;
 
@@ -592,6 +978,7 @@ protected:
     TemplateProcessor * frameSource;
 
     int next_sequence_number;
+    int next_frame_number; // Including frames skipped by the frame step
     int final_frame;
     bool is_broken;
     bool allReturned;
@@ -603,6 +990,114 @@ protected:
     QMutex last_frame_update;
 };
 
+// Runs stream jobs on a fixed set of threads, each with its own queue.
+// A job started from a worker goes on that worker's queue, and workers run their
+// most recently queued job first, so a thread tends to carry a frame through the
+// remaining stages rather than starting new frames. Idle workers steal the oldest
+// job from another worker's queue, so no stage waits behind a single shared queue.
+class WorkStealingPool : public QObject
+{
+public:
+    WorkStealingPool(int threadCount, QObject *parent)
+        : QObject(parent), stopping(false)
+    {
+        for (int i=0; i<std::max(1, threadCount); i++) {
+            queues.append(new Queue());
+            workers.append(new Worker(this, i));
+        }
+        foreach (Worker *worker, workers)
+            worker->start();
+    }
+
+    ~WorkStealingPool()
+    {
+        {
+            QMutexLocker locker(&sleepLock);
+            stopping = true;
+            wake.wakeAll();
+        }
+        foreach (Worker *worker, workers) {
+            worker->wait();
+            delete worker;
+        }
+        qDeleteAll(queues);
+    }
+
+    void start(QRunnable *job)
+    {
+        const Worker *worker = dynamic_cast<const Worker*>(QThread::currentThread());
+        const int index = ((worker != NULL) && (worker->pool == this)) ? worker->index
+                                                                       : (nextQueue.fetchAndAddRelaxed(1) & 0x7FFFFFFF) % queues.size();
+        {
+            QMutexLocker locker(&queues[index]->lock);
+            queues[index]->jobs.append(job);
+        }
+
+        // Pairs with the check in Worker::run, one of the two sees the other's increment
+        pending.fetchAndAddOrdered(1);
+        if (sleeping.fetchAndAddOrdered(0) > 0) {
+            QMutexLocker locker(&sleepLock);
+            wake.wakeOne();
+        }
+    }
+
+private:
+    struct Queue
+    {
+        QMutex lock;
+        QList<QRunnable*> jobs;
+    };
+
+    class Worker : public QThread
+    {
+    public:
+        WorkStealingPool *pool;
+        int index;
+
+        Worker(WorkStealingPool *pool_, int index_) : pool(pool_), index(index_) {}
+
+        void run()
+        {
+            forever {
+                QRunnable *job = pool->take(index);
+                if (job) {
+                    const bool autoDelete = job->autoDelete();
+                    job->run();
+                    if (autoDelete) delete job;
+                    continue;
+                }
+
+                QMutexLocker locker(&pool->sleepLock);
+                if (pool->stopping) return;
+                pool->sleeping.fetchAndAddOrdered(1);
+                if (pool->pending.fetchAndAddOrdered(0) == 0)
+                    pool->wake.wait(&pool->sleepLock);
+                pool->sleeping.fetchAndAddOrdered(-1);
+            }
+        }
+    };
+
+    QRunnable *take(int index)
+    {
+        // Newest job from our own queue, otherwise the oldest job of the next non-empty queue
+        for (int i=0; i<queues.size(); i++) {
+            Queue *queue = queues[(index + i) % queues.size()];
+            QMutexLocker locker(&queue->lock);
+            if (queue->jobs.isEmpty()) continue;
+            pending.fetchAndAddOrdered(-1);
+            return (i == 0) ? queue->jobs.takeLast() : queue->jobs.takeFirst();
+        }
+        return NULL;
+    }
+
+    QList<Queue*> queues;
+    QList<Worker*> workers;
+    QAtomicInt pending, sleeping, nextQueue;
+    QMutex sleepLock;
+    QWaitCondition wake;
+    bool stopping;
+};
+
 class ProcessingStage;
 
 class BasicLoop : public QRunnable, public QFutureInterface<void>
@@ -628,6 +1123,8 @@ public:
     ProcessingStage(int nThreads = 1)
     {
         thread_count = nThreads;
+        profileTrack = -1;
+        inputBuffer = NULL;
     }
     virtual ~ProcessingStage() {}
 
@@ -636,6 +1133,7 @@ public:
     virtual bool tryAcquireNextStage(FrameData *& input, bool & final)=0;
 
     int stage_id;
+    int profileTrack;
 
     virtual void reset()=0;
 
@@ -644,10 +1142,31 @@ public:
 protected:
     int thread_count;
 
+    // Also records how long the frame waited since the previous stage finished with it
+    QString profileName(const FrameData *input) const
+    {
+        if (!Profiler::enabled()) return QString();
+        const QString name = QString("stage %1 %2").arg(QString::number(stage_id), transform->objectName());
+        if (input->queuedTime > 0) Profiler::recordWait(name, Profiler::now() - input->queuedTime);
+        return name;
+    }
+
+    QString memoryOwner() const
+    {
+        if (!Memory::enabled()) return QString();
+        return QString("stage %1 %2").arg(QString::number(stage_id), transform->objectName());
+    }
+
+    QString metricLabels() const
+    {
+        if (!Metrics::enabled()) return QString();
+        return QString("stage=\"%1 %2\"").arg(QString::number(stage_id), transform->objectName());
+    }
+
     SharedBuffer * inputBuffer;
     ProcessingStage * nextStage;
     QList<ProcessingStage *> * stages;
-    QThreadPool * threads;
+    WorkStealingPool * threads;
     Transform * transform;
 
 };
@@ -665,8 +1184,15 @@ public:
             qFatal("null input to multi-thread stage");
         }
 
-        input->data >> *transform;
+        {
+            Profiler::Scope scope(profileName(input), "stage");
+            Metrics::Timer metric("br_stage_seconds", metricLabels());
+            Memory::Scope memory(memoryOwner());
+            input->data >> *transform;
+            if (Memory::enabled()) memory.setBytes(Profiler::bytes(input->data));
+        }
 
+        input->queuedTime = Profiler::enabled() ? Profiler::now() : 0;
         should_continue = nextStage->tryAcquireNextStage(input, final);
 
         return input;
@@ -744,8 +1270,15 @@ public:
         next_target = input->sequenceNumber + 1;
 
         // Project the input we got
-        transform->projectUpdate(input->data);
+        {
+            Profiler::Scope scope(profileName(input), "stage");
+            Metrics::Timer metric("br_stage_seconds", metricLabels());
+            Memory::Scope memory(memoryOwner());
+            transform->projectUpdate(input->data);
+            if (Memory::enabled()) memory.setBytes(Profiler::bytes(input->data));
+        }
 
+        input->queuedTime = Profiler::enabled() ? Profiler::now() : 0;
         should_continue = nextStage->tryAcquireNextStage(input,final);
 
         if (final)
@@ -773,12 +1306,9 @@ public:
         next->start_idx = this->stage_id;
         next->startItem = newItem;
 
-        // We start threads with priority equal to their stage id
-        // This is intended to ensure progression, we do queued late stage
-        // jobs before queued early stage jobs, and so tend to finish frames
-        // rather than go stage by stage. In Qt 5.1, priorities are priorities
-        // so we use the stage_id directly.
-        this->threads->start(next, stage_id);
+        // Jobs started from a worker run on that worker before its older jobs,
+        // so we tend to finish frames rather than go stage by stage.
+        this->threads->start(next);
     }
 
 
@@ -821,6 +1351,228 @@ public:
 
 };
 
+static void _projectUpdate(Transform *transform, const TemplateList *src, TemplateList *dst)
+{
+    transform->projectUpdate(*src, *dst);
+}
+
+/*!
+ * \ingroup transforms
+ * \brief Keeps a separate copy of a time-varying transform for each value of a metadata key.
+ *
+ * Stateful stages such as trackers or frame rate counters are often only stateful per source video.
+ * Templates with the same \em key value are projected in order by the same copy of \em transform,
+ * while templates with different values are projected concurrently. In a stream the stage runs
+ * one thread per key instead of one thread overall. Outside a stream, a template list is split by
+ * key and the outputs are concatenated in order of each key's first template.
+ * \author Josh Klontz \cite jklontz
+ */
+class PartitionTransform : public WrapperTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(QString key READ get_key WRITE set_key RESET reset_key STORED false)
+    BR_PROPERTY(QString, key, "name")
+
+    QMutex instancesLock;
+    QHash<QString, Transform*> instances;
+    QList<QString> keys; // In order of first appearance, for finalize
+
+public:
+    ~PartitionTransform()
+    {
+        qDeleteAll(instances);
+    }
+
+    QString partitionOf(const TemplateList &data) const
+    {
+        return data.isEmpty() ? QString() : data.first().file.get<QString>(key, QString());
+    }
+
+    // The copy of transform responsible for partition, made when the partition is first seen
+    Transform *instance(const QString &partition)
+    {
+        QMutexLocker locker(&instancesLock);
+        Transform *copy = instances.value(partition);
+        if (copy == NULL) {
+            bool newTransform = false;
+            copy = transform->smartCopy(newTransform);
+            if (!newTransform) qFatal("Partition requires a transform that can be copied, %s can not.", qPrintable(transform->objectName()));
+            instances.insert(partition, copy);
+            keys.append(partition);
+        }
+        return copy;
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        timeInvariantAlias.project(src, dst);
+    }
+
+    void projectUpdate(const Template &src, Template &dst)
+    {
+        instance(src.file.get<QString>(key, QString()))->projectUpdate(src, dst);
+    }
+
+    void projectUpdate(const TemplateList &src, TemplateList &dst)
+    {
+        QList<QString> order;
+        QHash<QString, TemplateList> partitions;
+        foreach (const Template &t, src) {
+            const QString partition = t.file.get<QString>(key, QString());
+            if (!partitions.contains(partition)) order.append(partition);
+            partitions[partition].append(t);
+        }
+
+        QVector<TemplateList> inputs(order.size()), outputs(order.size());
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<order.size(); i++) {
+            inputs[i] = partitions[order[i]];
+            futures.addFuture(QtConcurrent::run(_projectUpdate, instance(order[i]), &inputs[i], &outputs[i]));
+        }
+        futures.waitForFinished();
+
+        dst.clear();
+        foreach (const TemplateList &output, outputs)
+            dst.append(output);
+    }
+
+    // The copies are freed once their output is collected, the next stream starts new ones
+    void finalize(TemplateList &output)
+    {
+        QMutexLocker locker(&instancesLock);
+        output.clear();
+        foreach (const QString &partition, keys) {
+            TemplateList last;
+            instances[partition]->finalize(last);
+            output.append(last);
+        }
+        qDeleteAll(instances);
+        instances.clear();
+        keys.clear();
+    }
+
+    void init()
+    {
+        WrapperTransform::init();
+        QMutexLocker locker(&instancesLock);
+        qDeleteAll(instances);
+        instances.clear();
+        keys.clear();
+    }
+};
+
+BR_REGISTER(Transform, PartitionTransform)
+
+// Projects a PartitionTransform with one thread per partition. Frames leave the input
+// buffer in sequence order and wait in their partition's queue, so each partition sees
+// its frames in order, but frames of different partitions may overtake each other.
+class PartitionedStage : public ProcessingStage
+{
+    struct Partition
+    {
+        QList<FrameData*> pending;
+        bool running;
+        Partition() : running(false) {}
+    };
+
+    PartitionTransform *partitionTransform;
+    QMutex lock;
+    QHash<QString, Partition> partitions;
+
+public:
+    PartitionedStage(bool input_variance, PartitionTransform *partitionTransform_) : ProcessingStage(1), partitionTransform(partitionTransform_)
+    {
+        if (input_variance) this->inputBuffer = new DoubleBuffer();
+        else                this->inputBuffer = new SequencingBuffer();
+    }
+
+    ~PartitionedStage()
+    {
+        delete inputBuffer;
+    }
+
+    void reset()
+    {
+        QMutexLocker locker(&lock);
+        partitions.clear();
+        inputBuffer->reset();
+    }
+
+    FrameData *run(FrameData *input, bool &should_continue, bool &final)
+    {
+        if (input == NULL)
+            qFatal("NULL input to stage %d", this->stage_id);
+
+        const QString partition = partitionTransform->partitionOf(input->data);
+        {
+            Profiler::Scope scope(profileName(input), "stage");
+            Metrics::Timer metric("br_stage_seconds", metricLabels());
+            Memory::Scope memory(memoryOwner());
+            partitionTransform->instance(partition)->projectUpdate(input->data);
+            if (Memory::enabled()) memory.setBytes(Profiler::bytes(input->data));
+        }
+
+        // Start this partition's next frame before handing the current one on
+        FrameData *next = NULL;
+        {
+            QMutexLocker locker(&lock);
+            Partition &p = partitions[partition];
+            if (p.pending.isEmpty()) p.running = false;
+            else                     next = p.pending.takeFirst();
+        }
+        if (next) startThread(next);
+
+        input->queuedTime = Profiler::enabled() ? Profiler::now() : 0;
+        should_continue = nextStage->tryAcquireNextStage(input, final);
+        return input;
+    }
+
+    // Called from a different thread than run
+    bool tryAcquireNextStage(FrameData *&input, bool &final)
+    {
+        final = false;
+        inputBuffer->addItem(input);
+
+        QList<FrameData*> ready;
+        {
+            QMutexLocker locker(&lock);
+            while (FrameData *item = inputBuffer->tryGetItem()) {
+                Partition &p = partitions[partitionTransform->partitionOf(item->data)];
+                if (p.running) {
+                    p.pending.append(item);
+                } else {
+                    p.running = true;
+                    ready.append(item);
+                }
+            }
+        }
+
+        if (ready.isEmpty()) return false;
+
+        // The calling thread continues with the first frame, the others get new threads
+        input = ready.takeFirst();
+        foreach (FrameData *item, ready)
+            startThread(item);
+        return true;
+    }
+
+    void status()
+    {
+        QMutexLocker locker(&lock);
+        qDebug("partitioned stage %d, %d partitions, buffer size %d", this->stage_id, partitions.size(), this->inputBuffer->size());
+    }
+
+private:
+    void startThread(FrameData *newItem)
+    {
+        BasicLoop *next = new BasicLoop();
+        next->stages = stages;
+        next->start_idx = this->stage_id;
+        next->startItem = newItem;
+        this->threads->start(next);
+    }
+};
+
 // Semi-functional, doesn't do anything productive outside of stream::train
 class CollectSets : public TimeVaryingTransform
 {
@@ -847,7 +1599,7 @@ public:
 class ReadStage : public SingleThreadStage
 {
 public:
-    ReadStage(int activeFrames = 100) : SingleThreadStage(true), dataSource(activeFrames){ }
+    ReadStage(int activeFrames = 100, int memoryLimit = 0) : SingleThreadStage(true), dataSource(activeFrames, memoryLimit){ }
 
     DataSource dataSource;
 
@@ -863,6 +1615,7 @@ public:
             qFatal("NULL frame in input stage");
 
         // Can we enter the next stage?
+        input->queuedTime = Profiler::enabled() ? Profiler::now() : 0;
         should_continue = nextStage->tryAcquireNextStage(input, final);
 
         // Try to get a frame from the datasource, we keep working on
@@ -931,7 +1684,9 @@ public:
     }
 
     void status(){
-        qDebug("Read stage %d, status starting? %d, next frame %d buffer size %d", this->stage_id, this->currentStatus == SingleThreadStage::STARTING, this->next_target, this->dataSource.size());
+        int budget, outstanding, peak;
+        dataSource.counters(&budget, &outstanding, &peak);
+        qDebug("Read stage %d, status starting? %d, next frame %d buffer size %d, frame budget %d, frames in flight %d, peak %d", this->stage_id, this->currentStatus == SingleThreadStage::STARTING, this->next_target, this->dataSource.size(), budget, outstanding, peak);
     }
 };
 
@@ -943,7 +1698,17 @@ void BasicLoop::run()
     bool the_end = false;
     forever
     {
-        target_item = stages->at(current_idx)->run(target_item, should_continue, the_end);
+        ProcessingStage *stage = stages->at(current_idx);
+        if (Profiler::enabled()) {
+            // The frame may belong to another loop once the stage hands it off
+            const int frame = target_item->sequenceNumber;
+            const qint64 begin = Profiler::now();
+            if (target_item->queuedTime > 0) Profiler::record(stage->profileTrack, "queued", frame, target_item->queuedTime, begin);
+            target_item = stage->run(target_item, should_continue, the_end);
+            Profiler::record(stage->profileTrack, "run", frame, begin, Profiler::now());
+        } else {
+            target_item = stage->run(target_item, should_continue, the_end);
+        }
         if (!should_continue) {
             break;
         }
@@ -964,9 +1729,15 @@ class DirectStreamTransform : public CompositeTransform
 public:
 
     Q_PROPERTY(int activeFrames READ get_activeFrames WRITE set_activeFrames RESET reset_activeFrames)
+    Q_PROPERTY(int memoryLimit READ get_memoryLimit WRITE set_memoryLimit RESET reset_memoryLimit)
     Q_PROPERTY(br::Idiocy::StreamModes readMode READ get_readMode WRITE set_readMode RESET reset_readMode)
+    Q_PROPERTY(int sources READ get_sources WRITE set_sources RESET reset_sources)
+    Q_PROPERTY(bool latest READ get_latest WRITE set_latest RESET reset_latest)
     BR_PROPERTY(int, activeFrames, 100)
+    BR_PROPERTY(int, memoryLimit, 1024)
     BR_PROPERTY(br::Idiocy::StreamModes, readMode, br::Idiocy::Auto)
+    BR_PROPERTY(int, sources, 4)
+    BR_PROPERTY(bool, latest, false)
 
     friend class StreamTransfrom;
 
@@ -1011,7 +1782,14 @@ public:
                 // Project from the start to the trainable stage.
                 subProject(copy,i);
 
+                Memory::Scope memory("train " + transforms[i]->objectName());
                 transforms[i]->train(copy);
+                if (Memory::enabled()) {
+                    qint64 bytes = 0;
+                    foreach (const TemplateList &templates, copy)
+                        bytes += Profiler::bytes(templates);
+                    memory.setBytes(bytes);
+                }
             }
         }
         // Re-initialize because subProject probably messed us up.
@@ -1114,6 +1892,11 @@ public:
 
         dst.append(final_output);
 
+        // Report the frame budget and queue depths
+        if (Globals->verbose)
+            foreach(ProcessingStage * stage, processingStages)
+                stage->status();
+
         foreach(ProcessingStage * stage, processingStages) {
             stage->reset();
         }
@@ -1137,11 +1920,9 @@ public:
         // parent tranform, retrieve or create a thread pool based
         // on our parent transform.
         QMutexLocker poolLock(&poolsAccess);
-        QHash<QObject *, QThreadPool *>::Iterator it;
-        if (!pools.contains(this->parent())) {
-            it = pools.insert(this->parent(), new QThreadPool(this->parent()));
-            it.value()->setMaxThreadCount(Globals->parallelism);
-        }
+        QHash<QObject *, WorkStealingPool *>::Iterator it;
+        if (!pools.contains(this->parent()))
+            it = pools.insert(this->parent(), new WorkStealingPool(Globals->parallelism, this->parent()));
         else it = pools.find(this->parent());
         threads = it.value();
         poolLock.unlock();
@@ -1156,7 +1937,13 @@ public:
 
         // Additionally, we have a separate stage responsible for reading
         // frames from the data source
-        readStage = new ReadStage(activeFrames);
+        readStage = new ReadStage(activeFrames, memoryLimit);
+        readStage->dataSource.setFanIn(sources);
+        readStage->dataSource.setLatest(latest);
+
+        // Frames a leading DropFrames would discard are never decoded
+        if (!transforms.isEmpty() && (QString(transforms.first()->metaObject()->className()) == "br::DropFrames"))
+            readStage->dataSource.setFrameStep(transforms.first()->property("n").toInt());
 
         processingStages.push_back(readStage);
         readStage->stage_id = 0;
@@ -1169,7 +1956,11 @@ public:
         bool prev_stage_variance = true;
         for (int i =0; i < transforms.size(); i++)
         {
-            if (stage_variance[i])
+            PartitionTransform *partition = dynamic_cast<PartitionTransform *>(transforms[i]);
+            if (partition)
+                // One thread per partition, its output is no longer in sequence order
+                processingStages.append(new PartitionedStage(prev_stage_variance, partition));
+            else if (stage_variance[i])
                 // Whether or not the previous stage is multi-threaded controls
                 // the type of input buffer we need in a single threaded stage.
                 processingStages.append(new SingleThreadStage(prev_stage_variance));
@@ -1186,7 +1977,7 @@ public:
             processingStages.last()->threads = this->threads;
 
             processingStages.last()->transform = transforms[i];
-            prev_stage_variance = stage_variance[i];
+            prev_stage_variance = stage_variance[i] && !partition;
         }
 
         // We also have the last stage, which just puts the output of the
@@ -1206,6 +1997,12 @@ public:
         // And the collection stage points to the read stage, because this is
         // a ring buffer.
         collectionStage->nextStage = readStage;
+
+        if (Profiler::enabled())
+            foreach (ProcessingStage *stage, processingStages) {
+                stage->profileTrack = Profiler::track(QString("stage %1 %2").arg(QString::number(stage->stage_id), stage == readStage ? QString("Read") : stage->transform->objectName()));
+                if (stage->inputBuffer) stage->inputBuffer->profileTrack = stage->profileTrack;
+            }
     }
 
     DirectStreamTransform()
@@ -1246,9 +2043,9 @@ protected:
     // will steal work from those jobs, so in that sense distribute isn't doing a hold and wait.
     // Waiting for a QFutureSynchronzier isn't really possible here since stream runs an indeteriminate
     // number of jobs.
-    static QHash<QObject *, QThreadPool *> pools;
+    static QHash<QObject *, WorkStealingPool *> pools;
     static QMutex poolsAccess;
-    QThreadPool * threads;
+    WorkStealingPool * threads;
 
     void _project(const Template &src, Template &dst) const
     {
@@ -1262,7 +2059,7 @@ protected:
     }
 };
 
-QHash<QObject *, QThreadPool *> DirectStreamTransform::pools;
+QHash<QObject *, WorkStealingPool *> DirectStreamTransform::pools;
 QMutex DirectStreamTransform::poolsAccess;
 
 BR_REGISTER(Transform, DirectStreamTransform)
@@ -1277,10 +2074,16 @@ public:
     }
 
     Q_PROPERTY(int activeFrames READ get_activeFrames WRITE set_activeFrames RESET reset_activeFrames)
+    Q_PROPERTY(int memoryLimit READ get_memoryLimit WRITE set_memoryLimit RESET reset_memoryLimit)
     Q_PROPERTY(br::Idiocy::StreamModes readMode READ get_readMode WRITE set_readMode RESET reset_readMode)
+    Q_PROPERTY(int sources READ get_sources WRITE set_sources RESET reset_sources)
+    Q_PROPERTY(bool latest READ get_latest WRITE set_latest RESET reset_latest)
 
     BR_PROPERTY(int, activeFrames, 100)
+    BR_PROPERTY(int, memoryLimit, 1024)
     BR_PROPERTY(br::Idiocy::StreamModes, readMode, br::Idiocy::Auto)
+    BR_PROPERTY(int, sources, 4)
+    BR_PROPERTY(bool, latest, false)
 
     bool timeVarying() const { return true; }
 
@@ -1321,7 +2124,10 @@ public:
         basis.setParent(this->parent());
         basis.transforms.clear();
         basis.activeFrames = this->activeFrames;
+        basis.memoryLimit = this->memoryLimit;
         basis.readMode = this->readMode;
+        basis.sources = this->sources;
+        basis.latest = this->latest;
 
         // We need at least a CompositeTransform * to acess transform's children.
         CompositeTransform * downcast = dynamic_cast<CompositeTransform *> (transform);
@@ -1394,6 +2200,7 @@ public:
         // We just want the DirectStream to begin with, so just return a copy of that.
         DirectStreamTransform * res = (DirectStreamTransform *) basis.smartCopy(newTransform);
         res->activeFrames = this->activeFrames;
+        res->memoryLimit = this->memoryLimit;
         return res;
     }
 
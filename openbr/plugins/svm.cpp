@@ -14,7 +14,10 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
 #include <QTemporaryFile>
+#include <QVector>
+#include <QtConcurrentRun>
 #include <opencv2/core/core.hpp>
 #include <opencv2/ml/ml.hpp>
 
@@ -26,6 +29,89 @@ using namespace cv;
 namespace br
 {
 
+/*!
+ * \brief CvSVM that collapses the support vectors of each linear decision function into one weight vector,
+ *        so a batch of samples is predicted with a single matrix product.
+ */
+class LinearizedSVM : public SVM
+{
+    Mat weights, rho; // One row per decision function
+    QList<int> labels;
+
+    bool classifier() const
+    {
+        return (params.svm_type == CvSVM::C_SVC) || (params.svm_type == CvSVM::NU_SVC);
+    }
+
+public:
+    // Must be called after training or loading
+    void linearize()
+    {
+        weights.release();
+        rho.release();
+        labels.clear();
+        if ((decision_func == NULL) || (params.kernel_type != CvSVM::LINEAR) || (var_idx != NULL)) return;
+
+        const int functions = classifier() ? class_count*(class_count-1)/2 : 1;
+        if (functions < 1) return;
+
+        const int dims = get_var_count();
+        const CvSVMDecisionFunc *df = (const CvSVMDecisionFunc*) decision_func;
+        weights = Mat::zeros(functions, dims, CV_32FC1);
+        rho = Mat(functions, 1, CV_32FC1);
+        for (int f=0; f<functions; f++) {
+            float *w = weights.ptr<float>(f);
+            const int count = classifier() ? df[f].sv_count : get_support_vector_count();
+            for (int k=0; k<count; k++) {
+                const float *sv = get_support_vector(classifier() ? df[f].sv_index[k] : k);
+                for (int d=0; d<dims; d++)
+                    w[d] += df[f].alpha[k] * sv[d];
+            }
+            rho.at<float>(f) = df[f].rho;
+        }
+
+        if (classifier())
+            for (int i=0; i<class_count; i++)
+                labels.append(class_labels->data.i[i]);
+    }
+
+    bool linearized() const
+    {
+        return !weights.empty();
+    }
+
+    // Equivalent to CvSVM::predict() for each row of samples
+    void predictBatch(const Mat &samples, bool returnDFVal, float *results) const
+    {
+        Mat scores;
+        gemm(samples, weights, 1, Mat(), 0, scores, GEMM_2_T);
+
+        QVector<int> votes(labels.size());
+        for (int r=0; r<scores.rows; r++) {
+            const float *score = scores.ptr<float>(r);
+            if (!classifier()) {
+                const float sum = score[0] - rho.at<float>(0);
+                results[r] = (params.svm_type == CvSVM::ONE_CLASS) ? float(sum > 0) : sum;
+                continue;
+            }
+
+            votes.fill(0);
+            float sum = 0;
+            for (int i=0, f=0; i<labels.size(); i++)
+                for (int j=i+1; j<labels.size(); j++, f++) {
+                    sum = score[f] - rho.at<float>(f);
+                    votes[sum > 0 ? i : j]++;
+                }
+
+            int best = 0;
+            for (int i=1; i<votes.size(); i++)
+                if (votes[i] > votes[best])
+                    best = i;
+            results[r] = (returnDFVal && (labels.size() == 2)) ? sum : float(labels[best]);
+        }
+    }
+};
+
 static void storeSVM(const SVM &svm, QDataStream &stream)
 {
     // Create local file
@@ -43,7 +129,7 @@ static void storeSVM(const SVM &svm, QDataStream &stream)
     stream << data;
 }
 
-static void loadSVM(SVM &svm, QDataStream &stream)
+static void loadSVM(LinearizedSVM &svm, QDataStream &stream)
 {
     // Copy local file contents from stream
     QByteArray data;
@@ -57,9 +143,118 @@ static void loadSVM(SVM &svm, QDataStream &stream)
 
     // Load SVM from local file
     svm.load(qPrintable(tempFile.fileName()));
+    svm.linearize();
+}
+
+// One fold of cross validation for one combination of parameters
+struct SVMFold
+{
+    const Mat *trainData, *trainLab, *testData, *testLab;
+    CvSVMParams params;
+    bool regression;
+    double error;
+};
+
+static void evaluateFold(SVMFold *fold)
+{
+    SVM svm;
+    fold->error = std::numeric_limits<double>::max();
+    try {
+        if (!svm.train(*fold->trainData, *fold->trainLab, Mat(), Mat(), fold->params))
+            return;
+    } catch (...) {
+        return;
+    }
+
+    double error = 0;
+    for (int i=0; i<fold->testData->rows; i++) {
+        const float prediction = svm.predict(fold->testData->row(i));
+        const float truth = fold->testLab->at<float>(i, 0);
+        error += fold->regression ? (prediction-truth)*(prediction-truth) : (prediction != truth);
+    }
+    fold->error = error;
 }
 
-static void trainSVM(SVM &svm, Mat data, Mat lab, int kernel, int type, float C, float gamma)
+// Values of a CvParamGrid in the order CvSVM::train_auto() visits them
+static QList<double> gridValues(const CvParamGrid &grid)
+{
+    QList<double> values;
+    if (grid.step <= 1) values.append(grid.min_val);
+    else                for (double value=grid.min_val; value<grid.max_val; value*=grid.step) values.append(value);
+    return values;
+}
+
+// Cross validated grid search like CvSVM::train_auto(), evaluating every fold of every candidate in parallel
+static bool trainAuto(SVM &svm, const Mat &data, const Mat &lab, CvSVMParams params, bool searchC, bool searchGamma, int k)
+{
+    const int type = params.svm_type, kernel = params.kernel_type;
+    const bool regression = (type == CvSVM::EPS_SVR) || (type == CvSVM::NU_SVR);
+    const QList<double> Cs = searchC && (type != CvSVM::NU_SVC) && (type != CvSVM::ONE_CLASS) ? gridValues(CvSVM::get_default_grid(CvSVM::C)) : QList<double>() << params.C;
+    const QList<double> gammas = searchGamma && (kernel != CvSVM::LINEAR) ? gridValues(CvSVM::get_default_grid(CvSVM::GAMMA)) : QList<double>() << params.gamma;
+    const QList<double> nus = (type == CvSVM::NU_SVC) || (type == CvSVM::ONE_CLASS) || (type == CvSVM::NU_SVR) ? gridValues(CvSVM::get_default_grid(CvSVM::NU)) : QList<double>() << params.nu;
+    const QList<double> ps = (type == CvSVM::EPS_SVR) ? gridValues(CvSVM::get_default_grid(CvSVM::P)) : QList<double>() << params.p;
+
+    // Shuffle the samples into k folds
+    k = std::min(k, data.rows);
+    if (k < 2) return false;
+    QList<int> order;
+    for (int i=0; i<data.rows; i++)
+        order.append(i);
+    std::random_shuffle(order.begin(), order.end());
+
+    QVector<Mat> trainData(k), trainLab(k), testData(k), testLab(k);
+    for (int f=0; f<k; f++) {
+        for (int i=0; i<order.size(); i++) {
+            const bool test = (i % k) == f;
+            (test ? testData[f] : trainData[f]).push_back(data.row(order[i]));
+            (test ? testLab[f] : trainLab[f]).push_back(lab.row(order[i]));
+        }
+    }
+
+    QVector<SVMFold> folds;
+    foreach (double C, Cs)
+        foreach (double gamma, gammas)
+            foreach (double nu, nus)
+                foreach (double p, ps)
+                    for (int f=0; f<k; f++) {
+                        SVMFold fold;
+                        fold.trainData = &trainData[f];
+                        fold.trainLab = &trainLab[f];
+                        fold.testData = &testData[f];
+                        fold.testLab = &testLab[f];
+                        fold.params = params;
+                        fold.params.C = C;
+                        fold.params.gamma = gamma;
+                        fold.params.nu = nu;
+                        fold.params.p = p;
+                        fold.regression = regression;
+                        folds.append(fold);
+                    }
+
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<folds.size(); i++)
+        if (Globals->parallelism > 1) futures.addFuture(QtConcurrent::run(evaluateFold, &folds[i]));
+        else                          evaluateFold(&folds[i]);
+    futures.waitForFinished();
+
+    // Keep the first candidate with the lowest total error, as train_auto() does
+    int best = -1;
+    double bestError = std::numeric_limits<double>::max();
+    for (int i=0; i<folds.size(); i+=k) {
+        double error = 0;
+        for (int f=0; f<k; f++)
+            error = std::min(std::numeric_limits<double>::max(), error + folds[i+f].error);
+        if (error < bestError) {
+            bestError = error;
+            best = i;
+        }
+    }
+    if (best == -1) return false;
+
+    return svm.train(data, lab, Mat(), Mat(), folds[best].params);
+}
+
+static void trainSVM(LinearizedSVM &svm, Mat data, Mat lab, int kernel, int type, float C, float gamma)
 {
     if (data.type() != CV_32FC1)
         qFatal("Expected single channel floating point training data.");
@@ -70,9 +265,13 @@ static void trainSVM(SVM &svm, Mat data, Mat lab, int kernel, int type, float C,
     params.p = 0.1;
     params.nu = 0.5;
     if ((C == -1) || ((gamma == -1) && (kernel == CvSVM::RBF))) {
+        if (C != -1) params.C = C;
+        if (gamma != -1) params.gamma = gamma;
+        bool trained = false;
         try {
-            svm.train_auto(data, lab, Mat(), Mat(), params, 5);
-        } catch (...) {
+            trained = trainAuto(svm, data, lab, params, C == -1, gamma == -1, 5);
+        } catch (...) {}
+        if (!trained) {
             qWarning("Some classes do not contain sufficient examples or are not discriminative enough for accurate SVM classification.");
             svm.train(data, lab);
         }
@@ -81,6 +280,7 @@ static void trainSVM(SVM &svm, Mat data, Mat lab, int kernel, int type, float C,
         params.gamma = gamma;
         svm.train(data, lab, Mat(), Mat(), params);
     }
+    svm.linearize();
 
     CvSVMParams p = svm.get_params();
     qDebug("SVM C = %f  Gamma = %f  Support Vectors = %d", p.C, p.gamma, svm.get_support_vector_count());
@@ -91,6 +291,9 @@ static void trainSVM(SVM &svm, Mat data, Mat lab, int kernel, int type, float C,
  * \brief C. Burges. "A tutorial on support vector machines for pattern recognition,"
  * \author Josh Klontz \cite jklontz
  * Knowledge Discovery and Data Mining 2(2), 1998.
+ *
+ * Unspecified \em C and \em gamma are chosen by 5-fold cross validation with every fold trained in parallel.
+ * Linear kernels predict a template list with a single matrix product.
  */
 class SVMTransform : public Transform
 {
@@ -127,7 +330,7 @@ private:
     BR_PROPERTY(bool, returnDFVal, false)
 
 
-    SVM svm;
+    LinearizedSVM svm;
     QHash<QString, int> labelMap;
     QHash<int, QVariant> reverseLookup;
 
@@ -154,8 +357,40 @@ private:
         if (returnDFVal && reverseLookup.size() > 2)
             qFatal("Decision function for multiclass classification not implemented.");
 
+        output(src, dst, svm.predict(src.m().reshape(1, 1), returnDFVal));
+    }
+
+    // Linear kernels predict every template with one matrix product
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (!svm.linearized() || src.isEmpty()) {
+            Transform::project(src, dst);
+            return;
+        }
+
+        foreach (const Template &t, src)
+            if ((t.size() != 1) || (t.m().type() != CV_32FC1) || (int(t.m().total()) != svm.get_var_count())) {
+                Transform::project(src, dst);
+                return;
+            }
+
+        if (returnDFVal && reverseLookup.size() > 2)
+            qFatal("Decision function for multiclass classification not implemented.");
+
+        QVector<float> predictions(src.size());
+        svm.predictBatch(OpenCVUtils::toMat(src.data()), returnDFVal, predictions.data());
+
+        dst.clear();
+        for (int i=0; i<src.size(); i++) {
+            Template t;
+            output(src[i], t, predictions[i]);
+            dst.append(t);
+        }
+    }
+
+    void output(const Template &src, Template &dst, float prediction) const
+    {
         dst = src;
-        float prediction = svm.predict(src.m().reshape(1, 1), returnDFVal);
         if (returnDFVal) {
             dst.m() = Mat(1, 1, CV_32F);
             dst.m().at<float>(0, 0) = prediction;
@@ -234,7 +469,7 @@ private:
     BR_PROPERTY(Type, type, EPS_SVR)
     BR_PROPERTY(QString, inputVariable, "Label")
 
-    SVM svm;
+    LinearizedSVM svm;
 
     void train(const TemplateList &src)
     {
@@ -267,6 +502,24 @@ private:
         return svm.predict(delta.reshape(1, 1));
     }
 
+    bool compare(const Mat &targets, const Mat &query, float *scores) const
+    {
+        if ((targets.type() != CV_32FC1) || (targets.cols != svm.get_var_count()))
+            return false;
+
+        Mat deltas(targets.rows, targets.cols, CV_32FC1);
+        for (int i=0; i<targets.rows; i++)
+            absdiff(targets.row(i), query, deltas.row(i));
+
+        if (svm.linearized()) {
+            svm.predictBatch(deltas, false, scores);
+        } else {
+            for (int i=0; i<deltas.rows; i++)
+                scores[i] = svm.predict(deltas.row(i));
+        }
+        return true;
+    }
+
     void store(QDataStream &stream) const
     {
         storeSVM(svm, stream);
@@ -14,9 +14,11 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QMutex>
 #include <opencv2/imgproc/imgproc.hpp>
 #include "openbr_internal.h"
 
+#include "openbr/core/common.h"
 #include "openbr/core/opencvutils.h"
 
 using namespace cv;
@@ -24,22 +26,147 @@ using namespace cv;
 namespace br
 {
 
+/*!
+ * \brief Accumulates the normal equations of a per-pixel linear regression one block of training templates at a time.
+ *
+ * Each block sums its outer products locally and adds them to the shared totals once,
+ * so memory is <tt>O(d^2)</tt> in the number of input channels rather than proportional to the training pixels.
+ */
+struct NormalEquations
+{
+    const TemplateList *data;
+    QString inputVariable;
+    int inputs, blockSize;
+    Mat XtX, Xty;
+    double *pXtX, *pXty;
+    QMutex *mutex;
+
+    NormalEquations(const TemplateList &data_, const QString &inputVariable_, int inputs_, QMutex *mutex_)
+        : data(&data_), inputVariable(inputVariable_), inputs(inputs_), mutex(mutex_)
+    {
+        const int chunks = 4*std::max(1, Globals->parallelism);
+        blockSize = std::max(1, (data->size() + chunks - 1) / chunks);
+        XtX = Mat::zeros(inputs+1, inputs+1, CV_64FC1);
+        Xty = Mat::zeros(inputs+1, 1, CV_64FC1);
+        pXtX = XtX.ptr<double>();
+        pXty = Xty.ptr<double>();
+    }
+
+    int blocks() const
+    {
+        return (data->size() + blockSize - 1) / blockSize;
+    }
+
+    void operator()(int block) const
+    {
+        const int d = inputs+1;
+        QVector<double> a(d*d, 0), b(d, 0), x(d, 1);
+        for (int t=block*blockSize; t<std::min((block+1)*blockSize, data->size()); t++) {
+            const Template &src = data->at(t);
+            if (src.size() < inputs) qFatal("Expected at least %d source images, got %d.", inputs, src.size());
+            Mat y; src.file.get<Mat>(inputVariable).convertTo(y, CV_32F);
+
+            QList<Mat> m;
+            for (int i=0; i<inputs; i++) {
+                Mat mi; src[i].convertTo(mi, CV_32F);
+                if ((mi.size() != y.size()) || (mi.channels() != 1) || (y.channels() != 1))
+                    qFatal("Expected single channel %s matching the source image size.", qPrintable(inputVariable));
+                m.append(mi);
+            }
+
+            for (int r=0; r<y.rows; r++) {
+                const float *py = y.ptr<float>(r);
+                QVector<const float*> pm(inputs);
+                for (int i=0; i<inputs; i++)
+                    pm[i] = m[i].ptr<float>(r);
+                for (int c=0; c<y.cols; c++) {
+                    for (int i=0; i<inputs; i++)
+                        x[i] = pm[i][c];
+                    for (int i=0; i<d; i++) {
+                        b[i] += x[i]*py[c];
+                        for (int j=i; j<d; j++)
+                            a[i*d+j] += x[i]*x[j];
+                    }
+                }
+            }
+        }
+
+        QMutexLocker locker(mutex);
+        for (int i=0; i<d; i++) {
+            pXty[i] += b[i];
+            for (int j=i; j<d; j++)
+                pXtX[i*d+j] += a[i*d+j];
+        }
+    }
+
+    //! Solves for the coefficients of each input followed by the intercept.
+    static QList<float> solve(const TemplateList &data, const QString &inputVariable, int inputs)
+    {
+        QMutex mutex;
+        NormalEquations normalEquations(data, inputVariable, inputs, &mutex);
+        Common::ParallelFor(0, normalEquations.blocks(), normalEquations, Globals->parallelism);
+
+        Mat XtX = normalEquations.XtX;
+        for (int i=0; i<XtX.rows; i++)
+            for (int j=0; j<i; j++)
+                XtX.at<double>(i,j) = XtX.at<double>(j,i);
+
+        Mat w;
+        if (!cv::solve(XtX, normalEquations.Xty, w, DECOMP_CHOLESKY))
+            cv::solve(XtX, normalEquations.Xty, w, DECOMP_SVD);
+
+        QList<float> coefficients;
+        for (int i=0; i<w.rows; i++)
+            coefficients.append(w.at<double>(i));
+        return coefficients;
+    }
+};
+
 /*!
  * \ingroup transforms
  * \brief Prediction using only the red wavelength; magic numbers from jmp
+ *
+ * If \em inputVariable is set, training refits the coefficients by least squares against the image stored in that metadata key,
+ * otherwise the transform is untrainable and applies the given coefficients.
  * \author E. Taborsky \cite mmtaborsky
  */
-class RedLinearRegressionTransform : public UntrainableTransform
+class RedLinearRegressionTransform : public Transform
 {
     Q_OBJECT
+    Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
+    Q_PROPERTY(float rmult READ get_rmult WRITE set_rmult RESET reset_rmult STORED false)
+    Q_PROPERTY(float add READ get_add WRITE set_add RESET reset_add STORED false)
+    BR_PROPERTY(QString, inputVariable, "")
+    BR_PROPERTY(float, rmult, .6533673)
+    BR_PROPERTY(float, add, 41.268)
+
+    // Models saved without inputVariable hold no coefficients, as before they could be trained
+    void init()
+    {
+        trainable = !inputVariable.isEmpty();
+    }
+
+    void train(const TemplateList &data)
+    {
+        const QList<float> coefficients = NormalEquations::solve(data, inputVariable, 1);
+        rmult = coefficients[0];
+        add = coefficients[1];
+    }
+
+    void store(QDataStream &stream) const
+    {
+        if (trainable) stream << rmult << add;
+    }
+
+    void load(QDataStream &stream)
+    {
+        if (trainable) stream >> rmult >> add;
+    }
 
     void project(const Template &src, Template &dst) const
     {
         Mat m; src[0].convertTo(m, CV_32F); assert(m.isContinuous() && (m.channels() == 1));
 
-        const float rmult = .6533673;
-        const float add = 41.268;
-
         Mat dst1(m.size(), CV_32F);
         int rows = m.rows;
         int cols = m.cols;
@@ -63,11 +190,49 @@ BR_REGISTER(Transform, RedLinearRegressionTransform)
 /*!
  * \ingroup transforms
  * \brief Prediction with magic numbers from jmp; must get input as blue;green;red
+ *
+ * If \em inputVariable is set, training refits the coefficients by least squares against the image stored in that metadata key,
+ * otherwise the transform is untrainable and applies the given coefficients.
  * \author E. Taborsky \cite mmtaborsky
  */
-class OrigLinearRegressionTransform : public UntrainableMetaTransform
+class OrigLinearRegressionTransform : public MetaTransform
 {
     Q_OBJECT
+    Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
+    Q_PROPERTY(float bmult READ get_bmult WRITE set_bmult RESET reset_bmult STORED false)
+    Q_PROPERTY(float gmult READ get_gmult WRITE set_gmult RESET reset_gmult STORED false)
+    Q_PROPERTY(float rmult READ get_rmult WRITE set_rmult RESET reset_rmult STORED false)
+    Q_PROPERTY(float add READ get_add WRITE set_add RESET reset_add STORED false)
+    BR_PROPERTY(QString, inputVariable, "")
+    BR_PROPERTY(float, bmult, -.020115)
+    BR_PROPERTY(float, gmult, -.09625)
+    BR_PROPERTY(float, rmult, .809911)
+    BR_PROPERTY(float, add, 35.78)
+
+    // Models saved without inputVariable hold no coefficients, as before they could be trained
+    void init()
+    {
+        trainable = !inputVariable.isEmpty();
+    }
+
+    void train(const TemplateList &data)
+    {
+        const QList<float> coefficients = NormalEquations::solve(data, inputVariable, 3);
+        bmult = coefficients[0];
+        gmult = coefficients[1];
+        rmult = coefficients[2];
+        add = coefficients[3];
+    }
+
+    void store(QDataStream &stream) const
+    {
+        if (trainable) stream << bmult << gmult << rmult << add;
+    }
+
+    void load(QDataStream &stream)
+    {
+        if (trainable) stream >> bmult >> gmult >> rmult >> add;
+    }
 
     void project(const Template &src, Template &dst) const
     {
@@ -76,8 +241,6 @@ class OrigLinearRegressionTransform : public UntrainableMetaTransform
         Mat m2; src[1].convertTo(m2, CV_32F); assert(m2.isContinuous() && (m2.channels() == 1));
         Mat m3; src[2].convertTo(m3, CV_32F); assert(m3.isContinuous() && (m3.channels() == 1));
 
-        const float rmult = .809911, gmult = -.09625, bmult = -.020115, add = 35.78;
-
         Mat dstmat(m1.size(), CV_32F);
 
         int rows = m1.rows;
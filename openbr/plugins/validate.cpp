@@ -1,15 +1,21 @@
 #include <QFutureSynchronizer>
+#include <QScopedPointer>
+#include <QSet>
 #include <QtConcurrentRun>
 #include "openbr_internal.h"
 #include "openbr/core/common.h"
 #include <openbr/core/qtutils.h>
 
+using namespace cv;
+
 namespace br
 {
 
-static void _train(Transform * transform, TemplateList data) // think data has to be a copy -cao
+static void _train(Transform *transform, const TemplateList *data, TrainingSlots *slots)
 {
-    transform->train(data);
+    slots->acquire();
+    transform->train(*data);
+    slots->release();
 }
 
 /*!
@@ -31,11 +37,47 @@ class CrossValidateTransform : public MetaTransform
     // numPartitions copies of transform specified by description.
     QList<br::Transform*> transforms;
 
+    // The leading stages of a pipeline that neither train nor vary over time, as PipeTransform finds them, they are the same in every fold
+    static int sharedStages(Transform *transform)
+    {
+        int stages = 0;
+        if (transform->inherits("br::PipeTransform") &&
+            !QMetaObject::invokeMethod(transform, "prefixLength", Qt::DirectConnection, Q_RETURN_ARG(int, stages)))
+            qFatal("Failed to find the prefix of %s.", qPrintable(transform->objectName()));
+        return stages;
+    }
+
+    // A pipeline of the stages of a fold after the shared ones, the fold keeps ownership of them
+    static Transform *unsharedStages(Transform *transform, int shared)
+    {
+        CompositeTransform *suffix = dynamic_cast<CompositeTransform*>(Transform::make("Pipe([])", NULL));
+        if (suffix == NULL) qFatal("Dynamic cast failed!");
+        const QList<Transform*> &stages = dynamic_cast<CompositeTransform*>(transform)->transforms;
+        for (int i=shared; i<stages.size(); i++)
+            suffix->transforms.append(stages[i]);
+        suffix->init();
+        return suffix;
+    }
+
     // Treating this transform as a leaf (in terms of update training scheme), the child transform
     // of this transform will lose any structure present in the training QList<TemplateList>, which
     // is generally incorrect behavior.
-    void train(const TemplateList &data)
+    void train(const TemplateList &templates)
     {
+        if (transforms.isEmpty())
+            transforms.append(make(description));
+
+        // Project through the stages the folds share once rather than once per fold,
+        // by the pipe itself so its projections are taken from br::Context::prefixCachePath when it is set
+        TemplateList data = templates;
+        const int shared = sharedStages(transforms.first());
+        if (shared > 0) {
+            fprintf(stderr, "\nCrossValidate projecting shared stages...");
+            if (!QMetaObject::invokeMethod(transforms.first(), "projectPrefix", Qt::DirectConnection,
+                                           Q_RETURN_ARG(br::TemplateList, data), Q_ARG(br::TemplateList, templates)))
+                qFatal("Failed to project the prefix of %s.", qPrintable(transforms.first()->objectName()));
+        }
+
         int numPartitions = 0;
         QList<int> partitions; partitions.reserve(data.size());
         foreach (const File &file, data.files()) {
@@ -47,11 +89,16 @@ class CrossValidateTransform : public MetaTransform
             transforms.append(make(description));
 
         if (numPartitions < 2) {
-            transforms.first()->train(data);
+            if (shared > 0) {
+                QScopedPointer<Transform> suffix(unsharedStages(transforms.first(), shared));
+                suffix->train(data);
+            } else {
+                transforms.first()->train(templates);
+            }
             return;
         }
 
-        QFutureSynchronizer<void> futures;
+        QList<TemplateList> folds;
         for (int i=0; i<numPartitions; i++) {
             QList<int> partitionsBuffer = partitions;
             TemplateList partitionedData = data;
@@ -92,10 +139,19 @@ class CrossValidateTransform : public MetaTransform
                     j--;
                 } else j--;
             }
-            // Train on the remaining templates
-            futures.addFuture(QtConcurrent::run(_train, transforms[i], partitionedData));
+            folds.append(partitionedData);
         }
+
+        // Folds train concurrently on the remaining templates, as many at once as fit br::Context::trainingMemory
+        QList<Transform*> trainees;
+        for (int i=0; i<numPartitions; i++)
+            trainees.append(shared > 0 ? unsharedStages(transforms[i], shared) : transforms[i]);
+        TrainingSlots slots(TrainingSlots::bytes(folds.first()), numPartitions);
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<numPartitions; i++)
+            futures.addFuture(QtConcurrent::run(_train, trainees[i], &folds[i], &slots));
         futures.waitForFinished();
+        if (shared > 0) qDeleteAll(trainees);
     }
 
     void project(const Template &src, Template &dst) const
@@ -147,7 +203,16 @@ class CrossValidateDistance : public Distance
         static const QString key("Partition"); // More efficient to preallocate this
         const int partitionA = a.file.get<int>(key, 0);
         const int partitionB = b.file.get<int>(key, 0);
-        return (partitionA != partitionB) ? -std::numeric_limits<float>::max() : 0;
+        return ((partitionA != -1) && (partitionA != partitionB)) ? -std::numeric_limits<float>::max() : 0;
+    }
+
+    bool partition(const TemplateList &templates, QList<int> &partitions) const
+    {
+        static const QString key("Partition");
+        partitions.reserve(templates.size());
+        foreach (const Template &t, templates)
+            partitions.append(t.file.get<int>(key, 0));
+        return true;
     }
 };
 
@@ -180,6 +245,25 @@ class FilterDistance : public Distance
         }
         return 0;
     }
+
+    // The filters don't depend on the query, so one row of target flags serves every query
+    bool exclude(const TemplateList &targets, const TemplateList &queries, Mat &excluded) const
+    {
+        if (Globals->filters.isEmpty()) return false;
+        Mat flags(1, targets.size(), CV_8UC1, Scalar(0));
+        uchar *flag = flags.ptr<uchar>();
+        foreach (const QString &key, Globals->filters.keys()) {
+            const QSet<QString> values = QSet<QString>::fromList(Globals->filters[key]);
+            if (values.isEmpty()) continue;
+            for (int j=0; j<targets.size(); j++) {
+                if (flag[j]) continue;
+                const QString metadata = targets[j].file.get<QString>(key, "");
+                if (metadata.isEmpty() || !values.contains(metadata)) flag[j] = 1;
+            }
+        }
+        excluded = repeat(flags, queries.size(), 1);
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, FilterDistance)
@@ -230,6 +314,53 @@ class MetadataDistance : public Distance
         }
         return 0;
     }
+
+    bool exclude(const TemplateList &targets, const TemplateList &queries, Mat &excluded) const
+    {
+        if (filters.isEmpty()) return false;
+        excluded = Mat::zeros(queries.size(), targets.size(), CV_8UC1);
+        foreach (const QString &key, filters) {
+            // Code each distinct target value as an integer once, -1 for targets without one
+            QHash<QString, int> codes;
+            QVector<int> column(targets.size());
+            for (int j=0; j<targets.size(); j++) {
+                const QString aValue = targets[j].file.get<QString>(key, QString());
+                if (aValue.isEmpty()) {
+                    column[j] = -1;
+                } else {
+                    QHash<QString, int>::const_iterator it = codes.constFind(aValue);
+                    if (it == codes.constEnd()) it = codes.insert(aValue, codes.size());
+                    column[j] = it.value();
+                }
+            }
+
+            for (int i=0; i<queries.size(); i++) {
+                const File &b = queries[i].file;
+                QString bValue = b.get<QString>(key, QString());
+                if (bValue.isEmpty()) bValue = QtUtils::toString(b.get<QPointF>(key, QPointF()));
+                if (bValue.isEmpty()) continue;
+
+                // Codes the query accepts
+                QVector<uchar> accepted(codes.size(), 0);
+                bool ok;
+                const QPointF range = QtUtils::toPoint(bValue, &ok);
+                if (ok) /* Range */ {
+                    for (int value=range.x(); value<=int(range.y()); value++) {
+                        const int code = codes.value(QString::number(value), -1);
+                        if (code >= 0) accepted[code] = 1;
+                    }
+                } else {
+                    const int code = codes.value(bValue, -1);
+                    if (code >= 0) accepted[code] = 1;
+                }
+
+                uchar *row = excluded.ptr<uchar>(i);
+                for (int j=0; j<targets.size(); j++)
+                    if ((column[j] >= 0) && !accepted[column[j]]) row[j] = 1;
+            }
+        }
+        return true;
+    }
 };
 
 
@@ -14,8 +14,12 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QHash>
+#include <QMutex>
+#include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include "openbr_internal.h"
+#include "openbr/core/gabor.h"
 
 using namespace cv;
 
@@ -55,44 +59,9 @@ private:
 
     Mat kReal, kImaginary;
 
-    friend class GaborJetTransform;
-
-    static void makeWavelet(float lambda, float theta, float psi, float sigma, float gamma, Mat &kReal, Mat &kImaginary)
-    {
-        float sigma_x = sigma;
-        float sigma_y = sigma/gamma;
-
-        // Bounding box
-        const double nstds = 3;
-        int xmax = std::ceil(std::max(1.0, std::max(std::abs(nstds*sigma_x*cos(theta)),
-                                                    std::abs(nstds*sigma_y*sin(theta)))));
-        int ymax = std::ceil(std::max(1.0, std::max(std::abs(nstds*sigma_x*sin(theta)),
-                                                    std::abs(nstds*sigma_y*cos(theta)))));
-
-        // Compute kernels
-        kReal.create(2*ymax+1, 2*xmax+1, CV_32FC1);
-        kImaginary.create(2*ymax+1, 2*xmax+1, CV_32FC1);
-        for (int y = -ymax; y <= ymax; y++) {
-            int row = y + ymax;
-            for (int x = -xmax; x <= xmax; x++) {
-                int col = x + xmax;
-                float x_prime = x*cos(theta) + y*sin(theta);
-                float y_prime = -x*sin(theta) + y*cos(theta);
-                float a = exp(-0.5 * (x_prime*x_prime + gamma*gamma*y_prime*y_prime)/(sigma*sigma));
-                float b = 2*CV_PI*x_prime/lambda+psi;
-                kReal.at<float>(row, col) = a*cos(b);
-                kImaginary.at<float>(row, col) = a*sin(b);
-            }
-        }
-
-        // Remove DC component, should only effect real kernel
-        subtract(kReal, mean(kReal), kReal);
-        subtract(kImaginary, mean(kImaginary), kImaginary);
-    }
-
     void init()
     {
-        makeWavelet(lambda, theta, psi, sigma, gamma, kReal, kImaginary);
+        Gabor::wavelet(lambda, theta, psi, sigma, gamma, kReal, kImaginary);
     }
 
     void project(const Template &src, Template &dst) const
@@ -118,6 +87,10 @@ BR_REGISTER(Transform, GaborTransform)
 /*!
  * \ingroup transforms
  * \brief A vector of gabor wavelets applied at a point.
+ *
+ * When \em fft is set the bank is evaluated in the frequency domain: the image is transformed once,
+ * multiplied by each wavelet's cached spectrum and inverse transformed, then sampled at the points.
+ * This pays off for large banks sampled at many points, the spatial path is cheaper for a few points.
  * \author Josh Klontz \cite jklontz
  */
 class GaborJetTransform : public UntrainableTransform
@@ -135,21 +108,28 @@ class GaborJetTransform : public UntrainableTransform
     BR_PROPERTY(QList<float>, psis, QList<float>())
     BR_PROPERTY(QList<float>, sigmas, QList<float>())
     BR_PROPERTY(QList<float>, gammas, QList<float>())
+    Q_PROPERTY(bool fft READ get_fft WRITE set_fft RESET reset_fft STORED false)
     BR_PROPERTY(GaborTransform::Component, component, GaborTransform::Phase)
+    BR_PROPERTY(bool, fft, false)
 
     QList<Mat> kReals, kImaginaries;
 
+    // Wavelet spectra by padded image size, shared across images
+    mutable QHash< QPair<int,int>, QList<Mat> > spectra;
+    mutable QMutex spectraLock;
+
     void init()
     {
         kReals.clear();
         kImaginaries.clear();
+        spectra.clear();
         foreach (float lambda, lambdas)
             foreach (float theta, thetas)
                 foreach (float psi, psis)
                     foreach (float sigma, sigmas)
                         foreach (float gamma, gammas) {
                             Mat kReal, kImaginary;
-                            GaborTransform::makeWavelet(lambda, theta, psi, sigma, gamma, kReal, kImaginary);
+                            Gabor::wavelet(lambda, theta, psi, sigma, gamma, kReal, kImaginary);
                             kReals.append(kReal);
                             kImaginaries.append(kImaginary);
                         }
@@ -162,7 +142,7 @@ class GaborJetTransform : public UntrainableTransform
                  kReal.cols,
                  kReal.rows);
 
-        float real = 0, imaginary = 0, magnitude = 0, phase = 0;
+        float real = 0, imaginary = 0;
         if (component != GaborTransform::Imaginary) {
             Mat dst;
             multiply(src(roi), kReal, dst);
@@ -173,6 +153,12 @@ class GaborJetTransform : public UntrainableTransform
             multiply(src(roi), kImaginary, dst);
             imaginary = sum(dst)[0];
         }
+        return select(real, imaginary, component);
+    }
+
+    static float select(float real, float imaginary, GaborTransform::Component component)
+    {
+        float magnitude = 0, phase = 0;
         if ((component == GaborTransform::Magnitude) || (component == GaborTransform::Phase)) {
             magnitude = sqrt(real*real + imaginary*imaginary);
             phase = atan2(imaginary, real)*180/CV_PI;
@@ -187,10 +173,59 @@ class GaborJetTransform : public UntrainableTransform
         return dst;
     }
 
+    QList<Mat> getSpectra(const Size &size) const
+    {
+        QMutexLocker locker(&spectraLock);
+        const QPair<int,int> key(size.height, size.width);
+        if (!spectra.contains(key)) {
+            QList<Mat> kernels;
+            for (int j=0; j<kReals.size(); j++)
+                kernels.append(Gabor::spectrum(kReals[j], kImaginaries[j], size));
+            spectra.insert(key, kernels);
+        }
+        return spectra.value(key);
+    }
+
+    // Correlating with the complex wavelet kReal + i*kImaginary yields real - i*imaginary,
+    // and zero padding to at least the image size means the clamped windows never wrap.
+    void projectFFT(const Mat &src, const QList<QPointF> &points, Mat &dst) const
+    {
+        int rows = src.rows, cols = src.cols;
+        for (int j=0; j<kReals.size(); j++) {
+            rows = std::max(rows, kReals[j].rows);
+            cols = std::max(cols, kReals[j].cols);
+        }
+        const Size size(getOptimalDFTSize(cols), getOptimalDFTSize(rows));
+
+        Mat m, padded, image;
+        src.convertTo(m, CV_32F);
+        copyMakeBorder(m, padded, 0, size.height - m.rows, 0, size.width - m.cols, BORDER_CONSTANT, Scalar(0));
+        dft(padded, image, DFT_COMPLEX_OUTPUT);
+
+        const QList<Mat> kernels = getSpectra(size);
+        for (int j=0; j<kernels.size(); j++) {
+            Mat product, correlation;
+            mulSpectrums(image, kernels[j], product, 0, true);
+            idft(product, correlation, DFT_SCALE | DFT_COMPLEX_OUTPUT);
+
+            for (int i=0; i<points.size(); i++) {
+                const int x = std::max(std::min((int)(points[i].x() - kReals[j].cols/2.f), src.cols - kReals[j].cols), 0);
+                const int y = std::max(std::min((int)(points[i].y() - kReals[j].rows/2.f), src.rows - kReals[j].rows), 0);
+                const Vec2f value = correlation.at<Vec2f>(y, x);
+                dst.at<float>(i,j) = select(value[0], -value[1], component);
+            }
+        }
+    }
+
     void project(const Template &src, Template &dst) const
     {
         const QList<QPointF> points = src.file.points();
         dst = Mat(points.size(), kReals.size(), CV_32FC1);
+        if (fft) {
+            projectFFT(src, points, dst);
+            return;
+        }
+
         for (int i=0; i<points.size(); i++)
             for (int j=0; j<kReals.size(); j++)
                     dst.m().at<float>(i,j) = response(src, points[i], kReals[j], kImaginaries[j], component);
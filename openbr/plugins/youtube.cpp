@@ -1,8 +1,13 @@
 #include <QCoreApplication>
+#include <QHash>
+#include <QMutex>
 #include <QProcess>
+#include <QSemaphore>
+#include <QSharedPointer>
 #include "openbr_internal.h"
 
 #include "openbr/core/common.h"
+#include "openbr/core/qtutils.h"
 
 namespace br
 {
@@ -10,39 +15,112 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Implements the YouTubesFaceDB \cite wolf11 experimental protocol.
+ *
+ * Each video's frame directory is enrolled once, the first time a pair needs it, into <tt>YTF-</tt><i>algorithm</i><tt>/videos/</tt>.
+ * Pairs then compare the enrolled galleries, so a video shared by several pairs is only enrolled once.
+ * Up to \em processes enrollments and comparisons run at the same time, splitting br::Context::parallelism between them,
+ * \c -1 runs one per thread.
  * \author Josh Klontz \cite jklontz
  */
 class YouTubeFacesDBTransform : public UntrainableMetaTransform
 {
     Q_OBJECT
     Q_PROPERTY(QString algorithm READ get_algorithm WRITE set_algorithm RESET reset_algorithm STORED false)
+    Q_PROPERTY(int processes READ get_processes WRITE set_processes RESET reset_processes STORED false)
     BR_PROPERTY(QString, algorithm, "")
+    BR_PROPERTY(int, processes, -1)
+
+    static QMutex videosLock;
+    static QHash< QString, QSharedPointer<QMutex> > videoLocks;
+
+    int processCount() const
+    {
+        return (processes < 1) ? std::max(1, Globals->parallelism) : processes;
+    }
+
+    int run(const QStringList &arguments) const
+    {
+        static QSemaphore *processSlots = NULL;
+        {
+            QMutexLocker locker(&videosLock);
+            if (processSlots == NULL) processSlots = new QSemaphore(processCount());
+        }
+
+        const QStringList common = QStringList() << "-algorithm" << algorithm
+                                                 << "-parallelism" << QString::number(std::max(1, Globals->parallelism / processCount()))
+                                                 << "-path" << Globals->path;
+        processSlots->acquire();
+        const int result = QProcess::execute(QCoreApplication::applicationFilePath(), common + arguments);
+        processSlots->release();
+        return result;
+    }
+
+    // Returns the gallery of the video's enrolled frames, enrolling it if this is the first pair to need it
+    QString enrolled(const QString &video) const
+    {
+        QString name = video;
+        name.replace('/', '_').replace('\\', '_');
+        const QString gallery = "YTF-"+algorithm+"/videos/"+name+".gal";
+        const QString partial = "YTF-"+algorithm+"/videos/"+name+".partial.gal";
+
+        QSharedPointer<QMutex> videoLock;
+        {
+            QMutexLocker locker(&videosLock);
+            QSharedPointer<QMutex> &lock = videoLocks[gallery];
+            if (lock.isNull()) lock = QSharedPointer<QMutex>(new QMutex());
+            videoLock = lock;
+        }
+
+        // Other pairs sharing this video wait for its enrollment rather than repeating it
+        QMutexLocker locker(videoLock.data());
+        // Enrolled under a temporary name and renamed once complete, so an interrupted enrollment isn't mistaken for a finished one
+        if (!QFileInfo(gallery).exists()) {
+            QtUtils::touchDir(QFileInfo(gallery));
+            const QStringList suffixes = QStringList() << ".index" << ".tombstones" << "";
+            foreach (const QString &suffix, suffixes)
+                QFile::remove(partial + suffix);
+
+            const int result = run(QStringList() << "-enroll" << File(video).resolved() << partial);
+            if (result != 0) {
+                qWarning("Process for enrolling %s returned %d.", qPrintable(video), result);
+                foreach (const QString &suffix, suffixes)
+                    QFile::remove(partial + suffix);
+                return gallery;
+            }
+
+            // The gallery itself goes last, its existence marks the enrollment complete
+            foreach (const QString &suffix, suffixes) {
+                if (!QFileInfo(partial + suffix).exists()) continue;
+                QFile::remove(gallery + suffix);
+                if (!QFile::rename(partial + suffix, gallery + suffix))
+                    qWarning("Failed to rename %s to %s.", qPrintable(partial + suffix), qPrintable(gallery + suffix));
+            }
+        }
+        return gallery;
+    }
 
     void project(const Template &src, Template &dst) const
     {
-        static QMutex mutex;
+        dst = Template();
 
         // First input is the header in 'splits.txt'
         if (src.file.get<int>("Index") == 0) return;
 
         const QStringList words = src.file.name.split(", ");
         const QString matrix = "YTF-"+algorithm+"/"+words[0] + "_" + words[1] + "_" + words[4] + ".mtx";
-        const QStringList arguments = QStringList() << "-algorithm" << algorithm
-                                                    << "-parallelism" << QString::number(Globals->parallelism)
-                                                    << "-path" << Globals->path
-                                                    << "-compare" << File(words[2]).resolved() << File(words[3]).resolved() << matrix;
-        mutex.lock();    
-        int result = 0;
-        if (!QFileInfo(matrix).exists())
-            result = QProcess::execute(QCoreApplication::applicationFilePath(), arguments);
-        mutex.unlock();
+        if (QFileInfo(matrix).exists()) return;
 
+        const QString target = enrolled(words[2]);
+        const QString query = enrolled(words[3]);
+        const int result = run(QStringList() << "-compare" << target << query << matrix);
         if (result != 0)
             qWarning("Process for computing %s returned %d.", qPrintable(matrix), result);
-        dst = Template();
     }
 };
 
+QMutex YouTubeFacesDBTransform::videosLock;
+QHash< QString, QSharedPointer<QMutex> > YouTubeFacesDBTransform::videoLocks;
+
 BR_REGISTER(Transform, YouTubeFacesDBTransform)
 
 } // namespace br
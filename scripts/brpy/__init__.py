@@ -31,6 +31,7 @@ def init_brpy(br_loc='/usr/local/lib'):
     br.br_compare_n.argtypes = [c_int, POINTER(c_char_p)] + _string_args(2)
     br.br_pairwise_compare.argtypes = _string_args(3)
     br.br_convert.argtypes = _string_args(3)
+    br.br_deduplicate.argtypes = [c_char_p, c_float, c_char_p]
     br.br_enroll.argtypes = _string_args(2)
     br.br_enroll_n.argtypes = _var_string_args(1)
     br.br_eval.argtypes = _string_args(3)
@@ -111,5 +112,89 @@ def init_brpy(br_loc='/usr/local/lib'):
     br.br_load_from_gallery.restype = c_void_p
     br.br_add_to_gallery.argtypes = [c_void_p, c_void_p]
     br.br_close_gallery.argtypes = [c_void_p]
+    br.br_wrap_img.argtypes = [c_void_p, c_int, c_int, c_int, c_int]
+    br.br_wrap_img.restype = c_void_p
+    br.br_wrap_features.argtypes = [c_void_p, c_int, c_int, c_int]
+    br.br_wrap_features.restype = c_void_p
+    br.br_enroll_templates_async.argtypes = [POINTER(c_void_p), c_int]
+    br.br_enroll_templates_async.restype = c_void_p
+    br.br_enrollment_dims.argtypes = [c_void_p]
+    br.br_enrollment_dims.restype = c_int
+    br.br_take_enrollment.argtypes = [c_void_p, POINTER(c_float), c_int]
+    br.br_take_enrollment.restype = c_int
+    br.br_make_search.argtypes = [c_char_p]
+    br.br_make_search.restype = c_void_p
+    br.br_search_gallery.argtypes = [c_void_p]
+    br.br_search_gallery.restype = c_void_p
+    br.br_search_templates.argtypes = [c_void_p, c_void_p, c_int, POINTER(c_int), POINTER(c_float)]
+    br.br_search_templates.restype = c_int
+    br.br_free_search.argtypes = [c_void_p]
 
     return br
+
+# OpenCV depths of the NumPy types the C API can wrap
+_cv_depths = {'uint8': 0, 'int8': 1, 'uint16': 2, 'int16': 3, 'int32': 4, 'float32': 5, 'float64': 6}
+
+def _cv_type(array, channels):
+    name = str(array.dtype)
+    if name not in _cv_depths:
+        raise ValueError('Unsupported array type %s' % name)
+    return _cv_depths[name] + ((channels - 1) << 3)
+
+def _wrap_img(br, image):
+    """Wraps a rows x cols (x channels) NumPy image in a template sharing its pixels"""
+    import numpy as np
+    if image.ndim not in (2, 3):
+        raise ValueError('Images must have two or three dimensions')
+    channels = image.shape[2] if image.ndim == 3 else 1
+    # Rows may be strided, but pixels within a row must be packed
+    if image.strides[1] != image.itemsize * channels or (image.ndim == 3 and image.strides[2] != image.itemsize):
+        image = np.ascontiguousarray(image)
+    tmpl = br.br_wrap_img(image.ctypes.data, image.shape[0], image.shape[1], image.strides[0], _cv_type(image, channels))
+    return tmpl, image
+
+def enroll_images(br, images):
+    """Enrolls a batch of NumPy images with the current algorithm, returning an N x D float32 array of features.
+    Pixels are not copied, and features are written straight into the returned array.
+    Rows of images that failed to enroll are zero.
+    Algorithms that detect several or no templates per image return that many rows, at most one per image."""
+    import numpy as np
+    wrapped = [_wrap_img(br, image) for image in images]
+    tmpls = (c_void_p * len(wrapped))(*[tmpl for tmpl, _ in wrapped])
+    enrollment = br.br_enroll_templates_async(tmpls, len(wrapped))
+    dims = br.br_enrollment_dims(enrollment)
+    features = np.zeros((len(wrapped), max(dims, 1)), dtype=np.float32)
+    enrolled = br.br_take_enrollment(enrollment, features.ctypes.data_as(POINTER(c_float)), dims)
+    for tmpl, _ in wrapped:
+        br.br_free_template(tmpl)
+    return features[:min(enrolled, len(wrapped)), :dims]
+
+class Search(object):
+    """Top-k search of an enrolled gallery kept resident between queries"""
+
+    def __init__(self, br, gallery):
+        self.br = br
+        self.handle = br.br_make_search(gallery)
+
+    def filename(self, index):
+        """The file name of the gallery template at index"""
+        return self.br.br_get_filename(self.br.br_get_template(self.br.br_search_gallery(self.handle), int(index)))
+
+    def top_k(self, queries, k):
+        """Searches the rows of an N x D NumPy feature array, returning N x k arrays of gallery indices and scores.
+        Query rows are compared in place, and indices are -1 where the gallery has fewer than k templates."""
+        import numpy as np
+        queries = np.ascontiguousarray(queries)
+        if queries.ndim == 1:
+            queries = queries.reshape(1, -1)
+        tl = self.br.br_wrap_features(queries.ctypes.data, queries.shape[0], queries.shape[1], _cv_type(queries, 1))
+        indices = np.empty((queries.shape[0], k), dtype=np.int32)
+        scores = np.empty((queries.shape[0], k), dtype=np.float32)
+        self.br.br_search_templates(self.handle, tl, k, indices.ctypes.data_as(POINTER(c_int)), scores.ctypes.data_as(POINTER(c_float)))
+        self.br.br_free_template_list(tl)
+        return indices, scores
+
+    def close(self):
+        if self.handle:
+            self.br.br_free_search(self.handle)
+            self.handle = None
@@ -0,0 +1,40 @@
+import java.nio.ByteBuffer;
+
+/**
+ * Bulk bindings to the OpenBR C API.
+ *
+ * Every call passes a whole batch of images in one JNI crossing.
+ * Images are direct ByteBuffers of decoded pixels, read in place without copying,
+ * described by their rows, cols, bytes per row and OpenCV matrix type (16 for 8-bit BGR).
+ */
+public class OpenBR {
+    static {
+        System.loadLibrary("openbr");
+    }
+
+    /** Initialize OpenBR and choose the algorithm to enroll and compare with. */
+    public static native void initialize(String sdkPath, String algorithm);
+
+    /** Release OpenBR, no other methods may be called afterwards. */
+    public static native void shutdown();
+
+    /**
+     * Enroll images into features, one row of dims floats per image.
+     * At most images.length rows are written, even when detection finds several templates in an image.
+     * @return The number of templates enrolled, which can differ from images.length.
+     */
+    public static native int enroll(ByteBuffer[] images, int[] rows, int[] cols, int[] strides, int[] types, float[] features, int dims);
+
+    /** Load an enrolled gallery for repeated searches, released by freeSearch. */
+    public static native long makeSearch(String gallery);
+
+    /**
+     * Enroll images and find the k most similar gallery templates of each, k must be at least 1.
+     * Fills k indices and scores per image, -1 where there are fewer than k results.
+     * @return The number of images searched.
+     */
+    public static native int search(long search, ByteBuffer[] images, int[] rows, int[] cols, int[] strides, int[] types, int k, int[] indices, float[] scores);
+
+    /** Release a search made by makeSearch. */
+    public static native void freeSearch(long search);
+}
@@ -0,0 +1,81 @@
+# Performance regression tests run by CTest.
+#
+# Included from CMakeLists.txt, br_add_performance_test(<name> <metric> <command>...) adds a test that runs <command>,
+# extracts the throughput captured by the regular expression <metric> from its output
+# and fails if it falls more than BR_PERFORMANCE_TOLERANCE percent below the baseline stored for this machine.
+# The first run on a machine records the baseline, set BR_UPDATE_BASELINES in the environment to record it again.
+#
+# Run with cmake -P by the tests themselves, with:
+#   COMMAND      - The command, arguments separated by '|'
+#   METRIC       - Regular expression whose first capture is the throughput, higher is better
+#   BASELINE     - File holding this machine's baseline
+#   TOLERANCE    - Allowed regression in percent
+
+if(NOT CMAKE_SCRIPT_MODE_FILE)
+  set(BR_PERFORMANCE_BASELINES "${BR_SHARE_DIR}/baselines" CACHE PATH "Folder of per machine performance test baselines")
+  set(BR_PERFORMANCE_TOLERANCE 20 CACHE STRING "Allowed throughput regression in percent before a performance test fails")
+  site_name(BR_PERFORMANCE_SITE)
+
+  function(br_add_performance_test name metric)
+    string(REPLACE ";" "|" command "${ARGN}")
+    set(options -DCOMMAND=${command} -DMETRIC=${metric} -DTOLERANCE=${BR_PERFORMANCE_TOLERANCE}
+                -DBASELINE=${BR_PERFORMANCE_BASELINES}/${BR_PERFORMANCE_SITE}/${name}.txt)
+    add_test(NAME ${name} WORKING_DIRECTORY ${CMAKE_BINARY_DIR} COMMAND ${CMAKE_COMMAND} ${options} -P ${BR_SHARE_DIR}/cmake/PerformanceTest.cmake)
+    set_tests_properties(${name} PROPERTIES LABELS performance RUN_SERIAL TRUE)
+  endfunction()
+  return()
+endif()
+
+# Scientific or decimal throughput in thousandths, as 64 bit integer math is all CMake has
+function(to_milli value result)
+  if(NOT value MATCHES "^([0-9]+)(\\.([0-9]*))?([eE]([-+]?[0-9]+))?$")
+    message(FATAL_ERROR "Unable to parse throughput '${value}'.")
+  endif()
+  set(integer "${CMAKE_MATCH_1}")
+  set(fraction "${CMAKE_MATCH_3}")
+  set(exponent "${CMAKE_MATCH_5}")
+  if(NOT exponent)
+    set(exponent 0)
+  endif()
+  set(digits "${integer}${fraction}000")
+  string(LENGTH "${integer}" point)
+  math(EXPR point "${point} + ${exponent} + 3")
+  string(LENGTH "${digits}" length)
+  while(length LESS point)
+    set(digits "${digits}0")
+    math(EXPR length "${length} + 1")
+  endwhile()
+  if(point LESS 1)
+    set(${result} 0 PARENT_SCOPE)
+  else()
+    string(SUBSTRING "${digits}" 0 ${point} digits)
+    string(REGEX REPLACE "^0+([0-9])" "\\1" digits "${digits}")
+    set(${result} ${digits} PARENT_SCOPE)
+  endif()
+endfunction()
+
+string(REPLACE "|" ";" command "${COMMAND}")
+execute_process(COMMAND ${command} RESULT_VARIABLE status OUTPUT_VARIABLE output ERROR_VARIABLE errors)
+if(NOT status EQUAL 0)
+  message(FATAL_ERROR "${COMMAND} failed (${status}):\n${output}\n${errors}")
+endif()
+if(NOT output MATCHES "${METRIC}")
+  message(FATAL_ERROR "No throughput matching '${METRIC}' in:\n${output}")
+endif()
+set(measured "${CMAKE_MATCH_1}")
+to_milli("${measured}" measuredMilli)
+
+if(NOT EXISTS "${BASELINE}" OR NOT "$ENV{BR_UPDATE_BASELINES}" STREQUAL "")
+  file(WRITE "${BASELINE}" "${measured}\n")
+  message("Recorded baseline ${measured} in ${BASELINE}")
+  return()
+endif()
+
+file(STRINGS "${BASELINE}" baseline LIMIT_COUNT 1)
+to_milli("${baseline}" baselineMilli)
+math(EXPR measuredScaled "${measuredMilli} * 100")
+math(EXPR thresholdScaled "${baselineMilli} * (100 - ${TOLERANCE})")
+if(measuredScaled LESS thresholdScaled)
+  message(FATAL_ERROR "Throughput ${measured} regressed more than ${TOLERANCE}% from the baseline ${baseline} in ${BASELINE}.")
+endif()
+message("Throughput ${measured}, baseline ${baseline}")